@@ -14,6 +14,12 @@ ngx_os_io_t  ngx_io;
 
 
 static void ngx_drain_connections(ngx_cycle_t *cycle);
+#if (NGX_HAVE_REUSEPORT_CBPF)
+static void ngx_attach_reuseport_cbpf(ngx_cycle_t *cycle, ngx_listening_t *ls);
+#if (NGX_QUIC)
+static void ngx_attach_quic_cbpf(ngx_cycle_t *cycle, ngx_listening_t *ls);
+#endif
+#endif
 
 
 ngx_listening_t *
@@ -861,6 +867,23 @@ ngx_configure_listening_sockets(ngx_cycle_t *cycle)
             }
         }
 
+#if (NGX_HAVE_REUSEPORT_CBPF)
+
+        /* the program is shared by all sockets of the reuseport group */
+
+#if (NGX_QUIC)
+
+        if (ls[i].quic && ls[i].reuseport && ls[i].worker == 0) {
+            ngx_attach_quic_cbpf(cycle, &ls[i]);
+
+        } else
+#endif
+        if (ls[i].reuseport_cpu && ls[i].worker == 0) {
+            ngx_attach_reuseport_cbpf(cycle, &ls[i]);
+        }
+
+#endif
+
         /*
          * setting deferred mode should be last operation on socket,
          * because code may prematurely continue cycle on failure
@@ -1010,6 +1033,26 @@ ngx_configure_listening_sockets(ngx_cycle_t *cycle)
             }
         }
 
+#endif
+
+#if (NGX_HAVE_UDP_GRO)
+
+        if (ls[i].type == SOCK_DGRAM
+            && (ls[i].sockaddr->sa_family == AF_INET
+                || ls[i].sockaddr->sa_family == AF_INET6))
+        {
+            value = 1;
+
+            if (setsockopt(ls[i].fd, SOL_UDP, UDP_GRO,
+                           (const void *) &value, sizeof(int))
+                == -1)
+            {
+                ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_socket_errno,
+                              "setsockopt(UDP_GRO) for %V failed, ignored",
+                              &ls[i].addr_text);
+            }
+        }
+
 #endif
     }
 
@@ -1017,6 +1060,153 @@ ngx_configure_listening_sockets(ngx_cycle_t *cycle)
 }
 
 
+#if (NGX_HAVE_REUSEPORT_CBPF)
+
+/*
+ * the program returns an index of the socket in the reuseport group,
+ * the sockets are added to the group in the order of the worker numbers;
+ * the kernel falls back to the hash if the index is out of the group
+ */
+
+static void
+ngx_attach_reuseport_cbpf(ngx_cycle_t *cycle, ngx_listening_t *ls)
+{
+    ngx_uint_t           n, cpu;
+    ngx_core_conf_t     *ccf;
+    struct sock_fprog    prog;
+    struct sock_filter  *code, *f;
+#if (NGX_HAVE_CPU_AFFINITY)
+    ngx_cpuset_t        *mask;
+    u_char               worker[CPU_SETSIZE];
+#endif
+
+    ccf = (ngx_core_conf_t *) ngx_get_conf(cycle->conf_ctx, ngx_core_module);
+
+    code = ngx_alloc((CPU_SETSIZE * 2 + 3) * sizeof(struct sock_filter),
+                     cycle->log);
+    if (code == NULL) {
+        return;
+    }
+
+    f = code;
+
+    *f++ = (struct sock_filter)
+               BPF_STMT(BPF_LD|BPF_W|BPF_ABS, SKF_AD_OFF + SKF_AD_CPU);
+
+#if (NGX_HAVE_CPU_AFFINITY)
+
+    if (ccf->cpu_affinity) {
+
+        /* a CPU is steered to the first worker bound to it */
+
+        ngx_memset(worker, 0xff, CPU_SETSIZE);
+
+        for (n = (ngx_uint_t) ccf->worker_processes; n-- > 0; /* void */) {
+
+            mask = ngx_get_cpu_affinity(cycle, n);
+            if (mask == NULL) {
+                continue;
+            }
+
+            for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+                if (CPU_ISSET(cpu, mask) && n < 0xff) {
+                    worker[cpu] = (u_char) n;
+                }
+            }
+        }
+
+        for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (worker[cpu] == 0xff) {
+                continue;
+            }
+
+            *f++ = (struct sock_filter)
+                       BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, cpu, 0, 1);
+            *f++ = (struct sock_filter) BPF_STMT(BPF_RET|BPF_K, worker[cpu]);
+        }
+
+        *f++ = (struct sock_filter) BPF_STMT(BPF_RET|BPF_K, 0xffffffff);
+
+    } else
+
+#endif
+    {
+        /* no affinity, each CPU is still served by the same worker */
+
+        *f++ = (struct sock_filter)
+                   BPF_STMT(BPF_ALU|BPF_MOD|BPF_K, ccf->worker_processes);
+        *f++ = (struct sock_filter) BPF_STMT(BPF_RET|BPF_A, 0);
+    }
+
+    prog.len = (unsigned short) (f - code);
+    prog.filter = code;
+
+    if (setsockopt(ls->fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF,
+                   &prog, sizeof(struct sock_fprog))
+        == -1)
+    {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_socket_errno,
+                      "setsockopt(SO_ATTACH_REUSEPORT_CBPF) %V failed, "
+                      "ignored", &ls->addr_text);
+
+    } else {
+        ngx_log_debug2(NGX_LOG_DEBUG_CORE, cycle->log, 0,
+                       "reuseport cpu steering for %V: %ui instructions",
+                       &ls->addr_text, (ngx_uint_t) prog.len);
+    }
+
+    ngx_free(code);
+}
+
+
+#if (NGX_QUIC)
+
+/*
+ * QUIC datagrams are steered by the first byte of the destination
+ * connection id, server connection ids are generated so that the byte
+ * modulo the number of workers is the number of the owning worker;
+ * client chosen ids of the first Initial packets are steered the same way
+ */
+
+static void
+ngx_attach_quic_cbpf(ngx_cycle_t *cycle, ngx_listening_t *ls)
+{
+    ngx_core_conf_t     *ccf;
+    struct sock_fprog    prog;
+    struct sock_filter   code[] = {
+        /* A = first byte of the packet */
+        BPF_STMT(BPF_LD|BPF_B|BPF_ABS, 0),
+        /* long header: the id starts at offset 6, short header: at 1 */
+        BPF_JUMP(BPF_JMP|BPF_JSET|BPF_K, 0x80, 0, 2),
+        BPF_STMT(BPF_LD|BPF_B|BPF_ABS, 6),
+        BPF_JUMP(BPF_JMP|BPF_JA, 1, 0, 0),
+        BPF_STMT(BPF_LD|BPF_B|BPF_ABS, 1),
+        BPF_STMT(BPF_ALU|BPF_MOD|BPF_K, 1),
+        BPF_STMT(BPF_RET|BPF_A, 0)
+    };
+
+    ccf = (ngx_core_conf_t *) ngx_get_conf(cycle->conf_ctx, ngx_core_module);
+
+    code[5].k = ccf->worker_processes;
+
+    prog.len = sizeof(code) / sizeof(struct sock_filter);
+    prog.filter = code;
+
+    if (setsockopt(ls->fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF,
+                   &prog, sizeof(struct sock_fprog))
+        == -1)
+    {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_socket_errno,
+                      "setsockopt(SO_ATTACH_REUSEPORT_CBPF) %V failed, "
+                      "ignored", &ls->addr_text);
+    }
+}
+
+#endif
+
+#endif
+
+
 void
 ngx_close_listening_sockets(ngx_cycle_t *cycle)
 {
@@ -1034,6 +1224,16 @@ ngx_close_listening_sockets(ngx_cycle_t *cycle)
     ls = cycle->listening.elts;
     for (i = 0; i < cycle->listening.nelts; i++) {
 
+#if (NGX_QUIC)
+
+        /* the datagrams of the existing connections are still handled */
+
+        if (ls[i].quic) {
+            continue;
+        }
+
+#endif
+
         c = ls[i].connection;
 
         if (c) {
@@ -75,6 +75,8 @@ struct ngx_listening_s {
 #endif
     unsigned            reuseport:1;
     unsigned            add_reuseport:1;
+    unsigned            reuseport_cpu:1;
+    unsigned            quic:1;
     unsigned            keepalive:2;
 
     unsigned            deferred_accept:1;
@@ -157,6 +159,10 @@ struct ngx_connection_s {
 
     ngx_udp_connection_t  *udp;
 
+#if (NGX_QUIC || NGX_COMPAT)
+    ngx_quic_stream_t     *quic;
+#endif
+
     struct sockaddr    *local_sockaddr;         // 本地地址
     socklen_t           local_socklen;
 
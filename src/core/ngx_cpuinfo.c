@@ -9,10 +9,14 @@
 #include <ngx_core.h>
 
 
+ngx_uint_t  ngx_cpu_features;
+
+
 #if (( __i386__ || __amd64__ ) && ( __GNUC__ || __INTEL_COMPILER ))
 
 
 static ngx_inline void ngx_cpuid(uint32_t i, uint32_t *buf);
+static void ngx_cpu_simd(uint32_t max, uint32_t *cpu);
 
 
 #if ( __i386__ )
@@ -55,7 +59,7 @@ ngx_cpuid(uint32_t i, uint32_t *buf)
 
         "cpuid"
 
-    : "=a" (eax), "=b" (ebx), "=c" (ecx), "=d" (edx) : "a" (i) );
+    : "=a" (eax), "=b" (ebx), "=c" (ecx), "=d" (edx) : "a" (i), "c" (0) );
 
     buf[0] = eax;
     buf[1] = ebx;
@@ -91,6 +95,8 @@ ngx_cpuinfo(void)
 
     ngx_cpuid(1, cpu);
 
+    ngx_cpu_simd(vbuf[0], cpu);
+
     if (ngx_strcmp(vendor, "GenuineIntel") == 0) {
 
         switch ((cpu[0] & 0xf00) >> 8) {
@@ -127,6 +133,45 @@ ngx_cpuinfo(void)
     }
 }
 
+
+static void
+ngx_cpu_simd(uint32_t max, uint32_t *cpu)
+{
+#if ( __amd64__ )
+    uint32_t  eax, edx, ext[4];
+#endif
+
+    /* SSE4.2 */
+
+    if (cpu[3] & (1 << 20)) {
+        ngx_cpu_features |= NGX_CPU_SSE42;
+    }
+
+#if ( __amd64__ )
+
+    /* AVX and OSXSAVE, the YMM state must be enabled by OS as well */
+
+    if ((cpu[3] & 0x18000000) != 0x18000000 || max < 7) {
+        return;
+    }
+
+    __asm__ ("xgetbv" : "=a" (eax), "=d" (edx) : "c" (0));
+
+    if ((eax & 0x6) != 0x6) {
+        return;
+    }
+
+    ngx_cpuid(7, ext);
+
+    /* AVX2 */
+
+    if (ext[1] & (1 << 5)) {
+        ngx_cpu_features |= NGX_CPU_AVX2;
+    }
+
+#endif
+}
+
 #else
 
 
@@ -16,15 +16,64 @@ static void *ngx_palloc_block(ngx_pool_t *pool, size_t size);
 // 大块内存分配，即在pool->large分配
 static void *ngx_palloc_large(ngx_pool_t *pool, size_t size);
 
+static ngx_int_t ngx_pool_cache_index(size_t size);
+static void *ngx_pool_cache_alloc(ngx_uint_t n, ngx_log_t *log);
+static void ngx_pool_cache_free(ngx_uint_t n, void *p);
+static void ngx_pool_free_block(ngx_pool_t *p);
+static void ngx_pool_free_large(ngx_pool_large_t *l);
+
+
+/*
+ * Per-worker cache of pool blocks and large allocations.  Freed chunks
+ * are kept on free lists of size classes up to the "max" bytes in total
+ * and are handed out again instead of calling malloc().  Pool blocks are
+ * cached only if their size matches a class exactly, large allocations
+ * are rounded up to the class size.  The free lists are not locked: other
+ * threads bypass the cache and use malloc() and free() directly, which is
+ * safe as cached chunks are ordinary aligned allocations.
+ */
+
+typedef struct ngx_pool_cache_chunk_s  ngx_pool_cache_chunk_t;
+
+struct ngx_pool_cache_chunk_s {
+    ngx_pool_cache_chunk_t  *next;
+};
+
+
+static ngx_pool_cache_stats_t   ngx_pool_cache;
+static ngx_pool_cache_chunk_t  *ngx_pool_cache_chunks[NGX_POOL_CACHE_CLASSES];
+
+#if (NGX_THREADS)
+
+static pthread_t                ngx_pool_cache_owner;
+
+#define ngx_pool_cache_enabled()                                              \
+    (ngx_pool_cache.max && pthread_equal(pthread_self(), ngx_pool_cache_owner))
+
+#else
+
+#define ngx_pool_cache_enabled()  ngx_pool_cache.max
+
+#endif
+
 
 // 分配内存并初始化成员变量
 ngx_pool_t *
 ngx_create_pool(size_t size, ngx_log_t *log)
 {
+    ngx_int_t    n;
     ngx_pool_t  *p;
 
-    // 等价 malloc(size)
-    p = ngx_memalign(NGX_POOL_ALIGNMENT, size, log);
+    n = ngx_pool_cache_enabled() ? ngx_pool_cache_index(size) : NGX_ERROR;
+
+    if (n != NGX_ERROR && ngx_pool_cache.classes[n].size == size) {
+        p = ngx_pool_cache_alloc(n, log);
+
+    } else {
+        // 等价 malloc(size)
+        p = ngx_memalign(NGX_POOL_ALIGNMENT, size, log);
+    }
+
     if (p == NULL) {
         return NULL;
     }
@@ -91,13 +140,13 @@ ngx_destroy_pool(ngx_pool_t *pool)
     // 释放large链
     for (l = pool->large; l; l = l->next) {
         if (l->alloc) {
-            ngx_free(l->alloc);
+            ngx_pool_free_large(l);
         }
     }
 
     // 释放pool链
     for (p = pool, n = pool->d.next; /* void */; p = n, n = n->d.next) {
-        ngx_free(p);
+        ngx_pool_free_block(p);
 
         if (n == NULL) {
             break;
@@ -117,7 +166,7 @@ ngx_reset_pool(ngx_pool_t *pool)
     // 释放large链
     for (l = pool->large; l; l = l->next) {
         if (l->alloc) {
-            ngx_free(l->alloc);                 // dout ngx_pool_large结构未被释放？若ngx_pool_large在pool->data中分配，则是在同一的pool->data上分配还是不同？
+            ngx_pool_free_large(l);             // dout ngx_pool_large结构未被释放？若ngx_pool_large在pool->data中分配，则是在同一的pool->data上分配还是不同？
         }
     }
 
@@ -199,13 +248,22 @@ ngx_palloc_block(ngx_pool_t *pool, size_t size)
 {
     u_char      *m;
     size_t       psize;
+    ngx_int_t    n;
     ngx_pool_t  *p, *new;
 
     // 计算一个新的pool->data内存大小
     psize = (size_t) (pool->d.end - (u_char *) pool);
 
-    // 申请分配内存
-    m = ngx_memalign(NGX_POOL_ALIGNMENT, psize, pool->log);
+    n = ngx_pool_cache_enabled() ? ngx_pool_cache_index(psize) : NGX_ERROR;
+
+    if (n != NGX_ERROR && ngx_pool_cache.classes[n].size == psize) {
+        m = ngx_pool_cache_alloc(n, pool->log);
+
+    } else {
+        // 申请分配内存
+        m = ngx_memalign(NGX_POOL_ALIGNMENT, psize, pool->log);
+    }
+
     if (m == NULL) {
         return NULL;
     }
@@ -238,11 +296,23 @@ static void *
 ngx_palloc_large(ngx_pool_t *pool, size_t size)
 {
     void              *p;
+    size_t             csize;
+    ngx_int_t          c;
     ngx_uint_t         n;
     ngx_pool_large_t  *large;
 
-    // 直接申请一个新的内存 malloc(size)
-    p = ngx_alloc(size, pool->log);
+    c = ngx_pool_cache_enabled() ? ngx_pool_cache_index(size) : NGX_ERROR;
+
+    if (c != NGX_ERROR) {
+        csize = ngx_pool_cache.classes[c].size;
+        p = ngx_pool_cache_alloc(c, pool->log);
+
+    } else {
+        csize = 0;
+        // 直接申请一个新的内存 malloc(size)
+        p = ngx_alloc(size, pool->log);
+    }
+
     if (p == NULL) {
         return NULL;
     }
@@ -254,6 +324,7 @@ ngx_palloc_large(ngx_pool_t *pool, size_t size)
         // 挂载到链表中空的内存页
         if (large->alloc == NULL) {
             large->alloc = p;
+            large->size = csize;
             return p;
         }
 
@@ -266,12 +337,19 @@ ngx_palloc_large(ngx_pool_t *pool, size_t size)
     // 遍历超过3次后新建一个新large节点
     large = ngx_palloc_small(pool, sizeof(ngx_pool_large_t), 1);
     if (large == NULL) {
-        ngx_free(p);
+        if (csize) {
+            ngx_pool_cache_free(c, p);
+
+        } else {
+            ngx_free(p);
+        }
+
         return NULL;
     }
 
     // 头插法
     large->alloc = p;
+    large->size = csize;
     large->next = pool->large;
     pool->large = large;
 
@@ -299,6 +377,7 @@ ngx_pmemalign(ngx_pool_t *pool, size_t size, size_t alignment)
     }
 
     large->alloc = p;
+    large->size = 0;
     large->next = pool->large;
     pool->large = large;
 
@@ -316,7 +395,7 @@ ngx_pfree(ngx_pool_t *pool, void *p)
         if (p == l->alloc) {
             ngx_log_debug1(NGX_LOG_DEBUG_ALLOC, pool->log, 0,
                            "free: %p", l->alloc);
-            ngx_free(l->alloc);
+            ngx_pool_free_large(l);
             l->alloc = NULL;
 
             return NGX_OK;
@@ -438,30 +517,149 @@ ngx_pool_delete_file(void *data)
 }
 
 
-#if 0
+void
+ngx_pool_cache_init(size_t max)
+{
+    ngx_uint_t  n, shift;
+
+#if (NGX_DEBUG_PALLOC)
+    max = 0;
+#endif
+
+    ngx_memzero(&ngx_pool_cache, sizeof(ngx_pool_cache_stats_t));
+
+    ngx_pool_cache.classes[0].size = (size_t) 1 << NGX_POOL_CACHE_MIN_SHIFT;
+
+    for (n = 1; n < NGX_POOL_CACHE_CLASSES; n++) {
+        shift = NGX_POOL_CACHE_MIN_SHIFT + (n - 1) / 4;
+        ngx_pool_cache.classes[n].size = (size_t) (5 + (n - 1) % 4)
+                                         << (shift - 2);
+    }
+
+#if (NGX_THREADS)
+    ngx_pool_cache_owner = pthread_self();
+#endif
+
+    ngx_pool_cache.max = max;
+}
+
+
+ngx_pool_cache_stats_t *
+ngx_pool_cache_stats(void)
+{
+    return &ngx_pool_cache;
+}
+
+
+static ngx_int_t
+ngx_pool_cache_index(size_t size)
+{
+    size_t      n;
+    ngx_uint_t  shift;
+
+    if (size <= (size_t) 1 << NGX_POOL_CACHE_MIN_SHIFT) {
+        return 0;
+    }
+
+    if (size > (size_t) 1 << NGX_POOL_CACHE_MAX_SHIFT) {
+        return NGX_ERROR;
+    }
+
+    n = size - 1;
+
+    for (shift = NGX_POOL_CACHE_MIN_SHIFT; n >> (shift + 1); shift++) {
+        /* void */
+    }
+
+    return (shift - NGX_POOL_CACHE_MIN_SHIFT) * 4 + ((n >> (shift - 2)) & 3)
+           + 1;
+}
+
 
 static void *
-ngx_get_cached_block(size_t size)
+ngx_pool_cache_alloc(ngx_uint_t n, ngx_log_t *log)
 {
-    void                     *p;
-    ngx_cached_block_slot_t  *slot;
+    ngx_pool_cache_chunk_t  *chunk;
+    ngx_pool_cache_class_t  *pc;
 
-    if (ngx_cycle->cache == NULL) {
-        return NULL;
+    pc = &ngx_pool_cache.classes[n];
+    chunk = ngx_pool_cache_chunks[n];
+
+    if (chunk) {
+        ngx_pool_cache_chunks[n] = chunk->next;
+
+        pc->cached--;
+        pc->hits++;
+        ngx_pool_cache.size -= pc->size;
+
+        return chunk;
+    }
+
+    pc->misses++;
+
+    return ngx_memalign(NGX_POOL_ALIGNMENT, pc->size, log);
+}
+
+
+static void
+ngx_pool_cache_free(ngx_uint_t n, void *p)
+{
+    ngx_pool_cache_chunk_t  *chunk;
+    ngx_pool_cache_class_t  *pc;
+
+    if (!ngx_pool_cache_enabled()) {
+        ngx_free(p);
+        return;
+    }
+
+    pc = &ngx_pool_cache.classes[n];
+
+    if (ngx_pool_cache.size + pc->size > ngx_pool_cache.max) {
+        pc->releases++;
+        ngx_free(p);
+        return;
     }
 
-    slot = &ngx_cycle->cache[(size + ngx_pagesize - 1) / ngx_pagesize];
+    chunk = p;
+    chunk->next = ngx_pool_cache_chunks[n];
+    ngx_pool_cache_chunks[n] = chunk;
+
+    pc->cached++;
+    ngx_pool_cache.size += pc->size;
+}
+
 
-    slot->tries++;
+static void
+ngx_pool_free_block(ngx_pool_t *p)
+{
+    size_t     size;
+    ngx_int_t  n;
+
+    size = (size_t) (p->d.end - (u_char *) p);
+
+    /*
+     * blocks allocated before the cache was enabled are still
+     * of the exact size and aligned, so they can be cached as well
+     */
+
+    n = ngx_pool_cache_enabled() ? ngx_pool_cache_index(size) : NGX_ERROR;
 
-    if (slot->number) {
-        p = slot->block;
-        slot->block = slot->block->next;
-        slot->number--;
-        return p;
+    if (n != NGX_ERROR && ngx_pool_cache.classes[n].size == size) {
+        ngx_pool_cache_free(n, p);
+        return;
     }
 
-    return NULL;
+    ngx_free(p);
 }
 
-#endif
+
+static void
+ngx_pool_free_large(ngx_pool_large_t *l)
+{
+    if (l->size) {
+        ngx_pool_cache_free(ngx_pool_cache_index(l->size), l->alloc);
+        return;
+    }
+
+    ngx_free(l->alloc);
+}
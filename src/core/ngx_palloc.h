@@ -26,6 +26,15 @@
     ngx_align((sizeof(ngx_pool_t) + 2 * sizeof(ngx_pool_large_t)),            \
               NGX_POOL_ALIGNMENT)
 
+/*
+ * size classes of the block cache: 128 bytes, then four classes
+ * per power of two up to 64K, so that rounding wastes at most 25%
+ */
+#define NGX_POOL_CACHE_MIN_SHIFT 7
+#define NGX_POOL_CACHE_MAX_SHIFT 16
+#define NGX_POOL_CACHE_CLASSES                                                \
+    (4 * (NGX_POOL_CACHE_MAX_SHIFT - NGX_POOL_CACHE_MIN_SHIFT) + 1)
+
 
 typedef void (*ngx_pool_cleanup_pt)(void *data);
 
@@ -43,6 +52,7 @@ typedef struct ngx_pool_large_s  ngx_pool_large_t;
 struct ngx_pool_large_s {
     ngx_pool_large_t     *next;     // 下一数据块
     void                 *alloc;    // 数据块指针
+    size_t                size;     /* size class if taken from the cache */
 };
 
 
@@ -65,6 +75,22 @@ struct ngx_pool_s {
 };
 
 
+typedef struct {
+    size_t                size;         /* chunk size of the class */
+    ngx_uint_t            cached;       /* chunks kept for reuse */
+    ngx_uint_t            hits;
+    ngx_uint_t            misses;
+    ngx_uint_t            releases;     /* freed as the cache was full */
+} ngx_pool_cache_class_t;
+
+
+typedef struct {
+    size_t                size;         /* bytes kept in the cache */
+    size_t                max;
+    ngx_pool_cache_class_t  classes[NGX_POOL_CACHE_CLASSES];
+} ngx_pool_cache_stats_t;
+
+
 typedef struct {
     ngx_fd_t              fd;
     u_char               *name;
@@ -90,6 +116,9 @@ void *ngx_pmemalign(ngx_pool_t *pool, size_t size, size_t alignment);
 // 释放large内存
 ngx_int_t ngx_pfree(ngx_pool_t *pool, void *p);
 
+void ngx_pool_cache_init(size_t max);
+ngx_pool_cache_stats_t *ngx_pool_cache_stats(void);
+
 
 // --- Nginx cleanup机制 ---
 
@@ -17,23 +17,40 @@ typedef struct {
 } ngx_thread_pool_conf_t;
 
 
-// 任务队列头节点
+/*
+ * Bounded MPMC ring of tasks after D. Vyukov: each cell carries a sequence
+ * number telling producers and consumers whether it is free or filled in
+ * the current lap, so neither side takes a lock.  The positions are kept
+ * on separate cache lines.
+ */
+
 typedef struct {
-    ngx_thread_task_t        *first;
-    ngx_thread_task_t       **last;         // ??? 为什么要用二维指针?
-} ngx_thread_pool_queue_t;
+    ngx_atomic_t              sequence;
+    ngx_thread_task_t        *task;
+} ngx_thread_pool_cell_t;
 
-#define ngx_thread_pool_queue_init(q)                                         \
-    (q)->first = NULL;                                                        \
-    (q)->last = &(q)->first     // ??? -> 比 & 优先级高？
+
+typedef struct {
+    ngx_thread_pool_cell_t   *cells;
+    ngx_atomic_uint_t         mask;
+    u_char                    pad0[NGX_CPU_CACHE_LINE];
+    ngx_atomic_t              enqueue;
+    u_char                    pad1[NGX_CPU_CACHE_LINE];
+    ngx_atomic_t              dequeue;
+    u_char                    pad2[NGX_CPU_CACHE_LINE];
+} ngx_thread_pool_queue_t;
 
 
 // 线程池
 struct ngx_thread_pool_s {
-    ngx_thread_mutex_t        mtx;
     ngx_thread_pool_queue_t   queue;
-    ngx_int_t                 waiting;
+
+    /* idle threads sleep on the condition only when the queue is empty */
+    ngx_thread_mutex_t        mtx;
     ngx_thread_cond_t         cond;
+    ngx_atomic_t              sleeping;
+
+    ngx_thread_pool_stats_t   stats;
 
     ngx_log_t                *log;
 
@@ -51,6 +68,13 @@ struct ngx_thread_pool_s {
 // 初始化线程池
 static ngx_int_t ngx_thread_pool_init(ngx_thread_pool_t *tp, ngx_log_t *log,
     ngx_pool_t *pool);
+static ngx_int_t ngx_thread_pool_queue_push(ngx_thread_pool_queue_t *q,
+    ngx_thread_task_t *task);
+static ngx_thread_task_t *ngx_thread_pool_queue_pop(
+    ngx_thread_pool_queue_t *q);
+static ngx_thread_task_t *ngx_thread_pool_wait(ngx_thread_pool_t *tp);
+static ngx_uint_t ngx_thread_pool_hist_bucket(uint64_t usec);
+static uint64_t ngx_thread_pool_usec(void);
 // 销毁线程池
 static void ngx_thread_pool_destroy(ngx_thread_pool_t *tp);
 // callback 从线程池中移除任务
@@ -107,8 +131,13 @@ ngx_module_t  ngx_thread_pool_module = {
 static ngx_str_t  ngx_thread_pool_default = ngx_string("default");
 
 static ngx_uint_t               ngx_thread_pool_task_id;
-static ngx_atomic_t             ngx_thread_pool_done_lock;
-static ngx_thread_pool_queue_t  ngx_thread_pool_done;
+
+/*
+ * completed tasks are pushed by pool threads onto a lock-free list which
+ * the event loop takes over as a whole; only the push that finds the list
+ * empty notifies the event loop
+ */
+static ngx_atomic_t             ngx_thread_pool_done;
 
 
 static ngx_int_t
@@ -116,7 +145,7 @@ ngx_thread_pool_init(ngx_thread_pool_t *tp, ngx_log_t *log, ngx_pool_t *pool)
 {
     int             err;
     pthread_t       tid;
-    ngx_uint_t      n;
+    ngx_uint_t      n, size;
     pthread_attr_t  attr;
 
     if (ngx_notify == NULL) {
@@ -125,7 +154,28 @@ ngx_thread_pool_init(ngx_thread_pool_t *tp, ngx_log_t *log, ngx_pool_t *pool)
         return NGX_ERROR;
     }
 
-    ngx_thread_pool_queue_init(&tp->queue);
+    size = 1;
+
+    while (size < (ngx_uint_t) tp->max_queue) {
+        size <<= 1;
+    }
+
+    tp->queue.cells = ngx_palloc(pool, size * sizeof(ngx_thread_pool_cell_t));
+    if (tp->queue.cells == NULL) {
+        return NGX_ERROR;
+    }
+
+    for (n = 0; n < size; n++) {
+        tp->queue.cells[n].sequence = n;
+        tp->queue.cells[n].task = NULL;
+    }
+
+    tp->queue.mask = size - 1;
+    tp->queue.enqueue = 0;
+    tp->queue.dequeue = 0;
+
+    tp->sleeping = 0;
+    ngx_memzero(&tp->stats, sizeof(ngx_thread_pool_stats_t));
 
     if (ngx_thread_mutex_create(&tp->mtx, log) != NGX_OK) {
         return NGX_ERROR;
@@ -238,41 +288,65 @@ ngx_thread_task_alloc(ngx_pool_t *pool, size_t size)
 ngx_int_t
 ngx_thread_task_post(ngx_thread_pool_t *tp, ngx_thread_task_t *task)
 {
+    ngx_atomic_uint_t  queued;
+
     if (task->event.active) {
         ngx_log_error(NGX_LOG_ALERT, tp->log, 0,
                       "task #%ui already active", task->id);
         return NGX_ERROR;
     }
 
-    if (ngx_thread_mutex_lock(&tp->mtx, tp->log) != NGX_OK) {
-        return NGX_ERROR;
-    }
+    task->event.active = 1;
 
-    if (tp->waiting >= tp->max_queue) {
-        (void) ngx_thread_mutex_unlock(&tp->mtx, tp->log);
+    task->id = ngx_thread_pool_task_id++;
+    task->next = NULL;
+    task->pool = tp;
+    task->posted = ngx_thread_pool_usec();
+
+    queued = tp->queue.enqueue - tp->queue.dequeue;
+
+    if (queued >= (ngx_atomic_uint_t) tp->max_queue
+        || ngx_thread_pool_queue_push(&tp->queue, task) != NGX_OK)
+    {
+        tp->stats.overflows++;
 
         ngx_log_error(NGX_LOG_ERR, tp->log, 0,
-                      "thread pool \"%V\" queue overflow: %i tasks waiting",
-                      &tp->name, tp->waiting);
+                      "thread pool \"%V\" queue overflow: %uA tasks waiting",
+                      &tp->name, queued);
         return NGX_ERROR;
     }
 
-    task->event.active = 1;
+    /*
+     * the task is visible to threads as soon as it is pushed,
+     * so it has to be completely set up before
+     */
 
-    task->id = ngx_thread_pool_task_id++;
-    task->next = NULL;
+    queued++;
 
-    if (ngx_thread_cond_signal(&tp->cond, tp->log) != NGX_OK) {
-        (void) ngx_thread_mutex_unlock(&tp->mtx, tp->log);
-        return NGX_ERROR;
+    if (queued > tp->stats.max_queued) {
+        tp->stats.max_queued = queued;
     }
 
-    *tp->queue.last = task;
-    tp->queue.last = &task->next;
+    tp->stats.posted++;
 
-    tp->waiting++;
+    /*
+     * the locked fetch-add is a full barrier: either a thread going to sleep
+     * is already counted, or it will find the task when rechecking the queue
+     */
 
-    (void) ngx_thread_mutex_unlock(&tp->mtx, tp->log);
+    if (ngx_atomic_fetch_add(&tp->sleeping, 0) != 0) {
+
+        if (ngx_thread_mutex_lock(&tp->mtx, tp->log) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        if (ngx_thread_cond_signal(&tp->cond, tp->log) != NGX_OK) {
+            (void) ngx_thread_mutex_unlock(&tp->mtx, tp->log);
+            return NGX_ERROR;
+        }
+
+        (void) ngx_thread_mutex_unlock(&tp->mtx, tp->log);
+    }
 
     ngx_log_debug2(NGX_LOG_DEBUG_CORE, tp->log, 0,
                    "task #%ui added to thread pool \"%V\"",
@@ -289,6 +363,7 @@ ngx_thread_pool_cycle(void *data)
 
     int                 err;
     sigset_t            set;
+    ngx_atomic_uint_t   done;
     ngx_thread_task_t  *task;
 
 #if 0
@@ -312,37 +387,22 @@ ngx_thread_pool_cycle(void *data)
     }
 
     for ( ;; ) {
-        if (ngx_thread_mutex_lock(&tp->mtx, tp->log) != NGX_OK) {
-            return NULL;
-        }
+        task = ngx_thread_pool_queue_pop(&tp->queue);
 
-        /* the number may become negative */
-        tp->waiting--;
+        if (task == NULL) {
+            task = ngx_thread_pool_wait(tp);
 
-        while (tp->queue.first == NULL) {
-            if (ngx_thread_cond_wait(&tp->cond, &tp->mtx, tp->log)
-                != NGX_OK)
-            {
-                (void) ngx_thread_mutex_unlock(&tp->mtx, tp->log);
+            if (task == NULL) {
                 return NULL;
             }
         }
 
-        task = tp->queue.first;
-        tp->queue.first = task->next;
-
-        if (tp->queue.first == NULL) {
-            tp->queue.last = &tp->queue.first;
-        }
-
-        if (ngx_thread_mutex_unlock(&tp->mtx, tp->log) != NGX_OK) {
-            return NULL;
-        }
-
 #if 0
         ngx_time_update();
 #endif
 
+        task->started = ngx_thread_pool_usec();
+
         ngx_log_debug2(NGX_LOG_DEBUG_CORE, tp->log, 0,
                        "run task #%ui in thread pool \"%V\"",
                        task->id, &tp->name);
@@ -353,44 +413,179 @@ ngx_thread_pool_cycle(void *data)
                        "complete task #%ui in thread pool \"%V\"",
                        task->id, &tp->name);
 
-        task->next = NULL;
+        task->finished = ngx_thread_pool_usec();
+
+        do {
+            done = ngx_thread_pool_done;
+            task->next = (ngx_thread_task_t *) done;
+
+            ngx_memory_barrier();
+
+        } while (!ngx_atomic_cmp_set(&ngx_thread_pool_done, done,
+                                     (ngx_atomic_uint_t) task));
+
+        if (done == 0) {
+            (void) ngx_notify(ngx_thread_pool_handler);
+        }
+    }
+}
+
+
+static ngx_thread_task_t *
+ngx_thread_pool_wait(ngx_thread_pool_t *tp)
+{
+    ngx_thread_task_t  *task;
+
+    if (ngx_thread_mutex_lock(&tp->mtx, tp->log) != NGX_OK) {
+        return NULL;
+    }
+
+    (void) ngx_atomic_fetch_add(&tp->sleeping, 1);
+
+    for ( ;; ) {
+        task = ngx_thread_pool_queue_pop(&tp->queue);
+
+        if (task) {
+            break;
+        }
+
+        if (ngx_thread_cond_wait(&tp->cond, &tp->mtx, tp->log) != NGX_OK) {
+            break;
+        }
+    }
+
+    (void) ngx_atomic_fetch_add(&tp->sleeping, -1);
+
+    (void) ngx_thread_mutex_unlock(&tp->mtx, tp->log);
+
+    return task;
+}
+
+
+static ngx_int_t
+ngx_thread_pool_queue_push(ngx_thread_pool_queue_t *q,
+    ngx_thread_task_t *task)
+{
+    ngx_atomic_int_t         diff;
+    ngx_atomic_uint_t        pos, seq;
+    ngx_thread_pool_cell_t  *cell;
+
+    pos = q->enqueue;
+
+    for ( ;; ) {
+        cell = &q->cells[pos & q->mask];
+        seq = cell->sequence;
+
+        ngx_memory_barrier();
+
+        diff = (ngx_atomic_int_t) (seq - pos);
+
+        if (diff == 0) {
+            if (ngx_atomic_cmp_set(&q->enqueue, pos, pos + 1)) {
+                break;
+            }
+
+        } else if (diff < 0) {
+            /* the cell of the previous lap has not been consumed yet */
+            return NGX_DECLINED;
+        }
+
+        pos = q->enqueue;
+    }
+
+    cell->task = task;
+
+    ngx_memory_barrier();
+
+    cell->sequence = pos + 1;
+
+    return NGX_OK;
+}
+
 
-        ngx_spinlock(&ngx_thread_pool_done_lock, 1, 2048);
+static ngx_thread_task_t *
+ngx_thread_pool_queue_pop(ngx_thread_pool_queue_t *q)
+{
+    ngx_atomic_int_t         diff;
+    ngx_atomic_uint_t        pos, seq;
+    ngx_thread_task_t       *task;
+    ngx_thread_pool_cell_t  *cell;
+
+    pos = q->dequeue;
 
-        *ngx_thread_pool_done.last = task;
-        ngx_thread_pool_done.last = &task->next;
+    for ( ;; ) {
+        cell = &q->cells[pos & q->mask];
+        seq = cell->sequence;
 
         ngx_memory_barrier();
 
-        ngx_unlock(&ngx_thread_pool_done_lock);
+        diff = (ngx_atomic_int_t) (seq - (pos + 1));
+
+        if (diff == 0) {
+            if (ngx_atomic_cmp_set(&q->dequeue, pos, pos + 1)) {
+                break;
+            }
+
+        } else if (diff < 0) {
+            /* empty */
+            return NULL;
+        }
 
-        (void) ngx_notify(ngx_thread_pool_handler);
+        pos = q->dequeue;
     }
+
+    task = cell->task;
+
+    ngx_memory_barrier();
+
+    cell->sequence = pos + q->mask + 1;
+
+    return task;
 }
 
 
 static void
 ngx_thread_pool_handler(ngx_event_t *ev)
 {
-    ngx_event_t        *event;
-    ngx_thread_task_t  *task;
+    ngx_event_t              *event;
+    ngx_atomic_uint_t         done;
+    ngx_thread_task_t        *task, *next;
+    ngx_thread_pool_stats_t  *stats;
 
     ngx_log_debug0(NGX_LOG_DEBUG_CORE, ev->log, 0, "thread pool handler");
 
-    ngx_spinlock(&ngx_thread_pool_done_lock, 1, 2048);
+    do {
+        done = ngx_thread_pool_done;
 
-    task = ngx_thread_pool_done.first;
-    ngx_thread_pool_done.first = NULL;
-    ngx_thread_pool_done.last = &ngx_thread_pool_done.first;
+    } while (done && !ngx_atomic_cmp_set(&ngx_thread_pool_done, done, 0));
 
     ngx_memory_barrier();
 
-    ngx_unlock(&ngx_thread_pool_done_lock);
+    /* the list is LIFO, reverse it to complete tasks in order */
+
+    task = NULL;
+
+    while (done) {
+        next = ((ngx_thread_task_t *) done)->next;
+        ((ngx_thread_task_t *) done)->next = task;
+        task = (ngx_thread_task_t *) done;
+        done = (ngx_atomic_uint_t) next;
+    }
 
     while (task) {
         ngx_log_debug1(NGX_LOG_DEBUG_CORE, ev->log, 0,
                        "run completion handler for task #%ui", task->id);
 
+        stats = &task->pool->stats;
+
+        stats->completed++;
+        stats->wait_sum += task->started - task->posted;
+        stats->latency_sum += task->finished - task->started;
+        stats->wait[ngx_thread_pool_hist_bucket(task->started
+                                                - task->posted)]++;
+        stats->latency[ngx_thread_pool_hist_bucket(task->finished
+                                                   - task->started)]++;
+
         event = &task->event;
         task = task->next;
 
@@ -402,6 +597,60 @@ ngx_thread_pool_handler(ngx_event_t *ev)
 }
 
 
+static ngx_uint_t
+ngx_thread_pool_hist_bucket(uint64_t usec)
+{
+    ngx_uint_t  n;
+
+    n = 0;
+
+    while (usec > 1 && n < NGX_THREAD_POOL_HIST_LEN - 1) {
+        usec >>= 1;
+        n++;
+    }
+
+    return n;
+}
+
+
+static uint64_t
+ngx_thread_pool_usec(void)
+{
+#if (NGX_HAVE_CLOCK_MONOTONIC)
+    struct timespec  ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#else
+    struct timeval   tv;
+
+    ngx_gettimeofday(&tv);
+
+    return (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
+}
+
+
+ngx_str_t *
+ngx_thread_pool_name(ngx_thread_pool_t *tp)
+{
+    return &tp->name;
+}
+
+
+void
+ngx_thread_pool_get_stats(ngx_thread_pool_t *tp,
+    ngx_thread_pool_stats_t *stats)
+{
+    *stats = tp->stats;
+
+    if (tp->queue.cells) {
+        stats->queued = tp->queue.enqueue - tp->queue.dequeue;
+    }
+}
+
+
 static void *
 ngx_thread_pool_create_conf(ngx_cycle_t *cycle)
 {
@@ -587,6 +836,25 @@ ngx_thread_pool_get(ngx_cycle_t *cycle, ngx_str_t *name)
 }
 
 
+ngx_thread_pool_t *
+ngx_thread_pool_get_indexed(ngx_cycle_t *cycle, ngx_uint_t n)
+{
+    ngx_thread_pool_t       **tpp;
+    ngx_thread_pool_conf_t   *tcf;
+
+    tcf = (ngx_thread_pool_conf_t *) ngx_get_conf(cycle->conf_ctx,
+                                                  ngx_thread_pool_module);
+
+    if (n >= tcf->pools.nelts) {
+        return NULL;
+    }
+
+    tpp = tcf->pools.elts;
+
+    return tpp[n];
+}
+
+
 static ngx_int_t
 ngx_thread_pool_init_worker(ngx_cycle_t *cycle)
 {
@@ -607,7 +875,7 @@ ngx_thread_pool_init_worker(ngx_cycle_t *cycle)
         return NGX_OK;
     }
 
-    ngx_thread_pool_queue_init(&ngx_thread_pool_done);
+    ngx_thread_pool_done = 0;
 
     tpp = tcf->pools.elts;
 
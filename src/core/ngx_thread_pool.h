@@ -14,6 +14,12 @@
 #include <ngx_event.h>
 
 
+#define NGX_THREAD_POOL_HIST_LEN  20
+
+
+typedef struct ngx_thread_pool_s  ngx_thread_pool_t;
+
+
 // 线程池任务队列
 struct ngx_thread_task_s {
     ngx_thread_task_t   *next;                  // 链表next
@@ -21,17 +27,43 @@ struct ngx_thread_task_s {
     void                *ctx;                   // 上下文（任务数据、设置等）
     void               (*handler)(void *data, ngx_log_t *log);  // 回调函数
     ngx_event_t          event;                 // 关联事件
+
+    ngx_thread_pool_t   *pool;
+    uint64_t             posted;                /* usec */
+    uint64_t             started;
+    uint64_t             finished;
 };
 
 
-typedef struct ngx_thread_pool_s  ngx_thread_pool_t;
+/*
+ * per-worker counters, histograms are log2 buckets of microseconds:
+ * bucket n counts samples in [2^n, 2^(n+1)), the last one is open-ended
+ */
+
+typedef struct {
+    ngx_uint_t           queued;
+    ngx_uint_t           max_queued;
+    ngx_uint_t           posted;
+    ngx_uint_t           completed;
+    ngx_uint_t           overflows;
+    uint64_t             wait_sum;              /* usec */
+    uint64_t             latency_sum;
+    ngx_uint_t           wait[NGX_THREAD_POOL_HIST_LEN];
+    ngx_uint_t           latency[NGX_THREAD_POOL_HIST_LEN];
+} ngx_thread_pool_stats_t;
 
 
 ngx_thread_pool_t *ngx_thread_pool_add(ngx_conf_t *cf, ngx_str_t *name);
 ngx_thread_pool_t *ngx_thread_pool_get(ngx_cycle_t *cycle, ngx_str_t *name);
+ngx_thread_pool_t *ngx_thread_pool_get_indexed(ngx_cycle_t *cycle,
+    ngx_uint_t n);
 
 ngx_thread_task_t *ngx_thread_task_alloc(ngx_pool_t *pool, size_t size);
 ngx_int_t ngx_thread_task_post(ngx_thread_pool_t *tp, ngx_thread_task_t *task);
 
+ngx_str_t *ngx_thread_pool_name(ngx_thread_pool_t *tp);
+void ngx_thread_pool_get_stats(ngx_thread_pool_t *tp,
+    ngx_thread_pool_stats_t *stats);
+
 
 #endif /* _NGX_THREAD_POOL_H_INCLUDED_ */
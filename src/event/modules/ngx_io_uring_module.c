@@ -0,0 +1,1102 @@
+/*
+ * Copyright (C) Igor Sysoev
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+
+
+/*
+ * The ring is used as a readiness notification mechanism: each active event
+ * is a multishot IORING_OP_POLL_ADD request that keeps posting completions
+ * on every wakeup, which gives the same semantics as EPOLLET.  All changes
+ * are queued as submission entries and passed to the kernel in the same
+ * io_uring_enter() call that waits for completions, so adding and deleting
+ * events costs no syscalls at all.
+ *
+ * The user_data of a request is a connection pointer with the instance bit
+ * in bit 0 and the request type in bits 1-2, for file reads it is a pointer
+ * to the aio event.
+ */
+
+#define NGX_IO_URING_READ         0
+#define NGX_IO_URING_WRITE        2
+#define NGX_IO_URING_AIO          4
+#define NGX_IO_URING_TYPE         6
+#define NGX_IO_URING_MASK         7
+
+#define NGX_IO_URING_IGNORE       0
+#define NGX_IO_URING_TEST         1
+
+#define NGX_IO_URING_FEATURES                                                 \
+    (IORING_FEAT_SINGLE_MMAP|IORING_FEAT_NODROP|IORING_FEAT_EXT_ARG)
+
+
+typedef struct {
+    ngx_uint_t             entries;
+} ngx_io_uring_conf_t;
+
+
+typedef struct {
+    volatile uint32_t     *sq_head;
+    volatile uint32_t     *sq_tail;
+    uint32_t               sq_mask;
+    uint32_t               sq_entries;
+    uint32_t               sq_local_tail;
+    struct io_uring_sqe   *sqes;
+
+    volatile uint32_t     *cq_head;
+    volatile uint32_t     *cq_tail;
+    uint32_t               cq_mask;
+    struct io_uring_cqe   *cqes;
+
+    void                  *rings;
+    size_t                 rings_size;
+    size_t                 sqes_size;
+} ngx_io_uring_t;
+
+
+static ngx_int_t ngx_io_uring_init(ngx_cycle_t *cycle, ngx_msec_t timer);
+static ngx_int_t ngx_io_uring_create(ngx_cycle_t *cycle,
+    ngx_io_uring_conf_t *urcf);
+static ngx_int_t ngx_io_uring_probe(ngx_cycle_t *cycle);
+static ngx_int_t ngx_io_uring_test_multishot(ngx_cycle_t *cycle);
+static void ngx_io_uring_free(void);
+#if (NGX_HAVE_EVENTFD)
+static ngx_int_t ngx_io_uring_notify_init(ngx_log_t *log);
+static void ngx_io_uring_notify_handler(ngx_event_t *ev);
+#endif
+static void ngx_io_uring_done(ngx_cycle_t *cycle);
+static struct io_uring_sqe *ngx_io_uring_get_sqe(ngx_log_t *log);
+static uint32_t ngx_io_uring_poll_events(uint32_t events);
+static ngx_int_t ngx_io_uring_flush(ngx_log_t *log);
+static ngx_int_t ngx_io_uring_poll_add(ngx_connection_t *c, ngx_uint_t type,
+    ngx_uint_t instance, ngx_log_t *log);
+static ngx_int_t ngx_io_uring_poll_remove(ngx_connection_t *c,
+    ngx_uint_t type, ngx_uint_t instance, ngx_log_t *log);
+static ngx_int_t ngx_io_uring_add_event(ngx_event_t *ev, ngx_int_t event,
+    ngx_uint_t flags);
+static ngx_int_t ngx_io_uring_del_event(ngx_event_t *ev, ngx_int_t event,
+    ngx_uint_t flags);
+static ngx_int_t ngx_io_uring_add_connection(ngx_connection_t *c);
+static ngx_int_t ngx_io_uring_del_connection(ngx_connection_t *c,
+    ngx_uint_t flags);
+#if (NGX_HAVE_EVENTFD)
+static ngx_int_t ngx_io_uring_notify(ngx_event_handler_pt handler);
+#endif
+static ngx_int_t ngx_io_uring_process_events(ngx_cycle_t *cycle,
+    ngx_msec_t timer, ngx_uint_t flags);
+
+static void *ngx_io_uring_create_conf(ngx_cycle_t *cycle);
+static char *ngx_io_uring_init_conf(ngx_cycle_t *cycle, void *conf);
+
+
+extern ngx_module_t         ngx_epoll_module;
+
+static int                  uring = -1;
+static ngx_io_uring_t       ring;
+
+#if (NGX_HAVE_EVENTFD)
+static int                  notify_fd = -1;
+static ngx_event_t          notify_event;
+static ngx_connection_t     notify_conn;
+#endif
+
+static ngx_str_t      io_uring_name = ngx_string("io_uring");
+
+static ngx_command_t  ngx_io_uring_commands[] = {
+
+    { ngx_string("io_uring_entries"),
+      NGX_EVENT_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      0,
+      offsetof(ngx_io_uring_conf_t, entries),
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_event_module_t  ngx_io_uring_module_ctx = {
+    &io_uring_name,
+    ngx_io_uring_create_conf,            /* create configuration */
+    ngx_io_uring_init_conf,              /* init configuration */
+
+    {
+        ngx_io_uring_add_event,          /* add an event */
+        ngx_io_uring_del_event,          /* delete an event */
+        ngx_io_uring_add_event,          /* enable an event */
+        ngx_io_uring_del_event,          /* disable an event */
+        ngx_io_uring_add_connection,     /* add an connection */
+        ngx_io_uring_del_connection,     /* delete an connection */
+#if (NGX_HAVE_EVENTFD)
+        ngx_io_uring_notify,             /* trigger a notify */
+#else
+        NULL,                            /* trigger a notify */
+#endif
+        ngx_io_uring_process_events,     /* process the events */
+        ngx_io_uring_init,               /* init the events */
+        ngx_io_uring_done,               /* done the events */
+    }
+};
+
+
+ngx_module_t  ngx_io_uring_module = {
+    NGX_MODULE_V1,
+    &ngx_io_uring_module_ctx,            /* module context */
+    ngx_io_uring_commands,               /* module directives */
+    NGX_EVENT_MODULE,                    /* module type */
+    NULL,                                /* init master */
+    NULL,                                /* init module */
+    NULL,                                /* init process */
+    NULL,                                /* init thread */
+    NULL,                                /* exit thread */
+    NULL,                                /* exit process */
+    NULL,                                /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+/*
+ * We call io_uring_setup(), io_uring_enter(), and io_uring_register()
+ * directly as syscalls, the same way the epoll module does for Linux AIO,
+ * to avoid a dependency on liburing.
+ */
+
+static int
+io_uring_setup(u_int entries, struct io_uring_params *p)
+{
+    return syscall(SYS_io_uring_setup, entries, p);
+}
+
+
+static int
+io_uring_enter(int fd, u_int to_submit, u_int min_complete, u_int flags,
+    void *arg, size_t argsz)
+{
+    return syscall(SYS_io_uring_enter, fd, to_submit, min_complete, flags,
+                   arg, argsz);
+}
+
+
+static int
+io_uring_register(int fd, u_int opcode, void *arg, u_int nargs)
+{
+    return syscall(SYS_io_uring_register, fd, opcode, arg, nargs);
+}
+
+
+static ngx_int_t
+ngx_io_uring_init(ngx_cycle_t *cycle, ngx_msec_t timer)
+{
+    ngx_event_module_t   *module;
+    ngx_io_uring_conf_t  *urcf;
+
+    urcf = ngx_event_get_conf(cycle->conf_ctx, ngx_io_uring_module);
+
+    if (uring == -1) {
+
+        if (ngx_io_uring_create(cycle, urcf) != NGX_OK) {
+            ngx_io_uring_free();
+
+            ngx_log_error(NGX_LOG_WARN, cycle->log, 0,
+                          "io_uring is not usable, falling back to epoll");
+
+            module = ngx_epoll_module.ctx;
+
+            return module->actions.init(cycle, timer);
+        }
+
+#if (NGX_HAVE_EVENTFD)
+        if (ngx_io_uring_notify_init(cycle->log) != NGX_OK) {
+            ngx_io_uring_module_ctx.actions.notify = NULL;
+        }
+#endif
+    }
+
+    ngx_io = ngx_os_io;
+
+    ngx_event_actions = ngx_io_uring_module_ctx.actions;
+
+    ngx_event_flags = NGX_USE_CLEAR_EVENT
+                      |NGX_USE_GREEDY_EVENT
+                      |NGX_USE_EPOLL_EVENT
+                      |NGX_USE_IO_URING_EVENT;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_io_uring_create(ngx_cycle_t *cycle, ngx_io_uring_conf_t *urcf)
+{
+    u_char                  *p;
+    size_t                   sq_size, cq_size;
+    uint32_t                 i, *array;
+    struct io_uring_params   params;
+
+    ngx_memzero(&params, sizeof(struct io_uring_params));
+
+    /* leave enough room in the completion queue for bursts of events */
+
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = urcf->entries * 4;
+
+    uring = io_uring_setup(urcf->entries, &params);
+
+    if (uring == -1) {
+        ngx_log_error(NGX_LOG_WARN, cycle->log, ngx_errno,
+                      "io_uring_setup() failed");
+        return NGX_ERROR;
+    }
+
+    if ((params.features & NGX_IO_URING_FEATURES) != NGX_IO_URING_FEATURES) {
+        ngx_log_error(NGX_LOG_WARN, cycle->log, 0,
+                      "io_uring features %08xD are not sufficient",
+                      params.features);
+        return NGX_ERROR;
+    }
+
+    sq_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    cq_size = params.cq_off.cqes
+              + params.cq_entries * sizeof(struct io_uring_cqe);
+
+    ring.rings_size = ngx_max(sq_size, cq_size);
+
+    ring.rings = mmap(NULL, ring.rings_size, PROT_READ|PROT_WRITE,
+                      MAP_SHARED|MAP_POPULATE, uring, IORING_OFF_SQ_RING);
+
+    if (ring.rings == MAP_FAILED) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                      "mmap(IORING_OFF_SQ_RING, %uz) failed", ring.rings_size);
+        ring.rings = NULL;
+        return NGX_ERROR;
+    }
+
+    ring.sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    ring.sqes = mmap(NULL, ring.sqes_size, PROT_READ|PROT_WRITE,
+                     MAP_SHARED|MAP_POPULATE, uring, IORING_OFF_SQES);
+
+    if (ring.sqes == MAP_FAILED) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                      "mmap(IORING_OFF_SQES, %uz) failed", ring.sqes_size);
+        ring.sqes = NULL;
+        return NGX_ERROR;
+    }
+
+    p = ring.rings;
+
+    ring.sq_head = (uint32_t *) (p + params.sq_off.head);
+    ring.sq_tail = (uint32_t *) (p + params.sq_off.tail);
+    ring.sq_mask = *(uint32_t *) (p + params.sq_off.ring_mask);
+    ring.sq_entries = *(uint32_t *) (p + params.sq_off.ring_entries);
+    ring.sq_local_tail = *ring.sq_tail;
+
+    /* submission entries are always used in order */
+
+    array = (uint32_t *) (p + params.sq_off.array);
+
+    for (i = 0; i < ring.sq_entries; i++) {
+        array[i] = i;
+    }
+
+    ring.cq_head = (uint32_t *) (p + params.cq_off.head);
+    ring.cq_tail = (uint32_t *) (p + params.cq_off.tail);
+    ring.cq_mask = *(uint32_t *) (p + params.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *) (p + params.cq_off.cqes);
+
+    ngx_log_debug3(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                   "io_uring: fd:%d sq:%uD cq:%uD",
+                   uring, ring.sq_entries, params.cq_entries);
+
+    if (ngx_io_uring_probe(cycle) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    return ngx_io_uring_test_multishot(cycle);
+}
+
+
+static ngx_int_t
+ngx_io_uring_probe(ngx_cycle_t *cycle)
+{
+    size_t                  size;
+    ngx_int_t               rc;
+    ngx_uint_t              i;
+    struct io_uring_probe  *probe;
+
+    static ngx_uint_t  ops[] = {
+        IORING_OP_POLL_ADD,
+        IORING_OP_POLL_REMOVE,
+#if (NGX_HAVE_FILE_AIO)
+        IORING_OP_READ,
+#endif
+    };
+
+    size = sizeof(struct io_uring_probe)
+           + IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+
+    probe = ngx_alloc(size, cycle->log);
+    if (probe == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_memzero(probe, size);
+
+    rc = NGX_OK;
+
+    if (io_uring_register(uring, IORING_REGISTER_PROBE, probe,
+                          IORING_OP_LAST)
+        == -1)
+    {
+        ngx_log_error(NGX_LOG_WARN, cycle->log, ngx_errno,
+                      "io_uring_register(IORING_REGISTER_PROBE) failed");
+        rc = NGX_ERROR;
+        goto done;
+    }
+
+    for (i = 0; i < sizeof(ops) / sizeof(ngx_uint_t); i++) {
+
+        if (ops[i] > probe->last_op
+            || !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED))
+        {
+            ngx_log_error(NGX_LOG_WARN, cycle->log, 0,
+                          "io_uring opcode %ui is not supported", ops[i]);
+            rc = NGX_ERROR;
+            goto done;
+        }
+    }
+
+done:
+
+    ngx_free(probe);
+
+    return rc;
+}
+
+
+/*
+ * multishot polls appeared in Linux 5.13, older kernels either reject
+ * the IORING_POLL_ADD_MULTI flag or silently post a single completion,
+ * so test the real behaviour; the test also detects EPOLLRDHUP support
+ */
+
+static ngx_int_t
+ngx_io_uring_test_multishot(ngx_cycle_t *cycle)
+{
+    int                             s[2];
+    uint32_t                        head;
+    ngx_int_t                       rc;
+    ngx_uint_t                      multishot;
+    struct io_uring_cqe            *cqe;
+    struct io_uring_sqe            *sqe;
+    struct __kernel_timespec        ts;
+    struct io_uring_getevents_arg   arg;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, s) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                      "socketpair() failed");
+        return NGX_ERROR;
+    }
+
+    rc = NGX_ERROR;
+    multishot = 0;
+
+    sqe = ngx_io_uring_get_sqe(cycle->log);
+    if (sqe == NULL) {
+        goto failed;
+    }
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = s[0];
+    sqe->poll32_events = ngx_io_uring_poll_events(EPOLLIN|EPOLLRDHUP);
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = NGX_IO_URING_TEST;
+
+    if (close(s[1]) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                      "close() failed");
+    }
+
+    s[1] = -1;
+
+    ngx_memzero(&arg, sizeof(struct io_uring_getevents_arg));
+
+    ts.tv_sec = 5;
+    ts.tv_nsec = 0;
+    arg.ts = (uint64_t) (uintptr_t) &ts;
+
+    ngx_memory_barrier();
+
+    *ring.sq_tail = ring.sq_local_tail;
+
+    if (io_uring_enter(uring, ring.sq_local_tail - *ring.sq_head, 1,
+                       IORING_ENTER_GETEVENTS|IORING_ENTER_EXT_ARG,
+                       &arg, sizeof(struct io_uring_getevents_arg))
+        == -1)
+    {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                      "io_uring_enter() failed");
+        goto failed;
+    }
+
+    head = *ring.cq_head;
+
+    if (head != *ring.cq_tail) {
+        ngx_memory_barrier();
+
+        cqe = &ring.cqes[head & ring.cq_mask];
+
+        if (cqe->user_data == NGX_IO_URING_TEST && cqe->res > 0) {
+            multishot = (cqe->flags & IORING_CQE_F_MORE) ? 1 : 0;
+
+#if (NGX_HAVE_EPOLLRDHUP)
+            ngx_use_epoll_rdhup = cqe->res & EPOLLRDHUP;
+#endif
+        }
+
+        ngx_memory_barrier();
+
+        *ring.cq_head = head + 1;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                   "testing io_uring multishot poll: %s",
+                   multishot ? "success" : "fail");
+
+    if (!multishot) {
+        ngx_log_error(NGX_LOG_WARN, cycle->log, 0,
+                      "io_uring multishot poll is not supported");
+        goto failed;
+    }
+
+    sqe = ngx_io_uring_get_sqe(cycle->log);
+    if (sqe == NULL) {
+        goto failed;
+    }
+
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = NGX_IO_URING_TEST;
+    sqe->user_data = NGX_IO_URING_IGNORE;
+
+    if (ngx_io_uring_flush(cycle->log) != NGX_OK) {
+        goto failed;
+    }
+
+    /* the remaining test completions are skipped by the pointer check */
+
+    rc = NGX_OK;
+
+failed:
+
+    if (s[1] != -1 && close(s[1]) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                      "close() failed");
+    }
+
+    if (close(s[0]) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                      "close() failed");
+    }
+
+    return rc;
+}
+
+
+static void
+ngx_io_uring_free(void)
+{
+    if (ring.sqes) {
+        (void) munmap(ring.sqes, ring.sqes_size);
+        ring.sqes = NULL;
+    }
+
+    if (ring.rings) {
+        (void) munmap(ring.rings, ring.rings_size);
+        ring.rings = NULL;
+    }
+
+    if (uring != -1) {
+        (void) close(uring);
+        uring = -1;
+    }
+}
+
+
+#if (NGX_HAVE_EVENTFD)
+
+static ngx_int_t
+ngx_io_uring_notify_init(ngx_log_t *log)
+{
+#if (NGX_HAVE_SYS_EVENTFD_H)
+    notify_fd = eventfd(0, 0);
+#else
+    notify_fd = syscall(SYS_eventfd, 0);
+#endif
+
+    if (notify_fd == -1) {
+        ngx_log_error(NGX_LOG_EMERG, log, ngx_errno, "eventfd() failed");
+        return NGX_ERROR;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, log, 0,
+                   "notify eventfd: %d", notify_fd);
+
+    notify_event.handler = ngx_io_uring_notify_handler;
+    notify_event.log = log;
+    notify_event.active = 1;
+
+    notify_conn.fd = notify_fd;
+    notify_conn.read = &notify_event;
+    notify_conn.log = log;
+
+    if (ngx_io_uring_poll_add(&notify_conn, NGX_IO_URING_READ, 0, log)
+        != NGX_OK)
+    {
+        if (close(notify_fd) == -1) {
+            ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                          "eventfd close() failed");
+        }
+
+        notify_fd = -1;
+
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_io_uring_notify_handler(ngx_event_t *ev)
+{
+    ssize_t               n;
+    uint64_t              count;
+    ngx_err_t             err;
+    ngx_event_handler_pt  handler;
+
+    if (++ev->index == NGX_MAX_UINT32_VALUE) {
+        ev->index = 0;
+
+        n = read(notify_fd, &count, sizeof(uint64_t));
+
+        err = ngx_errno;
+
+        ngx_log_debug3(NGX_LOG_DEBUG_EVENT, ev->log, 0,
+                       "read() eventfd %d: %z count:%uL", notify_fd, n, count);
+
+        if ((size_t) n != sizeof(uint64_t)) {
+            ngx_log_error(NGX_LOG_ALERT, ev->log, err,
+                          "read() eventfd %d failed", notify_fd);
+        }
+    }
+
+    handler = ev->data;
+    handler(ev);
+}
+
+#endif
+
+
+static void
+ngx_io_uring_done(ngx_cycle_t *cycle)
+{
+    ngx_io_uring_free();
+
+#if (NGX_HAVE_EVENTFD)
+
+    if (notify_fd != -1 && close(notify_fd) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                      "eventfd close() failed");
+    }
+
+    notify_fd = -1;
+
+#endif
+}
+
+
+static struct io_uring_sqe *
+ngx_io_uring_get_sqe(ngx_log_t *log)
+{
+    struct io_uring_sqe  *sqe;
+
+    if (ring.sq_local_tail - *ring.sq_head >= ring.sq_entries) {
+
+        if (ngx_io_uring_flush(log) == NGX_ERROR) {
+            return NULL;
+        }
+
+        if (ring.sq_local_tail - *ring.sq_head >= ring.sq_entries) {
+            ngx_log_error(NGX_LOG_ALERT, log, 0,
+                          "io_uring submission queue is full");
+            return NULL;
+        }
+    }
+
+    sqe = &ring.sqes[ring.sq_local_tail & ring.sq_mask];
+
+    ring.sq_local_tail++;
+
+    ngx_memzero(sqe, sizeof(struct io_uring_sqe));
+
+    return sqe;
+}
+
+
+static uint32_t
+ngx_io_uring_poll_events(uint32_t events)
+{
+    /* the kernel reads poll32_events as two swapped halves on big endian */
+
+#if (NGX_HAVE_LITTLE_ENDIAN)
+    return events;
+#else
+    return (events << 16) | (events >> 16);
+#endif
+}
+
+
+static ngx_int_t
+ngx_io_uring_flush(ngx_log_t *log)
+{
+    uint32_t   n;
+    ngx_err_t  err;
+
+    ngx_memory_barrier();
+
+    *ring.sq_tail = ring.sq_local_tail;
+
+    n = ring.sq_local_tail - *ring.sq_head;
+
+    if (n == 0) {
+        return NGX_OK;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, log, 0, "io_uring flush: %uD", n);
+
+    if (io_uring_enter(uring, n, 0, 0, NULL, 0) == -1) {
+        err = ngx_errno;
+
+        if (err == NGX_EAGAIN || err == EBUSY || err == NGX_EINTR) {
+            return NGX_AGAIN;
+        }
+
+        ngx_log_error(NGX_LOG_ALERT, log, err, "io_uring_enter() failed");
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_io_uring_poll_add(ngx_connection_t *c, ngx_uint_t type,
+    ngx_uint_t instance, ngx_log_t *log)
+{
+    uint32_t              events;
+    struct io_uring_sqe  *sqe;
+
+    sqe = ngx_io_uring_get_sqe(log);
+    if (sqe == NULL) {
+        return NGX_ERROR;
+    }
+
+    events = (type == NGX_IO_URING_READ) ? EPOLLIN|EPOLLRDHUP : EPOLLOUT;
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = c->fd;
+    sqe->poll32_events = ngx_io_uring_poll_events(events);
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = (uintptr_t) c | type | instance;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_io_uring_poll_remove(ngx_connection_t *c, ngx_uint_t type,
+    ngx_uint_t instance, ngx_log_t *log)
+{
+    struct io_uring_sqe  *sqe;
+
+    sqe = ngx_io_uring_get_sqe(log);
+    if (sqe == NULL) {
+        return NGX_ERROR;
+    }
+
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = (uintptr_t) c | type | instance;
+    sqe->user_data = NGX_IO_URING_IGNORE;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_io_uring_add_event(ngx_event_t *ev, ngx_int_t event, ngx_uint_t flags)
+{
+    ngx_uint_t         type;
+    ngx_connection_t  *c;
+
+    c = ev->data;
+
+    type = (event == NGX_READ_EVENT) ? NGX_IO_URING_READ : NGX_IO_URING_WRITE;
+
+    ngx_log_debug3(NGX_LOG_DEBUG_EVENT, ev->log, 0,
+                   "io_uring add event: fd:%d type:%ui active:%d",
+                   c->fd, type, ev->active);
+
+    if (ev->active) {
+        return NGX_OK;
+    }
+
+    if (ngx_io_uring_poll_add(c, type, ev->instance, ev->log) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    ev->active = 1;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_io_uring_del_event(ngx_event_t *ev, ngx_int_t event, ngx_uint_t flags)
+{
+    ngx_uint_t         type;
+    ngx_connection_t  *c;
+
+    /*
+     * unlike epoll, a poll request holds a reference to the file,
+     * so it has to be removed explicitly even if the descriptor
+     * is going to be closed
+     */
+
+    c = ev->data;
+
+    type = (event == NGX_READ_EVENT) ? NGX_IO_URING_READ : NGX_IO_URING_WRITE;
+
+    ngx_log_debug3(NGX_LOG_DEBUG_EVENT, ev->log, 0,
+                   "io_uring del event: fd:%d type:%ui active:%d",
+                   c->fd, type, ev->active);
+
+    if (!ev->active) {
+        return NGX_OK;
+    }
+
+    ev->active = 0;
+
+    return ngx_io_uring_poll_remove(c, type, ev->instance, ev->log);
+}
+
+
+static ngx_int_t
+ngx_io_uring_add_connection(ngx_connection_t *c)
+{
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "io_uring add connection: fd:%d", c->fd);
+
+    if (ngx_io_uring_add_event(c->read, NGX_READ_EVENT, 0) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    return ngx_io_uring_add_event(c->write, NGX_WRITE_EVENT, 0);
+}
+
+
+static ngx_int_t
+ngx_io_uring_del_connection(ngx_connection_t *c, ngx_uint_t flags)
+{
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "io_uring del connection: fd:%d", c->fd);
+
+    if (ngx_io_uring_del_event(c->read, NGX_READ_EVENT, flags) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    return ngx_io_uring_del_event(c->write, NGX_WRITE_EVENT, flags);
+}
+
+
+#if (NGX_HAVE_EVENTFD)
+
+static ngx_int_t
+ngx_io_uring_notify(ngx_event_handler_pt handler)
+{
+    static uint64_t inc = 1;
+
+    notify_event.data = handler;
+
+    if ((size_t) write(notify_fd, &inc, sizeof(uint64_t)) != sizeof(uint64_t)) {
+        ngx_log_error(NGX_LOG_ALERT, notify_event.log, ngx_errno,
+                      "write() to eventfd %d failed", notify_fd);
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+#endif
+
+
+#if (NGX_HAVE_FILE_AIO)
+
+ngx_int_t
+ngx_io_uring_read(ngx_event_t *ev, ngx_fd_t fd, u_char *buf, size_t size,
+    off_t offset)
+{
+    struct io_uring_sqe  *sqe;
+
+    sqe = ngx_io_uring_get_sqe(ev->log);
+    if (sqe == NULL) {
+        return NGX_ERROR;
+    }
+
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t) buf;
+    sqe->len = (uint32_t) ngx_min(size, NGX_MAX_INT32_VALUE);
+    sqe->off = offset;
+    sqe->user_data = (uintptr_t) ev | NGX_IO_URING_AIO;
+
+    return NGX_OK;
+}
+
+#endif
+
+
+static ngx_int_t
+ngx_io_uring_process_events(ngx_cycle_t *cycle, ngx_msec_t timer,
+    ngx_uint_t flags)
+{
+    int                             n, res;
+    uint32_t                        head, revents, more;
+    uint64_t                        data;
+    ngx_uint_t                      level, type, instance;
+    ngx_err_t                       err;
+    ngx_event_t                    *ev;
+    ngx_queue_t                    *queue;
+    ngx_connection_t               *c;
+    struct io_uring_cqe            *cqe;
+    struct __kernel_timespec        ts;
+    struct io_uring_getevents_arg   arg;
+#if (NGX_HAVE_FILE_AIO)
+    ngx_event_aio_t                *aio;
+#endif
+
+    /* NGX_TIMER_INFINITE means no timeout */
+
+    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                   "io_uring timer: %M, submit: %uD",
+                   timer, ring.sq_local_tail - *ring.sq_head);
+
+    ngx_memzero(&arg, sizeof(struct io_uring_getevents_arg));
+
+    if (timer != NGX_TIMER_INFINITE) {
+        ts.tv_sec = timer / 1000;
+        ts.tv_nsec = (timer % 1000) * 1000000;
+        arg.ts = (uint64_t) (uintptr_t) &ts;
+    }
+
+    ngx_memory_barrier();
+
+    *ring.sq_tail = ring.sq_local_tail;
+
+    n = io_uring_enter(uring, ring.sq_local_tail - *ring.sq_head, 1,
+                       IORING_ENTER_GETEVENTS|IORING_ENTER_EXT_ARG,
+                       &arg, sizeof(struct io_uring_getevents_arg));
+
+    err = (n == -1) ? ngx_errno : 0;
+
+    if (flags & NGX_UPDATE_TIME || ngx_event_timer_alarm) {
+        ngx_time_update();
+    }
+
+    if (err && err != ETIME && err != EBUSY) {
+        if (err == NGX_EINTR) {
+
+            if (ngx_event_timer_alarm) {
+                ngx_event_timer_alarm = 0;
+                return NGX_OK;
+            }
+
+            level = NGX_LOG_INFO;
+
+        } else {
+            level = NGX_LOG_ALERT;
+        }
+
+        ngx_log_error(level, cycle->log, err, "io_uring_enter() failed");
+        return NGX_ERROR;
+    }
+
+    head = *ring.cq_head;
+
+    for ( ;; ) {
+
+        if (head == *ring.cq_tail) {
+            break;
+        }
+
+        ngx_memory_barrier();
+
+        cqe = &ring.cqes[head & ring.cq_mask];
+
+        data = cqe->user_data;
+        res = cqe->res;
+        more = cqe->flags & IORING_CQE_F_MORE;
+
+        ngx_memory_barrier();
+
+        *ring.cq_head = ++head;
+
+        if ((data & ~(uint64_t) NGX_IO_URING_MASK) == 0) {
+            continue;
+        }
+
+        type = data & NGX_IO_URING_TYPE;
+
+#if (NGX_HAVE_FILE_AIO)
+
+        if (type == NGX_IO_URING_AIO) {
+            ev = (ngx_event_t *) (uintptr_t) (data & ~(uint64_t) NGX_IO_URING_MASK);
+
+            ngx_log_debug2(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                           "io_uring read: %p res:%d", ev, res);
+
+            ev->complete = 1;
+            ev->active = 0;
+            ev->ready = 1;
+
+            aio = ev->data;
+            aio->res = res;
+
+            ngx_post_event(ev, &ngx_posted_events);
+
+            continue;
+        }
+
+#endif
+
+        instance = data & 1;
+        c = (ngx_connection_t *) (uintptr_t) (data & ~(uint64_t) NGX_IO_URING_MASK);
+
+        ev = (type == NGX_IO_URING_READ) ? c->read : c->write;
+
+        if (c->fd == -1 || ev->instance != instance) {
+
+            /*
+             * the stale event from a file descriptor
+             * that was just closed in this iteration
+             */
+
+            ngx_log_debug1(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                           "io_uring: stale event %p", c);
+            continue;
+        }
+
+        ngx_log_debug4(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                       "io_uring: fd:%d type:%ui res:%d more:%uD",
+                       c->fd, type, res, more);
+
+        if (res == -ECANCELED || !ev->active) {
+            continue;
+        }
+
+        if (res < 0) {
+            ngx_log_error(NGX_LOG_ALERT, cycle->log, -res,
+                          "io_uring poll on fd:%d failed", c->fd);
+
+            /* the handler will get the error from the i/o operation */
+
+            ev->active = 0;
+            revents = EPOLLERR;
+
+        } else {
+            revents = res;
+
+            if (!more) {
+
+                /* the multishot poll was terminated, e.g. on overflow */
+
+                if (ngx_io_uring_poll_add(c, type, instance, cycle->log)
+                    != NGX_OK)
+                {
+                    ev->active = 0;
+                }
+            }
+        }
+
+        if (type == NGX_IO_URING_READ) {
+
+#if (NGX_HAVE_EPOLLRDHUP)
+            if (revents & EPOLLRDHUP) {
+                ev->pending_eof = 1;
+            }
+#endif
+
+            ev->ready = 1;
+            ev->available = -1;
+
+            if (flags & NGX_POST_EVENTS) {
+                queue = ev->accept ? &ngx_posted_accept_events
+                                   : &ngx_posted_events;
+
+                ngx_post_event(ev, queue);
+
+            } else {
+                ev->handler(ev);
+            }
+
+            continue;
+        }
+
+        ev->ready = 1;
+#if (NGX_THREADS)
+        ev->complete = 1;
+#endif
+
+        if (flags & NGX_POST_EVENTS) {
+            ngx_post_event(ev, &ngx_posted_events);
+
+        } else {
+            ev->handler(ev);
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static void *
+ngx_io_uring_create_conf(ngx_cycle_t *cycle)
+{
+    ngx_io_uring_conf_t  *urcf;
+
+    urcf = ngx_palloc(cycle->pool, sizeof(ngx_io_uring_conf_t));
+    if (urcf == NULL) {
+        return NULL;
+    }
+
+    urcf->entries = NGX_CONF_UNSET;
+
+    return urcf;
+}
+
+
+static char *
+ngx_io_uring_init_conf(ngx_cycle_t *cycle, void *conf)
+{
+    ngx_io_uring_conf_t *urcf = conf;
+
+    ngx_conf_init_uint_value(urcf->entries, 1024);
+
+    return NGX_CONF_OK;
+}
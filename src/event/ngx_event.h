@@ -195,6 +195,10 @@ extern ngx_event_actions_t   ngx_event_actions;
 #if (NGX_HAVE_EPOLLRDHUP)
 extern ngx_uint_t            ngx_use_epoll_rdhup;
 #endif
+#if (NGX_HAVE_IO_URING && NGX_HAVE_FILE_AIO)
+ngx_int_t ngx_io_uring_read(ngx_event_t *ev, ngx_fd_t fd, u_char *buf,
+    size_t size, off_t offset);
+#endif
 
 
 /*
@@ -275,6 +279,12 @@ extern ngx_uint_t            ngx_use_epoll_rdhup;
  */
 #define NGX_USE_VNODE_EVENT      0x00002000
 
+/*
+ * The event filter is io_uring: readiness is reported by multishot polls
+ * and file reads may be posted to the same ring.
+ */
+#define NGX_USE_IO_URING_EVENT   0x00004000
+
 
 /*
  * The event filter is deleted just before the closing file.
@@ -445,6 +455,8 @@ typedef struct {
 
     ngx_msec_t    accept_mutex_delay;
 
+    ngx_flag_t    timer_wheel;
+
     u_char       *name;                 // 事件模块名称，与 use 对应
 
 #if (NGX_DEBUG)
@@ -504,12 +516,26 @@ extern ngx_module_t           ngx_event_core_module;
 
 
 
+struct ngx_udp_connection_s {
+    ngx_rbtree_node_t   node;
+    ngx_connection_t   *connection;
+    ngx_buf_t          *buffer;
+    ngx_str_t           key;      /* connection id, if not keyed by address */
+};
+
+
 // 监听连接事件
 void ngx_event_accept(ngx_event_t *ev);
 #if !(NGX_WIN32)
 void ngx_event_recvmsg(ngx_event_t *ev);
 void ngx_udp_rbtree_insert_value(ngx_rbtree_node_t *temp,
     ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
+#if (NGX_QUIC)
+void ngx_insert_udp_connection_id(ngx_connection_t *c,
+    ngx_udp_connection_t *udp, ngx_str_t *key);
+void ngx_delete_udp_connection_id(ngx_connection_t *c,
+    ngx_udp_connection_t *udp);
+#endif
 #endif
 void ngx_delete_udp_connection(void *data);
 // 解决惊群问题：同一时刻仅只有一个进程监听端口
@@ -543,6 +569,10 @@ ngx_int_t ngx_send_lowat(ngx_connection_t *c, size_t lowat);
 #include <ngx_event_timer.h>
 #include <ngx_event_posted.h>
 
+#if (NGX_QUIC)
+#include <ngx_event_quic.h>
+#endif
+
 #if (NGX_WIN32)
 #include <ngx_iocp_module.h>
 #endif
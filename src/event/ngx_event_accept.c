@@ -403,7 +403,7 @@ ngx_disable_accept_events(ngx_cycle_t *cycle, ngx_uint_t all)
          * when disabling accept events due to accept mutex
          */
 
-        if (ls[i].reuseport && !all) {
+        if ((ls[i].reuseport || ls[i].quic) && !all) {
             continue;
         }
 
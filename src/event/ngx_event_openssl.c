@@ -9,15 +9,95 @@
 #include <ngx_core.h>
 #include <ngx_event.h>
 
+#if (NGX_THREADS)
+#include <ngx_thread_pool.h>
+#endif
+
 
 #define NGX_SSL_PASSWORD_BUFFER_SIZE  4096
 
+#define NGX_SSL_SCACHE_SHARD_SIZE     (1024 * 1024)
+#define NGX_SSL_SCACHE_MAX_SHARDS     16
+#define NGX_SSL_SCACHE_READ_TRIES     4
+#define NGX_SSL_SCACHE_MAX_DEPTH      64
+
+
+/*
+ * the shard sequence number is odd while the shard is being modified,
+ * it is set rather than incremented on write so that a number left odd
+ * by an abnormally exited process is recovered by the next writer
+ */
+
+#define ngx_ssl_session_shard_write(shard)                                   \
+    (shard)->seq |= 1;                                                        \
+    ngx_memory_barrier()
+
+#define ngx_ssl_session_shard_lock(shard)                                    \
+    ngx_shmtx_lock(&(shard)->shpool->mutex);                                  \
+    ngx_ssl_session_shard_write(shard)
+
+#define ngx_ssl_session_shard_unlock(shard)                                  \
+    ngx_memory_barrier();                                                     \
+    (shard)->seq = ((shard)->seq | 1) + 1;                                    \
+    ngx_shmtx_unlock(&(shard)->shpool->mutex)
+
+#define ngx_ssl_session_in_pool(pool, p, size)                               \
+    ((u_char *) (p) >= (pool)->start                                          \
+     && (u_char *) (p) + (size) <= (pool)->end)
+
+
+#if (NGX_THREADS && defined SSL_MODE_ASYNC && !defined OPENSSL_NO_EC          \
+     && !defined LIBRESSL_VERSION_NUMBER)
+#define NGX_SSL_ASYNC_HANDSHAKE  1
+#include <openssl/async.h>
+#endif
+
 
 typedef struct {
     ngx_uint_t  engine;   /* unsigned  engine:1; */
 } ngx_openssl_conf_t;
 
 
+#if (NGX_SSL_ASYNC_HANDSHAKE)
+
+/*
+ * a private key operation, it lives on the stack
+ * of the paused OpenSSL async job
+ */
+
+typedef struct {
+    ngx_uint_t              type;
+    int                     rc;
+
+    int                     flen;
+    const unsigned char    *from;
+    unsigned char          *to;
+    RSA                    *rsa;
+    int                     padding;
+
+    int                     dtype;
+    const unsigned char    *dgst;
+    int                     dlen;
+    unsigned char          *sig;
+    unsigned int           *siglen;
+    const BIGNUM           *kinv;
+    const BIGNUM           *r;
+    EC_KEY                 *eckey;
+} ngx_ssl_async_op_t;
+
+#define NGX_SSL_ASYNC_RSA_ENC   0
+#define NGX_SSL_ASYNC_RSA_DEC   1
+#define NGX_SSL_ASYNC_EC_SIGN   2
+
+
+typedef struct {
+    ngx_connection_t       *connection;
+    ngx_ssl_async_op_t     *op;
+} ngx_ssl_async_ctx_t;
+
+#endif
+
+
 static X509 *ngx_ssl_load_certificate(ngx_pool_t *pool, char **err,
     ngx_str_t *cert, STACK_OF(X509) **chain);
 static EVP_PKEY *ngx_ssl_load_certificate_key(ngx_pool_t *pool, char **err,
@@ -36,6 +116,22 @@ static ngx_int_t ngx_ssl_try_early_data(ngx_connection_t *c);
 #if (NGX_DEBUG)
 static void ngx_ssl_handshake_log(ngx_connection_t *c);
 #endif
+#if (NGX_SSL_ASYNC_HANDSHAKE)
+static ngx_int_t ngx_ssl_async_no_rsa_kx(ngx_conf_t *cf, ngx_ssl_t *ssl);
+static EVP_PKEY *ngx_ssl_async_key(EVP_PKEY *pkey, ngx_thread_pool_t *tp);
+static int ngx_ssl_async_rsa_priv_enc(int flen, const unsigned char *from,
+    unsigned char *to, RSA *rsa, int padding);
+static int ngx_ssl_async_rsa_priv_dec(int flen, const unsigned char *from,
+    unsigned char *to, RSA *rsa, int padding);
+static int ngx_ssl_async_ec_sign(int type, const unsigned char *dgst,
+    int dlen, unsigned char *sig, unsigned int *siglen, const BIGNUM *kinv,
+    const BIGNUM *r, EC_KEY *eckey);
+static int ngx_ssl_async_offload(ngx_ssl_async_op_t *op,
+    ngx_thread_pool_t *tp);
+static void ngx_ssl_async_run(ngx_ssl_async_op_t *op);
+static void ngx_ssl_async_thread_handler(void *data, ngx_log_t *log);
+static void ngx_ssl_async_event_handler(ngx_event_t *ev);
+#endif
 static void ngx_ssl_handshake_handler(ngx_event_t *ev);
 #ifdef SSL_READ_EARLY_DATA_SUCCESS
 static ssize_t ngx_ssl_recv_early(ngx_connection_t *c, u_char *buf,
@@ -47,6 +143,8 @@ static void ngx_ssl_write_handler(ngx_event_t *wev);
 static ssize_t ngx_ssl_write_early(ngx_connection_t *c, u_char *data,
     size_t size);
 #endif
+static ssize_t ngx_ssl_sendfile(ngx_connection_t *c, ngx_buf_t *file,
+    size_t size);
 static void ngx_ssl_read_handler(ngx_event_t *rev);
 static void ngx_ssl_shutdown_handler(ngx_event_t *ev);
 static void ngx_ssl_connection_error(ngx_connection_t *c, int sslerr,
@@ -62,9 +160,11 @@ static ngx_ssl_session_t *ngx_ssl_get_cached_session(ngx_ssl_conn_t *ssl_conn,
     const
 #endif
     u_char *id, int len, int *copy);
+static ngx_int_t ngx_ssl_lookup_session(ngx_ssl_session_shard_t *shard,
+    uint32_t hash, u_char *id, size_t len, u_char *buf, size_t *slen);
 static void ngx_ssl_remove_session(SSL_CTX *ssl, ngx_ssl_session_t *sess);
-static void ngx_ssl_expire_sessions(ngx_ssl_session_cache_t *cache,
-    ngx_slab_pool_t *shpool, ngx_uint_t n);
+static void ngx_ssl_expire_sessions(ngx_ssl_session_shard_t *shard,
+    ngx_uint_t n);
 static void ngx_ssl_session_rbtree_insert_value(ngx_rbtree_node_t *temp,
     ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
 
@@ -72,6 +172,11 @@ static void ngx_ssl_session_rbtree_insert_value(ngx_rbtree_node_t *temp,
 static int ngx_ssl_session_ticket_key_callback(ngx_ssl_conn_t *ssl_conn,
     unsigned char *name, unsigned char *iv, EVP_CIPHER_CTX *ectx,
     HMAC_CTX *hctx, int enc);
+static ngx_int_t ngx_ssl_set_ticket_keys(ngx_conf_t *cf, ngx_ssl_t *ssl,
+    ngx_array_t *keys);
+static ngx_int_t ngx_ssl_rotate_ticket_keys(SSL_CTX *ssl_ctx, ngx_log_t *log);
+static ngx_int_t ngx_ssl_generate_ticket_key(ngx_ssl_session_ticket_key_t *key,
+    ngx_log_t *log);
 static void ngx_ssl_session_ticket_keys_cleanup(void *data);
 #endif
 
@@ -137,6 +242,27 @@ int  ngx_ssl_certificate_name_index;
 int  ngx_ssl_stapling_index;
 
 
+#if (NGX_SSL_ASYNC_HANDSHAKE)
+
+static int                ngx_ssl_async_rsa_index = -1;
+static int                ngx_ssl_async_ec_index = -1;
+static RSA_METHOD        *ngx_ssl_async_rsa_method;
+static EC_KEY_METHOD     *ngx_ssl_async_ec_method;
+
+static int (*ngx_ssl_rsa_priv_enc)(int flen, const unsigned char *from,
+    unsigned char *to, RSA *rsa, int padding);
+static int (*ngx_ssl_rsa_priv_dec)(int flen, const unsigned char *from,
+    unsigned char *to, RSA *rsa, int padding);
+static int (*ngx_ssl_ec_sign)(int type, const unsigned char *dgst, int dlen,
+    unsigned char *sig, unsigned int *siglen, const BIGNUM *kinv,
+    const BIGNUM *r, EC_KEY *eckey);
+
+/* the connection whose handshake is being run by SSL_do_handshake() */
+static ngx_connection_t  *ngx_ssl_async_connection;
+
+#endif
+
+
 ngx_int_t
 ngx_ssl_init(ngx_log_t *log)
 {
@@ -1496,6 +1622,288 @@ ngx_ssl_early_data(ngx_conf_t *cf, ngx_ssl_t *ssl, ngx_uint_t enable)
 }
 
 
+ngx_int_t
+ngx_ssl_ktls(ngx_conf_t *cf, ngx_ssl_t *ssl, ngx_uint_t enable)
+{
+    if (!enable) {
+        return NGX_OK;
+    }
+
+#ifdef SSL_OP_ENABLE_KTLS
+
+    /*
+     * OpenSSL 3.0 passes the keys to the kernel after the handshake
+     * if the kernel supports the cipher; see BIO_get_ktls_send()
+     * in ngx_ssl_handshake()
+     */
+
+    SSL_CTX_set_options(ssl->ctx, SSL_OP_ENABLE_KTLS);
+
+#else
+    ngx_log_error(NGX_LOG_WARN, ssl->log, 0,
+                  "\"ssl_ktls\" is not supported on this platform, "
+                  "ignored");
+#endif
+
+    return NGX_OK;
+}
+
+
+#if (NGX_THREADS)
+
+ngx_int_t
+ngx_ssl_async_handshake(ngx_conf_t *cf, ngx_ssl_t *ssl, ngx_str_t *pool)
+{
+#if (NGX_SSL_ASYNC_HANDSHAKE)
+
+    int                 (*sign_setup)(EC_KEY *eckey, BN_CTX *ctx,
+                            BIGNUM **kinv, BIGNUM **r);
+    ECDSA_SIG          *(*sign_sig)(const unsigned char *dgst, int dlen,
+                            const BIGNUM *kinv, const BIGNUM *r,
+                            EC_KEY *eckey);
+    EVP_PKEY            *pkey, *key;
+    ngx_uint_t           rsa;
+    ngx_thread_pool_t   *tp;
+
+    if (!ASYNC_is_capable()) {
+        ngx_log_error(NGX_LOG_WARN, ssl->log, 0,
+                      "\"ssl_async_handshake\" is not supported "
+                      "on this platform, ignored");
+        return NGX_OK;
+    }
+
+    tp = ngx_thread_pool_add(cf, pool);
+    if (tp == NULL) {
+        return NGX_ERROR;
+    }
+
+    /*
+     * private keys are replaced with copies whose RSA and EC methods
+     * pause the OpenSSL async job the handshake runs in and compute
+     * the signature in the thread pool, see ngx_ssl_async_offload()
+     */
+
+    if (ngx_ssl_async_rsa_method == NULL) {
+        ngx_ssl_async_rsa_index = RSA_get_ex_new_index(0, NULL, NULL, NULL,
+                                                       NULL);
+        ngx_ssl_async_ec_index = EC_KEY_get_ex_new_index(0, NULL, NULL, NULL,
+                                                         NULL);
+
+        if (ngx_ssl_async_rsa_index == -1 || ngx_ssl_async_ec_index == -1) {
+            ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0,
+                          "RSA_get_ex_new_index() failed");
+            return NGX_ERROR;
+        }
+
+        ngx_ssl_async_rsa_method = RSA_meth_dup(RSA_get_default_method());
+        ngx_ssl_async_ec_method =
+                             EC_KEY_METHOD_new(EC_KEY_get_default_method());
+
+        if (ngx_ssl_async_rsa_method == NULL
+            || ngx_ssl_async_ec_method == NULL)
+        {
+            ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0,
+                          "RSA_meth_dup() failed");
+            return NGX_ERROR;
+        }
+
+        ngx_ssl_rsa_priv_enc = RSA_meth_get_priv_enc(RSA_get_default_method());
+        ngx_ssl_rsa_priv_dec = RSA_meth_get_priv_dec(RSA_get_default_method());
+
+        RSA_meth_set_priv_enc(ngx_ssl_async_rsa_method,
+                              ngx_ssl_async_rsa_priv_enc);
+        RSA_meth_set_priv_dec(ngx_ssl_async_rsa_method,
+                              ngx_ssl_async_rsa_priv_dec);
+
+        EC_KEY_METHOD_get_sign(EC_KEY_get_default_method(), &ngx_ssl_ec_sign,
+                               &sign_setup, &sign_sig);
+        EC_KEY_METHOD_set_sign(ngx_ssl_async_ec_method, ngx_ssl_async_ec_sign,
+                               sign_setup, sign_sig);
+    }
+
+    if (SSL_CTX_set_current_cert(ssl->ctx, SSL_CERT_SET_FIRST) == 0) {
+        return NGX_OK;
+    }
+
+    rsa = 0;
+
+    do {
+        pkey = SSL_CTX_get0_privatekey(ssl->ctx);
+
+        if (pkey == NULL) {
+            continue;
+        }
+
+        key = ngx_ssl_async_key(pkey, tp);
+
+        if (key == NULL) {
+            ngx_log_error(NGX_LOG_WARN, ssl->log, 0,
+                          "\"ssl_async_handshake\" is not supported "
+                          "for this private key type, ignored");
+            continue;
+        }
+
+        if (SSL_CTX_use_PrivateKey(ssl->ctx, key) == 0) {
+            ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0,
+                          "SSL_CTX_use_PrivateKey() failed");
+            EVP_PKEY_free(key);
+            return NGX_ERROR;
+        }
+
+        if (EVP_PKEY_base_id(key) == EVP_PKEY_RSA) {
+            rsa = 1;
+        }
+
+        EVP_PKEY_free(key);
+
+    } while (SSL_CTX_set_current_cert(ssl->ctx, SSL_CERT_SET_NEXT));
+
+    if (rsa && OPENSSL_VERSION_NUMBER >= 0x30000000L
+        && ngx_ssl_async_no_rsa_kx(cf, ssl) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    SSL_CTX_set_mode(ssl->ctx, SSL_MODE_ASYNC);
+
+#else
+    ngx_log_error(NGX_LOG_WARN, ssl->log, 0,
+                  "\"ssl_async_handshake\" is not supported on this platform, "
+                  "ignored");
+#endif
+
+    return NGX_OK;
+}
+
+#endif
+
+
+#if (NGX_SSL_ASYNC_HANDSHAKE)
+
+static ngx_int_t
+ngx_ssl_async_no_rsa_kx(ngx_conf_t *cf, ngx_ssl_t *ssl)
+{
+    u_char                    *p;
+    size_t                     len;
+    ngx_int_t                  i, n, removed;
+    const char                *name;
+    const SSL_CIPHER          *cipher;
+    STACK_OF(SSL_CIPHER)      *ciphers;
+
+    /*
+     * OpenSSL 3.0 cannot decrypt the RSA key exchange with keys which
+     * use an RSA method, so such ciphers are removed from the list
+     */
+
+    ciphers = SSL_CTX_get_ciphers(ssl->ctx);
+    n = sk_SSL_CIPHER_num(ciphers);
+
+    len = 0;
+
+    for (i = 0; i < n; i++) {
+        cipher = sk_SSL_CIPHER_value(ciphers, i);
+        len += ngx_strlen(SSL_CIPHER_get_name(cipher)) + 1;
+    }
+
+    p = ngx_pnalloc(cf->temp_pool, len + 1);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    len = 0;
+    removed = 0;
+
+    for (i = 0; i < n; i++) {
+        cipher = sk_SSL_CIPHER_value(ciphers, i);
+
+        if (SSL_CIPHER_get_kx_nid(cipher) == NID_kx_rsa) {
+            removed++;
+            continue;
+        }
+
+        if (len) {
+            p[len++] = ':';
+        }
+
+        name = SSL_CIPHER_get_name(cipher);
+        len = ngx_cpymem(p + len, name, ngx_strlen(name)) - p;
+    }
+
+    p[len] = '\0';
+
+    if (len == 0 || removed == 0) {
+        return NGX_OK;
+    }
+
+    if (SSL_CTX_set_cipher_list(ssl->ctx, (char *) p) == 0) {
+        ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0,
+                      "SSL_CTX_set_cipher_list(\"%s\") failed", p);
+        return NGX_ERROR;
+    }
+
+    ngx_log_error(NGX_LOG_WARN, ssl->log, 0,
+                  "\"ssl_async_handshake\" disables %i ciphers "
+                  "with RSA key exchange", removed);
+
+    return NGX_OK;
+}
+
+
+static EVP_PKEY *
+ngx_ssl_async_key(EVP_PKEY *pkey, ngx_thread_pool_t *tp)
+{
+    RSA       *rsa;
+    EC_KEY    *eckey;
+    EVP_PKEY  *key;
+
+    key = EVP_PKEY_new();
+    if (key == NULL) {
+        return NULL;
+    }
+
+    switch (EVP_PKEY_base_id(pkey)) {
+
+    case EVP_PKEY_RSA:
+        rsa = EVP_PKEY_get1_RSA(pkey);
+        if (rsa == NULL) {
+            break;
+        }
+
+        if (RSA_set_method(rsa, ngx_ssl_async_rsa_method) == 0
+            || RSA_set_ex_data(rsa, ngx_ssl_async_rsa_index, tp) == 0
+            || EVP_PKEY_assign_RSA(key, rsa) == 0)
+        {
+            RSA_free(rsa);
+            break;
+        }
+
+        return key;
+
+    case EVP_PKEY_EC:
+        eckey = EVP_PKEY_get1_EC_KEY(pkey);
+        if (eckey == NULL) {
+            break;
+        }
+
+        if (EC_KEY_set_method(eckey, ngx_ssl_async_ec_method) == 0
+            || EC_KEY_set_ex_data(eckey, ngx_ssl_async_ec_index, tp) == 0
+            || EVP_PKEY_assign_EC_KEY(key, eckey) == 0)
+        {
+            EC_KEY_free(eckey);
+            break;
+        }
+
+        return key;
+    }
+
+    EVP_PKEY_free(key);
+
+    return NULL;
+}
+
+#endif
+
+
 ngx_int_t
 ngx_ssl_conf_commands(ngx_conf_t *cf, ngx_ssl_t *ssl, ngx_array_t *commands)
 {
@@ -1717,12 +2125,25 @@ ngx_ssl_handshake(ngx_connection_t *c)
 
     ngx_ssl_clear_error(c->log);
 
+#if (NGX_SSL_ASYNC_HANDSHAKE)
+    ngx_ssl_async_connection = c;
+#endif
+
     n = SSL_do_handshake(c->ssl->connection);
 
+#if (NGX_SSL_ASYNC_HANDSHAKE)
+    ngx_ssl_async_connection = NULL;
+#endif
+
     ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0, "SSL_do_handshake: %d", n);
 
     if (n == 1) {
 
+#if (NGX_SSL_ASYNC_HANDSHAKE)
+        /* application data are not read and written in async jobs */
+        SSL_clear_mode(c->ssl->connection, SSL_MODE_ASYNC);
+#endif
+
         if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
             return NGX_ERROR;
         }
@@ -1765,6 +2186,17 @@ ngx_ssl_handshake(ngx_connection_t *c)
             return NGX_AGAIN;
         }
 
+#ifdef BIO_get_ktls_send
+
+        if (BIO_get_ktls_send(SSL_get_wbio(c->ssl->connection)) == 1) {
+            ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                           "BIO_get_ktls_send(): 1");
+
+            c->ssl->sendfile = 1;
+        }
+
+#endif
+
         c->ssl->handshaked = 1;
 
         return NGX_OK;
@@ -1806,6 +2238,20 @@ ngx_ssl_handshake(ngx_connection_t *c)
         return NGX_AGAIN;
     }
 
+#if (NGX_SSL_ASYNC_HANDSHAKE)
+
+    if (sslerr == SSL_ERROR_WANT_ASYNC) {
+
+        /* a private key operation runs in a thread pool */
+
+        c->read->handler = ngx_ssl_handshake_handler;
+        c->write->handler = ngx_ssl_handshake_handler;
+
+        return NGX_AGAIN;
+    }
+
+#endif
+
     err = (sslerr == SSL_ERROR_SYSCALL) ? ngx_errno : 0;
 
     c->ssl->no_wait_shutdown = 1;
@@ -1834,46 +2280,234 @@ ngx_ssl_handshake(ngx_connection_t *c)
 }
 
 
-#ifdef SSL_READ_EARLY_DATA_SUCCESS
+#if (NGX_SSL_ASYNC_HANDSHAKE)
 
-static ngx_int_t
-ngx_ssl_try_early_data(ngx_connection_t *c)
+static int
+ngx_ssl_async_rsa_priv_enc(int flen, const unsigned char *from,
+    unsigned char *to, RSA *rsa, int padding)
 {
-    int        n, sslerr;
-    u_char     buf;
-    size_t     readbytes;
-    ngx_err_t  err;
-    ngx_int_t  rc;
+    ngx_ssl_async_op_t  op;
 
-    ngx_ssl_clear_error(c->log);
+    op.type = NGX_SSL_ASYNC_RSA_ENC;
+    op.flen = flen;
+    op.from = from;
+    op.to = to;
+    op.rsa = rsa;
+    op.padding = padding;
 
-    readbytes = 0;
+    return ngx_ssl_async_offload(&op,
+                                 RSA_get_ex_data(rsa, ngx_ssl_async_rsa_index));
+}
 
-    n = SSL_read_early_data(c->ssl->connection, &buf, 1, &readbytes);
 
-    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, c->log, 0,
-                   "SSL_read_early_data: %d, %uz", n, readbytes);
+static int
+ngx_ssl_async_rsa_priv_dec(int flen, const unsigned char *from,
+    unsigned char *to, RSA *rsa, int padding)
+{
+    ngx_ssl_async_op_t  op;
 
-    if (n == SSL_READ_EARLY_DATA_FINISH) {
-        c->ssl->try_early_data = 0;
-        return ngx_ssl_handshake(c);
-    }
+    op.type = NGX_SSL_ASYNC_RSA_DEC;
+    op.flen = flen;
+    op.from = from;
+    op.to = to;
+    op.rsa = rsa;
+    op.padding = padding;
 
-    if (n == SSL_READ_EARLY_DATA_SUCCESS) {
+    return ngx_ssl_async_offload(&op,
+                                 RSA_get_ex_data(rsa, ngx_ssl_async_rsa_index));
+}
 
-        if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
-            return NGX_ERROR;
-        }
 
-        if (ngx_handle_write_event(c->write, 0) != NGX_OK) {
-            return NGX_ERROR;
-        }
+static int
+ngx_ssl_async_ec_sign(int type, const unsigned char *dgst, int dlen,
+    unsigned char *sig, unsigned int *siglen, const BIGNUM *kinv,
+    const BIGNUM *r, EC_KEY *eckey)
+{
+    ngx_ssl_async_op_t  op;
+
+    op.type = NGX_SSL_ASYNC_EC_SIGN;
+    op.dtype = type;
+    op.dgst = dgst;
+    op.dlen = dlen;
+    op.sig = sig;
+    op.siglen = siglen;
+    op.kinv = kinv;
+    op.r = r;
+    op.eckey = eckey;
+
+    return ngx_ssl_async_offload(&op,
+                                 EC_KEY_get_ex_data(eckey,
+                                                    ngx_ssl_async_ec_index));
+}
 
-#if (NGX_DEBUG)
-        ngx_ssl_handshake_log(c);
-#endif
 
-        c->ssl->try_early_data = 0;
+/*
+ * The handshake runs in an OpenSSL async job (SSL_MODE_ASYNC).  A private
+ * key operation posts a task to the thread pool and pauses the job, so
+ * SSL_do_handshake() returns SSL_ERROR_WANT_ASYNC.  When the task is done,
+ * the worker calls SSL_do_handshake() again, which resumes the job with
+ * the result.  All other handshake steps and callbacks, and resumed
+ * handshakes without private key operations, stay in the worker.
+ */
+
+static int
+ngx_ssl_async_offload(ngx_ssl_async_op_t *op, ngx_thread_pool_t *tp)
+{
+    ngx_connection_t     *c;
+    ngx_thread_task_t    *task;
+    ngx_ssl_async_ctx_t  *ctx;
+
+    c = ngx_ssl_async_connection;
+
+    if (c == NULL || tp == NULL || ASYNC_get_current_job() == NULL) {
+        ngx_ssl_async_run(op);
+        return op->rc;
+    }
+
+    task = c->ssl->async_task;
+
+    if (task == NULL) {
+        task = ngx_thread_task_alloc(c->pool, sizeof(ngx_ssl_async_ctx_t));
+        if (task == NULL) {
+            ngx_ssl_async_run(op);
+            return op->rc;
+        }
+
+        ctx = task->ctx;
+        ctx->connection = c;
+
+        task->handler = ngx_ssl_async_thread_handler;
+        task->event.data = c;
+        task->event.handler = ngx_ssl_async_event_handler;
+
+        c->ssl->async_task = task;
+    }
+
+    ctx = task->ctx;
+    ctx->op = op;
+
+    if (ngx_thread_task_post(tp, task) != NGX_OK) {
+        ngx_ssl_async_run(op);
+        return op->rc;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "SSL private key operation %ui in thread", op->type);
+
+    c->ssl->in_thread = 1;
+
+    /* the job is resumed by SSL_do_handshake() when the task is done */
+
+    (void) ASYNC_pause_job();
+
+    return op->rc;
+}
+
+
+static void
+ngx_ssl_async_run(ngx_ssl_async_op_t *op)
+{
+    switch (op->type) {
+
+    case NGX_SSL_ASYNC_RSA_ENC:
+        op->rc = ngx_ssl_rsa_priv_enc(op->flen, op->from, op->to, op->rsa,
+                                      op->padding);
+        break;
+
+    case NGX_SSL_ASYNC_RSA_DEC:
+        op->rc = ngx_ssl_rsa_priv_dec(op->flen, op->from, op->to, op->rsa,
+                                      op->padding);
+        break;
+
+    default: /* NGX_SSL_ASYNC_EC_SIGN */
+        op->rc = ngx_ssl_ec_sign(op->dtype, op->dgst, op->dlen, op->sig,
+                                 op->siglen, op->kinv, op->r, op->eckey);
+    }
+}
+
+
+static void
+ngx_ssl_async_thread_handler(void *data, ngx_log_t *log)
+{
+    ngx_ssl_async_ctx_t *ctx = data;
+
+    ngx_ssl_async_run(ctx->op);
+
+    if (ctx->op->rc <= 0) {
+
+        /* the OpenSSL error queue is per thread, errors are logged here */
+
+        ngx_ssl_error(NGX_LOG_ERR, log, 0, "SSL private key operation failed");
+    }
+}
+
+
+static void
+ngx_ssl_async_event_handler(ngx_event_t *ev)
+{
+    ngx_connection_t  *c;
+
+    c = ev->data;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "SSL private key operation done");
+
+    c->ssl->in_thread = 0;
+
+    /* the paused job is resumed even if the connection has timed out */
+
+    if (ngx_ssl_handshake(c) == NGX_AGAIN
+        && !c->read->timedout && !c->write->timedout)
+    {
+        return;
+    }
+
+    c->ssl->handler(c);
+}
+
+#endif
+
+
+#ifdef SSL_READ_EARLY_DATA_SUCCESS
+
+static ngx_int_t
+ngx_ssl_try_early_data(ngx_connection_t *c)
+{
+    int        n, sslerr;
+    u_char     buf;
+    size_t     readbytes;
+    ngx_err_t  err;
+    ngx_int_t  rc;
+
+    ngx_ssl_clear_error(c->log);
+
+    readbytes = 0;
+
+    n = SSL_read_early_data(c->ssl->connection, &buf, 1, &readbytes);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "SSL_read_early_data: %d, %uz", n, readbytes);
+
+    if (n == SSL_READ_EARLY_DATA_FINISH) {
+        c->ssl->try_early_data = 0;
+        return ngx_ssl_handshake(c);
+    }
+
+    if (n == SSL_READ_EARLY_DATA_SUCCESS) {
+
+        if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        if (ngx_handle_write_event(c->write, 0) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+#if (NGX_DEBUG)
+        ngx_ssl_handshake_log(c);
+#endif
+
+        c->ssl->try_early_data = 0;
 
         c->ssl->early_buf = buf;
         c->ssl->early_preread = 1;
@@ -1897,6 +2531,17 @@ ngx_ssl_try_early_data(ngx_connection_t *c)
             return NGX_AGAIN;
         }
 
+#ifdef BIO_get_ktls_send
+
+        if (BIO_get_ktls_send(SSL_get_wbio(c->ssl->connection)) == 1) {
+            ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                           "BIO_get_ktls_send(): 1");
+
+            c->ssl->sendfile = 1;
+        }
+
+#endif
+
         c->ssl->handshaked = 1;
 
         return NGX_OK;
@@ -2029,6 +2674,10 @@ ngx_ssl_handshake_handler(ngx_event_t *ev)
     ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0,
                    "SSL handshake handler: %d", ev->write);
 
+    if (c->ssl->in_thread) {
+        return;
+    }
+
     if (ev->timedout) {
         c->ssl->handler(c);
         return;
@@ -2488,10 +3137,12 @@ ngx_ssl_write_handler(ngx_event_t *wev)
 ngx_chain_t *
 ngx_ssl_send_chain(ngx_connection_t *c, ngx_chain_t *in, off_t limit)
 {
-    int          n;
-    ngx_uint_t   flush;
-    ssize_t      send, size;
-    ngx_buf_t   *buf;
+    int            n;
+    size_t         file_size;
+    ssize_t        send, size;
+    ngx_buf_t     *buf;
+    ngx_uint_t     flush;
+    ngx_chain_t   *cl;
 
     if (!c->ssl->buffer) {
 
@@ -2565,6 +3216,11 @@ ngx_ssl_send_chain(ngx_connection_t *c, ngx_chain_t *in, off_t limit)
                 continue;
             }
 
+            if (in->buf->in_file && c->ssl->sendfile) {
+                flush = 1;
+                break;
+            }
+
             size = in->buf->last - in->buf->pos;
 
             if (size > buf->end - buf->last) {
@@ -2596,8 +3252,35 @@ ngx_ssl_send_chain(ngx_connection_t *c, ngx_chain_t *in, off_t limit)
         size = buf->last - buf->pos;
 
         if (size == 0) {
+
+            if (in && in->buf->in_file && send < limit) {
+
+                /* coalesce the neighbouring file bufs */
+
+                cl = in;
+                file_size = (size_t) ngx_chain_coalesce_file(&cl, limit - send);
+
+                n = ngx_ssl_sendfile(c, in->buf, file_size);
+
+                if (n == NGX_ERROR) {
+                    return NGX_CHAIN_ERROR;
+                }
+
+                if (n == NGX_AGAIN) {
+                    break;
+                }
+
+                in = ngx_chain_update_sent(in, n);
+
+                send += n;
+                flush = 0;
+
+                continue;
+            }
+
             buf->flush = 0;
             c->buffered &= ~NGX_SSL_BUFFERED;
+
             return in;
         }
 
@@ -2751,6 +3434,147 @@ ngx_ssl_write(ngx_connection_t *c, u_char *data, size_t size)
 }
 
 
+static ssize_t
+ngx_ssl_sendfile(ngx_connection_t *c, ngx_buf_t *file, size_t size)
+{
+#ifdef BIO_get_ktls_send
+
+    int        sslerr;
+    ssize_t    n;
+    ngx_err_t  err;
+
+    ngx_ssl_clear_error(c->log);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "SSL to sendfile: @%O %uz", file->file_pos, size);
+
+    ngx_set_errno(0);
+
+    n = SSL_sendfile(c->ssl->connection, file->file->fd, file->file_pos,
+                     size, 0);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0, "SSL_sendfile: %z", n);
+
+    if (n > 0) {
+
+        if (c->ssl->saved_read_handler) {
+
+            c->read->handler = c->ssl->saved_read_handler;
+            c->ssl->saved_read_handler = NULL;
+            c->read->ready = 1;
+
+            if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+                return NGX_ERROR;
+            }
+
+            ngx_post_event(c->read, &ngx_posted_events);
+        }
+
+        c->sent += n;
+
+        return n;
+    }
+
+    if (n == 0) {
+
+        /*
+         * if sendfile returns zero, then someone has truncated the file,
+         * so the offset became beyond the end of the file
+         */
+
+        ngx_log_error(NGX_LOG_ALERT, c->log, 0,
+                      "SSL_sendfile() reported that \"%s\" was truncated at %O",
+                      file->file->name.data, file->file_pos);
+
+        return NGX_ERROR;
+    }
+
+    sslerr = SSL_get_error(c->ssl->connection, n);
+
+    if (sslerr == SSL_ERROR_ZERO_RETURN) {
+
+        /* see the comment in ngx_ssl_write() */
+
+        sslerr = SSL_ERROR_SYSCALL;
+    }
+
+    if (sslerr == SSL_ERROR_SSL
+        && ERR_GET_REASON(ERR_peek_error()) == SSL_R_UNINITIALIZED
+        && ngx_errno != 0)
+    {
+        /*
+         * OpenSSL fails to return SSL_ERROR_SYSCALL if an error
+         * happens in sendfile(), and returns SSL_ERROR_SSL with
+         * SSL_R_UNINITIALIZED reason instead
+         */
+
+        sslerr = SSL_ERROR_SYSCALL;
+    }
+
+    err = (sslerr == SSL_ERROR_SYSCALL) ? ngx_errno : 0;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0, "SSL_get_error: %d", sslerr);
+
+    if (sslerr == SSL_ERROR_WANT_WRITE) {
+
+        if (c->ssl->saved_read_handler) {
+
+            c->read->handler = c->ssl->saved_read_handler;
+            c->ssl->saved_read_handler = NULL;
+            c->read->ready = 1;
+
+            if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+                return NGX_ERROR;
+            }
+
+            ngx_post_event(c->read, &ngx_posted_events);
+        }
+
+        c->write->ready = 0;
+        return NGX_AGAIN;
+    }
+
+    if (sslerr == SSL_ERROR_WANT_READ) {
+
+        ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                       "SSL_sendfile: want read");
+
+        c->read->ready = 0;
+
+        if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        /*
+         * we do not set the timer because there is already
+         * the write event timer
+         */
+
+        if (c->ssl->saved_read_handler == NULL) {
+            c->ssl->saved_read_handler = c->read->handler;
+            c->read->handler = ngx_ssl_read_handler;
+        }
+
+        return NGX_AGAIN;
+    }
+
+    c->ssl->no_wait_shutdown = 1;
+    c->ssl->no_send_shutdown = 1;
+    c->write->error = 1;
+
+    ngx_ssl_connection_error(c, sslerr, err, "SSL_sendfile() failed");
+
+#else
+
+    ngx_log_error(NGX_LOG_ALERT, c->log, 0,
+                  "SSL_sendfile() not available");
+
+#endif
+
+    return NGX_ERROR;
+}
+
+
 #ifdef SSL_READ_EARLY_DATA_SUCCESS
 
 ssize_t
@@ -2899,11 +3723,21 @@ ngx_ssl_shutdown(ngx_connection_t *c)
     ngx_err_t   err;
     ngx_uint_t  tries;
 
-    ngx_ssl_ocsp_cleanup(c);
+#if (NGX_QUIC)
 
-    if (SSL_in_init(c->ssl->connection)) {
-        /*
-         * OpenSSL 1.0.2f complains if SSL_shutdown() is called during
+    if (c->quic) {
+        /* streams share the TLS connection of their QUIC connection */
+        c->ssl = NULL;
+        return NGX_OK;
+    }
+
+#endif
+
+    ngx_ssl_ocsp_cleanup(c);
+
+    if (SSL_in_init(c->ssl->connection)) {
+        /*
+         * OpenSSL 1.0.2f complains if SSL_shutdown() is called during
          * an SSL handshake, while previous versions always return 0.
          * Avoid calling SSL_shutdown() if handshake wasn't completed.
          */
@@ -3463,8 +4297,11 @@ failed:
 ngx_int_t
 ngx_ssl_session_cache_init(ngx_shm_zone_t *shm_zone, void *data)
 {
-    size_t                    len;
-    ngx_slab_pool_t          *shpool;
+    u_char                   *p;
+    size_t                    len, size;
+    ngx_uint_t                i, n;
+    ngx_slab_pool_t          *shpool, *sp;
+    ngx_ssl_session_shard_t  *shard;
     ngx_ssl_session_cache_t  *cache;
 
     if (data) {
@@ -3479,18 +4316,42 @@ ngx_ssl_session_cache_init(ngx_shm_zone_t *shm_zone, void *data)
         return NGX_OK;
     }
 
-    cache = ngx_slab_alloc(shpool, sizeof(ngx_ssl_session_cache_t));
+    /*
+     * large zones are split into shards selected by the session id hash,
+     * each shard is a separate slab pool with its own mutex, rbtree
+     * and expire queue
+     */
+
+#if (NGX_HAVE_ATOMIC_OPS)
+    n = shm_zone->shm.size / NGX_SSL_SCACHE_SHARD_SIZE;
+
+    if (n > NGX_SSL_SCACHE_MAX_SHARDS) {
+        n = NGX_SSL_SCACHE_MAX_SHARDS;
+    }
+
+    if (n == 0) {
+        n = 1;
+    }
+#else
+    n = 1;
+#endif
+
+    len = sizeof(ngx_ssl_session_cache_t)
+          + (n - 1) * sizeof(ngx_ssl_session_shard_t *);
+
+    cache = ngx_slab_alloc(shpool, len);
     if (cache == NULL) {
         return NGX_ERROR;
     }
 
-    shpool->data = cache;
-    shm_zone->data = cache;
+    cache->nshards = n;
 
-    ngx_rbtree_init(&cache->session_rbtree, &cache->sentinel,
-                    ngx_ssl_session_rbtree_insert_value);
+#ifdef SSL_CTRL_SET_TLSEXT_TICKET_KEY_CB
+    ngx_memzero(cache->ticket_keys, sizeof(cache->ticket_keys));
+#endif
 
-    ngx_queue_init(&cache->expire_queue);
+    shpool->data = cache;
+    shm_zone->data = cache;
 
     len = sizeof(" in SSL session shared cache \"\"") + shm_zone->shm.name.len;
 
@@ -3504,6 +4365,51 @@ ngx_ssl_session_cache_init(ngx_shm_zone_t *shm_zone, void *data)
 
     shpool->log_nomem = 0;
 
+    size = shpool->pfree / n * ngx_pagesize;
+
+    for (i = 0; i < n; i++) {
+
+        if (n == 1) {
+            sp = shpool;
+
+        } else {
+            p = ngx_slab_alloc(shpool, size);
+            if (p == NULL) {
+                return NGX_ERROR;
+            }
+
+            sp = (ngx_slab_pool_t *) p;
+
+            sp->end = p + size;
+            sp->min_shift = 3;
+            sp->addr = p;
+
+            if (ngx_shmtx_create(&sp->mutex, &sp->lock, NULL) != NGX_OK) {
+                return NGX_ERROR;
+            }
+
+            ngx_slab_init(sp);
+
+            sp->log_ctx = shpool->log_ctx;
+            sp->log_nomem = 0;
+        }
+
+        shard = ngx_slab_alloc(sp, sizeof(ngx_ssl_session_shard_t));
+        if (shard == NULL) {
+            return NGX_ERROR;
+        }
+
+        ngx_rbtree_init(&shard->session_rbtree, &shard->sentinel,
+                        ngx_ssl_session_rbtree_insert_value);
+
+        ngx_queue_init(&shard->expire_queue);
+
+        shard->seq = 0;
+        shard->shpool = sp;
+
+        cache->shards[i] = shard;
+    }
+
     return NGX_OK;
 }
 
@@ -3522,7 +4428,7 @@ ngx_ssl_session_cache_init(ngx_shm_zone_t *shm_zone, void *data)
  * and an ASN1 representation, they take accordingly 128 and 128 bytes.
  *
  * OpenSSL's i2d_SSL_SESSION() and d2i_SSL_SESSION are slow,
- * so they are outside the code locked by shared pool mutex
+ * so they are outside the code locked by shard mutex
  */
 
 static int
@@ -3537,6 +4443,7 @@ ngx_ssl_new_session(ngx_ssl_conn_t *ssl_conn, ngx_ssl_session_t *sess)
     ngx_connection_t         *c;
     ngx_slab_pool_t          *shpool;
     ngx_ssl_sess_id_t        *sess_id;
+    ngx_ssl_session_shard_t  *shard;
     ngx_ssl_session_cache_t  *cache;
     u_char                    buf[NGX_SSL_MAX_SESSION_SIZE];
 
@@ -3551,18 +4458,23 @@ ngx_ssl_new_session(ngx_ssl_conn_t *ssl_conn, ngx_ssl_session_t *sess)
     p = buf;
     i2d_SSL_SESSION(sess, &p);
 
+    session_id = (u_char *) SSL_SESSION_get_id(sess, &session_id_length);
+
+    hash = ngx_crc32_short(session_id, session_id_length);
+
     c = ngx_ssl_get_connection(ssl_conn);
 
     ssl_ctx = c->ssl->session_ctx;
     shm_zone = SSL_CTX_get_ex_data(ssl_ctx, ngx_ssl_session_cache_index);
 
     cache = shm_zone->data;
-    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+    shard = cache->shards[hash % cache->nshards];
+    shpool = shard->shpool;
 
-    ngx_shmtx_lock(&shpool->mutex);
+    ngx_ssl_session_shard_lock(shard);
 
     /* drop one or two expired sessions */
-    ngx_ssl_expire_sessions(cache, shpool, 1);
+    ngx_ssl_expire_sessions(shard, 1);
 
     cached_sess = ngx_slab_alloc_locked(shpool, len);
 
@@ -3570,7 +4482,7 @@ ngx_ssl_new_session(ngx_ssl_conn_t *ssl_conn, ngx_ssl_session_t *sess)
 
         /* drop the oldest non-expired session and try once more */
 
-        ngx_ssl_expire_sessions(cache, shpool, 0);
+        ngx_ssl_expire_sessions(shard, 0);
 
         cached_sess = ngx_slab_alloc_locked(shpool, len);
 
@@ -3586,7 +4498,7 @@ ngx_ssl_new_session(ngx_ssl_conn_t *ssl_conn, ngx_ssl_session_t *sess)
 
         /* drop the oldest non-expired session and try once more */
 
-        ngx_ssl_expire_sessions(cache, shpool, 0);
+        ngx_ssl_expire_sessions(shard, 0);
 
         sess_id = ngx_slab_alloc_locked(shpool, sizeof(ngx_ssl_sess_id_t));
 
@@ -3595,8 +4507,6 @@ ngx_ssl_new_session(ngx_ssl_conn_t *ssl_conn, ngx_ssl_session_t *sess)
         }
     }
 
-    session_id = (u_char *) SSL_SESSION_get_id(sess, &session_id_length);
-
 #if (NGX_PTR_SIZE == 8)
 
     id = sess_id->sess_id;
@@ -3609,7 +4519,7 @@ ngx_ssl_new_session(ngx_ssl_conn_t *ssl_conn, ngx_ssl_session_t *sess)
 
         /* drop the oldest non-expired session and try once more */
 
-        ngx_ssl_expire_sessions(cache, shpool, 0);
+        ngx_ssl_expire_sessions(shard, 0);
 
         id = ngx_slab_alloc_locked(shpool, session_id_length);
 
@@ -3624,8 +4534,6 @@ ngx_ssl_new_session(ngx_ssl_conn_t *ssl_conn, ngx_ssl_session_t *sess)
 
     ngx_memcpy(id, session_id, session_id_length);
 
-    hash = ngx_crc32_short(session_id, session_id_length);
-
     ngx_log_debug3(NGX_LOG_DEBUG_EVENT, c->log, 0,
                    "ssl new session: %08XD:%ud:%d",
                    hash, session_id_length, len);
@@ -3638,11 +4546,11 @@ ngx_ssl_new_session(ngx_ssl_conn_t *ssl_conn, ngx_ssl_session_t *sess)
 
     sess_id->expire = ngx_time() + SSL_CTX_get_timeout(ssl_ctx);
 
-    ngx_queue_insert_head(&cache->expire_queue, &sess_id->queue);
+    ngx_queue_insert_head(&shard->expire_queue, &sess_id->queue);
 
-    ngx_rbtree_insert(&cache->session_rbtree, &sess_id->node);
+    ngx_rbtree_insert(&shard->session_rbtree, &sess_id->node);
 
-    ngx_shmtx_unlock(&shpool->mutex);
+    ngx_ssl_session_shard_unlock(shard);
 
     return 0;
 
@@ -3656,7 +4564,7 @@ failed:
         ngx_slab_free_locked(shpool, sess_id);
     }
 
-    ngx_shmtx_unlock(&shpool->mutex);
+    ngx_ssl_session_shard_unlock(shard);
 
     ngx_log_error(NGX_LOG_ALERT, c->log, 0,
                   "could not allocate new session%s", shpool->log_ctx);
@@ -3681,6 +4589,7 @@ ngx_ssl_get_cached_session(ngx_ssl_conn_t *ssl_conn,
     ngx_rbtree_node_t        *node, *sentinel;
     ngx_ssl_session_t        *sess;
     ngx_ssl_sess_id_t        *sess_id;
+    ngx_ssl_session_shard_t  *shard;
     ngx_ssl_session_cache_t  *cache;
     u_char                    buf[NGX_SSL_MAX_SESSION_SIZE];
     ngx_connection_t         *c;
@@ -3697,15 +4606,28 @@ ngx_ssl_get_cached_session(ngx_ssl_conn_t *ssl_conn,
                                    ngx_ssl_session_cache_index);
 
     cache = shm_zone->data;
+    shard = cache->shards[hash % cache->nshards];
+    shpool = shard->shpool;
 
-    sess = NULL;
+    rc = ngx_ssl_lookup_session(shard, hash, (u_char *) (uintptr_t) id,
+                                (size_t) len, buf, &slen);
 
-    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+    if (rc == NGX_DECLINED) {
+        return NULL;
+    }
+
+    if (rc == NGX_OK) {
+        goto found;
+    }
+
+    /* the shard is being modified or the session has expired */
+
+    sess = NULL;
 
     ngx_shmtx_lock(&shpool->mutex);
 
-    node = cache->session_rbtree.root;
-    sentinel = cache->session_rbtree.sentinel;
+    node = shard->session_rbtree.root;
+    sentinel = shard->session_rbtree.sentinel;
 
     while (node != sentinel) {
 
@@ -3735,15 +4657,14 @@ ngx_ssl_get_cached_session(ngx_ssl_conn_t *ssl_conn,
 
                 ngx_shmtx_unlock(&shpool->mutex);
 
-                p = buf;
-                sess = d2i_SSL_SESSION(NULL, &p, slen);
-
-                return sess;
+                goto found;
             }
 
+            ngx_ssl_session_shard_write(shard);
+
             ngx_queue_remove(&sess_id->queue);
 
-            ngx_rbtree_delete(&cache->session_rbtree, node);
+            ngx_rbtree_delete(&shard->session_rbtree, node);
 
             ngx_slab_free_locked(shpool, sess_id->session);
 #if (NGX_PTR_SIZE == 4)
@@ -3751,22 +4672,136 @@ ngx_ssl_get_cached_session(ngx_ssl_conn_t *ssl_conn,
 #endif
             ngx_slab_free_locked(shpool, sess_id);
 
-            sess = NULL;
+            ngx_ssl_session_shard_unlock(shard);
 
-            goto done;
+            return NULL;
         }
 
         node = (rc < 0) ? node->left : node->right;
     }
 
-done:
-
     ngx_shmtx_unlock(&shpool->mutex);
 
+    return NULL;
+
+found:
+
+    p = buf;
+    sess = d2i_SSL_SESSION(NULL, &p, slen);
+
     return sess;
 }
 
 
+/*
+ * The optimistic lookup walks the shard rbtree without the mutex:
+ * writers keep the shard sequence number odd while they modify
+ * the shard, and the lookup is retried if the number changes.
+ * Since the nodes may be freed and reused by the slab allocator
+ * during the walk, every pointer is checked to stay within the shard
+ * pool before it is dereferenced, and the walk depth is limited.
+ */
+
+static ngx_int_t
+ngx_ssl_lookup_session(ngx_ssl_session_shard_t *shard, uint32_t hash,
+    u_char *id, size_t len, u_char *buf, size_t *slen)
+{
+    u_char             *sid, *session;
+    size_t              n;
+    time_t              now;
+    ngx_int_t           rc;
+    ngx_uint_t          tries, depth;
+    ngx_atomic_uint_t   seq;
+    ngx_slab_pool_t    *shpool;
+    ngx_rbtree_node_t  *node, *sentinel;
+    ngx_ssl_sess_id_t  *sess_id;
+
+    shpool = shard->shpool;
+    sentinel = &shard->sentinel;
+    now = ngx_time();
+
+    for (tries = 0; tries < NGX_SSL_SCACHE_READ_TRIES; tries++) {
+
+        seq = shard->seq;
+
+        if (seq & 1) {
+            ngx_cpu_pause();
+            continue;
+        }
+
+        ngx_memory_barrier();
+
+        rc = NGX_DECLINED;
+        node = shard->session_rbtree.root;
+
+        for (depth = 0; node != sentinel; depth++) {
+
+            if (depth == NGX_SSL_SCACHE_MAX_DEPTH
+                || !ngx_ssl_session_in_pool(shpool, node,
+                                            sizeof(ngx_ssl_sess_id_t)))
+            {
+                rc = NGX_AGAIN;
+                break;
+            }
+
+            if (hash < node->key) {
+                node = node->left;
+                continue;
+            }
+
+            if (hash > node->key) {
+                node = node->right;
+                continue;
+            }
+
+            /* hash == node->key */
+
+            sess_id = (ngx_ssl_sess_id_t *) node;
+
+            sid = sess_id->id;
+            n = node->data;
+
+            if (!ngx_ssl_session_in_pool(shpool, sid, n)) {
+                rc = NGX_AGAIN;
+                break;
+            }
+
+            rc = ngx_memn2cmp(id, sid, len, n);
+
+            if (rc == 0) {
+                session = sess_id->session;
+                n = sess_id->len;
+
+                if (sess_id->expire <= now
+                    || n > NGX_SSL_MAX_SESSION_SIZE
+                    || !ngx_ssl_session_in_pool(shpool, session, n))
+                {
+                    rc = NGX_AGAIN;
+                    break;
+                }
+
+                ngx_memcpy(buf, session, n);
+                *slen = n;
+
+                rc = NGX_OK;
+                break;
+            }
+
+            node = (rc < 0) ? node->left : node->right;
+            rc = NGX_DECLINED;
+        }
+
+        ngx_memory_barrier();
+
+        if (shard->seq == seq) {
+            return rc;
+        }
+    }
+
+    return NGX_AGAIN;
+}
+
+
 void
 ngx_ssl_remove_cached_session(SSL_CTX *ssl, ngx_ssl_session_t *sess)
 {
@@ -3787,6 +4822,7 @@ ngx_ssl_remove_session(SSL_CTX *ssl, ngx_ssl_session_t *sess)
     ngx_slab_pool_t          *shpool;
     ngx_rbtree_node_t        *node, *sentinel;
     ngx_ssl_sess_id_t        *sess_id;
+    ngx_ssl_session_shard_t  *shard;
     ngx_ssl_session_cache_t  *cache;
 
     shm_zone = SSL_CTX_get_ex_data(ssl, ngx_ssl_session_cache_index);
@@ -3804,12 +4840,13 @@ ngx_ssl_remove_session(SSL_CTX *ssl, ngx_ssl_session_t *sess)
     ngx_log_debug2(NGX_LOG_DEBUG_EVENT, ngx_cycle->log, 0,
                    "ssl remove session: %08XD:%ud", hash, len);
 
-    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+    shard = cache->shards[hash % cache->nshards];
+    shpool = shard->shpool;
 
-    ngx_shmtx_lock(&shpool->mutex);
+    ngx_ssl_session_shard_lock(shard);
 
-    node = cache->session_rbtree.root;
-    sentinel = cache->session_rbtree.sentinel;
+    node = shard->session_rbtree.root;
+    sentinel = shard->session_rbtree.sentinel;
 
     while (node != sentinel) {
 
@@ -3833,7 +4870,7 @@ ngx_ssl_remove_session(SSL_CTX *ssl, ngx_ssl_session_t *sess)
 
             ngx_queue_remove(&sess_id->queue);
 
-            ngx_rbtree_delete(&cache->session_rbtree, node);
+            ngx_rbtree_delete(&shard->session_rbtree, node);
 
             ngx_slab_free_locked(shpool, sess_id->session);
 #if (NGX_PTR_SIZE == 4)
@@ -3849,27 +4886,28 @@ ngx_ssl_remove_session(SSL_CTX *ssl, ngx_ssl_session_t *sess)
 
 done:
 
-    ngx_shmtx_unlock(&shpool->mutex);
+    ngx_ssl_session_shard_unlock(shard);
 }
 
 
 static void
-ngx_ssl_expire_sessions(ngx_ssl_session_cache_t *cache,
-    ngx_slab_pool_t *shpool, ngx_uint_t n)
+ngx_ssl_expire_sessions(ngx_ssl_session_shard_t *shard, ngx_uint_t n)
 {
     time_t              now;
     ngx_queue_t        *q;
+    ngx_slab_pool_t    *shpool;
     ngx_ssl_sess_id_t  *sess_id;
 
     now = ngx_time();
+    shpool = shard->shpool;
 
     while (n < 3) {
 
-        if (ngx_queue_empty(&cache->expire_queue)) {
+        if (ngx_queue_empty(&shard->expire_queue)) {
             return;
         }
 
-        q = ngx_queue_last(&cache->expire_queue);
+        q = ngx_queue_last(&shard->expire_queue);
 
         sess_id = ngx_queue_data(q, ngx_ssl_sess_id_t, queue);
 
@@ -3882,7 +4920,7 @@ ngx_ssl_expire_sessions(ngx_ssl_session_cache_t *cache,
         ngx_log_debug1(NGX_LOG_DEBUG_EVENT, ngx_cycle->log, 0,
                        "expire session: %08Xi", sess_id->node.key);
 
-        ngx_rbtree_delete(&cache->session_rbtree, &sess_id->node);
+        ngx_rbtree_delete(&shard->session_rbtree, &sess_id->node);
 
         ngx_slab_free_locked(shpool, sess_id->session);
 #if (NGX_PTR_SIZE == 4)
@@ -3948,11 +4986,42 @@ ngx_ssl_session_ticket_keys(ngx_conf_t *cf, ngx_ssl_t *ssl, ngx_array_t *paths)
     ngx_uint_t                     i;
     ngx_array_t                   *keys;
     ngx_file_info_t                fi;
-    ngx_pool_cleanup_t            *cln;
     ngx_ssl_session_ticket_key_t  *key;
 
     if (paths == NULL) {
-        return NGX_OK;
+
+        if (SSL_CTX_get_ex_data(ssl->ctx, ngx_ssl_session_cache_index) == NULL
+#ifdef SSL_OP_NO_TICKET
+            || (SSL_CTX_get_options(ssl->ctx) & SSL_OP_NO_TICKET)
+#endif
+           )
+        {
+            return NGX_OK;
+        }
+
+        /*
+         * with a shared session cache, the keys are generated in the zone
+         * and rotated every session timeout, each worker keeps a copy of
+         * the current, next, and previous keys, see
+         * ngx_ssl_rotate_ticket_keys()
+         */
+
+        keys = ngx_array_create(cf->pool, 3,
+                                sizeof(ngx_ssl_session_ticket_key_t));
+        if (keys == NULL) {
+            return NGX_ERROR;
+        }
+
+        key = ngx_array_push_n(keys, 3);
+        if (key == NULL) {
+            return NGX_ERROR;
+        }
+
+        ngx_memzero(key, 3 * sizeof(ngx_ssl_session_ticket_key_t));
+
+        key[0].shared = 1;
+
+        return ngx_ssl_set_ticket_keys(cf, ssl, keys);
     }
 
     keys = ngx_array_create(cf->pool, paths->nelts,
@@ -3961,14 +5030,6 @@ ngx_ssl_session_ticket_keys(ngx_conf_t *cf, ngx_ssl_t *ssl, ngx_array_t *paths)
         return NGX_ERROR;
     }
 
-    cln = ngx_pool_cleanup_add(cf->pool, 0);
-    if (cln == NULL) {
-        return NGX_ERROR;
-    }
-
-    cln->handler = ngx_ssl_session_ticket_keys_cleanup;
-    cln->data = keys;
-
     path = paths->elts;
     for (i = 0; i < paths->nelts; i++) {
 
@@ -4023,6 +5084,8 @@ ngx_ssl_session_ticket_keys(ngx_conf_t *cf, ngx_ssl_t *ssl, ngx_array_t *paths)
             goto failed;
         }
 
+        ngx_memzero(key, sizeof(ngx_ssl_session_ticket_key_t));
+
         if (size == 48) {
             key->size = 48;
             ngx_memcpy(key->name, buf, 16);
@@ -4044,6 +5107,34 @@ ngx_ssl_session_ticket_keys(ngx_conf_t *cf, ngx_ssl_t *ssl, ngx_array_t *paths)
         ngx_explicit_memzero(&buf, 80);
     }
 
+    return ngx_ssl_set_ticket_keys(cf, ssl, keys);
+
+failed:
+
+    if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, cf->log, ngx_errno,
+                      ngx_close_file_n " \"%V\" failed", &file.name);
+    }
+
+    ngx_explicit_memzero(&buf, 80);
+
+    return NGX_ERROR;
+}
+
+
+static ngx_int_t
+ngx_ssl_set_ticket_keys(ngx_conf_t *cf, ngx_ssl_t *ssl, ngx_array_t *keys)
+{
+    ngx_pool_cleanup_t  *cln;
+
+    cln = ngx_pool_cleanup_add(cf->pool, 0);
+    if (cln == NULL) {
+        return NGX_ERROR;
+    }
+
+    cln->handler = ngx_ssl_session_ticket_keys_cleanup;
+    cln->data = keys;
+
     if (SSL_CTX_set_ex_data(ssl->ctx, ngx_ssl_session_ticket_keys_index, keys)
         == 0)
     {
@@ -4064,17 +5155,6 @@ ngx_ssl_session_ticket_keys(ngx_conf_t *cf, ngx_ssl_t *ssl, ngx_array_t *paths)
     }
 
     return NGX_OK;
-
-failed:
-
-    if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
-        ngx_log_error(NGX_LOG_ALERT, cf->log, ngx_errno,
-                      ngx_close_file_n " \"%V\" failed", &file.name);
-    }
-
-    ngx_explicit_memzero(&buf, 80);
-
-    return NGX_ERROR;
 }
 
 
@@ -4101,6 +5181,10 @@ ngx_ssl_session_ticket_key_callback(ngx_ssl_conn_t *ssl_conn,
     digest = EVP_sha256();
 #endif
 
+    if (ngx_ssl_rotate_ticket_keys(ssl_ctx, c->log) != NGX_OK) {
+        return -1;
+    }
+
     keys = SSL_CTX_get_ex_data(ssl_ctx, ngx_ssl_session_ticket_keys_index);
     if (keys == NULL) {
         return -1;
@@ -4199,6 +5283,116 @@ ngx_ssl_session_ticket_key_callback(ngx_ssl_conn_t *ssl_conn,
 }
 
 
+static ngx_int_t
+ngx_ssl_rotate_ticket_keys(SSL_CTX *ssl_ctx, ngx_log_t *log)
+{
+    time_t                         now;
+    ngx_int_t                      rc;
+    ngx_array_t                   *keys;
+    ngx_shm_zone_t                *shm_zone;
+    ngx_slab_pool_t               *shpool;
+    ngx_ssl_session_cache_t       *cache;
+    ngx_ssl_session_ticket_key_t  *key, *shkey;
+
+    keys = SSL_CTX_get_ex_data(ssl_ctx, ngx_ssl_session_ticket_keys_index);
+    if (keys == NULL) {
+        return NGX_OK;
+    }
+
+    key = keys->elts;
+
+    now = ngx_time();
+
+    if (!key[0].shared || key[0].expire > now) {
+        return NGX_OK;
+    }
+
+    /*
+     * the local copy is out of date: the first worker to see the
+     * current key expired makes the next key current, remembers
+     * the current one as previous, and generates a new next key;
+     * the next key is known to all workers before it is used
+     * for encryption, so tickets can be decrypted by workers
+     * which have not yet synced
+     */
+
+    shm_zone = SSL_CTX_get_ex_data(ssl_ctx, ngx_ssl_session_cache_index);
+
+    cache = shm_zone->data;
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    shkey = cache->ticket_keys;
+
+    rc = NGX_OK;
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    if (shkey[0].expire == 0) {
+
+        if (ngx_ssl_generate_ticket_key(&shkey[0], log) != NGX_OK
+            || ngx_ssl_generate_ticket_key(&shkey[1], log) != NGX_OK)
+        {
+            shkey[0].expire = 0;
+            rc = NGX_ERROR;
+            goto done;
+        }
+
+        shkey[2] = shkey[1];
+        shkey[0].expire = now + SSL_CTX_get_timeout(ssl_ctx);
+
+        ngx_log_debug2(NGX_LOG_DEBUG_EVENT, log, 0,
+                       "ssl session ticket keys created, key: \"%*xs\"",
+                       (size_t) 16, shkey[0].name);
+
+    } else if (shkey[0].expire <= now) {
+
+        shkey[2] = shkey[0];
+        shkey[0] = shkey[1];
+
+        if (ngx_ssl_generate_ticket_key(&shkey[1], log) != NGX_OK) {
+            shkey[1] = shkey[0];
+        }
+
+        shkey[0].expire = now + SSL_CTX_get_timeout(ssl_ctx);
+
+        ngx_log_error(NGX_LOG_INFO, log, 0,
+                      "ssl session ticket keys rotated%s", shpool->log_ctx);
+    }
+
+    ngx_memcpy(key, shkey, 3 * sizeof(ngx_ssl_session_ticket_key_t));
+
+done:
+
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    return rc;
+}
+
+
+static ngx_int_t
+ngx_ssl_generate_ticket_key(ngx_ssl_session_ticket_key_t *key, ngx_log_t *log)
+{
+    u_char  buf[80];
+
+    if (RAND_bytes(buf, 80) != 1) {
+        ngx_ssl_error(NGX_LOG_ALERT, log, 0, "RAND_bytes() failed");
+        return NGX_ERROR;
+    }
+
+    key->size = 80;
+    key->shared = 1;
+    key->expire = 0;
+
+    ngx_memcpy(key->name, buf, 16);
+    ngx_memcpy(key->hmac_key, buf + 16, 32);
+    ngx_memcpy(key->aes_key, buf + 48, 32);
+
+    ngx_explicit_memzero(&buf, 80);
+
+    return NGX_OK;
+}
+
+
 static void
 ngx_ssl_session_ticket_keys_cleanup(void *data)
 {
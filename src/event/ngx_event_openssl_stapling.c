@@ -14,6 +14,37 @@
 #if (!defined OPENSSL_NO_OCSP && defined SSL_CTRL_SET_TLSEXT_STATUS_REQ_CB)
 
 
+#define NGX_SSL_STAPLING_PREFETCH_CONNS     16
+#define NGX_SSL_STAPLING_PREFETCH_INTERVAL  60000
+
+
+typedef struct {
+    ngx_rbtree_t                 rbtree;
+    ngx_rbtree_node_t            sentinel;
+    ngx_queue_t                  queue;
+} ngx_ssl_stapling_cache_sh_t;
+
+
+typedef struct {
+    ngx_ssl_stapling_cache_sh_t *sh;
+    ngx_slab_pool_t             *shpool;
+
+    /* staples fetched by the first worker process */
+    ngx_array_t                  staples;
+    ngx_uint_t                   loading;
+    ngx_event_t                  event;
+} ngx_ssl_stapling_cache_t;
+
+
+typedef struct {
+    ngx_str_node_t               node;
+    ngx_queue_t                  queue;
+    time_t                       valid;
+    time_t                       refresh;
+    ngx_str_t                    staple;
+} ngx_ssl_stapling_cache_node_t;
+
+
 typedef struct {
     ngx_str_t                    staple;
     ngx_msec_t                   timeout;
@@ -38,6 +69,9 @@ typedef struct {
     time_t                       valid;
     time_t                       refresh;
 
+    ngx_ssl_stapling_cache_t    *cache;
+    ngx_str_t                    key;
+
     unsigned                     verify:1;
     unsigned                     loading:1;
 } ngx_ssl_stapling_t;
@@ -157,6 +191,12 @@ static int ngx_ssl_certificate_status_callback(ngx_ssl_conn_t *ssl_conn,
 static void ngx_ssl_stapling_update(ngx_ssl_stapling_t *staple);
 static void ngx_ssl_stapling_ocsp_handler(ngx_ssl_ocsp_ctx_t *ctx);
 
+static void ngx_ssl_stapling_prefetch_handler(ngx_event_t *ev);
+static ngx_int_t ngx_ssl_stapling_cache_lookup(ngx_ssl_stapling_t *staple,
+    ngx_ssl_conn_t *ssl_conn, ngx_log_t *log);
+static void ngx_ssl_stapling_cache_store(ngx_ssl_stapling_t *staple,
+    ngx_log_t *log);
+
 static time_t ngx_ssl_stapling_time(ASN1_GENERALIZEDTIME *asn1time);
 
 static void ngx_ssl_stapling_cleanup(void *data);
@@ -589,6 +629,11 @@ ngx_ssl_certificate_status_callback(ngx_ssl_conn_t *ssl_conn, void *data)
         return rc;
     }
 
+    if (staple->cache) {
+        /* the response is fetched by the first worker process */
+        return ngx_ssl_stapling_cache_lookup(staple, ssl_conn, c->log);
+    }
+
     if (staple->staple.len
         && staple->valid >= ngx_time())
     {
@@ -704,6 +749,11 @@ ngx_ssl_stapling_ocsp_handler(ngx_ssl_ocsp_ctx_t *ctx)
     staple->loading = 0;
     staple->refresh = ngx_max(ngx_min(ctx->valid - 300, now + 3600), now + 300);
 
+    if (staple->cache) {
+        staple->cache->loading--;
+        ngx_ssl_stapling_cache_store(staple, ctx->log);
+    }
+
     ngx_ssl_ocsp_done(ctx);
     return;
 
@@ -712,10 +762,386 @@ error:
     staple->loading = 0;
     staple->refresh = now + 300;
 
+    if (staple->cache) {
+        staple->cache->loading--;
+    }
+
     ngx_ssl_ocsp_done(ctx);
 }
 
 
+ngx_int_t
+ngx_ssl_stapling_cache(ngx_conf_t *cf, ngx_ssl_t *ssl, ngx_shm_zone_t *shm_zone)
+{
+    X509                      *cert;
+    unsigned int               len;
+    ngx_ssl_stapling_t        *staple, **sp;
+    ngx_ssl_stapling_cache_t  *cache;
+
+    cache = shm_zone->data;
+
+    if (cache == NULL) {
+        cache = ngx_pcalloc(cf->pool, sizeof(ngx_ssl_stapling_cache_t));
+        if (cache == NULL) {
+            return NGX_ERROR;
+        }
+
+        if (ngx_array_init(&cache->staples, cf->pool, 4,
+                           sizeof(ngx_ssl_stapling_t *))
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+        shm_zone->data = cache;
+    }
+
+    for (cert = SSL_CTX_get_ex_data(ssl->ctx, ngx_ssl_certificate_index);
+         cert;
+         cert = X509_get_ex_data(cert, ngx_ssl_next_certificate_index))
+    {
+        staple = X509_get_ex_data(cert, ngx_ssl_stapling_index);
+
+        if (staple == NULL || staple->host.len == 0) {
+            /* no responder or the response is loaded from a file */
+            continue;
+        }
+
+        staple->key.data = ngx_pnalloc(cf->pool, EVP_MAX_MD_SIZE);
+        if (staple->key.data == NULL) {
+            return NGX_ERROR;
+        }
+
+        if (X509_digest(cert, EVP_sha1(), staple->key.data, &len) == 0) {
+            ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0,
+                          "X509_digest() failed");
+            return NGX_ERROR;
+        }
+
+        staple->key.len = len;
+        staple->cache = cache;
+
+        sp = ngx_array_push(&cache->staples);
+        if (sp == NULL) {
+            return NGX_ERROR;
+        }
+
+        *sp = staple;
+    }
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_ssl_stapling_cache_init(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_ssl_stapling_cache_t  *ocache = data;
+
+    size_t                     len;
+    ngx_slab_pool_t           *shpool;
+    ngx_ssl_stapling_cache_t  *cache;
+
+    cache = shm_zone->data;
+
+    if (cache == NULL) {
+        /* not used by any server */
+        return NGX_OK;
+    }
+
+    if (ocache) {
+        cache->sh = ocache->sh;
+        cache->shpool = ocache->shpool;
+        return NGX_OK;
+    }
+
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    cache->shpool = shpool;
+
+    if (shm_zone->shm.exists || shpool->data) {
+        cache->sh = shpool->data;
+        return NGX_OK;
+    }
+
+    cache->sh = ngx_slab_alloc(shpool, sizeof(ngx_ssl_stapling_cache_sh_t));
+    if (cache->sh == NULL) {
+        return NGX_ERROR;
+    }
+
+    shpool->data = cache->sh;
+
+    ngx_rbtree_init(&cache->sh->rbtree, &cache->sh->sentinel,
+                    ngx_str_rbtree_insert_value);
+
+    ngx_queue_init(&cache->sh->queue);
+
+    len = sizeof(" in OCSP stapling cache \"\"") + shm_zone->shm.name.len;
+
+    shpool->log_ctx = ngx_slab_alloc(shpool, len);
+    if (shpool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(shpool->log_ctx, " in OCSP stapling cache \"%V\"%Z",
+                &shm_zone->shm.name);
+
+    shpool->log_nomem = 0;
+
+    return NGX_OK;
+}
+
+
+/*
+ * Staples in shared caches are fetched by the first worker process only,
+ * starting as soon as it is started, and other workers take them from
+ * the cache.  Since the cache zone is kept on reload, the responses are
+ * available to the new workers right away.
+ */
+
+ngx_int_t
+ngx_ssl_stapling_init_worker(ngx_cycle_t *cycle)
+{
+    ngx_uint_t                 i;
+    ngx_shm_zone_t            *shm_zone;
+    ngx_list_part_t           *part;
+    ngx_ssl_stapling_cache_t  *cache;
+
+    if ((ngx_process != NGX_PROCESS_WORKER
+         && ngx_process != NGX_PROCESS_SINGLE)
+        || ngx_worker != 0)
+    {
+        return NGX_OK;
+    }
+
+    part = &cycle->shared_memory.part;
+    shm_zone = part->elts;
+
+    for (i = 0; /* void */ ; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+            part = part->next;
+            shm_zone = part->elts;
+            i = 0;
+        }
+
+        if (shm_zone[i].init != ngx_ssl_stapling_cache_init
+            || shm_zone[i].data == NULL)
+        {
+            continue;
+        }
+
+        cache = shm_zone[i].data;
+
+        if (cache->event.handler) {
+            continue;
+        }
+
+        cache->event.handler = ngx_ssl_stapling_prefetch_handler;
+        cache->event.data = cache;
+        cache->event.log = cycle->log;
+        cache->event.cancelable = 1;
+
+        ngx_add_timer(&cache->event, 1);
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_ssl_stapling_prefetch_handler(ngx_event_t *ev)
+{
+    time_t                          now;
+    uint32_t                        hash;
+    ngx_msec_t                      timer;
+    ngx_uint_t                      i;
+    ngx_ssl_stapling_t             *staple, **sp;
+    ngx_ssl_stapling_cache_t       *cache;
+    ngx_ssl_stapling_cache_node_t  *node;
+
+    if (ngx_exiting) {
+        return;
+    }
+
+    cache = ev->data;
+    now = ngx_time();
+    timer = NGX_SSL_STAPLING_PREFETCH_INTERVAL;
+
+    sp = cache->staples.elts;
+
+    for (i = 0; i < cache->staples.nelts; i++) {
+        staple = sp[i];
+
+        if (staple->loading || staple->refresh >= now) {
+            continue;
+        }
+
+        /* the response may be left by the previous worker processes */
+
+        hash = ngx_crc32_short(staple->key.data, staple->key.len);
+
+        ngx_shmtx_lock(&cache->shpool->mutex);
+
+        node = (ngx_ssl_stapling_cache_node_t *)
+                   ngx_str_rbtree_lookup(&cache->sh->rbtree, &staple->key,
+                                         hash);
+
+        if (node && node->refresh > now) {
+            staple->refresh = node->refresh;
+            ngx_shmtx_unlock(&cache->shpool->mutex);
+            continue;
+        }
+
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+
+        if (cache->loading == NGX_SSL_STAPLING_PREFETCH_CONNS) {
+            timer = 1000;
+            break;
+        }
+
+        ngx_log_debug1(NGX_LOG_DEBUG_EVENT, ev->log, 0,
+                       "ssl stapling prefetch \"%s\"", staple->name);
+
+        cache->loading++;
+
+        ngx_ssl_stapling_update(staple);
+    }
+
+    ngx_add_timer(ev, timer);
+}
+
+
+static ngx_int_t
+ngx_ssl_stapling_cache_lookup(ngx_ssl_stapling_t *staple,
+    ngx_ssl_conn_t *ssl_conn, ngx_log_t *log)
+{
+    u_char                         *p;
+    uint32_t                        hash;
+    ngx_slab_pool_t                *shpool;
+    ngx_ssl_stapling_cache_t       *cache;
+    ngx_ssl_stapling_cache_node_t  *node;
+
+    cache = staple->cache;
+    shpool = cache->shpool;
+
+    hash = ngx_crc32_short(staple->key.data, staple->key.len);
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    node = (ngx_ssl_stapling_cache_node_t *)
+               ngx_str_rbtree_lookup(&cache->sh->rbtree, &staple->key, hash);
+
+    if (node == NULL || node->valid < ngx_time()) {
+        ngx_shmtx_unlock(&shpool->mutex);
+
+        ngx_log_debug0(NGX_LOG_DEBUG_EVENT, log, 0,
+                       "ssl stapling cache miss");
+
+        return SSL_TLSEXT_ERR_NOACK;
+    }
+
+    /* we have to copy ocsp response as OpenSSL will free it by itself */
+
+    p = OPENSSL_malloc(node->staple.len);
+    if (p == NULL) {
+        ngx_shmtx_unlock(&shpool->mutex);
+        ngx_ssl_error(NGX_LOG_ALERT, log, 0, "OPENSSL_malloc() failed");
+        return SSL_TLSEXT_ERR_NOACK;
+    }
+
+    ngx_memcpy(p, node->staple.data, node->staple.len);
+
+    SSL_set_tlsext_status_ocsp_resp(ssl_conn, p, node->staple.len);
+
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    ngx_log_debug0(NGX_LOG_DEBUG_EVENT, log, 0, "ssl stapling cache hit");
+
+    return SSL_TLSEXT_ERR_OK;
+}
+
+
+static void
+ngx_ssl_stapling_cache_store(ngx_ssl_stapling_t *staple, ngx_log_t *log)
+{
+    size_t                          size;
+    uint32_t                        hash;
+    ngx_queue_t                    *q;
+    ngx_slab_pool_t                *shpool;
+    ngx_ssl_stapling_cache_t       *cache;
+    ngx_ssl_stapling_cache_node_t  *node;
+
+    cache = staple->cache;
+    shpool = cache->shpool;
+
+    hash = ngx_crc32_short(staple->key.data, staple->key.len);
+    size = sizeof(ngx_ssl_stapling_cache_node_t) + staple->key.len
+           + staple->staple.len;
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    node = (ngx_ssl_stapling_cache_node_t *)
+               ngx_str_rbtree_lookup(&cache->sh->rbtree, &staple->key, hash);
+
+    if (node) {
+        ngx_rbtree_delete(&cache->sh->rbtree, &node->node.node);
+        ngx_queue_remove(&node->queue);
+        ngx_slab_free_locked(shpool, node);
+    }
+
+    node = ngx_slab_alloc_locked(shpool, size);
+
+    if (node == NULL) {
+
+        /* drop the oldest response, e.g., of a removed certificate */
+
+        if (!ngx_queue_empty(&cache->sh->queue)) {
+            q = ngx_queue_last(&cache->sh->queue);
+            node = ngx_queue_data(q, ngx_ssl_stapling_cache_node_t, queue);
+
+            ngx_rbtree_delete(&cache->sh->rbtree, &node->node.node);
+            ngx_queue_remove(q);
+            ngx_slab_free_locked(shpool, node);
+
+            node = ngx_slab_alloc_locked(shpool, size);
+        }
+
+        if (node == NULL) {
+            ngx_shmtx_unlock(&shpool->mutex);
+            ngx_log_error(NGX_LOG_ALERT, log, 0,
+                          "could not allocate new entry%s", shpool->log_ctx);
+            return;
+        }
+    }
+
+    node->node.str.len = staple->key.len;
+    node->node.str.data = (u_char *) node
+                          + sizeof(ngx_ssl_stapling_cache_node_t);
+    ngx_memcpy(node->node.str.data, staple->key.data, staple->key.len);
+    node->node.node.key = hash;
+
+    node->staple.len = staple->staple.len;
+    node->staple.data = node->node.str.data + staple->key.len;
+    ngx_memcpy(node->staple.data, staple->staple.data, staple->staple.len);
+
+    node->valid = staple->valid;
+    node->refresh = staple->refresh;
+
+    ngx_rbtree_insert(&cache->sh->rbtree, &node->node.node);
+    ngx_queue_insert_head(&cache->sh->queue, &node->queue);
+
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, log, 0,
+                   "ssl stapling cache store, valid:%T",
+                   staple->valid - ngx_time());
+}
+
+
 static time_t
 ngx_ssl_stapling_time(ASN1_GENERALIZEDTIME *asn1time)
 {
@@ -2729,6 +3155,27 @@ ngx_ssl_stapling_resolver(ngx_conf_t *cf, ngx_ssl_t *ssl,
 }
 
 
+ngx_int_t
+ngx_ssl_stapling_cache(ngx_conf_t *cf, ngx_ssl_t *ssl, ngx_shm_zone_t *shm_zone)
+{
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_ssl_stapling_cache_init(ngx_shm_zone_t *shm_zone, void *data)
+{
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_ssl_stapling_init_worker(ngx_cycle_t *cycle)
+{
+    return NGX_OK;
+}
+
+
 ngx_int_t
 ngx_ssl_ocsp(ngx_conf_t *cf, ngx_ssl_t *ssl, ngx_str_t *responder,
     ngx_uint_t depth, ngx_shm_zone_t *shm_zone)
@@ -10,9 +10,66 @@
 #include <ngx_event.h>
 
 
+/*
+ * The hierarchical timing wheel: the first level has 256 slots of one
+ * millisecond, each of the next four levels has 64 slots that are
+ * 64 times wider than the slots of the previous level, so the wheel
+ * covers 2^32 milliseconds.  A timer is linked to the slot of the lowest
+ * level that is able to hold it, and is moved down a level each time
+ * the lower levels wrap around.  The slots of all levels are numbered
+ * contiguously, and a bitmap of the non-empty slots allows to skip empty
+ * slots quickly.  The last slot holds timers that have already expired.
+ *
+ * The timer rbtree node is reused as a list link: "left" and "right" are
+ * the previous and the next nodes, "parent" is the slot head.
+ */
+
+#define NGX_TIMER_WHEEL_LEVELS    5
+#define NGX_TIMER_WHEEL_BITS0     8
+#define NGX_TIMER_WHEEL_BITS      6
+#define NGX_TIMER_WHEEL_SIZE0     (1 << NGX_TIMER_WHEEL_BITS0)
+#define NGX_TIMER_WHEEL_SIZE      (1 << NGX_TIMER_WHEEL_BITS)
+#define NGX_TIMER_WHEEL_MASK0     (NGX_TIMER_WHEEL_SIZE0 - 1)
+#define NGX_TIMER_WHEEL_MASK      (NGX_TIMER_WHEEL_SIZE - 1)
+
+#define NGX_TIMER_WHEEL_EXPIRED                                               \
+    (NGX_TIMER_WHEEL_SIZE0 + (NGX_TIMER_WHEEL_LEVELS - 1) * NGX_TIMER_WHEEL_SIZE)
+
+#define NGX_TIMER_WHEEL_SLOTS     (NGX_TIMER_WHEEL_EXPIRED + 1)
+
+#define ngx_event_timer_wheel_shift(level)                                    \
+    (NGX_TIMER_WHEEL_BITS0 + ((level) - 1) * NGX_TIMER_WHEEL_BITS)
+
+#define ngx_event_timer_wheel_base(level)                                     \
+    (NGX_TIMER_WHEEL_SIZE0 + ((level) - 1) * NGX_TIMER_WHEEL_SIZE)
+
+#define ngx_event_timer_wheel_empty(n)                                        \
+    (wheel.slots[n].right == &wheel.slots[n])
+
+
+typedef struct {
+    /* the next tick to process, all earlier ticks are already processed */
+    ngx_msec_t          current;
+
+    uint64_t            bitmap[(NGX_TIMER_WHEEL_SLOTS + 63) / 64];
+    ngx_rbtree_node_t   slots[NGX_TIMER_WHEEL_SLOTS];
+} ngx_event_timer_wheel_t;
+
+
+static void ngx_event_timer_wheel_init(void);
+static ngx_msec_t ngx_event_timer_wheel_find(void);
+static void ngx_event_timer_wheel_expire(void);
+static ngx_int_t ngx_event_timer_wheel_no_timers_left(void);
+static void ngx_event_timer_wheel_cascade(ngx_uint_t level, ngx_uint_t n);
+static ngx_uint_t ngx_event_timer_wheel_next(ngx_uint_t from, ngx_uint_t to);
+
+
 ngx_rbtree_t              ngx_event_timer_rbtree;
 static ngx_rbtree_node_t  ngx_event_timer_sentinel;
 
+ngx_uint_t                ngx_event_timer_wheel;
+static ngx_event_timer_wheel_t  wheel;
+
 /*
  * the event timer rbtree may contain the duplicate keys, however,
  * it should not be a problem, because we use the rbtree to find
@@ -22,6 +79,11 @@ static ngx_rbtree_node_t  ngx_event_timer_sentinel;
 ngx_int_t
 ngx_event_timer_init(ngx_log_t *log)
 {
+    if (ngx_event_timer_wheel) {
+        ngx_event_timer_wheel_init();
+        return NGX_OK;
+    }
+
     ngx_rbtree_init(&ngx_event_timer_rbtree, &ngx_event_timer_sentinel,
                     ngx_rbtree_insert_timer_value);
 
@@ -35,6 +97,10 @@ ngx_event_find_timer(void)
     ngx_msec_int_t      timer;
     ngx_rbtree_node_t  *node, *root, *sentinel;
 
+    if (ngx_event_timer_wheel) {
+        return ngx_event_timer_wheel_find();
+    }
+
     if (ngx_event_timer_rbtree.root == &ngx_event_timer_sentinel) {
         return NGX_TIMER_INFINITE;
     }
@@ -56,6 +122,11 @@ ngx_event_expire_timers(void)
     ngx_event_t        *ev;
     ngx_rbtree_node_t  *node, *root, *sentinel;
 
+    if (ngx_event_timer_wheel) {
+        ngx_event_timer_wheel_expire();
+        return;
+    }
+
     sentinel = ngx_event_timer_rbtree.sentinel;
 
     for ( ;; ) {
@@ -102,6 +173,10 @@ ngx_event_no_timers_left(void)
     ngx_event_t        *ev;
     ngx_rbtree_node_t  *node, *root, *sentinel;
 
+    if (ngx_event_timer_wheel) {
+        return ngx_event_timer_wheel_no_timers_left();
+    }
+
     sentinel = ngx_event_timer_rbtree.sentinel;
     root = ngx_event_timer_rbtree.root;
 
@@ -124,3 +199,339 @@ ngx_event_no_timers_left(void)
 
     return NGX_OK;
 }
+
+
+static void
+ngx_event_timer_wheel_init(void)
+{
+    ngx_uint_t  n;
+
+    ngx_memzero(wheel.bitmap, sizeof(wheel.bitmap));
+
+    for (n = 0; n < NGX_TIMER_WHEEL_SLOTS; n++) {
+        wheel.slots[n].left = &wheel.slots[n];
+        wheel.slots[n].right = &wheel.slots[n];
+    }
+
+    wheel.current = ngx_current_msec;
+}
+
+
+void
+ngx_event_timer_wheel_insert(ngx_rbtree_node_t *node)
+{
+    ngx_msec_t          key;
+    ngx_uint_t          n, level;
+    ngx_msec_int_t      diff;
+    ngx_rbtree_node_t  *head;
+
+    key = node->key;
+    diff = (ngx_msec_int_t) (key - wheel.current);
+
+    if (diff < 0) {
+        n = NGX_TIMER_WHEEL_EXPIRED;
+
+    } else if (diff < NGX_TIMER_WHEEL_SIZE0) {
+        n = key & NGX_TIMER_WHEEL_MASK0;
+
+    } else {
+
+        if ((uint64_t) diff > 0xffffffff) {
+
+            /* the timer is beyond the wheel, it is moved down later */
+
+            key = wheel.current + 0xffffffff;
+            level = NGX_TIMER_WHEEL_LEVELS - 1;
+
+        } else {
+            for (level = 1; level < NGX_TIMER_WHEEL_LEVELS - 1; level++) {
+                if ((ngx_msec_t) diff
+                    < (ngx_msec_t) 1 << ngx_event_timer_wheel_shift(level + 1))
+                {
+                    break;
+                }
+            }
+        }
+
+        n = ngx_event_timer_wheel_base(level)
+            + ((key >> ngx_event_timer_wheel_shift(level))
+               & NGX_TIMER_WHEEL_MASK);
+    }
+
+    head = &wheel.slots[n];
+
+    node->parent = head;
+    node->left = head->left;
+    node->right = head;
+    head->left->right = node;
+    head->left = node;
+
+    wheel.bitmap[n / 64] |= (uint64_t) 1 << (n % 64);
+}
+
+
+void
+ngx_event_timer_wheel_delete(ngx_rbtree_node_t *node)
+{
+    ngx_uint_t          n;
+    ngx_rbtree_node_t  *head;
+
+    node->left->right = node->right;
+    node->right->left = node->left;
+
+    head = node->parent;
+
+    if (head->right == head) {
+        n = head - wheel.slots;
+        wheel.bitmap[n / 64] &= ~((uint64_t) 1 << (n % 64));
+    }
+}
+
+
+static ngx_msec_t
+ngx_event_timer_wheel_find(void)
+{
+    ngx_msec_t      tick, min, mask;
+    ngx_uint_t      n, i, cur, base, level, shift;
+    ngx_msec_int_t  timer;
+
+    if (!ngx_event_timer_wheel_empty(NGX_TIMER_WHEEL_EXPIRED)) {
+        return 0;
+    }
+
+    cur = wheel.current & NGX_TIMER_WHEEL_MASK0;
+
+    n = ngx_event_timer_wheel_next(cur, NGX_TIMER_WHEEL_SIZE0);
+
+    if (n != NGX_TIMER_WHEEL_SIZE0) {
+        tick = wheel.current + (n - cur);
+        goto found;
+    }
+
+    min = NGX_TIMER_INFINITE;
+
+    /* the first slots will be reached after the lowest level wraps around */
+
+    if (ngx_event_timer_wheel_next(0, cur) != cur) {
+        min = (wheel.current | NGX_TIMER_WHEEL_MASK0) + 1;
+    }
+
+    for (level = 1; level < NGX_TIMER_WHEEL_LEVELS; level++) {
+
+        shift = ngx_event_timer_wheel_shift(level);
+        base = ngx_event_timer_wheel_base(level);
+
+        if (wheel.bitmap[base / 64] == 0) {
+            continue;
+        }
+
+        cur = (wheel.current >> shift) & NGX_TIMER_WHEEL_MASK;
+        mask = ((ngx_msec_t) 1 << shift) - 1;
+
+        if ((wheel.current & mask) == 0
+            && !ngx_event_timer_wheel_empty(base + cur))
+        {
+            /* the slot is cascaded on the current tick */
+            tick = wheel.current;
+
+        } else {
+            for (i = 1; i < NGX_TIMER_WHEEL_SIZE; i++) {
+                if (!ngx_event_timer_wheel_empty(
+                                 base + ((cur + i) & NGX_TIMER_WHEEL_MASK)))
+                {
+                    break;
+                }
+            }
+
+            tick = ((wheel.current >> shift) + i) << shift;
+        }
+
+        if (min == NGX_TIMER_INFINITE || (ngx_msec_int_t) (tick - min) < 0) {
+            min = tick;
+        }
+    }
+
+    if (min == NGX_TIMER_INFINITE) {
+        return NGX_TIMER_INFINITE;
+    }
+
+    tick = min;
+
+found:
+
+    timer = (ngx_msec_int_t) (tick - ngx_current_msec);
+
+    return (ngx_msec_t) (timer > 0 ? timer : 0);
+}
+
+
+static void
+ngx_event_timer_wheel_expire(void)
+{
+    ngx_msec_t          next, limit;
+    ngx_uint_t          n, level;
+    ngx_event_t        *ev;
+    ngx_rbtree_node_t  *head, *node;
+
+    n = NGX_TIMER_WHEEL_EXPIRED;
+
+    for ( ;; ) {
+
+        /* the expired slot is processed before each tick */
+
+        head = &wheel.slots[n];
+
+        while (head->right != head) {
+            node = head->right;
+
+            ev = (ngx_event_t *) ((char *) node - offsetof(ngx_event_t, timer));
+
+            ngx_log_debug2(NGX_LOG_DEBUG_EVENT, ev->log, 0,
+                           "event timer del: %d: %M",
+                           ngx_event_ident(ev->data), ev->timer.key);
+
+            ngx_event_timer_wheel_delete(node);
+
+#if (NGX_DEBUG)
+            ev->timer.left = NULL;
+            ev->timer.right = NULL;
+            ev->timer.parent = NULL;
+#endif
+
+            ev->timer_set = 0;
+
+            ev->timedout = 1;
+
+            ev->handler(ev);
+        }
+
+        if (n == NGX_TIMER_WHEEL_EXPIRED) {
+
+            if ((ngx_msec_int_t) (ngx_current_msec - wheel.current) < 0) {
+                return;
+            }
+
+            n = wheel.current & NGX_TIMER_WHEEL_MASK0;
+
+            if (n == 0) {
+
+                /* the lowest level wrapped around, move timers down */
+
+                for (level = 1; level < NGX_TIMER_WHEEL_LEVELS; level++) {
+                    n = (wheel.current >> ngx_event_timer_wheel_shift(level))
+                        & NGX_TIMER_WHEEL_MASK;
+
+                    ngx_event_timer_wheel_cascade(level, n);
+
+                    if (n != 0) {
+                        break;
+                    }
+                }
+
+                n = 0;
+            }
+
+            continue;
+        }
+
+        /* skip empty slots up to the next wrap or the current time */
+
+        limit = (wheel.current | NGX_TIMER_WHEEL_MASK0) + 1;
+
+        if ((ngx_msec_int_t) (limit - ngx_current_msec) > 0) {
+            limit = ngx_current_msec + 1;
+        }
+
+        next = wheel.current
+               + ngx_event_timer_wheel_next(n + 1, NGX_TIMER_WHEEL_SIZE0) - n;
+
+        wheel.current = ((ngx_msec_int_t) (next - limit) < 0) ? next : limit;
+
+        n = NGX_TIMER_WHEEL_EXPIRED;
+    }
+}
+
+
+static void
+ngx_event_timer_wheel_cascade(ngx_uint_t level, ngx_uint_t n)
+{
+    ngx_rbtree_node_t  *head, *node, *next;
+
+    n += ngx_event_timer_wheel_base(level);
+
+    head = &wheel.slots[n];
+
+    if (head->right == head) {
+        return;
+    }
+
+    node = head->right;
+    head->left->right = NULL;
+
+    head->left = head;
+    head->right = head;
+    wheel.bitmap[n / 64] &= ~((uint64_t) 1 << (n % 64));
+
+    while (node) {
+        next = node->right;
+        ngx_event_timer_wheel_insert(node);
+        node = next;
+    }
+}
+
+
+static ngx_uint_t
+ngx_event_timer_wheel_next(ngx_uint_t from, ngx_uint_t to)
+{
+    uint64_t  word;
+
+    /* returns the first non-empty slot in [from, to), or "to" */
+
+    while (from < to) {
+        word = wheel.bitmap[from / 64] >> (from % 64);
+
+        if (word == 0) {
+            from = (from | 63) + 1;
+            continue;
+        }
+
+        while ((word & 1) == 0) {
+            word >>= 1;
+            from++;
+        }
+
+        return ngx_min(from, to);
+    }
+
+    return to;
+}
+
+
+static ngx_int_t
+ngx_event_timer_wheel_no_timers_left(void)
+{
+    ngx_uint_t          n;
+    ngx_event_t        *ev;
+    ngx_rbtree_node_t  *head, *node;
+
+    for (n = 0; n < NGX_TIMER_WHEEL_SLOTS; n++) {
+
+        if (!(wheel.bitmap[n / 64] & ((uint64_t) 1 << (n % 64)))) {
+            continue;
+        }
+
+        head = &wheel.slots[n];
+
+        for (node = head->right; node != head; node = node->right) {
+            ev = (ngx_event_t *) ((char *) node - offsetof(ngx_event_t, timer));
+
+            if (!ev->cancelable) {
+                return NGX_AGAIN;
+            }
+        }
+    }
+
+    /* only cancelable timers left */
+
+    return NGX_OK;
+}
@@ -12,11 +12,16 @@
 
 #if !(NGX_WIN32)
 
-struct ngx_udp_connection_s {
-    ngx_rbtree_node_t   node;
-    ngx_connection_t   *connection;
-    ngx_buf_t          *buffer;
-};
+/*
+ * with UDP_GRO, recvmsg() may return several datagrams of the same
+ * size from one source, the size is passed in a control message
+ */
+
+#if (NGX_HAVE_UDP_GRO)
+#define NGX_UDP_GRO_CMSG_SPACE  CMSG_SPACE(sizeof(int))
+#else
+#define NGX_UDP_GRO_CMSG_SPACE  0
+#endif
 
 
 static void ngx_close_accepted_udp_connection(ngx_connection_t *c);
@@ -26,12 +31,18 @@ static ngx_int_t ngx_insert_udp_connection(ngx_connection_t *c);
 static ngx_connection_t *ngx_lookup_udp_connection(ngx_listening_t *ls,
     struct sockaddr *sockaddr, socklen_t socklen,
     struct sockaddr *local_sockaddr, socklen_t local_socklen);
+#if (NGX_QUIC)
+static ngx_connection_t *ngx_lookup_udp_connection_id(ngx_listening_t *ls,
+    ngx_str_t *key);
+#endif
 
 
 void
 ngx_event_recvmsg(ngx_event_t *ev)
 {
+    size_t             size;
     ssize_t            n;
+    u_char            *data;
     ngx_buf_t          buf;
     ngx_log_t         *log;
     ngx_err_t          err;
@@ -49,15 +60,22 @@ ngx_event_recvmsg(ngx_event_t *ev)
 #if (NGX_HAVE_MSGHDR_MSG_CONTROL)
 
 #if (NGX_HAVE_IP_RECVDSTADDR)
-    u_char             msg_control[CMSG_SPACE(sizeof(struct in_addr))];
+    u_char             msg_control[CMSG_SPACE(sizeof(struct in_addr))
+                                   + NGX_UDP_GRO_CMSG_SPACE];
 #elif (NGX_HAVE_IP_PKTINFO)
-    u_char             msg_control[CMSG_SPACE(sizeof(struct in_pktinfo))];
+    u_char             msg_control[CMSG_SPACE(sizeof(struct in_pktinfo))
+                                   + NGX_UDP_GRO_CMSG_SPACE];
 #endif
 
 #if (NGX_HAVE_INET6 && NGX_HAVE_IPV6_RECVPKTINFO)
-    u_char             msg_control6[CMSG_SPACE(sizeof(struct in6_pktinfo))];
+    u_char             msg_control6[CMSG_SPACE(sizeof(struct in6_pktinfo))
+                                    + NGX_UDP_GRO_CMSG_SPACE];
+#endif
+
 #endif
 
+#if (NGX_HAVE_UDP_GRO)
+    int                segment;
 #endif
 
     if (ev->timedout) {
@@ -111,6 +129,13 @@ ngx_event_recvmsg(ngx_event_t *ev)
 #endif
         }
 
+#if (NGX_HAVE_UDP_GRO)
+        else {
+            msg.msg_control = &msg_control;
+            msg.msg_controllen = sizeof(msg_control);
+        }
+#endif
+
 #endif
 
         n = recvmsg(lc->fd, &msg, 0);
@@ -229,8 +254,67 @@ ngx_event_recvmsg(ngx_event_t *ev)
 
 #endif
 
-        c = ngx_lookup_udp_connection(ls, sockaddr, socklen, local_sockaddr,
-                                      local_socklen);
+        data = buffer;
+        size = n;
+
+#if (NGX_HAVE_UDP_GRO)
+
+        segment = 0;
+
+        if (msg.msg_control) {
+            struct cmsghdr  *cmsg;
+
+            for (cmsg = CMSG_FIRSTHDR(&msg);
+                 cmsg != NULL;
+                 cmsg = CMSG_NXTHDR(&msg, cmsg))
+            {
+                if (cmsg->cmsg_level == SOL_UDP
+                    && cmsg->cmsg_type == UDP_GRO)
+                {
+                    ngx_memcpy(&segment, CMSG_DATA(cmsg), sizeof(int));
+                    break;
+                }
+            }
+        }
+
+        if (segment > 0 && segment < n) {
+            ngx_log_debug2(NGX_LOG_DEBUG_EVENT, ev->log, 0,
+                           "recvmsg: %z bytes in %d byte segments",
+                           n, segment);
+
+            size = segment;
+        }
+
+    datagram:
+
+#endif
+
+#if (NGX_QUIC)
+
+        if (ls->quic) {
+            ngx_str_t  key;
+
+            /* QUIC connections are looked up by destination connection id */
+
+            if (ngx_quic_get_packet_dcid(ev->log, data, size, &key) != NGX_OK)
+            {
+                goto next;
+            }
+
+            c = ngx_lookup_udp_connection_id(ls, &key);
+
+            if (c == NULL && !ngx_quic_long_packet(data)) {
+                ngx_log_debug0(NGX_LOG_DEBUG_EVENT, ev->log, 0,
+                               "quic packet for unknown connection");
+                goto next;
+            }
+
+        } else
+#endif
+        {
+            c = ngx_lookup_udp_connection(ls, sockaddr, socklen,
+                                          local_sockaddr, local_socklen);
+        }
 
         if (c) {
 
@@ -242,7 +326,7 @@ ngx_event_recvmsg(ngx_event_t *ev)
                 c->log->handler = NULL;
 
                 ngx_log_debug2(NGX_LOG_DEBUG_EVENT, c->log, 0,
-                               "recvmsg: fd:%d n:%z", c->fd, n);
+                               "recvmsg: fd:%d n:%uz", c->fd, size);
 
                 c->log->handler = handler;
             }
@@ -250,8 +334,8 @@ ngx_event_recvmsg(ngx_event_t *ev)
 
             ngx_memzero(&buf, sizeof(ngx_buf_t));
 
-            buf.pos = buffer;
-            buf.last = buffer + n;
+            buf.pos = data;
+            buf.last = data + size;
 
             rev = c->read;
 
@@ -335,13 +419,13 @@ ngx_event_recvmsg(ngx_event_t *ev)
         c->local_sockaddr = local_sockaddr;
         c->local_socklen = local_socklen;
 
-        c->buffer = ngx_create_temp_buf(c->pool, n);
+        c->buffer = ngx_create_temp_buf(c->pool, size);
         if (c->buffer == NULL) {
             ngx_close_accepted_udp_connection(c);
             return;
         }
 
-        c->buffer->last = ngx_cpymem(c->buffer->last, buffer, n);
+        c->buffer->last = ngx_cpymem(c->buffer->last, data, size);
 
         rev = c->read;
         wev = c->write;
@@ -398,14 +482,16 @@ ngx_event_recvmsg(ngx_event_t *ev)
                                      NGX_SOCKADDR_STRLEN, 1);
 
             ngx_log_debug4(NGX_LOG_DEBUG_EVENT, log, 0,
-                           "*%uA recvmsg: %V fd:%d n:%z",
-                           c->number, &addr, c->fd, n);
+                           "*%uA recvmsg: %V fd:%d n:%uz",
+                           c->number, &addr, c->fd, size);
         }
 
         }
 #endif
 
-        if (ngx_insert_udp_connection(c) != NGX_OK) {
+        /* QUIC connection ids are registered by ngx_quic_run() */
+
+        if (!ls->quic && ngx_insert_udp_connection(c) != NGX_OK) {
             ngx_close_accepted_udp_connection(c);
             return;
         }
@@ -417,6 +503,17 @@ ngx_event_recvmsg(ngx_event_t *ev)
 
     next:
 
+#if (NGX_HAVE_UDP_GRO)
+
+        data += size;
+
+        if (data < buffer + n) {
+            size = ngx_min((size_t) segment, (size_t) (buffer + n - data));
+            goto datagram;
+        }
+
+#endif
+
         if (ngx_event_flags & NGX_USE_KQUEUE_EVENT) {
             ev->available -= n;
         }
@@ -494,12 +591,19 @@ ngx_udp_rbtree_insert_value(ngx_rbtree_node_t *temp,
             udpt = (ngx_udp_connection_t *) temp;
             ct = udpt->connection;
 
-            rc = ngx_cmp_sockaddr(c->sockaddr, c->socklen,
-                                  ct->sockaddr, ct->socklen, 1);
+            if (udp->key.len) {
+                rc = ngx_memn2cmp(udp->key.data, udpt->key.data,
+                                  udp->key.len, udpt->key.len);
+
+            } else {
+                rc = ngx_cmp_sockaddr(c->sockaddr, c->socklen,
+                                      ct->sockaddr, ct->socklen, 1);
 
-            if (rc == 0 && c->listening->wildcard) {
-                rc = ngx_cmp_sockaddr(c->local_sockaddr, c->local_socklen,
-                                      ct->local_sockaddr, ct->local_socklen, 1);
+                if (rc == 0 && c->listening->wildcard) {
+                    rc = ngx_cmp_sockaddr(c->local_sockaddr, c->local_socklen,
+                                          ct->local_sockaddr,
+                                          ct->local_socklen, 1);
+                }
             }
 
             p = (rc < 0) ? &temp->left : &temp->right;
@@ -654,6 +758,85 @@ ngx_lookup_udp_connection(ngx_listening_t *ls, struct sockaddr *sockaddr,
     return NULL;
 }
 
+
+#if (NGX_QUIC)
+
+void
+ngx_insert_udp_connection_id(ngx_connection_t *c, ngx_udp_connection_t *udp,
+    ngx_str_t *key)
+{
+    uint32_t  hash;
+
+    ngx_crc32_init(hash);
+    ngx_crc32_update(&hash, key->data, key->len);
+    ngx_crc32_final(hash);
+
+    udp->connection = c;
+    udp->key = *key;
+    udp->node.key = hash;
+
+    ngx_rbtree_insert(&c->listening->rbtree, &udp->node);
+}
+
+
+void
+ngx_delete_udp_connection_id(ngx_connection_t *c, ngx_udp_connection_t *udp)
+{
+    if (udp->connection == NULL) {
+        return;
+    }
+
+    ngx_rbtree_delete(&c->listening->rbtree, &udp->node);
+
+    udp->connection = NULL;
+}
+
+
+static ngx_connection_t *
+ngx_lookup_udp_connection_id(ngx_listening_t *ls, ngx_str_t *key)
+{
+    uint32_t               hash;
+    ngx_int_t              rc;
+    ngx_rbtree_node_t     *node, *sentinel;
+    ngx_udp_connection_t  *udp;
+
+    node = ls->rbtree.root;
+    sentinel = ls->rbtree.sentinel;
+
+    ngx_crc32_init(hash);
+    ngx_crc32_update(&hash, key->data, key->len);
+    ngx_crc32_final(hash);
+
+    while (node != sentinel) {
+
+        if (hash < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (hash > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        /* hash == node->key */
+
+        udp = (ngx_udp_connection_t *) node;
+
+        rc = ngx_memn2cmp(key->data, udp->key.data, key->len, udp->key.len);
+
+        if (rc == 0) {
+            return udp->connection;
+        }
+
+        node = (rc < 0) ? node->left : node->right;
+    }
+
+    return NULL;
+}
+
+#endif
+
 #else
 
 void
@@ -0,0 +1,1507 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+#include <ngx_event_quic_connection.h>
+
+
+static ngx_quic_connection_t *ngx_quic_new_connection(ngx_connection_t *c,
+    ngx_quic_conf_t *conf, ngx_quic_header_t *pkt);
+static ngx_int_t ngx_quic_create_server_id(ngx_connection_t *c, u_char *id);
+static ngx_int_t ngx_quic_init_connection(ngx_connection_t *c);
+static void ngx_quic_input_handler(ngx_event_t *rev);
+static void ngx_quic_push_handler(ngx_event_t *ev);
+static void ngx_quic_close_handler(ngx_event_t *ev);
+static ngx_int_t ngx_quic_close_quic(ngx_connection_t *c, ngx_int_t rc);
+
+static ngx_int_t ngx_quic_handle_datagram(ngx_connection_t *c, ngx_buf_t *b,
+    ngx_quic_conf_t *conf);
+static ngx_int_t ngx_quic_handle_packet(ngx_connection_t *c,
+    ngx_quic_conf_t *conf, ngx_quic_header_t *pkt);
+static ngx_int_t ngx_quic_check_cids(ngx_quic_connection_t *qc,
+    ngx_quic_header_t *pkt);
+static ngx_int_t ngx_quic_handle_payload(ngx_connection_t *c,
+    ngx_quic_header_t *pkt);
+static ngx_int_t ngx_quic_handle_crypto_frame(ngx_connection_t *c,
+    ngx_quic_header_t *pkt, ngx_quic_frame_t *f);
+static ngx_int_t ngx_quic_do_handshake(ngx_connection_t *c);
+static ngx_int_t ngx_quic_apply_transport_params(ngx_connection_t *c);
+static ngx_int_t ngx_quic_handle_new_connection_id_frame(ngx_connection_t *c,
+    ngx_quic_frame_t *f);
+static ngx_int_t ngx_quic_handle_path_challenge_frame(ngx_connection_t *c,
+    ngx_quic_frame_t *f);
+
+
+void
+ngx_quic_run(ngx_connection_t *c, ngx_quic_conf_t *conf)
+{
+    ngx_int_t               rc;
+    ngx_quic_connection_t  *qc;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, 0, "quic run");
+
+    rc = ngx_quic_handle_datagram(c, c->buffer, conf);
+
+    if (rc != NGX_OK) {
+        /* the datagram is silently discarded unless it was a bad Initial */
+        ngx_quic_close_connection(c, rc == NGX_DECLINED ? NGX_DONE : rc);
+        return;
+    }
+
+    /* the connection is created by the first acceptable packet */
+
+    qc = ngx_quic_get_connection(c);
+
+    ngx_add_timer(c->read, qc->tp.max_idle_timeout);
+
+    c->read->handler = ngx_quic_input_handler;
+
+    /* graceful shutdown is signalled with c->close */
+    c->idle = 1;
+}
+
+
+static ngx_quic_connection_t *
+ngx_quic_new_connection(ngx_connection_t *c, ngx_quic_conf_t *conf,
+    ngx_quic_header_t *pkt)
+{
+    ssize_t                 len;
+    ngx_uint_t              i;
+    ngx_pool_cleanup_t     *cln;
+    ngx_quic_tp_t          *tp;
+    ngx_quic_send_ctx_t    *ctx;
+    ngx_quic_connection_t  *qc;
+
+    qc = ngx_pcalloc(c->pool, sizeof(ngx_quic_connection_t));
+    if (qc == NULL) {
+        return NULL;
+    }
+
+    qc->keys = ngx_quic_keys_new(c->pool);
+    if (qc->keys == NULL) {
+        return NULL;
+    }
+
+    cln = ngx_pool_cleanup_add(c->pool, 0);
+    if (cln == NULL) {
+        return NULL;
+    }
+
+    cln->handler = ngx_quic_keys_cleanup;
+    cln->data = qc->keys;
+
+    ngx_rbtree_init(&qc->streams.tree, &qc->streams.sentinel,
+                    ngx_quic_rbtree_insert_stream);
+
+    ngx_queue_init(&qc->streams.free);
+    ngx_queue_init(&qc->free_frames);
+
+    for (i = 0; i < NGX_QUIC_ENCRYPTION_LAST; i++) {
+        ctx = &qc->send_ctx[i];
+
+        ctx->level = i;
+        ctx->largest_ack = NGX_QUIC_UNSET_PN;
+        ctx->largest_pn = NGX_QUIC_UNSET_PN;
+
+        ngx_queue_init(&ctx->frames);
+        ngx_queue_init(&ctx->sent);
+        ngx_queue_init(&ctx->crypto.chain);
+    }
+
+    qc->push.log = c->log;
+    qc->push.data = c;
+    qc->push.handler = ngx_quic_push_handler;
+
+    qc->pto.log = c->log;
+    qc->pto.data = c;
+    qc->pto.handler = ngx_quic_pto_handler;
+    qc->pto.cancelable = 1;
+
+    qc->close.log = c->log;
+    qc->close.data = c;
+    qc->close.handler = ngx_quic_close_handler;
+    qc->close.cancelable = 1;
+
+    qc->avg_rtt = NGX_QUIC_INITIAL_RTT;
+    qc->rttvar = NGX_QUIC_INITIAL_RTT / 2;
+    qc->min_rtt = NGX_TIMER_INFINITE;
+
+    qc->congestion.window = NGX_QUIC_CC_INITIAL_WINDOW;
+    qc->congestion.ssthresh = (size_t) -1;
+    qc->congestion.recovery_start = ngx_current_msec;
+
+    qc->conf = conf;
+
+    /* the client chosen ids */
+
+    qc->dcid.len = pkt->scid.len;
+    qc->dcid.data = qc->dcid_buf;
+    ngx_memcpy(qc->dcid_buf, pkt->scid.data, pkt->scid.len);
+
+    qc->odcid.len = pkt->dcid.len;
+    qc->odcid.data = ngx_pstrdup(c->pool, &pkt->dcid);
+    if (qc->odcid.data == NULL) {
+        return NULL;
+    }
+
+    qc->scid.len = NGX_QUIC_SERVER_CID_LEN;
+    qc->scid.data = qc->scid_buf;
+
+    if (ngx_quic_create_server_id(c, qc->scid_buf) != NGX_OK) {
+        return NULL;
+    }
+
+    /* the defaults of RFC 9000, 18.2. Transport Parameter Definitions */
+
+    qc->ctp.max_udp_payload_size = NGX_QUIC_MAX_UDP_PAYLOAD_SIZE;
+    qc->ctp.ack_delay_exponent = NGX_QUIC_DEFAULT_ACK_DELAY_EXPONENT;
+    qc->ctp.max_ack_delay = NGX_QUIC_DEFAULT_MAX_ACK_DELAY;
+    qc->ctp.active_connection_id_limit = 2;
+
+    tp = &qc->tp;
+
+    tp->original_dcid = qc->odcid;
+    tp->initial_scid = qc->scid;
+    tp->max_idle_timeout = conf->timeout;
+    tp->max_udp_payload_size = NGX_QUIC_MAX_UDP_PAYLOAD_SIZE;
+    tp->initial_max_stream_data_bidi_local = conf->stream_buffer_size;
+    tp->initial_max_stream_data_bidi_remote = conf->stream_buffer_size;
+    tp->initial_max_stream_data_uni = conf->stream_buffer_size;
+    tp->initial_max_data = conf->stream_buffer_size
+                           * conf->max_concurrent_streams_bidi;
+    tp->initial_max_streams_bidi = conf->max_concurrent_streams_bidi;
+    tp->initial_max_streams_uni = conf->max_concurrent_streams_uni;
+    tp->active_connection_id_limit = 2;
+    tp->disable_active_migration = 1;
+
+    len = ngx_quic_create_transport_params(NULL, NULL, tp);
+
+    qc->tp_encoded.data = ngx_pnalloc(c->pool, len);
+    if (qc->tp_encoded.data == NULL) {
+        return NULL;
+    }
+
+    len = ngx_quic_create_transport_params(qc->tp_encoded.data,
+                                           qc->tp_encoded.data + len, tp);
+    if (len < 0) {
+        return NULL;
+    }
+
+    qc->tp_encoded.len = len;
+
+    qc->streams.recv_max_data = tp->initial_max_data;
+    qc->streams.recv_window = tp->initial_max_data;
+    qc->streams.client_max_streams_bidi = tp->initial_max_streams_bidi;
+    qc->streams.client_max_streams_uni = tp->initial_max_streams_uni;
+
+    if (ngx_quic_keys_set_initial_secret(qc->keys, &pkt->dcid, c->log)
+        != NGX_OK)
+    {
+        return NULL;
+    }
+
+    c->udp = &qc->udp;
+
+    ngx_insert_udp_connection_id(c, &qc->udp, &qc->scid);
+    ngx_insert_udp_connection_id(c, &qc->odcid_udp, &qc->odcid);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "quic connection created scid:%xV odcid:%xV",
+                   &qc->scid, &qc->odcid);
+
+    return qc;
+}
+
+
+static ngx_int_t
+ngx_quic_create_server_id(ngx_connection_t *c, u_char *id)
+{
+    ngx_uint_t        n;
+    ngx_core_conf_t  *ccf;
+
+    if (RAND_bytes(id, NGX_QUIC_SERVER_CID_LEN) <= 0) {
+        ngx_ssl_error(NGX_LOG_ALERT, c->log, 0, "RAND_bytes() failed");
+        return NGX_ERROR;
+    }
+
+    if (c->listening->reuseport) {
+        ccf = (ngx_core_conf_t *) ngx_get_conf(ngx_cycle->conf_ctx,
+                                               ngx_core_module);
+
+        n = ccf->worker_processes;
+
+        /* steers the packets to this worker, see ngx_attach_quic_cbpf() */
+
+        if (n > 1 && n <= 256) {
+            id[0] = (u_char) ((id[0] % (256 / n)) * n + ngx_worker);
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_quic_init_connection(ngx_connection_t *c)
+{
+    ngx_quic_connection_t  *qc;
+
+    qc = ngx_quic_get_connection(c);
+
+    if (ngx_ssl_create_connection(qc->conf->ssl, c, 0) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (ngx_quic_compat_init_connection(c) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_quic_input_handler(ngx_event_t *rev)
+{
+    ngx_int_t               rc;
+    ngx_buf_t              *b;
+    ngx_connection_t       *c;
+    ngx_quic_connection_t  *qc;
+
+    c = rev->data;
+    qc = ngx_quic_get_connection(c);
+
+    c->log->action = "handling quic input";
+
+    if (rev->timedout) {
+        ngx_log_error(NGX_LOG_INFO, c->log, 0,
+                      "quic client timed out");
+        ngx_quic_close_connection(c, NGX_DONE);
+        return;
+    }
+
+    if (c->close) {
+        c->close = 0;
+
+        if (qc->closing || qc->shutdown) {
+            return;
+        }
+
+        qc->shutdown = 1;
+
+        if (qc->conf->shutdown) {
+            qc->conf->shutdown(c);
+
+        } else {
+            ngx_quic_finalize_connection(c, NGX_QUIC_ERR_NO_ERROR,
+                                         "graceful shutdown");
+        }
+
+        return;
+    }
+
+    b = c->udp->buffer;
+    if (b == NULL) {
+        return;
+    }
+
+    rc = ngx_quic_handle_datagram(c, b, NULL);
+
+    if (rc == NGX_ERROR || rc == NGX_DONE) {
+        ngx_quic_close_connection(c, rc);
+        return;
+    }
+
+    if (!qc->closing) {
+        ngx_add_timer(rev, qc->tp.max_idle_timeout);
+    }
+}
+
+
+static void
+ngx_quic_push_handler(ngx_event_t *ev)
+{
+    ngx_connection_t       *c;
+    ngx_quic_connection_t  *qc;
+
+    c = ev->data;
+    qc = ngx_quic_get_connection(c);
+
+    ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, 0, "quic push handler");
+
+    if (qc->closing) {
+        /* the connection is freed when the last stream is gone */
+        ngx_quic_close_connection(c, NGX_OK);
+        return;
+    }
+
+    if (ngx_quic_output(c) != NGX_OK) {
+        ngx_quic_close_connection(c, NGX_ERROR);
+    }
+}
+
+
+static void
+ngx_quic_close_handler(ngx_event_t *ev)
+{
+    ngx_connection_t  *c;
+
+    c = ev->data;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, 0, "quic close timer");
+
+    ngx_quic_close_connection(c, NGX_OK);
+}
+
+
+void
+ngx_quic_close_connection(ngx_connection_t *c, ngx_int_t rc)
+{
+    ngx_pool_t             *pool;
+    ngx_quic_connection_t  *qc;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "quic close connection rc:%i", rc);
+
+    qc = ngx_quic_get_connection(c);
+
+    if (qc && ngx_quic_close_quic(c, rc) == NGX_AGAIN) {
+        return;
+    }
+
+    if (c->ssl) {
+        SSL_free(c->ssl->connection);
+        c->ssl = NULL;
+    }
+
+#if (NGX_STAT_STUB)
+    (void) ngx_atomic_fetch_add(ngx_stat_active, -1);
+#endif
+
+    c->destroyed = 1;
+
+    pool = c->pool;
+
+    ngx_close_connection(c);
+
+    ngx_destroy_pool(pool);
+}
+
+
+static ngx_int_t
+ngx_quic_close_quic(ngx_connection_t *c, ngx_int_t rc)
+{
+    ngx_uint_t              i;
+    ngx_quic_send_ctx_t    *ctx;
+    ngx_quic_connection_t  *qc;
+
+    qc = ngx_quic_get_connection(c);
+
+    if (!qc->closing) {
+
+        qc->closing = 1;
+
+        /* no acknowledgements are processed in the closing state */
+
+        for (i = 0; i < NGX_QUIC_ENCRYPTION_LAST; i++) {
+            ctx = &qc->send_ctx[i];
+
+            ngx_quic_free_frames(c, &ctx->frames);
+            ngx_quic_free_frames(c, &ctx->sent);
+        }
+
+        if (rc == NGX_DONE) {
+
+            /*
+             * RFC 9000, 10.1.  Idle Timeout and 10.2.2.  Draining
+             * Connection State: no packets are sent
+             */
+
+            ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                           "quic close silent drain:%ui", qc->draining);
+
+        } else {
+
+            if (rc == NGX_ERROR && qc->error == 0 && !qc->error_app) {
+                qc->error = NGX_QUIC_ERR_INTERNAL_ERROR;
+            }
+
+            ngx_log_debug3(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                           "quic close immediate err:%ui app:%ui reason:%s",
+                           qc->error, (ngx_uint_t) qc->error_app,
+                           qc->error_reason ? qc->error_reason : "");
+
+            (void) ngx_quic_send_close(c);
+
+            /* RFC 9000, 10.2.1.  Closing Connection State */
+
+            ctx = ngx_quic_get_send_ctx(qc, NGX_QUIC_ENCRYPTION_APPLICATION);
+
+            ngx_add_timer(&qc->close,
+                          NGX_QUIC_CLOSE_PTO_FACTOR * ngx_quic_pto(c, ctx));
+        }
+
+        if (qc->pto.timer_set) {
+            ngx_del_timer(&qc->pto);
+        }
+
+        if (c->read->timer_set) {
+            ngx_del_timer(c->read);
+        }
+    }
+
+    if (ngx_quic_close_streams(c, qc) == NGX_AGAIN) {
+        return NGX_AGAIN;
+    }
+
+    if (qc->close.timer_set) {
+        return NGX_AGAIN;
+    }
+
+    for (i = 0; i < NGX_QUIC_ENCRYPTION_LAST; i++) {
+        ngx_quic_free_buffer(c, &qc->send_ctx[i].crypto);
+    }
+
+    if (qc->push.posted) {
+        ngx_delete_posted_event(&qc->push);
+    }
+
+    ngx_delete_udp_connection_id(c, &qc->udp);
+    ngx_delete_udp_connection_id(c, &qc->odcid_udp);
+
+    ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, 0, "quic close completed");
+
+    c->udp = NULL;
+
+    return NGX_OK;
+}
+
+
+void
+ngx_quic_finalize_connection(ngx_connection_t *c, ngx_uint_t err,
+    const char *reason)
+{
+    ngx_quic_connection_t  *qc;
+
+    if (c->quic) {
+        c = c->quic->parent;
+    }
+
+    qc = ngx_quic_get_connection(c);
+
+    if (qc->closing) {
+        return;
+    }
+
+    qc->error = err;
+    qc->error_reason = reason;
+    qc->error_app = 1;
+    qc->error_ftype = 0;
+
+    ngx_quic_close_connection(c, NGX_ERROR);
+}
+
+
+static ngx_int_t
+ngx_quic_handle_datagram(ngx_connection_t *c, ngx_buf_t *b,
+    ngx_quic_conf_t *conf)
+{
+    size_t                  size;
+    u_char                 *p;
+    ngx_int_t               rc;
+    ngx_uint_t              good;
+    ngx_quic_header_t       pkt;
+    ngx_quic_connection_t  *qc;
+
+    size = b->last - b->pos;
+
+    p = b->pos;
+    good = 0;
+
+    while (p < b->last) {
+
+        ngx_memzero(&pkt, sizeof(ngx_quic_header_t));
+
+        pkt.log = c->log;
+        pkt.data = p;
+        pkt.raw_end = b->last;
+
+        rc = ngx_quic_handle_packet(c, conf, &pkt);
+
+        if (rc == NGX_ERROR || rc == NGX_DONE) {
+            return rc;
+        }
+
+        if (rc == NGX_OK) {
+            good = 1;
+        }
+
+        /* NGX_DECLINED: the packet is dropped */
+
+        if (pkt.len == 0) {
+            break;
+        }
+
+        /* RFC 9000, 12.2.  Coalescing Packets */
+
+        p = pkt.data + pkt.len;
+    }
+
+    if (!good) {
+        return NGX_DECLINED;
+    }
+
+    qc = ngx_quic_get_connection(c);
+
+    qc->received += size;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_quic_handle_packet(ngx_connection_t *c, ngx_quic_conf_t *conf,
+    ngx_quic_header_t *pkt)
+{
+    ngx_int_t               rc;
+    ngx_quic_send_ctx_t    *ctx;
+    ngx_quic_connection_t  *qc;
+
+    static u_char           buf[NGX_QUIC_MAX_UDP_PAYLOAD_SIZE];
+
+    c->log->action = "parsing quic packet";
+
+    rc = ngx_quic_parse_packet(pkt);
+
+    if (rc == NGX_ERROR) {
+        pkt->len = 0;
+        return NGX_DECLINED;
+    }
+
+    qc = ngx_quic_get_connection(c);
+
+    if (rc == NGX_ABORT) {
+
+        /* RFC 9000, 6.1.  Sending Version Negotiation Packets */
+
+        if (qc == NULL
+            && pkt->raw_end - pkt->data >= NGX_QUIC_MIN_INITIAL_SIZE)
+        {
+            (void) ngx_quic_send_version_negotiation(c, pkt);
+        }
+
+        return NGX_DECLINED;
+    }
+
+    if (qc == NULL) {
+
+        if (pkt->level != NGX_QUIC_ENCRYPTION_INITIAL
+            || pkt->raw_end - pkt->data < NGX_QUIC_MIN_INITIAL_SIZE
+            || pkt->dcid.len < NGX_QUIC_MIN_ODCID_LEN
+            || ngx_exiting)
+        {
+            return NGX_DECLINED;
+        }
+
+        qc = ngx_quic_new_connection(c, conf, pkt);
+        if (qc == NULL) {
+            return NGX_ERROR;
+        }
+
+        if (ngx_quic_init_connection(c) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+    } else if (ngx_quic_check_cids(qc, pkt) != NGX_OK) {
+        return NGX_DECLINED;
+    }
+
+    if (qc->closing) {
+        /* RFC 9000, 10.2.  Immediate Close: packets are not processed */
+        return NGX_DECLINED;
+    }
+
+    if (ngx_quic_long_packet(pkt->data) && ngx_quic_pkt_zrtt(pkt->flags)) {
+        /* early data are not accepted */
+        return NGX_DECLINED;
+    }
+
+    if (!ngx_quic_keys_available(qc->keys, pkt->level, 0)) {
+        ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                       "quic no keys for level %ui, packet dropped",
+                       pkt->level);
+        return NGX_DECLINED;
+    }
+
+    ctx = ngx_quic_get_send_ctx(qc, pkt->level);
+
+    pkt->key_phase = qc->key_phase;
+
+    c->log->action = "decrypting packet";
+
+    rc = ngx_quic_decrypt(qc->keys, pkt, &ctx->largest_pn, buf);
+
+    if (rc == NGX_DECLINED) {
+        ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                       "quic packet decryption failed, dropped");
+        return NGX_DECLINED;
+    }
+
+    if (rc != NGX_OK) {
+        qc->error = pkt->error;
+        qc->error_reason = "failed to decrypt packet";
+        return NGX_ERROR;
+    }
+
+    ngx_log_debug3(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "quic packet rx level:%ui pn:%uL len:%uz",
+                   pkt->level, pkt->pn, pkt->payload.len);
+
+    if (ngx_quic_duplicate_packet(ctx, pkt->pn) != NGX_OK) {
+        ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                       "quic duplicate packet pn:%uL, dropped", pkt->pn);
+        return NGX_DECLINED;
+    }
+
+    if (pkt->level == NGX_QUIC_ENCRYPTION_HANDSHAKE) {
+
+        /*
+         * RFC 9001, 4.9.1.  Discarding Initial Keys and
+         * RFC 9000, 8.1.  Address Validation during Connection Establishment
+         */
+
+        ngx_quic_discard_ctx(c, NGX_QUIC_ENCRYPTION_INITIAL);
+        qc->validated = 1;
+    }
+
+    if (pkt->key_update) {
+
+        /* RFC 9001, 6.2.  Responding to a Key Update */
+
+        ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, 0, "quic key update");
+
+        ngx_quic_keys_switch(qc->keys);
+        qc->key_phase ^= 1;
+
+        if (ngx_quic_keys_update(c->log, qc->keys) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
+    rc = ngx_quic_handle_payload(c, pkt);
+
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    return ngx_quic_ack_packet(c, pkt);
+}
+
+
+static ngx_int_t
+ngx_quic_check_cids(ngx_quic_connection_t *qc, ngx_quic_header_t *pkt)
+{
+    if (ngx_memn2cmp(pkt->dcid.data, qc->scid.data, pkt->dcid.len,
+                     qc->scid.len)
+        != 0
+        && ngx_memn2cmp(pkt->dcid.data, qc->odcid.data, pkt->dcid.len,
+                        qc->odcid.len)
+           != 0)
+    {
+        ngx_log_error(NGX_LOG_INFO, pkt->log, 0, "quic unexpected dcid");
+        return NGX_DECLINED;
+    }
+
+    /* the client id of long header packets is not changed */
+
+    if (ngx_quic_long_packet(pkt->data)
+        && qc->dcid_seqnum == 0
+        && ngx_memn2cmp(pkt->scid.data, qc->dcid.data, pkt->scid.len,
+                        qc->dcid.len)
+           != 0)
+    {
+        ngx_log_error(NGX_LOG_INFO, pkt->log, 0, "quic unexpected scid");
+        return NGX_DECLINED;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_quic_handle_payload(ngx_connection_t *c, ngx_quic_header_t *pkt)
+{
+    u_char                 *end, *p;
+    ssize_t                 len;
+    ngx_int_t               rc;
+    ngx_quic_frame_t        frame;
+    ngx_quic_connection_t  *qc;
+
+    qc = ngx_quic_get_connection(c);
+
+    p = pkt->payload.data;
+    end = p + pkt->payload.len;
+
+    while (p < end) {
+
+        c->log->action = "parsing frames";
+
+        ngx_memzero(&frame, sizeof(ngx_quic_frame_t));
+
+        len = ngx_quic_parse_frame(pkt, p, end, &frame);
+
+        if (len < 0) {
+            qc->error = pkt->error;
+            return NGX_ERROR;
+        }
+
+        p += len;
+
+        c->log->action = "handling frames";
+
+        ngx_log_debug2(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                       "quic frame rx type:0x%xi level:%ui",
+                       frame.type, pkt->level);
+
+        switch (frame.type) {
+
+        case NGX_QUIC_FT_PADDING:
+            continue;
+
+        case NGX_QUIC_FT_ACK:
+        case NGX_QUIC_FT_ACK_ECN:
+            rc = ngx_quic_handle_ack_frame(c, pkt, &frame);
+            break;
+
+        case NGX_QUIC_FT_CONNECTION_CLOSE:
+        case NGX_QUIC_FT_CONNECTION_CLOSE_APP:
+
+            ngx_log_error(NGX_LOG_INFO, c->log, 0,
+                          "quic peer closed connection error:0x%xL "
+                          "reason:\"%V\"",
+                          frame.u.close.error_code, &frame.u.close.reason);
+
+            qc->draining = 1;
+
+            return NGX_DONE;
+
+        case NGX_QUIC_FT_PING:
+            rc = NGX_OK;
+            break;
+
+        case NGX_QUIC_FT_CRYPTO:
+            rc = ngx_quic_handle_crypto_frame(c, pkt, &frame);
+            break;
+
+        case NGX_QUIC_FT_STREAM:
+            rc = ngx_quic_handle_stream_frame(c, pkt, &frame);
+            break;
+
+        case NGX_QUIC_FT_RESET_STREAM:
+            rc = ngx_quic_handle_reset_stream_frame(c, pkt, &frame);
+            break;
+
+        case NGX_QUIC_FT_STOP_SENDING:
+            rc = ngx_quic_handle_stop_sending_frame(c, pkt, &frame);
+            break;
+
+        case NGX_QUIC_FT_MAX_DATA:
+            rc = ngx_quic_handle_max_data_frame(c, &frame);
+            break;
+
+        case NGX_QUIC_FT_MAX_STREAM_DATA:
+            rc = ngx_quic_handle_max_stream_data_frame(c, pkt, &frame);
+            break;
+
+        case NGX_QUIC_FT_MAX_STREAMS:
+        case NGX_QUIC_FT_MAX_STREAMS2:
+            rc = ngx_quic_handle_max_streams_frame(c, &frame);
+            break;
+
+        case NGX_QUIC_FT_NEW_CONNECTION_ID:
+            rc = ngx_quic_handle_new_connection_id_frame(c, &frame);
+            break;
+
+        case NGX_QUIC_FT_PATH_CHALLENGE:
+            rc = ngx_quic_handle_path_challenge_frame(c, &frame);
+            break;
+
+        case NGX_QUIC_FT_HANDSHAKE_DONE:
+            /* only a server can send the frame */
+            qc->error = NGX_QUIC_ERR_PROTOCOL_VIOLATION;
+            rc = NGX_ERROR;
+            break;
+
+        default:
+
+            /*
+             * DATA_BLOCKED, STREAM_DATA_BLOCKED, STREAMS_BLOCKED:
+             * the limits are updated as the data are read;
+             * RETIRE_CONNECTION_ID: no additional ids are issued;
+             * PATH_RESPONSE: paths are not validated
+             */
+
+            rc = NGX_OK;
+            break;
+        }
+
+        if (rc != NGX_OK) {
+            if (rc == NGX_ERROR && qc->error_ftype == 0) {
+                qc->error_ftype = frame.type;
+            }
+
+            return rc;
+        }
+
+        if (frame.type != NGX_QUIC_FT_ACK
+            && frame.type != NGX_QUIC_FT_ACK_ECN)
+        {
+            pkt->need_ack = 1;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_quic_handle_crypto_frame(ngx_connection_t *c, ngx_quic_header_t *pkt,
+    ngx_quic_frame_t *f)
+{
+    size_t                  n;
+    uint64_t                last;
+    ngx_quic_send_ctx_t    *ctx;
+    ngx_quic_connection_t  *qc;
+    u_char                  buf[4096];
+
+    qc = ngx_quic_get_connection(c);
+    ctx = ngx_quic_get_send_ctx(qc, pkt->level);
+
+    last = f->u.crypto.offset + f->u.crypto.length;
+
+    if (last > ctx->crypto.offset + NGX_QUIC_MAX_CRYPTO_DATA) {
+        qc->error = NGX_QUIC_ERR_CRYPTO_BUFFER_EXCEEDED;
+        return NGX_ERROR;
+    }
+
+    if (last <= ctx->crypto.offset) {
+        /* a retransmission, the lost server data are resent on timeout */
+        return NGX_OK;
+    }
+
+    if (ngx_quic_write_buffer(c, &ctx->crypto, f->u.crypto.offset, f->data,
+                              f->u.crypto.length)
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    for ( ;; ) {
+        n = ngx_quic_read_buffer(c, &ctx->crypto, buf, sizeof(buf));
+
+        if (n == 0) {
+            break;
+        }
+
+        if (ngx_quic_compat_provide_data(c, pkt->level, buf, n) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
+    return ngx_quic_do_handshake(c);
+}
+
+
+static ngx_int_t
+ngx_quic_do_handshake(ngx_connection_t *c)
+{
+    int                     n, sslerr;
+    unsigned int            len;
+    const unsigned char    *data;
+    ngx_ssl_conn_t         *ssl_conn;
+    ngx_quic_frame_t       *frame;
+    ngx_quic_connection_t  *qc;
+
+    qc = ngx_quic_get_connection(c);
+
+    if (c->ssl->handshaked) {
+        return NGX_OK;
+    }
+
+    c->log->action = "SSL handshaking";
+
+    ssl_conn = c->ssl->connection;
+
+    n = SSL_do_handshake(ssl_conn);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0, "SSL_do_handshake: %d", n);
+
+    if (qc->compat->error) {
+        qc->error = NGX_QUIC_ERR_INTERNAL_ERROR;
+        return NGX_ERROR;
+    }
+
+    if (n <= 0) {
+        sslerr = SSL_get_error(ssl_conn, n);
+
+        ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                       "SSL_get_error: %d", sslerr);
+
+        if (sslerr != SSL_ERROR_WANT_READ) {
+
+            if (qc->compat->alert) {
+                qc->error = NGX_QUIC_ERR_CRYPTO(qc->compat->alert);
+
+            } else {
+                qc->error = NGX_QUIC_ERR_CRYPTO(SSL_AD_INTERNAL_ERROR);
+            }
+
+            ngx_ssl_error(NGX_LOG_INFO, c->log, 0,
+                          "SSL_do_handshake() failed");
+            return NGX_ERROR;
+        }
+    }
+
+    if (!qc->client_tp_done && qc->compat->ctp.len) {
+        if (ngx_quic_apply_transport_params(c) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
+    if (n <= 0 || SSL_in_init(ssl_conn)) {
+        return NGX_OK;
+    }
+
+    ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, 0, "quic handshake completed");
+
+    c->ssl->handshaked = 1;
+
+    /* RFC 9001, 8.1.  Application-Layer Protocol Negotiation */
+
+    SSL_get0_alpn_selected(ssl_conn, &data, &len);
+
+    if (len == 0) {
+        qc->error = NGX_QUIC_ERR_CRYPTO(SSL_AD_NO_APPLICATION_PROTOCOL);
+        qc->error_reason = "missing ALPN extension";
+        return NGX_ERROR;
+    }
+
+    /* 8.2.  QUIC Transport Parameters Extension */
+
+    if (!qc->client_tp_done) {
+        qc->error = NGX_QUIC_ERR_CRYPTO(SSL_AD_MISSING_EXTENSION);
+        qc->error_reason = "missing transport parameters";
+        return NGX_ERROR;
+    }
+
+    frame = ngx_quic_alloc_frame(c);
+    if (frame == NULL) {
+        return NGX_ERROR;
+    }
+
+    frame->level = NGX_QUIC_ENCRYPTION_APPLICATION;
+    frame->type = NGX_QUIC_FT_HANDSHAKE_DONE;
+
+    ngx_quic_queue_frame(qc, frame);
+
+    /*
+     * 4.9.2.  Discarding Handshake Keys: the server considers
+     * the handshake confirmed when it completes
+     */
+
+    ngx_quic_discard_ctx(c, NGX_QUIC_ENCRYPTION_HANDSHAKE);
+
+    if (ngx_quic_keys_update(c->log, qc->keys) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    qc->initialized = 1;
+
+    if (qc->conf->init) {
+        qc->conf->init(c);
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_quic_apply_transport_params(ngx_connection_t *c)
+{
+    ngx_str_t              *ctp;
+    ngx_quic_connection_t  *qc;
+
+    qc = ngx_quic_get_connection(c);
+    ctp = &qc->compat->ctp;
+
+    if (ngx_quic_parse_transport_params(ctp->data, ctp->data + ctp->len,
+                                        &qc->ctp, c->log)
+        != NGX_OK)
+    {
+        qc->error = NGX_QUIC_ERR_TRANSPORT_PARAMETER_ERROR;
+        qc->error_reason = "failed to process transport parameters";
+        return NGX_ERROR;
+    }
+
+    /* RFC 9000, 7.3.  Authenticating Connection IDs */
+
+    if (!qc->ctp.initial_scid_set
+        || ngx_memn2cmp(qc->ctp.initial_scid.data, qc->dcid.data,
+                        qc->ctp.initial_scid.len, qc->dcid.len)
+           != 0)
+    {
+        qc->error = NGX_QUIC_ERR_TRANSPORT_PARAMETER_ERROR;
+        qc->error_reason = "invalid initial_source_connection_id";
+        return NGX_ERROR;
+    }
+
+    /* 10.1.  Idle Timeout */
+
+    if (qc->ctp.max_idle_timeout
+        && qc->ctp.max_idle_timeout < qc->tp.max_idle_timeout)
+    {
+        qc->tp.max_idle_timeout = qc->ctp.max_idle_timeout;
+    }
+
+    qc->streams.send_max_data = qc->ctp.initial_max_data;
+    qc->streams.server_max_streams_bidi = qc->ctp.initial_max_streams_bidi;
+    qc->streams.server_max_streams_uni = qc->ctp.initial_max_streams_uni;
+
+    qc->client_tp_done = 1;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_quic_handle_new_connection_id_frame(ngx_connection_t *c,
+    ngx_quic_frame_t *f)
+{
+    uint64_t                seq;
+    ngx_quic_frame_t       *frame;
+    ngx_quic_connection_t  *qc;
+
+    qc = ngx_quic_get_connection(c);
+
+    /*
+     * RFC 9000, 19.15.  NEW_CONNECTION_ID Frame: only a single client id
+     * is used, it is replaced when retired by the client
+     */
+
+    if (f->u.ncid.retire <= qc->dcid_seqnum) {
+        return NGX_OK;
+    }
+
+    if (f->u.ncid.retire - qc->dcid_seqnum > qc->tp.active_connection_id_limit)
+    {
+        qc->error = NGX_QUIC_ERR_CONNECTION_ID_LIMIT_ERROR;
+        return NGX_ERROR;
+    }
+
+    for (seq = qc->dcid_seqnum; seq < f->u.ncid.retire; seq++) {
+
+        frame = ngx_quic_alloc_frame(c);
+        if (frame == NULL) {
+            return NGX_ERROR;
+        }
+
+        frame->level = NGX_QUIC_ENCRYPTION_APPLICATION;
+        frame->type = NGX_QUIC_FT_RETIRE_CONNECTION_ID;
+        frame->u.retire_cid.sequence_number = seq;
+
+        ngx_quic_queue_frame(qc, frame);
+    }
+
+    qc->dcid.len = f->u.ncid.len;
+    ngx_memcpy(qc->dcid_buf, f->u.ncid.cid, f->u.ncid.len);
+
+    qc->dcid_seqnum = f->u.ncid.seqnum;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "quic switched to client id seq:%uL dcid:%xV",
+                   qc->dcid_seqnum, &qc->dcid);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_quic_handle_path_challenge_frame(ngx_connection_t *c, ngx_quic_frame_t *f)
+{
+    ngx_quic_frame_t       *frame;
+    ngx_quic_connection_t  *qc;
+
+    qc = ngx_quic_get_connection(c);
+
+    frame = ngx_quic_alloc_frame(c);
+    if (frame == NULL) {
+        return NGX_ERROR;
+    }
+
+    frame->level = NGX_QUIC_ENCRYPTION_APPLICATION;
+    frame->type = NGX_QUIC_FT_PATH_RESPONSE;
+    frame->u.path_response = f->u.path_response;
+
+    ngx_quic_queue_frame(qc, frame);
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_quic_add_handshake_data(ngx_connection_t *c, ngx_uint_t level,
+    const u_char *data, size_t len)
+{
+    size_t                  n;
+    ngx_quic_frame_t       *frame;
+    ngx_quic_send_ctx_t    *ctx;
+    ngx_quic_connection_t  *qc;
+
+    qc = ngx_quic_get_connection(c);
+    ctx = ngx_quic_get_send_ctx(qc, level);
+
+    while (len) {
+        n = ngx_min(len, NGX_QUIC_MAX_FRAME_DATA);
+
+        frame = ngx_quic_alloc_frame(c);
+        if (frame == NULL) {
+            return NGX_ERROR;
+        }
+
+        if (ngx_quic_alloc_frame_data(c, frame) != NGX_OK) {
+            ngx_quic_free_frame(c, frame);
+            return NGX_ERROR;
+        }
+
+        frame->level = level;
+        frame->type = NGX_QUIC_FT_CRYPTO;
+        frame->u.crypto.offset = ctx->crypto_sent;
+        frame->u.crypto.length = n;
+
+        ngx_memcpy(frame->data, data, n);
+
+        ngx_quic_queue_frame(qc, frame);
+
+        ctx->crypto_sent += n;
+        data += n;
+        len -= n;
+    }
+
+    return NGX_OK;
+}
+
+
+void
+ngx_quic_discard_ctx(ngx_connection_t *c, ngx_uint_t level)
+{
+    ngx_queue_t            *q;
+    ngx_quic_frame_t       *f;
+    ngx_quic_send_ctx_t    *ctx;
+    ngx_quic_connection_t  *qc;
+
+    qc = ngx_quic_get_connection(c);
+
+    if (!ngx_quic_keys_available(qc->keys, level, 0)
+        && !ngx_quic_keys_available(qc->keys, level, 1))
+    {
+        return;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "quic discard keys level:%ui", level);
+
+    ngx_quic_keys_discard(qc->keys, level);
+
+    qc->pto_count = 0;
+
+    ctx = ngx_quic_get_send_ctx(qc, level);
+
+    /* RFC 9002, 6.4.  Discarding Keys and Packet State */
+
+    for (q = ngx_queue_head(&ctx->sent);
+         q != ngx_queue_sentinel(&ctx->sent);
+         q = ngx_queue_next(q))
+    {
+        f = ngx_queue_data(q, ngx_quic_frame_t, queue);
+
+        if (f->plen && f->pkt_need_ack) {
+            qc->congestion.in_flight -= f->plen;
+        }
+    }
+
+    ngx_quic_free_frames(c, &ctx->sent);
+    ngx_quic_free_frames(c, &ctx->frames);
+    ngx_quic_free_buffer(c, &ctx->crypto);
+
+    ctx->send_ack = 0;
+}
+
+
+ngx_quic_frame_t *
+ngx_quic_alloc_frame(ngx_connection_t *c)
+{
+    ngx_queue_t            *q;
+    ngx_quic_frame_t       *f;
+    ngx_quic_connection_t  *qc;
+
+    qc = ngx_quic_get_connection(c);
+
+    if (!ngx_queue_empty(&qc->free_frames)) {
+
+        q = ngx_queue_head(&qc->free_frames);
+        f = ngx_queue_data(q, ngx_quic_frame_t, queue);
+
+        ngx_queue_remove(&f->queue);
+
+    } else {
+
+        if (qc->nframes >= NGX_QUIC_MAX_FRAMES) {
+            ngx_log_error(NGX_LOG_INFO, c->log, 0,
+                          "quic too many frames allocated");
+            return NULL;
+        }
+
+        f = ngx_palloc(c->pool, sizeof(ngx_quic_frame_t));
+        if (f == NULL) {
+            return NULL;
+        }
+
+        qc->nframes++;
+    }
+
+    ngx_memzero(f, sizeof(ngx_quic_frame_t));
+
+    return f;
+}
+
+
+ngx_int_t
+ngx_quic_alloc_frame_data(ngx_connection_t *c, ngx_quic_frame_t *f)
+{
+    u_char                 *p;
+    ngx_quic_connection_t  *qc;
+
+    qc = ngx_quic_get_connection(c);
+
+    /* the first bytes of a free chunk point to the next free chunk */
+
+    p = qc->free_chunks;
+
+    if (p) {
+        qc->free_chunks = *(u_char **) p;
+
+    } else {
+        p = ngx_palloc(c->pool, NGX_QUIC_MAX_FRAME_DATA);
+        if (p == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    f->data = p;
+
+    return NGX_OK;
+}
+
+
+void
+ngx_quic_free_frame(ngx_connection_t *c, ngx_quic_frame_t *f)
+{
+    ngx_quic_connection_t  *qc;
+
+    qc = ngx_quic_get_connection(c);
+
+    if (f->data) {
+        *(u_char **) f->data = qc->free_chunks;
+        qc->free_chunks = f->data;
+        f->data = NULL;
+    }
+
+    ngx_queue_insert_head(&qc->free_frames, &f->queue);
+}
+
+
+void
+ngx_quic_free_frames(ngx_connection_t *c, ngx_queue_t *frames)
+{
+    ngx_queue_t       *q;
+    ngx_quic_frame_t  *f;
+
+    while (!ngx_queue_empty(frames)) {
+        q = ngx_queue_head(frames);
+        ngx_queue_remove(q);
+
+        f = ngx_queue_data(q, ngx_quic_frame_t, queue);
+
+        ngx_quic_free_frame(c, f);
+    }
+}
+
+
+void
+ngx_quic_queue_frame(ngx_quic_connection_t *qc, ngx_quic_frame_t *f)
+{
+    ngx_quic_send_ctx_t  *ctx;
+
+    ctx = ngx_quic_get_send_ctx(qc, f->level);
+
+    ngx_queue_insert_tail(&ctx->frames, &f->queue);
+
+    ngx_post_event(&qc->push, &ngx_posted_events);
+}
+
+
+/*
+ * received CRYPTO and STREAM data are kept as a list of frames
+ * sorted by offset, the data already read by the application
+ * and the parts already received are not stored
+ */
+
+ngx_int_t
+ngx_quic_write_buffer(ngx_connection_t *c, ngx_quic_buffer_t *qb,
+    uint64_t offset, u_char *data, uint64_t len)
+{
+    uint64_t           n;
+    ngx_queue_t       *q;
+    ngx_quic_frame_t  *f, *nf;
+
+    if (offset < qb->offset) {
+
+        if (offset + len <= qb->offset) {
+            return NGX_OK;
+        }
+
+        n = qb->offset - offset;
+
+        data += n;
+        len -= n;
+        offset = qb->offset;
+    }
+
+    q = ngx_queue_head(&qb->chain);
+
+    while (len) {
+
+        /* skip the frames ending before the data */
+
+        while (q != ngx_queue_sentinel(&qb->chain)) {
+            f = ngx_queue_data(q, ngx_quic_frame_t, queue);
+
+            if (f->u.stream.offset + f->u.stream.length > offset) {
+                break;
+            }
+
+            q = ngx_queue_next(q);
+        }
+
+        if (q != ngx_queue_sentinel(&qb->chain)) {
+            f = ngx_queue_data(q, ngx_quic_frame_t, queue);
+
+            if (f->u.stream.offset <= offset) {
+
+                /* the beginning of the data is already stored */
+
+                n = f->u.stream.offset + f->u.stream.length - offset;
+
+                if (n >= len) {
+                    break;
+                }
+
+                data += n;
+                len -= n;
+                offset += n;
+
+                q = ngx_queue_next(q);
+                continue;
+            }
+
+            n = ngx_min(len, f->u.stream.offset - offset);
+
+        } else {
+            n = len;
+        }
+
+        n = ngx_min(n, NGX_QUIC_MAX_FRAME_DATA);
+
+        nf = ngx_quic_alloc_frame(c);
+        if (nf == NULL) {
+            return NGX_ERROR;
+        }
+
+        if (ngx_quic_alloc_frame_data(c, nf) != NGX_OK) {
+            ngx_quic_free_frame(c, nf);
+            return NGX_ERROR;
+        }
+
+        nf->u.stream.offset = offset;
+        nf->u.stream.length = n;
+        ngx_memcpy(nf->data, data, n);
+
+        /* inserted before the frame q */
+        ngx_queue_insert_tail(q, &nf->queue);
+
+        data += n;
+        len -= n;
+        offset += n;
+    }
+
+    if (offset > qb->last_offset) {
+        qb->last_offset = offset;
+    }
+
+    return NGX_OK;
+}
+
+
+size_t
+ngx_quic_read_buffer(ngx_connection_t *c, ngx_quic_buffer_t *qb, u_char *buf,
+    size_t size)
+{
+    size_t             n;
+    u_char            *p;
+    ngx_queue_t       *q;
+    ngx_quic_frame_t  *f;
+
+    p = buf;
+
+    while (size && !ngx_queue_empty(&qb->chain)) {
+
+        q = ngx_queue_head(&qb->chain);
+        f = ngx_queue_data(q, ngx_quic_frame_t, queue);
+
+        if (f->u.stream.offset != qb->offset) {
+            break;
+        }
+
+        n = ngx_min(size, f->u.stream.length);
+
+        p = ngx_cpymem(p, f->data, n);
+
+        size -= n;
+        qb->offset += n;
+
+        if (n == f->u.stream.length) {
+            ngx_queue_remove(q);
+            ngx_quic_free_frame(c, f);
+            continue;
+        }
+
+        ngx_memmove(f->data, f->data + n, f->u.stream.length - n);
+
+        f->u.stream.offset += n;
+        f->u.stream.length -= n;
+    }
+
+    return p - buf;
+}
+
+
+void
+ngx_quic_free_buffer(ngx_connection_t *c, ngx_quic_buffer_t *qb)
+{
+    ngx_quic_free_frames(c, &qb->chain);
+}
@@ -0,0 +1,774 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+#include <ngx_event_quic_connection.h>
+
+
+#define ngx_quic_lost_threshold(qc)                                           \
+    ngx_max(NGX_QUIC_TIME_GRANULARITY,                                        \
+            ngx_max((qc)->latest_rtt, (qc)->avg_rtt) * 9 / 8)
+
+
+static ngx_int_t ngx_quic_handle_ack_range(ngx_connection_t *c,
+    ngx_quic_send_ctx_t *ctx, uint64_t min, uint64_t max, uint64_t largest,
+    ngx_msec_t *send_time);
+static void ngx_quic_rtt_sample(ngx_connection_t *c, ngx_quic_ack_frame_t *ack,
+    ngx_uint_t level, ngx_msec_t send_time);
+static void ngx_quic_congestion_ack(ngx_connection_t *c, ngx_quic_frame_t *f);
+static void ngx_quic_congestion_lost(ngx_connection_t *c, ngx_quic_frame_t *f);
+static ngx_uint_t ngx_quic_detect_lost(ngx_connection_t *c);
+static void ngx_quic_resend_packet(ngx_connection_t *c,
+    ngx_quic_send_ctx_t *ctx, ngx_queue_t *q);
+static void ngx_quic_resend_frame(ngx_connection_t *c,
+    ngx_quic_send_ctx_t *ctx, ngx_quic_frame_t *f);
+
+
+ngx_int_t
+ngx_quic_handle_ack_frame(ngx_connection_t *c, ngx_quic_header_t *pkt,
+    ngx_quic_frame_t *f)
+{
+    ssize_t                 n;
+    u_char                 *pos, *end;
+    uint64_t                min, max, gap, range;
+    ngx_msec_t              send_time;
+    ngx_uint_t              i;
+    ngx_quic_send_ctx_t    *ctx;
+    ngx_quic_ack_frame_t   *ack;
+    ngx_quic_connection_t  *qc;
+
+    qc = ngx_quic_get_connection(c);
+    ctx = ngx_quic_get_send_ctx(qc, pkt->level);
+    ack = &f->u.ack;
+
+    ngx_log_debug4(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "quic ack level:%ui largest:%uL first:%uL ranges:%uL",
+                   pkt->level, ack->largest, ack->first_range,
+                   ack->range_count);
+
+    /* RFC 9000, 19.3.1.  ACK Ranges */
+
+    if (ack->first_range > ack->largest) {
+        qc->error = NGX_QUIC_ERR_FRAME_ENCODING_ERROR;
+        return NGX_ERROR;
+    }
+
+    if (ack->largest >= ctx->pnum) {
+        /* 13.1.  Packet Processing: an unsent packet is acknowledged */
+        qc->error = NGX_QUIC_ERR_PROTOCOL_VIOLATION;
+        return NGX_ERROR;
+    }
+
+    send_time = NGX_TIMER_INFINITE;
+
+    max = ack->largest;
+    min = max - ack->first_range;
+
+    if (ngx_quic_handle_ack_range(c, ctx, min, max, ack->largest, &send_time)
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    pos = ack->ranges_start;
+    end = ack->ranges_end;
+
+    for (i = 0; i < ack->range_count; i++) {
+
+        n = ngx_quic_parse_ack_range(pkt->log, pos, end, &gap, &range);
+        if (n == NGX_ERROR) {
+            qc->error = NGX_QUIC_ERR_FRAME_ENCODING_ERROR;
+            return NGX_ERROR;
+        }
+
+        pos += n;
+
+        if (gap + 2 > min) {
+            qc->error = NGX_QUIC_ERR_FRAME_ENCODING_ERROR;
+            ngx_log_error(NGX_LOG_INFO, c->log, 0,
+                          "quic invalid range:%ui in ack frame", i);
+            return NGX_ERROR;
+        }
+
+        max = min - gap - 2;
+
+        if (range > max) {
+            qc->error = NGX_QUIC_ERR_FRAME_ENCODING_ERROR;
+            ngx_log_error(NGX_LOG_INFO, c->log, 0,
+                          "quic invalid range:%ui in ack frame", i);
+            return NGX_ERROR;
+        }
+
+        min = max - range;
+
+        if (ngx_quic_handle_ack_range(c, ctx, min, max, ack->largest,
+                                      &send_time)
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+    }
+
+    if (ctx->largest_ack == NGX_QUIC_UNSET_PN
+        || ack->largest > ctx->largest_ack)
+    {
+        ctx->largest_ack = ack->largest;
+
+        if (send_time != NGX_TIMER_INFINITE) {
+            ngx_quic_rtt_sample(c, ack, pkt->level, send_time);
+        }
+    }
+
+    /* RFC 9002, 6.2.1.  Computing PTO */
+
+    qc->pto_count = 0;
+
+    if (ngx_quic_detect_lost(c)) {
+        ngx_post_event(&qc->push, &ngx_posted_events);
+    }
+
+    ngx_quic_set_pto_timer(c);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_quic_handle_ack_range(ngx_connection_t *c, ngx_quic_send_ctx_t *ctx,
+    uint64_t min, uint64_t max, uint64_t largest, ngx_msec_t *send_time)
+{
+    ngx_uint_t              acked;
+    ngx_queue_t            *q;
+    ngx_quic_frame_t       *f;
+    ngx_quic_connection_t  *qc;
+
+    qc = ngx_quic_get_connection(c);
+
+    acked = 0;
+
+    q = ngx_queue_head(&ctx->sent);
+
+    while (q != ngx_queue_sentinel(&ctx->sent)) {
+
+        f = ngx_queue_data(q, ngx_quic_frame_t, queue);
+        q = ngx_queue_next(q);
+
+        /* the frames are sorted by packet number */
+
+        if (f->pnum > max) {
+            break;
+        }
+
+        if (f->pnum < min) {
+            continue;
+        }
+
+        if (f->pnum == largest) {
+            *send_time = f->sent;
+        }
+
+        ngx_quic_congestion_ack(c, f);
+
+        if (f->type == NGX_QUIC_FT_STREAM) {
+            ngx_quic_handle_stream_ack(c, f);
+        }
+
+        ngx_queue_remove(&f->queue);
+        ngx_quic_free_frame(c, f);
+
+        acked = 1;
+    }
+
+    if (acked) {
+        /* the acknowledged data may unblock the output */
+        ngx_post_event(&qc->push, &ngx_posted_events);
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_quic_rtt_sample(ngx_connection_t *c, ngx_quic_ack_frame_t *ack,
+    ngx_uint_t level, ngx_msec_t send_time)
+{
+    ngx_msec_t              latest_rtt, ack_delay, adjusted_rtt, rttvar_sample;
+    ngx_quic_connection_t  *qc;
+
+    qc = ngx_quic_get_connection(c);
+
+    /* RFC 9002, 5.  Estimating the Round-Trip Time */
+
+    latest_rtt = ngx_current_msec - send_time;
+    qc->latest_rtt = latest_rtt;
+
+    if (qc->min_rtt == NGX_TIMER_INFINITE) {
+        qc->min_rtt = latest_rtt;
+        qc->avg_rtt = latest_rtt;
+        qc->rttvar = latest_rtt / 2;
+        qc->first_rtt = ngx_current_msec;
+
+    } else {
+        qc->min_rtt = ngx_min(qc->min_rtt, latest_rtt);
+
+        ack_delay = (ack->delay << qc->ctp.ack_delay_exponent) / 1000;
+
+        if (level == NGX_QUIC_ENCRYPTION_APPLICATION) {
+            ack_delay = ngx_min(ack_delay, qc->ctp.max_ack_delay);
+        }
+
+        adjusted_rtt = latest_rtt;
+
+        if (qc->min_rtt + ack_delay < latest_rtt) {
+            adjusted_rtt -= ack_delay;
+        }
+
+        rttvar_sample = ngx_abs((ngx_msec_int_t) (qc->avg_rtt - adjusted_rtt));
+        qc->rttvar = (3 * qc->rttvar + rttvar_sample) / 4;
+        qc->avg_rtt = (7 * qc->avg_rtt + adjusted_rtt) / 8;
+    }
+
+    ngx_log_debug4(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "quic rtt sample latest:%M min:%M avg:%M var:%M",
+                   latest_rtt, qc->min_rtt, qc->avg_rtt, qc->rttvar);
+}
+
+
+static void
+ngx_quic_congestion_ack(ngx_connection_t *c, ngx_quic_frame_t *f)
+{
+    ngx_quic_congestion_t  *cg;
+    ngx_quic_connection_t  *qc;
+
+    if (f->plen == 0 || !f->pkt_need_ack) {
+        return;
+    }
+
+    qc = ngx_quic_get_connection(c);
+    cg = &qc->congestion;
+
+    cg->in_flight -= f->plen;
+
+    /* RFC 9002, 7.3.2.  Recovery: the window is not increased */
+
+    if ((ngx_msec_int_t) (f->sent - cg->recovery_start) <= 0) {
+        return;
+    }
+
+    if (cg->window < cg->ssthresh) {
+        /* 7.3.1.  Slow Start */
+        cg->window += f->plen;
+
+    } else {
+        /* 7.3.3.  Congestion Avoidance */
+        cg->window += NGX_QUIC_MIN_INITIAL_SIZE * f->plen / cg->window;
+    }
+}
+
+
+static void
+ngx_quic_congestion_lost(ngx_connection_t *c, ngx_quic_frame_t *f)
+{
+    ngx_quic_congestion_t  *cg;
+    ngx_quic_connection_t  *qc;
+
+    if (f->plen == 0 || !f->pkt_need_ack) {
+        return;
+    }
+
+    qc = ngx_quic_get_connection(c);
+    cg = &qc->congestion;
+
+    cg->in_flight -= f->plen;
+
+    /* a single reduction per round trip */
+
+    if ((ngx_msec_int_t) (f->sent - cg->recovery_start) <= 0) {
+        return;
+    }
+
+    cg->recovery_start = ngx_current_msec;
+    cg->window /= 2;
+
+    if (cg->window < NGX_QUIC_CC_MIN_WINDOW) {
+        cg->window = NGX_QUIC_CC_MIN_WINDOW;
+    }
+
+    cg->ssthresh = cg->window;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "quic congestion lost win:%uz if:%uz",
+                   cg->window, cg->in_flight);
+}
+
+
+static ngx_uint_t
+ngx_quic_detect_lost(ngx_connection_t *c)
+{
+    ngx_uint_t              i, lost;
+    ngx_msec_t              thr;
+    ngx_queue_t            *q;
+    ngx_quic_frame_t       *f;
+    ngx_quic_send_ctx_t    *ctx;
+    ngx_quic_connection_t  *qc;
+
+    qc = ngx_quic_get_connection(c);
+
+    /* RFC 9002, 6.1.  Acknowledgment-Based Detection */
+
+    thr = ngx_quic_lost_threshold(qc);
+    lost = 0;
+
+    for (i = 0; i < NGX_QUIC_ENCRYPTION_LAST; i++) {
+
+        ctx = &qc->send_ctx[i];
+
+        if (ctx->largest_ack == NGX_QUIC_UNSET_PN) {
+            continue;
+        }
+
+        while (!ngx_queue_empty(&ctx->sent)) {
+
+            q = ngx_queue_head(&ctx->sent);
+            f = ngx_queue_data(q, ngx_quic_frame_t, queue);
+
+            if (f->pnum > ctx->largest_ack) {
+                break;
+            }
+
+            if ((ngx_msec_int_t) (f->sent + thr - ngx_current_msec) > 0
+                && ctx->largest_ack - f->pnum < NGX_QUIC_PKT_THR)
+            {
+                break;
+            }
+
+            ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                           "quic packet lost pn:%uL", f->pnum);
+
+            ngx_quic_resend_packet(c, ctx, q);
+            lost = 1;
+        }
+    }
+
+    return lost;
+}
+
+
+static void
+ngx_quic_resend_packet(ngx_connection_t *c, ngx_quic_send_ctx_t *ctx,
+    ngx_queue_t *q)
+{
+    uint64_t           pnum;
+    ngx_queue_t       *next;
+    ngx_quic_frame_t  *f, *start;
+
+    start = ngx_queue_data(q, ngx_quic_frame_t, queue);
+    pnum = start->pnum;
+
+    ngx_quic_congestion_lost(c, start);
+
+    while (q != ngx_queue_sentinel(&ctx->sent)) {
+
+        f = ngx_queue_data(q, ngx_quic_frame_t, queue);
+
+        if (f->pnum != pnum) {
+            break;
+        }
+
+        next = ngx_queue_next(q);
+
+        ngx_queue_remove(q);
+        ngx_quic_resend_frame(c, ctx, f);
+
+        q = next;
+    }
+}
+
+
+static void
+ngx_quic_resend_frame(ngx_connection_t *c, ngx_quic_send_ctx_t *ctx,
+    ngx_quic_frame_t *f)
+{
+    ngx_quic_stream_t      *qs;
+    ngx_quic_connection_t  *qc;
+
+    qc = ngx_quic_get_connection(c);
+
+    switch (f->type) {
+
+    case NGX_QUIC_FT_ACK:
+    case NGX_QUIC_FT_PING:
+    case NGX_QUIC_FT_PATH_RESPONSE:
+
+        /* RFC 9000, 13.3.  Retransmission of Information: not repeated */
+
+        if (f->type == NGX_QUIC_FT_ACK) {
+            ctx->send_ack = 1;
+        }
+
+        ngx_quic_free_frame(c, f);
+        return;
+
+    case NGX_QUIC_FT_STREAM:
+
+        qs = ngx_quic_find_stream(&qc->streams.tree, f->u.stream.stream_id);
+
+        if (qs == NULL || qs->send_state == NGX_QUIC_STREAM_SEND_RESET_SENT) {
+            ngx_quic_free_frame(c, f);
+            return;
+        }
+
+        break;
+
+    case NGX_QUIC_FT_MAX_DATA:
+        f->u.max_data.max_data = qc->streams.recv_max_data;
+        break;
+
+    case NGX_QUIC_FT_MAX_STREAM_DATA:
+
+        qs = ngx_quic_find_stream(&qc->streams.tree,
+                                  f->u.max_stream_data.id);
+
+        if (qs == NULL || qs->recv_state != NGX_QUIC_STREAM_RECV_RECV) {
+            ngx_quic_free_frame(c, f);
+            return;
+        }
+
+        f->u.max_stream_data.limit = qs->recv_max_data;
+        break;
+
+    case NGX_QUIC_FT_MAX_STREAMS:
+    case NGX_QUIC_FT_MAX_STREAMS2:
+
+        f->u.max_streams.limit = f->u.max_streams.bidi
+                                 ? qc->streams.client_max_streams_bidi
+                                 : qc->streams.client_max_streams_uni;
+        break;
+
+    default:
+        break;
+    }
+
+    f->plen = 0;
+    f->pkt_need_ack = 0;
+
+    ngx_quic_queue_frame(qc, f);
+}
+
+
+ngx_int_t
+ngx_quic_duplicate_packet(ngx_quic_send_ctx_t *ctx, uint64_t pn)
+{
+    ngx_uint_t  i;
+
+    if (ctx->nranges == 0) {
+        return NGX_OK;
+    }
+
+    if (pn < ctx->ack_floor) {
+        /* too old to be tracked */
+        return NGX_DECLINED;
+    }
+
+    for (i = 0; i < ctx->nranges; i++) {
+        if (pn >= ctx->ranges[i].lo && pn <= ctx->ranges[i].hi) {
+            return NGX_DECLINED;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_quic_ack_packet(ngx_connection_t *c, ngx_quic_header_t *pkt)
+{
+    uint64_t                pn;
+    ngx_uint_t              i, j;
+    ngx_quic_range_t       *r;
+    ngx_quic_send_ctx_t    *ctx;
+    ngx_quic_connection_t  *qc;
+
+    qc = ngx_quic_get_connection(c);
+    ctx = ngx_quic_get_send_ctx(qc, pkt->level);
+
+    pn = pkt->pn;
+
+    if (ctx->largest_pn == NGX_QUIC_UNSET_PN || pn > ctx->largest_pn) {
+        ctx->largest_pn = pn;
+        ctx->largest_received = ngx_current_msec;
+    }
+
+    /* the ranges are sorted in descending order and do not overlap */
+
+    r = ctx->ranges;
+
+    for (i = 0; i < ctx->nranges; i++) {
+
+        if (pn > r[i].hi + 1) {
+            break;
+        }
+
+        if (pn == r[i].hi + 1) {
+            r[i].hi = pn;
+            goto done;
+        }
+
+        if (pn + 1 == r[i].lo) {
+            r[i].lo = pn;
+
+            /* the gap to the next range is closed */
+
+            if (i + 1 < ctx->nranges && r[i + 1].hi + 1 == pn) {
+                r[i].lo = r[i + 1].lo;
+
+                ngx_memmove(&r[i + 1], &r[i + 2],
+                            (ctx->nranges - i - 2) * sizeof(ngx_quic_range_t));
+                ctx->nranges--;
+            }
+
+            goto done;
+        }
+    }
+
+    /* a new range is inserted before the range i */
+
+    if (ctx->nranges == NGX_QUIC_MAX_RANGES) {
+
+        if (i == ctx->nranges) {
+            /* older than all tracked ranges */
+            goto done;
+        }
+
+        /* the oldest range is forgotten */
+
+        ctx->nranges--;
+        ctx->ack_floor = r[ctx->nranges - 1].lo;
+    }
+
+    for (j = ctx->nranges; j > i; j--) {
+        r[j] = r[j - 1];
+    }
+
+    r[i].lo = pn;
+    r[i].hi = pn;
+
+    ctx->nranges++;
+
+done:
+
+    if (pkt->need_ack) {
+        ctx->send_ack = 1;
+        ngx_post_event(&qc->push, &ngx_posted_events);
+    }
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_quic_generate_ack(ngx_connection_t *c, ngx_quic_send_ctx_t *ctx,
+    ngx_quic_frame_t *f)
+{
+    u_char                 *p;
+    ngx_uint_t              i;
+    ngx_msec_t              delay;
+    ngx_quic_range_t       *r;
+
+    if (ctx->nranges == 0) {
+        return NGX_DECLINED;
+    }
+
+    r = ctx->ranges;
+
+    p = ctx->ack_ranges;
+
+    for (i = 1; i < ctx->nranges; i++) {
+        ngx_quic_build_int(&p, r[i - 1].lo - r[i].hi - 2);
+        ngx_quic_build_int(&p, r[i].hi - r[i].lo);
+    }
+
+    delay = 0;
+
+    if (ctx->level == NGX_QUIC_ENCRYPTION_APPLICATION) {
+        delay = ngx_current_msec - ctx->largest_received;
+    }
+
+    f->level = ctx->level;
+    f->type = NGX_QUIC_FT_ACK;
+    f->u.ack.largest = r[0].hi;
+    f->u.ack.delay = (delay * 1000) >> NGX_QUIC_DEFAULT_ACK_DELAY_EXPONENT;
+    f->u.ack.range_count = ctx->nranges - 1;
+    f->u.ack.first_range = r[0].hi - r[0].lo;
+    f->u.ack.ranges_start = ctx->ack_ranges;
+    f->u.ack.ranges_end = p;
+
+    ctx->send_ack = 0;
+
+    return NGX_OK;
+}
+
+
+ngx_msec_t
+ngx_quic_pto(ngx_connection_t *c, ngx_quic_send_ctx_t *ctx)
+{
+    ngx_msec_t              duration;
+    ngx_quic_connection_t  *qc;
+
+    qc = ngx_quic_get_connection(c);
+
+    /* RFC 9002, 6.2.1.  Computing PTO */
+
+    duration = qc->avg_rtt;
+    duration += ngx_max(4 * qc->rttvar, NGX_QUIC_TIME_GRANULARITY);
+
+    if (ctx->level == NGX_QUIC_ENCRYPTION_APPLICATION && c->ssl
+        && c->ssl->handshaked)
+    {
+        duration += qc->ctp.max_ack_delay;
+    }
+
+    return duration << ngx_min(qc->pto_count, 10);
+}
+
+
+void
+ngx_quic_set_pto_timer(ngx_connection_t *c)
+{
+    ngx_uint_t              i;
+    ngx_msec_t              thr;
+    ngx_msec_int_t          wait, w;
+    ngx_queue_t            *q;
+    ngx_quic_frame_t       *f;
+    ngx_quic_send_ctx_t    *ctx;
+    ngx_quic_connection_t  *qc;
+
+    qc = ngx_quic_get_connection(c);
+
+    if (qc->closing) {
+        return;
+    }
+
+    thr = ngx_quic_lost_threshold(qc);
+    wait = -1;
+
+    for (i = 0; i < NGX_QUIC_ENCRYPTION_LAST; i++) {
+
+        ctx = &qc->send_ctx[i];
+
+        if (ngx_queue_empty(&ctx->sent)) {
+            continue;
+        }
+
+        /* 6.1.2.  Time Threshold */
+
+        q = ngx_queue_head(&ctx->sent);
+        f = ngx_queue_data(q, ngx_quic_frame_t, queue);
+
+        if (ctx->largest_ack != NGX_QUIC_UNSET_PN
+            && f->pnum < ctx->largest_ack)
+        {
+            w = (ngx_msec_int_t) (f->sent + thr - ngx_current_msec);
+
+            if (wait == -1 || w < wait) {
+                wait = w;
+            }
+        }
+
+        /* 6.2.  Probe Timeout, since the last packet sent */
+
+        q = ngx_queue_last(&ctx->sent);
+        f = ngx_queue_data(q, ngx_quic_frame_t, queue);
+
+        w = (ngx_msec_int_t) (f->sent + ngx_quic_pto(c, ctx)
+                              - ngx_current_msec);
+
+        if (wait == -1 || w < wait) {
+            wait = w;
+        }
+    }
+
+    if (wait == -1) {
+        if (qc->pto.timer_set) {
+            ngx_del_timer(&qc->pto);
+        }
+
+        return;
+    }
+
+    ngx_add_timer(&qc->pto, wait > 0 ? (ngx_msec_t) wait : 1);
+}
+
+
+void
+ngx_quic_pto_handler(ngx_event_t *ev)
+{
+    ngx_uint_t              i, fired;
+    ngx_queue_t            *q;
+    ngx_quic_frame_t       *f;
+    ngx_connection_t       *c;
+    ngx_quic_send_ctx_t    *ctx;
+    ngx_quic_connection_t  *qc;
+
+    c = ev->data;
+    qc = ngx_quic_get_connection(c);
+
+    ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, 0, "quic pto timer");
+
+    if (qc->closing) {
+        return;
+    }
+
+    fired = ngx_quic_detect_lost(c);
+
+    if (!fired) {
+
+        /*
+         * 6.2.4.  Sending Probe Packets: the oldest unacknowledged
+         * packet is retransmitted, its acknowledgement reveals
+         * the other lost packets
+         */
+
+        for (i = 0; i < NGX_QUIC_ENCRYPTION_LAST; i++) {
+
+            ctx = &qc->send_ctx[i];
+
+            if (ngx_queue_empty(&ctx->sent)) {
+                continue;
+            }
+
+            q = ngx_queue_last(&ctx->sent);
+            f = ngx_queue_data(q, ngx_quic_frame_t, queue);
+
+            if ((ngx_msec_int_t) (f->sent + ngx_quic_pto(c, ctx)
+                                  - ngx_current_msec)
+                > 0)
+            {
+                continue;
+            }
+
+            ngx_log_debug2(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                           "quic pto level:%ui count:%ui",
+                           ctx->level, qc->pto_count);
+
+            ngx_quic_resend_packet(c, ctx, ngx_queue_head(&ctx->sent));
+
+            fired = 1;
+        }
+
+        if (fired) {
+            qc->pto_count++;
+        }
+    }
+
+    if (fired) {
+        ngx_post_event(&qc->push, &ngx_posted_events);
+    }
+
+    ngx_quic_set_pto_timer(c);
+}
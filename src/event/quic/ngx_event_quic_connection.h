@@ -0,0 +1,237 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#ifndef _NGX_EVENT_QUIC_CONNECTION_H_INCLUDED_
+#define _NGX_EVENT_QUIC_CONNECTION_H_INCLUDED_
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+
+
+typedef struct ngx_quic_connection_s  ngx_quic_connection_t;
+typedef struct ngx_quic_compat_s      ngx_quic_compat_t;
+
+
+#include <ngx_event_quic_transport.h>
+#include <ngx_event_quic_protection.h>
+#include <ngx_event_quic_openssl_compat.h>
+
+
+/* received packet numbers are tracked in this number of ranges */
+#define NGX_QUIC_MAX_RANGES              32
+
+/* payload of a CRYPTO or STREAM frame always fits a 1200 byte datagram */
+#define NGX_QUIC_MAX_FRAME_DATA          1100
+
+#define NGX_QUIC_MAX_FRAMES              16384
+#define NGX_QUIC_MAX_CRYPTO_DATA         65536
+
+/* RFC 9002, 6.1.1. Packet Threshold and 6.2.2. Handshakes and New Paths */
+#define NGX_QUIC_PKT_THR                 3
+#define NGX_QUIC_TIME_GRANULARITY        1
+#define NGX_QUIC_INITIAL_RTT             333
+
+/* RFC 9002, 7.2. Initial and Minimum Congestion Window */
+#define NGX_QUIC_CC_INITIAL_WINDOW       (10 * NGX_QUIC_MIN_INITIAL_SIZE)
+#define NGX_QUIC_CC_MIN_WINDOW           (2 * NGX_QUIC_MIN_INITIAL_SIZE)
+
+/* RFC 9000, 8.1. Address Validation during Connection Establishment */
+#define NGX_QUIC_AMPLIFICATION_FACTOR    3
+
+#define NGX_QUIC_CLOSE_PTO_FACTOR        3
+
+#define NGX_QUIC_STREAM_GONE             (void *) -1
+
+#define NGX_QUIC_UNSET_PN                (uint64_t) -1
+
+#define ngx_quic_get_connection(c)                                           \
+    ((ngx_quic_connection_t *) (c)->udp)
+
+#define ngx_quic_get_send_ctx(qc, level)  (&(qc)->send_ctx[level])
+
+#define ngx_quic_stream_bidi(id)                                             \
+    (((id) & NGX_QUIC_STREAM_UNIDIRECTIONAL) == 0)
+#define ngx_quic_stream_server(id)                                           \
+    ((id) & NGX_QUIC_STREAM_SERVER_INITIATED)
+
+
+typedef struct {
+    uint64_t                          lo;
+    uint64_t                          hi;
+} ngx_quic_range_t;
+
+
+typedef struct {
+    ngx_uint_t                        level;
+
+    uint64_t                          pnum;          /* next to be sent */
+    uint64_t                          largest_ack;   /* acked by the peer */
+
+    uint64_t                          largest_pn;    /* received */
+    ngx_msec_t                        largest_received;
+    uint64_t                          ack_floor;
+    ngx_quic_range_t                  ranges[NGX_QUIC_MAX_RANGES];
+    ngx_uint_t                        nranges;
+    ngx_uint_t                        send_ack;
+
+    ngx_queue_t                       frames;        /* to be sent */
+    ngx_queue_t                       sent;          /* awaiting ack */
+
+    uint64_t                          crypto_sent;
+    ngx_quic_buffer_t                 crypto;
+
+    u_char                            ack_ranges[NGX_QUIC_MAX_RANGES * 16];
+} ngx_quic_send_ctx_t;
+
+
+typedef struct {
+    size_t                            in_flight;
+    size_t                            window;
+    size_t                            ssthresh;
+    ngx_msec_t                        recovery_start;
+} ngx_quic_congestion_t;
+
+
+typedef struct {
+    ngx_rbtree_t                      tree;
+    ngx_rbtree_node_t                 sentinel;
+
+    ngx_queue_t                       free;
+
+    uint64_t                          received;
+    uint64_t                          read;
+    uint64_t                          recv_max_data;
+    uint64_t                          recv_window;
+
+    uint64_t                          sent;
+    uint64_t                          send_max_data;
+
+    uint64_t                          server_max_streams_uni;
+    uint64_t                          server_max_streams_bidi;
+    uint64_t                          server_streams_uni;
+    uint64_t                          server_streams_bidi;
+
+    uint64_t                          client_max_streams_uni;
+    uint64_t                          client_max_streams_bidi;
+    uint64_t                          client_streams_uni;
+    uint64_t                          client_streams_bidi;
+} ngx_quic_streams_t;
+
+
+struct ngx_quic_connection_s {
+    ngx_udp_connection_t              udp;        /* keyed by server id */
+    ngx_udp_connection_t              odcid_udp;  /* keyed by client id */
+
+    ngx_str_t                         scid;
+    ngx_str_t                         odcid;
+    ngx_str_t                         dcid;
+    uint64_t                          dcid_seqnum;
+
+    u_char                            scid_buf[NGX_QUIC_SERVER_CID_LEN];
+    u_char                            dcid_buf[NGX_QUIC_MAX_CID_LEN];
+
+    ngx_quic_tp_t                     tp;
+    ngx_quic_tp_t                     ctp;
+    ngx_str_t                         tp_encoded;
+
+    ngx_quic_send_ctx_t               send_ctx[NGX_QUIC_ENCRYPTION_LAST];
+
+    ngx_quic_keys_t                  *keys;
+    ngx_quic_conf_t                  *conf;
+    ngx_quic_compat_t                *compat;
+
+    ngx_event_t                       push;
+    ngx_event_t                       pto;
+    ngx_event_t                       close;
+
+    ngx_quic_streams_t                streams;
+    ngx_quic_congestion_t             congestion;
+
+    ngx_queue_t                       free_frames;
+    u_char                           *free_chunks;
+    ngx_uint_t                        nframes;
+
+    ngx_msec_t                        first_rtt;
+    ngx_msec_t                        latest_rtt;
+    ngx_msec_t                        avg_rtt;
+    ngx_msec_t                        min_rtt;
+    ngx_msec_t                        rttvar;
+    ngx_uint_t                        pto_count;
+
+    off_t                             received;
+
+    ngx_uint_t                        error;
+    ngx_uint_t                        error_ftype;
+    const char                       *error_reason;
+
+    unsigned                          error_app:1;
+    unsigned                          closing:1;
+    unsigned                          draining:1;
+    unsigned                          shutdown:1;
+    unsigned                          key_phase:1;
+    unsigned                          validated:1;
+    unsigned                          client_tp_done:1;
+    unsigned                          initialized:1;
+};
+
+
+/* ngx_event_quic.c */
+void ngx_quic_close_connection(ngx_connection_t *c, ngx_int_t rc);
+ngx_quic_frame_t *ngx_quic_alloc_frame(ngx_connection_t *c);
+ngx_int_t ngx_quic_alloc_frame_data(ngx_connection_t *c,
+    ngx_quic_frame_t *f);
+void ngx_quic_free_frame(ngx_connection_t *c, ngx_quic_frame_t *f);
+void ngx_quic_free_frames(ngx_connection_t *c, ngx_queue_t *frames);
+void ngx_quic_queue_frame(ngx_quic_connection_t *qc, ngx_quic_frame_t *f);
+ngx_int_t ngx_quic_write_buffer(ngx_connection_t *c, ngx_quic_buffer_t *qb,
+    uint64_t offset, u_char *data, uint64_t len);
+size_t ngx_quic_read_buffer(ngx_connection_t *c, ngx_quic_buffer_t *qb,
+    u_char *buf, size_t size);
+void ngx_quic_free_buffer(ngx_connection_t *c, ngx_quic_buffer_t *qb);
+ngx_int_t ngx_quic_add_handshake_data(ngx_connection_t *c, ngx_uint_t level,
+    const u_char *data, size_t len);
+void ngx_quic_discard_ctx(ngx_connection_t *c, ngx_uint_t level);
+
+/* ngx_event_quic_ack.c */
+ngx_int_t ngx_quic_handle_ack_frame(ngx_connection_t *c,
+    ngx_quic_header_t *pkt, ngx_quic_frame_t *f);
+ngx_int_t ngx_quic_ack_packet(ngx_connection_t *c, ngx_quic_header_t *pkt);
+ngx_int_t ngx_quic_duplicate_packet(ngx_quic_send_ctx_t *ctx, uint64_t pn);
+ngx_int_t ngx_quic_generate_ack(ngx_connection_t *c, ngx_quic_send_ctx_t *ctx,
+    ngx_quic_frame_t *f);
+ngx_msec_t ngx_quic_pto(ngx_connection_t *c, ngx_quic_send_ctx_t *ctx);
+void ngx_quic_set_pto_timer(ngx_connection_t *c);
+void ngx_quic_pto_handler(ngx_event_t *ev);
+
+/* ngx_event_quic_output.c */
+ngx_int_t ngx_quic_output(ngx_connection_t *c);
+ngx_int_t ngx_quic_send_version_negotiation(ngx_connection_t *c,
+    ngx_quic_header_t *pkt);
+ngx_int_t ngx_quic_send_close(ngx_connection_t *c);
+
+/* ngx_event_quic_streams.c */
+ngx_int_t ngx_quic_handle_stream_frame(ngx_connection_t *c,
+    ngx_quic_header_t *pkt, ngx_quic_frame_t *f);
+ngx_int_t ngx_quic_handle_reset_stream_frame(ngx_connection_t *c,
+    ngx_quic_header_t *pkt, ngx_quic_frame_t *f);
+ngx_int_t ngx_quic_handle_stop_sending_frame(ngx_connection_t *c,
+    ngx_quic_header_t *pkt, ngx_quic_frame_t *f);
+ngx_int_t ngx_quic_handle_max_data_frame(ngx_connection_t *c,
+    ngx_quic_frame_t *f);
+ngx_int_t ngx_quic_handle_max_stream_data_frame(ngx_connection_t *c,
+    ngx_quic_header_t *pkt, ngx_quic_frame_t *f);
+ngx_int_t ngx_quic_handle_max_streams_frame(ngx_connection_t *c,
+    ngx_quic_frame_t *f);
+void ngx_quic_handle_stream_ack(ngx_connection_t *c, ngx_quic_frame_t *f);
+ngx_quic_stream_t *ngx_quic_find_stream(ngx_rbtree_t *rbtree, uint64_t id);
+ngx_int_t ngx_quic_close_streams(ngx_connection_t *c,
+    ngx_quic_connection_t *qc);
+void ngx_quic_rbtree_insert_stream(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
+
+#endif /* _NGX_EVENT_QUIC_CONNECTION_H_INCLUDED_ */
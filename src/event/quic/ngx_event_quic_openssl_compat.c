@@ -0,0 +1,529 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+#include <ngx_event_quic_connection.h>
+
+
+#define NGX_QUIC_COMPAT_RECORD_SIZE      16384
+
+
+static ngx_quic_connection_t *ngx_quic_compat_get_connection(
+    const SSL *ssl);
+static void ngx_quic_compat_keylog_callback(const SSL *ssl,
+    const char *line);
+static ngx_int_t ngx_quic_compat_set_record_secret(ngx_connection_t *c,
+    ngx_quic_compat_t *com, ngx_uint_t cipher_id, u_char *secret,
+    size_t len);
+static int ngx_quic_compat_add_transport_params_callback(SSL *ssl,
+    unsigned int ext_type, unsigned int context, const unsigned char **out,
+    size_t *outlen, X509 *x, size_t chainidx, int *al, void *add_arg);
+static int ngx_quic_compat_parse_transport_params_callback(SSL *ssl,
+    unsigned int ext_type, unsigned int context, const unsigned char *in,
+    size_t inlen, X509 *x, size_t chainidx, int *al, void *parse_arg);
+static void ngx_quic_compat_message_callback(int write_p, int version,
+    int content_type, const void *buf, size_t len, SSL *ssl, void *arg);
+static void ngx_quic_compat_cleanup(void *data);
+
+
+ngx_int_t
+ngx_quic_compat_init(ngx_conf_t *cf, SSL_CTX *ctx)
+{
+    if (SSL_CTX_get_keylog_callback(ctx) == ngx_quic_compat_keylog_callback) {
+        return NGX_OK;
+    }
+
+    SSL_CTX_set_keylog_callback(ctx, ngx_quic_compat_keylog_callback);
+
+    if (SSL_CTX_add_custom_ext(ctx, NGX_QUIC_EXT_TRANSPORT_PARAMS,
+                               SSL_EXT_CLIENT_HELLO
+                               |SSL_EXT_TLS1_3_ENCRYPTED_EXTENSIONS,
+                               ngx_quic_compat_add_transport_params_callback,
+                               NULL,
+                               NULL,
+                               ngx_quic_compat_parse_transport_params_callback,
+                               NULL)
+        == 0)
+    {
+        ngx_ssl_error(NGX_LOG_EMERG, cf->log, 0,
+                      "SSL_CTX_add_custom_ext() failed");
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_quic_compat_init_connection(ngx_connection_t *c)
+{
+    BIO                    *rbio, *wbio;
+    ngx_ssl_conn_t         *ssl_conn;
+    ngx_pool_cleanup_t     *cln;
+    ngx_quic_compat_t      *com;
+    ngx_quic_connection_t  *qc;
+
+    qc = ngx_quic_get_connection(c);
+    ssl_conn = c->ssl->connection;
+
+    com = ngx_pcalloc(c->pool, sizeof(ngx_quic_compat_t));
+    if (com == NULL) {
+        return NGX_ERROR;
+    }
+
+    com->write_level = NGX_QUIC_ENCRYPTION_INITIAL;
+
+    cln = ngx_pool_cleanup_add(c->pool, 0);
+    if (cln == NULL) {
+        return NGX_ERROR;
+    }
+
+    cln->handler = ngx_quic_compat_cleanup;
+    cln->data = com;
+
+    rbio = BIO_new(BIO_s_mem());
+    if (rbio == NULL) {
+        return NGX_ERROR;
+    }
+
+    /* an empty buffer means the data are to be received */
+    BIO_set_mem_eof_return(rbio, -1);
+
+    wbio = BIO_new(BIO_s_null());
+    if (wbio == NULL) {
+        BIO_free(rbio);
+        return NGX_ERROR;
+    }
+
+    SSL_set_bio(ssl_conn, rbio, wbio);
+
+    com->rbio = rbio;
+
+    SSL_set_msg_callback(ssl_conn, ngx_quic_compat_message_callback);
+
+    if (SSL_set_min_proto_version(ssl_conn, TLS1_3_VERSION) == 0) {
+        ngx_ssl_error(NGX_LOG_INFO, c->log, 0,
+                      "SSL_set_min_proto_version() failed");
+        return NGX_ERROR;
+    }
+
+#ifdef SSL_OP_ENABLE_MIDDLEBOX_COMPAT
+    SSL_clear_options(ssl_conn, SSL_OP_ENABLE_MIDDLEBOX_COMPAT);
+#endif
+
+#ifdef SSL_MODE_ASYNC
+    /* the handshake is driven by datagrams and cannot be resumed */
+    SSL_clear_mode(ssl_conn, SSL_MODE_ASYNC);
+#endif
+
+#ifdef SSL_READ_EARLY_DATA_SUCCESS
+    SSL_set_max_early_data(ssl_conn, 0);
+    c->ssl->try_early_data = 0;
+#endif
+
+    SSL_set_num_tickets(ssl_conn, 0);
+
+    qc->compat = com;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_quic_compat_cleanup(void *data)
+{
+    ngx_quic_compat_t  *com = data;
+
+    if (com->rctx) {
+        EVP_CIPHER_CTX_free(com->rctx);
+        com->rctx = NULL;
+    }
+}
+
+
+static ngx_quic_connection_t *
+ngx_quic_compat_get_connection(const SSL *ssl)
+{
+    ngx_connection_t  *c;
+
+    c = ngx_ssl_get_connection((ngx_ssl_conn_t *) ssl);
+
+    /* the callbacks are installed for all connections of the context */
+
+    if (c == NULL || c->listening == NULL || !c->listening->quic
+        || c->udp == NULL)
+    {
+        return NULL;
+    }
+
+    return ngx_quic_get_connection(c);
+}
+
+
+static void
+ngx_quic_compat_keylog_callback(const SSL *ssl, const char *line)
+{
+    u_char                 *p, *start, ch, c1;
+    size_t                  n;
+    ngx_uint_t              i, write, level;
+    ngx_connection_t       *c;
+    const SSL_CIPHER       *cipher;
+    ngx_quic_compat_t      *com;
+    ngx_quic_connection_t  *qc;
+    u_char                  secret[NGX_QUIC_MAX_MD_SIZE];
+
+    qc = ngx_quic_compat_get_connection(ssl);
+    if (qc == NULL || qc->compat == NULL) {
+        return;
+    }
+
+    c = ngx_ssl_get_connection((ngx_ssl_conn_t *) ssl);
+    com = qc->compat;
+
+    p = (u_char *) line;
+
+    if (ngx_strncmp(p, "CLIENT_HANDSHAKE_TRAFFIC_SECRET ", 32) == 0) {
+        write = 0;
+        level = NGX_QUIC_ENCRYPTION_HANDSHAKE;
+        p += 32;
+
+    } else if (ngx_strncmp(p, "SERVER_HANDSHAKE_TRAFFIC_SECRET ", 32) == 0) {
+        write = 1;
+        level = NGX_QUIC_ENCRYPTION_HANDSHAKE;
+        p += 32;
+
+    } else if (ngx_strncmp(p, "CLIENT_TRAFFIC_SECRET_0 ", 24) == 0) {
+        write = 0;
+        level = NGX_QUIC_ENCRYPTION_APPLICATION;
+        p += 24;
+
+    } else if (ngx_strncmp(p, "SERVER_TRAFFIC_SECRET_0 ", 24) == 0) {
+        write = 1;
+        level = NGX_QUIC_ENCRYPTION_APPLICATION;
+        p += 24;
+
+    } else {
+        return;
+    }
+
+    /* skip the client random */
+
+    while (*p && *p != ' ') {
+        p++;
+    }
+
+    if (*p++ != ' ') {
+        goto failed;
+    }
+
+    start = p;
+
+    for (n = 0; n < NGX_QUIC_MAX_MD_SIZE; n++) {
+
+        for (i = 0; i < 2; i++) {
+            ch = *p++;
+            c1 = (u_char) (ch | 0x20);
+
+            if (ch >= '0' && ch <= '9') {
+                ch -= '0';
+
+            } else if (c1 >= 'a' && c1 <= 'f') {
+                ch = c1 - 'a' + 10;
+
+            } else {
+                goto done;
+            }
+
+            secret[n] = i ? (secret[n] << 4) | ch : ch;
+        }
+    }
+
+done:
+
+    if (n == 0 || p - 1 != start + 2 * n) {
+        goto failed;
+    }
+
+    cipher = SSL_get_pending_cipher(ssl);
+
+    if (cipher == NULL) {
+        cipher = SSL_get_current_cipher(ssl);
+    }
+
+    if (cipher == NULL) {
+        goto failed;
+    }
+
+    ngx_log_debug3(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "quic compat secret level:%ui write:%ui cipher:%04xD",
+                   level, write, SSL_CIPHER_get_id(cipher) & 0xffff);
+
+    if (ngx_quic_keys_set_encryption_secret(c->log, write, qc->keys, level,
+                                            SSL_CIPHER_get_id(cipher) & 0xffff,
+                                            secret, n)
+        != NGX_OK)
+    {
+        goto failed;
+    }
+
+    if (write) {
+        com->write_level = level;
+
+    } else if (level == NGX_QUIC_ENCRYPTION_HANDSHAKE) {
+        if (ngx_quic_compat_set_record_secret(c, com,
+                                              SSL_CIPHER_get_id(cipher)
+                                              & 0xffff,
+                                              secret, n)
+            != NGX_OK)
+        {
+            goto failed;
+        }
+    }
+
+    ngx_explicit_memzero(secret, sizeof(secret));
+
+    return;
+
+failed:
+
+    ngx_explicit_memzero(secret, sizeof(secret));
+
+    ngx_log_error(NGX_LOG_INFO, c->log, 0,
+                  "quic compat failed to set secret");
+
+    com->error = 1;
+}
+
+
+static ngx_int_t
+ngx_quic_compat_set_record_secret(ngx_connection_t *c, ngx_quic_compat_t *com,
+    ngx_uint_t cipher_id, u_char *secret, size_t len)
+{
+    ngx_quic_md_t        s, key;
+    ngx_quic_ciphers_t   ciphers;
+
+    /* RFC 8446, 7.3.  Traffic Key Calculation */
+
+    if (ngx_quic_ciphers(cipher_id, &ciphers) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    s.len = len;
+    ngx_memcpy(s.data, secret, len);
+
+    key.len = EVP_CIPHER_key_length(ciphers.cipher);
+
+    if (ngx_quic_hkdf_expand_label(c->log, ciphers.md, &s, "tls13 key",
+                                   key.data, key.len)
+        != NGX_OK
+        || ngx_quic_hkdf_expand_label(c->log, ciphers.md, &s, "tls13 iv",
+                                      com->riv, NGX_QUIC_IV_LEN)
+           != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    if (com->rctx) {
+        EVP_CIPHER_CTX_free(com->rctx);
+        com->rctx = NULL;
+    }
+
+    if (ngx_quic_crypto_init(ciphers.cipher, key.data, 1, &com->rctx, c->log)
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    com->rseq = 0;
+
+    ngx_explicit_memzero(s.data, sizeof(s.data));
+    ngx_explicit_memzero(key.data, sizeof(key.data));
+
+    return NGX_OK;
+}
+
+
+static int
+ngx_quic_compat_add_transport_params_callback(SSL *ssl, unsigned int ext_type,
+    unsigned int context, const unsigned char **out, size_t *outlen, X509 *x,
+    size_t chainidx, int *al, void *add_arg)
+{
+    ngx_quic_connection_t  *qc;
+
+    qc = ngx_quic_compat_get_connection(ssl);
+    if (qc == NULL) {
+        /* not a QUIC connection, the extension is not added */
+        return 0;
+    }
+
+    *out = qc->tp_encoded.data;
+    *outlen = qc->tp_encoded.len;
+
+    return 1;
+}
+
+
+static int
+ngx_quic_compat_parse_transport_params_callback(SSL *ssl,
+    unsigned int ext_type, unsigned int context, const unsigned char *in,
+    size_t inlen, X509 *x, size_t chainidx, int *al, void *parse_arg)
+{
+    u_char                 *p;
+    ngx_connection_t       *c;
+    ngx_quic_connection_t  *qc;
+
+    qc = ngx_quic_compat_get_connection(ssl);
+    if (qc == NULL) {
+        return 1;
+    }
+
+    c = ngx_ssl_get_connection(ssl);
+
+    p = ngx_pnalloc(c->pool, inlen);
+    if (p == NULL) {
+        *al = SSL_AD_INTERNAL_ERROR;
+        return -1;
+    }
+
+    ngx_memcpy(p, in, inlen);
+
+    qc->compat->ctp.data = p;
+    qc->compat->ctp.len = inlen;
+
+    return 1;
+}
+
+
+static void
+ngx_quic_compat_message_callback(int write_p, int version, int content_type,
+    const void *buf, size_t len, SSL *ssl, void *arg)
+{
+    ngx_connection_t       *c;
+    ngx_quic_compat_t      *com;
+    ngx_quic_connection_t  *qc;
+
+    if (!write_p) {
+        return;
+    }
+
+    qc = ngx_quic_compat_get_connection(ssl);
+    if (qc == NULL || qc->compat == NULL) {
+        return;
+    }
+
+    c = ngx_ssl_get_connection(ssl);
+    com = qc->compat;
+
+    switch (content_type) {
+
+    case SSL3_RT_HANDSHAKE:
+        ngx_log_debug2(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                       "quic compat tx handshake len:%uz level:%ui",
+                       len, com->write_level);
+
+        if (ngx_quic_add_handshake_data(c, com->write_level, buf, len)
+            != NGX_OK)
+        {
+            com->error = 1;
+        }
+
+        break;
+
+    case SSL3_RT_ALERT:
+        if (len >= 2) {
+            com->alert = ((u_char *) buf)[1];
+
+            ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                           "quic compat tx alert:%ui", com->alert);
+        }
+
+        break;
+    }
+}
+
+
+ngx_int_t
+ngx_quic_compat_provide_data(ngx_connection_t *c, ngx_uint_t level,
+    u_char *data, size_t len)
+{
+    u_char                 *p;
+    size_t                  n, out_len;
+    ngx_quic_compat_t      *com;
+    ngx_quic_connection_t  *qc;
+    u_char                  header[5], nonce[NGX_QUIC_IV_LEN];
+
+    static u_char           in[NGX_QUIC_COMPAT_RECORD_SIZE + 1];
+    static u_char           out[NGX_QUIC_COMPAT_RECORD_SIZE + 1
+                                + NGX_QUIC_TAG_LEN];
+
+    qc = ngx_quic_get_connection(c);
+    com = qc->compat;
+
+    if (level == NGX_QUIC_ENCRYPTION_APPLICATION) {
+        /* post-handshake messages are not expected, no tickets are sent */
+        return NGX_OK;
+    }
+
+    while (len) {
+        n = ngx_min(len, NGX_QUIC_COMPAT_RECORD_SIZE);
+
+        header[1] = 0x03;
+        header[2] = 0x03;
+
+        if (level == NGX_QUIC_ENCRYPTION_INITIAL) {
+
+            /* RFC 8446, 5.1.  Record Layer: TLSPlaintext */
+
+            header[0] = SSL3_RT_HANDSHAKE;
+            header[3] = (u_char) (n >> 8);
+            header[4] = (u_char) n;
+
+            p = data;
+            out_len = n;
+
+        } else {
+
+            /* 5.2.  Record Payload Protection: TLSCiphertext */
+
+            if (com->rctx == NULL) {
+                return NGX_ERROR;
+            }
+
+            ngx_memcpy(in, data, n);
+            in[n] = SSL3_RT_HANDSHAKE;
+
+            header[0] = SSL3_RT_APPLICATION_DATA;
+            header[3] = (u_char) ((n + 1 + NGX_QUIC_TAG_LEN) >> 8);
+            header[4] = (u_char) (n + 1 + NGX_QUIC_TAG_LEN);
+
+            ngx_memcpy(nonce, com->riv, NGX_QUIC_IV_LEN);
+            ngx_quic_compute_nonce(nonce, sizeof(nonce), com->rseq++);
+
+            if (ngx_quic_crypto_seal(com->rctx, out, &out_len, nonce, in,
+                                     n + 1, header, 5, c->log)
+                != NGX_OK)
+            {
+                return NGX_ERROR;
+            }
+
+            p = out;
+        }
+
+        if (BIO_write(com->rbio, header, 5) != 5
+            || BIO_write(com->rbio, p, out_len) != (int) out_len)
+        {
+            ngx_ssl_error(NGX_LOG_INFO, c->log, 0, "BIO_write() failed");
+            return NGX_ERROR;
+        }
+
+        data += n;
+        len -= n;
+    }
+
+    return NGX_OK;
+}
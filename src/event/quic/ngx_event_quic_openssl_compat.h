@@ -0,0 +1,43 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#ifndef _NGX_EVENT_QUIC_OPENSSL_COMPAT_H_INCLUDED_
+#define _NGX_EVENT_QUIC_OPENSSL_COMPAT_H_INCLUDED_
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+
+/*
+ * OpenSSL has no QUIC API: handshake messages are intercepted with
+ * the message callback, traffic secrets are obtained from the key log
+ * callback, and the client messages are fed to the library as TLS records
+ */
+
+#define NGX_QUIC_EXT_TRANSPORT_PARAMS    0x39
+
+
+struct ngx_quic_compat_s {
+    BIO                      *rbio;
+    ngx_uint_t                write_level;
+
+    EVP_CIPHER_CTX           *rctx;       /* client handshake records */
+    u_char                    riv[NGX_QUIC_IV_LEN];
+    uint64_t                  rseq;
+
+    ngx_str_t                 ctp;        /* client transport parameters */
+
+    ngx_uint_t                alert;
+    ngx_uint_t                error;      /* unsigned  :1; */
+};
+
+
+ngx_int_t ngx_quic_compat_init_connection(ngx_connection_t *c);
+ngx_int_t ngx_quic_compat_provide_data(ngx_connection_t *c, ngx_uint_t level,
+    u_char *data, size_t len);
+
+#endif /* _NGX_EVENT_QUIC_OPENSSL_COMPAT_H_INCLUDED_ */
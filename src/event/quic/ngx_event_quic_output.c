@@ -0,0 +1,585 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+#include <ngx_event_quic_connection.h>
+
+
+/*
+ * all datagrams are sent with the minimum size to avoid path mtu
+ * discovery, the datagrams of a burst are sent using segmentation offload
+ */
+
+#define NGX_QUIC_MAX_DATAGRAMS      64
+#define NGX_QUIC_DATAGRAM_SIZE      NGX_QUIC_MIN_INITIAL_SIZE
+
+#define NGX_QUIC_NO_LEVEL           NGX_QUIC_ENCRYPTION_LAST
+
+
+static ssize_t ngx_quic_create_datagram(ngx_connection_t *c, u_char *p,
+    size_t max);
+static size_t ngx_quic_collect_frames(ngx_connection_t *c,
+    ngx_quic_send_ctx_t *ctx, ngx_queue_t *frames, size_t max,
+    ngx_uint_t *need_ack, ngx_uint_t *full);
+static size_t ngx_quic_header_len(ngx_quic_connection_t *qc,
+    ngx_uint_t level);
+static ssize_t ngx_quic_encrypt_packet(ngx_connection_t *c,
+    ngx_quic_send_ctx_t *ctx, u_char *out, u_char *payload, size_t plen);
+static void ngx_quic_commit_frames(ngx_connection_t *c,
+    ngx_quic_send_ctx_t *ctx, ngx_queue_t *frames, size_t size,
+    ngx_uint_t need_ack);
+static ngx_int_t ngx_quic_send(ngx_connection_t *c, u_char *buf, size_t len);
+
+
+ngx_int_t
+ngx_quic_output(ngx_connection_t *c)
+{
+    off_t                   sent, limit;
+    ssize_t                 len;
+    ngx_buf_t              *b;
+    ngx_uint_t              n;
+    ngx_chain_t            *cl;
+    ngx_quic_connection_t  *qc;
+
+    static u_char           dgrams[NGX_QUIC_MAX_DATAGRAMS]
+                                  [NGX_QUIC_DATAGRAM_SIZE];
+    static ngx_buf_t        bufs[NGX_QUIC_MAX_DATAGRAMS];
+    static ngx_chain_t      chains[NGX_QUIC_MAX_DATAGRAMS];
+
+    qc = ngx_quic_get_connection(c);
+
+    c->log->action = "sending frames";
+
+    sent = 0;
+
+    for (n = 0; n < NGX_QUIC_MAX_DATAGRAMS; n++) {
+
+        if (!qc->validated) {
+
+            /*
+             * RFC 9000, 8.1.  Address Validation during Connection
+             * Establishment: the anti-amplification limit
+             */
+
+            limit = NGX_QUIC_AMPLIFICATION_FACTOR * qc->received
+                    - c->sent - sent;
+
+            if (limit < NGX_QUIC_DATAGRAM_SIZE) {
+                ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                               "quic amplification limit left:%O", limit);
+                break;
+            }
+        }
+
+        len = ngx_quic_create_datagram(c, dgrams[n], NGX_QUIC_DATAGRAM_SIZE);
+
+        if (len == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+
+        if (len == 0) {
+            break;
+        }
+
+        b = &bufs[n];
+
+        ngx_memzero(b, sizeof(ngx_buf_t));
+
+        b->start = dgrams[n];
+        b->pos = b->start;
+        b->last = b->start + len;
+        b->end = b->last;
+        b->memory = 1;
+        b->flush = 1;
+
+        chains[n].buf = b;
+        chains[n].next = NULL;
+
+        if (n) {
+            chains[n - 1].next = &chains[n];
+        }
+
+        sent += len;
+    }
+
+    if (n) {
+        ngx_log_debug2(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                       "quic output datagrams:%ui size:%O", n, sent);
+
+        /* the shared socket is never blocked for long, see ngx_quic_send() */
+
+        c->write->ready = 1;
+
+        cl = c->send_chain(c, chains, 0);
+
+        if (cl != NULL && cl != NGX_CHAIN_ERROR) {
+            ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                           "quic output blocked, unsent datagrams are lost");
+        }
+
+        if (n == NGX_QUIC_MAX_DATAGRAMS) {
+            ngx_post_event(&qc->push, &ngx_posted_events);
+        }
+    }
+
+    ngx_quic_set_pto_timer(c);
+
+    return NGX_OK;
+}
+
+
+static ssize_t
+ngx_quic_create_datagram(ngx_connection_t *c, u_char *p, size_t max)
+{
+    u_char                 *start;
+    size_t                  left, hlen, plen[NGX_QUIC_ENCRYPTION_LAST];
+    ssize_t                 len;
+    ngx_uint_t              level, last, pad, full;
+    ngx_uint_t              need_ack[NGX_QUIC_ENCRYPTION_LAST];
+    ngx_queue_t            *q, frames[NGX_QUIC_ENCRYPTION_LAST];
+    ngx_quic_frame_t       *f;
+    ngx_quic_send_ctx_t    *ctx;
+    ngx_quic_connection_t  *qc;
+
+    static u_char           payload[NGX_QUIC_DATAGRAM_SIZE];
+
+    qc = ngx_quic_get_connection(c);
+
+    start = p;
+    left = max;
+    last = NGX_QUIC_NO_LEVEL;
+    pad = 0;
+    full = 0;
+
+    /* the packets of all levels are coalesced into the datagram */
+
+    for (level = 0; level < NGX_QUIC_ENCRYPTION_LAST; level++) {
+
+        ngx_queue_init(&frames[level]);
+        plen[level] = 0;
+        need_ack[level] = 0;
+
+        if (!ngx_quic_keys_available(qc->keys, level, 1)) {
+            continue;
+        }
+
+        ctx = ngx_quic_get_send_ctx(qc, level);
+
+        if (!ctx->send_ack && ngx_queue_empty(&ctx->frames)) {
+            continue;
+        }
+
+        hlen = ngx_quic_header_len(qc, level) + NGX_QUIC_TAG_LEN;
+
+        if (left <= hlen) {
+            full = 1;
+            break;
+        }
+
+        plen[level] = ngx_quic_collect_frames(c, ctx, &frames[level],
+                                              left - hlen, &need_ack[level],
+                                              &full);
+        if (plen[level] == 0) {
+            continue;
+        }
+
+        left -= hlen + plen[level];
+        last = level;
+
+        /*
+         * RFC 9000, 14.1.  Initial Datagram Size: datagrams with
+         * ack-eliciting Initial packets are expanded to 1200 bytes
+         */
+
+        if (level == NGX_QUIC_ENCRYPTION_INITIAL && need_ack[level]) {
+            pad = 1;
+        }
+
+        if (full) {
+            break;
+        }
+    }
+
+    if (last == NGX_QUIC_NO_LEVEL) {
+        return 0;
+    }
+
+    /* full datagrams keep the segments of a burst equally sized */
+
+    if (full) {
+        pad = 1;
+    }
+
+    for (level = 0; level <= last; level++) {
+
+        if (plen[level] == 0) {
+            continue;
+        }
+
+        ctx = ngx_quic_get_send_ctx(qc, level);
+
+        len = 0;
+
+        for (q = ngx_queue_head(&frames[level]);
+             q != ngx_queue_sentinel(&frames[level]);
+             q = ngx_queue_next(q))
+        {
+            f = ngx_queue_data(q, ngx_quic_frame_t, queue);
+
+            ngx_log_debug3(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                           "quic frame tx type:0x%xi level:%ui pn:%uL",
+                           f->type, level, ctx->pnum);
+
+            len += ngx_quic_create_frame(payload + len, f);
+        }
+
+        if (level == last && pad) {
+
+            /* PADDING frames */
+
+            ngx_memzero(payload + len, left);
+            len += left;
+        }
+
+        len = ngx_quic_encrypt_packet(c, ctx, p, payload, len);
+
+        if (len == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+
+        ngx_quic_commit_frames(c, ctx, &frames[level], len, need_ack[level]);
+
+        p += len;
+    }
+
+    return p - start;
+}
+
+
+static size_t
+ngx_quic_collect_frames(ngx_connection_t *c, ngx_quic_send_ctx_t *ctx,
+    ngx_queue_t *frames, size_t max, ngx_uint_t *need_ack, ngx_uint_t *full)
+{
+    size_t                  len, n;
+    ngx_queue_t            *q;
+    ngx_quic_frame_t       *f;
+    ngx_quic_stream_t      *qs;
+    ngx_quic_connection_t  *qc;
+
+    qc = ngx_quic_get_connection(c);
+
+    len = 0;
+
+    if (ctx->send_ack) {
+
+        f = ngx_quic_alloc_frame(c);
+        if (f == NULL) {
+            return 0;
+        }
+
+        if (ngx_quic_generate_ack(c, ctx, f) != NGX_OK) {
+            ngx_quic_free_frame(c, f);
+            ctx->send_ack = 0;
+
+        } else {
+            n = ngx_quic_create_frame(NULL, f);
+
+            if (n > max) {
+                ngx_quic_free_frame(c, f);
+                ctx->send_ack = 1;
+                *full = 1;
+                return 0;
+            }
+
+            ngx_queue_insert_tail(frames, &f->queue);
+            len += n;
+        }
+    }
+
+    while (!ngx_queue_empty(&ctx->frames)) {
+
+        /* RFC 9002, 7.  Congestion Control */
+
+        if (qc->congestion.in_flight + len >= qc->congestion.window) {
+            ngx_log_debug2(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                           "quic congestion blocked if:%uz win:%uz",
+                           qc->congestion.in_flight, qc->congestion.window);
+            break;
+        }
+
+        q = ngx_queue_head(&ctx->frames);
+        f = ngx_queue_data(q, ngx_quic_frame_t, queue);
+
+        if (f->type == NGX_QUIC_FT_STREAM) {
+            qs = ngx_quic_find_stream(&qc->streams.tree,
+                                      f->u.stream.stream_id);
+
+            if (qs == NULL
+                || qs->send_state == NGX_QUIC_STREAM_SEND_RESET_SENT)
+            {
+                ngx_queue_remove(q);
+                ngx_quic_free_frame(c, f);
+                continue;
+            }
+        }
+
+        n = ngx_quic_create_frame(NULL, f);
+
+        if (len + n > max) {
+            *full = 1;
+            break;
+        }
+
+        ngx_queue_remove(q);
+        ngx_queue_insert_tail(frames, q);
+
+        len += n;
+        *need_ack = 1;
+    }
+
+    return len;
+}
+
+
+static size_t
+ngx_quic_header_len(ngx_quic_connection_t *qc, ngx_uint_t level)
+{
+    size_t  len;
+
+    if (level == NGX_QUIC_ENCRYPTION_APPLICATION) {
+        return 1 + qc->dcid.len + NGX_QUIC_PN_LEN;
+    }
+
+    /* flags, version, ids, 2 bytes of length and packet number */
+
+    len = 1 + 4 + 1 + qc->dcid.len + 1 + qc->scid.len + 2 + NGX_QUIC_PN_LEN;
+
+    if (level == NGX_QUIC_ENCRYPTION_INITIAL) {
+        /* empty token */
+        len++;
+    }
+
+    return len;
+}
+
+
+static ssize_t
+ngx_quic_encrypt_packet(ngx_connection_t *c, ngx_quic_send_ctx_t *ctx,
+    u_char *out, u_char *payload, size_t plen)
+{
+    size_t                  hlen;
+    ngx_quic_header_t       pkt;
+    ngx_quic_connection_t  *qc;
+
+    qc = ngx_quic_get_connection(c);
+
+    ngx_memzero(&pkt, sizeof(ngx_quic_header_t));
+
+    pkt.log = c->log;
+    pkt.level = ctx->level;
+    pkt.pn = ctx->pnum;
+    pkt.dcid = qc->dcid;
+    pkt.scid = qc->scid;
+
+    /* all packets are sent with 4 byte packet numbers */
+
+    switch (ctx->level) {
+
+    case NGX_QUIC_ENCRYPTION_INITIAL:
+        pkt.flags = NGX_QUIC_PKT_LONG | NGX_QUIC_PKT_FIXED_BIT
+                    | NGX_QUIC_PKT_INITIAL | (NGX_QUIC_PN_LEN - 1);
+        break;
+
+    case NGX_QUIC_ENCRYPTION_HANDSHAKE:
+        pkt.flags = NGX_QUIC_PKT_LONG | NGX_QUIC_PKT_FIXED_BIT
+                    | NGX_QUIC_PKT_HANDSHAKE | (NGX_QUIC_PN_LEN - 1);
+        break;
+
+    default: /* NGX_QUIC_ENCRYPTION_APPLICATION */
+        pkt.flags = NGX_QUIC_PKT_FIXED_BIT
+                    | (qc->key_phase ? NGX_QUIC_PKT_KPHASE : 0)
+                    | (NGX_QUIC_PN_LEN - 1);
+        break;
+    }
+
+    hlen = ngx_quic_create_header(&pkt, out, plen);
+
+    if (ngx_quic_encrypt(&qc->keys->secrets[ctx->level].server, &pkt, out,
+                         hlen, payload, plen, c->log)
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    ngx_log_debug3(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "quic packet tx level:%ui pn:%uL len:%uz",
+                   ctx->level, ctx->pnum, plen);
+
+    ctx->pnum++;
+
+    return hlen + plen + NGX_QUIC_TAG_LEN;
+}
+
+
+static void
+ngx_quic_commit_frames(ngx_connection_t *c, ngx_quic_send_ctx_t *ctx,
+    ngx_queue_t *frames, size_t size, ngx_uint_t need_ack)
+{
+    uint64_t                pnum;
+    ngx_uint_t              first;
+    ngx_queue_t            *q;
+    ngx_quic_frame_t       *f;
+    ngx_quic_connection_t  *qc;
+
+    qc = ngx_quic_get_connection(c);
+
+    pnum = ctx->pnum - 1;
+    first = 1;
+
+    while (!ngx_queue_empty(frames)) {
+
+        q = ngx_queue_head(frames);
+        f = ngx_queue_data(q, ngx_quic_frame_t, queue);
+
+        ngx_queue_remove(q);
+
+        if (!need_ack) {
+            /* packets containing only ACK frames are not tracked */
+            ngx_quic_free_frame(c, f);
+            continue;
+        }
+
+        f->pnum = pnum;
+        f->sent = ngx_current_msec;
+        f->pkt_need_ack = 1;
+        f->plen = first ? size : 0;
+
+        first = 0;
+
+        ngx_queue_insert_tail(&ctx->sent, q);
+    }
+
+    if (need_ack) {
+        qc->congestion.in_flight += size;
+    }
+}
+
+
+ngx_int_t
+ngx_quic_send_close(ngx_connection_t *c)
+{
+    u_char                 *p;
+    ssize_t                 len;
+    ngx_uint_t              level;
+    ngx_quic_frame_t        frame;
+    ngx_quic_send_ctx_t    *ctx;
+    ngx_quic_connection_t  *qc;
+
+    static u_char           payload[NGX_QUIC_DATAGRAM_SIZE];
+    static u_char           dgram[NGX_QUIC_DATAGRAM_SIZE];
+
+    qc = ngx_quic_get_connection(c);
+
+    p = dgram;
+
+    /*
+     * RFC 9000, 10.2.3.  Immediate Close during the Handshake:
+     * the frame is sent at all levels the client may have keys for
+     */
+
+    for (level = 0; level < NGX_QUIC_ENCRYPTION_LAST; level++) {
+
+        if (!ngx_quic_keys_available(qc->keys, level, 1)) {
+            continue;
+        }
+
+        ngx_memzero(&frame, sizeof(ngx_quic_frame_t));
+
+        frame.level = level;
+
+        if (qc->error_app && level == NGX_QUIC_ENCRYPTION_APPLICATION) {
+            frame.type = NGX_QUIC_FT_CONNECTION_CLOSE_APP;
+            frame.u.close.error_code = qc->error;
+
+        } else if (qc->error_app) {
+
+            /* application errors are not disclosed before the handshake */
+
+            frame.type = NGX_QUIC_FT_CONNECTION_CLOSE;
+            frame.u.close.error_code = NGX_QUIC_ERR_APPLICATION_ERROR;
+
+        } else {
+            frame.type = NGX_QUIC_FT_CONNECTION_CLOSE;
+            frame.u.close.error_code = qc->error;
+            frame.u.close.frame_type = qc->error_ftype;
+        }
+
+        if (qc->error_reason
+            && (level == NGX_QUIC_ENCRYPTION_APPLICATION || !qc->error_app))
+        {
+            frame.u.close.reason.data = (u_char *) qc->error_reason;
+            frame.u.close.reason.len = ngx_min(ngx_strlen(qc->error_reason),
+                                               512);
+        }
+
+        len = ngx_quic_create_frame(payload, &frame);
+
+        ctx = ngx_quic_get_send_ctx(qc, level);
+
+        len = ngx_quic_encrypt_packet(c, ctx, p, payload, len);
+
+        if (len == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+
+        p += len;
+    }
+
+    if (p == dgram) {
+        return NGX_OK;
+    }
+
+    return ngx_quic_send(c, dgram, p - dgram);
+}
+
+
+ngx_int_t
+ngx_quic_send_version_negotiation(ngx_connection_t *c, ngx_quic_header_t *pkt)
+{
+    size_t  len;
+    u_char  buf[NGX_QUIC_MAX_CID_LEN * 2 + 16];
+
+    ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "quic send version negotiation packet");
+
+    len = ngx_quic_create_version_negotiation(pkt, buf);
+
+    return ngx_quic_send(c, buf, len);
+}
+
+
+static ngx_int_t
+ngx_quic_send(ngx_connection_t *c, u_char *buf, size_t len)
+{
+    ssize_t  n;
+
+    /*
+     * the socket is shared by all connections and is not polled
+     * for writing, a datagram which cannot be sent is lost
+     */
+
+    c->write->ready = 1;
+
+    n = c->send(c, buf, len);
+
+    if (n == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
@@ -0,0 +1,818 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+#include <ngx_event_quic_connection.h>
+
+
+/* RFC 9001, 5.4.1.  Header Protection Application: 5-byte mask */
+#define NGX_QUIC_HP_LEN               5
+
+
+static ngx_int_t ngx_hkdf_expand(u_char *out_key, size_t out_len,
+    const EVP_MD *digest, const u_char *prk, size_t prk_len,
+    const u_char *info, size_t info_len);
+static ngx_int_t ngx_hkdf_extract(u_char *out_key, size_t *out_len,
+    const EVP_MD *digest, const u_char *secret, size_t secret_len,
+    const u_char *salt, size_t salt_len);
+
+static uint64_t ngx_quic_parse_pn(u_char **pos, ngx_int_t len, u_char *mask,
+    uint64_t *largest_pn);
+
+static ngx_int_t ngx_quic_crypto_open(EVP_CIPHER_CTX *ctx, u_char *out,
+    size_t *out_len, u_char *nonce, u_char *in, size_t in_len, u_char *ad,
+    size_t ad_len, ngx_log_t *log);
+static ngx_int_t ngx_quic_secret_init(ngx_quic_secret_t *s,
+    ngx_quic_ciphers_t *ciphers, ngx_uint_t enc, ngx_log_t *log);
+static ngx_int_t ngx_quic_hp_mask(ngx_quic_secret_t *s, u_char *sample,
+    u_char *mask, ngx_log_t *log);
+static void ngx_quic_secret_cleanup(ngx_quic_secret_t *s);
+
+
+ngx_int_t
+ngx_quic_ciphers(ngx_uint_t id, ngx_quic_ciphers_t *ciphers)
+{
+    switch (id) {
+
+    case TLS1_3_CK_AES_128_GCM_SHA256:
+        ciphers->cipher = EVP_aes_128_gcm();
+        ciphers->hp_cipher = EVP_aes_128_ecb();
+        ciphers->md = EVP_sha256();
+        break;
+
+    case TLS1_3_CK_AES_256_GCM_SHA384:
+        ciphers->cipher = EVP_aes_256_gcm();
+        ciphers->hp_cipher = EVP_aes_256_ecb();
+        ciphers->md = EVP_sha384();
+        break;
+
+#ifndef OPENSSL_NO_CHACHA
+    case TLS1_3_CK_CHACHA20_POLY1305_SHA256:
+        ciphers->cipher = EVP_chacha20_poly1305();
+        ciphers->hp_cipher = EVP_chacha20();
+        ciphers->md = EVP_sha256();
+        break;
+#endif
+
+    default:
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+ngx_quic_keys_t *
+ngx_quic_keys_new(ngx_pool_t *pool)
+{
+    return ngx_pcalloc(pool, sizeof(ngx_quic_keys_t));
+}
+
+
+ngx_int_t
+ngx_quic_keys_set_initial_secret(ngx_quic_keys_t *keys, ngx_str_t *secret,
+    ngx_log_t *log)
+{
+    size_t               is_len;
+    uint8_t              is[SHA256_DIGEST_LENGTH];
+    ngx_quic_md_t        initial;
+    ngx_quic_ciphers_t   ciphers;
+    ngx_quic_secret_t   *client, *server;
+
+    static const uint8_t salt[20] =
+        "\x38\x76\x2c\xf7\xf5\x59\x34\xb3\x4d\x17"
+        "\x9a\xe6\xa4\xc8\x0c\xad\xcc\xbb\x7f\x0a";
+
+    client = &keys->secrets[NGX_QUIC_ENCRYPTION_INITIAL].client;
+    server = &keys->secrets[NGX_QUIC_ENCRYPTION_INITIAL].server;
+
+    /* RFC 9001, 5.2.  Initial Secrets */
+
+    (void) ngx_quic_ciphers(NGX_QUIC_INITIAL_CIPHER, &ciphers);
+
+    if (ngx_hkdf_extract(is, &is_len, ciphers.md, secret->data, secret->len,
+                         salt, sizeof(salt))
+        != NGX_OK)
+    {
+        ngx_ssl_error(NGX_LOG_INFO, log, 0,
+                      "quic HKDF_extract(initial) failed");
+        return NGX_ERROR;
+    }
+
+    initial.len = is_len;
+    ngx_memcpy(initial.data, is, is_len);
+
+    client->secret.len = SHA256_DIGEST_LENGTH;
+    server->secret.len = SHA256_DIGEST_LENGTH;
+
+    if (ngx_quic_hkdf_expand_label(log, ciphers.md, &initial,
+                                   "tls13 client in", client->secret.data,
+                                   client->secret.len)
+        != NGX_OK
+        || ngx_quic_hkdf_expand_label(log, ciphers.md, &initial,
+                                      "tls13 server in", server->secret.data,
+                                      server->secret.len)
+           != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    ngx_explicit_memzero(is, sizeof(is));
+    ngx_explicit_memzero(initial.data, sizeof(initial.data));
+
+    if (ngx_quic_secret_init(client, &ciphers, 0, log) != NGX_OK
+        || ngx_quic_secret_init(server, &ciphers, 1, log) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_quic_keys_set_encryption_secret(ngx_log_t *log, ngx_uint_t is_write,
+    ngx_quic_keys_t *keys, ngx_uint_t level, ngx_uint_t cipher_id,
+    const u_char *secret, size_t secret_len)
+{
+    ngx_quic_secret_t   *peer_secret;
+    ngx_quic_ciphers_t   ciphers;
+
+    peer_secret = is_write ? &keys->secrets[level].server
+                           : &keys->secrets[level].client;
+
+    if (ngx_quic_ciphers(cipher_id, &ciphers) != NGX_OK) {
+        ngx_log_error(NGX_LOG_INFO, log, 0,
+                      "quic unexpected cipher 0x%xi", cipher_id);
+        return NGX_ERROR;
+    }
+
+    if (secret_len > NGX_QUIC_MAX_MD_SIZE) {
+        return NGX_ERROR;
+    }
+
+    keys->cipher = cipher_id;
+
+    ngx_quic_secret_cleanup(peer_secret);
+
+    peer_secret->secret.len = secret_len;
+    ngx_memcpy(peer_secret->secret.data, secret, secret_len);
+
+    return ngx_quic_secret_init(peer_secret, &ciphers, is_write, log);
+}
+
+
+static ngx_int_t
+ngx_quic_secret_init(ngx_quic_secret_t *s, ngx_quic_ciphers_t *ciphers,
+    ngx_uint_t enc, ngx_log_t *log)
+{
+    s->key.len = EVP_CIPHER_key_length(ciphers->cipher);
+    s->hp.len = EVP_CIPHER_key_length(ciphers->hp_cipher);
+
+    if (ngx_quic_hkdf_expand_label(log, ciphers->md, &s->secret,
+                                   "tls13 quic key", s->key.data, s->key.len)
+        != NGX_OK
+        || ngx_quic_hkdf_expand_label(log, ciphers->md, &s->secret,
+                                      "tls13 quic iv", s->iv, NGX_QUIC_IV_LEN)
+           != NGX_OK
+        || ngx_quic_hkdf_expand_label(log, ciphers->md, &s->secret,
+                                      "tls13 quic hp", s->hp.data, s->hp.len)
+           != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    if (ngx_quic_crypto_init(ciphers->cipher, s->key.data, enc, &s->ctx, log)
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    s->hp_ctx = EVP_CIPHER_CTX_new();
+    if (s->hp_ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (EVP_EncryptInit_ex(s->hp_ctx, ciphers->hp_cipher, NULL, s->hp.data,
+                           NULL)
+        != 1)
+    {
+        ngx_ssl_error(NGX_LOG_INFO, log, 0, "EVP_EncryptInit_ex() failed");
+        return NGX_ERROR;
+    }
+
+    EVP_CIPHER_CTX_set_padding(s->hp_ctx, 0);
+
+    return NGX_OK;
+}
+
+
+ngx_uint_t
+ngx_quic_keys_available(ngx_quic_keys_t *keys, ngx_uint_t level,
+    ngx_uint_t is_write)
+{
+    if (is_write) {
+        return keys->secrets[level].server.ctx != NULL;
+    }
+
+    return keys->secrets[level].client.ctx != NULL;
+}
+
+
+void
+ngx_quic_keys_discard(ngx_quic_keys_t *keys, ngx_uint_t level)
+{
+    ngx_quic_secret_cleanup(&keys->secrets[level].client);
+    ngx_quic_secret_cleanup(&keys->secrets[level].server);
+}
+
+
+void
+ngx_quic_keys_cleanup(void *data)
+{
+    ngx_quic_keys_t  *keys = data;
+
+    ngx_uint_t  i;
+
+    for (i = 0; i < NGX_QUIC_ENCRYPTION_LAST; i++) {
+        ngx_quic_keys_discard(keys, i);
+    }
+
+    ngx_quic_secret_cleanup(&keys->next_key.client);
+    ngx_quic_secret_cleanup(&keys->next_key.server);
+}
+
+
+static void
+ngx_quic_secret_cleanup(ngx_quic_secret_t *s)
+{
+    if (s->ctx) {
+        EVP_CIPHER_CTX_free(s->ctx);
+        s->ctx = NULL;
+    }
+
+    if (s->hp_ctx) {
+        EVP_CIPHER_CTX_free(s->hp_ctx);
+        s->hp_ctx = NULL;
+    }
+
+    ngx_explicit_memzero(s->secret.data, s->secret.len);
+    ngx_explicit_memzero(s->key.data, s->key.len);
+    ngx_explicit_memzero(s->iv, NGX_QUIC_IV_LEN);
+}
+
+
+ngx_int_t
+ngx_quic_keys_update(ngx_log_t *log, ngx_quic_keys_t *keys)
+{
+    ngx_uint_t           i;
+    ngx_quic_ciphers_t   ciphers;
+    ngx_quic_secret_t   *current[2], *next[2];
+
+    /* RFC 9001, 6.  Key Update */
+
+    if (ngx_quic_ciphers(keys->cipher, &ciphers) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    current[0] = &keys->secrets[NGX_QUIC_ENCRYPTION_APPLICATION].client;
+    current[1] = &keys->secrets[NGX_QUIC_ENCRYPTION_APPLICATION].server;
+    next[0] = &keys->next_key.client;
+    next[1] = &keys->next_key.server;
+
+    for (i = 0; i < 2; i++) {
+
+        ngx_quic_secret_cleanup(next[i]);
+
+        next[i]->secret.len = current[i]->secret.len;
+        next[i]->key.len = current[i]->key.len;
+
+        if (ngx_quic_hkdf_expand_label(log, ciphers.md, &current[i]->secret,
+                                       "tls13 quic ku", next[i]->secret.data,
+                                       next[i]->secret.len)
+            != NGX_OK
+            || ngx_quic_hkdf_expand_label(log, ciphers.md, &next[i]->secret,
+                                          "tls13 quic key", next[i]->key.data,
+                                          next[i]->key.len)
+               != NGX_OK
+            || ngx_quic_hkdf_expand_label(log, ciphers.md, &next[i]->secret,
+                                          "tls13 quic iv", next[i]->iv,
+                                          NGX_QUIC_IV_LEN)
+               != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+        if (ngx_quic_crypto_init(ciphers.cipher, next[i]->key.data, i,
+                                 &next[i]->ctx, log)
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+void
+ngx_quic_keys_switch(ngx_quic_keys_t *keys)
+{
+    ngx_uint_t          i;
+    ngx_quic_secret_t  *current, *next, tmp;
+
+    /* the header protection keys are not updated */
+
+    for (i = 0; i < 2; i++) {
+        current = i ? &keys->secrets[NGX_QUIC_ENCRYPTION_APPLICATION].server
+                    : &keys->secrets[NGX_QUIC_ENCRYPTION_APPLICATION].client;
+        next = i ? &keys->next_key.server : &keys->next_key.client;
+
+        tmp = *current;
+
+        current->secret = next->secret;
+        current->key = next->key;
+        ngx_memcpy(current->iv, next->iv, NGX_QUIC_IV_LEN);
+        current->ctx = next->ctx;
+
+        next->secret = tmp.secret;
+        next->key = tmp.key;
+        ngx_memcpy(next->iv, tmp.iv, NGX_QUIC_IV_LEN);
+        next->ctx = tmp.ctx;
+    }
+}
+
+
+ngx_int_t
+ngx_quic_hkdf_expand_label(ngx_log_t *log, const EVP_MD *digest,
+    ngx_quic_md_t *secret, const char *label, u_char *out, size_t out_len)
+{
+    size_t   label_len, info_len;
+    uint8_t *p;
+    uint8_t  info[80];
+
+    label_len = ngx_strlen(label);
+
+    info_len = 2 + 1 + label_len + 1;
+
+    if (info_len > sizeof(info)) {
+        return NGX_ERROR;
+    }
+
+    p = info;
+
+    *p++ = (u_char) (out_len >> 8);
+    *p++ = (u_char) out_len;
+    *p++ = (u_char) label_len;
+    p = ngx_cpymem(p, label, label_len);
+    *p++ = '\0';
+
+    if (ngx_hkdf_expand(out, out_len, digest, secret->data, secret->len, info,
+                        info_len)
+        != NGX_OK)
+    {
+        ngx_ssl_error(NGX_LOG_INFO, log, 0,
+                      "quic HKDF_expand(label: \"%s\") failed", label);
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_hkdf_expand(u_char *out_key, size_t out_len, const EVP_MD *digest,
+    const uint8_t *prk, size_t prk_len, const u_char *info, size_t info_len)
+{
+    u_char        *p;
+    size_t         n, md_len;
+    uint8_t        counter;
+    unsigned int   len;
+    u_char         t[EVP_MAX_MD_SIZE], in[EVP_MAX_MD_SIZE + 80 + 1];
+
+    /* RFC 5869, 2.3.  Step 2: Expand */
+
+    md_len = EVP_MD_size(digest);
+
+    if (out_len > 255 * md_len || info_len > 80) {
+        return NGX_ERROR;
+    }
+
+    len = 0;
+    counter = 0;
+
+    while (out_len) {
+        p = in;
+
+        p = ngx_cpymem(p, t, len);
+        p = ngx_cpymem(p, info, info_len);
+        *p++ = ++counter;
+
+        if (HMAC(digest, prk, prk_len, in, p - in, t, &len) == NULL) {
+            return NGX_ERROR;
+        }
+
+        n = ngx_min(out_len, len);
+        out_key = ngx_cpymem(out_key, t, n);
+        out_len -= n;
+    }
+
+    ngx_explicit_memzero(t, sizeof(t));
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_hkdf_extract(u_char *out_key, size_t *out_len, const EVP_MD *digest,
+    const u_char *secret, size_t secret_len, const u_char *salt,
+    size_t salt_len)
+{
+    unsigned int  len;
+
+    /* RFC 5869, 2.2.  Step 1: Extract */
+
+    if (HMAC(digest, salt, salt_len, secret, secret_len, out_key, &len)
+        == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    *out_len = len;
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_quic_crypto_init(const EVP_CIPHER *cipher, u_char *key, ngx_uint_t enc,
+    EVP_CIPHER_CTX **pctx, ngx_log_t *log)
+{
+    EVP_CIPHER_CTX  *ctx;
+
+    ctx = EVP_CIPHER_CTX_new();
+    if (ctx == NULL) {
+        ngx_ssl_error(NGX_LOG_INFO, log, 0, "EVP_CIPHER_CTX_new() failed");
+        return NGX_ERROR;
+    }
+
+    if (EVP_CipherInit_ex(ctx, cipher, NULL, NULL, NULL, enc) != 1) {
+        EVP_CIPHER_CTX_free(ctx);
+        ngx_ssl_error(NGX_LOG_INFO, log, 0, "EVP_CipherInit_ex() failed");
+        return NGX_ERROR;
+    }
+
+    if (EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_SET_IVLEN, NGX_QUIC_IV_LEN,
+                            NULL)
+        == 0)
+    {
+        EVP_CIPHER_CTX_free(ctx);
+        ngx_ssl_error(NGX_LOG_INFO, log, 0,
+                      "EVP_CIPHER_CTX_ctrl(EVP_CTRL_AEAD_SET_IVLEN) failed");
+        return NGX_ERROR;
+    }
+
+    if (EVP_CipherInit_ex(ctx, NULL, NULL, key, NULL, enc) != 1) {
+        EVP_CIPHER_CTX_free(ctx);
+        ngx_ssl_error(NGX_LOG_INFO, log, 0, "EVP_CipherInit_ex() failed");
+        return NGX_ERROR;
+    }
+
+    *pctx = ctx;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_quic_crypto_open(EVP_CIPHER_CTX *ctx, u_char *out, size_t *out_len,
+    u_char *nonce, u_char *in, size_t in_len, u_char *ad, size_t ad_len,
+    ngx_log_t *log)
+{
+    int  len;
+
+    if (in_len < NGX_QUIC_TAG_LEN) {
+        return NGX_ERROR;
+    }
+
+    in_len -= NGX_QUIC_TAG_LEN;
+
+    if (EVP_DecryptInit_ex(ctx, NULL, NULL, NULL, nonce) != 1) {
+        ngx_ssl_error(NGX_LOG_INFO, log, 0, "EVP_DecryptInit_ex() failed");
+        return NGX_ERROR;
+    }
+
+    if (EVP_DecryptUpdate(ctx, NULL, &len, ad, ad_len) != 1) {
+        ngx_ssl_error(NGX_LOG_INFO, log, 0, "EVP_DecryptUpdate() failed");
+        return NGX_ERROR;
+    }
+
+    if (EVP_DecryptUpdate(ctx, out, &len, in, in_len) != 1) {
+        ngx_ssl_error(NGX_LOG_INFO, log, 0, "EVP_DecryptUpdate() failed");
+        return NGX_ERROR;
+    }
+
+    *out_len = len;
+
+    if (EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_SET_TAG, NGX_QUIC_TAG_LEN,
+                            in + in_len)
+        == 0)
+    {
+        ngx_ssl_error(NGX_LOG_INFO, log, 0,
+                      "EVP_CIPHER_CTX_ctrl(EVP_CTRL_AEAD_SET_TAG) failed");
+        return NGX_ERROR;
+    }
+
+    if (EVP_DecryptFinal_ex(ctx, out + len, &len) <= 0) {
+        /* authentication failure is not an ssl error to be logged */
+        ERR_clear_error();
+        return NGX_ERROR;
+    }
+
+    *out_len += len;
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_quic_crypto_seal(EVP_CIPHER_CTX *ctx, u_char *out, size_t *out_len,
+    u_char *nonce, u_char *in, size_t in_len, u_char *ad, size_t ad_len,
+    ngx_log_t *log)
+{
+    int  len;
+
+    if (EVP_EncryptInit_ex(ctx, NULL, NULL, NULL, nonce) != 1) {
+        ngx_ssl_error(NGX_LOG_INFO, log, 0, "EVP_EncryptInit_ex() failed");
+        return NGX_ERROR;
+    }
+
+    if (EVP_EncryptUpdate(ctx, NULL, &len, ad, ad_len) != 1) {
+        ngx_ssl_error(NGX_LOG_INFO, log, 0, "EVP_EncryptUpdate() failed");
+        return NGX_ERROR;
+    }
+
+    if (EVP_EncryptUpdate(ctx, out, &len, in, in_len) != 1) {
+        ngx_ssl_error(NGX_LOG_INFO, log, 0, "EVP_EncryptUpdate() failed");
+        return NGX_ERROR;
+    }
+
+    *out_len = len;
+
+    if (EVP_EncryptFinal_ex(ctx, out + len, &len) <= 0) {
+        ngx_ssl_error(NGX_LOG_INFO, log, 0, "EVP_EncryptFinal_ex failed");
+        return NGX_ERROR;
+    }
+
+    *out_len += len;
+
+    if (EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, NGX_QUIC_TAG_LEN,
+                            out + in_len)
+        == 0)
+    {
+        ngx_ssl_error(NGX_LOG_INFO, log, 0,
+                      "EVP_CIPHER_CTX_ctrl(EVP_CTRL_AEAD_GET_TAG) failed");
+        return NGX_ERROR;
+    }
+
+    *out_len += NGX_QUIC_TAG_LEN;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_quic_hp_mask(ngx_quic_secret_t *s, u_char *sample, u_char *mask,
+    ngx_log_t *log)
+{
+    int                   inlen, outlen;
+    u_char               *in;
+    static const u_char   zero[NGX_QUIC_HP_LEN];
+
+#ifndef OPENSSL_NO_CHACHA
+    if (EVP_CIPHER_CTX_nid(s->hp_ctx) == NID_chacha20) {
+
+        /* RFC 9001, 5.4.4: the sample is the counter and the nonce */
+
+        if (EVP_EncryptInit_ex(s->hp_ctx, NULL, NULL, NULL, sample) != 1) {
+            ngx_ssl_error(NGX_LOG_INFO, log, 0,
+                          "EVP_EncryptInit_ex() failed");
+            return NGX_ERROR;
+        }
+
+        in = (u_char *) zero;
+        inlen = NGX_QUIC_HP_LEN;
+
+    } else
+#endif
+    {
+        /* RFC 9001, 5.4.3: the mask is the encrypted sample */
+
+        in = sample;
+        inlen = 16;
+    }
+
+    if (EVP_EncryptUpdate(s->hp_ctx, mask, &outlen, in, inlen) != 1) {
+        ngx_ssl_error(NGX_LOG_INFO, log, 0, "EVP_EncryptUpdate() failed");
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+void
+ngx_quic_compute_nonce(u_char *nonce, size_t len, uint64_t pn)
+{
+    nonce[len - 8] ^= (pn >> 56) & 0x3f;
+    nonce[len - 7] ^= (pn >> 48) & 0xff;
+    nonce[len - 6] ^= (pn >> 40) & 0xff;
+    nonce[len - 5] ^= (pn >> 32) & 0xff;
+    nonce[len - 4] ^= (pn >> 24) & 0xff;
+    nonce[len - 3] ^= (pn >> 16) & 0xff;
+    nonce[len - 2] ^= (pn >> 8) & 0xff;
+    nonce[len - 1] ^= pn & 0xff;
+}
+
+
+ngx_int_t
+ngx_quic_encrypt(ngx_quic_secret_t *secret, ngx_quic_header_t *pkt,
+    u_char *out, size_t hlen, u_char *payload, size_t plen, ngx_log_t *log)
+{
+    size_t      len;
+    u_char     *sample;
+    ngx_uint_t  i;
+    u_char      nonce[NGX_QUIC_IV_LEN], mask[16];
+
+    ngx_memcpy(nonce, secret->iv, NGX_QUIC_IV_LEN);
+    ngx_quic_compute_nonce(nonce, sizeof(nonce), pkt->pn);
+
+    if (ngx_quic_crypto_seal(secret->ctx, out + hlen, &len, nonce, payload,
+                             plen, out, hlen, log)
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    /* the sample starts 4 bytes after the packet number */
+
+    sample = out + hlen;
+
+    if (ngx_quic_hp_mask(secret, sample, mask, log) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    out[0] ^= mask[0] & (ngx_quic_long_packet(out) ? 0x0f : 0x1f);
+
+    for (i = 0; i < NGX_QUIC_PN_LEN; i++) {
+        out[hlen - NGX_QUIC_PN_LEN + i] ^= mask[i + 1];
+    }
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_quic_decrypt(ngx_quic_keys_t *keys, ngx_quic_header_t *pkt,
+    uint64_t *largest_pn, u_char *out)
+{
+    u_char             *p, *sample, *end;
+    size_t              len, ad_len;
+    uint8_t             clearflags;
+    uint64_t            pn;
+    ngx_int_t           pnl;
+    ngx_quic_secret_t  *secret, *hp;
+    u_char              nonce[NGX_QUIC_IV_LEN], mask[16];
+
+    hp = &keys->secrets[pkt->level].client;
+
+    p = pkt->pn_pos;
+    end = pkt->data + pkt->len;
+
+    if ((size_t) (end - p) < 4 + 16) {
+        return NGX_DECLINED;
+    }
+
+    sample = p + 4;
+
+    /* header protection */
+
+    if (ngx_quic_hp_mask(hp, sample, mask, pkt->log) != NGX_OK) {
+        return NGX_DECLINED;
+    }
+
+    if (ngx_quic_long_packet(pkt->data)) {
+        clearflags = pkt->flags ^ (mask[0] & 0x0f);
+
+    } else {
+        clearflags = pkt->flags ^ (mask[0] & 0x1f);
+    }
+
+    pnl = (clearflags & 0x03) + 1;
+
+    pn = ngx_quic_parse_pn(&p, pnl, &mask[1], largest_pn);
+
+    secret = hp;
+
+    if (!ngx_quic_long_packet(pkt->data)) {
+
+        if (((clearflags & NGX_QUIC_PKT_KPHASE) != 0) != pkt->key_phase) {
+
+            if (keys->next_key.client.ctx == NULL) {
+                return NGX_DECLINED;
+            }
+
+            secret = &keys->next_key.client;
+            pkt->key_update = 1;
+        }
+    }
+
+    ngx_memcpy(nonce, secret->iv, NGX_QUIC_IV_LEN);
+    ngx_quic_compute_nonce(nonce, sizeof(nonce), pn);
+
+    /* the header is authenticated in its unprotected form */
+
+    pkt->data[0] = clearflags;
+
+    ad_len = p - pkt->data;
+
+    for (len = 0; len < (size_t) pnl; len++) {
+        pkt->pn_pos[len] ^= mask[len + 1];
+    }
+
+    if (ngx_quic_crypto_open(secret->ctx, out, &len, nonce, p, end - p,
+                             pkt->data, ad_len, pkt->log)
+        != NGX_OK)
+    {
+        return NGX_DECLINED;
+    }
+
+    pkt->flags = clearflags;
+    pkt->pn = pn;
+    pkt->payload.data = out;
+    pkt->payload.len = len;
+
+    if (pkt->payload.len == 0) {
+        /* 12.4. Frames and Frame Types: a packet contains at least a frame */
+        pkt->error = NGX_QUIC_ERR_PROTOCOL_VIOLATION;
+        return NGX_ERROR;
+    }
+
+    if (clearflags & (ngx_quic_long_packet(pkt->data)
+                      ? NGX_QUIC_PKT_LONG_RESERVED_BIT
+                      : NGX_QUIC_PKT_SHORT_RESERVED_BIT))
+    {
+        pkt->error = NGX_QUIC_ERR_PROTOCOL_VIOLATION;
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static uint64_t
+ngx_quic_parse_pn(u_char **pos, ngx_int_t len, u_char *mask,
+    uint64_t *largest_pn)
+{
+    u_char    *p;
+    uint64_t   truncated_pn, expected_pn, candidate_pn;
+    uint64_t   pn_nbits, pn_win, pn_hwin, pn_mask;
+
+    pn_nbits = ngx_min(len * 8, 62);
+
+    p = *pos;
+    truncated_pn = *p++ ^ *mask++;
+
+    while (--len) {
+        truncated_pn = (truncated_pn << 8) + (*p++ ^ *mask++);
+    }
+
+    *pos = p;
+
+    /* RFC 9000, A.3.  Sample Packet Number Decoding Algorithm */
+
+    expected_pn = *largest_pn + 1;
+    pn_win = 1ULL << pn_nbits;
+    pn_hwin = pn_win / 2;
+    pn_mask = pn_win - 1;
+
+    candidate_pn = (expected_pn & ~pn_mask) | truncated_pn;
+
+    if ((int64_t) candidate_pn <= (int64_t) (expected_pn - pn_hwin)
+        && candidate_pn < (1ULL << 62) - pn_win)
+    {
+        candidate_pn += pn_win;
+
+    } else if (candidate_pn > expected_pn + pn_hwin
+               && candidate_pn >= pn_win)
+    {
+        candidate_pn -= pn_win;
+    }
+
+    return candidate_pn;
+}
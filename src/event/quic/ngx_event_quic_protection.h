@@ -0,0 +1,87 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#ifndef _NGX_EVENT_QUIC_PROTECTION_H_INCLUDED_
+#define _NGX_EVENT_QUIC_PROTECTION_H_INCLUDED_
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+#include <ngx_event_quic_transport.h>
+
+
+#define NGX_QUIC_INITIAL_CIPHER          TLS1_3_CK_AES_128_GCM_SHA256
+
+#define NGX_QUIC_MAX_MD_SIZE             48
+#define NGX_QUIC_IV_LEN                  12
+
+
+typedef struct {
+    size_t                    len;
+    u_char                    data[NGX_QUIC_MAX_MD_SIZE];
+} ngx_quic_md_t;
+
+
+typedef struct {
+    const EVP_CIPHER         *cipher;
+    const EVP_CIPHER         *hp_cipher;
+    const EVP_MD             *md;
+} ngx_quic_ciphers_t;
+
+
+typedef struct {
+    ngx_quic_md_t             secret;
+    ngx_quic_md_t             key;
+    u_char                    iv[NGX_QUIC_IV_LEN];
+    ngx_quic_md_t             hp;
+    EVP_CIPHER_CTX           *ctx;
+    EVP_CIPHER_CTX           *hp_ctx;
+} ngx_quic_secret_t;
+
+
+typedef struct {
+    ngx_quic_secret_t         client;
+    ngx_quic_secret_t         server;
+} ngx_quic_secrets_t;
+
+
+typedef struct {
+    ngx_quic_secrets_t        secrets[NGX_QUIC_ENCRYPTION_LAST];
+    ngx_quic_secrets_t        next_key;
+    ngx_uint_t                cipher;
+} ngx_quic_keys_t;
+
+
+ngx_quic_keys_t *ngx_quic_keys_new(ngx_pool_t *pool);
+ngx_int_t ngx_quic_keys_set_initial_secret(ngx_quic_keys_t *keys,
+    ngx_str_t *secret, ngx_log_t *log);
+ngx_int_t ngx_quic_keys_set_encryption_secret(ngx_log_t *log,
+    ngx_uint_t is_write, ngx_quic_keys_t *keys, ngx_uint_t level,
+    ngx_uint_t cipher_id, const u_char *secret, size_t secret_len);
+ngx_uint_t ngx_quic_keys_available(ngx_quic_keys_t *keys, ngx_uint_t level,
+    ngx_uint_t is_write);
+void ngx_quic_keys_discard(ngx_quic_keys_t *keys, ngx_uint_t level);
+void ngx_quic_keys_cleanup(void *data);
+void ngx_quic_keys_switch(ngx_quic_keys_t *keys);
+ngx_int_t ngx_quic_keys_update(ngx_log_t *log, ngx_quic_keys_t *keys);
+
+ngx_int_t ngx_quic_ciphers(ngx_uint_t id, ngx_quic_ciphers_t *ciphers);
+ngx_int_t ngx_quic_hkdf_expand_label(ngx_log_t *log, const EVP_MD *digest,
+    ngx_quic_md_t *secret, const char *label, u_char *out, size_t out_len);
+ngx_int_t ngx_quic_crypto_init(const EVP_CIPHER *cipher, u_char *key,
+    ngx_uint_t enc, EVP_CIPHER_CTX **ctx, ngx_log_t *log);
+ngx_int_t ngx_quic_crypto_seal(EVP_CIPHER_CTX *ctx, u_char *out,
+    size_t *out_len, u_char *nonce, u_char *in, size_t in_len, u_char *ad,
+    size_t ad_len, ngx_log_t *log);
+void ngx_quic_compute_nonce(u_char *nonce, size_t len, uint64_t pn);
+
+ngx_int_t ngx_quic_encrypt(ngx_quic_secret_t *secret, ngx_quic_header_t *pkt,
+    u_char *out, size_t hlen, u_char *payload, size_t plen, ngx_log_t *log);
+ngx_int_t ngx_quic_decrypt(ngx_quic_keys_t *keys, ngx_quic_header_t *pkt,
+    uint64_t *largest_pn, u_char *out);
+
+#endif /* _NGX_EVENT_QUIC_PROTECTION_H_INCLUDED_ */
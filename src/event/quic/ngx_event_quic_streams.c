@@ -0,0 +1,1401 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+#include <ngx_event_quic_connection.h>
+
+
+static ngx_quic_stream_t *ngx_quic_get_stream(ngx_connection_t *c,
+    uint64_t id);
+static ngx_int_t ngx_quic_reject_streams(ngx_connection_t *c, uint64_t min,
+    uint64_t max);
+static ngx_quic_stream_t *ngx_quic_create_stream(ngx_connection_t *c,
+    uint64_t id);
+static void ngx_quic_init_stream_handler(ngx_event_t *ev);
+static ssize_t ngx_quic_stream_recv(ngx_connection_t *c, u_char *buf,
+    size_t size);
+static ssize_t ngx_quic_stream_send(ngx_connection_t *c, u_char *buf,
+    size_t size);
+static ngx_chain_t *ngx_quic_stream_send_chain(ngx_connection_t *c,
+    ngx_chain_t *in, off_t limit);
+static void ngx_quic_stream_cleanup_handler(void *data);
+static void ngx_quic_free_stream(ngx_connection_t *c, ngx_quic_stream_t *qs);
+static ngx_int_t ngx_quic_update_flow(ngx_connection_t *c,
+    ngx_quic_stream_t *qs, uint64_t last);
+static ngx_int_t ngx_quic_update_max_data(ngx_connection_t *c,
+    ngx_quic_stream_t *qs, size_t len);
+static ngx_int_t ngx_quic_send_stream_frame(ngx_connection_t *c,
+    ngx_uint_t type, uint64_t id, uint64_t err, uint64_t final_size);
+static void ngx_quic_unblock_stream(ngx_quic_stream_t *qs);
+static void ngx_quic_post_stream_event(ngx_event_t *ev, ngx_uint_t error);
+
+
+ngx_connection_t *
+ngx_quic_open_stream(ngx_connection_t *c, ngx_uint_t bidi)
+{
+    uint64_t                id;
+    ngx_quic_stream_t      *qs;
+    ngx_quic_connection_t  *qc;
+
+    if (c->quic) {
+        c = c->quic->parent;
+    }
+
+    qc = ngx_quic_get_connection(c);
+
+    if (qc->closing) {
+        return NULL;
+    }
+
+    if (bidi) {
+        if (qc->streams.server_streams_bidi
+            >= qc->streams.server_max_streams_bidi)
+        {
+            ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                           "quic too many server bidi streams:%uL",
+                           qc->streams.server_streams_bidi);
+            return NULL;
+        }
+
+        id = (qc->streams.server_streams_bidi << 2)
+             | NGX_QUIC_STREAM_SERVER_INITIATED;
+
+        qc->streams.server_streams_bidi++;
+
+    } else {
+        if (qc->streams.server_streams_uni
+            >= qc->streams.server_max_streams_uni)
+        {
+            ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                           "quic too many server uni streams:%uL",
+                           qc->streams.server_streams_uni);
+            return NULL;
+        }
+
+        id = (qc->streams.server_streams_uni << 2)
+             | NGX_QUIC_STREAM_SERVER_INITIATED
+             | NGX_QUIC_STREAM_UNIDIRECTIONAL;
+
+        qc->streams.server_streams_uni++;
+    }
+
+    qs = ngx_quic_create_stream(c, id);
+    if (qs == NULL) {
+        return NULL;
+    }
+
+    return qs->connection;
+}
+
+
+static ngx_quic_stream_t *
+ngx_quic_get_stream(ngx_connection_t *c, uint64_t id)
+{
+    uint64_t                min, n, *streams, *max_streams;
+    ngx_quic_stream_t      *qs;
+    ngx_quic_connection_t  *qc;
+
+    qc = ngx_quic_get_connection(c);
+
+    qs = ngx_quic_find_stream(&qc->streams.tree, id);
+
+    if (qs) {
+        return qs;
+    }
+
+    n = (id >> 2) + 1;
+
+    if (ngx_quic_stream_server(id)) {
+
+        streams = ngx_quic_stream_bidi(id) ? &qc->streams.server_streams_bidi
+                                           : &qc->streams.server_streams_uni;
+
+        if (n > *streams) {
+            /* RFC 9000, 19.8.  STREAM Frames: not opened yet */
+            qc->error = NGX_QUIC_ERR_STREAM_STATE_ERROR;
+            return NULL;
+        }
+
+        return NGX_QUIC_STREAM_GONE;
+    }
+
+    if (ngx_quic_stream_bidi(id)) {
+        streams = &qc->streams.client_streams_bidi;
+        max_streams = &qc->streams.client_max_streams_bidi;
+
+    } else {
+        streams = &qc->streams.client_streams_uni;
+        max_streams = &qc->streams.client_max_streams_uni;
+    }
+
+    if (n <= *streams) {
+        return NGX_QUIC_STREAM_GONE;
+    }
+
+    if (n > *max_streams) {
+        qc->error = NGX_QUIC_ERR_STREAM_LIMIT_ERROR;
+        return NULL;
+    }
+
+    /* RFC 9000, 3.2.  Receiving Stream States: lower ids are opened too */
+
+    min = (*streams << 2) | (id & 0x03);
+
+    *streams = n;
+
+    if (qc->shutdown) {
+        if (ngx_quic_reject_streams(c, min, id) != NGX_OK) {
+            return NULL;
+        }
+
+        return NGX_QUIC_STREAM_GONE;
+    }
+
+    for ( /* void */ ; min < id; min += 4) {
+
+        if (ngx_quic_create_stream(c, min) == NULL) {
+            return NULL;
+        }
+    }
+
+    return ngx_quic_create_stream(c, id);
+}
+
+
+static ngx_int_t
+ngx_quic_reject_streams(ngx_connection_t *c, uint64_t min, uint64_t max)
+{
+    ngx_int_t               code;
+    ngx_quic_connection_t  *qc;
+
+    qc = ngx_quic_get_connection(c);
+
+    code = ngx_quic_stream_bidi(max) ? qc->conf->stream_reject_code_bidi
+                                     : qc->conf->stream_reject_code_uni;
+
+    if (code < 0) {
+        return NGX_OK;
+    }
+
+    for ( /* void */ ; min <= max; min += 4) {
+
+        ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                       "quic stream id:0x%xL rejected", min);
+
+        if (ngx_quic_stream_bidi(min)
+            && ngx_quic_send_stream_frame(c, NGX_QUIC_FT_RESET_STREAM, min,
+                                          code, 0)
+               != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+        if (ngx_quic_send_stream_frame(c, NGX_QUIC_FT_STOP_SENDING, min,
+                                       code, 0)
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_quic_stream_t *
+ngx_quic_create_stream(ngx_connection_t *c, uint64_t id)
+{
+    ngx_log_t              *log;
+    ngx_pool_t             *pool;
+    ngx_queue_t            *q;
+    ngx_connection_t       *sc;
+    ngx_quic_stream_t      *qs;
+    ngx_pool_cleanup_t     *cln;
+    ngx_quic_connection_t  *qc;
+
+    qc = ngx_quic_get_connection(c);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "quic stream id:0x%xL create", id);
+
+    if (!ngx_queue_empty(&qc->streams.free)) {
+        q = ngx_queue_head(&qc->streams.free);
+        qs = ngx_queue_data(q, ngx_quic_stream_t, queue);
+        ngx_queue_remove(q);
+
+    } else {
+        qs = ngx_palloc(c->pool, sizeof(ngx_quic_stream_t));
+        if (qs == NULL) {
+            return NULL;
+        }
+    }
+
+    ngx_memzero(qs, sizeof(ngx_quic_stream_t));
+
+    qs->node.key = (ngx_rbtree_key_t) id;
+    qs->parent = c;
+    qs->id = id;
+    qs->send_final_size = (uint64_t) -1;
+
+    ngx_queue_init(&qs->recv.chain);
+
+    if (ngx_quic_stream_bidi(id)) {
+
+        /* RFC 9000, 18.2.  Transport Parameter Definitions */
+
+        qs->send_max_data = ngx_quic_stream_server(id)
+                            ? qc->ctp.initial_max_stream_data_bidi_remote
+                            : qc->ctp.initial_max_stream_data_bidi_local;
+
+        qs->recv_max_data = qc->conf->stream_buffer_size;
+
+    } else if (ngx_quic_stream_server(id)) {
+        qs->send_max_data = qc->ctp.initial_max_stream_data_uni;
+        qs->recv_state = NGX_QUIC_STREAM_RECV_DATA_READ;
+
+    } else {
+        qs->send_state = NGX_QUIC_STREAM_SEND_DATA_RECVD;
+        qs->recv_max_data = qc->conf->stream_buffer_size;
+    }
+
+    qs->recv_window = qs->recv_max_data;
+
+    ngx_rbtree_insert(&qc->streams.tree, &qs->node);
+
+    pool = ngx_create_pool(c->listening->pool_size, c->log);
+    if (pool == NULL) {
+        goto failed;
+    }
+
+    log = ngx_palloc(pool, sizeof(ngx_log_t));
+    if (log == NULL) {
+        ngx_destroy_pool(pool);
+        goto failed;
+    }
+
+    *log = *c->log;
+    pool->log = log;
+
+    sc = ngx_get_connection(c->fd, log);
+    if (sc == NULL) {
+        ngx_destroy_pool(pool);
+        goto failed;
+    }
+
+    qs->connection = sc;
+
+    sc->quic = qs;
+    sc->shared = 1;
+    sc->type = SOCK_STREAM;
+    sc->pool = pool;
+    sc->ssl = c->ssl;
+    sc->sockaddr = c->sockaddr;
+    sc->socklen = c->socklen;
+    sc->listening = c->listening;
+    sc->addr_text = c->addr_text;
+    sc->local_sockaddr = c->local_sockaddr;
+    sc->local_socklen = c->local_socklen;
+    sc->number = ngx_atomic_fetch_add(ngx_connection_counter, 1);
+    sc->start_time = c->start_time;
+    sc->tcp_nodelay = NGX_TCP_NODELAY_DISABLED;
+    sc->tcp_nopush = NGX_TCP_NOPUSH_DISABLED;
+    sc->need_last_buf = 1;
+
+    sc->recv = ngx_quic_stream_recv;
+    sc->send = ngx_quic_stream_send;
+    sc->send_chain = ngx_quic_stream_send_chain;
+
+    log->connection = sc->number;
+
+    sc->read->log = log;
+    sc->write->log = log;
+
+    if (qs->send_state == NGX_QUIC_STREAM_SEND_READY) {
+        sc->write->ready = 1;
+    }
+
+#if (NGX_STAT_STUB)
+    (void) ngx_atomic_fetch_add(ngx_stat_active, 1);
+#endif
+
+    cln = ngx_pool_cleanup_add(pool, 0);
+    if (cln == NULL) {
+        /* the stream is released as the connection is closed */
+        ngx_close_connection(sc);
+        ngx_destroy_pool(pool);
+#if (NGX_STAT_STUB)
+        (void) ngx_atomic_fetch_add(ngx_stat_active, -1);
+#endif
+        qs->connection = NULL;
+        goto failed;
+    }
+
+    cln->handler = ngx_quic_stream_cleanup_handler;
+    cln->data = qs;
+
+    if (!ngx_quic_stream_server(id)) {
+
+        /* the application is notified when the packet is processed */
+
+        sc->read->handler = ngx_quic_init_stream_handler;
+        ngx_post_event(sc->read, &ngx_posted_events);
+    }
+
+    return qs;
+
+failed:
+
+    ngx_rbtree_delete(&qc->streams.tree, &qs->node);
+    ngx_queue_insert_tail(&qc->streams.free, &qs->queue);
+
+    return NULL;
+}
+
+
+static void
+ngx_quic_init_stream_handler(ngx_event_t *ev)
+{
+    ngx_connection_t  *c;
+
+    c = ev->data;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "quic stream id:0x%xL init", c->quic->id);
+
+    c->listening->handler(c);
+}
+
+
+static ssize_t
+ngx_quic_stream_recv(ngx_connection_t *c, u_char *buf, size_t size)
+{
+    size_t              len;
+    ngx_event_t        *rev;
+    ngx_connection_t   *pc;
+    ngx_quic_stream_t  *qs;
+
+    qs = c->quic;
+    pc = qs->parent;
+    rev = c->read;
+
+    if (qs->recv_state == NGX_QUIC_STREAM_RECV_RESET_RECVD) {
+        rev->error = 1;
+    }
+
+    if (rev->error) {
+        return NGX_ERROR;
+    }
+
+    if (qs->recv_state == NGX_QUIC_STREAM_RECV_DATA_READ) {
+        rev->ready = 0;
+        rev->eof = 1;
+        return 0;
+    }
+
+    len = ngx_quic_read_buffer(pc, &qs->recv, buf, size);
+
+    ngx_log_debug3(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "quic stream id:0x%xL recv len:%uz of size:%uz",
+                   qs->id, len, size);
+
+    if (qs->recv_state == NGX_QUIC_STREAM_RECV_SIZE_KNOWN
+        && qs->recv.offset == qs->recv_final_size)
+    {
+        qs->recv_state = NGX_QUIC_STREAM_RECV_DATA_READ;
+    }
+
+    if (len == 0) {
+
+        if (qs->recv_state == NGX_QUIC_STREAM_RECV_DATA_READ) {
+            rev->ready = 0;
+            rev->eof = 1;
+            return 0;
+        }
+
+        rev->ready = 0;
+        return NGX_AGAIN;
+    }
+
+    if (ngx_quic_update_max_data(pc, qs, len) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    return len;
+}
+
+
+static ssize_t
+ngx_quic_stream_send(ngx_connection_t *c, u_char *buf, size_t size)
+{
+    off_t         sent;
+    ngx_buf_t     b;
+    ngx_chain_t   cl, *rc;
+
+    ngx_memzero(&b, sizeof(ngx_buf_t));
+
+    b.memory = 1;
+    b.pos = buf;
+    b.last = buf + size;
+
+    cl.buf = &b;
+    cl.next = NULL;
+
+    sent = c->sent;
+
+    rc = ngx_quic_stream_send_chain(c, &cl, 0);
+
+    if (rc == NGX_CHAIN_ERROR) {
+        return NGX_ERROR;
+    }
+
+    if (c->sent == sent) {
+        return NGX_AGAIN;
+    }
+
+    return c->sent - sent;
+}
+
+
+static ngx_chain_t *
+ngx_quic_stream_send_chain(ngx_connection_t *c, ngx_chain_t *in, off_t limit)
+{
+    size_t                  size;
+    uint64_t                n, buffered, flow;
+    ngx_buf_t              *b;
+    ngx_uint_t              fin;
+    ngx_event_t            *wev;
+    ngx_connection_t       *pc;
+    ngx_quic_frame_t       *f;
+    ngx_quic_stream_t      *qs;
+    ngx_quic_connection_t  *qc;
+
+    qs = c->quic;
+    pc = qs->parent;
+    qc = ngx_quic_get_connection(pc);
+    wev = c->write;
+
+    if (qs->send_state != NGX_QUIC_STREAM_SEND_READY
+        && qs->send_state != NGX_QUIC_STREAM_SEND_SEND)
+    {
+        wev->error = 1;
+        return NGX_CHAIN_ERROR;
+    }
+
+    if (wev->error || qc->closing) {
+        wev->error = 1;
+        return NGX_CHAIN_ERROR;
+    }
+
+    qs->send_state = NGX_QUIC_STREAM_SEND_SEND;
+
+    /*
+     * the data are limited by the stream and connection flow control
+     * and by the buffer size, the buffered data are freed when acked
+     */
+
+    flow = ngx_min(qs->send_max_data - qs->send_offset,
+                   qc->streams.send_max_data - qc->streams.sent);
+
+    buffered = qs->send_offset - qs->send_acked;
+
+    if (buffered >= qc->conf->stream_buffer_size) {
+        n = 0;
+
+    } else {
+        n = ngx_min(flow, qc->conf->stream_buffer_size - buffered);
+    }
+
+    if (limit > 0 && (uint64_t) limit < n) {
+        n = limit;
+    }
+
+    f = NULL;
+    fin = 0;
+
+    while (in) {
+        b = in->buf;
+
+        if (!ngx_buf_in_memory(b) && !ngx_buf_special(b)) {
+            ngx_log_error(NGX_LOG_ALERT, c->log, 0,
+                          "non-memory buf in quic stream");
+            return NGX_CHAIN_ERROR;
+        }
+
+        if (b->pos == b->last || ngx_buf_special(b)) {
+
+            if (b->last_buf) {
+                fin = 1;
+            }
+
+            in = in->next;
+            continue;
+        }
+
+        if (n == 0) {
+            break;
+        }
+
+        if (f == NULL) {
+            f = ngx_quic_alloc_frame(pc);
+            if (f == NULL) {
+                return NGX_CHAIN_ERROR;
+            }
+
+            if (ngx_quic_alloc_frame_data(pc, f) != NGX_OK) {
+                ngx_quic_free_frame(pc, f);
+                return NGX_CHAIN_ERROR;
+            }
+
+            f->level = NGX_QUIC_ENCRYPTION_APPLICATION;
+            f->type = NGX_QUIC_FT_STREAM;
+            f->u.stream.stream_id = qs->id;
+            f->u.stream.offset = qs->send_offset;
+        }
+
+        size = ngx_min((uint64_t) (b->last - b->pos), n);
+        size = ngx_min(size, NGX_QUIC_MAX_FRAME_DATA - f->u.stream.length);
+
+        ngx_memcpy(f->data + f->u.stream.length, b->pos, size);
+
+        b->pos += size;
+        f->u.stream.length += size;
+        qs->send_offset += size;
+        qc->streams.sent += size;
+        c->sent += size;
+        n -= size;
+
+        if (f->u.stream.length == NGX_QUIC_MAX_FRAME_DATA) {
+            ngx_quic_queue_frame(qc, f);
+            f = NULL;
+        }
+    }
+
+    if (fin && in == NULL) {
+
+        if (f == NULL) {
+            f = ngx_quic_alloc_frame(pc);
+            if (f == NULL) {
+                return NGX_CHAIN_ERROR;
+            }
+
+            f->level = NGX_QUIC_ENCRYPTION_APPLICATION;
+            f->type = NGX_QUIC_FT_STREAM;
+            f->u.stream.stream_id = qs->id;
+            f->u.stream.offset = qs->send_offset;
+        }
+
+        f->u.stream.fin = 1;
+
+        qs->send_final_size = qs->send_offset;
+        qs->send_state = NGX_QUIC_STREAM_SEND_DATA_SENT;
+
+        ngx_log_debug2(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                       "quic stream id:0x%xL send fin size:%uL",
+                       qs->id, qs->send_final_size);
+    }
+
+    if (f) {
+        ngx_quic_queue_frame(qc, f);
+    }
+
+    if (in) {
+        qs->blocked = 1;
+        wev->ready = 0;
+
+    } else {
+        wev->ready = 1;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "quic stream id:0x%xL send offset:%uL",
+                   qs->id, qs->send_offset);
+
+    return in;
+}
+
+
+static void
+ngx_quic_stream_cleanup_handler(void *data)
+{
+    ngx_quic_stream_t *qs = data;
+
+    ngx_connection_t       *c;
+    ngx_quic_connection_t  *qc;
+
+    c = qs->parent;
+    qc = ngx_quic_get_connection(c);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "quic stream id:0x%xL cleanup", qs->id);
+
+    /* the stream connection is already closed */
+
+    qs->connection = NULL;
+
+    if (qc->closing) {
+        ngx_quic_free_stream(c, qs);
+        goto done;
+    }
+
+    if (qs->recv_state == NGX_QUIC_STREAM_RECV_RECV
+        || qs->recv_state == NGX_QUIC_STREAM_RECV_SIZE_KNOWN)
+    {
+        /* RFC 9000, 3.5.  Solicited State Transitions */
+
+        if (ngx_quic_send_stream_frame(c, NGX_QUIC_FT_STOP_SENDING, qs->id,
+                                       qc->conf->stream_close_code, 0)
+            != NGX_OK)
+        {
+            goto failed;
+        }
+
+        qs->recv_state = NGX_QUIC_STREAM_RECV_DATA_READ;
+    }
+
+    ngx_quic_free_buffer(c, &qs->recv);
+
+    if (qs->send_state == NGX_QUIC_STREAM_SEND_READY
+        || qs->send_state == NGX_QUIC_STREAM_SEND_SEND)
+    {
+        if (ngx_quic_send_stream_frame(c, NGX_QUIC_FT_RESET_STREAM, qs->id,
+                                       qc->conf->stream_close_code,
+                                       qs->send_offset)
+            != NGX_OK)
+        {
+            goto failed;
+        }
+
+        qs->send_state = NGX_QUIC_STREAM_SEND_RESET_SENT;
+    }
+
+    if (qs->send_state == NGX_QUIC_STREAM_SEND_DATA_SENT) {
+        /* the stream is freed when all the data are acknowledged */
+        goto done;
+    }
+
+    ngx_quic_free_stream(c, qs);
+
+done:
+
+    ngx_post_event(&qc->push, &ngx_posted_events);
+
+    return;
+
+failed:
+
+    qc->error = NGX_QUIC_ERR_INTERNAL_ERROR;
+    ngx_quic_free_stream(c, qs);
+
+    ngx_post_event(&qc->push, &ngx_posted_events);
+}
+
+
+static void
+ngx_quic_free_stream(ngx_connection_t *c, ngx_quic_stream_t *qs)
+{
+    ngx_quic_frame_t       *frame;
+    ngx_quic_connection_t  *qc;
+
+    qc = ngx_quic_get_connection(c);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "quic stream id:0x%xL free", qs->id);
+
+    ngx_rbtree_delete(&qc->streams.tree, &qs->node);
+    ngx_quic_free_buffer(c, &qs->recv);
+    ngx_queue_insert_tail(&qc->streams.free, &qs->queue);
+
+    if (qc->closing || ngx_quic_stream_server(qs->id)) {
+        return;
+    }
+
+    /* RFC 9000, 4.6.  Controlling Concurrency */
+
+    frame = ngx_quic_alloc_frame(c);
+    if (frame == NULL) {
+        return;
+    }
+
+    frame->level = NGX_QUIC_ENCRYPTION_APPLICATION;
+
+    if (ngx_quic_stream_bidi(qs->id)) {
+        frame->type = NGX_QUIC_FT_MAX_STREAMS;
+        frame->u.max_streams.limit = ++qc->streams.client_max_streams_bidi;
+        frame->u.max_streams.bidi = 1;
+
+    } else {
+        frame->type = NGX_QUIC_FT_MAX_STREAMS2;
+        frame->u.max_streams.limit = ++qc->streams.client_max_streams_uni;
+        frame->u.max_streams.bidi = 0;
+    }
+
+    ngx_quic_queue_frame(qc, frame);
+}
+
+
+ngx_int_t
+ngx_quic_close_streams(ngx_connection_t *c, ngx_quic_connection_t *qc)
+{
+    ngx_connection_t   *sc;
+    ngx_rbtree_node_t  *node, *next;
+    ngx_quic_stream_t  *qs;
+
+    if (qc->streams.tree.root == qc->streams.tree.sentinel) {
+        return NGX_OK;
+    }
+
+    node = ngx_rbtree_min(qc->streams.tree.root, qc->streams.tree.sentinel);
+
+    while (node) {
+        next = ngx_rbtree_next(&qc->streams.tree, node);
+
+        qs = (ngx_quic_stream_t *) node;
+        sc = qs->connection;
+
+        if (sc == NULL) {
+            ngx_quic_free_stream(c, qs);
+
+        } else if (!sc->read->error) {
+
+            /* the application closes the stream on error */
+
+            ngx_quic_post_stream_event(sc->read, 1);
+            ngx_quic_post_stream_event(sc->write, 1);
+        }
+
+        node = next;
+    }
+
+    if (qc->streams.tree.root == qc->streams.tree.sentinel) {
+        return NGX_OK;
+    }
+
+    ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "quic connection has active streams");
+
+    return NGX_AGAIN;
+}
+
+
+ngx_int_t
+ngx_quic_reset_stream(ngx_connection_t *c, ngx_uint_t err)
+{
+    ngx_connection_t       *pc;
+    ngx_quic_stream_t      *qs;
+    ngx_quic_connection_t  *qc;
+
+    qs = c->quic;
+    pc = qs->parent;
+    qc = ngx_quic_get_connection(pc);
+
+    if (qs->send_state == NGX_QUIC_STREAM_SEND_DATA_RECVD
+        || qs->send_state == NGX_QUIC_STREAM_SEND_RESET_SENT)
+    {
+        return NGX_OK;
+    }
+
+    qs->send_state = NGX_QUIC_STREAM_SEND_RESET_SENT;
+    c->write->error = 1;
+
+    if (qc->closing) {
+        return NGX_OK;
+    }
+
+    return ngx_quic_send_stream_frame(pc, NGX_QUIC_FT_RESET_STREAM, qs->id,
+                                      err, qs->send_offset);
+}
+
+
+ngx_int_t
+ngx_quic_shutdown_stream(ngx_connection_t *c, int how)
+{
+    ngx_buf_t               b;
+    ngx_chain_t             cl;
+    ngx_connection_t       *pc;
+    ngx_quic_stream_t      *qs;
+    ngx_quic_connection_t  *qc;
+
+    qs = c->quic;
+    pc = qs->parent;
+    qc = ngx_quic_get_connection(pc);
+
+    if (how == NGX_READ_SHUTDOWN) {
+
+        if (qs->recv_state != NGX_QUIC_STREAM_RECV_RECV
+            && qs->recv_state != NGX_QUIC_STREAM_RECV_SIZE_KNOWN)
+        {
+            return NGX_OK;
+        }
+
+        qs->recv_state = NGX_QUIC_STREAM_RECV_DATA_READ;
+        ngx_quic_free_buffer(pc, &qs->recv);
+
+        return ngx_quic_send_stream_frame(pc, NGX_QUIC_FT_STOP_SENDING,
+                                          qs->id, qc->conf->stream_close_code,
+                                          0);
+    }
+
+    /* NGX_WRITE_SHUTDOWN */
+
+    if (qs->send_state != NGX_QUIC_STREAM_SEND_READY
+        && qs->send_state != NGX_QUIC_STREAM_SEND_SEND)
+    {
+        return NGX_OK;
+    }
+
+    ngx_memzero(&b, sizeof(ngx_buf_t));
+
+    b.last_buf = 1;
+
+    cl.buf = &b;
+    cl.next = NULL;
+
+    if (ngx_quic_stream_send_chain(c, &cl, 0) == NGX_CHAIN_ERROR) {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_quic_handle_stream_frame(ngx_connection_t *c, ngx_quic_header_t *pkt,
+    ngx_quic_frame_t *f)
+{
+    uint64_t                 last;
+    ngx_quic_stream_t       *qs;
+    ngx_quic_connection_t   *qc;
+    ngx_quic_stream_frame_t *sf;
+
+    qc = ngx_quic_get_connection(c);
+    sf = &f->u.stream;
+
+    if (ngx_quic_stream_server(sf->stream_id)
+        && !ngx_quic_stream_bidi(sf->stream_id))
+    {
+        qc->error = NGX_QUIC_ERR_STREAM_STATE_ERROR;
+        return NGX_ERROR;
+    }
+
+    last = sf->offset + sf->length;
+
+    if (last > NGX_QUIC_MAX_INT) {
+        qc->error = NGX_QUIC_ERR_FRAME_ENCODING_ERROR;
+        return NGX_ERROR;
+    }
+
+    qs = ngx_quic_get_stream(c, sf->stream_id);
+
+    if (qs == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (qs == NGX_QUIC_STREAM_GONE) {
+        return NGX_OK;
+    }
+
+    if (qs->recv_state != NGX_QUIC_STREAM_RECV_RECV
+        && qs->recv_state != NGX_QUIC_STREAM_RECV_SIZE_KNOWN)
+    {
+        return NGX_OK;
+    }
+
+    /* RFC 9000, 4.5.  Stream Final Size */
+
+    if (qs->recv_state == NGX_QUIC_STREAM_RECV_SIZE_KNOWN) {
+
+        if (last > qs->recv_final_size
+            || (sf->fin && last != qs->recv_final_size))
+        {
+            qc->error = NGX_QUIC_ERR_FINAL_SIZE_ERROR;
+            return NGX_ERROR;
+        }
+
+    } else if (sf->fin) {
+
+        if (last < qs->recv.last_offset) {
+            qc->error = NGX_QUIC_ERR_FINAL_SIZE_ERROR;
+            return NGX_ERROR;
+        }
+
+        qs->recv_final_size = last;
+        qs->recv_state = NGX_QUIC_STREAM_RECV_SIZE_KNOWN;
+    }
+
+    if (ngx_quic_update_flow(c, qs, last) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (ngx_quic_write_buffer(c, &qs->recv, sf->offset, f->data, sf->length)
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    if (qs->connection) {
+        ngx_quic_post_stream_event(qs->connection->read, 0);
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_quic_update_flow(ngx_connection_t *c, ngx_quic_stream_t *qs,
+    uint64_t last)
+{
+    ngx_quic_connection_t  *qc;
+
+    qc = ngx_quic_get_connection(c);
+
+    /* RFC 9000, 4.1.  Data Flow Control */
+
+    if (last > qs->recv_max_data) {
+        qc->error = NGX_QUIC_ERR_FLOW_CONTROL_ERROR;
+        return NGX_ERROR;
+    }
+
+    if (last <= qs->recv.last_offset) {
+        return NGX_OK;
+    }
+
+    qc->streams.received += last - qs->recv.last_offset;
+
+    if (qc->streams.received > qc->streams.recv_max_data) {
+        qc->error = NGX_QUIC_ERR_FLOW_CONTROL_ERROR;
+        return NGX_ERROR;
+    }
+
+    qs->recv.last_offset = last;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_quic_update_max_data(ngx_connection_t *c, ngx_quic_stream_t *qs,
+    size_t len)
+{
+    ngx_quic_frame_t       *frame;
+    ngx_quic_connection_t  *qc;
+
+    qc = ngx_quic_get_connection(c);
+
+    /* the credit is extended as a half of the window is consumed */
+
+    if (qs->recv_state == NGX_QUIC_STREAM_RECV_RECV
+        && qs->recv_max_data - qs->recv.offset < qs->recv_window / 2)
+    {
+        qs->recv_max_data = qs->recv.offset + qs->recv_window;
+
+        frame = ngx_quic_alloc_frame(c);
+        if (frame == NULL) {
+            return NGX_ERROR;
+        }
+
+        frame->level = NGX_QUIC_ENCRYPTION_APPLICATION;
+        frame->type = NGX_QUIC_FT_MAX_STREAM_DATA;
+        frame->u.max_stream_data.id = qs->id;
+        frame->u.max_stream_data.limit = qs->recv_max_data;
+
+        ngx_quic_queue_frame(qc, frame);
+    }
+
+    qc->streams.read += len;
+
+    if (qc->streams.recv_max_data - qc->streams.read
+        < qc->streams.recv_window / 2)
+    {
+        qc->streams.recv_max_data = qc->streams.read
+                                    + qc->streams.recv_window;
+
+        frame = ngx_quic_alloc_frame(c);
+        if (frame == NULL) {
+            return NGX_ERROR;
+        }
+
+        frame->level = NGX_QUIC_ENCRYPTION_APPLICATION;
+        frame->type = NGX_QUIC_FT_MAX_DATA;
+        frame->u.max_data.max_data = qc->streams.recv_max_data;
+
+        ngx_quic_queue_frame(qc, frame);
+    }
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_quic_handle_reset_stream_frame(ngx_connection_t *c,
+    ngx_quic_header_t *pkt, ngx_quic_frame_t *f)
+{
+    ngx_quic_stream_t              *qs;
+    ngx_quic_connection_t          *qc;
+    ngx_quic_reset_stream_frame_t  *rs;
+
+    qc = ngx_quic_get_connection(c);
+    rs = &f->u.reset_stream;
+
+    if (ngx_quic_stream_server(rs->id) && !ngx_quic_stream_bidi(rs->id)) {
+        qc->error = NGX_QUIC_ERR_STREAM_STATE_ERROR;
+        return NGX_ERROR;
+    }
+
+    qs = ngx_quic_get_stream(c, rs->id);
+
+    if (qs == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (qs == NGX_QUIC_STREAM_GONE) {
+        return NGX_OK;
+    }
+
+    if (qs->recv_state != NGX_QUIC_STREAM_RECV_RECV
+        && qs->recv_state != NGX_QUIC_STREAM_RECV_SIZE_KNOWN)
+    {
+        return NGX_OK;
+    }
+
+    if ((qs->recv_state == NGX_QUIC_STREAM_RECV_SIZE_KNOWN
+         && rs->final_size != qs->recv_final_size)
+        || rs->final_size < qs->recv.last_offset)
+    {
+        qc->error = NGX_QUIC_ERR_FINAL_SIZE_ERROR;
+        return NGX_ERROR;
+    }
+
+    if (ngx_quic_update_flow(c, qs, rs->final_size) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "quic stream id:0x%xL reset by peer err:0x%xL",
+                   qs->id, rs->error_code);
+
+    qs->recv_state = NGX_QUIC_STREAM_RECV_RESET_RECVD;
+    qs->recv_final_size = rs->final_size;
+
+    ngx_quic_free_buffer(c, &qs->recv);
+
+    if (qs->connection) {
+        ngx_quic_post_stream_event(qs->connection->read, 1);
+    }
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_quic_handle_stop_sending_frame(ngx_connection_t *c,
+    ngx_quic_header_t *pkt, ngx_quic_frame_t *f)
+{
+    ngx_quic_stream_t              *qs;
+    ngx_quic_connection_t          *qc;
+    ngx_quic_stop_sending_frame_t  *ss;
+
+    qc = ngx_quic_get_connection(c);
+    ss = &f->u.stop_sending;
+
+    if (!ngx_quic_stream_server(ss->id) && !ngx_quic_stream_bidi(ss->id)) {
+        qc->error = NGX_QUIC_ERR_STREAM_STATE_ERROR;
+        return NGX_ERROR;
+    }
+
+    qs = ngx_quic_get_stream(c, ss->id);
+
+    if (qs == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (qs == NGX_QUIC_STREAM_GONE) {
+        return NGX_OK;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "quic stream id:0x%xL stop sending by peer err:0x%xL",
+                   qs->id, ss->error_code);
+
+    /* RFC 9000, 3.5.  Solicited State Transitions */
+
+    if (qs->send_state == NGX_QUIC_STREAM_SEND_DATA_RECVD
+        || qs->send_state == NGX_QUIC_STREAM_SEND_RESET_SENT)
+    {
+        return NGX_OK;
+    }
+
+    qs->send_state = NGX_QUIC_STREAM_SEND_RESET_SENT;
+
+    if (ngx_quic_send_stream_frame(c, NGX_QUIC_FT_RESET_STREAM, qs->id,
+                                   ss->error_code, qs->send_offset)
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    if (qs->connection) {
+        ngx_quic_post_stream_event(qs->connection->write, 1);
+
+    } else {
+        ngx_quic_free_stream(c, qs);
+    }
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_quic_handle_max_data_frame(ngx_connection_t *c, ngx_quic_frame_t *f)
+{
+    ngx_rbtree_node_t      *node;
+    ngx_quic_stream_t      *qs;
+    ngx_quic_connection_t  *qc;
+
+    qc = ngx_quic_get_connection(c);
+
+    if (f->u.max_data.max_data <= qc->streams.send_max_data) {
+        return NGX_OK;
+    }
+
+    qc->streams.send_max_data = f->u.max_data.max_data;
+
+    if (qc->streams.tree.root == qc->streams.tree.sentinel) {
+        return NGX_OK;
+    }
+
+    for (node = ngx_rbtree_min(qc->streams.tree.root,
+                               qc->streams.tree.sentinel);
+         node;
+         node = ngx_rbtree_next(&qc->streams.tree, node))
+    {
+        qs = (ngx_quic_stream_t *) node;
+        ngx_quic_unblock_stream(qs);
+    }
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_quic_handle_max_stream_data_frame(ngx_connection_t *c,
+    ngx_quic_header_t *pkt, ngx_quic_frame_t *f)
+{
+    ngx_quic_stream_t                 *qs;
+    ngx_quic_connection_t             *qc;
+    ngx_quic_max_stream_data_frame_t  *msd;
+
+    qc = ngx_quic_get_connection(c);
+    msd = &f->u.max_stream_data;
+
+    if (!ngx_quic_stream_server(msd->id) && !ngx_quic_stream_bidi(msd->id)) {
+        qc->error = NGX_QUIC_ERR_STREAM_STATE_ERROR;
+        return NGX_ERROR;
+    }
+
+    qs = ngx_quic_get_stream(c, msd->id);
+
+    if (qs == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (qs == NGX_QUIC_STREAM_GONE || msd->limit <= qs->send_max_data) {
+        return NGX_OK;
+    }
+
+    qs->send_max_data = msd->limit;
+
+    ngx_quic_unblock_stream(qs);
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_quic_handle_max_streams_frame(ngx_connection_t *c, ngx_quic_frame_t *f)
+{
+    ngx_quic_connection_t  *qc;
+
+    qc = ngx_quic_get_connection(c);
+
+    /* RFC 9000, 19.11.  MAX_STREAMS Frames */
+
+    if (f->u.max_streams.limit > ((uint64_t) 1 << 60)) {
+        qc->error = NGX_QUIC_ERR_FRAME_ENCODING_ERROR;
+        return NGX_ERROR;
+    }
+
+    if (f->u.max_streams.bidi) {
+        if (f->u.max_streams.limit > qc->streams.server_max_streams_bidi) {
+            qc->streams.server_max_streams_bidi = f->u.max_streams.limit;
+        }
+
+    } else {
+        if (f->u.max_streams.limit > qc->streams.server_max_streams_uni) {
+            qc->streams.server_max_streams_uni = f->u.max_streams.limit;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+void
+ngx_quic_handle_stream_ack(ngx_connection_t *c, ngx_quic_frame_t *f)
+{
+    ngx_quic_stream_t      *qs;
+    ngx_quic_connection_t  *qc;
+
+    qc = ngx_quic_get_connection(c);
+
+    qs = ngx_quic_find_stream(&qc->streams.tree, f->u.stream.stream_id);
+
+    if (qs == NULL) {
+        return;
+    }
+
+    qs->send_acked += f->u.stream.length;
+
+    if (f->u.stream.fin) {
+        qs->fin_acked = 1;
+    }
+
+    if (qs->send_state == NGX_QUIC_STREAM_SEND_DATA_SENT
+        && qs->fin_acked
+        && qs->send_acked == qs->send_final_size)
+    {
+        ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                       "quic stream id:0x%xL all data acked", qs->id);
+
+        qs->send_state = NGX_QUIC_STREAM_SEND_DATA_RECVD;
+    }
+
+    if (qs->connection == NULL) {
+
+        if (qs->send_state != NGX_QUIC_STREAM_SEND_DATA_SENT) {
+            ngx_quic_free_stream(c, qs);
+        }
+
+        return;
+    }
+
+    /* the acknowledged data are no longer buffered */
+
+    ngx_quic_unblock_stream(qs);
+}
+
+
+static ngx_int_t
+ngx_quic_send_stream_frame(ngx_connection_t *c, ngx_uint_t type, uint64_t id,
+    uint64_t err, uint64_t final_size)
+{
+    ngx_quic_frame_t       *frame;
+    ngx_quic_connection_t  *qc;
+
+    qc = ngx_quic_get_connection(c);
+
+    frame = ngx_quic_alloc_frame(c);
+    if (frame == NULL) {
+        return NGX_ERROR;
+    }
+
+    frame->level = NGX_QUIC_ENCRYPTION_APPLICATION;
+    frame->type = type;
+
+    if (type == NGX_QUIC_FT_RESET_STREAM) {
+        frame->u.reset_stream.id = id;
+        frame->u.reset_stream.error_code = err;
+        frame->u.reset_stream.final_size = final_size;
+
+    } else {
+        frame->u.stop_sending.id = id;
+        frame->u.stop_sending.error_code = err;
+    }
+
+    ngx_quic_queue_frame(qc, frame);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_quic_unblock_stream(ngx_quic_stream_t *qs)
+{
+    if (!qs->blocked || qs->connection == NULL) {
+        return;
+    }
+
+    qs->blocked = 0;
+
+    ngx_quic_post_stream_event(qs->connection->write, 0);
+}
+
+
+static void
+ngx_quic_post_stream_event(ngx_event_t *ev, ngx_uint_t error)
+{
+    if (error) {
+        ev->error = 1;
+    }
+
+    ev->ready = 1;
+
+    if (ev->handler) {
+        ngx_post_event(ev, &ngx_posted_events);
+    }
+}
+
+
+ngx_quic_stream_t *
+ngx_quic_find_stream(ngx_rbtree_t *rbtree, uint64_t id)
+{
+    ngx_rbtree_node_t  *node, *sentinel;
+    ngx_quic_stream_t  *qn;
+
+    node = rbtree->root;
+    sentinel = rbtree->sentinel;
+
+    while (node != sentinel) {
+        qn = (ngx_quic_stream_t *) node;
+
+        if (id == qn->id) {
+            return qn;
+        }
+
+        node = (id < qn->id) ? node->left : node->right;
+    }
+
+    return NULL;
+}
+
+
+void
+ngx_quic_rbtree_insert_stream(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+{
+    ngx_rbtree_node_t  **p;
+    ngx_quic_stream_t   *qn, *qnt;
+
+    for ( ;; ) {
+        qn = (ngx_quic_stream_t *) node;
+        qnt = (ngx_quic_stream_t *) temp;
+
+        p = (qn->id < qnt->id) ? &temp->left : &temp->right;
+
+        if (*p == sentinel) {
+            break;
+        }
+
+        temp = *p;
+    }
+
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
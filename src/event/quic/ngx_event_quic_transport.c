@@ -0,0 +1,1304 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+#include <ngx_event_quic_connection.h>
+
+
+#define ngx_quic_parse_uint32(p)                                             \
+    ((uint32_t) (p)[0] << 24 | (p)[1] << 16 | (p)[2] << 8 | (p)[3])
+
+#define ngx_quic_write_uint32(p, s)                                          \
+    ((p)[0] = (u_char) ((s) >> 24),                                          \
+     (p)[1] = (u_char) ((s) >> 16),                                          \
+     (p)[2] = (u_char) ((s) >> 8),                                           \
+     (p)[3] = (u_char)  (s),                                                 \
+     (p) + sizeof(uint32_t))
+
+
+static u_char *ngx_quic_read_bytes(u_char *pos, u_char *end, size_t len,
+    u_char **out);
+static u_char *ngx_quic_copy_bytes(u_char *pos, u_char *end, size_t len,
+    u_char *dst);
+static ngx_int_t ngx_quic_frame_allowed(ngx_quic_header_t *pkt,
+    ngx_uint_t frame_type);
+
+static size_t ngx_quic_create_ack(u_char *p, ngx_quic_ack_frame_t *ack);
+static size_t ngx_quic_create_crypto(u_char *p, ngx_quic_frame_t *f);
+static size_t ngx_quic_create_stream(u_char *p, ngx_quic_frame_t *f);
+static size_t ngx_quic_create_close(u_char *p, ngx_quic_frame_t *f);
+static size_t ngx_quic_create_new_connection_id(u_char *p,
+    ngx_quic_new_conn_id_frame_t *ncid);
+static size_t ngx_quic_create_varints(u_char *p, ngx_uint_t type,
+    ngx_uint_t n, uint64_t v1, uint64_t v2, uint64_t v3);
+
+static size_t ngx_quic_tp_len(uint16_t id, uint64_t value);
+static void ngx_quic_tp_write(u_char **pos, uint16_t id, uint64_t value);
+static size_t ngx_quic_tp_strlen(uint16_t id, ngx_str_t *value);
+static void ngx_quic_tp_write_str(u_char **pos, uint16_t id,
+    ngx_str_t *value);
+
+
+u_char *
+ngx_quic_parse_int(u_char *pos, u_char *end, uint64_t *out)
+{
+    u_char      *p;
+    uint64_t     value;
+    ngx_uint_t   len;
+
+    if (pos >= end) {
+        return NULL;
+    }
+
+    p = pos;
+    len = 1 << (*p >> 6);
+
+    value = *p++ & 0x3f;
+
+    if ((size_t) (end - pos) < len) {
+        return NULL;
+    }
+
+    while (--len) {
+        value = (value << 8) + *p++;
+    }
+
+    *out = value;
+
+    return p;
+}
+
+
+void
+ngx_quic_build_int(u_char **pos, uint64_t value)
+{
+    u_char      *p;
+    ngx_uint_t   bits, len;
+
+    p = *pos;
+    bits = 0;
+
+    while (value >> ((8 << bits) - 2)) {
+        bits++;
+    }
+
+    len = (1 << bits);
+
+    while (len--) {
+        *p++ = value >> (len * 8);
+    }
+
+    **pos |= bits << 6;
+    *pos = p;
+}
+
+
+ngx_uint_t
+ngx_quic_varint_len(uint64_t value)
+{
+    ngx_uint_t  bits;
+
+    bits = 0;
+
+    while (value >> ((8 << bits) - 2)) {
+        bits++;
+    }
+
+    return 1 << bits;
+}
+
+
+static u_char *
+ngx_quic_read_bytes(u_char *pos, u_char *end, size_t len, u_char **out)
+{
+    if ((size_t) (end - pos) < len) {
+        return NULL;
+    }
+
+    *out = pos;
+
+    return pos + len;
+}
+
+
+static u_char *
+ngx_quic_copy_bytes(u_char *pos, u_char *end, size_t len, u_char *dst)
+{
+    if ((size_t) (end - pos) < len) {
+        return NULL;
+    }
+
+    ngx_memcpy(dst, pos, len);
+
+    return pos + len;
+}
+
+
+ngx_int_t
+ngx_quic_get_packet_dcid(ngx_log_t *log, u_char *data, size_t n,
+    ngx_str_t *dcid)
+{
+    size_t  len;
+
+    if (n == 0) {
+        goto failed;
+    }
+
+    if (ngx_quic_long_packet(data)) {
+        if (n < 6) {
+            goto failed;
+        }
+
+        len = data[5];
+
+        if (len > NGX_QUIC_MAX_CID_LEN || n < 6 + len) {
+            goto failed;
+        }
+
+        dcid->len = len;
+        dcid->data = &data[6];
+
+    } else {
+        if (n < 1 + NGX_QUIC_SERVER_CID_LEN) {
+            goto failed;
+        }
+
+        dcid->len = NGX_QUIC_SERVER_CID_LEN;
+        dcid->data = &data[1];
+    }
+
+    return NGX_OK;
+
+failed:
+
+    ngx_log_debug0(NGX_LOG_DEBUG_EVENT, log, 0, "quic malformed packet");
+
+    return NGX_ERROR;
+}
+
+
+ngx_int_t
+ngx_quic_parse_packet(ngx_quic_header_t *pkt)
+{
+    u_char    *p, *end;
+    uint8_t    len;
+    uint64_t   varint;
+
+    p = pkt->data;
+    end = pkt->raw_end;
+
+    if (p >= end) {
+        return NGX_ERROR;
+    }
+
+    pkt->flags = *p++;
+
+    if (!ngx_quic_long_packet(pkt->data)) {
+
+        if (!(pkt->flags & NGX_QUIC_PKT_FIXED_BIT)) {
+            ngx_log_error(NGX_LOG_INFO, pkt->log, 0,
+                          "quic fixed bit is not set");
+            return NGX_ERROR;
+        }
+
+        p = ngx_quic_read_bytes(p, end, NGX_QUIC_SERVER_CID_LEN,
+                                &pkt->dcid.data);
+        if (p == NULL) {
+            return NGX_ERROR;
+        }
+
+        pkt->dcid.len = NGX_QUIC_SERVER_CID_LEN;
+        pkt->level = NGX_QUIC_ENCRYPTION_APPLICATION;
+        pkt->pn_pos = p;
+        pkt->len = end - pkt->data;
+
+        return NGX_OK;
+    }
+
+    if (end - p < 5) {
+        return NGX_ERROR;
+    }
+
+    pkt->version = ngx_quic_parse_uint32(p);
+    p += 4;
+
+    len = *p++;
+
+    if (len > NGX_QUIC_MAX_CID_LEN) {
+        return NGX_ERROR;
+    }
+
+    p = ngx_quic_read_bytes(p, end, len, &pkt->dcid.data);
+    if (p == NULL || p == end) {
+        return NGX_ERROR;
+    }
+
+    pkt->dcid.len = len;
+
+    len = *p++;
+
+    if (len > NGX_QUIC_MAX_CID_LEN) {
+        return NGX_ERROR;
+    }
+
+    p = ngx_quic_read_bytes(p, end, len, &pkt->scid.data);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    pkt->scid.len = len;
+
+    if (pkt->version != NGX_QUIC_VERSION) {
+        ngx_log_debug1(NGX_LOG_DEBUG_EVENT, pkt->log, 0,
+                       "quic unsupported version: 0x%xD", pkt->version);
+        pkt->len = end - pkt->data;
+        return NGX_ABORT;
+    }
+
+    if (!(pkt->flags & NGX_QUIC_PKT_FIXED_BIT)) {
+        ngx_log_error(NGX_LOG_INFO, pkt->log, 0,
+                      "quic fixed bit is not set");
+        return NGX_ERROR;
+    }
+
+    if (ngx_quic_pkt_in(pkt->flags)) {
+        p = ngx_quic_parse_int(p, end, &varint);
+        if (p == NULL) {
+            return NGX_ERROR;
+        }
+
+        p = ngx_quic_read_bytes(p, end, varint, &pkt->token.data);
+        if (p == NULL) {
+            return NGX_ERROR;
+        }
+
+        pkt->token.len = varint;
+        pkt->level = NGX_QUIC_ENCRYPTION_INITIAL;
+
+    } else if (ngx_quic_pkt_hs(pkt->flags)) {
+        pkt->level = NGX_QUIC_ENCRYPTION_HANDSHAKE;
+
+    } else if (ngx_quic_pkt_zrtt(pkt->flags)) {
+        pkt->level = NGX_QUIC_ENCRYPTION_APPLICATION;
+
+    } else {
+        ngx_log_error(NGX_LOG_INFO, pkt->log, 0,
+                      "quic unexpected retry packet");
+        return NGX_ERROR;
+    }
+
+    p = ngx_quic_parse_int(p, end, &varint);
+    if (p == NULL || varint > (uint64_t) (end - p)) {
+        ngx_log_error(NGX_LOG_INFO, pkt->log, 0,
+                      "quic bad packet length");
+        return NGX_ERROR;
+    }
+
+    pkt->pn_pos = p;
+    pkt->len = p + varint - pkt->data;
+
+    return NGX_OK;
+}
+
+
+size_t
+ngx_quic_create_version_negotiation(ngx_quic_header_t *pkt, u_char *out)
+{
+    u_char  *p, *start;
+
+    p = start = out;
+
+    *p++ = NGX_QUIC_PKT_LONG | NGX_QUIC_PKT_FIXED_BIT;
+    p = ngx_quic_write_uint32(p, 0);
+
+    *p++ = pkt->scid.len;
+    p = ngx_cpymem(p, pkt->scid.data, pkt->scid.len);
+
+    *p++ = pkt->dcid.len;
+    p = ngx_cpymem(p, pkt->dcid.data, pkt->dcid.len);
+
+    p = ngx_quic_write_uint32(p, NGX_QUIC_VERSION);
+
+    return p - start;
+}
+
+
+size_t
+ngx_quic_create_header(ngx_quic_header_t *pkt, u_char *out,
+    size_t payload_len)
+{
+    u_char    *p, *start;
+    uint64_t   len;
+
+    p = start = out;
+
+    *p++ = pkt->flags;
+
+    if (ngx_quic_long_packet(&pkt->flags)) {
+        p = ngx_quic_write_uint32(p, NGX_QUIC_VERSION);
+
+        *p++ = pkt->dcid.len;
+        p = ngx_cpymem(p, pkt->dcid.data, pkt->dcid.len);
+
+        *p++ = pkt->scid.len;
+        p = ngx_cpymem(p, pkt->scid.data, pkt->scid.len);
+
+        if (ngx_quic_pkt_in(pkt->flags)) {
+            /* no tokens are issued */
+            *p++ = 0;
+        }
+
+        /* the length is always encoded in 2 bytes */
+
+        len = NGX_QUIC_PN_LEN + payload_len + NGX_QUIC_TAG_LEN;
+
+        *p++ = 0x40 | (u_char) (len >> 8);
+        *p++ = (u_char) len;
+
+    } else {
+        p = ngx_cpymem(p, pkt->dcid.data, pkt->dcid.len);
+    }
+
+    pkt->pn_pos = p;
+
+    p = ngx_quic_write_uint32(p, (uint32_t) pkt->pn);
+
+    return p - start;
+}
+
+
+ssize_t
+ngx_quic_parse_frame(ngx_quic_header_t *pkt, u_char *start, u_char *end,
+    ngx_quic_frame_t *f)
+{
+    u_char    *p;
+    uint64_t   varint;
+
+    p = start;
+
+    p = ngx_quic_parse_int(p, end, &varint);
+    if (p == NULL) {
+        pkt->error = NGX_QUIC_ERR_FRAME_ENCODING_ERROR;
+        ngx_log_error(NGX_LOG_INFO, pkt->log, 0,
+                      "quic failed to obtain quic frame type");
+        return NGX_ERROR;
+    }
+
+    if (varint > NGX_QUIC_FT_HANDSHAKE_DONE) {
+        pkt->error = NGX_QUIC_ERR_FRAME_ENCODING_ERROR;
+        ngx_log_error(NGX_LOG_INFO, pkt->log, 0,
+                      "quic unknown frame type 0x%xL", varint);
+        return NGX_ERROR;
+    }
+
+    f->type = varint;
+
+    if (ngx_quic_frame_allowed(pkt, f->type) != NGX_OK) {
+        pkt->error = NGX_QUIC_ERR_PROTOCOL_VIOLATION;
+        return NGX_ERROR;
+    }
+
+    switch (f->type) {
+
+    case NGX_QUIC_FT_PADDING:
+
+        /* allow only consequent PADDING frames */
+        while (p < end && *p == NGX_QUIC_FT_PADDING) {
+            p++;
+        }
+
+        break;
+
+    case NGX_QUIC_FT_PING:
+    case NGX_QUIC_FT_HANDSHAKE_DONE:
+        break;
+
+    case NGX_QUIC_FT_ACK:
+    case NGX_QUIC_FT_ACK_ECN:
+
+        if (!((p = ngx_quic_parse_int(p, end, &f->u.ack.largest))
+              && (p = ngx_quic_parse_int(p, end, &f->u.ack.delay))
+              && (p = ngx_quic_parse_int(p, end, &f->u.ack.range_count))
+              && (p = ngx_quic_parse_int(p, end, &f->u.ack.first_range))))
+        {
+            goto error;
+        }
+
+        f->u.ack.ranges_start = p;
+
+        for (varint = 0; varint < f->u.ack.range_count; varint++) {
+            uint64_t  gap, range;
+
+            p = ngx_quic_parse_int(p, end, &gap);
+            if (p == NULL) {
+                goto error;
+            }
+
+            p = ngx_quic_parse_int(p, end, &range);
+            if (p == NULL) {
+                goto error;
+            }
+        }
+
+        f->u.ack.ranges_end = p;
+
+        if (f->type == NGX_QUIC_FT_ACK_ECN) {
+            uint64_t  ect0, ect1, ce;
+
+            if (!((p = ngx_quic_parse_int(p, end, &ect0))
+                  && (p = ngx_quic_parse_int(p, end, &ect1))
+                  && (p = ngx_quic_parse_int(p, end, &ce))))
+            {
+                goto error;
+            }
+        }
+
+        break;
+
+    case NGX_QUIC_FT_RESET_STREAM:
+
+        if (!((p = ngx_quic_parse_int(p, end, &f->u.reset_stream.id))
+              && (p = ngx_quic_parse_int(p, end,
+                                         &f->u.reset_stream.error_code))
+              && (p = ngx_quic_parse_int(p, end,
+                                         &f->u.reset_stream.final_size))))
+        {
+            goto error;
+        }
+
+        break;
+
+    case NGX_QUIC_FT_STOP_SENDING:
+
+        if (!((p = ngx_quic_parse_int(p, end, &f->u.stop_sending.id))
+              && (p = ngx_quic_parse_int(p, end,
+                                         &f->u.stop_sending.error_code))))
+        {
+            goto error;
+        }
+
+        break;
+
+    case NGX_QUIC_FT_CRYPTO:
+
+        if (!((p = ngx_quic_parse_int(p, end, &f->u.crypto.offset))
+              && (p = ngx_quic_parse_int(p, end, &f->u.crypto.length))))
+        {
+            goto error;
+        }
+
+        p = ngx_quic_read_bytes(p, end, f->u.crypto.length, &f->data);
+        if (p == NULL) {
+            goto error;
+        }
+
+        break;
+
+    case NGX_QUIC_FT_NEW_TOKEN:
+
+        /* only a server can send the frame */
+        pkt->error = NGX_QUIC_ERR_PROTOCOL_VIOLATION;
+        return NGX_ERROR;
+
+    case NGX_QUIC_FT_MAX_DATA:
+
+        p = ngx_quic_parse_int(p, end, &f->u.max_data.max_data);
+        if (p == NULL) {
+            goto error;
+        }
+
+        break;
+
+    case NGX_QUIC_FT_MAX_STREAM_DATA:
+    case NGX_QUIC_FT_STREAM_DATA_BLOCKED:
+
+        if (!((p = ngx_quic_parse_int(p, end, &f->u.max_stream_data.id))
+              && (p = ngx_quic_parse_int(p, end,
+                                         &f->u.max_stream_data.limit))))
+        {
+            goto error;
+        }
+
+        break;
+
+    case NGX_QUIC_FT_MAX_STREAMS:
+    case NGX_QUIC_FT_MAX_STREAMS2:
+    case NGX_QUIC_FT_STREAMS_BLOCKED:
+    case NGX_QUIC_FT_STREAMS_BLOCKED2:
+
+        p = ngx_quic_parse_int(p, end, &f->u.max_streams.limit);
+        if (p == NULL) {
+            goto error;
+        }
+
+        f->u.max_streams.bidi = (f->type == NGX_QUIC_FT_MAX_STREAMS
+                                 || f->type == NGX_QUIC_FT_STREAMS_BLOCKED);
+
+        break;
+
+    case NGX_QUIC_FT_DATA_BLOCKED:
+
+        p = ngx_quic_parse_int(p, end, &varint);
+        if (p == NULL) {
+            goto error;
+        }
+
+        break;
+
+    case NGX_QUIC_FT_NEW_CONNECTION_ID:
+
+        if (!((p = ngx_quic_parse_int(p, end, &f->u.ncid.seqnum))
+              && (p = ngx_quic_parse_int(p, end, &f->u.ncid.retire))))
+        {
+            goto error;
+        }
+
+        if (f->u.ncid.retire > f->u.ncid.seqnum || p == end) {
+            goto error;
+        }
+
+        f->u.ncid.len = *p++;
+
+        if (f->u.ncid.len < 1 || f->u.ncid.len > NGX_QUIC_MAX_CID_LEN) {
+            goto error;
+        }
+
+        p = ngx_quic_copy_bytes(p, end, f->u.ncid.len, f->u.ncid.cid);
+        if (p == NULL) {
+            goto error;
+        }
+
+        p = ngx_quic_copy_bytes(p, end, 16, f->u.ncid.srt);
+        if (p == NULL) {
+            goto error;
+        }
+
+        break;
+
+    case NGX_QUIC_FT_RETIRE_CONNECTION_ID:
+
+        p = ngx_quic_parse_int(p, end, &f->u.retire_cid.sequence_number);
+        if (p == NULL) {
+            goto error;
+        }
+
+        break;
+
+    case NGX_QUIC_FT_PATH_CHALLENGE:
+    case NGX_QUIC_FT_PATH_RESPONSE:
+
+        p = ngx_quic_copy_bytes(p, end, 8, f->u.path_response.data);
+        if (p == NULL) {
+            goto error;
+        }
+
+        break;
+
+    case NGX_QUIC_FT_CONNECTION_CLOSE:
+    case NGX_QUIC_FT_CONNECTION_CLOSE_APP:
+
+        p = ngx_quic_parse_int(p, end, &f->u.close.error_code);
+        if (p == NULL) {
+            goto error;
+        }
+
+        if (f->type == NGX_QUIC_FT_CONNECTION_CLOSE) {
+            p = ngx_quic_parse_int(p, end, &f->u.close.frame_type);
+            if (p == NULL) {
+                goto error;
+            }
+        }
+
+        p = ngx_quic_parse_int(p, end, &varint);
+        if (p == NULL) {
+            goto error;
+        }
+
+        f->u.close.reason.len = varint;
+
+        p = ngx_quic_read_bytes(p, end, f->u.close.reason.len,
+                                &f->u.close.reason.data);
+        if (p == NULL) {
+            goto error;
+        }
+
+        break;
+
+    default: /* NGX_QUIC_FT_STREAM ... NGX_QUIC_FT_STREAM_LAST */
+
+        p = ngx_quic_parse_int(p, end, &f->u.stream.stream_id);
+        if (p == NULL) {
+            goto error;
+        }
+
+        if (f->type & NGX_QUIC_STREAM_FRAME_OFF) {
+            p = ngx_quic_parse_int(p, end, &f->u.stream.offset);
+            if (p == NULL) {
+                goto error;
+            }
+
+        } else {
+            f->u.stream.offset = 0;
+        }
+
+        if (f->type & NGX_QUIC_STREAM_FRAME_LEN) {
+            p = ngx_quic_parse_int(p, end, &f->u.stream.length);
+            if (p == NULL) {
+                goto error;
+            }
+
+        } else {
+            f->u.stream.length = end - p; /* up to packet end */
+        }
+
+        p = ngx_quic_read_bytes(p, end, f->u.stream.length, &f->data);
+        if (p == NULL) {
+            goto error;
+        }
+
+        f->u.stream.fin = (f->type & NGX_QUIC_STREAM_FRAME_FIN) ? 1 : 0;
+
+        if (f->u.stream.offset + f->u.stream.length > NGX_QUIC_MAX_INT) {
+            goto error;
+        }
+
+        f->type = NGX_QUIC_FT_STREAM;
+    }
+
+    f->level = pkt->level;
+
+    return p - start;
+
+error:
+
+    pkt->error = NGX_QUIC_ERR_FRAME_ENCODING_ERROR;
+
+    ngx_log_error(NGX_LOG_INFO, pkt->log, 0,
+                  "quic failed to parse frame type:0x%xi", f->type);
+
+    return NGX_ERROR;
+}
+
+
+static ngx_int_t
+ngx_quic_frame_allowed(ngx_quic_header_t *pkt, ngx_uint_t frame_type)
+{
+    /* 12.4. Frames and Frame Types, Table 3 */
+
+    if (pkt->level == NGX_QUIC_ENCRYPTION_APPLICATION) {
+        return NGX_OK;
+    }
+
+    switch (frame_type) {
+
+    case NGX_QUIC_FT_PADDING:
+    case NGX_QUIC_FT_PING:
+    case NGX_QUIC_FT_ACK:
+    case NGX_QUIC_FT_ACK_ECN:
+    case NGX_QUIC_FT_CRYPTO:
+    case NGX_QUIC_FT_CONNECTION_CLOSE:
+        return NGX_OK;
+    }
+
+    ngx_log_error(NGX_LOG_INFO, pkt->log, 0,
+                  "quic frame type 0x%xi is not allowed in packet "
+                  "with flags 0x%xd", frame_type, pkt->flags);
+
+    return NGX_DECLINED;
+}
+
+
+ssize_t
+ngx_quic_parse_ack_range(ngx_log_t *log, u_char *start, u_char *end,
+    uint64_t *gap, uint64_t *range)
+{
+    u_char  *p;
+
+    p = ngx_quic_parse_int(start, end, gap);
+    if (p == NULL) {
+        ngx_log_error(NGX_LOG_INFO, log, 0,
+                      "quic failed to parse ack frame gap");
+        return NGX_ERROR;
+    }
+
+    p = ngx_quic_parse_int(p, end, range);
+    if (p == NULL) {
+        ngx_log_error(NGX_LOG_INFO, log, 0,
+                      "quic failed to parse ack frame range");
+        return NGX_ERROR;
+    }
+
+    return p - start;
+}
+
+
+ssize_t
+ngx_quic_create_frame(u_char *p, ngx_quic_frame_t *f)
+{
+    /*
+     * the function is called with p == NULL to obtain the length
+     * of the frame as it will be written
+     */
+
+    switch (f->type) {
+
+    case NGX_QUIC_FT_PING:
+    case NGX_QUIC_FT_HANDSHAKE_DONE:
+
+        if (p) {
+            *p = (u_char) f->type;
+        }
+
+        return 1;
+
+    case NGX_QUIC_FT_ACK:
+        return ngx_quic_create_ack(p, &f->u.ack);
+
+    case NGX_QUIC_FT_CRYPTO:
+        return ngx_quic_create_crypto(p, f);
+
+    case NGX_QUIC_FT_STREAM:
+        return ngx_quic_create_stream(p, f);
+
+    case NGX_QUIC_FT_RESET_STREAM:
+        return ngx_quic_create_varints(p, f->type, 3,
+                                       f->u.reset_stream.id,
+                                       f->u.reset_stream.error_code,
+                                       f->u.reset_stream.final_size);
+
+    case NGX_QUIC_FT_STOP_SENDING:
+        return ngx_quic_create_varints(p, f->type, 2,
+                                       f->u.stop_sending.id,
+                                       f->u.stop_sending.error_code, 0);
+
+    case NGX_QUIC_FT_MAX_DATA:
+        return ngx_quic_create_varints(p, f->type, 1,
+                                       f->u.max_data.max_data, 0, 0);
+
+    case NGX_QUIC_FT_MAX_STREAM_DATA:
+        return ngx_quic_create_varints(p, f->type, 2,
+                                       f->u.max_stream_data.id,
+                                       f->u.max_stream_data.limit, 0);
+
+    case NGX_QUIC_FT_MAX_STREAMS:
+    case NGX_QUIC_FT_MAX_STREAMS2:
+        return ngx_quic_create_varints(p, f->type, 1,
+                                       f->u.max_streams.limit, 0, 0);
+
+    case NGX_QUIC_FT_RETIRE_CONNECTION_ID:
+        return ngx_quic_create_varints(p, f->type, 1,
+                                       f->u.retire_cid.sequence_number, 0, 0);
+
+    case NGX_QUIC_FT_NEW_CONNECTION_ID:
+        return ngx_quic_create_new_connection_id(p, &f->u.ncid);
+
+    case NGX_QUIC_FT_PATH_RESPONSE:
+
+        if (p) {
+            *p++ = (u_char) f->type;
+            ngx_memcpy(p, f->u.path_response.data, 8);
+        }
+
+        return 1 + 8;
+
+    case NGX_QUIC_FT_CONNECTION_CLOSE:
+    case NGX_QUIC_FT_CONNECTION_CLOSE_APP:
+        return ngx_quic_create_close(p, f);
+
+    default:
+        /* BUG: unsupported frame type generated */
+        return NGX_ERROR;
+    }
+}
+
+
+static size_t
+ngx_quic_create_ack(u_char *p, ngx_quic_ack_frame_t *ack)
+{
+    size_t   len, ranges_len;
+    u_char  *start;
+
+    ranges_len = ack->ranges_end - ack->ranges_start;
+
+    if (p == NULL) {
+        len = ngx_quic_varint_len(NGX_QUIC_FT_ACK);
+        len += ngx_quic_varint_len(ack->largest);
+        len += ngx_quic_varint_len(ack->delay);
+        len += ngx_quic_varint_len(ack->range_count);
+        len += ngx_quic_varint_len(ack->first_range);
+        len += ranges_len;
+
+        return len;
+    }
+
+    start = p;
+
+    ngx_quic_build_int(&p, NGX_QUIC_FT_ACK);
+    ngx_quic_build_int(&p, ack->largest);
+    ngx_quic_build_int(&p, ack->delay);
+    ngx_quic_build_int(&p, ack->range_count);
+    ngx_quic_build_int(&p, ack->first_range);
+
+    p = ngx_cpymem(p, ack->ranges_start, ranges_len);
+
+    return p - start;
+}
+
+
+static size_t
+ngx_quic_create_crypto(u_char *p, ngx_quic_frame_t *f)
+{
+    size_t   len;
+    u_char  *start;
+
+    if (p == NULL) {
+        len = ngx_quic_varint_len(NGX_QUIC_FT_CRYPTO);
+        len += ngx_quic_varint_len(f->u.crypto.offset);
+        len += ngx_quic_varint_len(f->u.crypto.length);
+        len += f->u.crypto.length;
+
+        return len;
+    }
+
+    start = p;
+
+    ngx_quic_build_int(&p, NGX_QUIC_FT_CRYPTO);
+    ngx_quic_build_int(&p, f->u.crypto.offset);
+    ngx_quic_build_int(&p, f->u.crypto.length);
+
+    p = ngx_cpymem(p, f->data, f->u.crypto.length);
+
+    return p - start;
+}
+
+
+static size_t
+ngx_quic_create_stream(u_char *p, ngx_quic_frame_t *f)
+{
+    size_t                    len;
+    u_char                   *start;
+    ngx_uint_t                type;
+    ngx_quic_stream_frame_t  *sf;
+
+    sf = &f->u.stream;
+
+    /* the length is always present, frames are not padded to packet end */
+
+    type = NGX_QUIC_FT_STREAM | NGX_QUIC_STREAM_FRAME_LEN;
+
+    if (sf->offset) {
+        type |= NGX_QUIC_STREAM_FRAME_OFF;
+    }
+
+    if (sf->fin) {
+        type |= NGX_QUIC_STREAM_FRAME_FIN;
+    }
+
+    if (p == NULL) {
+        len = ngx_quic_varint_len(type);
+        len += ngx_quic_varint_len(sf->stream_id);
+
+        if (sf->offset) {
+            len += ngx_quic_varint_len(sf->offset);
+        }
+
+        len += ngx_quic_varint_len(sf->length);
+        len += sf->length;
+
+        return len;
+    }
+
+    start = p;
+
+    ngx_quic_build_int(&p, type);
+    ngx_quic_build_int(&p, sf->stream_id);
+
+    if (sf->offset) {
+        ngx_quic_build_int(&p, sf->offset);
+    }
+
+    ngx_quic_build_int(&p, sf->length);
+
+    p = ngx_cpymem(p, f->data, sf->length);
+
+    return p - start;
+}
+
+
+static size_t
+ngx_quic_create_close(u_char *p, ngx_quic_frame_t *f)
+{
+    size_t                   len;
+    u_char                  *start;
+    ngx_quic_close_frame_t  *cl;
+
+    cl = &f->u.close;
+
+    if (p == NULL) {
+        len = ngx_quic_varint_len(f->type);
+        len += ngx_quic_varint_len(cl->error_code);
+
+        if (f->type == NGX_QUIC_FT_CONNECTION_CLOSE) {
+            len += ngx_quic_varint_len(cl->frame_type);
+        }
+
+        len += ngx_quic_varint_len(cl->reason.len);
+        len += cl->reason.len;
+
+        return len;
+    }
+
+    start = p;
+
+    ngx_quic_build_int(&p, f->type);
+    ngx_quic_build_int(&p, cl->error_code);
+
+    if (f->type == NGX_QUIC_FT_CONNECTION_CLOSE) {
+        ngx_quic_build_int(&p, cl->frame_type);
+    }
+
+    ngx_quic_build_int(&p, cl->reason.len);
+    p = ngx_cpymem(p, cl->reason.data, cl->reason.len);
+
+    return p - start;
+}
+
+
+static size_t
+ngx_quic_create_new_connection_id(u_char *p,
+    ngx_quic_new_conn_id_frame_t *ncid)
+{
+    size_t   len;
+    u_char  *start;
+
+    if (p == NULL) {
+        len = ngx_quic_varint_len(NGX_QUIC_FT_NEW_CONNECTION_ID);
+        len += ngx_quic_varint_len(ncid->seqnum);
+        len += ngx_quic_varint_len(ncid->retire);
+        len += 1 + ncid->len + 16;
+
+        return len;
+    }
+
+    start = p;
+
+    ngx_quic_build_int(&p, NGX_QUIC_FT_NEW_CONNECTION_ID);
+    ngx_quic_build_int(&p, ncid->seqnum);
+    ngx_quic_build_int(&p, ncid->retire);
+
+    *p++ = ncid->len;
+    p = ngx_cpymem(p, ncid->cid, ncid->len);
+    p = ngx_cpymem(p, ncid->srt, 16);
+
+    return p - start;
+}
+
+
+static size_t
+ngx_quic_create_varints(u_char *p, ngx_uint_t type, ngx_uint_t n,
+    uint64_t v1, uint64_t v2, uint64_t v3)
+{
+    size_t   len;
+    u_char  *start;
+
+    if (p == NULL) {
+        len = ngx_quic_varint_len(type) + ngx_quic_varint_len(v1);
+
+        if (n > 1) {
+            len += ngx_quic_varint_len(v2);
+        }
+
+        if (n > 2) {
+            len += ngx_quic_varint_len(v3);
+        }
+
+        return len;
+    }
+
+    start = p;
+
+    ngx_quic_build_int(&p, type);
+    ngx_quic_build_int(&p, v1);
+
+    if (n > 1) {
+        ngx_quic_build_int(&p, v2);
+    }
+
+    if (n > 2) {
+        ngx_quic_build_int(&p, v3);
+    }
+
+    return p - start;
+}
+
+
+ngx_int_t
+ngx_quic_parse_transport_params(u_char *p, u_char *end, ngx_quic_tp_t *tp,
+    ngx_log_t *log)
+{
+    u_char     *v;
+    uint64_t    id, len, varint;
+    ngx_str_t   str;
+
+    while (p < end) {
+        p = ngx_quic_parse_int(p, end, &id);
+        if (p == NULL) {
+            goto failed;
+        }
+
+        p = ngx_quic_parse_int(p, end, &len);
+        if (p == NULL || len > (uint64_t) (end - p)) {
+            goto failed;
+        }
+
+        v = p;
+        p += len;
+
+        switch (id) {
+
+        case NGX_QUIC_TP_ORIGINAL_DCID:
+        case NGX_QUIC_TP_PREFERRED_ADDRESS:
+        case NGX_QUIC_TP_RETRY_SCID:
+        case NGX_QUIC_TP_SR_TOKEN:
+            ngx_log_error(NGX_LOG_INFO, log, 0,
+                          "quic client sent forbidden transport param"
+                          " id:0x%xL", id);
+            return NGX_ERROR;
+
+        case NGX_QUIC_TP_DISABLE_ACTIVE_MIGRATION:
+            if (len != 0) {
+                goto failed;
+            }
+
+            tp->disable_active_migration = 1;
+            continue;
+
+        case NGX_QUIC_TP_INITIAL_SCID:
+            if (len > NGX_QUIC_MAX_CID_LEN) {
+                goto failed;
+            }
+
+            str.len = len;
+            str.data = v;
+
+            tp->initial_scid = str;
+            tp->initial_scid_set = 1;
+            continue;
+
+        case NGX_QUIC_TP_MAX_IDLE_TIMEOUT:
+        case NGX_QUIC_TP_MAX_UDP_PAYLOAD_SIZE:
+        case NGX_QUIC_TP_INITIAL_MAX_DATA:
+        case NGX_QUIC_TP_INITIAL_MAX_STREAM_DATA_BIDI_LOCAL:
+        case NGX_QUIC_TP_INITIAL_MAX_STREAM_DATA_BIDI_REMOTE:
+        case NGX_QUIC_TP_INITIAL_MAX_STREAM_DATA_UNI:
+        case NGX_QUIC_TP_INITIAL_MAX_STREAMS_BIDI:
+        case NGX_QUIC_TP_INITIAL_MAX_STREAMS_UNI:
+        case NGX_QUIC_TP_ACK_DELAY_EXPONENT:
+        case NGX_QUIC_TP_MAX_ACK_DELAY:
+        case NGX_QUIC_TP_ACTIVE_CONNECTION_ID_LIMIT:
+            break;
+
+        default:
+            /* unknown parameters are ignored */
+            continue;
+        }
+
+        if (ngx_quic_parse_int(v, p, &varint) != p) {
+            goto failed;
+        }
+
+        switch (id) {
+
+        case NGX_QUIC_TP_MAX_IDLE_TIMEOUT:
+            tp->max_idle_timeout = varint;
+            break;
+
+        case NGX_QUIC_TP_MAX_UDP_PAYLOAD_SIZE:
+            if (varint < NGX_QUIC_MIN_INITIAL_SIZE) {
+                goto failed;
+            }
+
+            tp->max_udp_payload_size = varint;
+            break;
+
+        case NGX_QUIC_TP_INITIAL_MAX_DATA:
+            tp->initial_max_data = varint;
+            break;
+
+        case NGX_QUIC_TP_INITIAL_MAX_STREAM_DATA_BIDI_LOCAL:
+            tp->initial_max_stream_data_bidi_local = varint;
+            break;
+
+        case NGX_QUIC_TP_INITIAL_MAX_STREAM_DATA_BIDI_REMOTE:
+            tp->initial_max_stream_data_bidi_remote = varint;
+            break;
+
+        case NGX_QUIC_TP_INITIAL_MAX_STREAM_DATA_UNI:
+            tp->initial_max_stream_data_uni = varint;
+            break;
+
+        case NGX_QUIC_TP_INITIAL_MAX_STREAMS_BIDI:
+            if (varint > (1ULL << 60)) {
+                goto failed;
+            }
+
+            tp->initial_max_streams_bidi = varint;
+            break;
+
+        case NGX_QUIC_TP_INITIAL_MAX_STREAMS_UNI:
+            if (varint > (1ULL << 60)) {
+                goto failed;
+            }
+
+            tp->initial_max_streams_uni = varint;
+            break;
+
+        case NGX_QUIC_TP_ACK_DELAY_EXPONENT:
+            if (varint > 20) {
+                goto failed;
+            }
+
+            tp->ack_delay_exponent = varint;
+            break;
+
+        case NGX_QUIC_TP_MAX_ACK_DELAY:
+            if (varint >= 16384) {
+                goto failed;
+            }
+
+            tp->max_ack_delay = varint;
+            break;
+
+        case NGX_QUIC_TP_ACTIVE_CONNECTION_ID_LIMIT:
+            if (varint < 2) {
+                goto failed;
+            }
+
+            tp->active_connection_id_limit = varint;
+            break;
+        }
+    }
+
+    return NGX_OK;
+
+failed:
+
+    ngx_log_error(NGX_LOG_INFO, log, 0,
+                  "quic failed to parse transport params");
+
+    return NGX_ERROR;
+}
+
+
+ssize_t
+ngx_quic_create_transport_params(u_char *pos, u_char *end, ngx_quic_tp_t *tp)
+{
+    u_char  *p;
+    size_t   len;
+
+    len = ngx_quic_tp_strlen(NGX_QUIC_TP_ORIGINAL_DCID, &tp->original_dcid);
+    len += ngx_quic_tp_strlen(NGX_QUIC_TP_INITIAL_SCID, &tp->initial_scid);
+    len += ngx_quic_tp_len(NGX_QUIC_TP_MAX_IDLE_TIMEOUT,
+                           tp->max_idle_timeout);
+    len += ngx_quic_tp_len(NGX_QUIC_TP_MAX_UDP_PAYLOAD_SIZE,
+                           tp->max_udp_payload_size);
+    len += ngx_quic_tp_len(NGX_QUIC_TP_INITIAL_MAX_DATA,
+                           tp->initial_max_data);
+    len += ngx_quic_tp_len(NGX_QUIC_TP_INITIAL_MAX_STREAM_DATA_BIDI_LOCAL,
+                           tp->initial_max_stream_data_bidi_local);
+    len += ngx_quic_tp_len(NGX_QUIC_TP_INITIAL_MAX_STREAM_DATA_BIDI_REMOTE,
+                           tp->initial_max_stream_data_bidi_remote);
+    len += ngx_quic_tp_len(NGX_QUIC_TP_INITIAL_MAX_STREAM_DATA_UNI,
+                           tp->initial_max_stream_data_uni);
+    len += ngx_quic_tp_len(NGX_QUIC_TP_INITIAL_MAX_STREAMS_BIDI,
+                           tp->initial_max_streams_bidi);
+    len += ngx_quic_tp_len(NGX_QUIC_TP_INITIAL_MAX_STREAMS_UNI,
+                           tp->initial_max_streams_uni);
+    len += ngx_quic_tp_len(NGX_QUIC_TP_ACTIVE_CONNECTION_ID_LIMIT,
+                           tp->active_connection_id_limit);
+
+    if (tp->disable_active_migration) {
+        len += ngx_quic_varint_len(NGX_QUIC_TP_DISABLE_ACTIVE_MIGRATION);
+        len += ngx_quic_varint_len(0);
+    }
+
+    if (pos == NULL) {
+        return len;
+    }
+
+    if ((size_t) (end - pos) < len) {
+        return NGX_ERROR;
+    }
+
+    p = pos;
+
+    ngx_quic_tp_write_str(&p, NGX_QUIC_TP_ORIGINAL_DCID, &tp->original_dcid);
+    ngx_quic_tp_write_str(&p, NGX_QUIC_TP_INITIAL_SCID, &tp->initial_scid);
+    ngx_quic_tp_write(&p, NGX_QUIC_TP_MAX_IDLE_TIMEOUT,
+                      tp->max_idle_timeout);
+    ngx_quic_tp_write(&p, NGX_QUIC_TP_MAX_UDP_PAYLOAD_SIZE,
+                      tp->max_udp_payload_size);
+    ngx_quic_tp_write(&p, NGX_QUIC_TP_INITIAL_MAX_DATA,
+                      tp->initial_max_data);
+    ngx_quic_tp_write(&p, NGX_QUIC_TP_INITIAL_MAX_STREAM_DATA_BIDI_LOCAL,
+                      tp->initial_max_stream_data_bidi_local);
+    ngx_quic_tp_write(&p, NGX_QUIC_TP_INITIAL_MAX_STREAM_DATA_BIDI_REMOTE,
+                      tp->initial_max_stream_data_bidi_remote);
+    ngx_quic_tp_write(&p, NGX_QUIC_TP_INITIAL_MAX_STREAM_DATA_UNI,
+                      tp->initial_max_stream_data_uni);
+    ngx_quic_tp_write(&p, NGX_QUIC_TP_INITIAL_MAX_STREAMS_BIDI,
+                      tp->initial_max_streams_bidi);
+    ngx_quic_tp_write(&p, NGX_QUIC_TP_INITIAL_MAX_STREAMS_UNI,
+                      tp->initial_max_streams_uni);
+    ngx_quic_tp_write(&p, NGX_QUIC_TP_ACTIVE_CONNECTION_ID_LIMIT,
+                      tp->active_connection_id_limit);
+
+    if (tp->disable_active_migration) {
+        ngx_quic_build_int(&p, NGX_QUIC_TP_DISABLE_ACTIVE_MIGRATION);
+        ngx_quic_build_int(&p, 0);
+    }
+
+    return p - pos;
+}
+
+
+static size_t
+ngx_quic_tp_len(uint16_t id, uint64_t value)
+{
+    size_t  len;
+
+    len = ngx_quic_varint_len(value);
+
+    return ngx_quic_varint_len(id) + ngx_quic_varint_len(len) + len;
+}
+
+
+static void
+ngx_quic_tp_write(u_char **pos, uint16_t id, uint64_t value)
+{
+    ngx_quic_build_int(pos, id);
+    ngx_quic_build_int(pos, ngx_quic_varint_len(value));
+    ngx_quic_build_int(pos, value);
+}
+
+
+static size_t
+ngx_quic_tp_strlen(uint16_t id, ngx_str_t *value)
+{
+    return ngx_quic_varint_len(id) + ngx_quic_varint_len(value->len)
+           + value->len;
+}
+
+
+static void
+ngx_quic_tp_write_str(u_char **pos, uint16_t id, ngx_str_t *value)
+{
+    ngx_quic_build_int(pos, id);
+    ngx_quic_build_int(pos, value->len);
+    *pos = ngx_cpymem(*pos, value->data, value->len);
+}
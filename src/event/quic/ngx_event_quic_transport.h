@@ -0,0 +1,309 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#ifndef _NGX_EVENT_QUIC_TRANSPORT_H_INCLUDED_
+#define _NGX_EVENT_QUIC_TRANSPORT_H_INCLUDED_
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+
+/* RFC 9000, 17.2. Long Header Packets and 17.3. Short Header Packets */
+
+#define NGX_QUIC_PKT_LONG                0x80
+#define NGX_QUIC_PKT_FIXED_BIT           0x40
+#define NGX_QUIC_PKT_TYPE                0x30
+#define NGX_QUIC_PKT_KPHASE              0x04
+
+#define NGX_QUIC_PKT_INITIAL             0x00
+#define NGX_QUIC_PKT_ZRTT                0x10
+#define NGX_QUIC_PKT_HANDSHAKE           0x20
+#define NGX_QUIC_PKT_RETRY               0x30
+
+#define NGX_QUIC_PKT_LONG_RESERVED_BIT   0x0c
+#define NGX_QUIC_PKT_SHORT_RESERVED_BIT  0x18
+
+#define ngx_quic_pkt_in(flags)                                               \
+    (((flags) & NGX_QUIC_PKT_TYPE) == NGX_QUIC_PKT_INITIAL)
+#define ngx_quic_pkt_zrtt(flags)                                             \
+    (((flags) & NGX_QUIC_PKT_TYPE) == NGX_QUIC_PKT_ZRTT)
+#define ngx_quic_pkt_hs(flags)                                               \
+    (((flags) & NGX_QUIC_PKT_TYPE) == NGX_QUIC_PKT_HANDSHAKE)
+#define ngx_quic_pkt_retry(flags)                                            \
+    (((flags) & NGX_QUIC_PKT_TYPE) == NGX_QUIC_PKT_RETRY)
+
+#define NGX_QUIC_VERSION                 0x00000001
+
+#define NGX_QUIC_MAX_CID_LEN             20
+#define NGX_QUIC_MIN_ODCID_LEN           8
+
+/* all packets are sent with 4 byte packet numbers */
+#define NGX_QUIC_PN_LEN                  4
+#define NGX_QUIC_TAG_LEN                 16
+
+/* encryption levels */
+#define NGX_QUIC_ENCRYPTION_INITIAL      0
+#define NGX_QUIC_ENCRYPTION_HANDSHAKE    1
+#define NGX_QUIC_ENCRYPTION_APPLICATION  2
+#define NGX_QUIC_ENCRYPTION_LAST         3
+
+/* 12.4. Frames and Frame Types */
+#define NGX_QUIC_FT_PADDING              0x00
+#define NGX_QUIC_FT_PING                 0x01
+#define NGX_QUIC_FT_ACK                  0x02
+#define NGX_QUIC_FT_ACK_ECN              0x03
+#define NGX_QUIC_FT_RESET_STREAM         0x04
+#define NGX_QUIC_FT_STOP_SENDING         0x05
+#define NGX_QUIC_FT_CRYPTO               0x06
+#define NGX_QUIC_FT_NEW_TOKEN            0x07
+#define NGX_QUIC_FT_STREAM               0x08
+#define NGX_QUIC_FT_STREAM_LAST          0x0f
+#define NGX_QUIC_FT_MAX_DATA             0x10
+#define NGX_QUIC_FT_MAX_STREAM_DATA      0x11
+#define NGX_QUIC_FT_MAX_STREAMS          0x12
+#define NGX_QUIC_FT_MAX_STREAMS2         0x13
+#define NGX_QUIC_FT_DATA_BLOCKED         0x14
+#define NGX_QUIC_FT_STREAM_DATA_BLOCKED  0x15
+#define NGX_QUIC_FT_STREAMS_BLOCKED      0x16
+#define NGX_QUIC_FT_STREAMS_BLOCKED2     0x17
+#define NGX_QUIC_FT_NEW_CONNECTION_ID    0x18
+#define NGX_QUIC_FT_RETIRE_CONNECTION_ID 0x19
+#define NGX_QUIC_FT_PATH_CHALLENGE       0x1a
+#define NGX_QUIC_FT_PATH_RESPONSE        0x1b
+#define NGX_QUIC_FT_CONNECTION_CLOSE     0x1c
+#define NGX_QUIC_FT_CONNECTION_CLOSE_APP 0x1d
+#define NGX_QUIC_FT_HANDSHAKE_DONE       0x1e
+
+#define NGX_QUIC_STREAM_FRAME_FIN        0x01
+#define NGX_QUIC_STREAM_FRAME_LEN        0x02
+#define NGX_QUIC_STREAM_FRAME_OFF        0x04
+
+/* 20.1. Transport Error Codes */
+#define NGX_QUIC_ERR_NO_ERROR                   0x00
+#define NGX_QUIC_ERR_INTERNAL_ERROR             0x01
+#define NGX_QUIC_ERR_CONNECTION_REFUSED         0x02
+#define NGX_QUIC_ERR_FLOW_CONTROL_ERROR         0x03
+#define NGX_QUIC_ERR_STREAM_LIMIT_ERROR         0x04
+#define NGX_QUIC_ERR_STREAM_STATE_ERROR         0x05
+#define NGX_QUIC_ERR_FINAL_SIZE_ERROR           0x06
+#define NGX_QUIC_ERR_FRAME_ENCODING_ERROR       0x07
+#define NGX_QUIC_ERR_TRANSPORT_PARAMETER_ERROR  0x08
+#define NGX_QUIC_ERR_CONNECTION_ID_LIMIT_ERROR  0x09
+#define NGX_QUIC_ERR_PROTOCOL_VIOLATION         0x0a
+#define NGX_QUIC_ERR_INVALID_TOKEN              0x0b
+#define NGX_QUIC_ERR_APPLICATION_ERROR          0x0c
+#define NGX_QUIC_ERR_CRYPTO_BUFFER_EXCEEDED     0x0d
+#define NGX_QUIC_ERR_KEY_UPDATE_ERROR           0x0e
+#define NGX_QUIC_ERR_AEAD_LIMIT_REACHED         0x0f
+#define NGX_QUIC_ERR_CRYPTO_ERROR               0x100
+
+#define NGX_QUIC_ERR_CRYPTO(e)  (NGX_QUIC_ERR_CRYPTO_ERROR + (e))
+
+/* 18.2. Transport Parameter Definitions */
+#define NGX_QUIC_TP_ORIGINAL_DCID                      0x00
+#define NGX_QUIC_TP_MAX_IDLE_TIMEOUT                   0x01
+#define NGX_QUIC_TP_SR_TOKEN                           0x02
+#define NGX_QUIC_TP_MAX_UDP_PAYLOAD_SIZE               0x03
+#define NGX_QUIC_TP_INITIAL_MAX_DATA                   0x04
+#define NGX_QUIC_TP_INITIAL_MAX_STREAM_DATA_BIDI_LOCAL 0x05
+#define NGX_QUIC_TP_INITIAL_MAX_STREAM_DATA_BIDI_REMOTE 0x06
+#define NGX_QUIC_TP_INITIAL_MAX_STREAM_DATA_UNI        0x07
+#define NGX_QUIC_TP_INITIAL_MAX_STREAMS_BIDI           0x08
+#define NGX_QUIC_TP_INITIAL_MAX_STREAMS_UNI            0x09
+#define NGX_QUIC_TP_ACK_DELAY_EXPONENT                 0x0a
+#define NGX_QUIC_TP_MAX_ACK_DELAY                      0x0b
+#define NGX_QUIC_TP_DISABLE_ACTIVE_MIGRATION           0x0c
+#define NGX_QUIC_TP_PREFERRED_ADDRESS                  0x0d
+#define NGX_QUIC_TP_ACTIVE_CONNECTION_ID_LIMIT         0x0e
+#define NGX_QUIC_TP_INITIAL_SCID                       0x0f
+#define NGX_QUIC_TP_RETRY_SCID                         0x10
+
+#define NGX_QUIC_MAX_INT                 0x3fffffffffffffff
+
+
+typedef struct {
+    uint64_t                    largest;
+    uint64_t                    delay;
+    uint64_t                    range_count;
+    uint64_t                    first_range;
+    u_char                     *ranges_start;
+    u_char                     *ranges_end;
+} ngx_quic_ack_frame_t;
+
+
+typedef struct {
+    uint64_t                    offset;
+    uint64_t                    length;
+} ngx_quic_crypto_frame_t;
+
+
+typedef struct {
+    uint64_t                    stream_id;
+    uint64_t                    offset;
+    uint64_t                    length;
+    unsigned                    fin:1;
+} ngx_quic_stream_frame_t;
+
+
+typedef struct {
+    uint64_t                    id;
+    uint64_t                    error_code;
+    uint64_t                    final_size;
+} ngx_quic_reset_stream_frame_t;
+
+
+typedef struct {
+    uint64_t                    id;
+    uint64_t                    error_code;
+} ngx_quic_stop_sending_frame_t;
+
+
+typedef struct {
+    uint64_t                    max_data;
+} ngx_quic_max_data_frame_t;
+
+
+typedef struct {
+    uint64_t                    id;
+    uint64_t                    limit;
+} ngx_quic_max_stream_data_frame_t;
+
+
+typedef struct {
+    uint64_t                    limit;
+    ngx_uint_t                  bidi;
+} ngx_quic_max_streams_frame_t;
+
+
+typedef struct {
+    uint64_t                    seqnum;
+    uint64_t                    retire;
+    uint8_t                     len;
+    u_char                      cid[NGX_QUIC_MAX_CID_LEN];
+    u_char                      srt[16];
+} ngx_quic_new_conn_id_frame_t;
+
+
+typedef struct {
+    uint64_t                    sequence_number;
+} ngx_quic_retire_cid_frame_t;
+
+
+typedef struct {
+    u_char                      data[8];
+} ngx_quic_path_challenge_frame_t;
+
+
+typedef struct {
+    uint64_t                    error_code;
+    uint64_t                    frame_type;
+    ngx_str_t                   reason;
+} ngx_quic_close_frame_t;
+
+
+typedef struct ngx_quic_frame_s  ngx_quic_frame_t;
+
+struct ngx_quic_frame_s {
+    ngx_uint_t                  type;
+    ngx_uint_t                  level;
+    ngx_queue_t                 queue;
+    uint64_t                    pnum;
+    size_t                      plen;      /* set in the first packet frame */
+    ngx_msec_t                  sent;
+    ssize_t                     len;
+
+    u_char                     *data;      /* CRYPTO and STREAM payload */
+
+    unsigned                    need_ack:1;
+    unsigned                    pkt_need_ack:1;
+
+    union {
+        ngx_quic_ack_frame_t              ack;
+        ngx_quic_crypto_frame_t           crypto;
+        ngx_quic_stream_frame_t           stream;
+        ngx_quic_reset_stream_frame_t     reset_stream;
+        ngx_quic_stop_sending_frame_t     stop_sending;
+        ngx_quic_max_data_frame_t         max_data;
+        ngx_quic_max_stream_data_frame_t  max_stream_data;
+        ngx_quic_max_streams_frame_t      max_streams;
+        ngx_quic_new_conn_id_frame_t      ncid;
+        ngx_quic_retire_cid_frame_t       retire_cid;
+        ngx_quic_path_challenge_frame_t   path_response;
+        ngx_quic_close_frame_t            close;
+    } u;
+};
+
+
+typedef struct {
+    ngx_log_t                  *log;
+
+    u_char                     *data;      /* start of the packet */
+    size_t                      len;       /* length of the packet */
+    u_char                     *raw_end;   /* end of the datagram */
+
+    uint8_t                     flags;
+    uint32_t                    version;
+    ngx_str_t                   dcid;
+    ngx_str_t                   scid;
+    ngx_str_t                   token;
+    ngx_uint_t                  level;
+
+    u_char                     *pn_pos;    /* offset of the packet number */
+    uint64_t                    pn;
+    ngx_str_t                   payload;   /* decrypted frames */
+
+    ngx_uint_t                  error;
+
+    unsigned                    need_ack:1;
+    unsigned                    key_phase:1;
+    unsigned                    key_update:1;
+} ngx_quic_header_t;
+
+
+typedef struct {
+    ngx_msec_t                  max_idle_timeout;
+    ngx_msec_t                  max_ack_delay;
+
+    size_t                      max_udp_payload_size;
+    uint64_t                    initial_max_data;
+    uint64_t                    initial_max_stream_data_bidi_local;
+    uint64_t                    initial_max_stream_data_bidi_remote;
+    uint64_t                    initial_max_stream_data_uni;
+    uint64_t                    initial_max_streams_bidi;
+    uint64_t                    initial_max_streams_uni;
+    ngx_uint_t                  ack_delay_exponent;
+    ngx_uint_t                  active_connection_id_limit;
+    ngx_flag_t                  disable_active_migration;
+
+    ngx_str_t                   original_dcid;
+    ngx_str_t                   initial_scid;
+    ngx_uint_t                  initial_scid_set;    /* unsigned  :1; */
+} ngx_quic_tp_t;
+
+
+u_char *ngx_quic_parse_int(u_char *pos, u_char *end, uint64_t *out);
+void ngx_quic_build_int(u_char **pos, uint64_t value);
+ngx_uint_t ngx_quic_varint_len(uint64_t value);
+
+ngx_int_t ngx_quic_parse_packet(ngx_quic_header_t *pkt);
+size_t ngx_quic_create_version_negotiation(ngx_quic_header_t *pkt,
+    u_char *out);
+size_t ngx_quic_create_header(ngx_quic_header_t *pkt, u_char *out,
+    size_t payload_len);
+
+ssize_t ngx_quic_parse_frame(ngx_quic_header_t *pkt, u_char *start,
+    u_char *end, ngx_quic_frame_t *frame);
+ssize_t ngx_quic_create_frame(u_char *p, ngx_quic_frame_t *f);
+ssize_t ngx_quic_parse_ack_range(ngx_log_t *log, u_char *start, u_char *end,
+    uint64_t *gap, uint64_t *range);
+
+ngx_int_t ngx_quic_parse_transport_params(u_char *p, u_char *end,
+    ngx_quic_tp_t *tp, ngx_log_t *log);
+ssize_t ngx_quic_create_transport_params(u_char *p, u_char *end,
+    ngx_quic_tp_t *tp);
+
+#endif /* _NGX_EVENT_QUIC_TRANSPORT_H_INCLUDED_ */
@@ -0,0 +1,2098 @@
+
+/*
+ * Copyright (C) Igor Sysoev
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include <nginx.h>
+
+
+/*
+ * Each worker owns a cache line aligned slot of plain 64-bit counters
+ * in a shared memory zone and updates it without atomic operations;
+ * the status handler sums all slots on read.  A slot is owned by the
+ * process which claimed it until the master process reaps it, so
+ * workers of older generations keep their slots while shutting down.
+ * A worker claiming a released slot folds it into the accumulated
+ * totals first, so counters survive reloads as long as the set of
+ * zones, upstream peers and caches does not change.
+ */
+
+
+#define NGX_HTTP_EXTENDED_STATUS_REQUESTS    0
+#define NGX_HTTP_EXTENDED_STATUS_RESPONSES   1
+#define NGX_HTTP_EXTENDED_STATUS_RECEIVED    6
+#define NGX_HTTP_EXTENDED_STATUS_SENT        7
+#define NGX_HTTP_EXTENDED_STATUS_TIME        8
+#define NGX_HTTP_EXTENDED_STATUS_BUCKETS     9
+
+/* request time buckets: 1ms, 2ms, ... 16384ms, +Inf */
+#define NGX_HTTP_EXTENDED_STATUS_NBUCKETS    16
+
+#define NGX_HTTP_EXTENDED_STATUS_COUNTERS                                     \
+    (NGX_HTTP_EXTENDED_STATUS_BUCKETS + NGX_HTTP_EXTENDED_STATUS_NBUCKETS)
+
+#if (NGX_HTTP_CACHE)
+/* indexed by cache status - 1, from NGX_HTTP_CACHE_MISS to _HIT */
+#define NGX_HTTP_EXTENDED_STATUS_CACHE_COUNTERS  NGX_HTTP_CACHE_HIT
+#endif
+
+/* slots per worker, for workers of older generations still running */
+#define NGX_HTTP_EXTENDED_STATUS_GENERATIONS  4
+
+#define NGX_HTTP_EXTENDED_STATUS_JSON        1
+#define NGX_HTTP_EXTENDED_STATUS_PROMETHEUS  2
+
+
+typedef struct {
+    ngx_atomic_t                     pid;
+    uint32_t                         signature;
+} ngx_http_extended_status_slot_t;
+
+
+typedef struct {
+    ngx_uint_t                       generation;
+    uint32_t                         accum_signature;
+    ngx_uint_t                       nslots;
+    size_t                           slot_size;
+    ngx_http_extended_status_slot_t *slots;
+    uint64_t                        *area;
+} ngx_http_extended_status_sh_t;
+
+
+typedef struct {
+    ngx_http_upstream_srv_conf_t    *uscf;
+    ngx_uint_t                       peer;
+    ngx_uint_t                       npeers;
+    ngx_str_t                       *names;
+    ngx_uint_t                      *backup;
+    ngx_http_upstream_rr_peer_t    **peerp;
+} ngx_http_extended_status_upstream_t;
+
+
+/* peer counters by the address of the peer name, see u->state->peer */
+
+typedef struct {
+    ngx_str_t                       *name;
+    ngx_uint_t                       counters;
+} ngx_http_extended_status_index_t;
+
+
+typedef struct {
+    ngx_array_t                      server_zones;   /* ngx_str_t */
+    ngx_array_t                      location_zones; /* ngx_str_t */
+    ngx_array_t                      upstreams;
+                                     /* ngx_http_extended_status_upstream_t */
+    ngx_array_t                      caches;   /* ngx_http_file_cache_t * */
+
+    ngx_uint_t                       npeers;
+    ngx_uint_t                       ncounters;
+    ngx_uint_t                       nworkers;
+    ngx_uint_t                       nslots;
+    size_t                           slot_size;
+    uint32_t                         signature;
+
+    ngx_uint_t                       enabled;     /* unsigned  enabled:1; */
+
+    ngx_shm_zone_t                  *shm_zone;
+    ngx_slab_pool_t                 *shpool;
+    ngx_http_extended_status_sh_t   *sh;
+    uint64_t                        *slot;
+
+    ngx_http_extended_status_index_t  *index;
+    ngx_uint_t                       index_mask;
+} ngx_http_extended_status_main_conf_t;
+
+
+typedef struct {
+    ngx_uint_t                       zone;
+} ngx_http_extended_status_srv_conf_t;
+
+
+typedef struct {
+    ngx_uint_t                       zone;
+    ngx_uint_t                       format;
+} ngx_http_extended_status_loc_conf_t;
+
+
+typedef struct {
+    ngx_str_t                        label;
+    uint64_t                        *counters;
+} ngx_http_extended_status_entry_t;
+
+
+static ngx_int_t ngx_http_extended_status_handler(ngx_http_request_t *r);
+static ngx_int_t ngx_http_extended_status_log_handler(ngx_http_request_t *r);
+static void ngx_http_extended_status_count(uint64_t *c, ngx_uint_t status,
+    off_t received, off_t sent, ngx_msec_int_t ms);
+static void ngx_http_extended_status_aggregate(
+    ngx_http_extended_status_main_conf_t *smcf, uint64_t *total);
+static ngx_int_t ngx_http_extended_status_peer(
+    ngx_http_extended_status_main_conf_t *smcf, ngx_str_t *name);
+static u_char *ngx_http_extended_status_json(ngx_http_request_t *r,
+    u_char *p, uint64_t *total);
+static u_char *ngx_http_extended_status_json_counters(u_char *p,
+    uint64_t *c, char *time);
+static u_char *ngx_http_extended_status_json_worker(u_char *p);
+#if (NGX_THREADS)
+static u_char *ngx_http_extended_status_json_histogram(u_char *p, char *name,
+    uint64_t sum, ngx_uint_t *buckets);
+#endif
+static u_char *ngx_http_extended_status_prometheus(ngx_http_request_t *r,
+    u_char *p, uint64_t *total);
+static u_char *ngx_http_extended_status_prometheus_counters(u_char *p,
+    char *prefix, char *time, ngx_http_extended_status_entry_t *entries,
+    ngx_uint_t n);
+static u_char *ngx_http_extended_status_prometheus_worker(u_char *p);
+#if (NGX_THREADS)
+static u_char *ngx_http_extended_status_prometheus_histogram(u_char *p,
+    char *name, ngx_str_t *pool, ngx_uint_t type, uint64_t sum,
+    ngx_uint_t *buckets);
+#endif
+static ngx_int_t ngx_http_extended_status_init_zone(ngx_shm_zone_t *shm_zone,
+    void *data);
+static void ngx_http_extended_status_reap(ngx_shm_zone_t *shm_zone,
+    ngx_pid_t pid);
+static uint32_t ngx_http_extended_status_signature(
+    ngx_http_extended_status_main_conf_t *smcf);
+
+static void *ngx_http_extended_status_create_main_conf(ngx_conf_t *cf);
+static void *ngx_http_extended_status_create_srv_conf(ngx_conf_t *cf);
+static char *ngx_http_extended_status_merge_srv_conf(ngx_conf_t *cf,
+    void *parent, void *child);
+static void *ngx_http_extended_status_create_loc_conf(ngx_conf_t *cf);
+static char *ngx_http_extended_status_merge_loc_conf(ngx_conf_t *cf,
+    void *parent, void *child);
+static char *ngx_http_extended_status_zone(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static char *ngx_http_extended_status(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static ngx_int_t ngx_http_extended_status_init(ngx_conf_t *cf);
+static ngx_int_t ngx_http_extended_status_init_process(ngx_cycle_t *cycle);
+static ngx_int_t ngx_http_extended_status_init_index(ngx_cycle_t *cycle,
+    ngx_http_extended_status_main_conf_t *smcf);
+
+
+static ngx_command_t  ngx_http_extended_status_commands[] = {
+
+    { ngx_string("status_zone"),
+      NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_extended_status_zone,
+      0,
+      0,
+      NULL },
+
+    { ngx_string("extended_status"),
+      NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_NOARGS|NGX_CONF_TAKE1,
+      ngx_http_extended_status,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_http_module_t  ngx_http_extended_status_module_ctx = {
+    NULL,                                  /* preconfiguration */
+    ngx_http_extended_status_init,         /* postconfiguration */
+
+    ngx_http_extended_status_create_main_conf, /* create main configuration */
+    NULL,                                  /* init main configuration */
+
+    ngx_http_extended_status_create_srv_conf, /* create server configuration */
+    ngx_http_extended_status_merge_srv_conf, /* merge server configuration */
+
+    ngx_http_extended_status_create_loc_conf, /* create location configuration */
+    ngx_http_extended_status_merge_loc_conf /* merge location configuration */
+};
+
+
+ngx_module_t  ngx_http_extended_status_module = {
+    NGX_MODULE_V1,
+    &ngx_http_extended_status_module_ctx,  /* module context */
+    ngx_http_extended_status_commands,     /* module directives */
+    NGX_HTTP_MODULE,                       /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    ngx_http_extended_status_init_process, /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+#if (NGX_HTTP_CACHE)
+
+static char  *ngx_http_extended_status_cache_names[] = {
+    "miss", "bypass", "expired", "stale", "updating", "revalidated", "hit"
+};
+
+#endif
+
+
+static char  *ngx_http_extended_status_pool_cache_names[] = {
+    "hits", "misses", "releases"
+};
+
+
+static ngx_int_t
+ngx_http_extended_status_handler(ngx_http_request_t *r)
+{
+    size_t                                 size;
+    ngx_int_t                              rc;
+    ngx_str_t                              value;
+    ngx_buf_t                             *b;
+    ngx_uint_t                             format, i;
+    ngx_chain_t                            out;
+    ngx_http_extended_status_loc_conf_t   *slcf;
+#if (NGX_HTTP_CACHE)
+    ngx_http_file_cache_t                **caches;
+#endif
+#if (NGX_THREADS)
+    ngx_thread_pool_t                     *tp;
+#endif
+    ngx_http_extended_status_upstream_t   *up;
+    ngx_http_extended_status_main_conf_t  *smcf;
+    uint64_t                              *total;
+
+    if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
+
+    rc = ngx_http_discard_request_body(r);
+
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    smcf = ngx_http_get_module_main_conf(r, ngx_http_extended_status_module);
+    slcf = ngx_http_get_module_loc_conf(r, ngx_http_extended_status_module);
+
+    format = slcf->format;
+
+    if (ngx_http_arg(r, (u_char *) "format", 6, &value) == NGX_OK) {
+
+        if (value.len == 4 && ngx_strncmp(value.data, "json", 4) == 0) {
+            format = NGX_HTTP_EXTENDED_STATUS_JSON;
+
+        } else if (value.len == 10
+                   && ngx_strncmp(value.data, "prometheus", 10) == 0)
+        {
+            format = NGX_HTTP_EXTENDED_STATUS_PROMETHEUS;
+        }
+    }
+
+    total = ngx_pcalloc(r->pool, (smcf->ncounters + 1) * sizeof(uint64_t));
+    if (total == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    ngx_http_extended_status_aggregate(smcf, total);
+
+    /*
+     * a generous estimate: every counters block is printed with
+     * at most 32 lines, each with a label and a 20-digit number
+     */
+
+    size = 1024 + NGX_POOL_CACHE_CLASSES * 4 * 128;
+
+    for (i = 0; i < smcf->server_zones.nelts; i++) {
+        size += 32 * (128 + 2 * ((ngx_str_t *) smcf->server_zones.elts)[i].len);
+    }
+
+    for (i = 0; i < smcf->location_zones.nelts; i++) {
+        size += 32
+                * (128 + 2 * ((ngx_str_t *) smcf->location_zones.elts)[i].len);
+    }
+
+    up = smcf->upstreams.elts;
+
+    for (i = 0; i < smcf->upstreams.nelts; i++) {
+        size += up[i].npeers * 32
+                * (256 + 2 * up[i].uscf->host.len + 2 * NGX_SOCKADDR_STRLEN);
+    }
+
+#if (NGX_HTTP_CACHE)
+
+    caches = smcf->caches.elts;
+
+    for (i = 0; i < smcf->caches.nelts; i++) {
+        size += 16 * (128 + 2 * caches[i]->shm_zone->shm.name.len);
+    }
+
+#endif
+
+#if (NGX_THREADS)
+
+    for (i = 0; /* void */ ; i++) {
+        tp = ngx_thread_pool_get_indexed((ngx_cycle_t *) ngx_cycle, i);
+
+        if (tp == NULL) {
+            break;
+        }
+
+        size += (2 * NGX_THREAD_POOL_HIST_LEN + 16)
+                * (128 + 2 * ngx_thread_pool_name(tp)->len);
+    }
+
+#endif
+
+    b = ngx_create_temp_buf(r->pool, size);
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if (format == NGX_HTTP_EXTENDED_STATUS_PROMETHEUS) {
+        ngx_str_set(&r->headers_out.content_type, "text/plain; version=0.0.4");
+        b->last = ngx_http_extended_status_prometheus(r, b->last, total);
+
+    } else {
+        ngx_str_set(&r->headers_out.content_type, "application/json");
+        b->last = ngx_http_extended_status_json(r, b->last, total);
+    }
+
+    if (b->last == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    r->headers_out.content_type_len = r->headers_out.content_type.len;
+    r->headers_out.content_type_lowcase = NULL;
+
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = b->last - b->pos;
+
+    b->last_buf = (r == r->main) ? 1 : 0;
+    b->last_in_chain = 1;
+
+    out.buf = b;
+    out.next = NULL;
+
+    rc = ngx_http_send_header(r);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    return ngx_http_output_filter(r, &out);
+}
+
+
+static ngx_int_t
+ngx_http_extended_status_log_handler(ngx_http_request_t *r)
+{
+    uint64_t                              *slot, *c;
+    ngx_int_t                              k;
+    ngx_uint_t                             i, n, status;
+    ngx_time_t                            *tp;
+    ngx_msec_int_t                         ms;
+#if (NGX_HTTP_CACHE)
+    ngx_http_cache_t                      *cache;
+    ngx_http_file_cache_t                **caches;
+#endif
+    ngx_http_upstream_t                   *u;
+    ngx_http_upstream_state_t             *state;
+    ngx_http_extended_status_srv_conf_t   *sscf;
+    ngx_http_extended_status_loc_conf_t   *slcf;
+    ngx_http_extended_status_main_conf_t  *smcf;
+
+    smcf = ngx_http_get_module_main_conf(r, ngx_http_extended_status_module);
+
+    slot = smcf->slot;
+
+    if (slot == NULL) {
+        return NGX_OK;
+    }
+
+    if (r->err_status) {
+        status = r->err_status;
+
+    } else {
+        status = r->headers_out.status;
+    }
+
+    tp = ngx_timeofday();
+
+    ms = (ngx_msec_int_t)
+             ((tp->sec - r->start_sec) * 1000 + (tp->msec - r->start_msec));
+    ms = ngx_max(ms, 0);
+
+    sscf = ngx_http_get_module_srv_conf(r, ngx_http_extended_status_module);
+
+    if (sscf->zone != NGX_CONF_UNSET_UINT) {
+        c = slot + sscf->zone * NGX_HTTP_EXTENDED_STATUS_COUNTERS;
+        ngx_http_extended_status_count(c, status, r->request_length,
+                                       r->connection->sent, ms);
+    }
+
+    slcf = ngx_http_get_module_loc_conf(r, ngx_http_extended_status_module);
+
+    if (slcf->zone != NGX_CONF_UNSET_UINT) {
+        c = slot + (smcf->server_zones.nelts + slcf->zone)
+                   * NGX_HTTP_EXTENDED_STATUS_COUNTERS;
+        ngx_http_extended_status_count(c, status, r->request_length,
+                                       r->connection->sent, ms);
+    }
+
+    u = r->upstream;
+
+    if (u == NULL) {
+        return NGX_OK;
+    }
+
+    if (u->upstream && r->upstream_states && smcf->index) {
+
+        state = r->upstream_states->elts;
+        n = r->upstream_states->nelts;
+
+        c = slot + (smcf->server_zones.nelts + smcf->location_zones.nelts)
+                   * NGX_HTTP_EXTENDED_STATUS_COUNTERS;
+
+        for (i = 0; i < n; i++) {
+            if (state[i].peer == NULL) {
+                continue;
+            }
+
+            k = ngx_http_extended_status_peer(smcf, state[i].peer);
+
+            if (k == NGX_DECLINED) {
+                continue;
+            }
+
+            if (state[i].response_time == (ngx_msec_t) -1) {
+                ms = -1;
+
+            } else {
+                ms = (ngx_msec_int_t) state[i].response_time;
+            }
+
+            ngx_http_extended_status_count(
+                                c + k * NGX_HTTP_EXTENDED_STATUS_COUNTERS,
+                                state[i].status, state[i].bytes_received,
+                                state[i].bytes_sent, ms);
+        }
+    }
+
+#if (NGX_HTTP_CACHE)
+
+    cache = r->cache;
+
+    if (cache && cache->file_cache
+        && u->cache_status >= NGX_HTTP_CACHE_MISS
+        && u->cache_status <= NGX_HTTP_CACHE_HIT)
+    {
+        caches = smcf->caches.elts;
+
+        for (i = 0; i < smcf->caches.nelts; i++) {
+            if (caches[i] == cache->file_cache) {
+                c = slot + smcf->ncounters
+                    - (smcf->caches.nelts - i)
+                      * NGX_HTTP_EXTENDED_STATUS_CACHE_COUNTERS;
+                c[u->cache_status - 1]++;
+                break;
+            }
+        }
+    }
+
+#endif
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_extended_status_count(uint64_t *c, ngx_uint_t status,
+    off_t received, off_t sent, ngx_msec_int_t ms)
+{
+    ngx_uint_t  i;
+
+    c[NGX_HTTP_EXTENDED_STATUS_REQUESTS]++;
+
+    if (status >= 100 && status < 600) {
+        c[NGX_HTTP_EXTENDED_STATUS_RESPONSES + status / 100 - 1]++;
+    }
+
+    c[NGX_HTTP_EXTENDED_STATUS_RECEIVED] += received;
+    c[NGX_HTTP_EXTENDED_STATUS_SENT] += sent;
+
+    if (ms < 0) {
+        return;
+    }
+
+    c[NGX_HTTP_EXTENDED_STATUS_TIME] += ms;
+
+    for (i = 0; i < NGX_HTTP_EXTENDED_STATUS_NBUCKETS - 1; i++) {
+        if (ms <= (1 << i)) {
+            break;
+        }
+    }
+
+    c[NGX_HTTP_EXTENDED_STATUS_BUCKETS + i]++;
+}
+
+
+static void
+ngx_http_extended_status_aggregate(ngx_http_extended_status_main_conf_t *smcf,
+    uint64_t *total)
+{
+    uint64_t                       *c;
+    ngx_uint_t                      i, k, n;
+    ngx_http_extended_status_sh_t  *sh;
+
+    sh = smcf->sh;
+
+    if (sh == NULL) {
+        return;
+    }
+
+    n = smcf->ncounters;
+
+    /* slots being claimed are folded and cleared under the mutex */
+
+    ngx_shmtx_lock(&smcf->shpool->mutex);
+
+    if (sh->accum_signature == smcf->signature) {
+        for (k = 0; k < n; k++) {
+            total[k] = sh->area[k];
+        }
+    }
+
+    for (i = 0; i < smcf->nslots; i++) {
+
+        if (sh->slots[i].signature != smcf->signature) {
+            continue;
+        }
+
+        c = (uint64_t *) ((u_char *) sh->area + (1 + i) * smcf->slot_size);
+
+        for (k = 0; k < n; k++) {
+            total[k] += c[k];
+        }
+    }
+
+    ngx_shmtx_unlock(&smcf->shpool->mutex);
+}
+
+
+static ngx_int_t
+ngx_http_extended_status_peer(ngx_http_extended_status_main_conf_t *smcf,
+    ngx_str_t *name)
+{
+    ngx_uint_t                         h;
+    ngx_http_extended_status_index_t  *index;
+
+    index = smcf->index;
+
+    for (h = ((uintptr_t) name >> 3) & smcf->index_mask;
+         index[h].name;
+         h = (h + 1) & smcf->index_mask)
+    {
+        if (index[h].name == name) {
+            return index[h].counters;
+        }
+    }
+
+    return NGX_DECLINED;
+}
+
+
+static u_char *
+ngx_http_extended_status_json(ngx_http_request_t *r, u_char *p,
+    uint64_t *total)
+{
+    uint64_t                              *c;
+    ngx_str_t                             *name;
+    ngx_uint_t                             i, k, n;
+#if (NGX_HTTP_CACHE)
+    ngx_http_file_cache_t                **caches;
+#endif
+    ngx_http_upstream_rr_peer_t           *peer;
+#if (NGX_HTTP_UPSTREAM_ZONE)
+    ngx_http_upstream_rr_peers_t          *peers;
+#endif
+    ngx_http_extended_status_upstream_t   *up;
+    ngx_http_extended_status_main_conf_t  *smcf;
+
+    smcf = ngx_http_get_module_main_conf(r, ngx_http_extended_status_module);
+
+    p = ngx_sprintf(p, "{\"version\":\"" NGINX_VERSION "\","
+                       "\"generation\":%ui,\"pid\":%P,\"workers\":%ui,",
+                    smcf->sh ? smcf->sh->generation : 0, ngx_pid,
+                    smcf->nworkers);
+
+#if (NGX_STAT_STUB)
+
+    p = ngx_sprintf(p, "\"connections\":{\"accepted\":%uA,\"handled\":%uA,"
+                       "\"active\":%uA,\"reading\":%uA,\"writing\":%uA,"
+                       "\"waiting\":%uA},\"requests\":{\"total\":%uA},",
+                    *ngx_stat_accepted, *ngx_stat_handled, *ngx_stat_active,
+                    *ngx_stat_reading, *ngx_stat_writing, *ngx_stat_waiting,
+                    *ngx_stat_requests);
+
+#endif
+
+    c = total;
+
+    p = ngx_cpymem(p, "\"server_zones\":{", sizeof("\"server_zones\":{") - 1);
+
+    name = smcf->server_zones.elts;
+
+    for (i = 0; i < smcf->server_zones.nelts; i++) {
+        if (i) {
+            *p++ = ',';
+        }
+
+        *p++ = '"';
+        p = (u_char *) ngx_escape_json(p, name[i].data, name[i].len);
+        p = ngx_cpymem(p, "\":{", 3);
+        p = ngx_http_extended_status_json_counters(p, c, "request_time");
+        *p++ = '}';
+
+        c += NGX_HTTP_EXTENDED_STATUS_COUNTERS;
+    }
+
+    p = ngx_cpymem(p, "},\"location_zones\":{",
+                   sizeof("},\"location_zones\":{") - 1);
+
+    name = smcf->location_zones.elts;
+
+    for (i = 0; i < smcf->location_zones.nelts; i++) {
+        if (i) {
+            *p++ = ',';
+        }
+
+        *p++ = '"';
+        p = (u_char *) ngx_escape_json(p, name[i].data, name[i].len);
+        p = ngx_cpymem(p, "\":{", 3);
+        p = ngx_http_extended_status_json_counters(p, c, "request_time");
+        *p++ = '}';
+
+        c += NGX_HTTP_EXTENDED_STATUS_COUNTERS;
+    }
+
+    p = ngx_cpymem(p, "},\"upstreams\":{", sizeof("},\"upstreams\":{") - 1);
+
+    up = smcf->upstreams.elts;
+
+    for (i = 0; i < smcf->upstreams.nelts; i++) {
+        if (i) {
+            *p++ = ',';
+        }
+
+        *p++ = '"';
+        p = (u_char *) ngx_escape_json(p, up[i].uscf->host.data,
+                                       up[i].uscf->host.len);
+        p = ngx_cpymem(p, "\":{\"peers\":[", sizeof("\":{\"peers\":[") - 1);
+
+#if (NGX_HTTP_UPSTREAM_ZONE)
+        peers = up[i].uscf->peer.data;
+
+        ngx_http_upstream_rr_peers_rlock(peers);
+#endif
+
+        for (k = 0; k < up[i].npeers; k++) {
+            if (k) {
+                *p++ = ',';
+            }
+
+            n = up[i].peer + k;
+
+            p = ngx_cpymem(p, "{\"server\":\"", sizeof("{\"server\":\"") - 1);
+            p = (u_char *) ngx_escape_json(p, up[i].names[k].data,
+                                           up[i].names[k].len);
+            p = ngx_sprintf(p, "\",\"backup\":%s,",
+                            up[i].backup[k] ? "true" : "false");
+
+            peer = up[i].peerp ? up[i].peerp[k] : NULL;
+
+            if (peer) {
+                p = ngx_sprintf(p, "\"weight\":%i,\"state\":\"%s\","
+                                   "\"active\":%ui,\"fails\":%ui,",
+                                peer->weight,
+                                (peer->down
+                                 & NGX_HTTP_UPSTREAM_PEER_UNHEALTHY)
+                                ? "unhealthy"
+                                : peer->down ? "down"
+                                : (peer->max_fails
+                                   && peer->fails >= peer->max_fails)
+                                  ? "unavail" : "up",
+                                peer->conns, peer->fails);
+            }
+
+            p = ngx_http_extended_status_json_counters(p,
+                        c + n * NGX_HTTP_EXTENDED_STATUS_COUNTERS,
+                        "response_time");
+            *p++ = '}';
+        }
+
+#if (NGX_HTTP_UPSTREAM_ZONE)
+        ngx_http_upstream_rr_peers_unlock(peers);
+#endif
+
+        p = ngx_cpymem(p, "]}", 2);
+    }
+
+    p = ngx_cpymem(p, "},\"caches\":{", sizeof("},\"caches\":{") - 1);
+
+#if (NGX_HTTP_CACHE)
+
+    c += smcf->npeers * NGX_HTTP_EXTENDED_STATUS_COUNTERS;
+
+    caches = smcf->caches.elts;
+
+    for (i = 0; i < smcf->caches.nelts; i++) {
+        if (i) {
+            *p++ = ',';
+        }
+
+        name = &caches[i]->shm_zone->shm.name;
+
+        *p++ = '"';
+        p = (u_char *) ngx_escape_json(p, name->data, name->len);
+        *p++ = '"';
+        *p++ = ':';
+        *p++ = '{';
+
+        if (caches[i]->sh) {
+            p = ngx_sprintf(p, "\"size\":%O,\"max_size\":%O,\"cold\":%s,",
+                            ngx_http_file_cache_size(caches[i]),
+                            caches[i]->max_size * caches[i]->bsize,
+                            caches[i]->sh->cold ? "true" : "false");
+        }
+
+        for (k = 0; k < NGX_HTTP_EXTENDED_STATUS_CACHE_COUNTERS; k++) {
+            p = ngx_sprintf(p, "%s\"%s\":%uL", k ? "," : "",
+                            ngx_http_extended_status_cache_names[k], c[k]);
+        }
+
+        *p++ = '}';
+
+        c += NGX_HTTP_EXTENDED_STATUS_CACHE_COUNTERS;
+    }
+
+#endif
+
+    p = ngx_cpymem(p, "},\"worker\":{", sizeof("},\"worker\":{") - 1);
+    p = ngx_http_extended_status_json_worker(p);
+    p = ngx_cpymem(p, "}}" CRLF, sizeof("}}" CRLF) - 1);
+
+    return p;
+}
+
+
+static u_char *
+ngx_http_extended_status_json_worker(u_char *p)
+{
+    ngx_uint_t                i, n;
+#if (NGX_THREADS)
+    ngx_str_t                *name;
+    ngx_thread_pool_t        *tp;
+    ngx_thread_pool_stats_t   stats;
+#endif
+    ngx_pool_cache_class_t   *pc;
+    ngx_pool_cache_stats_t   *pcs;
+
+    /* the counters of the worker that handles the request */
+
+    pcs = ngx_pool_cache_stats();
+
+    p = ngx_sprintf(p, "\"pool_cache\":{\"size\":%uz,\"max_size\":%uz,"
+                       "\"classes\":{",
+                    pcs->size, pcs->max);
+
+    for (i = 0, n = 0; i < NGX_POOL_CACHE_CLASSES; i++) {
+        pc = &pcs->classes[i];
+
+        if (pc->cached + pc->hits + pc->misses == 0) {
+            continue;
+        }
+
+        p = ngx_sprintf(p, "%s\"%uz\":{\"cached\":%ui,\"hits\":%ui,"
+                           "\"misses\":%ui,\"releases\":%ui}",
+                        n++ ? "," : "", pc->size, pc->cached, pc->hits,
+                        pc->misses, pc->releases);
+    }
+
+    p = ngx_cpymem(p, "}}", 2);
+
+#if (NGX_THREADS)
+
+    p = ngx_cpymem(p, ",\"thread_pools\":{",
+                   sizeof(",\"thread_pools\":{") - 1);
+
+    for (i = 0; /* void */ ; i++) {
+        tp = ngx_thread_pool_get_indexed((ngx_cycle_t *) ngx_cycle, i);
+
+        if (tp == NULL) {
+            break;
+        }
+
+        name = ngx_thread_pool_name(tp);
+        ngx_thread_pool_get_stats(tp, &stats);
+
+        if (i) {
+            *p++ = ',';
+        }
+
+        *p++ = '"';
+        p = (u_char *) ngx_escape_json(p, name->data, name->len);
+        p = ngx_sprintf(p, "\":{\"queued\":%ui,\"max_queued\":%ui,"
+                           "\"posted\":%ui,\"completed\":%ui,"
+                           "\"overflows\":%ui,",
+                        stats.queued, stats.max_queued, stats.posted,
+                        stats.completed, stats.overflows);
+
+        p = ngx_http_extended_status_json_histogram(p, "wait_time",
+                                                    stats.wait_sum,
+                                                    stats.wait);
+        *p++ = ',';
+        p = ngx_http_extended_status_json_histogram(p, "run_time",
+                                                    stats.latency_sum,
+                                                    stats.latency);
+        *p++ = '}';
+    }
+
+    *p++ = '}';
+
+#endif
+
+    return p;
+}
+
+
+#if (NGX_THREADS)
+
+static u_char *
+ngx_http_extended_status_json_histogram(u_char *p, char *name, uint64_t sum,
+    ngx_uint_t *buckets)
+{
+    ngx_uint_t  i;
+
+    /* bucket i counts samples below 2^(i+1) microseconds */
+
+    p = ngx_sprintf(p, "\"%s\":{\"sum_us\":%uL,\"buckets\":{", name, sum);
+
+    for (i = 0; i < NGX_THREAD_POOL_HIST_LEN - 1; i++) {
+        p = ngx_sprintf(p, "\"%ui\":%ui,", (ngx_uint_t) 2 << i, buckets[i]);
+    }
+
+    p = ngx_sprintf(p, "\"inf\":%ui}}", buckets[i]);
+
+    return p;
+}
+
+#endif
+
+
+static u_char *
+ngx_http_extended_status_json_counters(u_char *p, uint64_t *c, char *time)
+{
+    ngx_uint_t  i;
+
+    p = ngx_sprintf(p, "\"requests\":%uL,\"responses\":{\"1xx\":%uL,"
+                       "\"2xx\":%uL,\"3xx\":%uL,\"4xx\":%uL,\"5xx\":%uL},"
+                       "\"received\":%uL,\"sent\":%uL,"
+                       "\"%s\":{\"sum_ms\":%uL,\"buckets\":{",
+                    c[NGX_HTTP_EXTENDED_STATUS_REQUESTS],
+                    c[NGX_HTTP_EXTENDED_STATUS_RESPONSES],
+                    c[NGX_HTTP_EXTENDED_STATUS_RESPONSES + 1],
+                    c[NGX_HTTP_EXTENDED_STATUS_RESPONSES + 2],
+                    c[NGX_HTTP_EXTENDED_STATUS_RESPONSES + 3],
+                    c[NGX_HTTP_EXTENDED_STATUS_RESPONSES + 4],
+                    c[NGX_HTTP_EXTENDED_STATUS_RECEIVED],
+                    c[NGX_HTTP_EXTENDED_STATUS_SENT],
+                    time, c[NGX_HTTP_EXTENDED_STATUS_TIME]);
+
+    for (i = 0; i < NGX_HTTP_EXTENDED_STATUS_NBUCKETS - 1; i++) {
+        p = ngx_sprintf(p, "\"%ui\":%uL,", (ngx_uint_t) 1 << i,
+                        c[NGX_HTTP_EXTENDED_STATUS_BUCKETS + i]);
+    }
+
+    p = ngx_sprintf(p, "\"inf\":%uL}}",
+                    c[NGX_HTTP_EXTENDED_STATUS_BUCKETS + i]);
+
+    return p;
+}
+
+
+static u_char *
+ngx_http_extended_status_prometheus(ngx_http_request_t *r, u_char *p,
+    uint64_t *total)
+{
+    u_char                                *l;
+    uint64_t                              *c;
+    ngx_str_t                             *name;
+    ngx_uint_t                             i, k, n, nentries;
+#if (NGX_HTTP_CACHE)
+    ngx_http_file_cache_t                **caches;
+#endif
+    ngx_http_upstream_rr_peer_t           *peer;
+#if (NGX_HTTP_UPSTREAM_ZONE)
+    ngx_http_upstream_rr_peers_t          *peers;
+#endif
+    ngx_http_extended_status_entry_t      *entries;
+    ngx_http_extended_status_upstream_t   *up;
+    ngx_http_extended_status_main_conf_t  *smcf;
+
+    smcf = ngx_http_get_module_main_conf(r, ngx_http_extended_status_module);
+
+    nentries = ngx_max(smcf->server_zones.nelts, smcf->location_zones.nelts);
+    nentries = ngx_max(nentries, smcf->npeers);
+
+    entries = ngx_palloc(r->pool,
+                         (nentries + 1)
+                         * sizeof(ngx_http_extended_status_entry_t));
+    if (entries == NULL) {
+        return NULL;
+    }
+
+#if (NGX_STAT_STUB)
+
+    p = ngx_sprintf(p, "# TYPE nginx_connections_accepted_total counter\n"
+                       "nginx_connections_accepted_total %uA\n"
+                       "# TYPE nginx_connections_handled_total counter\n"
+                       "nginx_connections_handled_total %uA\n"
+                       "# TYPE nginx_connections gauge\n"
+                       "nginx_connections{state=\"active\"} %uA\n"
+                       "nginx_connections{state=\"reading\"} %uA\n"
+                       "nginx_connections{state=\"writing\"} %uA\n"
+                       "nginx_connections{state=\"waiting\"} %uA\n"
+                       "# TYPE nginx_http_requests_total counter\n"
+                       "nginx_http_requests_total %uA\n",
+                    *ngx_stat_accepted, *ngx_stat_handled, *ngx_stat_active,
+                    *ngx_stat_reading, *ngx_stat_writing, *ngx_stat_waiting,
+                    *ngx_stat_requests);
+
+#endif
+
+    c = total;
+
+    name = smcf->server_zones.elts;
+    n = smcf->server_zones.nelts;
+
+    for (i = 0; i < n; i++) {
+        l = ngx_pnalloc(r->pool, sizeof("zone=\"\"") - 1 + 2 * name[i].len);
+        if (l == NULL) {
+            return NULL;
+        }
+
+        entries[i].label.data = l;
+
+        l = ngx_cpymem(l, "zone=\"", sizeof("zone=\"") - 1);
+        l = (u_char *) ngx_escape_json(l, name[i].data, name[i].len);
+        *l++ = '"';
+
+        entries[i].label.len = l - entries[i].label.data;
+        entries[i].counters = c;
+
+        c += NGX_HTTP_EXTENDED_STATUS_COUNTERS;
+    }
+
+    p = ngx_http_extended_status_prometheus_counters(p, "nginx_server_zone",
+                                                     "request", entries, n);
+
+    name = smcf->location_zones.elts;
+    n = smcf->location_zones.nelts;
+
+    for (i = 0; i < n; i++) {
+        l = ngx_pnalloc(r->pool, sizeof("zone=\"\"") - 1 + 2 * name[i].len);
+        if (l == NULL) {
+            return NULL;
+        }
+
+        entries[i].label.data = l;
+
+        l = ngx_cpymem(l, "zone=\"", sizeof("zone=\"") - 1);
+        l = (u_char *) ngx_escape_json(l, name[i].data, name[i].len);
+        *l++ = '"';
+
+        entries[i].label.len = l - entries[i].label.data;
+        entries[i].counters = c;
+
+        c += NGX_HTTP_EXTENDED_STATUS_COUNTERS;
+    }
+
+    p = ngx_http_extended_status_prometheus_counters(p, "nginx_location_zone",
+                                                     "request", entries, n);
+
+    up = smcf->upstreams.elts;
+    n = 0;
+
+    for (i = 0; i < smcf->upstreams.nelts; i++) {
+        for (k = 0; k < up[i].npeers; k++) {
+            l = ngx_pnalloc(r->pool, sizeof("upstream=\"\",peer=\"\"") - 1
+                                     + 2 * up[i].uscf->host.len
+                                     + 2 * up[i].names[k].len);
+            if (l == NULL) {
+                return NULL;
+            }
+
+            entries[n].label.data = l;
+
+            l = ngx_cpymem(l, "upstream=\"", sizeof("upstream=\"") - 1);
+            l = (u_char *) ngx_escape_json(l, up[i].uscf->host.data,
+                                           up[i].uscf->host.len);
+            l = ngx_cpymem(l, "\",peer=\"", sizeof("\",peer=\"") - 1);
+            l = (u_char *) ngx_escape_json(l, up[i].names[k].data,
+                                           up[i].names[k].len);
+            *l++ = '"';
+
+            entries[n].label.len = l - entries[n].label.data;
+            entries[n].counters = c + (up[i].peer + k)
+                                      * NGX_HTTP_EXTENDED_STATUS_COUNTERS;
+            n++;
+        }
+    }
+
+    p = ngx_http_extended_status_prometheus_counters(p, "nginx_upstream_peer",
+                                                     "response", entries, n);
+
+    if (n) {
+        p = ngx_sprintf(p, "# TYPE nginx_upstream_peer_up gauge\n");
+
+        for (i = 0, n = 0; i < smcf->upstreams.nelts; i++) {
+#if (NGX_HTTP_UPSTREAM_ZONE)
+            peers = up[i].uscf->peer.data;
+
+            ngx_http_upstream_rr_peers_rlock(peers);
+#endif
+
+            for (k = 0; k < up[i].npeers; k++, n++) {
+                peer = up[i].peerp ? up[i].peerp[k] : NULL;
+
+                if (peer == NULL) {
+                    continue;
+                }
+
+                p = ngx_sprintf(p, "nginx_upstream_peer_up{%V} %d\n",
+                                &entries[n].label,
+                                !peer->down
+                                && !(peer->max_fails
+                                     && peer->fails >= peer->max_fails));
+            }
+
+#if (NGX_HTTP_UPSTREAM_ZONE)
+            ngx_http_upstream_rr_peers_unlock(peers);
+#endif
+        }
+
+        p = ngx_sprintf(p, "# TYPE nginx_upstream_peer_active gauge\n");
+
+        for (i = 0, n = 0; i < smcf->upstreams.nelts; i++) {
+#if (NGX_HTTP_UPSTREAM_ZONE)
+            peers = up[i].uscf->peer.data;
+
+            ngx_http_upstream_rr_peers_rlock(peers);
+#endif
+
+            for (k = 0; k < up[i].npeers; k++, n++) {
+                peer = up[i].peerp ? up[i].peerp[k] : NULL;
+
+                if (peer == NULL) {
+                    continue;
+                }
+
+                p = ngx_sprintf(p, "nginx_upstream_peer_active{%V} %ui\n",
+                                &entries[n].label, peer->conns);
+            }
+
+#if (NGX_HTTP_UPSTREAM_ZONE)
+            ngx_http_upstream_rr_peers_unlock(peers);
+#endif
+        }
+    }
+
+#if (NGX_HTTP_CACHE)
+
+    c += smcf->npeers * NGX_HTTP_EXTENDED_STATUS_COUNTERS;
+
+    caches = smcf->caches.elts;
+
+    if (smcf->caches.nelts) {
+        p = ngx_sprintf(p, "# TYPE nginx_cache_responses_total counter\n");
+    }
+
+    for (i = 0; i < smcf->caches.nelts; i++) {
+        name = &caches[i]->shm_zone->shm.name;
+
+        for (k = 0; k < NGX_HTTP_EXTENDED_STATUS_CACHE_COUNTERS; k++) {
+            p = ngx_cpymem(p, "nginx_cache_responses_total{zone=\"",
+                           sizeof("nginx_cache_responses_total{zone=\"") - 1);
+            p = (u_char *) ngx_escape_json(p, name->data, name->len);
+            p = ngx_sprintf(p, "\",status=\"%s\"} %uL\n",
+                            ngx_http_extended_status_cache_names[k],
+                            c[k + i * NGX_HTTP_EXTENDED_STATUS_CACHE_COUNTERS]);
+        }
+    }
+
+    if (smcf->caches.nelts) {
+        p = ngx_sprintf(p, "# TYPE nginx_cache_size_bytes gauge\n");
+    }
+
+    for (i = 0; i < smcf->caches.nelts; i++) {
+        if (caches[i]->sh == NULL) {
+            continue;
+        }
+
+        name = &caches[i]->shm_zone->shm.name;
+
+        p = ngx_cpymem(p, "nginx_cache_size_bytes{zone=\"",
+                       sizeof("nginx_cache_size_bytes{zone=\"") - 1);
+        p = (u_char *) ngx_escape_json(p, name->data, name->len);
+        p = ngx_sprintf(p, "\"} %O\n", ngx_http_file_cache_size(caches[i]));
+    }
+
+#endif
+
+    return ngx_http_extended_status_prometheus_worker(p);
+}
+
+
+static u_char *
+ngx_http_extended_status_prometheus_worker(u_char *p)
+{
+    ngx_uint_t                i, k;
+#if (NGX_THREADS)
+    ngx_str_t                *name;
+    ngx_thread_pool_t        *tp;
+    ngx_thread_pool_stats_t   stats;
+#endif
+    ngx_pool_cache_class_t   *pc;
+    ngx_pool_cache_stats_t   *pcs;
+
+    pcs = ngx_pool_cache_stats();
+
+    if (pcs->max) {
+        p = ngx_sprintf(p, "# TYPE nginx_worker_pool_cache_bytes gauge\n"
+                           "nginx_worker_pool_cache_bytes{pid=\"%P\"} %uz\n",
+                        ngx_pid, pcs->size);
+
+        for (k = 0; k < 3; k++) {
+            p = ngx_sprintf(p, "# TYPE nginx_worker_pool_cache_%s_total"
+                               " counter\n",
+                            ngx_http_extended_status_pool_cache_names[k]);
+
+            for (i = 0; i < NGX_POOL_CACHE_CLASSES; i++) {
+                pc = &pcs->classes[i];
+
+                if (pc->cached + pc->hits + pc->misses == 0) {
+                    continue;
+                }
+
+                p = ngx_sprintf(p, "nginx_worker_pool_cache_%s_total"
+                                   "{pid=\"%P\",class=\"%uz\"} %ui\n",
+                                ngx_http_extended_status_pool_cache_names[k],
+                                ngx_pid, pc->size,
+                                k == 0 ? pc->hits
+                                : k == 1 ? pc->misses : pc->releases);
+            }
+        }
+    }
+
+#if (NGX_THREADS)
+
+    /* every metric is printed for all pools under a single TYPE line */
+
+    for (k = 0; k < 5; k++) {
+
+        for (i = 0; /* void */ ; i++) {
+            tp = ngx_thread_pool_get_indexed((ngx_cycle_t *) ngx_cycle, i);
+
+            if (tp == NULL) {
+                break;
+            }
+
+            name = ngx_thread_pool_name(tp);
+            ngx_thread_pool_get_stats(tp, &stats);
+
+            switch (k) {
+
+            case 0:
+                p = ngx_sprintf(p, "%snginx_worker_thread_pool_queued"
+                                   "{pid=\"%P\",pool=\"%V\"} %ui\n",
+                                i ? "" : "# TYPE nginx_worker_thread_pool_"
+                                         "queued gauge\n",
+                                ngx_pid, name, stats.queued);
+                break;
+
+            case 1:
+                p = ngx_sprintf(p, "%snginx_worker_thread_pool_max_queued"
+                                   "{pid=\"%P\",pool=\"%V\"} %ui\n",
+                                i ? "" : "# TYPE nginx_worker_thread_pool_"
+                                         "max_queued gauge\n",
+                                ngx_pid, name, stats.max_queued);
+                break;
+
+            case 2:
+                p = ngx_sprintf(p, "%snginx_worker_thread_pool_overflows_total"
+                                   "{pid=\"%P\",pool=\"%V\"} %ui\n",
+                                i ? "" : "# TYPE nginx_worker_thread_pool_"
+                                         "overflows_total counter\n",
+                                ngx_pid, name, stats.overflows);
+                break;
+
+            case 3:
+                p = ngx_http_extended_status_prometheus_histogram(p, "wait",
+                        name, i == 0, stats.wait_sum, stats.wait);
+                break;
+
+            default: /* 4 */
+                p = ngx_http_extended_status_prometheus_histogram(p, "run",
+                        name, i == 0, stats.latency_sum, stats.latency);
+            }
+        }
+    }
+
+#endif
+
+    return p;
+}
+
+
+#if (NGX_THREADS)
+
+static u_char *
+ngx_http_extended_status_prometheus_histogram(u_char *p, char *name,
+    ngx_str_t *pool, ngx_uint_t type, uint64_t sum, ngx_uint_t *buckets)
+{
+    ngx_uint_t  i, n, us;
+
+    if (type) {
+        p = ngx_sprintf(p, "# TYPE nginx_worker_thread_pool_%s_duration_seconds"
+                           " histogram\n", name);
+    }
+
+    for (i = 0, n = 0; i < NGX_THREAD_POOL_HIST_LEN - 1; i++) {
+        n += buckets[i];
+        us = (ngx_uint_t) 2 << i;
+
+        p = ngx_sprintf(p, "nginx_worker_thread_pool_%s_duration_seconds_bucket"
+                           "{pid=\"%P\",pool=\"%V\",le=\"%ui.%06ui\"} %ui\n",
+                        name, ngx_pid, pool, us / 1000000, us % 1000000, n);
+    }
+
+    n += buckets[i];
+
+    p = ngx_sprintf(p, "nginx_worker_thread_pool_%s_duration_seconds_bucket"
+                       "{pid=\"%P\",pool=\"%V\",le=\"+Inf\"} %ui\n"
+                       "nginx_worker_thread_pool_%s_duration_seconds_sum"
+                       "{pid=\"%P\",pool=\"%V\"} %uL.%06uL\n"
+                       "nginx_worker_thread_pool_%s_duration_seconds_count"
+                       "{pid=\"%P\",pool=\"%V\"} %ui\n",
+                    name, ngx_pid, pool, n,
+                    name, ngx_pid, pool, sum / 1000000, sum % 1000000,
+                    name, ngx_pid, pool, n);
+
+    return p;
+}
+
+#endif
+
+
+static u_char *
+ngx_http_extended_status_prometheus_counters(u_char *p, char *prefix,
+    char *time, ngx_http_extended_status_entry_t *entries, ngx_uint_t n)
+{
+    uint64_t    *c, sum;
+    ngx_uint_t   i, k;
+
+    if (n == 0) {
+        return p;
+    }
+
+    p = ngx_sprintf(p, "# TYPE %s_requests_total counter\n", prefix);
+
+    for (i = 0; i < n; i++) {
+        p = ngx_sprintf(p, "%s_requests_total{%V} %uL\n", prefix,
+                        &entries[i].label,
+                        entries[i].counters[NGX_HTTP_EXTENDED_STATUS_REQUESTS]);
+    }
+
+    p = ngx_sprintf(p, "# TYPE %s_responses_total counter\n", prefix);
+
+    for (i = 0; i < n; i++) {
+        c = entries[i].counters + NGX_HTTP_EXTENDED_STATUS_RESPONSES;
+
+        for (k = 0; k < 5; k++) {
+            p = ngx_sprintf(p, "%s_responses_total{%V,code=\"%uixx\"} %uL\n",
+                            prefix, &entries[i].label, k + 1, c[k]);
+        }
+    }
+
+    p = ngx_sprintf(p, "# TYPE %s_received_bytes_total counter\n", prefix);
+
+    for (i = 0; i < n; i++) {
+        p = ngx_sprintf(p, "%s_received_bytes_total{%V} %uL\n", prefix,
+                        &entries[i].label,
+                        entries[i].counters[NGX_HTTP_EXTENDED_STATUS_RECEIVED]);
+    }
+
+    p = ngx_sprintf(p, "# TYPE %s_sent_bytes_total counter\n", prefix);
+
+    for (i = 0; i < n; i++) {
+        p = ngx_sprintf(p, "%s_sent_bytes_total{%V} %uL\n", prefix,
+                        &entries[i].label,
+                        entries[i].counters[NGX_HTTP_EXTENDED_STATUS_SENT]);
+    }
+
+    p = ngx_sprintf(p, "# TYPE %s_%s_duration_seconds histogram\n",
+                    prefix, time);
+
+    for (i = 0; i < n; i++) {
+        c = entries[i].counters;
+        sum = 0;
+
+        for (k = 0; k < NGX_HTTP_EXTENDED_STATUS_NBUCKETS - 1; k++) {
+            sum += c[NGX_HTTP_EXTENDED_STATUS_BUCKETS + k];
+
+            p = ngx_sprintf(p, "%s_%s_duration_seconds_bucket"
+                               "{%V,le=\"%ui.%03ui\"} %uL\n",
+                            prefix, time, &entries[i].label,
+                            (ngx_uint_t) (1 << k) / 1000,
+                            (ngx_uint_t) (1 << k) % 1000, sum);
+        }
+
+        sum += c[NGX_HTTP_EXTENDED_STATUS_BUCKETS + k];
+
+        p = ngx_sprintf(p, "%s_%s_duration_seconds_bucket"
+                           "{%V,le=\"+Inf\"} %uL\n"
+                           "%s_%s_duration_seconds_sum{%V} %uL.%03uL\n"
+                           "%s_%s_duration_seconds_count{%V} %uL\n",
+                        prefix, time, &entries[i].label, sum,
+                        prefix, time, &entries[i].label,
+                        c[NGX_HTTP_EXTENDED_STATUS_TIME] / 1000,
+                        c[NGX_HTTP_EXTENDED_STATUS_TIME] % 1000,
+                        prefix, time, &entries[i].label, sum);
+    }
+
+    return p;
+}
+
+
+static ngx_int_t
+ngx_http_extended_status_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_http_extended_status_main_conf_t  *osmcf = data;
+
+    size_t                                 size;
+    ngx_slab_pool_t                       *shpool;
+    ngx_http_extended_status_sh_t         *sh;
+    ngx_http_extended_status_main_conf_t  *smcf;
+
+    smcf = shm_zone->data;
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    smcf->shpool = shpool;
+
+    if (osmcf) {
+        sh = osmcf->sh;
+
+    } else if (shm_zone->shm.exists) {
+        /* windows nginx worker */
+        smcf->sh = shpool->data;
+        return NGX_OK;
+
+    } else {
+        size = sizeof(ngx_http_extended_status_sh_t)
+               + smcf->nslots * sizeof(ngx_http_extended_status_slot_t)
+               + ngx_cacheline_size + (smcf->nslots + 1) * smcf->slot_size;
+
+        sh = ngx_slab_calloc(shpool, size);
+        if (sh == NULL) {
+            return NGX_ERROR;
+        }
+
+        sh->nslots = smcf->nslots;
+        sh->slot_size = smcf->slot_size;
+
+        sh->slots = (ngx_http_extended_status_slot_t *) &sh[1];
+        sh->area = (uint64_t *) ngx_align_ptr(&sh->slots[sh->nslots],
+                                              ngx_cacheline_size);
+
+        sh->generation = 0;
+        sh->accum_signature = smcf->signature;
+
+        shpool->data = sh;
+
+        smcf->sh = sh;
+
+        return NGX_OK;
+    }
+
+    /*
+     * the slots are left to the workers of the previous generations,
+     * only the totals of a different set of counters are dropped
+     */
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    sh->generation++;
+
+    if (sh->accum_signature != smcf->signature) {
+        ngx_memzero(sh->area, smcf->ncounters * sizeof(uint64_t));
+        sh->accum_signature = smcf->signature;
+    }
+
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    smcf->sh = sh;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_extended_status_reap(ngx_shm_zone_t *shm_zone, ngx_pid_t pid)
+{
+    ngx_uint_t                      i;
+    ngx_slab_pool_t                *shpool;
+    ngx_http_extended_status_sh_t  *sh;
+
+    /* called by the master process from the SIGCHLD handler */
+
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+    sh = shpool->data;
+
+    if (sh == NULL) {
+        return;
+    }
+
+    for (i = 0; i < sh->nslots; i++) {
+        (void) ngx_atomic_cmp_set(&sh->slots[i].pid, pid, 0);
+    }
+}
+
+
+static uint32_t
+ngx_http_extended_status_signature(ngx_http_extended_status_main_conf_t *smcf)
+{
+    uint32_t                               crc;
+    ngx_str_t                             *name;
+    ngx_uint_t                             i, k;
+#if (NGX_HTTP_CACHE)
+    ngx_http_file_cache_t                **caches;
+#endif
+    ngx_http_extended_status_upstream_t   *up;
+
+    ngx_crc32_init(crc);
+
+    ngx_crc32_update(&crc, (u_char *) &smcf->nworkers, sizeof(ngx_uint_t));
+    ngx_crc32_update(&crc, (u_char *) &smcf->ncounters, sizeof(ngx_uint_t));
+
+    name = smcf->server_zones.elts;
+
+    for (i = 0; i < smcf->server_zones.nelts; i++) {
+        ngx_crc32_update(&crc, name[i].data, name[i].len + 1);
+    }
+
+    ngx_crc32_update(&crc, (u_char *) "", 1);
+
+    name = smcf->location_zones.elts;
+
+    for (i = 0; i < smcf->location_zones.nelts; i++) {
+        ngx_crc32_update(&crc, name[i].data, name[i].len + 1);
+    }
+
+    ngx_crc32_update(&crc, (u_char *) "", 1);
+
+    up = smcf->upstreams.elts;
+
+    for (i = 0; i < smcf->upstreams.nelts; i++) {
+        ngx_crc32_update(&crc, up[i].uscf->host.data, up[i].uscf->host.len);
+        ngx_crc32_update(&crc, (u_char *) "", 1);
+
+        for (k = 0; k < up[i].npeers; k++) {
+            ngx_crc32_update(&crc, up[i].names[k].data, up[i].names[k].len);
+            ngx_crc32_update(&crc, (u_char *) "", 1);
+        }
+    }
+
+    ngx_crc32_update(&crc, (u_char *) "", 1);
+
+#if (NGX_HTTP_CACHE)
+
+    caches = smcf->caches.elts;
+
+    for (i = 0; i < smcf->caches.nelts; i++) {
+        name = &caches[i]->shm_zone->shm.name;
+        ngx_crc32_update(&crc, name->data, name->len);
+        ngx_crc32_update(&crc, (u_char *) "", 1);
+    }
+
+#endif
+
+    ngx_crc32_final(crc);
+
+    return crc;
+}
+
+
+static void *
+ngx_http_extended_status_create_main_conf(ngx_conf_t *cf)
+{
+    ngx_http_extended_status_main_conf_t  *smcf;
+
+    smcf = ngx_pcalloc(cf->pool, sizeof(ngx_http_extended_status_main_conf_t));
+    if (smcf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     smcf->npeers = 0;
+     *     smcf->enabled = 0;
+     *     smcf->shm_zone = NULL;
+     *     smcf->sh = NULL;
+     *     smcf->slot = NULL;
+     */
+
+    if (ngx_array_init(&smcf->server_zones, cf->pool, 4, sizeof(ngx_str_t))
+        != NGX_OK)
+    {
+        return NULL;
+    }
+
+    if (ngx_array_init(&smcf->location_zones, cf->pool, 4, sizeof(ngx_str_t))
+        != NGX_OK)
+    {
+        return NULL;
+    }
+
+    if (ngx_array_init(&smcf->upstreams, cf->pool, 4,
+                       sizeof(ngx_http_extended_status_upstream_t))
+        != NGX_OK)
+    {
+        return NULL;
+    }
+
+    if (ngx_array_init(&smcf->caches, cf->pool, 4,
+                       sizeof(ngx_http_file_cache_t *))
+        != NGX_OK)
+    {
+        return NULL;
+    }
+
+    return smcf;
+}
+
+
+static void *
+ngx_http_extended_status_create_srv_conf(ngx_conf_t *cf)
+{
+    ngx_http_extended_status_srv_conf_t  *conf;
+
+    conf = ngx_palloc(cf->pool, sizeof(ngx_http_extended_status_srv_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    conf->zone = NGX_CONF_UNSET_UINT;
+
+    return conf;
+}
+
+
+static char *
+ngx_http_extended_status_merge_srv_conf(ngx_conf_t *cf, void *parent,
+    void *child)
+{
+    ngx_http_extended_status_srv_conf_t *prev = parent;
+    ngx_http_extended_status_srv_conf_t *conf = child;
+
+    ngx_conf_merge_uint_value(conf->zone, prev->zone, NGX_CONF_UNSET_UINT);
+
+    return NGX_CONF_OK;
+}
+
+
+static void *
+ngx_http_extended_status_create_loc_conf(ngx_conf_t *cf)
+{
+    ngx_http_extended_status_loc_conf_t  *conf;
+
+    conf = ngx_palloc(cf->pool, sizeof(ngx_http_extended_status_loc_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    conf->zone = NGX_CONF_UNSET_UINT;
+    conf->format = NGX_CONF_UNSET_UINT;
+
+    return conf;
+}
+
+
+static char *
+ngx_http_extended_status_merge_loc_conf(ngx_conf_t *cf, void *parent,
+    void *child)
+{
+    ngx_http_extended_status_loc_conf_t *prev = parent;
+    ngx_http_extended_status_loc_conf_t *conf = child;
+
+    ngx_conf_merge_uint_value(conf->zone, prev->zone, NGX_CONF_UNSET_UINT);
+    ngx_conf_merge_uint_value(conf->format, prev->format,
+                              NGX_HTTP_EXTENDED_STATUS_JSON);
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_http_extended_status_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_str_t                             *value, *name;
+    ngx_uint_t                             i, *zone;
+    ngx_array_t                           *zones;
+    ngx_http_extended_status_srv_conf_t   *sscf;
+    ngx_http_extended_status_loc_conf_t   *slcf;
+    ngx_http_extended_status_main_conf_t  *smcf;
+
+    smcf = ngx_http_conf_get_module_main_conf(cf,
+                                              ngx_http_extended_status_module);
+
+    if (cf->cmd_type == NGX_HTTP_SRV_CONF) {
+        sscf = ngx_http_conf_get_module_srv_conf(cf,
+                                               ngx_http_extended_status_module);
+        zones = &smcf->server_zones;
+        zone = &sscf->zone;
+
+    } else {
+        slcf = ngx_http_conf_get_module_loc_conf(cf,
+                                               ngx_http_extended_status_module);
+        zones = &smcf->location_zones;
+        zone = &slcf->zone;
+    }
+
+    if (*zone != NGX_CONF_UNSET_UINT) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (value[1].len == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid zone name \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    /* several servers or locations may share a zone */
+
+    name = zones->elts;
+
+    for (i = 0; i < zones->nelts; i++) {
+        if (name[i].len == value[1].len
+            && ngx_strncmp(name[i].data, value[1].data, value[1].len) == 0)
+        {
+            *zone = i;
+            smcf->enabled = 1;
+            return NGX_CONF_OK;
+        }
+    }
+
+    name = ngx_array_push(zones);
+    if (name == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    *name = value[1];
+    *zone = zones->nelts - 1;
+
+    smcf->enabled = 1;
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_http_extended_status(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_extended_status_loc_conf_t *slcf = conf;
+
+    ngx_str_t                             *value;
+    ngx_http_core_loc_conf_t              *clcf;
+    ngx_http_extended_status_main_conf_t  *smcf;
+
+    if (slcf->format != NGX_CONF_UNSET_UINT) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (cf->args->nelts == 1
+        || ngx_strcmp(value[1].data, "json") == 0)
+    {
+        slcf->format = NGX_HTTP_EXTENDED_STATUS_JSON;
+
+    } else if (ngx_strcmp(value[1].data, "prometheus") == 0) {
+        slcf->format = NGX_HTTP_EXTENDED_STATUS_PROMETHEUS;
+
+    } else {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid format \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    smcf = ngx_http_conf_get_module_main_conf(cf,
+                                              ngx_http_extended_status_module);
+    smcf->enabled = 1;
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    clcf->handler = ngx_http_extended_status_handler;
+
+    return NGX_CONF_OK;
+}
+
+
+static ngx_int_t
+ngx_http_extended_status_init(ngx_conf_t *cf)
+{
+    ngx_str_t                              name;
+    ngx_uint_t                             i, k, n;
+    ngx_shm_zone_t                        *shm_zone;
+    ngx_core_conf_t                       *ccf;
+    ngx_http_handler_pt                   *h;
+#if (NGX_HTTP_CACHE)
+    ngx_list_part_t                       *part;
+    ngx_http_file_cache_t                **cache;
+#endif
+    ngx_http_core_main_conf_t             *cmcf;
+    ngx_http_upstream_rr_peer_t           *peer;
+    ngx_http_upstream_rr_peers_t          *peers;
+    ngx_http_upstream_srv_conf_t         **uscfp;
+    ngx_http_upstream_main_conf_t         *umcf;
+    ngx_http_extended_status_upstream_t   *up;
+    ngx_http_extended_status_main_conf_t  *smcf, *osmcf;
+
+    smcf = ngx_http_conf_get_module_main_conf(cf,
+                                              ngx_http_extended_status_module);
+
+    if (!smcf->enabled) {
+        return NGX_OK;
+    }
+
+    /* explicitly configured upstream blocks */
+
+    umcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_upstream_module);
+
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+
+        if (uscfp[i]->srv_conf == NULL || uscfp[i]->peer.data == NULL) {
+            continue;
+        }
+
+        up = ngx_array_push(&smcf->upstreams);
+        if (up == NULL) {
+            return NGX_ERROR;
+        }
+
+        up->uscf = uscfp[i];
+        up->peer = smcf->npeers;
+        up->npeers = 0;
+
+        for (peers = uscfp[i]->peer.data; peers; peers = peers->next) {
+            up->npeers += peers->number;
+        }
+
+        up->names = ngx_palloc(cf->pool, up->npeers * sizeof(ngx_str_t));
+        if (up->names == NULL) {
+            return NGX_ERROR;
+        }
+
+        up->backup = ngx_palloc(cf->pool, up->npeers * sizeof(ngx_uint_t));
+        if (up->backup == NULL) {
+            return NGX_ERROR;
+        }
+
+        n = 0;
+        k = 0;
+
+        for (peers = uscfp[i]->peer.data; peers; peers = peers->next) {
+            for (peer = peers->peer; peer && n < up->npeers; peer = peer->next)
+            {
+                if (peer->name.len == 0) {
+                    /* an unresolved slot, see "server ... resolve" */
+                    continue;
+                }
+
+                up->names[n] = peer->name;
+                up->backup[n] = k;
+                n++;
+            }
+
+            k = 1;
+        }
+
+        up->npeers = n;
+        smcf->npeers += n;
+    }
+
+#if (NGX_HTTP_CACHE)
+
+    /* file caches are recognized by their shared memory zones */
+
+    part = &cf->cycle->shared_memory.part;
+    shm_zone = part->elts;
+
+    for (i = 0; /* void */ ; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+            part = part->next;
+            shm_zone = part->elts;
+            i = 0;
+        }
+
+        if (shm_zone[i].init != ngx_http_file_cache_init) {
+            continue;
+        }
+
+        cache = ngx_array_push(&smcf->caches);
+        if (cache == NULL) {
+            return NGX_ERROR;
+        }
+
+        *cache = shm_zone[i].data;
+    }
+
+#endif
+
+    smcf->ncounters = (smcf->server_zones.nelts + smcf->location_zones.nelts
+                       + smcf->npeers) * NGX_HTTP_EXTENDED_STATUS_COUNTERS;
+
+#if (NGX_HTTP_CACHE)
+    smcf->ncounters += smcf->caches.nelts
+                       * NGX_HTTP_EXTENDED_STATUS_CACHE_COUNTERS;
+#endif
+
+    smcf->slot_size = ngx_align((smcf->ncounters + 1) * sizeof(uint64_t),
+                                ngx_cacheline_size);
+
+    ccf = (ngx_core_conf_t *) ngx_get_conf(cf->cycle->conf_ctx,
+                                           ngx_core_module);
+
+    if (ccf->worker_processes != NGX_CONF_UNSET
+        && ccf->worker_processes > 0)
+    {
+        smcf->nworkers = ccf->worker_processes;
+
+    } else {
+        smcf->nworkers = ngx_max(ngx_ncpu, 1);
+    }
+
+    smcf->nslots = smcf->nworkers * NGX_HTTP_EXTENDED_STATUS_GENERATIONS;
+
+    smcf->signature = ngx_http_extended_status_signature(smcf);
+
+    ngx_str_set(&name, "extended_status");
+
+    shm_zone = ngx_shared_memory_add(cf, &name,
+                                     8 * ngx_pagesize
+                                     + smcf->nslots
+                                       * sizeof(ngx_http_extended_status_slot_t)
+                                     + (smcf->nslots + 2) * smcf->slot_size,
+                                     &ngx_http_extended_status_module);
+    if (shm_zone == NULL) {
+        return NGX_ERROR;
+    }
+
+    shm_zone->init = ngx_http_extended_status_init_zone;
+    shm_zone->reap = ngx_http_extended_status_reap;
+    shm_zone->data = smcf;
+
+    /*
+     * the slots of the previous workers are kept in place,
+     * so a zone with a different layout cannot be reused
+     */
+
+    if (ngx_is_init_cycle(cf->cycle->old_cycle)) {
+        osmcf = NULL;
+
+    } else {
+        osmcf = ngx_http_cycle_get_module_main_conf(cf->cycle->old_cycle,
+                                               ngx_http_extended_status_module);
+    }
+
+    if (osmcf && osmcf->sh
+        && (osmcf->nslots != smcf->nslots
+            || osmcf->slot_size != smcf->slot_size))
+    {
+        shm_zone->noreuse = 1;
+    }
+
+    smcf->shm_zone = shm_zone;
+
+    cmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_core_module);
+
+    h = ngx_array_push(&cmcf->phases[NGX_HTTP_LOG_PHASE].handlers);
+    if (h == NULL) {
+        return NGX_ERROR;
+    }
+
+    *h = ngx_http_extended_status_log_handler;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_extended_status_init_process(ngx_cycle_t *cycle)
+{
+    uint64_t                              *c, *accum;
+    ngx_uint_t                             i, k;
+    ngx_http_extended_status_sh_t         *sh;
+    ngx_http_extended_status_main_conf_t  *smcf;
+
+    if (ngx_process != NGX_PROCESS_WORKER
+        && ngx_process != NGX_PROCESS_SINGLE)
+    {
+        return NGX_OK;
+    }
+
+    smcf = ngx_http_cycle_get_module_main_conf(cycle,
+                                               ngx_http_extended_status_module);
+
+    if (smcf == NULL || smcf->sh == NULL) {
+        return NGX_OK;
+    }
+
+    if (ngx_http_extended_status_init_index(cycle, smcf) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    sh = smcf->sh;
+
+    ngx_shmtx_lock(&smcf->shpool->mutex);
+
+    for (i = 0; i < smcf->nslots; i++) {
+        if (sh->slots[i].pid == 0
+            && ngx_atomic_cmp_set(&sh->slots[i].pid, 0, ngx_pid))
+        {
+            break;
+        }
+    }
+
+    if (i == smcf->nslots) {
+        ngx_shmtx_unlock(&smcf->shpool->mutex);
+
+        ngx_log_error(NGX_LOG_WARN, cycle->log, 0,
+                      "extended status: no free counters slot, "
+                      "requests of this worker are not counted");
+        return NGX_OK;
+    }
+
+    /* the slot was released by an exited process */
+
+    c = (uint64_t *) ((u_char *) sh->area + (1 + i) * smcf->slot_size);
+
+    if (sh->slots[i].signature == smcf->signature
+        && sh->accum_signature == smcf->signature)
+    {
+        accum = sh->area;
+
+        for (k = 0; k < smcf->ncounters; k++) {
+            accum[k] += c[k];
+        }
+    }
+
+    ngx_memzero(c, smcf->slot_size);
+
+    sh->slots[i].signature = smcf->signature;
+
+    ngx_shmtx_unlock(&smcf->shpool->mutex);
+
+    smcf->slot = c;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_extended_status_init_index(ngx_cycle_t *cycle,
+    ngx_http_extended_status_main_conf_t *smcf)
+{
+    ngx_uint_t                             i, k, h, size;
+    ngx_http_upstream_rr_peer_t           *peer;
+    ngx_http_upstream_rr_peers_t          *primary, *peers;
+    ngx_http_extended_status_index_t      *index;
+    ngx_http_extended_status_upstream_t   *up;
+
+    /*
+     * peers are looked up by the address of their names in the log phase,
+     * the peers of upstreams in shared memory are only known at this point
+     */
+
+    if (smcf->npeers == 0) {
+        return NGX_OK;
+    }
+
+    for (size = 1; size < 2 * smcf->npeers; size <<= 1) { /* void */ }
+
+    index = ngx_pcalloc(cycle->pool,
+                        size * sizeof(ngx_http_extended_status_index_t));
+    if (index == NULL) {
+        return NGX_ERROR;
+    }
+
+    up = smcf->upstreams.elts;
+
+    for (i = 0; i < smcf->upstreams.nelts; i++) {
+
+        up[i].peerp = ngx_pcalloc(cycle->pool,
+                          up[i].npeers * sizeof(ngx_http_upstream_rr_peer_t *));
+        if (up[i].peerp == NULL) {
+            return NGX_ERROR;
+        }
+
+        primary = up[i].uscf->peer.data;
+        k = 0;
+
+        ngx_http_upstream_rr_peers_rlock(primary);
+
+        for (peers = primary; peers && k < up[i].npeers; peers = peers->next) {
+            for (peer = peers->peer; peer && k < up[i].npeers;
+                 peer = peer->next)
+            {
+                if (peer->name.len != up[i].names[k].len
+                    || ngx_strncmp(peer->name.data, up[i].names[k].data,
+                                   peer->name.len)
+                       != 0)
+                {
+                    /* an unresolved slot */
+                    continue;
+                }
+
+                up[i].peerp[k] = peer;
+
+                for (h = ((uintptr_t) &peer->name >> 3) & (size - 1);
+                     index[h].name;
+                     h = (h + 1) & (size - 1))
+                {
+                    /* void */
+                }
+
+                index[h].name = &peer->name;
+                index[h].counters = up[i].peer + k;
+
+                k++;
+            }
+        }
+
+        ngx_http_upstream_rr_peers_unlock(primary);
+    }
+
+    smcf->index = index;
+    smcf->index_mask = size - 1;
+
+    return NGX_OK;
+}
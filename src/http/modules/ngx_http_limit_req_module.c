@@ -16,6 +16,9 @@
 #define NGX_HTTP_LIMIT_REQ_DELAYED_DRY_RUN   4
 #define NGX_HTTP_LIMIT_REQ_REJECTED_DRY_RUN  5
 
+#define NGX_HTTP_LIMIT_REQ_MAX_SHARDS        256
+#define NGX_HTTP_LIMIT_REQ_LOCAL_MAX         16384
+
 
 typedef struct {
     u_char                       color;
@@ -40,10 +43,46 @@ typedef struct {
 typedef struct {
     ngx_http_limit_req_shctx_t  *sh;
     ngx_slab_pool_t             *shpool;
+} ngx_http_limit_req_shard_t;
+
+
+/* per-worker approximation of a shared state */
+
+typedef struct {
+    ngx_str_node_t               sn;
+    ngx_queue_t                  queue;
+    ngx_msec_t                   last;
+    ngx_msec_t                   synced;
+    ngx_msec_t                   accessed;
+    /* integer value, 1 corresponds to 0.001 r/s */
+    ngx_uint_t                   excess;
+    /* admitted locally since the last synchronization */
+    ngx_uint_t                   pending;
+    u_char                       data[1];
+} ngx_http_limit_req_local_node_t;
+
+
+typedef struct {
+    ngx_rbtree_t                 rbtree;
+    ngx_rbtree_node_t            sentinel;
+    ngx_queue_t                  queue;
+    ngx_uint_t                   nodes;
+    ngx_event_t                  event;
+} ngx_http_limit_req_local_t;
+
+
+typedef struct {
+    /* each shard is a separate slab pool with its own mutex */
+    ngx_http_limit_req_shard_t  *shards;
+    ngx_uint_t                   nshards;
     /* integer value, 1 corresponds to 0.001 r/s */
     ngx_uint_t                   rate;
     ngx_http_complex_value_t     key;
     ngx_http_limit_req_node_t   *node;
+    ngx_http_limit_req_shard_t  *shard;
+    ngx_msec_t                   sync;
+    ngx_http_limit_req_local_t  *local;
+    ngx_http_limit_req_local_node_t  *local_node;
 } ngx_http_limit_req_ctx_t;
 
 
@@ -66,13 +105,25 @@ typedef struct {
 
 static void ngx_http_limit_req_delay(ngx_http_request_t *r);
 static ngx_int_t ngx_http_limit_req_lookup(ngx_http_limit_req_limit_t *limit,
-    ngx_uint_t hash, ngx_str_t *key, ngx_uint_t *ep, ngx_uint_t account);
+    ngx_http_limit_req_shard_t *shard, ngx_uint_t hash, ngx_str_t *key,
+    ngx_uint_t *ep, ngx_uint_t account);
+static ngx_http_limit_req_node_t *ngx_http_limit_req_alloc_node(
+    ngx_http_limit_req_ctx_t *ctx, ngx_http_limit_req_shard_t *shard,
+    ngx_uint_t hash, ngx_str_t *key);
+static ngx_int_t ngx_http_limit_req_lookup_local(
+    ngx_http_limit_req_limit_t *limit, ngx_uint_t hash, ngx_str_t *key,
+    ngx_uint_t *ep, ngx_uint_t account);
+static ngx_int_t ngx_http_limit_req_sync(ngx_http_limit_req_ctx_t *ctx,
+    ngx_http_limit_req_local_node_t *ln);
+static void ngx_http_limit_req_local_handler(ngx_event_t *ev);
 static ngx_msec_t ngx_http_limit_req_account(ngx_http_limit_req_limit_t *limits,
     ngx_uint_t n, ngx_uint_t *ep, ngx_http_limit_req_limit_t **limit);
 static void ngx_http_limit_req_unlock(ngx_http_limit_req_limit_t *limits,
     ngx_uint_t n);
 static void ngx_http_limit_req_expire(ngx_http_limit_req_ctx_t *ctx,
-    ngx_uint_t n);
+    ngx_http_limit_req_shard_t *shard, ngx_uint_t n);
+static ngx_int_t ngx_http_limit_req_init_shards(ngx_shm_zone_t *shm_zone,
+    ngx_slab_pool_t *shpool);
 
 static ngx_int_t ngx_http_limit_req_status_variable(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t data);
@@ -85,6 +136,7 @@ static char *ngx_http_limit_req(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
 static ngx_int_t ngx_http_limit_req_add_variables(ngx_conf_t *cf);
 static ngx_int_t ngx_http_limit_req_init(ngx_conf_t *cf);
+static ngx_int_t ngx_http_limit_req_init_worker(ngx_cycle_t *cycle);
 
 
 static ngx_conf_enum_t  ngx_http_limit_req_log_levels[] = {
@@ -104,7 +156,7 @@ static ngx_conf_num_bounds_t  ngx_http_limit_req_status_bounds = {
 static ngx_command_t  ngx_http_limit_req_commands[] = {
 
     { ngx_string("limit_req_zone"),
-      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE3,
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE3|NGX_CONF_TAKE4|NGX_CONF_TAKE5,
       ngx_http_limit_req_zone,
       0,
       0,
@@ -164,7 +216,7 @@ ngx_module_t  ngx_http_limit_req_module = {
     NGX_HTTP_MODULE,                       /* module type */
     NULL,                                  /* init master */
     NULL,                                  /* init module */
-    NULL,                                  /* init process */
+    ngx_http_limit_req_init_worker,        /* init process */
     NULL,                                  /* init thread */
     NULL,                                  /* exit thread */
     NULL,                                  /* exit process */
@@ -201,6 +253,7 @@ ngx_http_limit_req_handler(ngx_http_request_t *r)
     ngx_msec_t                   delay;
     ngx_http_limit_req_ctx_t    *ctx;
     ngx_http_limit_req_conf_t   *lrcf;
+    ngx_http_limit_req_shard_t  *shard;
     ngx_http_limit_req_limit_t  *limit, *limits;
 
     if (r->main->limit_req_status) {
@@ -243,12 +296,20 @@ ngx_http_limit_req_handler(ngx_http_request_t *r)
 
         hash = ngx_crc32_short(key.data, key.len);
 
-        ngx_shmtx_lock(&ctx->shpool->mutex);
+        if (ctx->local) {
+            rc = ngx_http_limit_req_lookup_local(limit, hash, &key, &excess,
+                                                 (n == lrcf->limits.nelts - 1));
+
+        } else {
+            shard = &ctx->shards[hash % ctx->nshards];
 
-        rc = ngx_http_limit_req_lookup(limit, hash, &key, &excess,
-                                       (n == lrcf->limits.nelts - 1));
+            ngx_shmtx_lock(&shard->shpool->mutex);
 
-        ngx_shmtx_unlock(&ctx->shpool->mutex);
+            rc = ngx_http_limit_req_lookup(limit, shard, hash, &key, &excess,
+                                           (n == lrcf->limits.nelts - 1));
+
+            ngx_shmtx_unlock(&shard->shpool->mutex);
+        }
 
         ngx_log_debug4(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                        "limit_req[%ui]: %i %ui.%03ui",
@@ -402,10 +463,10 @@ ngx_http_limit_req_rbtree_insert_value(ngx_rbtree_node_t *temp,
 
 
 static ngx_int_t
-ngx_http_limit_req_lookup(ngx_http_limit_req_limit_t *limit, ngx_uint_t hash,
-    ngx_str_t *key, ngx_uint_t *ep, ngx_uint_t account)
+ngx_http_limit_req_lookup(ngx_http_limit_req_limit_t *limit,
+    ngx_http_limit_req_shard_t *shard, ngx_uint_t hash, ngx_str_t *key,
+    ngx_uint_t *ep, ngx_uint_t account)
 {
-    size_t                      size;
     ngx_int_t                   rc, excess;
     ngx_msec_t                  now;
     ngx_msec_int_t              ms;
@@ -417,8 +478,8 @@ ngx_http_limit_req_lookup(ngx_http_limit_req_limit_t *limit, ngx_uint_t hash,
 
     ctx = limit->shm_zone->data;
 
-    node = ctx->sh->rbtree.root;
-    sentinel = ctx->sh->rbtree.sentinel;
+    node = shard->sh->rbtree.root;
+    sentinel = shard->sh->rbtree.sentinel;
 
     while (node != sentinel) {
 
@@ -440,7 +501,7 @@ ngx_http_limit_req_lookup(ngx_http_limit_req_limit_t *limit, ngx_uint_t hash,
 
         if (rc == 0) {
             ngx_queue_remove(&lr->queue);
-            ngx_queue_insert_head(&ctx->sh->queue, &lr->queue);
+            ngx_queue_insert_head(&shard->sh->queue, &lr->queue);
 
             ms = (ngx_msec_int_t) (now - lr->last);
 
@@ -476,6 +537,7 @@ ngx_http_limit_req_lookup(ngx_http_limit_req_limit_t *limit, ngx_uint_t hash,
             lr->count++;
 
             ctx->node = lr;
+            ctx->shard = shard;
 
             return NGX_AGAIN;
         }
@@ -485,22 +547,51 @@ ngx_http_limit_req_lookup(ngx_http_limit_req_limit_t *limit, ngx_uint_t hash,
 
     *ep = 0;
 
+    lr = ngx_http_limit_req_alloc_node(ctx, shard, hash, key);
+    if (lr == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (account) {
+        lr->last = now;
+        lr->count = 0;
+        return NGX_OK;
+    }
+
+    lr->last = 0;
+    lr->count = 1;
+
+    ctx->node = lr;
+    ctx->shard = shard;
+
+    return NGX_AGAIN;
+}
+
+
+static ngx_http_limit_req_node_t *
+ngx_http_limit_req_alloc_node(ngx_http_limit_req_ctx_t *ctx,
+    ngx_http_limit_req_shard_t *shard, ngx_uint_t hash, ngx_str_t *key)
+{
+    size_t                      size;
+    ngx_rbtree_node_t          *node;
+    ngx_http_limit_req_node_t  *lr;
+
     size = offsetof(ngx_rbtree_node_t, color)
            + offsetof(ngx_http_limit_req_node_t, data)
            + key->len;
 
-    ngx_http_limit_req_expire(ctx, 1);
+    ngx_http_limit_req_expire(ctx, shard, 1);
 
-    node = ngx_slab_alloc_locked(ctx->shpool, size);
+    node = ngx_slab_alloc_locked(shard->shpool, size);
 
     if (node == NULL) {
-        ngx_http_limit_req_expire(ctx, 0);
+        ngx_http_limit_req_expire(ctx, shard, 0);
 
-        node = ngx_slab_alloc_locked(ctx->shpool, size);
+        node = ngx_slab_alloc_locked(shard->shpool, size);
         if (node == NULL) {
             ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
-                          "could not allocate node%s", ctx->shpool->log_ctx);
-            return NGX_ERROR;
+                          "could not allocate node%s", shard->shpool->log_ctx);
+            return NULL;
         }
     }
 
@@ -513,22 +604,289 @@ ngx_http_limit_req_lookup(ngx_http_limit_req_limit_t *limit, ngx_uint_t hash,
 
     ngx_memcpy(lr->data, key->data, key->len);
 
-    ngx_rbtree_insert(&ctx->sh->rbtree, node);
+    ngx_rbtree_insert(&shard->sh->rbtree, node);
+
+    ngx_queue_insert_head(&shard->sh->queue, &lr->queue);
+
+    return lr;
+}
+
+
+static ngx_int_t
+ngx_http_limit_req_lookup_local(ngx_http_limit_req_limit_t *limit,
+    ngx_uint_t hash, ngx_str_t *key, ngx_uint_t *ep, ngx_uint_t account)
+{
+    ngx_int_t                         excess;
+    ngx_msec_t                        now;
+    ngx_queue_t                      *q;
+    ngx_msec_int_t                    ms;
+    ngx_str_node_t                   *sn;
+    ngx_http_limit_req_ctx_t         *ctx;
+    ngx_http_limit_req_local_t       *local;
+    ngx_http_limit_req_local_node_t  *ln;
+
+    now = ngx_current_msec;
+
+    ctx = limit->shm_zone->data;
+    local = ctx->local;
+
+    sn = ngx_str_rbtree_lookup(&local->rbtree, key, hash);
+
+    if (sn) {
+        ln = (ngx_http_limit_req_local_node_t *) sn;
+
+        ngx_queue_remove(&ln->queue);
+
+        if ((ngx_msec_int_t) (now - ln->synced) >= (ngx_msec_int_t) ctx->sync) {
+            (void) ngx_http_limit_req_sync(ctx, ln);
+        }
+
+    } else {
+
+        if (local->nodes >= NGX_HTTP_LIMIT_REQ_LOCAL_MAX) {
+            q = ngx_queue_last(&local->queue);
+            ln = ngx_queue_data(q, ngx_http_limit_req_local_node_t, queue);
 
-    ngx_queue_insert_head(&ctx->sh->queue, &lr->queue);
+            if (ln->pending) {
+                (void) ngx_http_limit_req_sync(ctx, ln);
+            }
+
+            ngx_queue_remove(q);
+            ngx_rbtree_delete(&local->rbtree, &ln->sn.node);
+            ngx_free(ln);
+
+            local->nodes--;
+        }
+
+        ln = ngx_alloc(offsetof(ngx_http_limit_req_local_node_t, data)
+                       + key->len, ngx_cycle->log);
+        if (ln == NULL) {
+            return NGX_ERROR;
+        }
+
+        ngx_memcpy(ln->data, key->data, key->len);
+
+        ln->sn.node.key = hash;
+        ln->sn.str.len = key->len;
+        ln->sn.str.data = ln->data;
+        ln->excess = 0;
+        ln->pending = 0;
+
+        ngx_rbtree_insert(&local->rbtree, &ln->sn.node);
+
+        local->nodes++;
+
+        /* start from the shared state */
+
+        if (ngx_http_limit_req_sync(ctx, ln) != NGX_OK) {
+            ln->last = now;
+            ln->synced = now;
+        }
+    }
+
+    ngx_queue_insert_head(&local->queue, &ln->queue);
+
+    ln->accessed = now;
+
+    ms = (ngx_msec_int_t) (now - ln->last);
+
+    if (ms < -60000) {
+        ms = 1;
+
+    } else if (ms < 0) {
+        ms = 0;
+    }
+
+    excess = ln->excess - ctx->rate * ms / 1000 + 1000;
+
+    if (excess < 0) {
+        excess = 0;
+    }
+
+    *ep = excess;
+
+    if ((ngx_uint_t) excess > limit->burst) {
+        return NGX_BUSY;
+    }
 
     if (account) {
+        ln->excess = excess;
+        ln->pending += 1000;
+
+        if (ms) {
+            ln->last = now;
+        }
+
+        return NGX_OK;
+    }
+
+    ctx->local_node = ln;
+
+    return NGX_AGAIN;
+}
+
+
+static ngx_int_t
+ngx_http_limit_req_sync(ngx_http_limit_req_ctx_t *ctx,
+    ngx_http_limit_req_local_node_t *ln)
+{
+    ngx_int_t                    rc, excess;
+    ngx_msec_t                   now;
+    ngx_msec_int_t               ms;
+    ngx_rbtree_node_t           *node, *sentinel;
+    ngx_http_limit_req_node_t   *lr;
+    ngx_http_limit_req_shard_t  *shard;
+
+    now = ngx_current_msec;
+
+    shard = &ctx->shards[ln->sn.node.key % ctx->nshards];
+
+    ngx_shmtx_lock(&shard->shpool->mutex);
+
+    node = shard->sh->rbtree.root;
+    sentinel = shard->sh->rbtree.sentinel;
+
+    lr = NULL;
+
+    while (node != sentinel) {
+
+        if (ln->sn.node.key < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (ln->sn.node.key > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        /* ln->sn.node.key == node->key */
+
+        lr = (ngx_http_limit_req_node_t *) &node->color;
+
+        rc = ngx_memn2cmp(ln->sn.str.data, lr->data, ln->sn.str.len,
+                          (size_t) lr->len);
+
+        if (rc == 0) {
+            break;
+        }
+
+        lr = NULL;
+
+        node = (rc < 0) ? node->left : node->right;
+    }
+
+    if (lr == NULL) {
+
+        if (ln->pending == 0) {
+            ngx_shmtx_unlock(&shard->shpool->mutex);
+
+            ln->excess = 0;
+            ln->last = now;
+            ln->synced = now;
+
+            return NGX_OK;
+        }
+
+        lr = ngx_http_limit_req_alloc_node(ctx, shard, ln->sn.node.key,
+                                           &ln->sn.str);
+        if (lr == NULL) {
+            ngx_shmtx_unlock(&shard->shpool->mutex);
+            return NGX_ERROR;
+        }
+
         lr->last = now;
         lr->count = 0;
-        return NGX_OK;
+
+    } else {
+        ngx_queue_remove(&lr->queue);
+        ngx_queue_insert_head(&shard->sh->queue, &lr->queue);
     }
 
-    lr->last = 0;
-    lr->count = 1;
+    ms = (ngx_msec_int_t) (now - lr->last);
 
-    ctx->node = lr;
+    if (ms < -60000) {
+        ms = 1;
 
-    return NGX_AGAIN;
+    } else if (ms < 0) {
+        ms = 0;
+    }
+
+    excess = lr->excess - ctx->rate * ms / 1000;
+
+    if (excess < 0) {
+        excess = 0;
+    }
+
+    excess += ln->pending;
+
+    lr->excess = excess;
+    lr->last = now;
+
+    ngx_shmtx_unlock(&shard->shpool->mutex);
+
+    ngx_log_debug4(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "limit_req sync \"%V\": %ui pending, %ui.%03ui excess",
+                   &ln->sn.str, ln->pending / 1000,
+                   excess / 1000, excess % 1000);
+
+    ln->excess = excess;
+    ln->pending = 0;
+    ln->last = now;
+    ln->synced = now;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_limit_req_local_handler(ngx_event_t *ev)
+{
+    ngx_msec_t                        now;
+    ngx_queue_t                      *q;
+    ngx_http_limit_req_ctx_t         *ctx;
+    ngx_http_limit_req_local_t       *local;
+    ngx_http_limit_req_local_node_t  *ln;
+
+    ctx = ev->data;
+    local = ctx->local;
+
+    now = ngx_current_msec;
+
+    /*
+     * flush the state of keys not seen during the last interval
+     * and forget those idle for a minute
+     */
+
+    for (q = ngx_queue_last(&local->queue);
+         q != ngx_queue_sentinel(&local->queue);
+         /* void */)
+    {
+        ln = ngx_queue_data(q, ngx_http_limit_req_local_node_t, queue);
+
+        if ((ngx_msec_int_t) (now - ln->accessed) < (ngx_msec_int_t) ctx->sync)
+        {
+            break;
+        }
+
+        q = ngx_queue_prev(q);
+
+        if (ln->pending) {
+            if (ngx_http_limit_req_sync(ctx, ln) != NGX_OK) {
+                continue;
+            }
+        }
+
+        if ((ngx_msec_int_t) (now - ln->accessed) >= 60000) {
+            ngx_queue_remove(&ln->queue);
+            ngx_rbtree_delete(&local->rbtree, &ln->sn.node);
+            ngx_free(ln);
+
+            local->nodes--;
+        }
+    }
+
+    ngx_add_timer(ev, ctx->sync);
 }
 
 
@@ -536,11 +894,12 @@ static ngx_msec_t
 ngx_http_limit_req_account(ngx_http_limit_req_limit_t *limits, ngx_uint_t n,
     ngx_uint_t *ep, ngx_http_limit_req_limit_t **limit)
 {
-    ngx_int_t                   excess;
-    ngx_msec_t                  now, delay, max_delay;
-    ngx_msec_int_t              ms;
-    ngx_http_limit_req_ctx_t   *ctx;
-    ngx_http_limit_req_node_t  *lr;
+    ngx_int_t                         excess;
+    ngx_msec_t                        now, delay, max_delay;
+    ngx_msec_int_t                    ms;
+    ngx_http_limit_req_ctx_t         *ctx;
+    ngx_http_limit_req_node_t        *lr;
+    ngx_http_limit_req_local_node_t  *ln;
 
     excess = *ep;
 
@@ -555,12 +914,42 @@ ngx_http_limit_req_account(ngx_http_limit_req_limit_t *limits, ngx_uint_t n,
     while (n--) {
         ctx = limits[n].shm_zone->data;
         lr = ctx->node;
+        ln = ctx->local_node;
+
+        if (ln) {
+            now = ngx_current_msec;
+            ms = (ngx_msec_int_t) (now - ln->last);
+
+            if (ms < -60000) {
+                ms = 1;
+
+            } else if (ms < 0) {
+                ms = 0;
+            }
+
+            excess = ln->excess - ctx->rate * ms / 1000 + 1000;
+
+            if (excess < 0) {
+                excess = 0;
+            }
+
+            if (ms) {
+                ln->last = now;
+            }
+
+            ln->excess = excess;
+            ln->pending += 1000;
+
+            ctx->local_node = NULL;
+
+            goto accounted;
+        }
 
         if (lr == NULL) {
             continue;
         }
 
-        ngx_shmtx_lock(&ctx->shpool->mutex);
+        ngx_shmtx_lock(&ctx->shard->shpool->mutex);
 
         now = ngx_current_msec;
         ms = (ngx_msec_int_t) (now - lr->last);
@@ -585,10 +974,12 @@ ngx_http_limit_req_account(ngx_http_limit_req_limit_t *limits, ngx_uint_t n,
         lr->excess = excess;
         lr->count--;
 
-        ngx_shmtx_unlock(&ctx->shpool->mutex);
+        ngx_shmtx_unlock(&ctx->shard->shpool->mutex);
 
         ctx->node = NULL;
 
+    accounted:
+
         if ((ngx_uint_t) excess <= limits[n].delay) {
             continue;
         }
@@ -614,15 +1005,17 @@ ngx_http_limit_req_unlock(ngx_http_limit_req_limit_t *limits, ngx_uint_t n)
     while (n--) {
         ctx = limits[n].shm_zone->data;
 
+        ctx->local_node = NULL;
+
         if (ctx->node == NULL) {
             continue;
         }
 
-        ngx_shmtx_lock(&ctx->shpool->mutex);
+        ngx_shmtx_lock(&ctx->shard->shpool->mutex);
 
         ctx->node->count--;
 
-        ngx_shmtx_unlock(&ctx->shpool->mutex);
+        ngx_shmtx_unlock(&ctx->shard->shpool->mutex);
 
         ctx->node = NULL;
     }
@@ -630,7 +1023,8 @@ ngx_http_limit_req_unlock(ngx_http_limit_req_limit_t *limits, ngx_uint_t n)
 
 
 static void
-ngx_http_limit_req_expire(ngx_http_limit_req_ctx_t *ctx, ngx_uint_t n)
+ngx_http_limit_req_expire(ngx_http_limit_req_ctx_t *ctx,
+    ngx_http_limit_req_shard_t *shard, ngx_uint_t n)
 {
     ngx_int_t                   excess;
     ngx_msec_t                  now;
@@ -649,11 +1043,11 @@ ngx_http_limit_req_expire(ngx_http_limit_req_ctx_t *ctx, ngx_uint_t n)
 
     while (n < 3) {
 
-        if (ngx_queue_empty(&ctx->sh->queue)) {
+        if (ngx_queue_empty(&shard->sh->queue)) {
             return;
         }
 
-        q = ngx_queue_last(&ctx->sh->queue);
+        q = ngx_queue_last(&shard->sh->queue);
 
         lr = ngx_queue_data(q, ngx_http_limit_req_node_t, queue);
 
@@ -688,9 +1082,9 @@ ngx_http_limit_req_expire(ngx_http_limit_req_ctx_t *ctx, ngx_uint_t n)
         node = (ngx_rbtree_node_t *)
                    ((u_char *) lr - offsetof(ngx_rbtree_node_t, color));
 
-        ngx_rbtree_delete(&ctx->sh->rbtree, node);
+        ngx_rbtree_delete(&shard->sh->rbtree, node);
 
-        ngx_slab_free_locked(ctx->shpool, node);
+        ngx_slab_free_locked(shard->shpool, node);
     }
 }
 
@@ -700,8 +1094,10 @@ ngx_http_limit_req_init_zone(ngx_shm_zone_t *shm_zone, void *data)
 {
     ngx_http_limit_req_ctx_t  *octx = data;
 
-    size_t                     len;
-    ngx_http_limit_req_ctx_t  *ctx;
+    size_t                       len;
+    ngx_slab_pool_t             *shpool;
+    ngx_http_limit_req_ctx_t    *ctx;
+    ngx_http_limit_req_shctx_t  *sh;
 
     ctx = shm_zone->data;
 
@@ -719,43 +1115,151 @@ ngx_http_limit_req_init_zone(ngx_shm_zone_t *shm_zone, void *data)
             return NGX_ERROR;
         }
 
-        ctx->sh = octx->sh;
-        ctx->shpool = octx->shpool;
+        if (ctx->nshards != octx->nshards) {
+            ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                          "limit_req \"%V\" uses %ui shards "
+                          "while previously it used %ui shards",
+                          &shm_zone->shm.name, ctx->nshards, octx->nshards);
+            return NGX_ERROR;
+        }
+
+        ngx_memcpy(ctx->shards, octx->shards,
+                   ctx->nshards * sizeof(ngx_http_limit_req_shard_t));
 
         return NGX_OK;
     }
 
-    ctx->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
 
     if (shm_zone->shm.exists) {
-        ctx->sh = ctx->shpool->data;
+
+        if (ctx->nshards == 1) {
+            ctx->shards[0].sh = shpool->data;
+            ctx->shards[0].shpool = shpool;
+
+        } else {
+            ngx_memcpy(ctx->shards, shpool->data,
+                       ctx->nshards * sizeof(ngx_http_limit_req_shard_t));
+        }
 
         return NGX_OK;
     }
 
-    ctx->sh = ngx_slab_alloc(ctx->shpool, sizeof(ngx_http_limit_req_shctx_t));
-    if (ctx->sh == NULL) {
+    if (ctx->nshards > 1) {
+        return ngx_http_limit_req_init_shards(shm_zone, shpool);
+    }
+
+    sh = ngx_slab_alloc(shpool, sizeof(ngx_http_limit_req_shctx_t));
+    if (sh == NULL) {
         return NGX_ERROR;
     }
 
-    ctx->shpool->data = ctx->sh;
+    shpool->data = sh;
 
-    ngx_rbtree_init(&ctx->sh->rbtree, &ctx->sh->sentinel,
+    ngx_rbtree_init(&sh->rbtree, &sh->sentinel,
                     ngx_http_limit_req_rbtree_insert_value);
 
-    ngx_queue_init(&ctx->sh->queue);
+    ngx_queue_init(&sh->queue);
+
+    ctx->shards[0].sh = sh;
+    ctx->shards[0].shpool = shpool;
 
     len = sizeof(" in limit_req zone \"\"") + shm_zone->shm.name.len;
 
-    ctx->shpool->log_ctx = ngx_slab_alloc(ctx->shpool, len);
-    if (ctx->shpool->log_ctx == NULL) {
+    shpool->log_ctx = ngx_slab_alloc(shpool, len);
+    if (shpool->log_ctx == NULL) {
         return NGX_ERROR;
     }
 
-    ngx_sprintf(ctx->shpool->log_ctx, " in limit_req zone \"%V\"%Z",
+    ngx_sprintf(shpool->log_ctx, " in limit_req zone \"%V\"%Z",
                 &shm_zone->shm.name);
 
-    ctx->shpool->log_nomem = 0;
+    shpool->log_nomem = 0;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_limit_req_init_shards(ngx_shm_zone_t *shm_zone,
+    ngx_slab_pool_t *shpool)
+{
+    u_char                      *p;
+    size_t                       len, size;
+    ngx_uint_t                   i;
+    ngx_slab_pool_t             *sp;
+    ngx_http_limit_req_ctx_t    *ctx;
+    ngx_http_limit_req_shard_t  *shards;
+    ngx_http_limit_req_shctx_t  *sh;
+
+    ctx = shm_zone->data;
+
+    shards = ngx_slab_alloc(shpool,
+                            ctx->nshards * sizeof(ngx_http_limit_req_shard_t));
+    if (shards == NULL) {
+        return NGX_ERROR;
+    }
+
+    shpool->data = shards;
+
+    len = sizeof(" in limit_req zone \"\"") + shm_zone->shm.name.len;
+
+    shpool->log_ctx = ngx_slab_alloc(shpool, len);
+    if (shpool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(shpool->log_ctx, " in limit_req zone \"%V\"%Z",
+                &shm_zone->shm.name);
+
+    shpool->log_nomem = 0;
+
+    /*
+     * the rest of the zone is split into equal slab pools,
+     * each one has its own mutex, rbtree and LRU queue
+     */
+
+    size = shpool->pfree / ctx->nshards * ngx_pagesize;
+
+    for (i = 0; i < ctx->nshards; i++) {
+
+        p = ngx_slab_alloc(shpool, size);
+        if (p == NULL) {
+            return NGX_ERROR;
+        }
+
+        sp = (ngx_slab_pool_t *) p;
+
+        sp->end = p + size;
+        sp->min_shift = 3;
+        sp->addr = p;
+
+        if (ngx_shmtx_create(&sp->mutex, &sp->lock, NULL) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        ngx_slab_init(sp);
+
+        sh = ngx_slab_alloc(sp, sizeof(ngx_http_limit_req_shctx_t));
+        if (sh == NULL) {
+            return NGX_ERROR;
+        }
+
+        sp->data = sh;
+        sp->log_ctx = shpool->log_ctx;
+        sp->log_nomem = 0;
+
+        ngx_rbtree_init(&sh->rbtree, &sh->sentinel,
+                        ngx_http_limit_req_rbtree_insert_value);
+
+        ngx_queue_init(&sh->queue);
+
+        shards[i].sh = sh;
+        shards[i].shpool = sp;
+    }
+
+    ngx_memcpy(ctx->shards, shards,
+               ctx->nshards * sizeof(ngx_http_limit_req_shard_t));
 
     return NGX_OK;
 }
@@ -836,8 +1340,9 @@ ngx_http_limit_req_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     size_t                             len;
     ssize_t                            size;
     ngx_str_t                         *value, name, s;
-    ngx_int_t                          rate, scale;
+    ngx_int_t                          rate, scale, shards;
     ngx_uint_t                         i;
+    ngx_msec_t                         sync;
     ngx_shm_zone_t                    *shm_zone;
     ngx_http_limit_req_ctx_t          *ctx;
     ngx_http_compile_complex_value_t   ccv;
@@ -862,6 +1367,8 @@ ngx_http_limit_req_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     size = 0;
     rate = 1;
     scale = 1;
+    shards = 1;
+    sync = 0;
     name.len = 0;
 
     for (i = 2; i < cf->args->nelts; i++) {
@@ -924,6 +1431,48 @@ ngx_http_limit_req_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             continue;
         }
 
+        if (ngx_strncmp(value[i].data, "shards=", 7) == 0) {
+
+            shards = ngx_atoi(value[i].data + 7, value[i].len - 7);
+            if (shards <= 0 || shards > NGX_HTTP_LIMIT_REQ_MAX_SHARDS) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid shards value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+#if !(NGX_HAVE_ATOMIC_OPS)
+            if (shards > 1) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "\"%V\" is not supported "
+                                   "on this platform", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+#endif
+
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "approximate") == 0) {
+            sync = 100;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "approximate=", 12) == 0) {
+
+            s.len = value[i].len - 12;
+            s.data = value[i].data + 12;
+
+            sync = ngx_parse_time(&s, 0);
+            if (sync == (ngx_msec_t) NGX_ERROR || sync == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid approximate value \"%V\"",
+                                   &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
         ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
                            "invalid parameter \"%V\"", &value[i]);
         return NGX_CONF_ERROR;
@@ -936,7 +1485,24 @@ ngx_http_limit_req_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         return NGX_CONF_ERROR;
     }
 
+    if (shards > 1
+        && size < (ssize_t) ((shards * 8 + 1) * ngx_pagesize))
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "zone \"%V\" is too small for %i shards",
+                           &name, shards);
+        return NGX_CONF_ERROR;
+    }
+
     ctx->rate = rate * 1000 / scale;
+    ctx->nshards = shards;
+    ctx->sync = sync;
+
+    ctx->shards = ngx_pcalloc(cf->pool,
+                              shards * sizeof(ngx_http_limit_req_shard_t));
+    if (ctx->shards == NULL) {
+        return NGX_CONF_ERROR;
+    }
 
     shm_zone = ngx_shared_memory_add(cf, &name, size,
                                      &ngx_http_limit_req_module);
@@ -1083,6 +1649,70 @@ ngx_http_limit_req_add_variables(ngx_conf_t *cf)
 }
 
 
+static ngx_int_t
+ngx_http_limit_req_init_worker(ngx_cycle_t *cycle)
+{
+    ngx_uint_t                   i;
+    ngx_shm_zone_t              *shm_zone;
+    ngx_list_part_t             *part;
+    ngx_http_limit_req_ctx_t    *ctx;
+    ngx_http_limit_req_local_t  *local;
+
+    if (ngx_process != NGX_PROCESS_WORKER
+        && ngx_process != NGX_PROCESS_SINGLE)
+    {
+        return NGX_OK;
+    }
+
+    part = &cycle->shared_memory.part;
+    shm_zone = part->elts;
+
+    for (i = 0; /* void */ ; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+
+            part = part->next;
+            shm_zone = part->elts;
+            i = 0;
+        }
+
+        if (shm_zone[i].tag != &ngx_http_limit_req_module) {
+            continue;
+        }
+
+        ctx = shm_zone[i].data;
+
+        if (ctx == NULL || ctx->sync == 0) {
+            continue;
+        }
+
+        local = ngx_pcalloc(cycle->pool, sizeof(ngx_http_limit_req_local_t));
+        if (local == NULL) {
+            return NGX_ERROR;
+        }
+
+        ngx_rbtree_init(&local->rbtree, &local->sentinel,
+                        ngx_str_rbtree_insert_value);
+
+        ngx_queue_init(&local->queue);
+
+        local->event.handler = ngx_http_limit_req_local_handler;
+        local->event.data = ctx;
+        local->event.log = cycle->log;
+        local->event.cancelable = 1;
+
+        ngx_add_timer(&local->event, ctx->sync);
+
+        ctx->local = local;
+    }
+
+    return NGX_OK;
+}
+
+
 static ngx_int_t
 ngx_http_limit_req_init(ngx_conf_t *cf)
 {
@@ -141,9 +141,20 @@ typedef struct {
     ngx_chain_t                   *free;
     ngx_chain_t                   *busy;
 
+#if (NGX_HTTP_V2)
+    ngx_uint_t                     frame_state;
+    ngx_uint_t                     frame_type;
+    ngx_uint_t                     frame_flags;
+    size_t                         frame_size;
+    off_t                          length;
+#endif
+
     unsigned                       head:1;
     unsigned                       internal_chunked:1;
     unsigned                       header_sent:1;
+#if (NGX_HTTP_V2)
+    unsigned                       end_stream:1;
+#endif
 } ngx_http_proxy_ctx_t;
 
 
@@ -166,6 +177,22 @@ static ngx_int_t ngx_http_proxy_non_buffered_copy_filter(void *data,
     ssize_t bytes);
 static ngx_int_t ngx_http_proxy_non_buffered_chunked_filter(void *data,
     ssize_t bytes);
+#if (NGX_HTTP_V2)
+static ngx_int_t ngx_http_proxy_create_v2_request(ngx_http_request_t *r);
+static u_char *ngx_http_proxy_write_v2_frame_header(u_char *p, size_t len,
+    ngx_uint_t type, ngx_uint_t flags);
+static ngx_uint_t ngx_http_proxy_v2_hop_by_hop(u_char *name, size_t len);
+static ngx_int_t ngx_http_proxy_v2_body_output_filter(void *data,
+    ngx_chain_t *in);
+static ngx_int_t ngx_http_proxy_process_v2_header(ngx_http_request_t *r);
+static ngx_int_t ngx_http_proxy_v2_filter_init(void *data);
+static ngx_int_t ngx_http_proxy_parse_v2_frame(ngx_http_request_t *r,
+    ngx_buf_t *b, ngx_http_proxy_ctx_t *ctx);
+static ngx_int_t ngx_http_proxy_v2_filter(ngx_event_pipe_t *p,
+    ngx_buf_t *buf);
+static ngx_int_t ngx_http_proxy_non_buffered_v2_filter(void *data,
+    ssize_t bytes);
+#endif
 static void ngx_http_proxy_abort_request(ngx_http_request_t *r);
 static void ngx_http_proxy_finalize_request(ngx_http_request_t *r,
     ngx_int_t rc);
@@ -288,6 +315,9 @@ static ngx_conf_post_t  ngx_http_proxy_ssl_conf_command_post =
 static ngx_conf_enum_t  ngx_http_proxy_http_version[] = {
     { ngx_string("1.0"), NGX_HTTP_VERSION_10 },
     { ngx_string("1.1"), NGX_HTTP_VERSION_11 },
+#if (NGX_HTTP_V2)
+    { ngx_string("2"), NGX_HTTP_VERSION_20 },
+#endif
     { ngx_null_string, 0 }
 };
 
@@ -1011,12 +1041,26 @@ ngx_http_proxy_handler(ngx_http_request_t *r)
     u->input_filter = ngx_http_proxy_non_buffered_copy_filter;
     u->input_filter_ctx = r;
 
+#if (NGX_HTTP_V2)
+
+    if (plcf->http_version == NGX_HTTP_VERSION_20) {
+        u->http2 = 1;
+
+        u->create_request = ngx_http_proxy_create_v2_request;
+        u->process_header = ngx_http_proxy_process_v2_header;
+        u->pipe->input_filter = ngx_http_proxy_v2_filter;
+        u->input_filter_init = ngx_http_proxy_v2_filter_init;
+        u->input_filter = ngx_http_proxy_non_buffered_v2_filter;
+    }
+
+#endif
+
     u->accel = 1;
 
     if (!plcf->upstream.request_buffering
         && plcf->body_values == NULL && plcf->upstream.pass_request_body
         && (!r->headers_in.chunked
-            || plcf->http_version == NGX_HTTP_VERSION_11))
+            || plcf->http_version != NGX_HTTP_VERSION_10))
     {
         r->request_body_no_buffering = 1;
     }
@@ -1622,6 +1666,22 @@ ngx_http_proxy_reinit_request(ngx_http_request_t *r)
     ctx->status.start = NULL;
     ctx->status.end = NULL;
     ctx->chunked.state = 0;
+    ctx->header_sent = 0;
+
+#if (NGX_HTTP_V2)
+
+    if (r->upstream->http2) {
+        ctx->frame_state = 0;
+        ctx->end_stream = 0;
+
+        r->upstream->process_header = ngx_http_proxy_process_v2_header;
+        r->upstream->pipe->input_filter = ngx_http_proxy_v2_filter;
+        r->upstream->input_filter = ngx_http_proxy_non_buffered_v2_filter;
+
+        return NGX_OK;
+    }
+
+#endif
 
     r->upstream->process_header = ngx_http_proxy_process_status_line;
     r->upstream->pipe->input_filter = ngx_http_proxy_copy_filter;
@@ -2489,6 +2549,1362 @@ ngx_http_proxy_non_buffered_chunked_filter(void *data, ssize_t bytes)
 }
 
 
+#if (NGX_HTTP_V2)
+
+static ngx_int_t
+ngx_http_proxy_create_v2_request(ngx_http_request_t *r)
+{
+    u_char                       *p, *tmp, *key_tmp, *val_tmp, *enc,
+                                 *authority, *headers_frame;
+    size_t                        len, tmp_len, uri_len, loc_len, body_len,
+                                  key_len, val_len;
+    uintptr_t                     escape;
+    ngx_buf_t                    *b;
+    ngx_str_t                     method;
+    ngx_uint_t                    i, next, unparsed_uri, end_stream;
+    ngx_chain_t                  *cl, *body;
+    ngx_list_part_t              *part;
+    ngx_table_elt_t              *header;
+    ngx_http_upstream_t          *u;
+    ngx_http_proxy_ctx_t         *ctx;
+    ngx_http_script_code_pt       code;
+    ngx_http_proxy_headers_t     *headers;
+    ngx_http_script_engine_t      e, le;
+    ngx_http_proxy_loc_conf_t    *plcf;
+    ngx_http_script_len_code_pt   lcode;
+
+    u = r->upstream;
+
+    plcf = ngx_http_get_module_loc_conf(r, ngx_http_proxy_module);
+
+#if (NGX_HTTP_CACHE)
+    headers = u->cacheable ? &plcf->headers_cache : &plcf->headers;
+#else
+    headers = &plcf->headers;
+#endif
+
+    if (u->method.len) {
+        /* HEAD was changed to GET to cache response */
+        method = u->method;
+
+    } else if (plcf->method) {
+        if (ngx_http_complex_value(r, plcf->method, &method) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+    } else {
+        method = r->method_name;
+    }
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_proxy_module);
+
+    if (method.len == 4
+        && ngx_strncasecmp(method.data, (u_char *) "HEAD", 4) == 0)
+    {
+        ctx->head = 1;
+    }
+
+    len = NGX_HTTP_V2_FRAME_HEADER_SIZE;
+
+    /* :method header */
+
+    len += 1 + NGX_HTTP_V2_INT_OCTETS + method.len;
+    tmp_len = method.len;
+
+    /* :scheme header */
+
+    len += 1;
+
+    /* :path header */
+
+    escape = 0;
+    loc_len = 0;
+    unparsed_uri = 0;
+
+    if (plcf->proxy_lengths && ctx->vars.uri.len) {
+        uri_len = ctx->vars.uri.len;
+
+    } else if (ctx->vars.uri.len == 0 && r->valid_unparsed_uri) {
+        unparsed_uri = 1;
+        uri_len = r->unparsed_uri.len;
+
+    } else {
+        loc_len = (r->valid_location && ctx->vars.uri.len) ?
+                      plcf->location.len : 0;
+
+        if (r->quoted_uri || r->space_in_uri || r->internal) {
+            escape = 2 * ngx_escape_uri(NULL, r->uri.data + loc_len,
+                                        r->uri.len - loc_len, NGX_ESCAPE_URI);
+        }
+
+        uri_len = ctx->vars.uri.len + r->uri.len - loc_len + escape
+                  + sizeof("?") - 1 + r->args.len;
+    }
+
+    if (uri_len == 0) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "zero length URI to proxy");
+        return NGX_ERROR;
+    }
+
+    len += 1 + NGX_HTTP_V2_INT_OCTETS + uri_len;
+
+    if (tmp_len < uri_len) {
+        tmp_len = uri_len;
+    }
+
+    ngx_memzero(&le, sizeof(ngx_http_script_engine_t));
+
+    ngx_http_script_flush_no_cacheable_variables(r, plcf->body_flushes);
+    ngx_http_script_flush_no_cacheable_variables(r, headers->flushes);
+
+    body_len = 0;
+
+    if (plcf->body_lengths) {
+        le.ip = plcf->body_lengths->elts;
+        le.request = r;
+        le.flushed = 1;
+
+        while (*(uintptr_t *) le.ip) {
+            lcode = *(ngx_http_script_len_code_pt *) le.ip;
+            body_len += lcode(&le);
+        }
+
+        ctx->internal_body_length = body_len;
+
+    } else if (r->headers_in.chunked && r->reading_body) {
+        ctx->internal_body_length = -1;
+        ctx->internal_chunked = 1;
+
+    } else {
+        ctx->internal_body_length = r->headers_in.content_length_n;
+    }
+
+    /* headers, the "Host" header is sent as the :authority header */
+
+    le.ip = headers->lengths->elts;
+    le.request = r;
+    le.flushed = 1;
+
+    while (*(uintptr_t *) le.ip) {
+
+        lcode = *(ngx_http_script_len_code_pt *) le.ip;
+        key_len = lcode(&le);
+
+        for (val_len = 0; *(uintptr_t *) le.ip; val_len += lcode(&le)) {
+            lcode = *(ngx_http_script_len_code_pt *) le.ip;
+        }
+        le.ip += sizeof(uintptr_t);
+
+        if (val_len == 0) {
+            continue;
+        }
+
+        len += 1 + NGX_HTTP_V2_INT_OCTETS + key_len
+                 + NGX_HTTP_V2_INT_OCTETS + val_len;
+
+        if (tmp_len < key_len) {
+            tmp_len = key_len;
+        }
+
+        if (tmp_len < val_len) {
+            tmp_len = val_len;
+        }
+    }
+
+    if (plcf->upstream.pass_request_headers) {
+        part = &r->headers_in.headers.part;
+        header = part->elts;
+
+        for (i = 0; /* void */; i++) {
+
+            if (i >= part->nelts) {
+                if (part->next == NULL) {
+                    break;
+                }
+
+                part = part->next;
+                header = part->elts;
+                i = 0;
+            }
+
+            if (ngx_hash_find(&headers->hash, header[i].hash,
+                              header[i].lowcase_key, header[i].key.len))
+            {
+                continue;
+            }
+
+            len += 1 + NGX_HTTP_V2_INT_OCTETS + header[i].key.len
+                     + NGX_HTTP_V2_INT_OCTETS + header[i].value.len;
+
+            if (tmp_len < header[i].key.len) {
+                tmp_len = header[i].key.len;
+            }
+
+            if (tmp_len < header[i].value.len) {
+                tmp_len = header[i].value.len;
+            }
+        }
+    }
+
+    /* continuation frames */
+
+    len += NGX_HTTP_V2_FRAME_HEADER_SIZE
+           * (len / NGX_HTTP_V2_DEFAULT_FRAME_SIZE);
+
+    /* data frame with the body set by proxy_set_body */
+
+    if (body_len) {
+        len += NGX_HTTP_V2_FRAME_HEADER_SIZE + body_len;
+    }
+
+    b = ngx_create_temp_buf(r->pool, len);
+    if (b == NULL) {
+        return NGX_ERROR;
+    }
+
+    cl = ngx_alloc_chain_link(r->pool);
+    if (cl == NULL) {
+        return NGX_ERROR;
+    }
+
+    cl->buf = b;
+
+    tmp = ngx_palloc(r->pool, tmp_len * 4 + 1 + NGX_HTTP_V2_INT_OCTETS);
+    if (tmp == NULL) {
+        return NGX_ERROR;
+    }
+
+    key_tmp = tmp + tmp_len;
+    val_tmp = tmp + 2 * tmp_len;
+    enc = tmp + 3 * tmp_len;
+
+    /* headers frame */
+
+    headers_frame = b->last;
+    b->last = ngx_http_proxy_write_v2_frame_header(b->last, 0,
+                                                   NGX_HTTP_V2_HEADERS_FRAME,
+                                                   NGX_HTTP_V2_NO_FLAG);
+
+    if (method.len == 3 && ngx_strncmp(method.data, "GET", 3) == 0) {
+        *b->last++ = ngx_http_v2_indexed(NGX_HTTP_V2_METHOD_GET_INDEX);
+
+    } else if (method.len == 4 && ngx_strncmp(method.data, "POST", 4) == 0) {
+        *b->last++ = ngx_http_v2_indexed(NGX_HTTP_V2_METHOD_POST_INDEX);
+
+    } else {
+        *b->last++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_METHOD_INDEX);
+        b->last = ngx_http_v2_write_value(b->last, method.data, method.len,
+                                          tmp);
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http proxy header: \":method: %V\"", &method);
+
+#if (NGX_HTTP_SSL)
+    if (u->ssl) {
+        *b->last++ = ngx_http_v2_indexed(NGX_HTTP_V2_SCHEME_HTTPS_INDEX);
+
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http proxy header: \":scheme: https\"");
+    } else
+#endif
+    {
+        *b->last++ = ngx_http_v2_indexed(NGX_HTTP_V2_SCHEME_HTTP_INDEX);
+
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http proxy header: \":scheme: http\"");
+    }
+
+    u->uri.data = ngx_pnalloc(r->pool, uri_len);
+    if (u->uri.data == NULL) {
+        return NGX_ERROR;
+    }
+
+    p = u->uri.data;
+
+    if (plcf->proxy_lengths && ctx->vars.uri.len) {
+        p = ngx_copy(p, ctx->vars.uri.data, ctx->vars.uri.len);
+
+    } else if (unparsed_uri) {
+        p = ngx_copy(p, r->unparsed_uri.data, r->unparsed_uri.len);
+
+    } else {
+        if (r->valid_location) {
+            p = ngx_copy(p, ctx->vars.uri.data, ctx->vars.uri.len);
+        }
+
+        if (escape) {
+            ngx_escape_uri(p, r->uri.data + loc_len,
+                           r->uri.len - loc_len, NGX_ESCAPE_URI);
+            p += r->uri.len - loc_len + escape;
+
+        } else {
+            p = ngx_copy(p, r->uri.data + loc_len, r->uri.len - loc_len);
+        }
+
+        if (r->args.len > 0) {
+            *p++ = '?';
+            p = ngx_copy(p, r->args.data, r->args.len);
+        }
+    }
+
+    u->uri.len = p - u->uri.data;
+
+    if (u->uri.len == 1 && u->uri.data[0] == '/') {
+        *b->last++ = ngx_http_v2_indexed(NGX_HTTP_V2_PATH_ROOT_INDEX);
+
+    } else {
+        *b->last++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_PATH_INDEX);
+        b->last = ngx_http_v2_write_value(b->last, u->uri.data, u->uri.len,
+                                          tmp);
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http proxy header: \":path: %V\"", &u->uri);
+
+    /* the :authority header is inserted here if "Host" is found */
+
+    authority = b->last;
+
+    ngx_memzero(&e, sizeof(ngx_http_script_engine_t));
+
+    e.ip = headers->values->elts;
+    e.request = r;
+    e.flushed = 1;
+
+    le.ip = headers->lengths->elts;
+
+    while (*(uintptr_t *) le.ip) {
+
+        lcode = *(ngx_http_script_len_code_pt *) le.ip;
+        key_len = lcode(&le);
+
+        for (val_len = 0; *(uintptr_t *) le.ip; val_len += lcode(&le)) {
+            lcode = *(ngx_http_script_len_code_pt *) le.ip;
+        }
+        le.ip += sizeof(uintptr_t);
+
+        if (val_len == 0) {
+            e.skip = 1;
+
+            while (*(uintptr_t *) e.ip) {
+                code = *(ngx_http_script_code_pt *) e.ip;
+                code((ngx_http_script_engine_t *) &e);
+            }
+            e.ip += sizeof(uintptr_t);
+
+            e.skip = 0;
+
+            continue;
+        }
+
+        e.pos = key_tmp;
+
+        code = *(ngx_http_script_code_pt *) e.ip;
+        code((ngx_http_script_engine_t *) &e);
+
+        e.pos = val_tmp;
+
+        while (*(uintptr_t *) e.ip) {
+            code = *(ngx_http_script_code_pt *) e.ip;
+            code((ngx_http_script_engine_t *) &e);
+        }
+        e.ip += sizeof(uintptr_t);
+
+        ngx_strlow(key_tmp, key_tmp, key_len);
+
+        if (key_len == sizeof("host") - 1
+            && ngx_strncmp(key_tmp, "host", sizeof("host") - 1) == 0)
+        {
+            p = enc;
+            *p++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_AUTHORITY_INDEX);
+            p = ngx_http_v2_write_value(p, val_tmp, val_len, tmp);
+
+            ngx_memmove(authority + (p - enc), authority,
+                        b->last - authority);
+            ngx_memcpy(authority, enc, p - enc);
+            b->last += p - enc;
+
+            ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                           "http proxy header: \":authority: %*s\"",
+                           val_len, val_tmp);
+            continue;
+        }
+
+        if (ngx_http_proxy_v2_hop_by_hop(key_tmp, key_len)) {
+            continue;
+        }
+
+        *b->last++ = 0;
+
+        b->last = ngx_http_v2_write_name(b->last, key_tmp, key_len, tmp);
+        b->last = ngx_http_v2_write_value(b->last, val_tmp, val_len, tmp);
+
+        ngx_log_debug4(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http proxy header: \"%*s: %*s\"",
+                       key_len, key_tmp, val_len, val_tmp);
+    }
+
+    if (plcf->upstream.pass_request_headers) {
+        part = &r->headers_in.headers.part;
+        header = part->elts;
+
+        for (i = 0; /* void */; i++) {
+
+            if (i >= part->nelts) {
+                if (part->next == NULL) {
+                    break;
+                }
+
+                part = part->next;
+                header = part->elts;
+                i = 0;
+            }
+
+            if (ngx_hash_find(&headers->hash, header[i].hash,
+                              header[i].lowcase_key, header[i].key.len))
+            {
+                continue;
+            }
+
+            if (ngx_http_proxy_v2_hop_by_hop(header[i].lowcase_key,
+                                             header[i].key.len))
+            {
+                continue;
+            }
+
+            *b->last++ = 0;
+
+            b->last = ngx_http_v2_write_name(b->last, header[i].key.data,
+                                             header[i].key.len, tmp);
+
+            b->last = ngx_http_v2_write_value(b->last, header[i].value.data,
+                                              header[i].value.len, tmp);
+
+            ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                           "http proxy header: \"%V: %V\"",
+                           &header[i].key, &header[i].value);
+        }
+    }
+
+    /* split the header block into headers and continuation frames */
+
+    p = headers_frame;
+    len = b->last - p - NGX_HTTP_V2_FRAME_HEADER_SIZE;
+
+    for ( ;; ) {
+
+        if (len > NGX_HTTP_V2_DEFAULT_FRAME_SIZE) {
+            len = NGX_HTTP_V2_DEFAULT_FRAME_SIZE;
+            next = 1;
+
+        } else {
+            next = 0;
+        }
+
+        p[0] = (u_char) (len >> 16);
+        p[1] = (u_char) (len >> 8);
+        p[2] = (u_char) len;
+
+        if (!next) {
+            p[4] |= NGX_HTTP_V2_END_HEADERS_FLAG;
+            break;
+        }
+
+        p += NGX_HTTP_V2_FRAME_HEADER_SIZE + NGX_HTTP_V2_DEFAULT_FRAME_SIZE;
+        len = b->last - p;
+
+        ngx_memmove(p + NGX_HTTP_V2_FRAME_HEADER_SIZE, p, len);
+        b->last += NGX_HTTP_V2_FRAME_HEADER_SIZE;
+
+        (void) ngx_http_proxy_write_v2_frame_header(p, 0,
+                                               NGX_HTTP_V2_CONTINUATION_FRAME,
+                                               NGX_HTTP_V2_NO_FLAG);
+    }
+
+    ngx_log_debug4(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http proxy header: %*xs%s, len: %uz",
+                   (size_t) ngx_min(b->last - b->pos, 256), b->pos,
+                   b->last - b->pos > 256 ? "..." : "",
+                   b->last - b->pos);
+
+    if (plcf->body_values) {
+
+        if (body_len) {
+            b->last = ngx_http_proxy_write_v2_frame_header(b->last, body_len,
+                                                   NGX_HTTP_V2_DATA_FRAME,
+                                                   NGX_HTTP_V2_END_STREAM_FLAG);
+
+            e.ip = plcf->body_values->elts;
+            e.pos = b->last;
+            e.skip = 0;
+
+            while (*(uintptr_t *) e.ip) {
+                code = *(ngx_http_script_code_pt *) e.ip;
+                code((ngx_http_script_engine_t *) &e);
+            }
+
+            b->last = e.pos;
+        }
+
+        end_stream = (body_len == 0);
+
+        u->request_bufs = cl;
+
+    } else if (!plcf->upstream.pass_request_body) {
+
+        end_stream = 1;
+
+        u->request_bufs = cl;
+
+    } else if (r->request_body_no_buffering) {
+
+        end_stream = (r->headers_in.content_length_n <= 0
+                      && !r->headers_in.chunked);
+
+        u->request_bufs = cl;
+
+    } else {
+
+        body = u->request_bufs;
+        u->request_bufs = cl;
+
+        end_stream = (body == NULL);
+
+        while (body) {
+            b = ngx_alloc_buf(r->pool);
+            if (b == NULL) {
+                return NGX_ERROR;
+            }
+
+            ngx_memcpy(b, body->buf, sizeof(ngx_buf_t));
+
+            cl->next = ngx_alloc_chain_link(r->pool);
+            if (cl->next == NULL) {
+                return NGX_ERROR;
+            }
+
+            cl = cl->next;
+            cl->buf = b;
+
+            body = body->next;
+        }
+
+        b->last_buf = 1;
+    }
+
+    if (end_stream) {
+        headers_frame[4] |= NGX_HTTP_V2_END_STREAM_FLAG;
+
+    } else if (plcf->body_values == NULL) {
+        u->output.output_filter = ngx_http_proxy_v2_body_output_filter;
+        u->output.filter_ctx = r;
+    }
+
+    b->flush = 1;
+    cl->next = NULL;
+
+    return NGX_OK;
+}
+
+
+static u_char *
+ngx_http_proxy_write_v2_frame_header(u_char *p, size_t len, ngx_uint_t type,
+    ngx_uint_t flags)
+{
+    *p++ = (u_char) (len >> 16);
+    *p++ = (u_char) (len >> 8);
+    *p++ = (u_char) len;
+    *p++ = (u_char) type;
+    *p++ = (u_char) flags;
+
+    /* the stream identifier is assigned by the http2 upstream connection */
+
+    *p++ = 0;
+    *p++ = 0;
+    *p++ = 0;
+    *p++ = 0;
+
+    return p;
+}
+
+
+static ngx_uint_t
+ngx_http_proxy_v2_hop_by_hop(u_char *name, size_t len)
+{
+    ngx_uint_t  i;
+
+    static ngx_str_t  headers[] = {
+        ngx_string("connection"),
+        ngx_string("keep-alive"),
+        ngx_string("proxy-connection"),
+        ngx_string("te"),
+        ngx_string("transfer-encoding"),
+        ngx_string("upgrade"),
+        ngx_null_string
+    };
+
+    for (i = 0; headers[i].len; i++) {
+        if (len == headers[i].len
+            && ngx_strncmp(name, headers[i].data, len) == 0)
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+static ngx_int_t
+ngx_http_proxy_v2_body_output_filter(void *data, ngx_chain_t *in)
+{
+    ngx_http_request_t  *r = data;
+
+    off_t                  size;
+    ngx_int_t              rc;
+    ngx_buf_t             *b, *buf;
+    ngx_uint_t             last;
+    ngx_chain_t           *out, *cl, *tl, **ll;
+    ngx_http_proxy_ctx_t  *ctx;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "proxy output filter");
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_proxy_module);
+
+    if (in == NULL) {
+        out = in;
+        goto out;
+    }
+
+    out = NULL;
+    ll = &out;
+
+    if (!ctx->header_sent) {
+        /* first buffer contains headers frames, pass it unmodified */
+
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "proxy output header");
+
+        ctx->header_sent = 1;
+
+        tl = ngx_alloc_chain_link(r->pool);
+        if (tl == NULL) {
+            return NGX_ERROR;
+        }
+
+        tl->buf = in->buf;
+        *ll = tl;
+        ll = &tl->next;
+
+        in = in->next;
+    }
+
+    /* each buffer is sent as a data frame */
+
+    for (cl = in; cl; cl = cl->next) {
+
+        buf = cl->buf;
+        size = ngx_buf_size(buf);
+        last = buf->last_buf;
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "proxy output data frame: %O", size);
+
+        if (size == 0 && !last) {
+
+            if (buf->flush || buf->sync) {
+                tl = ngx_alloc_chain_link(r->pool);
+                if (tl == NULL) {
+                    return NGX_ERROR;
+                }
+
+                tl->buf = buf;
+                *ll = tl;
+                ll = &tl->next;
+            }
+
+            continue;
+        }
+
+        do {
+            tl = ngx_chain_get_free_buf(r->pool, &ctx->free);
+            if (tl == NULL) {
+                return NGX_ERROR;
+            }
+
+            b = tl->buf;
+
+            if (b->start == NULL) {
+                b->start = ngx_palloc(r->pool, NGX_HTTP_V2_FRAME_HEADER_SIZE);
+                if (b->start == NULL) {
+                    return NGX_ERROR;
+                }
+
+                b->end = b->start + NGX_HTTP_V2_FRAME_HEADER_SIZE;
+            }
+
+            b->tag = (ngx_buf_tag_t) &ngx_http_proxy_v2_body_output_filter;
+            b->memory = 0;
+            b->temporary = 1;
+            b->pos = b->start;
+
+            *ll = tl;
+            ll = &tl->next;
+
+            if (size <= NGX_HTTP_V2_MAX_FRAME_SIZE) {
+                b->last = ngx_http_proxy_write_v2_frame_header(b->pos,
+                                    (size_t) size, NGX_HTTP_V2_DATA_FRAME,
+                                    last ? NGX_HTTP_V2_END_STREAM_FLAG
+                                         : NGX_HTTP_V2_NO_FLAG);
+
+                if (size) {
+                    tl = ngx_alloc_chain_link(r->pool);
+                    if (tl == NULL) {
+                        return NGX_ERROR;
+                    }
+
+                    tl->buf = buf;
+                    *ll = tl;
+                    ll = &tl->next;
+                }
+
+                break;
+            }
+
+            /* a buffer larger than the maximum frame size, send its part */
+
+            b->last = ngx_http_proxy_write_v2_frame_header(b->pos,
+                                                   NGX_HTTP_V2_MAX_FRAME_SIZE,
+                                                   NGX_HTTP_V2_DATA_FRAME,
+                                                   NGX_HTTP_V2_NO_FLAG);
+
+            tl = ngx_chain_get_free_buf(r->pool, &ctx->free);
+            if (tl == NULL) {
+                return NGX_ERROR;
+            }
+
+            b = tl->buf;
+
+            b->tag = (ngx_buf_tag_t) &ngx_http_proxy_v2_body_output_filter;
+            b->memory = 1;
+            b->temporary = 0;
+            b->pos = buf->pos;
+            b->last = buf->pos + NGX_HTTP_V2_MAX_FRAME_SIZE;
+
+            buf->pos = b->last;
+            size -= NGX_HTTP_V2_MAX_FRAME_SIZE;
+
+            *ll = tl;
+            ll = &tl->next;
+
+        } while (size);
+    }
+
+    *ll = NULL;
+
+out:
+
+    rc = ngx_chain_writer(&r->upstream->writer, out);
+
+    ngx_chain_update_chains(r->pool, &ctx->free, &ctx->busy, &out,
+                        (ngx_buf_tag_t) &ngx_http_proxy_v2_body_output_filter);
+
+    return rc;
+}
+
+
+static ngx_int_t
+ngx_http_proxy_process_v2_header(ngx_http_request_t *r)
+{
+    u_char                         *p, *end;
+    size_t                          len;
+    ngx_int_t                       rc, status;
+    ngx_str_t                       name, value;
+    ngx_buf_t                      *b;
+    ngx_uint_t                      type, flags;
+    ngx_table_elt_t                *h;
+    ngx_http_upstream_t            *u;
+    ngx_http_proxy_ctx_t           *ctx;
+    ngx_http_upstream_header_t     *hh;
+    ngx_http_upstream_main_conf_t  *umcf;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_proxy_module);
+
+    if (ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    u = r->upstream;
+    b = &u->buffer;
+
+    /*
+     * the http2 upstream connection passes a header block
+     * as a single HEADERS frame
+     */
+
+    for ( ;; ) {
+
+        if (b->last - b->pos < NGX_HTTP_V2_FRAME_HEADER_SIZE) {
+            return NGX_AGAIN;
+        }
+
+        p = b->pos;
+
+        len = (size_t) p[0] << 16 | p[1] << 8 | p[2];
+        type = p[3];
+        flags = p[4];
+
+        if (type != NGX_HTTP_V2_HEADERS_FRAME) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "upstream sent unexpected http2 frame: %ui", type);
+            return NGX_HTTP_UPSTREAM_INVALID_HEADER;
+        }
+
+        if ((size_t) (b->last - p) < NGX_HTTP_V2_FRAME_HEADER_SIZE + len) {
+            return NGX_AGAIN;
+        }
+
+        p += NGX_HTTP_V2_FRAME_HEADER_SIZE;
+        end = p + len;
+
+        rc = ngx_http_v2_upstream_parse_header(r, &p, end, &name, &value);
+
+        if (rc == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+
+        if (rc != NGX_OK
+            || name.len != sizeof(":status") - 1
+            || ngx_strncmp(name.data, ":status", sizeof(":status") - 1) != 0)
+        {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "upstream sent no :status header");
+            return NGX_HTTP_UPSTREAM_INVALID_HEADER;
+        }
+
+        status = (value.len == 3) ? ngx_atoi(value.data, 3) : NGX_ERROR;
+
+        if (status == NGX_ERROR
+            || status == NGX_HTTP_SWITCHING_PROTOCOLS
+            || (status < NGX_HTTP_OK
+                && (flags & NGX_HTTP_V2_END_STREAM_FLAG)))
+        {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "upstream sent invalid :status \"%V\"", &value);
+            return NGX_HTTP_UPSTREAM_INVALID_HEADER;
+        }
+
+        if (status >= NGX_HTTP_OK) {
+            break;
+        }
+
+        /* skip an interim response */
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http proxy interim status %i", status);
+
+        b->pos = end;
+    }
+
+    u->headers_in.status_n = status;
+
+    if (u->state && u->state->status == 0) {
+        u->state->status = status;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http proxy status %i", status);
+
+    umcf = ngx_http_get_module_main_conf(r, ngx_http_upstream_module);
+
+    for ( ;; ) {
+
+        rc = ngx_http_v2_upstream_parse_header(r, &p, end, &name, &value);
+
+        if (rc == NGX_DONE) {
+            break;
+        }
+
+        if (rc == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+
+        if (rc == NGX_DECLINED || name.data[0] == ':') {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "upstream sent invalid header");
+            return NGX_HTTP_UPSTREAM_INVALID_HEADER;
+        }
+
+        h = ngx_list_push(&u->headers_in.headers);
+        if (h == NULL) {
+            return NGX_ERROR;
+        }
+
+        h->key = name;
+        h->value = value;
+        h->lowcase_key = h->key.data;
+        h->hash = ngx_hash_key(h->key.data, h->key.len);
+
+        hh = ngx_hash_find(&umcf->headers_in_hash, h->hash,
+                           h->lowcase_key, h->key.len);
+
+        if (hh && hh->handler(r, h, hh->offset) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http proxy header: \"%V: %V\"", &h->key, &h->value);
+    }
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http proxy header done");
+
+    b->pos = end;
+
+    ctx->end_stream = (flags & NGX_HTTP_V2_END_STREAM_FLAG) ? 1 : 0;
+
+    /*
+     * if no "Server" and "Date" in header line,
+     * then add the special empty headers
+     */
+
+    if (u->headers_in.server == NULL) {
+        h = ngx_list_push(&u->headers_in.headers);
+        if (h == NULL) {
+            return NGX_ERROR;
+        }
+
+        h->hash = ngx_hash(ngx_hash(ngx_hash(ngx_hash(
+                            ngx_hash('s', 'e'), 'r'), 'v'), 'e'), 'r');
+
+        ngx_str_set(&h->key, "Server");
+        ngx_str_null(&h->value);
+        h->lowcase_key = (u_char *) "server";
+    }
+
+    if (u->headers_in.date == NULL) {
+        h = ngx_list_push(&u->headers_in.headers);
+        if (h == NULL) {
+            return NGX_ERROR;
+        }
+
+        h->hash = ngx_hash(ngx_hash(ngx_hash('d', 'a'), 't'), 'e');
+
+        ngx_str_set(&h->key, "Date");
+        ngx_str_null(&h->value);
+        h->lowcase_key = (u_char *) "date";
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_proxy_v2_filter_init(void *data)
+{
+    ngx_http_request_t    *r = data;
+    ngx_http_upstream_t   *u;
+    ngx_http_proxy_ctx_t  *ctx;
+
+    u = r->upstream;
+    ctx = ngx_http_get_module_ctx(r, ngx_http_proxy_module);
+
+    if (ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_log_debug4(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http proxy filter init s:%ui h:%d e:%d l:%O",
+                   u->headers_in.status_n, ctx->head, ctx->end_stream,
+                   u->headers_in.content_length_n);
+
+    if (u->headers_in.status_n == NGX_HTTP_NO_CONTENT
+        || u->headers_in.status_n == NGX_HTTP_NOT_MODIFIED
+        || ctx->head)
+    {
+        ctx->length = 0;
+
+    } else {
+        ctx->length = u->headers_in.content_length_n;
+    }
+
+    if (ctx->end_stream) {
+
+        if (ctx->length > 0) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "upstream prematurely closed stream");
+            return NGX_ERROR;
+        }
+
+        u->pipe->length = 0;
+        u->length = 0;
+
+    } else {
+
+        /* the body ends with the END_STREAM flag */
+
+        u->pipe->length = 1;
+        u->length = 1;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_proxy_parse_v2_frame(ngx_http_request_t *r, ngx_buf_t *b,
+    ngx_http_proxy_ctx_t *ctx)
+{
+    size_t  n;
+
+    for ( ;; ) {
+
+        if (ctx->frame_state == NGX_HTTP_V2_FRAME_HEADER_SIZE) {
+
+            /* frame payload */
+
+            if (ctx->frame_size) {
+
+                if (b->pos == b->last) {
+                    return NGX_AGAIN;
+                }
+
+                if (ctx->frame_type == NGX_HTTP_V2_DATA_FRAME) {
+                    return NGX_OK;
+                }
+
+                /* trailers are not passed */
+
+                n = ngx_min((size_t) (b->last - b->pos), ctx->frame_size);
+
+                b->pos += n;
+                ctx->frame_size -= n;
+
+                continue;
+            }
+
+            ctx->frame_state = 0;
+
+            if (ctx->frame_flags & NGX_HTTP_V2_END_STREAM_FLAG) {
+                return NGX_DONE;
+            }
+
+            continue;
+        }
+
+        if (b->pos == b->last) {
+            return NGX_AGAIN;
+        }
+
+        switch (ctx->frame_state++) {
+
+        case 0:
+            ctx->frame_size = (size_t) *b->pos << 16;
+            break;
+
+        case 1:
+            ctx->frame_size |= *b->pos << 8;
+            break;
+
+        case 2:
+            ctx->frame_size |= *b->pos;
+            break;
+
+        case 3:
+            ctx->frame_type = *b->pos;
+            break;
+
+        case 4:
+            ctx->frame_flags = *b->pos;
+            break;
+
+        default:
+            /* stream identifier */
+            break;
+        }
+
+        b->pos++;
+
+        if (ctx->frame_state < NGX_HTTP_V2_FRAME_HEADER_SIZE) {
+            continue;
+        }
+
+        ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http proxy frame: type:%ui f:%ui l:%uz",
+                       ctx->frame_type, ctx->frame_flags, ctx->frame_size);
+
+        if (ctx->frame_type != NGX_HTTP_V2_DATA_FRAME
+            && (ctx->frame_type != NGX_HTTP_V2_HEADERS_FRAME
+                || !(ctx->frame_flags & NGX_HTTP_V2_END_STREAM_FLAG)))
+        {
+            return NGX_ERROR;
+        }
+    }
+}
+
+
+static ngx_int_t
+ngx_http_proxy_v2_filter(ngx_event_pipe_t *p, ngx_buf_t *buf)
+{
+    ngx_int_t              rc;
+    ngx_buf_t             *b, **prev;
+    ngx_chain_t           *cl;
+    ngx_http_request_t    *r;
+    ngx_http_proxy_ctx_t  *ctx;
+
+    if (buf->pos == buf->last) {
+        return NGX_OK;
+    }
+
+    r = p->input_ctx;
+    ctx = ngx_http_get_module_ctx(r, ngx_http_proxy_module);
+
+    if (ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (p->upstream_done || p->length == 0) {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, p->log, 0,
+                       "http proxy data after close");
+        return NGX_OK;
+    }
+
+    b = NULL;
+    prev = &buf->shadow;
+
+    for ( ;; ) {
+
+        rc = ngx_http_proxy_parse_v2_frame(r, buf, ctx);
+
+        if (rc == NGX_OK) {
+
+            /* a part of a data frame */
+
+            cl = ngx_chain_get_free_buf(p->pool, &p->free);
+            if (cl == NULL) {
+                return NGX_ERROR;
+            }
+
+            b = cl->buf;
+
+            ngx_memzero(b, sizeof(ngx_buf_t));
+
+            b->pos = buf->pos;
+            b->start = buf->start;
+            b->end = buf->end;
+            b->tag = p->tag;
+            b->temporary = 1;
+            b->recycled = 1;
+
+            *prev = b;
+            prev = &b->shadow;
+
+            if (p->in) {
+                *p->last_in = cl;
+            } else {
+                p->in = cl;
+            }
+            p->last_in = &cl->next;
+
+            /* STUB */ b->num = buf->num;
+
+            ngx_log_debug2(NGX_LOG_DEBUG_EVENT, p->log, 0,
+                           "input buf #%d %p", b->num, b->pos);
+
+            if ((size_t) (buf->last - buf->pos) >= ctx->frame_size) {
+                buf->pos += ctx->frame_size;
+                b->last = buf->pos;
+                ctx->frame_size = 0;
+
+            } else {
+                ctx->frame_size -= buf->last - buf->pos;
+                buf->pos = buf->last;
+                b->last = buf->last;
+            }
+
+            if (ctx->length == -1) {
+                continue;
+            }
+
+            if (b->last - b->pos > ctx->length) {
+                ngx_log_error(NGX_LOG_ERR, p->log, 0,
+                              "upstream sent more data than specified in "
+                              "\"Content-Length\" header");
+                return NGX_ERROR;
+            }
+
+            ctx->length -= b->last - b->pos;
+
+            continue;
+        }
+
+        if (rc == NGX_DONE) {
+
+            /* the stream is closed */
+
+            if (ctx->length > 0) {
+                ngx_log_error(NGX_LOG_ERR, p->log, 0,
+                              "upstream prematurely closed stream");
+                return NGX_ERROR;
+            }
+
+            p->length = 0;
+
+            break;
+        }
+
+        if (rc == NGX_AGAIN) {
+            break;
+        }
+
+        /* invalid response */
+
+        ngx_log_error(NGX_LOG_ERR, p->log, 0,
+                      "upstream sent unexpected http2 frame: %ui",
+                      ctx->frame_type);
+
+        return NGX_ERROR;
+    }
+
+    if (b) {
+        b->shadow = buf;
+        b->last_shadow = 1;
+
+        ngx_log_debug2(NGX_LOG_DEBUG_EVENT, p->log, 0,
+                       "input buf %p %z", b->pos, b->last - b->pos);
+
+        return NGX_OK;
+    }
+
+    /* there is no data record in the buf, add it to free chain */
+
+    if (ngx_event_pipe_add_free_buf(p, buf) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_proxy_non_buffered_v2_filter(void *data, ssize_t bytes)
+{
+    ngx_http_request_t   *r = data;
+
+    ngx_int_t              rc;
+    ngx_buf_t             *b, *buf;
+    ngx_chain_t           *cl, **ll;
+    ngx_http_upstream_t   *u;
+    ngx_http_proxy_ctx_t  *ctx;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_proxy_module);
+
+    if (ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    u = r->upstream;
+    buf = &u->buffer;
+
+    buf->pos = buf->last;
+    buf->last += bytes;
+
+    for (cl = u->out_bufs, ll = &u->out_bufs; cl; cl = cl->next) {
+        ll = &cl->next;
+    }
+
+    for ( ;; ) {
+
+        rc = ngx_http_proxy_parse_v2_frame(r, buf, ctx);
+
+        if (rc == NGX_OK) {
+
+            /* a part of a data frame */
+
+            cl = ngx_chain_get_free_buf(r->pool, &u->free_bufs);
+            if (cl == NULL) {
+                return NGX_ERROR;
+            }
+
+            *ll = cl;
+            ll = &cl->next;
+
+            b = cl->buf;
+
+            b->flush = 1;
+            b->memory = 1;
+
+            b->pos = buf->pos;
+            b->tag = u->output.tag;
+
+            if ((size_t) (buf->last - buf->pos) >= ctx->frame_size) {
+                buf->pos += ctx->frame_size;
+                b->last = buf->pos;
+                ctx->frame_size = 0;
+
+            } else {
+                ctx->frame_size -= buf->last - buf->pos;
+                buf->pos = buf->last;
+                b->last = buf->last;
+            }
+
+            ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                           "http proxy out buf %p %z",
+                           b->pos, b->last - b->pos);
+
+            if (ctx->length == -1) {
+                continue;
+            }
+
+            if (b->last - b->pos > ctx->length) {
+                ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                              "upstream sent more data than specified in "
+                              "\"Content-Length\" header");
+                return NGX_ERROR;
+            }
+
+            ctx->length -= b->last - b->pos;
+
+            continue;
+        }
+
+        if (rc == NGX_DONE) {
+
+            /* the stream is closed */
+
+            if (ctx->length > 0) {
+                ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                              "upstream prematurely closed stream");
+                return NGX_ERROR;
+            }
+
+            u->length = 0;
+
+            break;
+        }
+
+        if (rc == NGX_AGAIN) {
+            break;
+        }
+
+        /* invalid response */
+
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "upstream sent unexpected http2 frame: %ui",
+                      ctx->frame_type);
+
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+#endif
+
+
 static void
 ngx_http_proxy_abort_request(ngx_http_request_t *r)
 {
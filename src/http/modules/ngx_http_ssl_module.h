@@ -21,6 +21,7 @@ typedef struct {
 
     ngx_flag_t                      prefer_server_ciphers;
     ngx_flag_t                      early_data;
+    ngx_flag_t                      ktls;
     ngx_flag_t                      reject_handshake;
 
     ngx_uint_t                      protocols;
@@ -64,6 +65,9 @@ typedef struct {
     ngx_flag_t                      stapling_verify;
     ngx_str_t                       stapling_file;
     ngx_str_t                       stapling_responder;
+    ngx_shm_zone_t                 *stapling_cache_zone;
+
+    ngx_str_t                      *async_handshake;
 
     u_char                         *file;
     ngx_uint_t                      line;
@@ -22,9 +22,18 @@ typedef struct {
 } ngx_http_upstream_chash_points_t;
 
 
+typedef struct {
+    ngx_uint_t                          number;
+    uint32_t                           *entry;
+    ngx_http_upstream_rr_peer_t       **peer;
+} ngx_http_upstream_maglev_t;
+
+
 typedef struct {
     ngx_http_complex_value_t            key;
     ngx_http_upstream_chash_points_t   *points;
+    ngx_http_upstream_maglev_t         *maglev;
+    ngx_uint_t                          bound;
 } ngx_http_upstream_hash_srv_conf_t;
 
 
@@ -58,6 +67,15 @@ static ngx_int_t ngx_http_upstream_init_chash_peer(ngx_http_request_t *r,
 static ngx_int_t ngx_http_upstream_get_chash_peer(ngx_peer_connection_t *pc,
     void *data);
 
+static ngx_int_t ngx_http_upstream_init_maglev(ngx_conf_t *cf,
+    ngx_http_upstream_srv_conf_t *us);
+static ngx_int_t ngx_http_upstream_update_maglev(ngx_pool_t *pool,
+    ngx_http_upstream_srv_conf_t *us);
+static ngx_int_t ngx_http_upstream_init_maglev_peer(ngx_http_request_t *r,
+    ngx_http_upstream_srv_conf_t *us);
+static ngx_int_t ngx_http_upstream_get_maglev_peer(ngx_peer_connection_t *pc,
+    void *data);
+
 static void *ngx_http_upstream_hash_create_conf(ngx_conf_t *cf);
 static char *ngx_http_upstream_hash(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
@@ -66,7 +84,7 @@ static char *ngx_http_upstream_hash(ngx_conf_t *cf, ngx_command_t *cmd,
 static ngx_command_t  ngx_http_upstream_hash_commands[] = {
 
     { ngx_string("hash"),
-      NGX_HTTP_UPS_CONF|NGX_CONF_TAKE12,
+      NGX_HTTP_UPS_CONF|NGX_CONF_TAKE123,
       ngx_http_upstream_hash,
       NGX_HTTP_SRV_CONF_OFFSET,
       0,
@@ -498,7 +516,8 @@ ngx_http_upstream_get_chash_peer(ngx_peer_connection_t *pc, void *data)
     intptr_t                            m;
     ngx_str_t                          *server;
     ngx_int_t                           total;
-    ngx_uint_t                          i, n, best_i;
+    ngx_uint_t                          i, n, best_i, conns, weight, spill,
+                                        overloaded;
     ngx_http_upstream_rr_peer_t        *peer, *best;
     ngx_http_upstream_chash_point_t    *point;
     ngx_http_upstream_chash_points_t   *points;
@@ -523,8 +542,32 @@ ngx_http_upstream_get_chash_peer(ngx_peer_connection_t *pc, void *data)
     points = hcf->points;
     point = &points->point[0];
 
+    conns = 0;
+    weight = 0;
+    spill = 0;
+
+    if (hcf->bound) {
+
+        /*
+         * consistent hashing with bounded loads: a peer takes a new
+         * connection only while it has less than "bound" times its
+         * weighted share of all connections; otherwise the request
+         * spills over to the next point on the ring
+         */
+
+        for (peer = hp->rrp.peers->peer; peer; peer = peer->next) {
+            if (peer->down) {
+                continue;
+            }
+
+            conns += peer->conns;
+            weight += peer->weight;
+        }
+    }
+
     for ( ;; ) {
         server = point[hp->hash % points->number].server;
+        overloaded = 0;
 
         ngx_log_debug2(NGX_LOG_DEBUG_HTTP, pc->log, 0,
                        "consistent hash peer:%uD, server:\"%V\"",
@@ -567,6 +610,14 @@ ngx_http_upstream_get_chash_peer(ngx_peer_connection_t *pc, void *data)
                 continue;
             }
 
+            if (weight
+                && peer->conns * 100 * weight
+                   >= hcf->bound * (conns + 1) * peer->weight)
+            {
+                overloaded = 1;
+                continue;
+            }
+
             peer->current_weight += peer->effective_weight;
             total += peer->effective_weight;
 
@@ -586,6 +637,11 @@ ngx_http_upstream_get_chash_peer(ngx_peer_connection_t *pc, void *data)
         }
 
         hp->hash++;
+
+        if (overloaded && ++spill < points->number) {
+            continue;
+        }
+
         hp->tries++;
 
         if (hp->tries > 20) {
@@ -619,6 +675,313 @@ found:
 }
 
 
+static ngx_int_t
+ngx_http_upstream_init_maglev(ngx_conf_t *cf, ngx_http_upstream_srv_conf_t *us)
+{
+    uint32_t                            hash, *entry, *offset, *skip;
+    ngx_uint_t                          i, j, w, size, filled;
+    ngx_http_upstream_rr_peer_t        *peer;
+    ngx_http_upstream_rr_peers_t       *peers;
+    ngx_http_upstream_server_t         *server;
+    ngx_http_upstream_maglev_t         *maglev;
+    ngx_http_upstream_hash_srv_conf_t  *hcf;
+
+    static ngx_uint_t  sizes[] = { 4093, 16381, 65521, 262139, 1048573 };
+
+    /*
+     * the table is built once from the configured peers, while addresses
+     * of servers resolved at run time come and go in reserved slots
+     */
+
+    server = us->servers->elts;
+
+    for (i = 0; i < us->servers->nelts; i++) {
+        if (server[i].resolve) {
+            ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                          "maglev hash cannot be used with servers resolved "
+                          "at run time in upstream \"%V\" in %s:%ui",
+                          &us->host, us->file_name, us->line);
+            return NGX_ERROR;
+        }
+    }
+
+    if (ngx_http_upstream_init_round_robin(cf, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    us->peer.init = ngx_http_upstream_init_maglev_peer;
+
+    peers = us->peer.data;
+
+    /* the table size is a prime well above the number of weight units */
+
+    for (i = 0; i < sizeof(sizes) / sizeof(ngx_uint_t) - 1; i++) {
+        if (sizes[i] >= peers->total_weight * 100) {
+            break;
+        }
+    }
+
+    size = sizes[i];
+
+    maglev = ngx_palloc(cf->pool, sizeof(ngx_http_upstream_maglev_t));
+    if (maglev == NULL) {
+        return NGX_ERROR;
+    }
+
+    entry = ngx_palloc(cf->pool, size * sizeof(uint32_t));
+    if (entry == NULL) {
+        return NGX_ERROR;
+    }
+
+    offset = ngx_alloc(peers->number * 2 * sizeof(uint32_t), cf->log);
+    if (offset == NULL) {
+        return NGX_ERROR;
+    }
+
+    skip = offset + peers->number;
+
+    /*
+     * Maglev: each peer walks its own permutation of the table
+     * (offset, offset + skip, ...) and claims the next free entry,
+     * "weight" entries per round, until the table is full
+     */
+
+    for (peer = peers->peer, i = 0; peer; peer = peer->next, i++) {
+        ngx_crc32_init(hash);
+        ngx_crc32_update(&hash, peer->server.data, peer->server.len);
+        ngx_crc32_update(&hash, peer->name.data, peer->name.len);
+        ngx_crc32_final(hash);
+
+        offset[i] = hash % size;
+
+        ngx_crc32_init(hash);
+        ngx_crc32_update(&hash, peer->name.data, peer->name.len);
+        ngx_crc32_update(&hash, peer->server.data, peer->server.len);
+        ngx_crc32_final(hash);
+
+        skip[i] = hash % (size - 1) + 1;
+    }
+
+    ngx_memset(entry, 0xff, size * sizeof(uint32_t));
+
+    filled = 0;
+
+    for ( ;; ) {
+        for (peer = peers->peer, i = 0; peer; peer = peer->next, i++) {
+
+            for (w = 0; w < (ngx_uint_t) peer->weight; w++) {
+
+                for ( ;; ) {
+                    j = offset[i];
+                    offset[i] = (offset[i] + skip[i]) % size;
+
+                    if (entry[j] == (uint32_t) -1) {
+                        break;
+                    }
+                }
+
+                entry[j] = (uint32_t) i;
+
+                if (++filled == size) {
+                    goto done;
+                }
+            }
+        }
+    }
+
+done:
+
+    ngx_free(offset);
+
+    maglev->number = size;
+    maglev->entry = entry;
+    maglev->peer = NULL;
+
+    hcf = ngx_http_conf_upstream_srv_conf(us, ngx_http_upstream_hash_module);
+    hcf->maglev = maglev;
+
+#if (NGX_HTTP_UPSTREAM_ZONE)
+    if (us->shm_zone) {
+        return NGX_OK;
+    }
+#endif
+
+    return ngx_http_upstream_update_maglev(cf->pool, us);
+}
+
+
+static ngx_int_t
+ngx_http_upstream_update_maglev(ngx_pool_t *pool,
+    ngx_http_upstream_srv_conf_t *us)
+{
+    size_t                              size;
+    ngx_uint_t                          i;
+    ngx_http_upstream_rr_peer_t        *peer, **peerp;
+    ngx_http_upstream_rr_peers_t       *peers;
+    ngx_http_upstream_hash_srv_conf_t  *hcf;
+
+    hcf = ngx_http_conf_upstream_srv_conf(us, ngx_http_upstream_hash_module);
+
+    peers = us->peer.data;
+
+    size = peers->number * sizeof(ngx_http_upstream_rr_peer_t *);
+
+    peerp = pool ? ngx_palloc(pool, size) : ngx_alloc(size, ngx_cycle->log);
+    if (peerp == NULL) {
+        return NGX_ERROR;
+    }
+
+    for (peer = peers->peer, i = 0; peer; peer = peer->next, i++) {
+        peerp[i] = peer;
+    }
+
+    hcf->maglev->peer = peerp;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_init_maglev_peer(ngx_http_request_t *r,
+    ngx_http_upstream_srv_conf_t *us)
+{
+    ngx_http_upstream_hash_peer_data_t  *hp;
+#if (NGX_HTTP_UPSTREAM_ZONE)
+    ngx_http_upstream_hash_srv_conf_t   *hcf;
+#endif
+
+    if (ngx_http_upstream_init_hash_peer(r, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    r->upstream->peer.get = ngx_http_upstream_get_maglev_peer;
+
+    hp = r->upstream->peer.data;
+
+    hp->hash = ngx_crc32_long(hp->key.data, hp->key.len);
+
+    ngx_http_upstream_rr_peers_rlock(hp->rrp.peers);
+
+#if (NGX_HTTP_UPSTREAM_ZONE)
+    hcf = ngx_http_conf_upstream_srv_conf(us, ngx_http_upstream_hash_module);
+
+    if (hp->rrp.peers->shpool && hcf->maglev->peer == NULL) {
+        if (ngx_http_upstream_update_maglev(NULL, us) != NGX_OK) {
+            ngx_http_upstream_rr_peers_unlock(hp->rrp.peers);
+            return NGX_ERROR;
+        }
+    }
+#endif
+
+    ngx_http_upstream_rr_peers_unlock(hp->rrp.peers);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_get_maglev_peer(ngx_peer_connection_t *pc, void *data)
+{
+    ngx_http_upstream_hash_peer_data_t  *hp = data;
+
+    time_t                        now;
+    uintptr_t                     m;
+    ngx_uint_t                    n, p;
+    ngx_http_upstream_rr_peer_t  *peer;
+    ngx_http_upstream_maglev_t   *maglev;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "get maglev hash peer, try: %ui", pc->tries);
+
+    ngx_http_upstream_rr_peers_rlock(hp->rrp.peers);
+
+    if (hp->tries > 20 || hp->rrp.peers->single || hp->key.len == 0) {
+        ngx_http_upstream_rr_peers_unlock(hp->rrp.peers);
+        return hp->get_rr_peer(pc, &hp->rrp);
+    }
+
+    now = ngx_time();
+
+    pc->cached = 0;
+    pc->connection = NULL;
+
+    maglev = hp->conf->maglev;
+
+    for ( ;; ) {
+
+        /*
+         * an unusable peer makes the lookup move on to the next
+         * table entry, which belongs to another peer with
+         * a probability proportional to its weight
+         */
+
+        p = maglev->entry[hp->hash % maglev->number];
+        peer = maglev->peer[p];
+
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                       "get maglev hash peer, value:%uD, peer:%ui",
+                       hp->hash, p);
+
+        hp->hash++;
+
+        n = p / (8 * sizeof(uintptr_t));
+        m = (uintptr_t) 1 << p % (8 * sizeof(uintptr_t));
+
+        if (hp->rrp.tried[n] & m) {
+            goto next;
+        }
+
+        ngx_http_upstream_rr_peer_lock(hp->rrp.peers, peer);
+
+        if (peer->down) {
+            ngx_http_upstream_rr_peer_unlock(hp->rrp.peers, peer);
+            goto next;
+        }
+
+        if (peer->max_fails
+            && peer->fails >= peer->max_fails
+            && now - peer->checked <= peer->fail_timeout)
+        {
+            ngx_http_upstream_rr_peer_unlock(hp->rrp.peers, peer);
+            goto next;
+        }
+
+        if (peer->max_conns && peer->conns >= peer->max_conns) {
+            ngx_http_upstream_rr_peer_unlock(hp->rrp.peers, peer);
+            goto next;
+        }
+
+        break;
+
+    next:
+
+        if (++hp->tries > 20) {
+            ngx_http_upstream_rr_peers_unlock(hp->rrp.peers);
+            return hp->get_rr_peer(pc, &hp->rrp);
+        }
+    }
+
+    hp->rrp.current = peer;
+
+    pc->sockaddr = peer->sockaddr;
+    pc->socklen = peer->socklen;
+    pc->name = &peer->name;
+
+    peer->conns++;
+
+    if (now - peer->checked > peer->fail_timeout) {
+        peer->checked = now;
+    }
+
+    ngx_http_upstream_rr_peer_unlock(hp->rrp.peers, peer);
+    ngx_http_upstream_rr_peers_unlock(hp->rrp.peers);
+
+    hp->rrp.tried[n] |= m;
+
+    return NGX_OK;
+}
+
+
 static void *
 ngx_http_upstream_hash_create_conf(ngx_conf_t *cf)
 {
@@ -630,6 +993,8 @@ ngx_http_upstream_hash_create_conf(ngx_conf_t *cf)
     }
 
     conf->points = NULL;
+    conf->maglev = NULL;
+    conf->bound = 0;
 
     return conf;
 }
@@ -640,6 +1005,7 @@ ngx_http_upstream_hash(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
     ngx_http_upstream_hash_srv_conf_t  *hcf = conf;
 
+    ngx_int_t                          n;
     ngx_str_t                         *value;
     ngx_http_upstream_srv_conf_t      *uscf;
     ngx_http_compile_complex_value_t   ccv;
@@ -676,11 +1042,37 @@ ngx_http_upstream_hash(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     } else if (ngx_strcmp(value[2].data, "consistent") == 0) {
         uscf->peer.init_upstream = ngx_http_upstream_init_chash;
 
+    } else if (ngx_strcmp(value[2].data, "maglev") == 0) {
+        uscf->peer.init_upstream = ngx_http_upstream_init_maglev;
+
     } else {
         ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
                            "invalid parameter \"%V\"", &value[2]);
         return NGX_CONF_ERROR;
     }
 
+    if (cf->args->nelts == 3) {
+        return NGX_CONF_OK;
+    }
+
+    if (uscf->peer.init_upstream != ngx_http_upstream_init_chash
+        || ngx_strncmp(value[3].data, "bounded=", 8) != 0)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid parameter \"%V\"", &value[3]);
+        return NGX_CONF_ERROR;
+    }
+
+    n = ngx_atofp(value[3].data + 8, value[3].len - 8, 2);
+
+    if (n == NGX_ERROR || n <= 100) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid bound factor \"%V\", "
+                           "it must be greater than 1", &value[3]);
+        return NGX_CONF_ERROR;
+    }
+
+    hcf->bound = n;
+
     return NGX_CONF_OK;
 }
@@ -0,0 +1,1315 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event_connect.h>
+#include <ngx_http.h>
+
+
+#define NGX_HTTP_UPSTREAM_HC_EXISTS      0
+#define NGX_HTTP_UPSTREAM_HC_ABSENT      1
+#define NGX_HTTP_UPSTREAM_HC_EQUAL       2
+#define NGX_HTTP_UPSTREAM_HC_NOT_EQUAL   3
+#define NGX_HTTP_UPSTREAM_HC_REGEX       4
+#define NGX_HTTP_UPSTREAM_HC_NOT_REGEX   5
+
+
+typedef struct {
+    ngx_uint_t                         low;
+    ngx_uint_t                         high;
+} ngx_http_upstream_hc_range_t;
+
+
+typedef struct {
+    ngx_str_t                          name;
+    ngx_str_t                          value;
+    ngx_uint_t                         op;
+#if (NGX_PCRE)
+    ngx_regex_t                       *regex;
+#endif
+} ngx_http_upstream_hc_header_t;
+
+
+typedef struct {
+    ngx_str_t                          name;
+
+    ngx_array_t                       *status;
+    ngx_uint_t                         status_not;
+
+    ngx_array_t                       *headers;
+
+#if (NGX_PCRE)
+    ngx_regex_t                       *body;
+    ngx_uint_t                         body_not;
+#endif
+} ngx_http_upstream_hc_match_t;
+
+
+typedef struct {
+    ngx_array_t                        matches;
+} ngx_http_upstream_hc_main_conf_t;
+
+
+typedef struct {
+    ngx_msec_t                         interval;
+    ngx_msec_t                         timeout;
+    ngx_uint_t                         fails;
+    ngx_uint_t                         passes;
+    in_port_t                          port;
+
+    ngx_str_t                          request;
+
+    ngx_str_t                          match_name;
+    ngx_http_upstream_hc_match_t      *match;
+} ngx_http_upstream_hc_srv_conf_t;
+
+
+typedef struct {
+    ngx_http_upstream_hc_srv_conf_t   *conf;
+    ngx_http_upstream_rr_peers_t      *peers;
+    ngx_http_upstream_rr_peer_t       *peer;
+
+    ngx_event_t                        event;
+    ngx_peer_connection_t              pc;
+
+    ngx_sockaddr_t                     sockaddr;
+    socklen_t                          socklen;
+
+    ngx_pool_t                        *pool;
+    ngx_http_request_t                *request;
+    ngx_buf_t                         *buffer;
+    ngx_array_t                       *headers;
+    ngx_http_status_t                  status;
+    u_char                            *sent;
+    u_char                            *body;
+    ngx_uint_t                         state;
+
+    ngx_uint_t                         fails;
+    ngx_uint_t                         passes;
+} ngx_http_upstream_hc_peer_t;
+
+
+static void ngx_http_upstream_hc_handler(ngx_event_t *ev);
+static void ngx_http_upstream_hc_send_handler(ngx_event_t *wev);
+static void ngx_http_upstream_hc_read_handler(ngx_event_t *rev);
+static void ngx_http_upstream_hc_dummy_handler(ngx_event_t *ev);
+static ngx_int_t ngx_http_upstream_hc_parse(ngx_http_upstream_hc_peer_t *hp);
+static ngx_int_t ngx_http_upstream_hc_match(ngx_http_upstream_hc_peer_t *hp);
+static void ngx_http_upstream_hc_finalize(ngx_http_upstream_hc_peer_t *hp,
+    ngx_uint_t healthy);
+
+static ngx_int_t ngx_http_upstream_hc_init_process(ngx_cycle_t *cycle);
+static ngx_int_t ngx_http_upstream_hc_add_peers(ngx_cycle_t *cycle,
+    ngx_http_upstream_hc_srv_conf_t *hcf, ngx_http_upstream_rr_peers_t *peers);
+
+static void *ngx_http_upstream_hc_create_main_conf(ngx_conf_t *cf);
+static char *ngx_http_upstream_hc_init_main_conf(ngx_conf_t *cf, void *conf);
+static void *ngx_http_upstream_hc_create_conf(ngx_conf_t *cf);
+static char *ngx_http_upstream_hc(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static char *ngx_http_upstream_hc_match_block(ngx_conf_t *cf,
+    ngx_command_t *cmd, void *conf);
+static char *ngx_http_upstream_hc_match_condition(ngx_conf_t *cf,
+    ngx_command_t *dummy, void *conf);
+static char *ngx_http_upstream_hc_match_status(ngx_conf_t *cf,
+    ngx_http_upstream_hc_match_t *m);
+static char *ngx_http_upstream_hc_match_header(ngx_conf_t *cf,
+    ngx_http_upstream_hc_match_t *m);
+static char *ngx_http_upstream_hc_match_body(ngx_conf_t *cf,
+    ngx_http_upstream_hc_match_t *m);
+#if (NGX_PCRE)
+static ngx_regex_t *ngx_http_upstream_hc_regex(ngx_conf_t *cf,
+    ngx_str_t *pattern);
+#endif
+
+
+static ngx_command_t  ngx_http_upstream_hc_commands[] = {
+
+    { ngx_string("health_check"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_ANY,
+      ngx_http_upstream_hc,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("match"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_BLOCK|NGX_CONF_TAKE1,
+      ngx_http_upstream_hc_match_block,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      0,
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_http_module_t  ngx_http_upstream_hc_module_ctx = {
+    NULL,                                  /* preconfiguration */
+    NULL,                                  /* postconfiguration */
+
+    ngx_http_upstream_hc_create_main_conf, /* create main configuration */
+    ngx_http_upstream_hc_init_main_conf,   /* init main configuration */
+
+    ngx_http_upstream_hc_create_conf,      /* create server configuration */
+    NULL,                                  /* merge server configuration */
+
+    NULL,                                  /* create location configuration */
+    NULL                                   /* merge location configuration */
+};
+
+
+ngx_module_t  ngx_http_upstream_hc_module = {
+    NGX_MODULE_V1,
+    &ngx_http_upstream_hc_module_ctx,      /* module context */
+    ngx_http_upstream_hc_commands,         /* module directives */
+    NGX_HTTP_MODULE,                       /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    ngx_http_upstream_hc_init_process,     /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static void
+ngx_http_upstream_hc_handler(ngx_event_t *ev)
+{
+    ngx_int_t                     rc;
+    ngx_connection_t             *c;
+    ngx_http_upstream_hc_peer_t  *hp;
+
+    hp = ev->data;
+
+    if (ngx_terminate || ngx_exiting || ngx_quit) {
+        return;
+    }
+
+    /* the address may be changed at run time, see "server ... resolve" */
+
+    ngx_http_upstream_rr_peers_rlock(hp->peers);
+
+    if (hp->peer->down & NGX_HTTP_UPSTREAM_PEER_UNRESOLVED) {
+        ngx_http_upstream_rr_peers_unlock(hp->peers);
+        ngx_add_timer(ev, hp->conf->interval);
+        return;
+    }
+
+    ngx_memcpy(&hp->sockaddr, hp->peer->sockaddr, hp->peer->socklen);
+    hp->socklen = hp->peer->socklen;
+
+    ngx_http_upstream_rr_peers_unlock(hp->peers);
+
+    if (hp->conf->port) {
+        ngx_inet_set_port(&hp->sockaddr.sockaddr, hp->conf->port);
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ev->log, 0,
+                   "health check peer %V", &hp->peer->name);
+
+    hp->pool = ngx_create_pool(1024, ev->log);
+    if (hp->pool == NULL) {
+        goto failed;
+    }
+
+    hp->request = ngx_pcalloc(hp->pool, sizeof(ngx_http_request_t));
+    if (hp->request == NULL) {
+        goto failed;
+    }
+
+    hp->buffer = ngx_create_temp_buf(hp->pool, ngx_pagesize);
+    if (hp->buffer == NULL) {
+        goto failed;
+    }
+
+    hp->headers = ngx_array_create(hp->pool, 8, sizeof(ngx_table_elt_t));
+    if (hp->headers == NULL) {
+        goto failed;
+    }
+
+    ngx_memzero(&hp->status, sizeof(ngx_http_status_t));
+    hp->sent = hp->conf->request.data;
+    hp->body = NULL;
+    hp->state = 0;
+
+    ngx_memzero(&hp->pc, sizeof(ngx_peer_connection_t));
+
+    hp->pc.sockaddr = &hp->sockaddr.sockaddr;
+    hp->pc.socklen = hp->socklen;
+    hp->pc.name = &hp->peer->name;
+    hp->pc.get = ngx_event_get_peer;
+    hp->pc.log = ev->log;
+    hp->pc.log_error = NGX_ERROR_INFO;
+
+    rc = ngx_event_connect_peer(&hp->pc);
+
+    if (rc == NGX_ERROR || rc == NGX_BUSY || rc == NGX_DECLINED) {
+        goto failed;
+    }
+
+    c = hp->pc.connection;
+    c->data = hp;
+    c->pool = hp->pool;
+
+    c->write->handler = ngx_http_upstream_hc_send_handler;
+    c->read->handler = ngx_http_upstream_hc_read_handler;
+
+    ngx_add_timer(c->read, hp->conf->timeout);
+
+    if (rc == NGX_AGAIN) {
+        return;
+    }
+
+    ngx_http_upstream_hc_send_handler(c->write);
+
+    return;
+
+failed:
+
+    ngx_http_upstream_hc_finalize(hp, 0);
+}
+
+
+static void
+ngx_http_upstream_hc_send_handler(ngx_event_t *wev)
+{
+    ssize_t                       n, size;
+    ngx_connection_t             *c;
+    ngx_http_upstream_hc_peer_t  *hp;
+
+    c = wev->data;
+    hp = c->data;
+
+    size = hp->conf->request.data + hp->conf->request.len - hp->sent;
+
+    while (size > 0) {
+        n = c->send(c, hp->sent, size);
+
+        if (n == NGX_ERROR) {
+            ngx_http_upstream_hc_finalize(hp, 0);
+            return;
+        }
+
+        if (n == NGX_AGAIN) {
+            if (ngx_handle_write_event(wev, 0) != NGX_OK) {
+                ngx_http_upstream_hc_finalize(hp, 0);
+            }
+
+            return;
+        }
+
+        hp->sent += n;
+        size -= n;
+    }
+
+    wev->handler = ngx_http_upstream_hc_dummy_handler;
+
+    if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+        ngx_http_upstream_hc_finalize(hp, 0);
+        return;
+    }
+
+    if (c->read->ready) {
+        ngx_http_upstream_hc_read_handler(c->read);
+    }
+}
+
+
+static void
+ngx_http_upstream_hc_read_handler(ngx_event_t *rev)
+{
+    ssize_t                       n;
+    ngx_int_t                     rc;
+    ngx_buf_t                    *b;
+    ngx_connection_t             *c;
+    ngx_http_upstream_hc_peer_t  *hp;
+
+    c = rev->data;
+    hp = c->data;
+
+    if (rev->timedout) {
+        ngx_log_error(NGX_LOG_INFO, c->log, NGX_ETIMEDOUT,
+                      "health check of peer %V in upstream \"%V\" timed out",
+                      &hp->peer->name, hp->peers->name);
+        ngx_http_upstream_hc_finalize(hp, 0);
+        return;
+    }
+
+    b = hp->buffer;
+
+    for ( ;; ) {
+
+        if (b->last == b->end) {
+
+            /* the body is only matched against what fits into the buffer */
+
+            rc = (hp->state == 2) ? ngx_http_upstream_hc_match(hp) : NGX_ERROR;
+            break;
+        }
+
+        n = c->recv(c, b->last, b->end - b->last);
+
+        if (n == NGX_AGAIN) {
+            if (ngx_handle_read_event(rev, 0) != NGX_OK) {
+                ngx_http_upstream_hc_finalize(hp, 0);
+            }
+
+            return;
+        }
+
+        if (n == NGX_ERROR) {
+            rc = NGX_ERROR;
+            break;
+        }
+
+        if (n == 0) {
+            rc = (hp->state == 2) ? ngx_http_upstream_hc_match(hp) : NGX_ERROR;
+            break;
+        }
+
+        b->last += n;
+
+        rc = ngx_http_upstream_hc_parse(hp);
+
+        if (rc == NGX_AGAIN) {
+            continue;
+        }
+
+        if (rc == NGX_OK) {
+            rc = ngx_http_upstream_hc_match(hp);
+        }
+
+        break;
+    }
+
+    ngx_http_upstream_hc_finalize(hp, rc == NGX_OK);
+}
+
+
+static void
+ngx_http_upstream_hc_dummy_handler(ngx_event_t *ev)
+{
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ev->log, 0,
+                   "health check dummy handler");
+}
+
+
+static ngx_int_t
+ngx_http_upstream_hc_parse(ngx_http_upstream_hc_peer_t *hp)
+{
+    ngx_int_t            rc;
+    ngx_buf_t           *b;
+    ngx_table_elt_t     *h;
+    ngx_http_request_t  *r;
+
+    r = hp->request;
+    b = hp->buffer;
+
+    if (hp->state == 0) {
+        rc = ngx_http_parse_status_line(r, b, &hp->status);
+
+        if (rc != NGX_OK) {
+            return rc;
+        }
+
+        hp->state = 1;
+    }
+
+    if (hp->state == 1) {
+
+        for ( ;; ) {
+            rc = ngx_http_parse_header_line(r, b, 1);
+
+            if (rc == NGX_OK) {
+                h = ngx_array_push(hp->headers);
+                if (h == NULL) {
+                    return NGX_ERROR;
+                }
+
+                h->key.len = r->header_name_end - r->header_name_start;
+                h->key.data = r->header_name_start;
+                h->value.len = r->header_end - r->header_start;
+                h->value.data = r->header_start;
+
+                continue;
+            }
+
+            if (rc == NGX_HTTP_PARSE_HEADER_DONE) {
+                hp->body = b->pos;
+                hp->state = 2;
+                break;
+            }
+
+            if (rc == NGX_AGAIN) {
+                return NGX_AGAIN;
+            }
+
+            return NGX_ERROR;
+        }
+    }
+
+#if (NGX_PCRE)
+    if (hp->conf->match && hp->conf->match->body) {
+        return NGX_AGAIN;
+    }
+#endif
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_hc_match(ngx_http_upstream_hc_peer_t *hp)
+{
+    ngx_uint_t                      i, j, found, matched;
+    ngx_table_elt_t                *h;
+    ngx_http_upstream_hc_match_t   *m;
+    ngx_http_upstream_hc_range_t   *range;
+    ngx_http_upstream_hc_header_t  *cond;
+#if (NGX_PCRE)
+    ngx_int_t                       rc;
+    ngx_str_t                       body;
+#endif
+
+    m = hp->conf->match;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, hp->pc.log, 0,
+                   "health check peer %V status %ui",
+                   &hp->peer->name, hp->status.code);
+
+    if (m == NULL) {
+        return (hp->status.code >= NGX_HTTP_OK
+                && hp->status.code < NGX_HTTP_BAD_REQUEST)
+               ? NGX_OK : NGX_DECLINED;
+    }
+
+    if (m->status) {
+        found = 0;
+        range = m->status->elts;
+
+        for (i = 0; i < m->status->nelts; i++) {
+            if (hp->status.code >= range[i].low
+                && hp->status.code <= range[i].high)
+            {
+                found = 1;
+                break;
+            }
+        }
+
+        if (found == m->status_not) {
+            return NGX_DECLINED;
+        }
+    }
+
+    if (m->headers) {
+        cond = m->headers->elts;
+
+        for (i = 0; i < m->headers->nelts; i++) {
+            found = 0;
+            matched = 0;
+            h = hp->headers->elts;
+
+            for (j = 0; j < hp->headers->nelts; j++) {
+                if (h[j].key.len != cond[i].name.len
+                    || ngx_strncasecmp(h[j].key.data, cond[i].name.data,
+                                       cond[i].name.len)
+                       != 0)
+                {
+                    continue;
+                }
+
+                found = 1;
+
+                switch (cond[i].op) {
+
+                case NGX_HTTP_UPSTREAM_HC_EQUAL:
+                case NGX_HTTP_UPSTREAM_HC_NOT_EQUAL:
+                    if (h[j].value.len == cond[i].value.len
+                        && ngx_strncmp(h[j].value.data, cond[i].value.data,
+                                       cond[i].value.len)
+                           == 0)
+                    {
+                        matched = 1;
+                    }
+                    break;
+
+#if (NGX_PCRE)
+                case NGX_HTTP_UPSTREAM_HC_REGEX:
+                case NGX_HTTP_UPSTREAM_HC_NOT_REGEX:
+                    rc = ngx_regex_exec(cond[i].regex, &h[j].value, NULL, 0);
+
+                    if (rc >= 0) {
+                        matched = 1;
+
+                    } else if (rc != NGX_REGEX_NO_MATCHED) {
+                        ngx_log_error(NGX_LOG_ALERT, hp->pc.log, 0,
+                                      ngx_regex_exec_n " failed: %i on \"%V\"",
+                                      rc, &h[j].value);
+                        return NGX_ERROR;
+                    }
+                    break;
+#endif
+
+                default: /* NGX_HTTP_UPSTREAM_HC_EXISTS, ABSENT */
+                    break;
+                }
+            }
+
+            switch (cond[i].op) {
+
+            case NGX_HTTP_UPSTREAM_HC_EXISTS:
+                matched = found;
+                break;
+
+            case NGX_HTTP_UPSTREAM_HC_ABSENT:
+                matched = !found;
+                break;
+
+            case NGX_HTTP_UPSTREAM_HC_NOT_EQUAL:
+            case NGX_HTTP_UPSTREAM_HC_NOT_REGEX:
+                matched = !matched;
+                break;
+            }
+
+            if (!matched) {
+                return NGX_DECLINED;
+            }
+        }
+    }
+
+#if (NGX_PCRE)
+
+    if (m->body) {
+        body.data = hp->body;
+        body.len = hp->buffer->last - hp->body;
+
+        rc = ngx_regex_exec(m->body, &body, NULL, 0);
+
+        if (rc < NGX_REGEX_NO_MATCHED) {
+            ngx_log_error(NGX_LOG_ALERT, hp->pc.log, 0,
+                          ngx_regex_exec_n " failed: %i on response body",
+                          rc);
+            return NGX_ERROR;
+        }
+
+        if ((ngx_uint_t) (rc >= 0) == m->body_not) {
+            return NGX_DECLINED;
+        }
+    }
+
+#endif
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_upstream_hc_finalize(ngx_http_upstream_hc_peer_t *hp,
+    ngx_uint_t healthy)
+{
+    ngx_http_upstream_rr_peer_t      *peer;
+    ngx_http_upstream_rr_peers_t     *peers;
+    ngx_http_upstream_hc_srv_conf_t  *hcf;
+
+    hcf = hp->conf;
+    peers = hp->peers;
+    peer = hp->peer;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, hp->event.log, 0,
+                   "health check peer %V result: %ui",
+                   &peer->name, healthy);
+
+    if (hp->pc.connection) {
+        ngx_close_connection(hp->pc.connection);
+        hp->pc.connection = NULL;
+    }
+
+    if (hp->pool) {
+        ngx_destroy_pool(hp->pool);
+        hp->pool = NULL;
+    }
+
+    if (healthy) {
+        hp->fails = 0;
+
+        if (++hp->passes >= hcf->passes) {
+            ngx_http_upstream_rr_peers_wlock(peers);
+
+            if (peer->down & NGX_HTTP_UPSTREAM_PEER_UNHEALTHY) {
+                peer->down &= ~NGX_HTTP_UPSTREAM_PEER_UNHEALTHY;
+                peer->fails = 0;
+
+                ngx_log_error(NGX_LOG_NOTICE, hp->event.log, 0,
+                              "peer %V in upstream \"%V\" is healthy",
+                              &peer->name, peers->name);
+            }
+
+            ngx_http_upstream_rr_peers_unlock(peers);
+        }
+
+    } else {
+        hp->passes = 0;
+
+        if (++hp->fails >= hcf->fails) {
+            ngx_http_upstream_rr_peers_wlock(peers);
+
+            if (!(peer->down & NGX_HTTP_UPSTREAM_PEER_UNHEALTHY)) {
+                peer->down |= NGX_HTTP_UPSTREAM_PEER_UNHEALTHY;
+
+                ngx_log_error(NGX_LOG_WARN, hp->event.log, 0,
+                              "peer %V in upstream \"%V\" is unhealthy",
+                              &peer->name, peers->name);
+            }
+
+            ngx_http_upstream_rr_peers_unlock(peers);
+        }
+    }
+
+    if (ngx_terminate || ngx_exiting || ngx_quit) {
+        return;
+    }
+
+    ngx_add_timer(&hp->event, hcf->interval);
+}
+
+
+static ngx_int_t
+ngx_http_upstream_hc_init_process(ngx_cycle_t *cycle)
+{
+    ngx_uint_t                        i;
+    ngx_http_upstream_rr_peers_t     *peers;
+    ngx_http_upstream_hc_srv_conf_t  *hcf;
+    ngx_http_upstream_srv_conf_t    **uscfp;
+    ngx_http_upstream_main_conf_t    *umcf;
+
+    /* probes are sent by the first worker only */
+
+    if ((ngx_process != NGX_PROCESS_WORKER
+         && ngx_process != NGX_PROCESS_SINGLE)
+        || ngx_worker != 0)
+    {
+        return NGX_OK;
+    }
+
+    umcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_upstream_module);
+
+    if (umcf == NULL) {
+        return NGX_OK;
+    }
+
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+
+        if (uscfp[i]->srv_conf == NULL || uscfp[i]->shm_zone == NULL) {
+            continue;
+        }
+
+        hcf = ngx_http_conf_upstream_srv_conf(uscfp[i],
+                                              ngx_http_upstream_hc_module);
+
+        if (hcf->interval == 0) {
+            continue;
+        }
+
+        for (peers = uscfp[i]->peer.data; peers; peers = peers->next) {
+            if (ngx_http_upstream_hc_add_peers(cycle, hcf, peers) != NGX_OK) {
+                return NGX_ERROR;
+            }
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_hc_add_peers(ngx_cycle_t *cycle,
+    ngx_http_upstream_hc_srv_conf_t *hcf, ngx_http_upstream_rr_peers_t *peers)
+{
+    ngx_http_upstream_rr_peer_t  *peer;
+    ngx_http_upstream_hc_peer_t  *hp;
+
+    for (peer = peers->peer; peer; peer = peer->next) {
+
+        hp = ngx_pcalloc(cycle->pool, sizeof(ngx_http_upstream_hc_peer_t));
+        if (hp == NULL) {
+            return NGX_ERROR;
+        }
+
+        hp->conf = hcf;
+        hp->peers = peers;
+        hp->peer = peer;
+
+        hp->event.handler = ngx_http_upstream_hc_handler;
+        hp->event.data = hp;
+        hp->event.log = cycle->log;
+        hp->event.cancelable = 1;
+
+        ngx_add_timer(&hp->event, 0);
+    }
+
+    return NGX_OK;
+}
+
+
+static void *
+ngx_http_upstream_hc_create_main_conf(ngx_conf_t *cf)
+{
+    ngx_http_upstream_hc_main_conf_t  *hmcf;
+
+    hmcf = ngx_pcalloc(cf->pool, sizeof(ngx_http_upstream_hc_main_conf_t));
+    if (hmcf == NULL) {
+        return NULL;
+    }
+
+    if (ngx_array_init(&hmcf->matches, cf->pool, 4,
+                       sizeof(ngx_http_upstream_hc_match_t))
+        != NGX_OK)
+    {
+        return NULL;
+    }
+
+    return hmcf;
+}
+
+
+static char *
+ngx_http_upstream_hc_init_main_conf(ngx_conf_t *cf, void *conf)
+{
+    ngx_http_upstream_hc_main_conf_t  *hmcf = conf;
+
+    ngx_uint_t                         i, j;
+    ngx_http_upstream_hc_match_t      *m;
+    ngx_http_upstream_srv_conf_t     **uscfp;
+    ngx_http_upstream_hc_srv_conf_t   *hcf;
+    ngx_http_upstream_main_conf_t     *umcf;
+
+    umcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_upstream_module);
+
+    uscfp = umcf->upstreams.elts;
+    m = hmcf->matches.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+
+        if (uscfp[i]->srv_conf == NULL) {
+            continue;
+        }
+
+        hcf = ngx_http_conf_upstream_srv_conf(uscfp[i],
+                                              ngx_http_upstream_hc_module);
+
+        if (hcf->interval == 0) {
+            continue;
+        }
+
+        if (uscfp[i]->shm_zone == NULL) {
+            ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                          "health check requires \"zone\" in upstream \"%V\" "
+                          "in %s:%ui",
+                          &uscfp[i]->host, uscfp[i]->file_name,
+                          uscfp[i]->line);
+            return NGX_CONF_ERROR;
+        }
+
+        if (hcf->match_name.len == 0) {
+            continue;
+        }
+
+        for (j = 0; j < hmcf->matches.nelts; j++) {
+            if (m[j].name.len == hcf->match_name.len
+                && ngx_strncmp(m[j].name.data, hcf->match_name.data,
+                               hcf->match_name.len)
+                   == 0)
+            {
+                hcf->match = &m[j];
+                break;
+            }
+        }
+
+        if (hcf->match == NULL) {
+            ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                          "match \"%V\" not found for upstream \"%V\" "
+                          "in %s:%ui",
+                          &hcf->match_name, &uscfp[i]->host,
+                          uscfp[i]->file_name, uscfp[i]->line);
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static void *
+ngx_http_upstream_hc_create_conf(ngx_conf_t *cf)
+{
+    ngx_http_upstream_hc_srv_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_upstream_hc_srv_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     conf->interval = 0;
+     *     conf->port = 0;
+     *     conf->request = { 0, NULL };
+     *     conf->match_name = { 0, NULL };
+     *     conf->match = NULL;
+     */
+
+    return conf;
+}
+
+
+static char *
+ngx_http_upstream_hc(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_upstream_hc_srv_conf_t  *hcf = conf;
+
+    u_char                        *p;
+    ngx_int_t                      n;
+    ngx_str_t                     *value, s, uri;
+    ngx_uint_t                     i;
+    ngx_http_upstream_srv_conf_t  *uscf;
+
+    if (hcf->interval) {
+        return "is duplicate";
+    }
+
+    hcf->interval = 5000;
+    hcf->timeout = 1000;
+    hcf->fails = 1;
+    hcf->passes = 1;
+
+    ngx_str_set(&uri, "/");
+
+    value = cf->args->elts;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "interval=", 9) == 0) {
+            s.len = value[i].len - 9;
+            s.data = &value[i].data[9];
+
+            hcf->interval = ngx_parse_time(&s, 0);
+            if (hcf->interval == (ngx_msec_t) NGX_ERROR
+                || hcf->interval == 0)
+            {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "timeout=", 8) == 0) {
+            s.len = value[i].len - 8;
+            s.data = &value[i].data[8];
+
+            hcf->timeout = ngx_parse_time(&s, 0);
+            if (hcf->timeout == (ngx_msec_t) NGX_ERROR || hcf->timeout == 0) {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "fails=", 6) == 0) {
+            n = ngx_atoi(&value[i].data[6], value[i].len - 6);
+            if (n == NGX_ERROR || n == 0) {
+                goto invalid;
+            }
+
+            hcf->fails = n;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "passes=", 7) == 0) {
+            n = ngx_atoi(&value[i].data[7], value[i].len - 7);
+            if (n == NGX_ERROR || n == 0) {
+                goto invalid;
+            }
+
+            hcf->passes = n;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "port=", 5) == 0) {
+            n = ngx_atoi(&value[i].data[5], value[i].len - 5);
+            if (n < 1 || n > 65535) {
+                goto invalid;
+            }
+
+            hcf->port = (in_port_t) n;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "uri=", 4) == 0) {
+            uri.len = value[i].len - 4;
+            uri.data = &value[i].data[4];
+
+            if (uri.len == 0 || uri.data[0] != '/') {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "match=", 6) == 0) {
+            hcf->match_name.len = value[i].len - 6;
+            hcf->match_name.data = &value[i].data[6];
+
+            if (hcf->match_name.len == 0) {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        goto invalid;
+    }
+
+    uscf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_upstream_module);
+
+    hcf->request.len = sizeof("GET ") - 1 + uri.len
+                       + sizeof(" HTTP/1.0" CRLF "Host: ") - 1 + uscf->host.len
+                       + sizeof(CRLF "Connection: close" CRLF CRLF) - 1;
+
+    p = ngx_pnalloc(cf->pool, hcf->request.len);
+    if (p == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    hcf->request.data = p;
+
+    p = ngx_cpymem(p, "GET ", sizeof("GET ") - 1);
+    p = ngx_cpymem(p, uri.data, uri.len);
+    p = ngx_cpymem(p, " HTTP/1.0" CRLF "Host: ",
+                   sizeof(" HTTP/1.0" CRLF "Host: ") - 1);
+    p = ngx_cpymem(p, uscf->host.data, uscf->host.len);
+    ngx_memcpy(p, CRLF "Connection: close" CRLF CRLF,
+               sizeof(CRLF "Connection: close" CRLF CRLF) - 1);
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+
+    return NGX_CONF_ERROR;
+}
+
+
+static char *
+ngx_http_upstream_hc_match_block(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+    ngx_http_upstream_hc_main_conf_t  *hmcf = conf;
+
+    char                          *rv;
+    ngx_str_t                     *value;
+    ngx_uint_t                     i;
+    ngx_conf_t                     save;
+    ngx_http_upstream_hc_match_t  *m;
+
+    value = cf->args->elts;
+    m = hmcf->matches.elts;
+
+    for (i = 0; i < hmcf->matches.nelts; i++) {
+        if (m[i].name.len == value[1].len
+            && ngx_strncmp(m[i].name.data, value[1].data, value[1].len) == 0)
+        {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "duplicate match \"%V\"", &value[1]);
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    m = ngx_array_push(&hmcf->matches);
+    if (m == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_memzero(m, sizeof(ngx_http_upstream_hc_match_t));
+
+    m->name = value[1];
+
+    save = *cf;
+    cf->handler = ngx_http_upstream_hc_match_condition;
+    cf->handler_conf = (char *) m;
+
+    rv = ngx_conf_parse(cf, NULL);
+
+    *cf = save;
+
+    return rv;
+}
+
+
+static char *
+ngx_http_upstream_hc_match_condition(ngx_conf_t *cf, ngx_command_t *dummy,
+    void *conf)
+{
+    ngx_http_upstream_hc_match_t  *m = conf;
+
+    ngx_str_t  *value;
+
+    value = cf->args->elts;
+
+    if (cf->args->nelts >= 2) {
+
+        if (ngx_strcmp(value[0].data, "status") == 0) {
+            return ngx_http_upstream_hc_match_status(cf, m);
+        }
+
+        if (ngx_strcmp(value[0].data, "header") == 0) {
+            return ngx_http_upstream_hc_match_header(cf, m);
+        }
+
+        if (ngx_strcmp(value[0].data, "body") == 0) {
+            return ngx_http_upstream_hc_match_body(cf, m);
+        }
+    }
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid match condition \"%V\"", &value[0]);
+
+    return NGX_CONF_ERROR;
+}
+
+
+static char *
+ngx_http_upstream_hc_match_status(ngx_conf_t *cf,
+    ngx_http_upstream_hc_match_t *m)
+{
+    u_char                        *dash;
+    ngx_int_t                      low, high;
+    ngx_str_t                     *value;
+    ngx_uint_t                     i;
+    ngx_http_upstream_hc_range_t  *range;
+
+    if (m->status) {
+        return "is duplicate";
+    }
+
+    m->status = ngx_array_create(cf->pool, 4,
+                                 sizeof(ngx_http_upstream_hc_range_t));
+    if (m->status == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    value = cf->args->elts;
+    i = 1;
+
+    if (value[1].len == 1 && value[1].data[0] == '!') {
+        m->status_not = 1;
+        i++;
+    }
+
+    if (i == cf->args->nelts) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid number of arguments in \"status\"");
+        return NGX_CONF_ERROR;
+    }
+
+    for ( /* void */ ; i < cf->args->nelts; i++) {
+
+        dash = ngx_strlchr(value[i].data, value[i].data + value[i].len, '-');
+
+        if (dash) {
+            low = ngx_atoi(value[i].data, dash - value[i].data);
+            high = ngx_atoi(dash + 1, value[i].data + value[i].len - dash - 1);
+
+        } else {
+            low = ngx_atoi(value[i].data, value[i].len);
+            high = low;
+        }
+
+        if (low < 100 || high > 599 || low > high) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid status \"%V\"", &value[i]);
+            return NGX_CONF_ERROR;
+        }
+
+        range = ngx_array_push(m->status);
+        if (range == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        range->low = low;
+        range->high = high;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_http_upstream_hc_match_header(ngx_conf_t *cf,
+    ngx_http_upstream_hc_match_t *m)
+{
+    ngx_str_t                      *value, *op;
+    ngx_http_upstream_hc_header_t  *h;
+
+    if (m->headers == NULL) {
+        m->headers = ngx_array_create(cf->pool, 4,
+                                      sizeof(ngx_http_upstream_hc_header_t));
+        if (m->headers == NULL) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    h = ngx_array_push(m->headers);
+    if (h == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_memzero(h, sizeof(ngx_http_upstream_hc_header_t));
+
+    value = cf->args->elts;
+
+    switch (cf->args->nelts) {
+
+    case 2:
+        h->name = value[1];
+        h->op = NGX_HTTP_UPSTREAM_HC_EXISTS;
+        return NGX_CONF_OK;
+
+    case 3:
+        if (value[1].len != 1 || value[1].data[0] != '!') {
+            break;
+        }
+
+        h->name = value[2];
+        h->op = NGX_HTTP_UPSTREAM_HC_ABSENT;
+        return NGX_CONF_OK;
+
+    case 4:
+        h->name = value[1];
+        h->value = value[3];
+        op = &value[2];
+
+        if (op->len == 1 && op->data[0] == '=') {
+            h->op = NGX_HTTP_UPSTREAM_HC_EQUAL;
+            return NGX_CONF_OK;
+        }
+
+        if (op->len == 2 && ngx_strncmp(op->data, "!=", 2) == 0) {
+            h->op = NGX_HTTP_UPSTREAM_HC_NOT_EQUAL;
+            return NGX_CONF_OK;
+        }
+
+        if (op->len == 1 && op->data[0] == '~') {
+            h->op = NGX_HTTP_UPSTREAM_HC_REGEX;
+
+        } else if (op->len == 2 && ngx_strncmp(op->data, "!~", 2) == 0) {
+            h->op = NGX_HTTP_UPSTREAM_HC_NOT_REGEX;
+
+        } else {
+            break;
+        }
+
+#if (NGX_PCRE)
+        h->regex = ngx_http_upstream_hc_regex(cf, &value[3]);
+        if (h->regex == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        return NGX_CONF_OK;
+#else
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "using regex \"%V\" requires PCRE library",
+                           &value[3]);
+        return NGX_CONF_ERROR;
+#endif
+    }
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid \"header\" condition");
+
+    return NGX_CONF_ERROR;
+}
+
+
+static char *
+ngx_http_upstream_hc_match_body(ngx_conf_t *cf,
+    ngx_http_upstream_hc_match_t *m)
+{
+    ngx_str_t  *value;
+
+    value = cf->args->elts;
+
+    if (cf->args->nelts != 3) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid number of arguments in \"body\"");
+        return NGX_CONF_ERROR;
+    }
+
+#if (NGX_PCRE)
+
+    if (m->body) {
+        return "is duplicate";
+    }
+
+    if (value[1].len == 1 && value[1].data[0] == '~') {
+        m->body_not = 0;
+
+    } else if (value[1].len == 2 && ngx_strncmp(value[1].data, "!~", 2) == 0) {
+        m->body_not = 1;
+
+    } else {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid \"body\" operator \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    m->body = ngx_http_upstream_hc_regex(cf, &value[2]);
+    if (m->body == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+
+#else
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "using regex \"%V\" requires PCRE library", &value[2]);
+    return NGX_CONF_ERROR;
+
+#endif
+}
+
+
+#if (NGX_PCRE)
+
+static ngx_regex_t *
+ngx_http_upstream_hc_regex(ngx_conf_t *cf, ngx_str_t *pattern)
+{
+    u_char               errstr[NGX_MAX_CONF_ERRSTR];
+    ngx_regex_compile_t  rc;
+
+    ngx_memzero(&rc, sizeof(ngx_regex_compile_t));
+
+    rc.pattern = *pattern;
+    rc.pool = cf->pool;
+    rc.err.len = NGX_MAX_CONF_ERRSTR;
+    rc.err.data = errstr;
+
+    if (ngx_regex_compile(&rc) != NGX_OK) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "%V", &rc.err);
+        return NULL;
+    }
+
+    return rc.regex;
+}
+
+#endif
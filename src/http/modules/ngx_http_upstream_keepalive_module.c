@@ -9,6 +9,44 @@
 #include <ngx_core.h>
 #include <ngx_http.h>
 
+#if (NGX_HAVE_UNIX_DOMAIN)
+#include <ngx_channel.h>
+#endif
+
+
+/*
+ * With "keepalive N shared" the N idle connections are a limit for all
+ * workers together.  Each worker claims a slot in the shared zone and
+ * counts its idle connections of every upstream in that slot; the slot
+ * is released by the master process when it reaps the worker.  A worker
+ * which misses its local cache asks the worker with most idle connections
+ * to pass one over the process channel and waits for it for a short time.
+ */
+
+typedef struct {
+    ngx_atomic_t                       idle;
+    /* hash of the address of the peer the worker is waiting for */
+    ngx_atomic_t                       want;
+} ngx_http_upstream_keepalive_slot_t;
+
+
+typedef struct ngx_http_upstream_keepalive_shared_s
+    ngx_http_upstream_keepalive_shared_t;
+
+struct ngx_http_upstream_keepalive_shared_s {
+    ngx_str_t                          name;
+    ngx_http_upstream_keepalive_shared_t  *next;
+    ngx_uint_t                         nslots;
+    ngx_http_upstream_keepalive_slot_t     slots[1];
+};
+
+
+typedef struct {
+    ngx_http_upstream_keepalive_shared_t  *records;
+    ngx_uint_t                         nslots;
+    ngx_atomic_t                       pids[1];
+} ngx_http_upstream_keepalive_sh_t;
+
 
 typedef struct {
     ngx_uint_t                         max_cached;
@@ -22,9 +60,29 @@ typedef struct {
     ngx_http_upstream_init_pt          original_init_upstream;
     ngx_http_upstream_init_peer_pt     original_init_peer;
 
+    ngx_str_t                          name;
+    ngx_http_upstream_keepalive_shared_t  *shared;
+    ngx_http_upstream_keepalive_slot_t    *slot;
+    ngx_queue_t                        waiting;
+
 } ngx_http_upstream_keepalive_srv_conf_t;
 
 
+typedef struct {
+    ngx_shm_zone_t                    *shm_zone;
+    ngx_http_upstream_keepalive_sh_t  *sh;
+    ngx_uint_t                         nslots;
+    ngx_array_t                        shared;
+} ngx_http_upstream_keepalive_main_conf_t;
+
+
+/* slots per worker, for workers of older generations still running */
+#define NGX_HTTP_UPSTREAM_KEEPALIVE_GENERATIONS  4
+
+/* time to wait for a connection passed by another worker */
+#define NGX_HTTP_UPSTREAM_KEEPALIVE_WAIT         20
+
+
 typedef struct {
     ngx_http_upstream_keepalive_srv_conf_t  *conf;
 
@@ -52,6 +110,16 @@ typedef struct {
     ngx_event_save_peer_session_pt     original_save_session;
 #endif
 
+#if (NGX_HAVE_UNIX_DOMAIN)
+    ngx_http_request_t                *request;
+    ngx_queue_t                        queue;
+    ngx_event_t                        wait;
+#endif
+
+    unsigned                           waiting:1;
+    unsigned                           waited:1;
+    unsigned                           resumed:1;
+
 } ngx_http_upstream_keepalive_peer_data_t;
 
 
@@ -62,10 +130,32 @@ static ngx_int_t ngx_http_upstream_get_keepalive_peer(ngx_peer_connection_t *pc,
 static void ngx_http_upstream_free_keepalive_peer(ngx_peer_connection_t *pc,
     void *data, ngx_uint_t state);
 
+static void ngx_http_upstream_keepalive_save(
+    ngx_http_upstream_keepalive_cache_t *item, ngx_connection_t *c);
 static void ngx_http_upstream_keepalive_dummy_handler(ngx_event_t *ev);
 static void ngx_http_upstream_keepalive_close_handler(ngx_event_t *ev);
 static void ngx_http_upstream_keepalive_close(ngx_connection_t *c);
 
+#if (NGX_HAVE_UNIX_DOMAIN)
+static ngx_int_t ngx_http_upstream_keepalive_reserve(
+    ngx_http_upstream_keepalive_srv_conf_t *kcf);
+static ngx_int_t ngx_http_upstream_keepalive_want(
+    ngx_http_upstream_keepalive_peer_data_t *kp, ngx_peer_connection_t *pc);
+static void ngx_http_upstream_keepalive_wait_handler(ngx_event_t *ev);
+static void ngx_http_upstream_keepalive_pass(
+    ngx_http_upstream_keepalive_srv_conf_t *kcf, ngx_pid_t pid,
+    ngx_log_t *log);
+static void ngx_http_upstream_keepalive_pass_handler(ngx_socket_t s,
+    ngx_pid_t pid, ngx_uint_t id, ngx_log_t *log);
+static ngx_int_t ngx_http_upstream_keepalive_channel(ngx_pid_t pid);
+static ngx_int_t ngx_http_upstream_keepalive_init_zone(
+    ngx_shm_zone_t *shm_zone, void *data);
+static void ngx_http_upstream_keepalive_reap(ngx_shm_zone_t *shm_zone,
+    ngx_pid_t pid);
+static ngx_int_t ngx_http_upstream_keepalive_init(ngx_conf_t *cf);
+static ngx_int_t ngx_http_upstream_keepalive_init_worker(ngx_cycle_t *cycle);
+#endif
+
 #if (NGX_HTTP_SSL)
 static ngx_int_t ngx_http_upstream_keepalive_set_session(
     ngx_peer_connection_t *pc, void *data);
@@ -73,6 +163,7 @@ static void ngx_http_upstream_keepalive_save_session(ngx_peer_connection_t *pc,
     void *data);
 #endif
 
+static void *ngx_http_upstream_keepalive_create_main_conf(ngx_conf_t *cf);
 static void *ngx_http_upstream_keepalive_create_conf(ngx_conf_t *cf);
 static char *ngx_http_upstream_keepalive(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
@@ -81,7 +172,7 @@ static char *ngx_http_upstream_keepalive(ngx_conf_t *cf, ngx_command_t *cmd,
 static ngx_command_t  ngx_http_upstream_keepalive_commands[] = {
 
     { ngx_string("keepalive"),
-      NGX_HTTP_UPS_CONF|NGX_CONF_TAKE1,
+      NGX_HTTP_UPS_CONF|NGX_CONF_TAKE12,
       ngx_http_upstream_keepalive,
       NGX_HTTP_SRV_CONF_OFFSET,
       0,
@@ -114,9 +205,14 @@ static ngx_command_t  ngx_http_upstream_keepalive_commands[] = {
 
 static ngx_http_module_t  ngx_http_upstream_keepalive_module_ctx = {
     NULL,                                  /* preconfiguration */
+#if (NGX_HAVE_UNIX_DOMAIN)
+    ngx_http_upstream_keepalive_init,      /* postconfiguration */
+#else
     NULL,                                  /* postconfiguration */
+#endif
 
-    NULL,                                  /* create main configuration */
+    ngx_http_upstream_keepalive_create_main_conf,
+                                           /* create main configuration */
     NULL,                                  /* init main configuration */
 
     ngx_http_upstream_keepalive_create_conf, /* create server configuration */
@@ -134,7 +230,11 @@ ngx_module_t  ngx_http_upstream_keepalive_module = {
     NGX_HTTP_MODULE,                       /* module type */
     NULL,                                  /* init master */
     NULL,                                  /* init module */
+#if (NGX_HAVE_UNIX_DOMAIN)
+    ngx_http_upstream_keepalive_init_worker, /* init process */
+#else
     NULL,                                  /* init process */
+#endif
     NULL,                                  /* init thread */
     NULL,                                  /* exit thread */
     NULL,                                  /* exit process */
@@ -179,6 +279,7 @@ ngx_http_upstream_init_keepalive(ngx_conf_t *cf,
 
     ngx_queue_init(&kcf->cache);
     ngx_queue_init(&kcf->free);
+    ngx_queue_init(&kcf->waiting);
 
     for (i = 0; i < kcf->max_cached; i++) {
         ngx_queue_insert_head(&kcf->free, &cached[i].queue);
@@ -202,7 +303,7 @@ ngx_http_upstream_init_keepalive_peer(ngx_http_request_t *r,
     kcf = ngx_http_conf_upstream_srv_conf(us,
                                           ngx_http_upstream_keepalive_module);
 
-    kp = ngx_palloc(r->pool, sizeof(ngx_http_upstream_keepalive_peer_data_t));
+    kp = ngx_pcalloc(r->pool, sizeof(ngx_http_upstream_keepalive_peer_data_t));
     if (kp == NULL) {
         return NGX_ERROR;
     }
@@ -228,6 +329,10 @@ ngx_http_upstream_init_keepalive_peer(ngx_http_request_t *r,
     r->upstream->peer.save_session = ngx_http_upstream_keepalive_save_session;
 #endif
 
+#if (NGX_HAVE_UNIX_DOMAIN)
+    kp->request = r;
+#endif
+
     return NGX_OK;
 }
 
@@ -245,14 +350,29 @@ ngx_http_upstream_get_keepalive_peer(ngx_peer_connection_t *pc, void *data)
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, pc->log, 0,
                    "get keepalive peer");
 
-    /* ask balancer */
+    /* ask balancer, unless it chose the peer before waiting */
 
-    rc = kp->original_get_peer(pc, kp->data);
+    if (!kp->resumed) {
+        rc = kp->original_get_peer(pc, kp->data);
 
-    if (rc != NGX_OK) {
-        return rc;
+        if (rc != NGX_OK) {
+            return rc;
+        }
     }
 
+    kp->resumed = 0;
+
+#if (NGX_HTTP_V2)
+
+    if (kp->upstream->http2) {
+
+        /* streams are multiplexed over connections of their own */
+
+        return NGX_OK;
+    }
+
+#endif
+
     /* search cache for suitable connection */
 
     cache = &kp->conf->cache;
@@ -275,10 +395,49 @@ ngx_http_upstream_get_keepalive_peer(ngx_peer_connection_t *pc, void *data)
         }
     }
 
+#if (NGX_HAVE_UNIX_DOMAIN)
+
+    /*
+     * TLS connections cannot be passed, as their state lives in
+     * the process; sessions are shared with the "zone" directive
+     */
+
+    if (kp->conf->shared
+        && !kp->waited
+#if (NGX_HTTP_SSL)
+        && !kp->upstream->ssl
+#endif
+        && ngx_http_upstream_keepalive_want(kp, pc) == NGX_OK)
+    {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                       "get keepalive peer: waiting for connection");
+
+        kp->waited = 1;
+        kp->waiting = 1;
+
+        kp->wait.handler = ngx_http_upstream_keepalive_wait_handler;
+        kp->wait.data = kp;
+        kp->wait.log = pc->log;
+
+        ngx_add_timer(&kp->wait, NGX_HTTP_UPSTREAM_KEEPALIVE_WAIT);
+
+        ngx_queue_insert_tail(&kp->conf->waiting, &kp->queue);
+
+        return NGX_AGAIN;
+    }
+
+#endif
+
     return NGX_OK;
 
 found:
 
+#if (NGX_HAVE_UNIX_DOMAIN)
+    if (kp->conf->shared) {
+        (void) ngx_atomic_fetch_add(&kp->conf->slot->idle, -1);
+    }
+#endif
+
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0,
                    "get keepalive peer: using connection %p", c);
 
@@ -308,6 +467,7 @@ ngx_http_upstream_free_keepalive_peer(ngx_peer_connection_t *pc, void *data,
     ngx_http_upstream_keepalive_peer_data_t  *kp = data;
     ngx_http_upstream_keepalive_cache_t      *item;
 
+    ngx_uint_t            full;
     ngx_queue_t          *q;
     ngx_connection_t     *c;
     ngx_http_upstream_t  *u;
@@ -315,6 +475,23 @@ ngx_http_upstream_free_keepalive_peer(ngx_peer_connection_t *pc, void *data,
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, pc->log, 0,
                    "free keepalive peer");
 
+#if (NGX_HAVE_UNIX_DOMAIN)
+
+    if (kp->waiting) {
+        if (kp->wait.timer_set) {
+            ngx_del_timer(&kp->wait);
+        }
+
+        if (kp->wait.posted) {
+            ngx_delete_posted_event(&kp->wait);
+        }
+
+        ngx_queue_remove(&kp->queue);
+        kp->waiting = 0;
+    }
+
+#endif
+
     /* cache valid connections */
 
     u = kp->upstream;
@@ -358,30 +535,62 @@ ngx_http_upstream_free_keepalive_peer(ngx_peer_connection_t *pc, void *data,
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0,
                    "free keepalive peer: saving connection %p", c);
 
-    if (ngx_queue_empty(&kp->conf->free)) {
+    full = ngx_queue_empty(&kp->conf->free);
 
-        q = ngx_queue_last(&kp->conf->cache);
+#if (NGX_HAVE_UNIX_DOMAIN)
+
+    if (!full && kp->conf->shared) {
+        full = (ngx_http_upstream_keepalive_reserve(kp->conf) != NGX_OK);
+    }
+
+#endif
+
+    if (!full) {
+        q = ngx_queue_head(&kp->conf->free);
         ngx_queue_remove(q);
 
         item = ngx_queue_data(q, ngx_http_upstream_keepalive_cache_t, queue);
 
-        ngx_http_upstream_keepalive_close(item->connection);
-
     } else {
-        q = ngx_queue_head(&kp->conf->free);
+
+        if (ngx_queue_empty(&kp->conf->cache)) {
+
+            /* idle connections of other workers use up the shared limit */
+
+            goto invalid;
+        }
+
+        q = ngx_queue_last(&kp->conf->cache);
         ngx_queue_remove(q);
 
         item = ngx_queue_data(q, ngx_http_upstream_keepalive_cache_t, queue);
-    }
 
-    ngx_queue_insert_head(&kp->conf->cache, q);
+        ngx_http_upstream_keepalive_close(item->connection);
+    }
 
-    item->connection = c;
+    item->socklen = pc->socklen;
+    ngx_memcpy(&item->sockaddr, pc->sockaddr, pc->socklen);
 
     pc->connection = NULL;
 
+    ngx_http_upstream_keepalive_save(item, c);
+
+invalid:
+
+    kp->original_free_peer(pc, kp->data, state);
+}
+
+
+static void
+ngx_http_upstream_keepalive_save(ngx_http_upstream_keepalive_cache_t *item,
+    ngx_connection_t *c)
+{
+    ngx_queue_insert_head(&item->conf->cache, &item->queue);
+
+    item->connection = c;
+
     c->read->delayed = 0;
-    ngx_add_timer(c->read, kp->conf->timeout);
+    ngx_add_timer(c->read, item->conf->timeout);
 
     if (c->write->timer_set) {
         ngx_del_timer(c->write);
@@ -397,16 +606,9 @@ ngx_http_upstream_free_keepalive_peer(ngx_peer_connection_t *pc, void *data,
     c->write->log = ngx_cycle->log;
     c->pool->log = ngx_cycle->log;
 
-    item->socklen = pc->socklen;
-    ngx_memcpy(&item->sockaddr, pc->sockaddr, pc->socklen);
-
     if (c->read->ready) {
         ngx_http_upstream_keepalive_close_handler(c->read);
     }
-
-invalid:
-
-    kp->original_free_peer(pc, kp->data, state);
 }
 
 
@@ -458,6 +660,12 @@ close:
 
     ngx_queue_remove(&item->queue);
     ngx_queue_insert_head(&conf->free, &item->queue);
+
+#if (NGX_HAVE_UNIX_DOMAIN)
+    if (conf->shared) {
+        (void) ngx_atomic_fetch_add(&conf->slot->idle, -1);
+    }
+#endif
 }
 
 
@@ -507,6 +715,683 @@ ngx_http_upstream_keepalive_save_session(ngx_peer_connection_t *pc, void *data)
 #endif
 
 
+#if (NGX_HAVE_UNIX_DOMAIN)
+
+static ngx_int_t
+ngx_http_upstream_keepalive_reserve(ngx_http_upstream_keepalive_srv_conf_t *kcf)
+{
+    ngx_uint_t                             i, n;
+    ngx_http_upstream_keepalive_shared_t  *sh;
+
+    sh = kcf->shared;
+
+    (void) ngx_atomic_fetch_add(&kcf->slot->idle, 1);
+
+    n = 0;
+
+    for (i = 0; i < sh->nslots; i++) {
+        n += sh->slots[i].idle;
+    }
+
+    if (n > kcf->max_cached) {
+        (void) ngx_atomic_fetch_add(&kcf->slot->idle, -1);
+        return NGX_DECLINED;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_keepalive_want(ngx_http_upstream_keepalive_peer_data_t *kp,
+    ngx_peer_connection_t *pc)
+{
+    ngx_int_t                                 slot;
+    ngx_uint_t                                i, n, best;
+    ngx_channel_t                             ch;
+    ngx_http_upstream_keepalive_shared_t     *sh;
+    ngx_http_upstream_keepalive_main_conf_t  *kmcf;
+
+    sh = kp->conf->shared;
+
+    /* ask the worker with most idle connections */
+
+    n = 0;
+    best = 0;
+
+    for (i = 0; i < sh->nslots; i++) {
+        if (&sh->slots[i] != kp->conf->slot && sh->slots[i].idle > n) {
+            n = sh->slots[i].idle;
+            best = i;
+        }
+    }
+
+    if (n == 0) {
+        return NGX_DECLINED;
+    }
+
+    kmcf = ngx_http_cycle_get_module_main_conf(ngx_cycle,
+                                         ngx_http_upstream_keepalive_module);
+
+    slot = ngx_http_upstream_keepalive_channel(kmcf->sh->pids[best]);
+
+    if (slot == NGX_ERROR) {
+        return NGX_DECLINED;
+    }
+
+    kp->conf->slot->want = ngx_crc32_short((u_char *) pc->sockaddr,
+                                           pc->socklen);
+
+    ngx_memzero(&ch, sizeof(ngx_channel_t));
+
+    ch.command = NGX_CMD_WANT_CONNECTION;
+    ch.pid = ngx_pid;
+    ch.slot = (u_char *) sh - (u_char *) kmcf->shm_zone->shm.addr;
+    ch.fd = -1;
+
+    if (ngx_write_channel(ngx_processes[slot].channel[0], &ch,
+                          sizeof(ngx_channel_t), pc->log)
+        != NGX_OK)
+    {
+        return NGX_DECLINED;
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_upstream_keepalive_wait_handler(ngx_event_t *ev)
+{
+    ngx_http_upstream_keepalive_peer_data_t  *kp;
+
+    kp = ev->data;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ev->log, 0,
+                   "keepalive wait handler, timed out: %d", ev->timedout);
+
+    if (ev->timer_set) {
+        ngx_del_timer(ev);
+    }
+
+    ngx_queue_remove(&kp->queue);
+
+    kp->waiting = 0;
+    kp->resumed = 1;
+
+    ngx_http_upstream_resume_connect(kp->request, kp->upstream);
+}
+
+
+static void
+ngx_http_upstream_keepalive_pass(ngx_http_upstream_keepalive_srv_conf_t *kcf,
+    ngx_pid_t pid, ngx_log_t *log)
+{
+    uint32_t                                  want;
+    ngx_int_t                                 slot;
+    ngx_uint_t                                i;
+    ngx_queue_t                              *q;
+    ngx_channel_t                             ch;
+    ngx_connection_t                         *c;
+    ngx_http_upstream_keepalive_cache_t      *item, *it;
+    ngx_http_upstream_keepalive_main_conf_t  *kmcf;
+
+    slot = ngx_http_upstream_keepalive_channel(pid);
+
+    if (slot == NGX_ERROR) {
+        return;
+    }
+
+    kmcf = ngx_http_cycle_get_module_main_conf(ngx_cycle,
+                                         ngx_http_upstream_keepalive_module);
+
+    want = 0;
+
+    for (i = 0; i < kmcf->sh->nslots; i++) {
+        if (kmcf->sh->pids[i] == (ngx_atomic_uint_t) pid) {
+            want = kcf->shared->slots[i].want;
+            break;
+        }
+    }
+
+    /* prefer a connection to the peer wanted, then the most recent one */
+
+    item = NULL;
+
+    for (q = ngx_queue_head(&kcf->cache);
+         q != ngx_queue_sentinel(&kcf->cache);
+         q = ngx_queue_next(q))
+    {
+        it = ngx_queue_data(q, ngx_http_upstream_keepalive_cache_t, queue);
+
+#if (NGX_HTTP_SSL)
+
+        /* TLS state cannot be passed to another process */
+
+        if (it->connection->ssl) {
+            continue;
+        }
+
+#endif
+
+        if (item == NULL) {
+            item = it;
+        }
+
+        if (ngx_crc32_short((u_char *) &it->sockaddr, it->socklen) == want) {
+            item = it;
+            break;
+        }
+    }
+
+    if (item == NULL) {
+        return;
+    }
+
+    c = item->connection;
+
+    ngx_memzero(&ch, sizeof(ngx_channel_t));
+
+    ch.command = NGX_CMD_PASS_CONNECTION;
+    ch.pid = ngx_pid;
+    ch.slot = (u_char *) kcf->shared - (u_char *) kmcf->shm_zone->shm.addr;
+    ch.fd = c->fd;
+
+    if (ngx_write_channel(ngx_processes[slot].channel[0], &ch,
+                          sizeof(ngx_channel_t), log)
+        != NGX_OK)
+    {
+        return;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, log, 0,
+                   "keepalive: passed connection %p to %P", c, pid);
+
+    /*
+     * the socket stays open in the receiver, so the epoll registration
+     * of this worker has to be removed explicitly
+     */
+
+    if (ngx_del_conn) {
+        ngx_del_conn(c, 0);
+
+    } else {
+        if (c->read->active || c->read->disabled) {
+            ngx_del_event(c->read, NGX_READ_EVENT, 0);
+        }
+
+        if (c->write->active || c->write->disabled) {
+            ngx_del_event(c->write, NGX_WRITE_EVENT, 0);
+        }
+    }
+
+    ngx_queue_remove(&item->queue);
+    ngx_queue_insert_head(&kcf->free, &item->queue);
+
+    (void) ngx_atomic_fetch_add(&kcf->slot->idle, -1);
+
+    ngx_http_upstream_keepalive_close(c);
+}
+
+
+static void
+ngx_http_upstream_keepalive_pass_handler(ngx_socket_t s, ngx_pid_t pid,
+    ngx_uint_t id, ngx_log_t *log)
+{
+    ngx_int_t                                 event;
+    ngx_uint_t                                i;
+    ngx_queue_t                              *q;
+    ngx_connection_t                         *c;
+    ngx_http_upstream_keepalive_cache_t      *item;
+    ngx_http_upstream_keepalive_peer_data_t  *kp, *first;
+    ngx_http_upstream_keepalive_srv_conf_t  **kcfp, *kcf;
+    ngx_http_upstream_keepalive_main_conf_t  *kmcf;
+
+    kmcf = ngx_http_cycle_get_module_main_conf(ngx_cycle,
+                                         ngx_http_upstream_keepalive_module);
+
+    kcfp = kmcf->shared.elts;
+
+    for (i = 0; i < kmcf->shared.nelts; i++) {
+        if (kcfp[i]->shared
+            && (u_char *) kcfp[i]->shared - (u_char *) kmcf->shm_zone->shm.addr
+               == (ssize_t) id)
+        {
+            break;
+        }
+    }
+
+    if (s == (ngx_socket_t) -1) {
+
+        if (i < kmcf->shared.nelts && !ngx_exiting && !ngx_terminate) {
+            ngx_http_upstream_keepalive_pass(kcfp[i], pid, log);
+        }
+
+        return;
+    }
+
+    if (i == kmcf->shared.nelts) {
+
+        /* a connection of an upstream removed by reconfiguration */
+
+        goto failed;
+    }
+
+    kcf = kcfp[i];
+
+    if (ngx_exiting || ngx_terminate || ngx_queue_empty(&kcf->free)) {
+        goto failed;
+    }
+
+    q = ngx_queue_head(&kcf->free);
+    item = ngx_queue_data(q, ngx_http_upstream_keepalive_cache_t, queue);
+
+    item->socklen = sizeof(ngx_sockaddr_t);
+
+    if (getpeername(s, &item->sockaddr.sockaddr, &item->socklen) == -1) {
+        ngx_log_error(NGX_LOG_INFO, log, ngx_socket_errno,
+                      "getpeername() of passed connection failed");
+        goto failed;
+    }
+
+    c = ngx_get_connection(s, log);
+
+    if (c == NULL) {
+        goto failed;
+    }
+
+    c->pool = ngx_create_pool(128, log);
+    if (c->pool == NULL) {
+        ngx_close_connection(c);
+        return;
+    }
+
+    c->log = log;
+    c->read->log = log;
+    c->write->log = log;
+
+    c->type = SOCK_STREAM;
+    c->recv = ngx_recv;
+    c->send = ngx_send;
+    c->recv_chain = ngx_recv_chain;
+    c->send_chain = ngx_send_chain;
+    c->sendfile = 1;
+
+    if (item->sockaddr.sockaddr.sa_family == AF_UNIX) {
+        c->tcp_nopush = NGX_TCP_NOPUSH_DISABLED;
+        c->tcp_nodelay = NGX_TCP_NODELAY_DISABLED;
+    }
+
+    c->log_error = NGX_ERROR_ERR;
+    c->number = ngx_atomic_fetch_add(ngx_connection_counter, 1);
+    c->start_time = ngx_current_msec;
+
+    c->write->ready = 1;
+
+    if (ngx_add_conn) {
+        if (ngx_add_conn(c) == NGX_ERROR) {
+            ngx_http_upstream_keepalive_close(c);
+            return;
+        }
+
+    } else {
+        event = (ngx_event_flags & NGX_USE_CLEAR_EVENT) ? NGX_CLEAR_EVENT:
+                                                          NGX_LEVEL_EVENT;
+
+        if (ngx_add_event(c->read, NGX_READ_EVENT, event) != NGX_OK) {
+            ngx_http_upstream_keepalive_close(c);
+            return;
+        }
+    }
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, log, 0,
+                   "keepalive: got connection %p for \"%V\" from %P",
+                   c, &kcf->name, pid);
+
+    /* the sender does not count the connection any more */
+
+    (void) ngx_atomic_fetch_add(&kcf->slot->idle, 1);
+
+    ngx_queue_remove(q);
+
+    ngx_http_upstream_keepalive_save(item, c);
+
+    /* wake up a request waiting for this peer, or the oldest one */
+
+    first = NULL;
+
+    for (q = ngx_queue_head(&kcf->waiting);
+         q != ngx_queue_sentinel(&kcf->waiting);
+         q = ngx_queue_next(q))
+    {
+        kp = ngx_queue_data(q, ngx_http_upstream_keepalive_peer_data_t,
+                            queue);
+
+        if (kp->wait.posted) {
+            continue;
+        }
+
+        if (first == NULL) {
+            first = kp;
+        }
+
+        if (ngx_memn2cmp((u_char *) &item->sockaddr,
+                         (u_char *) kp->upstream->peer.sockaddr,
+                         item->socklen, kp->upstream->peer.socklen)
+            == 0)
+        {
+            first = kp;
+            break;
+        }
+    }
+
+    if (first) {
+        ngx_post_event(&first->wait, &ngx_posted_events);
+    }
+
+    return;
+
+failed:
+
+    if (ngx_close_socket(s) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_socket_errno,
+                      ngx_close_socket_n " failed");
+    }
+}
+
+
+static ngx_int_t
+ngx_http_upstream_keepalive_channel(ngx_pid_t pid)
+{
+    ngx_int_t  s;
+
+    for (s = 0; s < ngx_last_process; s++) {
+        if (ngx_processes[s].pid == pid
+            && ngx_processes[s].channel[0] != -1)
+        {
+            return s;
+        }
+    }
+
+    return NGX_ERROR;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_keepalive_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_http_upstream_keepalive_main_conf_t  *kmcf = shm_zone->data;
+
+    size_t                                   size;
+    ngx_uint_t                               i;
+    ngx_slab_pool_t                         *shpool;
+    ngx_http_upstream_keepalive_sh_t        *sh;
+    ngx_http_upstream_keepalive_shared_t    *rec;
+    ngx_http_upstream_keepalive_srv_conf_t **kcfp;
+
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    /*
+     * the records of an upstream are looked up by name and kept
+     * across reconfiguration, as old workers still hold connections
+     */
+
+    if (data) {
+        sh = shpool->data;
+
+    } else {
+        sh = ngx_slab_calloc(shpool, sizeof(ngx_http_upstream_keepalive_sh_t)
+                                     + (kmcf->nslots - 1)
+                                       * sizeof(ngx_atomic_t));
+        if (sh == NULL) {
+            return NGX_ERROR;
+        }
+
+        sh->nslots = kmcf->nslots;
+        shpool->data = sh;
+    }
+
+    kmcf->sh = sh;
+
+    kcfp = kmcf->shared.elts;
+
+    for (i = 0; i < kmcf->shared.nelts; i++) {
+
+        for (rec = sh->records; rec; rec = rec->next) {
+            if (rec->name.len == kcfp[i]->name.len
+                && ngx_strncmp(rec->name.data, kcfp[i]->name.data,
+                               rec->name.len)
+                   == 0)
+            {
+                break;
+            }
+        }
+
+        if (rec == NULL) {
+            size = sizeof(ngx_http_upstream_keepalive_shared_t)
+                   + (sh->nslots - 1)
+                     * sizeof(ngx_http_upstream_keepalive_slot_t);
+
+            rec = ngx_slab_calloc(shpool, size + kcfp[i]->name.len);
+            if (rec == NULL) {
+                return NGX_ERROR;
+            }
+
+            rec->nslots = sh->nslots;
+            rec->name.len = kcfp[i]->name.len;
+            rec->name.data = (u_char *) rec + size;
+            ngx_memcpy(rec->name.data, kcfp[i]->name.data, rec->name.len);
+
+            rec->next = sh->records;
+            sh->records = rec;
+        }
+
+        kcfp[i]->shared = rec;
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_upstream_keepalive_reap(ngx_shm_zone_t *shm_zone, ngx_pid_t pid)
+{
+    ngx_uint_t                             i;
+    ngx_slab_pool_t                       *shpool;
+    ngx_http_upstream_keepalive_sh_t      *sh;
+    ngx_http_upstream_keepalive_shared_t  *rec;
+
+    /* called by the master process from the SIGCHLD handler */
+
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+    sh = shpool->data;
+
+    if (sh == NULL) {
+        return;
+    }
+
+    for (i = 0; i < sh->nslots; i++) {
+        if (sh->pids[i] == (ngx_atomic_uint_t) pid) {
+            break;
+        }
+    }
+
+    if (i == sh->nslots) {
+        return;
+    }
+
+    /* the connections were closed with the process */
+
+    for (rec = sh->records; rec; rec = rec->next) {
+        rec->slots[i].idle = 0;
+        rec->slots[i].want = 0;
+    }
+
+    ngx_memory_barrier();
+
+    sh->pids[i] = 0;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_keepalive_init(ngx_conf_t *cf)
+{
+    size_t                                    size;
+    ngx_str_t                                 name;
+    ngx_uint_t                                i;
+    ngx_core_conf_t                          *ccf;
+    ngx_http_upstream_keepalive_srv_conf_t  **kcfp;
+    ngx_http_upstream_keepalive_main_conf_t  *kmcf, *okmcf;
+
+    kmcf = ngx_http_conf_get_module_main_conf(cf,
+                                          ngx_http_upstream_keepalive_module);
+
+    if (kmcf->shared.nelts == 0) {
+        return NGX_OK;
+    }
+
+    ccf = (ngx_core_conf_t *) ngx_get_conf(cf->cycle->conf_ctx,
+                                           ngx_core_module);
+
+    if (ccf->worker_processes != NGX_CONF_UNSET
+        && ccf->worker_processes > 0)
+    {
+        kmcf->nslots = ccf->worker_processes;
+
+    } else {
+        kmcf->nslots = ngx_max(ngx_ncpu, 1);
+    }
+
+    kmcf->nslots *= NGX_HTTP_UPSTREAM_KEEPALIVE_GENERATIONS;
+
+    size = 8 * ngx_pagesize + kmcf->nslots * sizeof(ngx_atomic_t);
+
+    kcfp = kmcf->shared.elts;
+
+    for (i = 0; i < kmcf->shared.nelts; i++) {
+        size += 2 * (sizeof(ngx_http_upstream_keepalive_shared_t)
+                     + kmcf->nslots
+                       * sizeof(ngx_http_upstream_keepalive_slot_t)
+                     + kcfp[i]->name.len);
+    }
+
+    ngx_str_set(&name, "upstream_keepalive");
+
+    kmcf->shm_zone = ngx_shared_memory_add(cf, &name, size,
+                                         &ngx_http_upstream_keepalive_module);
+    if (kmcf->shm_zone == NULL) {
+        return NGX_ERROR;
+    }
+
+    kmcf->shm_zone->init = ngx_http_upstream_keepalive_init_zone;
+    kmcf->shm_zone->reap = ngx_http_upstream_keepalive_reap;
+    kmcf->shm_zone->data = kmcf;
+
+    /* the slots of the previous workers are kept in place */
+
+    if (ngx_is_init_cycle(cf->cycle->old_cycle)) {
+        okmcf = NULL;
+
+    } else {
+        okmcf = ngx_http_cycle_get_module_main_conf(cf->cycle->old_cycle,
+                                          ngx_http_upstream_keepalive_module);
+    }
+
+    if (okmcf && okmcf->sh && okmcf->nslots != kmcf->nslots) {
+        kmcf->shm_zone->noreuse = 1;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_keepalive_init_worker(ngx_cycle_t *cycle)
+{
+    ngx_uint_t                                i, n;
+    ngx_http_upstream_keepalive_sh_t         *sh;
+    ngx_http_upstream_keepalive_srv_conf_t  **kcfp;
+    ngx_http_upstream_keepalive_main_conf_t  *kmcf;
+
+    kmcf = ngx_http_cycle_get_module_main_conf(cycle,
+                                         ngx_http_upstream_keepalive_module);
+
+    if (kmcf == NULL || kmcf->sh == NULL) {
+        return NGX_OK;
+    }
+
+    sh = kmcf->sh;
+    kcfp = kmcf->shared.elts;
+
+    n = sh->nslots;
+
+    if (ngx_process == NGX_PROCESS_WORKER) {
+
+        for (n = 0; n < sh->nslots; n++) {
+            if (sh->pids[n] == 0
+                && ngx_atomic_cmp_set(&sh->pids[n], 0, ngx_pid))
+            {
+                break;
+            }
+        }
+
+        if (n == sh->nslots) {
+            ngx_log_error(NGX_LOG_WARN, cycle->log, 0,
+                          "upstream keepalive: no free slot, the \"shared\" "
+                          "limit does not apply to this worker");
+        }
+    }
+
+    for (i = 0; i < kmcf->shared.nelts; i++) {
+
+        if (n == sh->nslots) {
+            kcfp[i]->shared = NULL;
+            continue;
+        }
+
+        kcfp[i]->slot = &kcfp[i]->shared->slots[n];
+    }
+
+    if (n < sh->nslots) {
+        ngx_pass_connection_handler = ngx_http_upstream_keepalive_pass_handler;
+    }
+
+    return NGX_OK;
+}
+
+#endif
+
+
+static void *
+ngx_http_upstream_keepalive_create_main_conf(ngx_conf_t *cf)
+{
+    ngx_http_upstream_keepalive_main_conf_t  *kmcf;
+
+    kmcf = ngx_pcalloc(cf->pool,
+                       sizeof(ngx_http_upstream_keepalive_main_conf_t));
+    if (kmcf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     kmcf->shm_zone = NULL;
+     *     kmcf->sh = NULL;
+     *     kmcf->nslots = 0;
+     */
+
+    if (ngx_array_init(&kmcf->shared, cf->pool, 4,
+                       sizeof(ngx_http_upstream_keepalive_srv_conf_t *))
+        != NGX_OK)
+    {
+        return NULL;
+    }
+
+    return kmcf;
+}
+
+
 static void *
 ngx_http_upstream_keepalive_create_conf(ngx_conf_t *cf)
 {
@@ -524,6 +1409,9 @@ ngx_http_upstream_keepalive_create_conf(ngx_conf_t *cf)
      *     conf->original_init_upstream = NULL;
      *     conf->original_init_peer = NULL;
      *     conf->max_cached = 0;
+     *     conf->name = { 0, NULL };
+     *     conf->shared = NULL;
+     *     conf->slot = NULL;
      */
 
     conf->time = NGX_CONF_UNSET_MSEC;
@@ -540,8 +1428,12 @@ ngx_http_upstream_keepalive(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     ngx_http_upstream_srv_conf_t            *uscf;
     ngx_http_upstream_keepalive_srv_conf_t  *kcf = conf;
 
-    ngx_int_t    n;
-    ngx_str_t   *value;
+    ngx_int_t                                 n;
+    ngx_str_t                                *value;
+#if (NGX_HAVE_UNIX_DOMAIN)
+    ngx_http_upstream_keepalive_srv_conf_t  **kcfp;
+    ngx_http_upstream_keepalive_main_conf_t  *kmcf;
+#endif
 
     if (kcf->max_cached) {
         return "is duplicate";
@@ -566,6 +1458,38 @@ ngx_http_upstream_keepalive(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 
     uscf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_upstream_module);
 
+    if (cf->args->nelts == 3) {
+
+        if (ngx_strcmp(value[2].data, "shared") != 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid parameter \"%V\"", &value[2]);
+            return NGX_CONF_ERROR;
+        }
+
+#if (NGX_HAVE_UNIX_DOMAIN)
+
+        kmcf = ngx_http_conf_get_module_main_conf(cf,
+                                          ngx_http_upstream_keepalive_module);
+
+        /* the zone is added when the number of upstreams is known */
+
+        kcfp = ngx_array_push(&kmcf->shared);
+        if (kcfp == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        *kcfp = kcf;
+        kcf->name = uscf->host;
+
+#else
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"shared\" is not supported on this platform");
+        return NGX_CONF_ERROR;
+
+#endif
+    }
+
     kcf->original_init_upstream = uscf->peer.init_upstream
                                   ? uscf->peer.init_upstream
                                   : ngx_http_upstream_init_round_robin;
@@ -17,6 +17,7 @@ typedef struct {
 
 typedef struct {
     ngx_uint_t                            two;
+    ngx_uint_t                            least_time;
     ngx_http_upstream_random_range_t     *ranges;
 } ngx_http_upstream_random_srv_conf_t;
 
@@ -26,10 +27,22 @@ typedef struct {
     ngx_http_upstream_rr_peer_data_t      rrp;
 
     ngx_http_upstream_random_srv_conf_t  *conf;
+    ngx_http_upstream_t                  *upstream;
     u_char                                tries;
 } ngx_http_upstream_random_peer_data_t;
 
 
+#define NGX_HTTP_UPSTREAM_RANDOM_LEAST_CONN       0
+#define NGX_HTTP_UPSTREAM_RANDOM_LEAST_TIME_HDR   1
+#define NGX_HTTP_UPSTREAM_RANDOM_LEAST_TIME_LAST  2
+
+/* time constant of the response time decay, in milliseconds */
+#define NGX_HTTP_UPSTREAM_RANDOM_DECAY            10000
+
+/* cost of a peer with requests in flight and no response time yet */
+#define NGX_HTTP_UPSTREAM_RANDOM_PENALTY          ((uint64_t) 1 << 40)
+
+
 static ngx_int_t ngx_http_upstream_init_random(ngx_conf_t *cf,
     ngx_http_upstream_srv_conf_t *us);
 static ngx_int_t ngx_http_upstream_update_random(ngx_pool_t *pool,
@@ -41,6 +54,10 @@ static ngx_int_t ngx_http_upstream_get_random_peer(ngx_peer_connection_t *pc,
     void *data);
 static ngx_int_t ngx_http_upstream_get_random2_peer(ngx_peer_connection_t *pc,
     void *data);
+static void ngx_http_upstream_free_random2_peer(ngx_peer_connection_t *pc,
+    void *data, ngx_uint_t state);
+static uint64_t ngx_http_upstream_random_cost(ngx_http_upstream_rr_peer_t *peer,
+    ngx_msec_t now);
 static ngx_uint_t ngx_http_upstream_peek_random_peer(
     ngx_http_upstream_rr_peers_t *peers,
     ngx_http_upstream_random_peer_data_t *rp);
@@ -176,11 +193,16 @@ ngx_http_upstream_init_random_peer(ngx_http_request_t *r,
     if (rcf->two) {
         r->upstream->peer.get = ngx_http_upstream_get_random2_peer;
 
+        if (rcf->least_time) {
+            r->upstream->peer.free = ngx_http_upstream_free_random2_peer;
+        }
+
     } else {
         r->upstream->peer.get = ngx_http_upstream_get_random_peer;
     }
 
     rp->conf = rcf;
+    rp->upstream = r->upstream;
     rp->tries = 0;
 
     ngx_http_upstream_rr_peers_rlock(rp->rrp.peers);
@@ -301,7 +323,7 @@ ngx_http_upstream_get_random2_peer(ngx_peer_connection_t *pc, void *data)
 
     time_t                             now;
     uintptr_t                          m;
-    ngx_uint_t                         i, n, p;
+    ngx_uint_t                         i, n, p, swap;
     ngx_http_upstream_rr_peer_t       *peer, *prev;
     ngx_http_upstream_rr_peers_t      *peers;
     ngx_http_upstream_rr_peer_data_t  *rrp;
@@ -363,7 +385,17 @@ ngx_http_upstream_get_random2_peer(ngx_peer_connection_t *pc, void *data)
         }
 
         if (prev) {
-            if (peer->conns * prev->weight > prev->conns * peer->weight) {
+            if (rp->conf->least_time) {
+                swap = ngx_http_upstream_random_cost(peer, ngx_current_msec)
+                       * prev->weight
+                       > ngx_http_upstream_random_cost(prev, ngx_current_msec)
+                         * peer->weight;
+
+            } else {
+                swap = peer->conns * prev->weight > prev->conns * peer->weight;
+            }
+
+            if (swap) {
                 peer = prev;
                 n = p / (8 * sizeof(uintptr_t));
                 m = (uintptr_t) 1 << p % (8 * sizeof(uintptr_t));
@@ -403,6 +435,115 @@ ngx_http_upstream_get_random2_peer(ngx_peer_connection_t *pc, void *data)
 }
 
 
+static void
+ngx_http_upstream_free_random2_peer(ngx_peer_connection_t *pc, void *data,
+    ngx_uint_t state)
+{
+    ngx_http_upstream_random_peer_data_t  *rp = data;
+
+    uint64_t                       ewma;
+    ngx_msec_t                     now, sample, elapsed;
+    ngx_http_upstream_t           *u;
+    ngx_http_upstream_rr_peer_t   *peer;
+
+    u = rp->upstream;
+    peer = rp->rrp.current;
+
+    if (peer == NULL || u->state == NULL) {
+        goto done;
+    }
+
+    now = ngx_current_msec;
+
+    if (state & NGX_PEER_FAILED) {
+
+        /*
+         * a failed try may take no time at all, e.g., if the connection
+         * is refused, so it is accounted as if the peer was as slow
+         * as the connect timeout allows
+         */
+
+        sample = ngx_max(now - u->start_time, u->conf->connect_timeout);
+
+    } else if (rp->conf->least_time
+               == NGX_HTTP_UPSTREAM_RANDOM_LEAST_TIME_HDR)
+    {
+        sample = u->state->header_time;
+
+    } else {
+        sample = u->state->response_time;
+    }
+
+    if (sample == (ngx_msec_t) -1) {
+        sample = now - u->start_time;
+    }
+
+    /*
+     * peak EWMA: a slower sample replaces the average at once,
+     * a faster one is blended in with a weight growing with the time
+     * passed since the last update
+     */
+
+    ewma = ((uint64_t) sample + 1) * 1000;
+
+    ngx_http_upstream_rr_peers_rlock(rp->rrp.peers);
+    ngx_http_upstream_rr_peer_lock(rp->rrp.peers, peer);
+
+    if (ewma >= peer->ewma) {
+        peer->ewma = ewma;
+
+    } else {
+        elapsed = now - peer->ewma_updated;
+
+        if (elapsed == 0) {
+            elapsed = 1;
+        }
+
+        peer->ewma = ((uint64_t) peer->ewma * NGX_HTTP_UPSTREAM_RANDOM_DECAY
+                      + ewma * elapsed)
+                     / (NGX_HTTP_UPSTREAM_RANDOM_DECAY + elapsed);
+    }
+
+    peer->ewma_updated = now;
+    ewma = peer->ewma;
+
+    ngx_http_upstream_rr_peer_unlock(rp->rrp.peers, peer);
+    ngx_http_upstream_rr_peers_unlock(rp->rrp.peers);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "free random2 peer, time: %M, ewma: %uL", sample, ewma);
+
+done:
+
+    ngx_http_upstream_free_round_robin_peer(pc, &rp->rrp, state);
+}
+
+
+static uint64_t
+ngx_http_upstream_random_cost(ngx_http_upstream_rr_peer_t *peer,
+    ngx_msec_t now)
+{
+    uint64_t    ewma;
+    ngx_msec_t  elapsed;
+
+    if (peer->ewma == 0) {
+        return peer->conns ? NGX_HTTP_UPSTREAM_RANDOM_PENALTY : 0;
+    }
+
+    /*
+     * the average decays towards zero while a peer is not chosen,
+     * so a peer penalized once gets probed again eventually
+     */
+
+    elapsed = now - peer->ewma_updated;
+
+    ewma = (uint64_t) peer->ewma * NGX_HTTP_UPSTREAM_RANDOM_DECAY
+           / (NGX_HTTP_UPSTREAM_RANDOM_DECAY + elapsed);
+
+    return ewma * (peer->conns + 1);
+}
+
+
 static ngx_uint_t
 ngx_http_upstream_peek_random_peer(ngx_http_upstream_rr_peers_t *peers,
     ngx_http_upstream_random_peer_data_t *rp)
@@ -443,6 +584,7 @@ ngx_http_upstream_random_create_conf(ngx_conf_t *cf)
      * set by ngx_pcalloc():
      *
      *     conf->two = 0;
+     *     conf->least_time = NGX_HTTP_UPSTREAM_RANDOM_LEAST_CONN;
      */
 
     return conf;
@@ -492,7 +634,16 @@ ngx_http_upstream_random(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         return NGX_CONF_OK;
     }
 
-    if (ngx_strcmp(value[2].data, "least_conn") != 0) {
+    if (ngx_strcmp(value[2].data, "least_conn") == 0) {
+        rcf->least_time = NGX_HTTP_UPSTREAM_RANDOM_LEAST_CONN;
+
+    } else if (ngx_strcmp(value[2].data, "least_time=header") == 0) {
+        rcf->least_time = NGX_HTTP_UPSTREAM_RANDOM_LEAST_TIME_HDR;
+
+    } else if (ngx_strcmp(value[2].data, "least_time=last_byte") == 0) {
+        rcf->least_time = NGX_HTTP_UPSTREAM_RANDOM_LEAST_TIME_LAST;
+
+    } else {
         ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
                            "invalid parameter \"%V\"", &value[2]);
         return NGX_CONF_ERROR;
@@ -10,6 +10,15 @@
 #include <ngx_http.h>
 
 
+typedef struct {
+    ngx_http_upstream_srv_conf_t   *uscf;
+    ngx_http_upstream_server_t     *server;
+    ngx_http_upstream_rr_peers_t   *peers;
+    ngx_http_upstream_rr_peer_t    *peer;
+    ngx_event_t                     event;
+} ngx_http_upstream_host_t;
+
+
 static char *ngx_http_upstream_zone(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
 static ngx_int_t ngx_http_upstream_init_zone(ngx_shm_zone_t *shm_zone,
@@ -18,6 +27,14 @@ static ngx_http_upstream_rr_peers_t *ngx_http_upstream_zone_copy_peers(
     ngx_slab_pool_t *shpool, ngx_http_upstream_srv_conf_t *uscf);
 static ngx_http_upstream_rr_peer_t *ngx_http_upstream_zone_copy_peer(
     ngx_http_upstream_rr_peers_t *peers, ngx_http_upstream_rr_peer_t *src);
+static ngx_int_t ngx_http_upstream_zone_init_worker(ngx_cycle_t *cycle);
+static ngx_int_t ngx_http_upstream_zone_add_hosts(ngx_cycle_t *cycle,
+    ngx_http_upstream_srv_conf_t *uscf, ngx_http_upstream_rr_peers_t *peers,
+    ngx_uint_t backup);
+static void ngx_http_upstream_zone_resolve_timer(ngx_event_t *event);
+static void ngx_http_upstream_zone_resolve_handler(ngx_resolver_ctx_t *ctx);
+static void ngx_http_upstream_zone_update_peers(ngx_http_upstream_host_t *host,
+    ngx_resolver_addr_t *addrs, ngx_uint_t naddrs);
 
 
 static ngx_command_t  ngx_http_upstream_zone_commands[] = {
@@ -55,7 +72,7 @@ ngx_module_t  ngx_http_upstream_zone_module = {
     NGX_HTTP_MODULE,                       /* module type */
     NULL,                                  /* init master */
     NULL,                                  /* init module */
-    NULL,                                  /* init process */
+    ngx_http_upstream_zone_init_worker,    /* init process */
     NULL,                                  /* init thread */
     NULL,                                  /* exit thread */
     NULL,                                  /* exit process */
@@ -323,3 +340,299 @@ failed:
 
     return NULL;
 }
+
+
+static ngx_int_t
+ngx_http_upstream_zone_init_worker(ngx_cycle_t *cycle)
+{
+    ngx_uint_t                      i;
+    ngx_http_upstream_rr_peers_t   *peers;
+    ngx_http_upstream_srv_conf_t   *uscf, **uscfp;
+    ngx_http_upstream_main_conf_t  *umcf;
+
+    /* names are re-resolved by the first worker only */
+
+    if ((ngx_process != NGX_PROCESS_WORKER
+         && ngx_process != NGX_PROCESS_SINGLE)
+        || ngx_worker != 0)
+    {
+        return NGX_OK;
+    }
+
+    umcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_upstream_module);
+
+    if (umcf == NULL) {
+        return NGX_OK;
+    }
+
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+        uscf = uscfp[i];
+
+        if (uscf->shm_zone == NULL || uscf->resolver == NULL) {
+            continue;
+        }
+
+        peers = uscf->peer.data;
+
+        if (ngx_http_upstream_zone_add_hosts(cycle, uscf, peers, 0)
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+        if (peers->next
+            && ngx_http_upstream_zone_add_hosts(cycle, uscf, peers->next, 1)
+               != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_zone_add_hosts(ngx_cycle_t *cycle,
+    ngx_http_upstream_srv_conf_t *uscf, ngx_http_upstream_rr_peers_t *peers,
+    ngx_uint_t backup)
+{
+    ngx_uint_t                    i, j;
+    ngx_http_upstream_host_t     *host;
+    ngx_http_upstream_server_t   *server;
+    ngx_http_upstream_rr_peer_t  *peer;
+
+    /* peers follow the order of servers, see round robin initialization */
+
+    peer = peers->peer;
+    server = uscf->servers->elts;
+
+    for (i = 0; i < uscf->servers->nelts; i++) {
+
+        if (server[i].backup != backup) {
+            continue;
+        }
+
+        if (server[i].resolve) {
+            host = ngx_pcalloc(cycle->pool, sizeof(ngx_http_upstream_host_t));
+            if (host == NULL) {
+                return NGX_ERROR;
+            }
+
+            host->uscf = uscf;
+            host->server = &server[i];
+            host->peers = peers;
+            host->peer = peer;
+
+            host->event.handler = ngx_http_upstream_zone_resolve_timer;
+            host->event.data = host;
+            host->event.log = cycle->log;
+            host->event.cancelable = 1;
+
+            ngx_add_timer(&host->event, 0);
+        }
+
+        for (j = 0; j < server[i].naddrs; j++) {
+            peer = peer->next;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_upstream_zone_resolve_timer(ngx_event_t *event)
+{
+    ngx_resolver_ctx_t        *ctx;
+    ngx_http_upstream_host_t  *host;
+
+    host = event->data;
+
+    if (ngx_terminate || ngx_exiting || ngx_quit) {
+        return;
+    }
+
+    ctx = ngx_resolve_start(host->uscf->resolver, NULL);
+    if (ctx == NULL) {
+        goto retry;
+    }
+
+    if (ctx == NGX_NO_RESOLVER) {
+        ngx_log_error(NGX_LOG_ERR, event->log, 0,
+                      "no resolver defined to resolve %V",
+                      &host->server->host);
+        return;
+    }
+
+    ctx->name = host->server->host;
+    ctx->handler = ngx_http_upstream_zone_resolve_handler;
+    ctx->data = host;
+    ctx->timeout = host->uscf->resolver_timeout;
+
+    if (ngx_resolve_name(ctx) == NGX_OK) {
+        return;
+    }
+
+retry:
+
+    ngx_add_timer(event, 1000);
+}
+
+
+static void
+ngx_http_upstream_zone_resolve_handler(ngx_resolver_ctx_t *ctx)
+{
+    time_t                     valid;
+    ngx_event_t               *event;
+    ngx_http_upstream_host_t  *host;
+
+    host = ctx->data;
+    event = &host->event;
+
+    if (ctx->state) {
+        ngx_log_error(NGX_LOG_ERR, event->log, 0,
+                      "%V in upstream \"%V\" could not be resolved (%i: %s)",
+                      &ctx->name, &host->uscf->host, ctx->state,
+                      ngx_resolver_strerror(ctx->state));
+
+        if (ctx->state == NGX_RESOLVE_NXDOMAIN) {
+            ngx_http_upstream_zone_update_peers(host, NULL, 0);
+        }
+
+    } else {
+        ngx_http_upstream_zone_update_peers(host, ctx->addrs, ctx->naddrs);
+    }
+
+    /* the answer is cached by the resolver until ctx->valid inclusive */
+
+    valid = ctx->valid - ngx_time() + 1;
+
+    if (valid < 1) {
+        valid = 1;
+    }
+
+    ngx_resolve_name_done(ctx);
+
+    if (ngx_terminate || ngx_exiting || ngx_quit) {
+        return;
+    }
+
+    ngx_add_timer(event, (ngx_msec_t) valid * 1000);
+}
+
+
+static void
+ngx_http_upstream_zone_update_peers(ngx_http_upstream_host_t *host,
+    ngx_resolver_addr_t *addrs, ngx_uint_t naddrs)
+{
+    ngx_uint_t                     i, j;
+    ngx_sockaddr_t                 sockaddr;
+    ngx_http_upstream_server_t    *server;
+    ngx_http_upstream_rr_peer_t   *peer, *slot, *spare;
+    ngx_http_upstream_rr_peers_t  *peers;
+
+    server = host->server;
+    peers = host->peers;
+
+    ngx_http_upstream_rr_peers_wlock(peers);
+
+    /* disable peers whose addresses are gone */
+
+    for (peer = host->peer, i = 0; i < server->naddrs; peer = peer->next, i++) {
+
+        if (peer->down & NGX_HTTP_UPSTREAM_PEER_UNRESOLVED) {
+            continue;
+        }
+
+        for (j = 0; j < naddrs; j++) {
+            ngx_memcpy(&sockaddr, addrs[j].sockaddr, addrs[j].socklen);
+            ngx_inet_set_port(&sockaddr.sockaddr, server->port);
+
+            if (ngx_cmp_sockaddr(peer->sockaddr, peer->socklen,
+                                 &sockaddr.sockaddr, addrs[j].socklen, 1)
+                == NGX_OK)
+            {
+                break;
+            }
+        }
+
+        if (j == naddrs) {
+            peer->down |= NGX_HTTP_UPSTREAM_PEER_UNRESOLVED;
+
+            ngx_log_error(NGX_LOG_NOTICE, host->event.log, 0,
+                          "removed peer %V from upstream \"%V\"",
+                          &peer->name, peers->name);
+        }
+    }
+
+    /*
+     * add new addresses; a slot is reused only if no connection
+     * can still refer to its old address
+     */
+
+    for (j = 0; j < naddrs; j++) {
+        ngx_memcpy(&sockaddr, addrs[j].sockaddr, addrs[j].socklen);
+        ngx_inet_set_port(&sockaddr.sockaddr, server->port);
+
+        slot = NULL;
+        spare = NULL;
+
+        for (peer = host->peer, i = 0;
+             i < server->naddrs;
+             peer = peer->next, i++)
+        {
+            if (ngx_cmp_sockaddr(peer->sockaddr, peer->socklen,
+                                 &sockaddr.sockaddr, addrs[j].socklen, 1)
+                == NGX_OK)
+            {
+                slot = peer;
+                break;
+            }
+
+            if (spare == NULL
+                && (peer->down & NGX_HTTP_UPSTREAM_PEER_UNRESOLVED)
+                && peer->conns == 0)
+            {
+                spare = peer;
+            }
+        }
+
+        if (slot && !(slot->down & NGX_HTTP_UPSTREAM_PEER_UNRESOLVED)) {
+            continue;
+        }
+
+        if (slot == NULL) {
+            if (spare == NULL) {
+                ngx_log_error(NGX_LOG_WARN, host->event.log, 0,
+                              "no free peer slots for %V in upstream \"%V\"",
+                              &server->host, peers->name);
+                break;
+            }
+
+            slot = spare;
+
+            ngx_memcpy(slot->sockaddr, &sockaddr, addrs[j].socklen);
+            slot->socklen = addrs[j].socklen;
+            slot->name.len = ngx_sock_ntop(slot->sockaddr, slot->socklen,
+                                           slot->name.data,
+                                           NGX_SOCKADDR_STRLEN, 1);
+        }
+
+        slot->current_weight = 0;
+        slot->effective_weight = slot->weight;
+        slot->fails = 0;
+        slot->accessed = 0;
+        slot->checked = 0;
+        slot->down &= ~(NGX_HTTP_UPSTREAM_PEER_UNRESOLVED
+                        |NGX_HTTP_UPSTREAM_PEER_UNHEALTHY);
+
+        ngx_log_error(NGX_LOG_NOTICE, host->event.log, 0,
+                      "added peer %V to upstream \"%V\"",
+                      &slot->name, peers->name);
+    }
+
+    ngx_http_upstream_rr_peers_unlock(peers);
+}
@@ -29,6 +29,8 @@
 
 #define NGX_HTTP_CACHE_VERSION       5
 
+#define NGX_HTTP_CACHE_MAX_SHARDS    256
+
 
 typedef struct {
     ngx_uint_t                       status;
@@ -156,10 +158,20 @@ typedef struct {
 } ngx_http_file_cache_sh_t;
 
 
+typedef struct {
+    ngx_http_file_cache_sh_t        *sh;
+    ngx_slab_pool_t                 *shpool;
+} ngx_http_file_cache_shard_t;
+
+
 struct ngx_http_file_cache_s {
     ngx_http_file_cache_sh_t        *sh;
     ngx_slab_pool_t                 *shpool;
 
+    ngx_http_file_cache_shard_t     *shards;
+    ngx_uint_t                       nshards;
+    ngx_uint_t                       shard;
+
     ngx_path_t                      *path;
 
     off_t                            min_free;
@@ -180,6 +192,11 @@ struct ngx_http_file_cache_s {
     ngx_msec_t                       manager_sleep;
     ngx_msec_t                       manager_threshold;
 
+    ngx_str_t                        index;
+    time_t                           index_interval;
+    time_t                           index_time;
+    u_char                          *index_dirs;
+
     ngx_shm_zone_t                  *shm_zone;
 
     ngx_uint_t                       use_temp_path;
@@ -187,6 +204,8 @@ struct ngx_http_file_cache_s {
 };
 
 
+ngx_int_t ngx_http_file_cache_init(ngx_shm_zone_t *shm_zone, void *data);
+off_t ngx_http_file_cache_size(ngx_http_file_cache_t *cache);
 ngx_int_t ngx_http_file_cache_new(ngx_http_request_t *r);
 ngx_int_t ngx_http_file_cache_create(ngx_http_request_t *r);
 void ngx_http_file_cache_create_key(ngx_http_request_t *r);
@@ -11,6 +11,28 @@
 #include <ngx_md5.h>
 
 
+#define NGX_HTTP_CACHE_INDEX_VERSION  1
+
+/* nodes walked in a shard while its mutex is held */
+#define NGX_HTTP_CACHE_INDEX_BATCH    1024
+
+
+typedef struct {
+    u_char                           magic[8];
+    uint32_t                         version;
+    uint32_t                         bsize;
+    uint64_t                         time;
+    uint64_t                         entries;
+    u_char                           levels[8];
+} ngx_http_file_cache_index_header_t;
+
+
+typedef struct {
+    u_char                           key[NGX_HTTP_CACHE_KEY_LEN];
+    uint64_t                         fs_size;
+} ngx_http_file_cache_index_entry_t;
+
+
 static ngx_int_t ngx_http_file_cache_lock(ngx_http_request_t *r,
     ngx_http_cache_t *c);
 static void ngx_http_file_cache_lock_wait_handler(ngx_event_t *ev);
@@ -33,7 +55,8 @@ static ngx_int_t ngx_http_file_cache_exists(ngx_http_file_cache_t *cache,
 static ngx_int_t ngx_http_file_cache_name(ngx_http_request_t *r,
     ngx_path_t *path);
 static ngx_http_file_cache_node_t *
-    ngx_http_file_cache_lookup(ngx_http_file_cache_t *cache, u_char *key);
+    ngx_http_file_cache_lookup(ngx_http_file_cache_shard_t *shard,
+    u_char *key);
 static void ngx_http_file_cache_rbtree_insert_value(ngx_rbtree_node_t *temp,
     ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
 static void ngx_http_file_cache_vary(ngx_http_request_t *r, u_char *vary,
@@ -45,10 +68,13 @@ static ngx_int_t ngx_http_file_cache_reopen(ngx_http_request_t *r,
 static ngx_int_t ngx_http_file_cache_update_variant(ngx_http_request_t *r,
     ngx_http_cache_t *c);
 static void ngx_http_file_cache_cleanup(void *data);
-static time_t ngx_http_file_cache_forced_expire(ngx_http_file_cache_t *cache);
+static time_t ngx_http_file_cache_forced_expire(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_shard_t *shard);
 static time_t ngx_http_file_cache_expire(ngx_http_file_cache_t *cache);
+static time_t ngx_http_file_cache_expire_shard(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_shard_t *shard, u_char *name);
 static void ngx_http_file_cache_delete(ngx_http_file_cache_t *cache,
-    ngx_queue_t *q, u_char *name);
+    ngx_http_file_cache_shard_t *shard, ngx_queue_t *q, u_char *name);
 static void ngx_http_file_cache_loader_sleep(ngx_http_file_cache_t *cache);
 static ngx_int_t ngx_http_file_cache_noop(ngx_tree_ctx_t *ctx,
     ngx_str_t *path);
@@ -62,7 +88,19 @@ static ngx_int_t ngx_http_file_cache_add(ngx_http_file_cache_t *cache,
     ngx_http_cache_t *c);
 static ngx_int_t ngx_http_file_cache_delete_file(ngx_tree_ctx_t *ctx,
     ngx_str_t *path);
-static void ngx_http_file_cache_set_watermark(ngx_http_file_cache_t *cache);
+static void ngx_http_file_cache_set_watermark(
+    ngx_http_file_cache_shard_t *shard);
+static ngx_int_t ngx_http_file_cache_init_shards(ngx_shm_zone_t *shm_zone,
+    ngx_http_file_cache_t *cache);
+static void ngx_http_file_cache_write_index(ngx_http_file_cache_t *cache);
+static ngx_int_t ngx_http_file_cache_open_index(ngx_http_file_cache_t *cache,
+    ngx_file_mapping_t *fm);
+static ngx_int_t ngx_http_file_cache_replay_index(ngx_http_file_cache_t *cache,
+    ngx_file_mapping_t *fm);
+static ngx_uint_t ngx_http_file_cache_index_dir(ngx_path_t *path,
+    u_char *key);
+static ngx_rbtree_node_t *ngx_http_file_cache_index_next(ngx_rbtree_t *tree,
+    u_char *key);
 
 
 ngx_str_t  ngx_http_cache_status[] = {
@@ -78,8 +116,18 @@ ngx_str_t  ngx_http_cache_status[] = {
 
 static u_char  ngx_http_file_cache_key[] = { LF, 'K', 'E', 'Y', ':', ' ' };
 
+static u_char  ngx_http_file_cache_index_magic[] = "NGXCIDX";
 
-static ngx_int_t
+
+/* a shard is chosen by the first four bytes of the md5 key */
+
+#define ngx_http_file_cache_shard(cache, key)                                 \
+    ((cache)->nshards == 1 ? &(cache)->shards[0]                              \
+     : &(cache)->shards[((uint32_t) (key)[0] << 24 | (key)[1] << 16           \
+                         | (key)[2] << 8 | (key)[3]) % (cache)->nshards])
+
+
+ngx_int_t
 ngx_http_file_cache_init(ngx_shm_zone_t *shm_zone, void *data)
 {
     ngx_http_file_cache_t  *ocache = data;
@@ -110,9 +158,17 @@ ngx_http_file_cache_init(ngx_shm_zone_t *shm_zone, void *data)
             }
         }
 
+        if (cache->nshards != ocache->nshards) {
+            ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                          "cache \"%V\" had previously %ui shards",
+                          &shm_zone->shm.name, ocache->nshards);
+            return NGX_ERROR;
+        }
+
         cache->sh = ocache->sh;
 
         cache->shpool = ocache->shpool;
+        cache->shards = ocache->shards;
         cache->bsize = ocache->bsize;
 
         cache->max_size /= cache->bsize;
@@ -127,51 +183,149 @@ ngx_http_file_cache_init(ngx_shm_zone_t *shm_zone, void *data)
     cache->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
 
     if (shm_zone->shm.exists) {
-        cache->sh = cache->shpool->data;
+        cache->shards = cache->shpool->data;
+        cache->sh = cache->shards[0].sh;
         cache->bsize = ngx_fs_bsize(cache->path->name.data);
         cache->max_size /= cache->bsize;
 
         return NGX_OK;
     }
 
-    cache->sh = ngx_slab_alloc(cache->shpool, sizeof(ngx_http_file_cache_sh_t));
-    if (cache->sh == NULL) {
+    len = sizeof(" in cache keys zone \"\"") + shm_zone->shm.name.len;
+
+    cache->shpool->log_ctx = ngx_slab_alloc(cache->shpool, len);
+    if (cache->shpool->log_ctx == NULL) {
         return NGX_ERROR;
     }
 
-    cache->shpool->data = cache->sh;
+    ngx_sprintf(cache->shpool->log_ctx, " in cache keys zone \"%V\"%Z",
+                &shm_zone->shm.name);
+
+    cache->shpool->log_nomem = 0;
 
-    ngx_rbtree_init(&cache->sh->rbtree, &cache->sh->sentinel,
-                    ngx_http_file_cache_rbtree_insert_value);
+    if (ngx_http_file_cache_init_shards(shm_zone, cache) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    /* the first shard also keeps the loader state of the whole cache */
 
-    ngx_queue_init(&cache->sh->queue);
+    cache->sh = cache->shards[0].sh;
 
     cache->sh->cold = 1;
     cache->sh->loading = 0;
-    cache->sh->size = 0;
-    cache->sh->count = 0;
-    cache->sh->watermark = (ngx_uint_t) -1;
 
     cache->bsize = ngx_fs_bsize(cache->path->name.data);
 
     cache->max_size /= cache->bsize;
 
-    len = sizeof(" in cache keys zone \"\"") + shm_zone->shm.name.len;
+    return NGX_OK;
+}
 
-    cache->shpool->log_ctx = ngx_slab_alloc(cache->shpool, len);
-    if (cache->shpool->log_ctx == NULL) {
+
+static ngx_int_t
+ngx_http_file_cache_init_shards(ngx_shm_zone_t *shm_zone,
+    ngx_http_file_cache_t *cache)
+{
+    u_char                    *p;
+    size_t                     size;
+    ngx_uint_t                 i;
+    ngx_slab_pool_t           *shpool, *sp;
+    ngx_http_file_cache_sh_t  *sh;
+
+    shpool = cache->shpool;
+
+    cache->shards = ngx_slab_alloc(shpool, cache->nshards
+                                       * sizeof(ngx_http_file_cache_shard_t));
+    if (cache->shards == NULL) {
         return NGX_ERROR;
     }
 
-    ngx_sprintf(cache->shpool->log_ctx, " in cache keys zone \"%V\"%Z",
-                &shm_zone->shm.name);
+    shpool->data = cache->shards;
 
-    cache->shpool->log_nomem = 0;
+    /*
+     * with several shards the rest of the zone is split into
+     * equal slab pools, each one has its own mutex, rbtree and
+     * LRU queue
+     */
+
+    size = shpool->pfree / cache->nshards * ngx_pagesize;
+
+    for (i = 0; i < cache->nshards; i++) {
+
+        if (cache->nshards == 1) {
+            sp = shpool;
+
+        } else {
+            p = ngx_slab_alloc(shpool, size);
+            if (p == NULL) {
+                return NGX_ERROR;
+            }
+
+            sp = (ngx_slab_pool_t *) p;
+
+            sp->end = p + size;
+            sp->min_shift = 3;
+            sp->addr = p;
+
+            if (ngx_shmtx_create(&sp->mutex, &sp->lock, NULL) != NGX_OK) {
+                return NGX_ERROR;
+            }
+
+            ngx_slab_init(sp);
+
+            sp->log_ctx = shpool->log_ctx;
+            sp->log_nomem = 0;
+        }
+
+        sh = ngx_slab_alloc(sp, sizeof(ngx_http_file_cache_sh_t));
+        if (sh == NULL) {
+            return NGX_ERROR;
+        }
+
+        ngx_rbtree_init(&sh->rbtree, &sh->sentinel,
+                        ngx_http_file_cache_rbtree_insert_value);
+
+        ngx_queue_init(&sh->queue);
+
+        sh->cold = 0;
+        sh->loading = 0;
+        sh->size = 0;
+        sh->count = 0;
+        sh->watermark = (ngx_uint_t) -1;
+
+        if (sp != shpool) {
+            sp->data = sh;
+        }
+
+        cache->shards[i].sh = sh;
+        cache->shards[i].shpool = sp;
+    }
 
     return NGX_OK;
 }
 
 
+off_t
+ngx_http_file_cache_size(ngx_http_file_cache_t *cache)
+{
+    off_t                         size;
+    ngx_uint_t                    i;
+    ngx_http_file_cache_shard_t  *shard;
+
+    size = 0;
+
+    for (i = 0; i < cache->nshards; i++) {
+        shard = &cache->shards[i];
+
+        ngx_shmtx_lock(&shard->shpool->mutex);
+        size += shard->sh->size;
+        ngx_shmtx_unlock(&shard->shpool->mutex);
+    }
+
+    return size * cache->bsize;
+}
+
+
 ngx_int_t
 ngx_http_file_cache_new(ngx_http_request_t *r)
 {
@@ -404,8 +558,9 @@ done:
 static ngx_int_t
 ngx_http_file_cache_lock(ngx_http_request_t *r, ngx_http_cache_t *c)
 {
-    ngx_msec_t                 now, timer;
-    ngx_http_file_cache_t     *cache;
+    ngx_msec_t                    now, timer;
+    ngx_http_file_cache_t        *cache;
+    ngx_http_file_cache_shard_t  *shard;
 
     if (!c->lock) {
         return NGX_DECLINED;
@@ -414,8 +569,9 @@ ngx_http_file_cache_lock(ngx_http_request_t *r, ngx_http_cache_t *c)
     now = ngx_current_msec;
 
     cache = c->file_cache;
+    shard = ngx_http_file_cache_shard(cache, c->key);
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    ngx_shmtx_lock(&shard->shpool->mutex);
 
     timer = c->node->lock_time - now;
 
@@ -426,7 +582,7 @@ ngx_http_file_cache_lock(ngx_http_request_t *r, ngx_http_cache_t *c)
         c->lock_time = c->node->lock_time;
     }
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+    ngx_shmtx_unlock(&shard->shpool->mutex);
 
     ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                    "http file cache lock u:%d wt:%M",
@@ -483,9 +639,10 @@ ngx_http_file_cache_lock_wait_handler(ngx_event_t *ev)
 static void
 ngx_http_file_cache_lock_wait(ngx_http_request_t *r, ngx_http_cache_t *c)
 {
-    ngx_uint_t              wait;
-    ngx_msec_t              now, timer;
-    ngx_http_file_cache_t  *cache;
+    ngx_uint_t                    wait;
+    ngx_msec_t                    now, timer;
+    ngx_http_file_cache_t        *cache;
+    ngx_http_file_cache_shard_t  *shard;
 
     now = ngx_current_msec;
 
@@ -499,9 +656,10 @@ ngx_http_file_cache_lock_wait(ngx_http_request_t *r, ngx_http_cache_t *c)
     }
 
     cache = c->file_cache;
+    shard = ngx_http_file_cache_shard(cache, c->key);
     wait = 0;
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    ngx_shmtx_lock(&shard->shpool->mutex);
 
     timer = c->node->lock_time - now;
 
@@ -509,7 +667,7 @@ ngx_http_file_cache_lock_wait(ngx_http_request_t *r, ngx_http_cache_t *c)
         wait = 1;
     }
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+    ngx_shmtx_unlock(&shard->shpool->mutex);
 
     if (wait) {
         ngx_add_timer(&c->wait_event, (timer > 500) ? 500 : timer);
@@ -534,6 +692,7 @@ ngx_http_file_cache_read(ngx_http_request_t *r, ngx_http_cache_t *c)
     ngx_int_t                      rc;
     ngx_uint_t                     i;
     ngx_http_file_cache_t         *cache;
+    ngx_http_file_cache_shard_t   *shard;
     ngx_http_file_cache_header_t  *h;
 
     n = ngx_http_file_cache_aio_read(r, c);
@@ -616,10 +775,11 @@ ngx_http_file_cache_read(ngx_http_request_t *r, ngx_http_cache_t *c)
     r->cached = 1;
 
     cache = c->file_cache;
+    shard = ngx_http_file_cache_shard(cache, c->key);
 
     if (cache->sh->cold) {
 
-        ngx_shmtx_lock(&cache->shpool->mutex);
+        ngx_shmtx_lock(&shard->shpool->mutex);
 
         if (!c->node->exists) {
             c->node->uses = 1;
@@ -628,10 +788,10 @@ ngx_http_file_cache_read(ngx_http_request_t *r, ngx_http_cache_t *c)
             c->node->uniq = c->uniq;
             c->node->fs_size = c->fs_size;
 
-            cache->sh->size += c->fs_size;
+            shard->sh->size += c->fs_size;
         }
 
-        ngx_shmtx_unlock(&cache->shpool->mutex);
+        ngx_shmtx_unlock(&shard->shpool->mutex);
     }
 
     now = ngx_time();
@@ -640,7 +800,7 @@ ngx_http_file_cache_read(ngx_http_request_t *r, ngx_http_cache_t *c)
         c->stale_updating = c->valid_sec + c->updating_sec >= now;
         c->stale_error = c->valid_sec + c->error_sec >= now;
 
-        ngx_shmtx_lock(&cache->shpool->mutex);
+        ngx_shmtx_lock(&shard->shpool->mutex);
 
         if (c->node->updating) {
             rc = NGX_HTTP_CACHE_UPDATING;
@@ -652,7 +812,7 @@ ngx_http_file_cache_read(ngx_http_request_t *r, ngx_http_cache_t *c)
             rc = NGX_HTTP_CACHE_STALE;
         }
 
-        ngx_shmtx_unlock(&cache->shpool->mutex);
+        ngx_shmtx_unlock(&shard->shpool->mutex);
 
         ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                        "http file cache expired: %i %T %T",
@@ -821,15 +981,18 @@ ngx_http_cache_thread_event_handler(ngx_event_t *ev)
 static ngx_int_t
 ngx_http_file_cache_exists(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
 {
-    ngx_int_t                    rc;
-    ngx_http_file_cache_node_t  *fcn;
+    ngx_int_t                     rc;
+    ngx_http_file_cache_node_t   *fcn;
+    ngx_http_file_cache_shard_t  *shard;
+
+    shard = ngx_http_file_cache_shard(cache, c->key);
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    ngx_shmtx_lock(&shard->shpool->mutex);
 
     fcn = c->node;
 
     if (fcn == NULL) {
-        fcn = ngx_http_file_cache_lookup(cache, c->key);
+        fcn = ngx_http_file_cache_lookup(shard, c->key);
     }
 
     if (fcn) {
@@ -868,35 +1031,35 @@ ngx_http_file_cache_exists(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
         goto done;
     }
 
-    fcn = ngx_slab_calloc_locked(cache->shpool,
+    fcn = ngx_slab_calloc_locked(shard->shpool,
                                  sizeof(ngx_http_file_cache_node_t));
     if (fcn == NULL) {
-        ngx_http_file_cache_set_watermark(cache);
+        ngx_http_file_cache_set_watermark(shard);
 
-        ngx_shmtx_unlock(&cache->shpool->mutex);
+        ngx_shmtx_unlock(&shard->shpool->mutex);
 
-        (void) ngx_http_file_cache_forced_expire(cache);
+        (void) ngx_http_file_cache_forced_expire(cache, shard);
 
-        ngx_shmtx_lock(&cache->shpool->mutex);
+        ngx_shmtx_lock(&shard->shpool->mutex);
 
-        fcn = ngx_slab_calloc_locked(cache->shpool,
+        fcn = ngx_slab_calloc_locked(shard->shpool,
                                      sizeof(ngx_http_file_cache_node_t));
         if (fcn == NULL) {
             ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
-                          "could not allocate node%s", cache->shpool->log_ctx);
+                          "could not allocate node%s", shard->shpool->log_ctx);
             rc = NGX_ERROR;
             goto failed;
         }
     }
 
-    cache->sh->count++;
+    shard->sh->count++;
 
     ngx_memcpy((u_char *) &fcn->node.key, c->key, sizeof(ngx_rbtree_key_t));
 
     ngx_memcpy(fcn->key, &c->key[sizeof(ngx_rbtree_key_t)],
                NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
 
-    ngx_rbtree_insert(&cache->sh->rbtree, &fcn->node);
+    ngx_rbtree_insert(&shard->sh->rbtree, &fcn->node);
 
     fcn->uses = 1;
     fcn->count = 1;
@@ -917,7 +1080,7 @@ done:
 
     fcn->expire = ngx_time() + cache->inactive;
 
-    ngx_queue_insert_head(&cache->sh->queue, &fcn->queue);
+    ngx_queue_insert_head(&shard->sh->queue, &fcn->queue);
 
     c->uniq = fcn->uniq;
     c->error = fcn->error;
@@ -925,7 +1088,7 @@ done:
 
 failed:
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+    ngx_shmtx_unlock(&shard->shpool->mutex);
 
     return rc;
 }
@@ -967,7 +1130,7 @@ ngx_http_file_cache_name(ngx_http_request_t *r, ngx_path_t *path)
 
 
 static ngx_http_file_cache_node_t *
-ngx_http_file_cache_lookup(ngx_http_file_cache_t *cache, u_char *key)
+ngx_http_file_cache_lookup(ngx_http_file_cache_shard_t *shard, u_char *key)
 {
     ngx_int_t                    rc;
     ngx_rbtree_key_t             node_key;
@@ -976,8 +1139,8 @@ ngx_http_file_cache_lookup(ngx_http_file_cache_t *cache, u_char *key)
 
     ngx_memcpy((u_char *) &node_key, key, sizeof(ngx_rbtree_key_t));
 
-    node = cache->sh->rbtree.root;
-    sentinel = cache->sh->rbtree.sentinel;
+    node = shard->sh->rbtree.root;
+    sentinel = shard->sh->rbtree.sentinel;
 
     while (node != sentinel) {
 
@@ -1209,7 +1372,8 @@ ngx_http_file_cache_vary_header(ngx_http_request_t *r, ngx_md5_t *md5,
 static ngx_int_t
 ngx_http_file_cache_reopen(ngx_http_request_t *r, ngx_http_cache_t *c)
 {
-    ngx_http_file_cache_t  *cache;
+    ngx_http_file_cache_t        *cache;
+    ngx_http_file_cache_shard_t  *shard;
 
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
                    "http file cache reopen");
@@ -1222,13 +1386,14 @@ ngx_http_file_cache_reopen(ngx_http_request_t *r, ngx_http_cache_t *c)
     }
 
     cache = c->file_cache;
+    shard = ngx_http_file_cache_shard(cache, c->key);
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    ngx_shmtx_lock(&shard->shpool->mutex);
 
     c->node->count--;
     c->node = NULL;
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+    ngx_shmtx_unlock(&shard->shpool->mutex);
 
     c->secondary = 1;
     c->file.name.len = 0;
@@ -1308,7 +1473,8 @@ ngx_http_file_cache_set_header(ngx_http_request_t *r, u_char *buf)
 static ngx_int_t
 ngx_http_file_cache_update_variant(ngx_http_request_t *r, ngx_http_cache_t *c)
 {
-    ngx_http_file_cache_t  *cache;
+    ngx_http_file_cache_t        *cache;
+    ngx_http_file_cache_shard_t  *shard;
 
     if (!c->secondary) {
         return NGX_OK;
@@ -1330,13 +1496,15 @@ ngx_http_file_cache_update_variant(ngx_http_request_t *r, ngx_http_cache_t *c)
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                    "http file cache main key");
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    shard = ngx_http_file_cache_shard(cache, c->key);
+
+    ngx_shmtx_lock(&shard->shpool->mutex);
 
     c->node->count--;
     c->node->updating = 0;
     c->node = NULL;
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+    ngx_shmtx_unlock(&shard->shpool->mutex);
 
     c->file.name.len = 0;
     c->update_variant = 1;
@@ -1358,13 +1526,14 @@ ngx_http_file_cache_update_variant(ngx_http_request_t *r, ngx_http_cache_t *c)
 void
 ngx_http_file_cache_update(ngx_http_request_t *r, ngx_temp_file_t *tf)
 {
-    off_t                   fs_size;
-    ngx_int_t               rc;
-    ngx_file_uniq_t         uniq;
-    ngx_file_info_t         fi;
-    ngx_http_cache_t        *c;
-    ngx_ext_rename_file_t   ext;
-    ngx_http_file_cache_t  *cache;
+    off_t                         fs_size;
+    ngx_int_t                     rc;
+    ngx_file_uniq_t               uniq;
+    ngx_file_info_t               fi;
+    ngx_http_cache_t             *c;
+    ngx_ext_rename_file_t         ext;
+    ngx_http_file_cache_t        *cache;
+    ngx_http_file_cache_shard_t  *shard;
 
     c = r->cache;
 
@@ -1410,14 +1579,16 @@ ngx_http_file_cache_update(ngx_http_request_t *r, ngx_temp_file_t *tf)
         }
     }
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    shard = ngx_http_file_cache_shard(cache, c->key);
+
+    ngx_shmtx_lock(&shard->shpool->mutex);
 
     c->node->count--;
     c->node->error = 0;
     c->node->uniq = uniq;
     c->node->body_start = c->body_start;
 
-    cache->sh->size += fs_size - c->node->fs_size;
+    shard->sh->size += fs_size - c->node->fs_size;
     c->node->fs_size = fs_size;
 
     if (rc == NGX_OK) {
@@ -1426,7 +1597,7 @@ ngx_http_file_cache_update(ngx_http_request_t *r, ngx_temp_file_t *tf)
 
     c->node->updating = 0;
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+    ngx_shmtx_unlock(&shard->shpool->mutex);
 }
 
 
@@ -1618,19 +1789,21 @@ ngx_http_cache_send(ngx_http_request_t *r)
 void
 ngx_http_file_cache_free(ngx_http_cache_t *c, ngx_temp_file_t *tf)
 {
-    ngx_http_file_cache_t       *cache;
-    ngx_http_file_cache_node_t  *fcn;
+    ngx_http_file_cache_t        *cache;
+    ngx_http_file_cache_node_t   *fcn;
+    ngx_http_file_cache_shard_t  *shard;
 
     if (c->updated || c->node == NULL) {
         return;
     }
 
     cache = c->file_cache;
+    shard = ngx_http_file_cache_shard(cache, c->key);
 
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
                    "http file cache free, fd: %d", c->file.fd);
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    ngx_shmtx_lock(&shard->shpool->mutex);
 
     fcn = c->node;
     fcn->count--;
@@ -1649,13 +1822,13 @@ ngx_http_file_cache_free(ngx_http_cache_t *c, ngx_temp_file_t *tf)
 
     } else if (!fcn->exists && fcn->count == 0 && c->min_uses == 1) {
         ngx_queue_remove(&fcn->queue);
-        ngx_rbtree_delete(&cache->sh->rbtree, &fcn->node);
-        ngx_slab_free_locked(cache->shpool, fcn);
-        cache->sh->count--;
+        ngx_rbtree_delete(&shard->sh->rbtree, &fcn->node);
+        ngx_slab_free_locked(shard->shpool, fcn);
+        shard->sh->count--;
         c->node = NULL;
     }
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+    ngx_shmtx_unlock(&shard->shpool->mutex);
 
     c->updated = 1;
     c->updating = 0;
@@ -1702,7 +1875,8 @@ ngx_http_file_cache_cleanup(void *data)
 
 
 static time_t
-ngx_http_file_cache_forced_expire(ngx_http_file_cache_t *cache)
+ngx_http_file_cache_forced_expire(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_shard_t *shard)
 {
     u_char                      *name, *p;
     size_t                       len;
@@ -1730,14 +1904,14 @@ ngx_http_file_cache_forced_expire(ngx_http_file_cache_t *cache)
     tries = 20;
     sentinel = NULL;
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    ngx_shmtx_lock(&shard->shpool->mutex);
 
     for ( ;; ) {
-        if (ngx_queue_empty(&cache->sh->queue)) {
+        if (ngx_queue_empty(&shard->sh->queue)) {
             break;
         }
 
-        q = ngx_queue_last(&cache->sh->queue);
+        q = ngx_queue_last(&shard->sh->queue);
 
         if (q == sentinel) {
             break;
@@ -1751,7 +1925,7 @@ ngx_http_file_cache_forced_expire(ngx_http_file_cache_t *cache)
                   fcn->key[0], fcn->key[1], fcn->key[2], fcn->key[3]);
 
         if (fcn->count == 0) {
-            ngx_http_file_cache_delete(cache, q, name);
+            ngx_http_file_cache_delete(cache, shard, q, name);
             wait = 0;
             break;
         }
@@ -1769,7 +1943,7 @@ ngx_http_file_cache_forced_expire(ngx_http_file_cache_t *cache)
 
         ngx_queue_remove(q);
         fcn->expire = ngx_time() + cache->inactive;
-        ngx_queue_insert_head(&cache->sh->queue, &fcn->queue);
+        ngx_queue_insert_head(&shard->sh->queue, &fcn->queue);
 
         ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
                       "ignore long locked inactive cache entry %*s, count:%d",
@@ -1787,7 +1961,7 @@ ngx_http_file_cache_forced_expire(ngx_http_file_cache_t *cache)
         break;
     }
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+    ngx_shmtx_unlock(&shard->shpool->mutex);
 
     ngx_free(name);
 
@@ -1798,14 +1972,11 @@ ngx_http_file_cache_forced_expire(ngx_http_file_cache_t *cache)
 static time_t
 ngx_http_file_cache_expire(ngx_http_file_cache_t *cache)
 {
-    u_char                      *name, *p;
-    size_t                       len;
-    time_t                       now, wait;
-    ngx_path_t                  *path;
-    ngx_msec_t                   elapsed;
-    ngx_queue_t                 *q;
-    ngx_http_file_cache_node_t  *fcn;
-    u_char                       key[2 * NGX_HTTP_CACHE_KEY_LEN];
+    u_char      *name;
+    size_t       len;
+    time_t       wait, next;
+    ngx_uint_t   i, n;
+    ngx_path_t  *path;
 
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
                    "http file cache expire");
@@ -1820,9 +1991,56 @@ ngx_http_file_cache_expire(ngx_http_file_cache_t *cache)
 
     ngx_memcpy(name, path->name.data, path->name.len);
 
+    /*
+     * shards are expired round-robin, starting from the one
+     * following the shard which exhausted the previous iteration
+     */
+
+    wait = 10;
+
+    for (i = 0; i < cache->nshards; i++) {
+
+        n = (cache->shard + i) % cache->nshards;
+
+        next = ngx_http_file_cache_expire_shard(cache, &cache->shards[n],
+                                                name);
+
+        if (next == 0) {
+            cache->shard = n + 1;
+            wait = 0;
+            break;
+        }
+
+        if (next < wait) {
+            wait = next;
+        }
+
+        if (ngx_quit || ngx_terminate) {
+            break;
+        }
+    }
+
+    ngx_free(name);
+
+    return wait;
+}
+
+
+static time_t
+ngx_http_file_cache_expire_shard(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_shard_t *shard, u_char *name)
+{
+    u_char                      *p;
+    size_t                       len;
+    time_t                       now, wait;
+    ngx_msec_t                   elapsed;
+    ngx_queue_t                 *q;
+    ngx_http_file_cache_node_t  *fcn;
+    u_char                       key[2 * NGX_HTTP_CACHE_KEY_LEN];
+
     now = ngx_time();
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    ngx_shmtx_lock(&shard->shpool->mutex);
 
     for ( ;; ) {
 
@@ -1831,12 +2049,12 @@ ngx_http_file_cache_expire(ngx_http_file_cache_t *cache)
             break;
         }
 
-        if (ngx_queue_empty(&cache->sh->queue)) {
+        if (ngx_queue_empty(&shard->sh->queue)) {
             wait = 10;
             break;
         }
 
-        q = ngx_queue_last(&cache->sh->queue);
+        q = ngx_queue_last(&shard->sh->queue);
 
         fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
 
@@ -1853,7 +2071,7 @@ ngx_http_file_cache_expire(ngx_http_file_cache_t *cache)
                        fcn->key[0], fcn->key[1], fcn->key[2], fcn->key[3]);
 
         if (fcn->count == 0) {
-            ngx_http_file_cache_delete(cache, q, name);
+            ngx_http_file_cache_delete(cache, shard, q, name);
             goto next;
         }
 
@@ -1875,7 +2093,7 @@ ngx_http_file_cache_expire(ngx_http_file_cache_t *cache)
 
         ngx_queue_remove(q);
         fcn->expire = ngx_time() + cache->inactive;
-        ngx_queue_insert_head(&cache->sh->queue, &fcn->queue);
+        ngx_queue_insert_head(&shard->sh->queue, &fcn->queue);
 
         ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
                       "ignore long locked inactive cache entry %*s, count:%d",
@@ -1898,17 +2116,15 @@ next:
         }
     }
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
-
-    ngx_free(name);
+    ngx_shmtx_unlock(&shard->shpool->mutex);
 
     return wait;
 }
 
 
 static void
-ngx_http_file_cache_delete(ngx_http_file_cache_t *cache, ngx_queue_t *q,
-    u_char *name)
+ngx_http_file_cache_delete(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_shard_t *shard, ngx_queue_t *q, u_char *name)
 {
     u_char                      *p;
     size_t                       len;
@@ -1918,7 +2134,7 @@ ngx_http_file_cache_delete(ngx_http_file_cache_t *cache, ngx_queue_t *q,
     fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
 
     if (fcn->exists) {
-        cache->sh->size -= fcn->fs_size;
+        shard->sh->size -= fcn->fs_size;
 
         path = cache->path;
         p = name + path->name.len + 1 + path->len;
@@ -1930,7 +2146,7 @@ ngx_http_file_cache_delete(ngx_http_file_cache_t *cache, ngx_queue_t *q,
 
         fcn->count++;
         fcn->deleting = 1;
-        ngx_shmtx_unlock(&cache->shpool->mutex);
+        ngx_shmtx_unlock(&shard->shpool->mutex);
 
         len = path->name.len + 1 + path->len + 2 * NGX_HTTP_CACHE_KEY_LEN;
         ngx_create_hashed_filename(path, name, len);
@@ -1943,16 +2159,16 @@ ngx_http_file_cache_delete(ngx_http_file_cache_t *cache, ngx_queue_t *q,
                           ngx_delete_file_n " \"%s\" failed", name);
         }
 
-        ngx_shmtx_lock(&cache->shpool->mutex);
+        ngx_shmtx_lock(&shard->shpool->mutex);
         fcn->count--;
         fcn->deleting = 0;
     }
 
     if (fcn->count == 0) {
         ngx_queue_remove(q);
-        ngx_rbtree_delete(&cache->sh->rbtree, &fcn->node);
-        ngx_slab_free_locked(cache->shpool, fcn);
-        cache->sh->count--;
+        ngx_rbtree_delete(&shard->sh->rbtree, &fcn->node);
+        ngx_slab_free_locked(shard->shpool, fcn);
+        shard->sh->count--;
     }
 }
 
@@ -1962,10 +2178,18 @@ ngx_http_file_cache_manager(void *data)
 {
     ngx_http_file_cache_t  *cache = data;
 
-    off_t       size, free;
-    time_t      wait;
-    ngx_msec_t  elapsed, next;
-    ngx_uint_t  count, watermark;
+    off_t                         size, free, max, ssize;
+    time_t                        wait;
+    ngx_msec_t                    elapsed, next;
+    ngx_uint_t                    i, count, watermark;
+    ngx_http_file_cache_shard_t  *shard, *full, *largest;
+
+    if (cache->index.len
+        && !cache->sh->cold
+        && ngx_time() - cache->index_time >= cache->index_interval)
+    {
+        ngx_http_file_cache_write_index(cache);
+    }
 
     cache->last = ngx_current_msec;
     cache->files = 0;
@@ -1978,19 +2202,48 @@ ngx_http_file_cache_manager(void *data)
     }
 
     for ( ;; ) {
-        ngx_shmtx_lock(&cache->shpool->mutex);
 
-        size = cache->sh->size;
-        count = cache->sh->count;
-        watermark = cache->sh->watermark;
+        /*
+         * a shard whose nodes do not fit in its pool is expired first,
+         * otherwise the largest shard is expired to free disk space
+         */
+
+        size = 0;
+        max = -1;
+        full = NULL;
+        largest = NULL;
+
+        for (i = 0; i < cache->nshards; i++) {
+            shard = &cache->shards[i];
 
-        ngx_shmtx_unlock(&cache->shpool->mutex);
+            ngx_shmtx_lock(&shard->shpool->mutex);
 
-        ngx_log_debug3(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                       "http file cache size: %O c:%ui w:%i",
-                       size, count, (ngx_int_t) watermark);
+            ssize = shard->sh->size;
+            count = shard->sh->count;
+            watermark = shard->sh->watermark;
 
-        if (size < cache->max_size && count < watermark) {
+            ngx_shmtx_unlock(&shard->shpool->mutex);
+
+            ngx_log_debug4(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                           "http file cache shard %ui size: %O c:%ui w:%i",
+                           i, ssize, count, (ngx_int_t) watermark);
+
+            size += ssize;
+
+            if (ssize > max) {
+                max = ssize;
+                largest = shard;
+            }
+
+            if (full == NULL && count >= watermark) {
+                full = shard;
+            }
+        }
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                       "http file cache size: %O", size);
+
+        if (full == NULL && size < cache->max_size) {
 
             if (!cache->min_free) {
                 break;
@@ -2006,7 +2259,8 @@ ngx_http_file_cache_manager(void *data)
             }
         }
 
-        wait = ngx_http_file_cache_forced_expire(cache);
+        wait = ngx_http_file_cache_forced_expire(cache,
+                                                 full ? full : largest);
 
         if (wait > 0) {
             next = (ngx_msec_t) wait * 1000;
@@ -2049,7 +2303,13 @@ ngx_http_file_cache_loader(void *data)
 {
     ngx_http_file_cache_t  *cache = data;
 
-    ngx_tree_ctx_t  tree;
+    size_t                               digits;
+    ngx_int_t                            rc;
+    ngx_uint_t                           n, index, walk;
+    ngx_tree_ctx_t                       tree;
+    ngx_file_info_t                      fi;
+    ngx_file_mapping_t                   fm;
+    ngx_http_file_cache_index_header_t  *header;
 
     if (!cache->sh->cold || cache->sh->loading) {
         return;
@@ -2062,6 +2322,53 @@ ngx_http_file_cache_loader(void *data)
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
                    "http file cache loader");
 
+    /*
+     * with a valid index only the directories modified after
+     * the index checkpoint are walked, the rest is replayed
+     * from the index
+     */
+
+    index = 0;
+    walk = 1;
+
+    if (cache->index.len
+        && ngx_http_file_cache_open_index(cache, &fm) == NGX_OK)
+    {
+        index = 1;
+
+        header = fm.addr;
+        cache->index_time = (time_t) header->time;
+
+        digits = 0;
+
+        for (n = 0; n < NGX_MAX_PATH_LEVEL; n++) {
+            digits += cache->path->level[n];
+        }
+
+        if (digits == 0) {
+
+            /* all files are in the cache directory itself */
+
+            if (ngx_file_info(cache->path->name.data, &fi) != NGX_FILE_ERROR
+                && ngx_file_mtime(&fi) < cache->index_time)
+            {
+                walk = 0;
+
+            } else {
+                ngx_close_file_mapping(&fm);
+                index = 0;
+            }
+
+        } else {
+            cache->index_dirs = ngx_calloc(((size_t) 1 << 4 * digits) / 8 + 1,
+                                           ngx_cycle->log);
+            if (cache->index_dirs == NULL) {
+                ngx_close_file_mapping(&fm);
+                index = 0;
+            }
+        }
+    }
+
     tree.init_handler = NULL;
     tree.file_handler = ngx_http_file_cache_manage_file;
     tree.pre_tree_handler = ngx_http_file_cache_manage_directory;
@@ -2074,7 +2381,26 @@ ngx_http_file_cache_loader(void *data)
     cache->last = ngx_current_msec;
     cache->files = 0;
 
-    if (ngx_walk_tree(&tree, &cache->path->name) == NGX_ABORT) {
+    rc = NGX_OK;
+
+    if (walk) {
+        rc = ngx_walk_tree(&tree, &cache->path->name);
+    }
+
+    if (index) {
+        if (rc != NGX_ABORT) {
+            rc = ngx_http_file_cache_replay_index(cache, &fm);
+        }
+
+        ngx_close_file_mapping(&fm);
+
+        if (cache->index_dirs) {
+            ngx_free(cache->index_dirs);
+            cache->index_dirs = NULL;
+        }
+    }
+
+    if (rc == NGX_ABORT) {
         cache->sh->loading = 0;
         return;
     }
@@ -2085,7 +2411,7 @@ ngx_http_file_cache_loader(void *data)
     ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
                   "http file cache: %V %.3fM, bsize: %uz",
                   &cache->path->name,
-                  ((double) cache->sh->size * cache->bsize) / (1024 * 1024),
+                  ((double) ngx_http_file_cache_size(cache)) / (1024 * 1024),
                   cache->bsize);
 }
 
@@ -2132,12 +2458,64 @@ ngx_http_file_cache_manage_file(ngx_tree_ctx_t *ctx, ngx_str_t *path)
 static ngx_int_t
 ngx_http_file_cache_manage_directory(ngx_tree_ctx_t *ctx, ngx_str_t *path)
 {
+    u_char                 *p, *last;
+    ngx_int_t               n;
+    ngx_uint_t              dir;
+    ngx_http_file_cache_t  *cache;
+
     if (path->len >= 5
         && ngx_strncmp(path->data + path->len - 5, "/temp", 5) == 0)
     {
         return NGX_DECLINED;
     }
 
+    /* the index is kept in a directory of its own */
+
+    if (path->len >= 6
+        && ngx_strncmp(path->data + path->len - 6, "/index", 6) == 0)
+    {
+        return NGX_DECLINED;
+    }
+
+    cache = ctx->data;
+
+    if (cache->index_dirs == NULL
+        || path->len != cache->path->name.len + cache->path->len)
+    {
+        return NGX_OK;
+    }
+
+    /*
+     * a leaf directory which was not modified after the index
+     * checkpoint contains only the files listed in the index
+     */
+
+    if (ctx->mtime < cache->index_time) {
+        return NGX_DECLINED;
+    }
+
+    dir = 0;
+
+    p = path->data + cache->path->name.len + 1;
+    last = path->data + path->len;
+
+    for ( /* void */ ; p < last; p++) {
+
+        if (*p == '/') {
+            continue;
+        }
+
+        n = ngx_hextoi(p, 1);
+
+        if (n == NGX_ERROR) {
+            return NGX_OK;
+        }
+
+        dir = dir * 16 + n;
+    }
+
+    cache->index_dirs[dir / 8] |= (u_char) (1 << (dir % 8));
+
     return NGX_OK;
 }
 
@@ -2211,43 +2589,46 @@ ngx_http_file_cache_add_file(ngx_tree_ctx_t *ctx, ngx_str_t *name)
 static ngx_int_t
 ngx_http_file_cache_add(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
 {
-    ngx_http_file_cache_node_t  *fcn;
+    ngx_http_file_cache_node_t   *fcn;
+    ngx_http_file_cache_shard_t  *shard;
+
+    shard = ngx_http_file_cache_shard(cache, c->key);
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    ngx_shmtx_lock(&shard->shpool->mutex);
 
-    fcn = ngx_http_file_cache_lookup(cache, c->key);
+    fcn = ngx_http_file_cache_lookup(shard, c->key);
 
     if (fcn == NULL) {
 
-        fcn = ngx_slab_calloc_locked(cache->shpool,
+        fcn = ngx_slab_calloc_locked(shard->shpool,
                                      sizeof(ngx_http_file_cache_node_t));
         if (fcn == NULL) {
-            ngx_http_file_cache_set_watermark(cache);
+            ngx_http_file_cache_set_watermark(shard);
 
             if (cache->fail_time != ngx_time()) {
                 cache->fail_time = ngx_time();
                 ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
-                           "could not allocate node%s", cache->shpool->log_ctx);
+                           "could not allocate node%s", shard->shpool->log_ctx);
             }
 
-            ngx_shmtx_unlock(&cache->shpool->mutex);
+            ngx_shmtx_unlock(&shard->shpool->mutex);
             return NGX_ERROR;
         }
 
-        cache->sh->count++;
+        shard->sh->count++;
 
         ngx_memcpy((u_char *) &fcn->node.key, c->key, sizeof(ngx_rbtree_key_t));
 
         ngx_memcpy(fcn->key, &c->key[sizeof(ngx_rbtree_key_t)],
                    NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
 
-        ngx_rbtree_insert(&cache->sh->rbtree, &fcn->node);
+        ngx_rbtree_insert(&shard->sh->rbtree, &fcn->node);
 
         fcn->uses = 1;
         fcn->exists = 1;
         fcn->fs_size = c->fs_size;
 
-        cache->sh->size += c->fs_size;
+        shard->sh->size += c->fs_size;
 
     } else {
         ngx_queue_remove(&fcn->queue);
@@ -2255,9 +2636,9 @@ ngx_http_file_cache_add(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
 
     fcn->expire = ngx_time() + cache->inactive;
 
-    ngx_queue_insert_head(&cache->sh->queue, &fcn->queue);
+    ngx_queue_insert_head(&shard->sh->queue, &fcn->queue);
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+    ngx_shmtx_unlock(&shard->shpool->mutex);
 
     return NGX_OK;
 }
@@ -2279,12 +2660,369 @@ ngx_http_file_cache_delete_file(ngx_tree_ctx_t *ctx, ngx_str_t *path)
 
 
 static void
-ngx_http_file_cache_set_watermark(ngx_http_file_cache_t *cache)
+ngx_http_file_cache_set_watermark(ngx_http_file_cache_shard_t *shard)
 {
-    cache->sh->watermark = cache->sh->count - cache->sh->count / 8;
+    shard->sh->watermark = shard->sh->count - shard->sh->count / 8;
 
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                   "http file cache watermark: %ui", cache->sh->watermark);
+                   "http file cache watermark: %ui", shard->sh->watermark);
+}
+
+
+static void
+ngx_http_file_cache_write_index(ngx_http_file_cache_t *cache)
+{
+    u_char                              *name;
+    off_t                                offset;
+    size_t                               size;
+    time_t                               now;
+    ngx_uint_t                           i, k, n, total, visited;
+    ngx_file_t                           file;
+    ngx_rbtree_t                        *tree;
+    ngx_rbtree_node_t                   *node;
+    ngx_http_file_cache_node_t          *fcn;
+    ngx_http_file_cache_shard_t         *shard;
+    ngx_http_file_cache_index_entry_t   *batch;
+    ngx_http_file_cache_index_header_t   header;
+    u_char                               last[NGX_HTTP_CACHE_KEY_LEN];
+
+    now = ngx_time();
+
+    name = ngx_alloc(cache->index.len + sizeof(".tmp"), ngx_cycle->log);
+    if (name == NULL) {
+        return;
+    }
+
+    batch = ngx_alloc(NGX_HTTP_CACHE_INDEX_BATCH
+                      * sizeof(ngx_http_file_cache_index_entry_t),
+                      ngx_cycle->log);
+    if (batch == NULL) {
+        ngx_free(name);
+        return;
+    }
+
+    ngx_memzero(&file, sizeof(ngx_file_t));
+
+    file.name.data = name;
+    file.name.len = ngx_sprintf(name, "%V.tmp", &cache->index) - name;
+    file.log = ngx_cycle->log;
+
+    name[file.name.len] = '\0';
+
+    file.fd = ngx_open_file(name, NGX_FILE_WRONLY, NGX_FILE_TRUNCATE,
+                            NGX_FILE_DEFAULT_ACCESS);
+
+    if (file.fd == NGX_INVALID_FILE) {
+        ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                      ngx_open_file_n " \"%s\" failed", name);
+        goto free;
+    }
+
+    /*
+     * the nodes are copied in key order and in batches, so the mutex
+     * is not held for long; after the mutex is released the walk goes
+     * on from the key copied last, as the node itself may be gone
+     */
+
+    offset = sizeof(ngx_http_file_cache_index_header_t);
+    total = 0;
+
+    for (i = 0; i < cache->nshards; i++) {
+        shard = &cache->shards[i];
+        tree = &shard->sh->rbtree;
+
+        for (n = 0; /* void */ ; n++) {
+
+            if (ngx_quit || ngx_terminate) {
+                goto failed;
+            }
+
+            ngx_shmtx_lock(&shard->shpool->mutex);
+
+            if (n == 0) {
+                node = (tree->root == tree->sentinel)
+                       ? NULL : ngx_rbtree_min(tree->root, tree->sentinel);
+
+            } else {
+                node = ngx_http_file_cache_index_next(tree, last);
+            }
+
+            for (k = 0, visited = 0;
+                 node && visited < NGX_HTTP_CACHE_INDEX_BATCH;
+                 node = ngx_rbtree_next(tree, node), visited++)
+            {
+                fcn = (ngx_http_file_cache_node_t *) node;
+
+                ngx_memcpy(last, &node->key, sizeof(ngx_rbtree_key_t));
+                ngx_memcpy(&last[sizeof(ngx_rbtree_key_t)], fcn->key,
+                           NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+
+                if (!fcn->exists || fcn->deleting) {
+                    continue;
+                }
+
+                ngx_memcpy(batch[k].key, last, NGX_HTTP_CACHE_KEY_LEN);
+                batch[k].fs_size = fcn->fs_size;
+
+                k++;
+            }
+
+            ngx_shmtx_unlock(&shard->shpool->mutex);
+
+            if (k) {
+                size = k * sizeof(ngx_http_file_cache_index_entry_t);
+
+                if (ngx_write_file(&file, (u_char *) batch, size, offset)
+                    == NGX_ERROR)
+                {
+                    goto failed;
+                }
+
+                offset += size;
+                total += k;
+            }
+
+            if (node == NULL) {
+                break;
+            }
+        }
+    }
+
+    ngx_memzero(&header, sizeof(ngx_http_file_cache_index_header_t));
+
+    ngx_memcpy(header.magic, ngx_http_file_cache_index_magic,
+               sizeof(header.magic));
+
+    header.version = NGX_HTTP_CACHE_INDEX_VERSION;
+    header.bsize = (uint32_t) cache->bsize;
+
+    /* a second of slack for the entries updated during the checkpoint */
+
+    header.time = now - 1;
+    header.entries = total;
+
+    for (i = 0; i < NGX_MAX_PATH_LEVEL; i++) {
+        header.levels[i] = (u_char) cache->path->level[i];
+    }
+
+    if (ngx_write_file(&file, (u_char *) &header,
+                       sizeof(ngx_http_file_cache_index_header_t), 0)
+        == NGX_ERROR)
+    {
+        goto failed;
+    }
+
+    /* the data has to be on disk before the rename replaces the index */
+
+    if (ngx_fsync(file.fd) == -1) {
+        ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                      ngx_fsync_n " \"%s\" failed", name);
+        goto failed;
+    }
+
+    if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", name);
+    }
+
+    file.fd = NGX_INVALID_FILE;
+
+    if (ngx_rename_file(name, cache->index.data) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                      ngx_rename_file_n " \"%s\" to \"%V\" failed",
+                      name, &cache->index);
+        goto failed;
+    }
+
+    cache->index_time = now;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache index: \"%V\" %ui entries",
+                   &cache->index, total);
+
+    goto free;
+
+failed:
+
+    if (file.fd != NGX_INVALID_FILE
+        && ngx_close_file(file.fd) == NGX_FILE_ERROR)
+    {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", name);
+    }
+
+    if (ngx_delete_file(name) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                      ngx_delete_file_n " \"%s\" failed", name);
+    }
+
+free:
+
+    ngx_free(batch);
+    ngx_free(name);
+}
+
+
+static ngx_rbtree_node_t *
+ngx_http_file_cache_index_next(ngx_rbtree_t *tree, u_char *key)
+{
+    ngx_int_t                    rc;
+    ngx_rbtree_key_t             node_key;
+    ngx_rbtree_node_t           *node, *sentinel, *next;
+    ngx_http_file_cache_node_t  *fcn;
+
+    /*
+     * the first node after the key, in the order of
+     * ngx_http_file_cache_rbtree_insert_value()
+     */
+
+    ngx_memcpy(&node_key, key, sizeof(ngx_rbtree_key_t));
+
+    node = tree->root;
+    sentinel = tree->sentinel;
+    next = NULL;
+
+    while (node != sentinel) {
+
+        if (node->key != node_key) {
+            rc = (node->key > node_key) ? 1 : -1;
+
+        } else {
+            fcn = (ngx_http_file_cache_node_t *) node;
+
+            rc = ngx_memcmp(fcn->key, key + sizeof(ngx_rbtree_key_t),
+                            NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+        }
+
+        if (rc > 0) {
+            next = node;
+            node = node->left;
+
+        } else {
+            node = node->right;
+        }
+    }
+
+    return next;
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_open_index(ngx_http_file_cache_t *cache,
+    ngx_file_mapping_t *fm)
+{
+    ngx_uint_t                           i;
+    ngx_http_file_cache_index_header_t  *header;
+
+    fm->name = cache->index.data;
+    fm->log = ngx_cycle->log;
+
+    if (ngx_open_file_mapping(fm) != NGX_OK) {
+        return NGX_DECLINED;
+    }
+
+    header = fm->addr;
+
+    if (fm->size < sizeof(ngx_http_file_cache_index_header_t)
+        || ngx_memcmp(header->magic, ngx_http_file_cache_index_magic,
+                      sizeof(header->magic))
+           != 0
+        || header->version != NGX_HTTP_CACHE_INDEX_VERSION
+        || header->bsize != cache->bsize
+        || header->entries > (fm->size
+                              - sizeof(ngx_http_file_cache_index_header_t))
+                             / sizeof(ngx_http_file_cache_index_entry_t))
+    {
+        goto invalid;
+    }
+
+    for (i = 0; i < NGX_MAX_PATH_LEVEL; i++) {
+        if (header->levels[i] != cache->path->level[i]) {
+            goto invalid;
+        }
+    }
+
+    return NGX_OK;
+
+invalid:
+
+    ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
+                  "cache index \"%V\" is invalid, ignored", &cache->index);
+
+    ngx_close_file_mapping(fm);
+
+    return NGX_DECLINED;
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_replay_index(ngx_http_file_cache_t *cache,
+    ngx_file_mapping_t *fm)
+{
+    ngx_uint_t                           i, dir, n;
+    ngx_http_cache_t                     c;
+    ngx_http_file_cache_index_entry_t   *entry;
+    ngx_http_file_cache_index_header_t  *header;
+
+    header = fm->addr;
+    entry = (ngx_http_file_cache_index_entry_t *) (header + 1);
+
+    ngx_memzero(&c, sizeof(ngx_http_cache_t));
+
+    n = 0;
+
+    for (i = 0; i < header->entries; i++) {
+
+        if ((i & 0xffff) == 0 && (ngx_quit || ngx_terminate)) {
+            return NGX_ABORT;
+        }
+
+        if (cache->index_dirs) {
+            dir = ngx_http_file_cache_index_dir(cache->path, entry[i].key);
+
+            /* the directory was walked, its files are already added */
+
+            if (cache->index_dirs[dir / 8] & (1 << (dir % 8))) {
+                continue;
+            }
+        }
+
+        ngx_memcpy(c.key, entry[i].key, NGX_HTTP_CACHE_KEY_LEN);
+        c.fs_size = (off_t) entry[i].fs_size;
+
+        if (ngx_http_file_cache_add(cache, &c) == NGX_OK) {
+            n++;
+        }
+    }
+
+    ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
+                  "http file cache: %V %ui of %uL entries loaded from index",
+                  &cache->path->name, n, header->entries);
+
+    return NGX_OK;
+}
+
+
+static ngx_uint_t
+ngx_http_file_cache_index_dir(ngx_path_t *path, u_char *key)
+{
+    size_t      i, pos;
+    ngx_uint_t  n, dir;
+
+    /* the same hex digits ngx_create_hashed_filename() uses */
+
+    dir = 0;
+    pos = 2 * NGX_HTTP_CACHE_KEY_LEN;
+
+    for (n = 0; n < NGX_MAX_PATH_LEVEL && path->level[n]; n++) {
+        pos -= path->level[n];
+
+        for (i = pos; i < pos + path->level[n]; i++) {
+            dir = dir * 16 + ((i & 1) ? (key[i / 2] & 0xf) : (key[i / 2] >> 4));
+        }
+    }
+
+    return dir;
 }
 
 
@@ -2327,7 +3065,10 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     ngx_int_t               loader_files, manager_files;
     ngx_msec_t              loader_sleep, manager_sleep, loader_threshold,
                             manager_threshold;
-    ngx_uint_t              i, n, use_temp_path;
+    time_t                  index_interval;
+    ngx_int_t               shards;
+    ngx_uint_t              i, n, use_temp_path, index;
+    ngx_path_t             *path;
     ngx_array_t            *caches;
     ngx_http_file_cache_t  *cache, **ce;
 
@@ -2355,6 +3096,9 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 
     name.len = 0;
     size = 0;
+    shards = 1;
+    index = 0;
+    index_interval = 300;
     max_size = NGX_MAX_OFF_T_VALUE;
     min_free = 0;
 
@@ -2462,6 +3206,61 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             continue;
         }
 
+        if (ngx_strncmp(value[i].data, "shards=", 7) == 0) {
+
+            shards = ngx_atoi(value[i].data + 7, value[i].len - 7);
+            if (shards <= 0 || shards > NGX_HTTP_CACHE_MAX_SHARDS) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid shards value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+#if !(NGX_HAVE_ATOMIC_OPS)
+            if (shards > 1) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "\"%V\" is not supported "
+                                   "on this platform", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+#endif
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "index=", 6) == 0) {
+
+            if (ngx_strcmp(&value[i].data[6], "on") == 0) {
+                index = 1;
+
+            } else if (ngx_strcmp(&value[i].data[6], "off") == 0) {
+                index = 0;
+
+            } else {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid index value \"%V\", "
+                                   "it must be \"on\" or \"off\"",
+                                   &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "index_interval=", 15) == 0) {
+
+            s.len = value[i].len - 15;
+            s.data = value[i].data + 15;
+
+            index_interval = ngx_parse_time(&s, 1);
+            if (index_interval == (time_t) NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid index_interval value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
         if (ngx_strncmp(value[i].data, "inactive=", 9) == 0) {
 
             s.len = value[i].len - 9;
@@ -2611,6 +3410,13 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         return NGX_CONF_ERROR;
     }
 
+    if (shards > 1 && size < (ssize_t) ((shards * 8 + 1) * ngx_pagesize)) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "keys zone \"%V\" is too small for %i shards",
+                           &name, shards);
+        return NGX_CONF_ERROR;
+    }
+
     cache->path->manager = ngx_http_file_cache_manager;
     cache->path->loader = ngx_http_file_cache_loader;
     cache->path->data = cache;
@@ -2623,10 +3429,49 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     cache->manager_sleep = manager_sleep;
     cache->manager_threshold = manager_threshold;
 
+    cache->index_interval = index_interval;
+
     if (ngx_add_path(cf, &cache->path) != NGX_OK) {
         return NGX_CONF_ERROR;
     }
 
+    if (index) {
+
+        /*
+         * the index lives in a subdirectory, so that writing it
+         * does not change the mtime of the cache directory itself
+         */
+
+        path = ngx_pcalloc(cf->pool, sizeof(ngx_path_t));
+        if (path == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        path->name.len = cache->path->name.len + sizeof("/index") - 1;
+        path->name.data = ngx_pnalloc(cf->pool, path->name.len + 1);
+        if (path->name.data == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        ngx_sprintf(path->name.data, "%V/index%Z", &cache->path->name);
+
+        path->data = cache;
+        path->conf_file = cf->conf_file->file.name.data;
+        path->line = cf->conf_file->line;
+
+        if (ngx_add_path(cf, &path) != NGX_OK) {
+            return NGX_CONF_ERROR;
+        }
+
+        cache->index.len = path->name.len + sizeof("/checkpoint") - 1;
+        cache->index.data = ngx_pnalloc(cf->pool, cache->index.len + 1);
+        if (cache->index.data == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        ngx_sprintf(cache->index.data, "%V/checkpoint%Z", &path->name);
+    }
+
     cache->shm_zone = ngx_shared_memory_add(cf, &name, size, cmd->post);
     if (cache->shm_zone == NULL) {
         return NGX_CONF_ERROR;
@@ -2643,6 +3488,7 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     cache->shm_zone->data = cache;
 
     cache->use_temp_path = use_temp_path;
+    cache->nshards = shards;
 
     cache->inactive = inactive;
     cache->max_size = max_size;
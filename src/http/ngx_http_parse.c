@@ -9,6 +9,33 @@
 #include <ngx_core.h>
 #include <ngx_http.h>
 
+#if (NGX_HAVE_GCC_X86_SIMD)
+#include <immintrin.h>
+#endif
+
+
+typedef u_char *(*ngx_http_parse_scan_pt)(u_char *p, u_char *last,
+    u_char *set, size_t n);
+
+
+static u_char *ngx_http_parse_scan(u_char *p, u_char *last, u_char *set,
+    size_t n);
+#if (NGX_HAVE_GCC_X86_SIMD)
+static u_char *ngx_http_parse_scan_sse42(u_char *p, u_char *last,
+    u_char *set, size_t n);
+static u_char *ngx_http_parse_scan_avx2(u_char *p, u_char *last,
+    u_char *set, size_t n);
+#endif
+
+
+static ngx_http_parse_scan_pt  ngx_http_parse_scan_handler;
+static ngx_uint_t              ngx_http_parse_avx2;
+
+/* the characters which end the fast scan of arguments and header values */
+
+static u_char  ngx_http_parse_args_stop[16] = { ' ', CR, LF, '#', '\0' };
+static u_char  ngx_http_parse_value_stop[16] = { CR, LF, '\0' };
+
 
 static uint32_t  usual[] = {
     0xffffdbfe, /* 1111 1111 1111 1111  1101 1011 1111 1110 */
@@ -98,6 +125,133 @@ static uint32_t  usual[] = {
 #endif
 
 
+void
+ngx_http_parse_init(void)
+{
+#if (NGX_HAVE_GCC_X86_SIMD)
+
+    if (ngx_cpu_features & NGX_CPU_SSE42) {
+        ngx_http_parse_scan_handler = ngx_http_parse_scan_sse42;
+    }
+
+    if (ngx_cpu_features & NGX_CPU_AVX2) {
+        ngx_http_parse_avx2 = 1;
+    }
+
+#endif
+}
+
+
+/*
+ * the fast paths are used for the long runs of the URI arguments
+ * and header values, the byte by byte state machines handle the rest
+ */
+
+static u_char *
+ngx_http_parse_scan(u_char *p, u_char *last, u_char *set, size_t n)
+{
+    size_t  i;
+
+    for ( /* void */ ; p < last; p++) {
+        for (i = 0; i < n; i++) {
+            if (*p == set[i]) {
+                return p;
+            }
+        }
+    }
+
+    return last;
+}
+
+
+#if (NGX_HAVE_GCC_X86_SIMD)
+
+__attribute__((target("sse4.2")))
+static u_char *
+ngx_http_parse_scan_sse42(u_char *p, u_char *last, u_char *set, size_t n)
+{
+    int         i;
+    __m128i     stop;
+    ngx_uint_t  blocks;
+
+    stop = _mm_loadu_si128((__m128i *) set);
+
+    blocks = 0;
+
+    while (last - p >= 16) {
+        i = _mm_cmpestri(stop, n, _mm_loadu_si128((__m128i *) p), 16,
+                         _SIDD_UBYTE_OPS|_SIDD_CMP_EQUAL_ANY
+                         |_SIDD_LEAST_SIGNIFICANT);
+
+        if (i != 16) {
+            return p + i;
+        }
+
+        p += 16;
+
+        /*
+         * most of the values are short, so the AVX2 loop
+         * is only worth entering for a long run like a cookie
+         */
+
+        if (++blocks == 4 && ngx_http_parse_avx2) {
+            return ngx_http_parse_scan_avx2(p, last, set, n);
+        }
+    }
+
+    return ngx_http_parse_scan(p, last, set, n);
+}
+
+
+__attribute__((target("avx2")))
+static u_char *
+ngx_http_parse_scan_avx2(u_char *p, u_char *last, u_char *set, size_t n)
+{
+    uint32_t  mask;
+    __m256i   data, match, s0, s1, s2, s3, s4;
+
+    /* the sets are padded with '\0', which is always a stop character */
+
+    s0 = _mm256_set1_epi8((char) set[0]);
+    s1 = _mm256_set1_epi8((char) set[1]);
+    s2 = _mm256_set1_epi8((char) set[2]);
+    s3 = _mm256_set1_epi8((char) set[3]);
+    s4 = _mm256_set1_epi8((char) set[4]);
+
+    while (last - p >= 32) {
+        data = _mm256_loadu_si256((__m256i *) p);
+
+        match = _mm256_or_si256(
+                    _mm256_or_si256(_mm256_cmpeq_epi8(data, s0),
+                                    _mm256_cmpeq_epi8(data, s1)),
+                    _mm256_or_si256(_mm256_cmpeq_epi8(data, s2),
+                                    _mm256_cmpeq_epi8(data, s3)));
+        match = _mm256_or_si256(match, _mm256_cmpeq_epi8(data, s4));
+
+        mask = (uint32_t) _mm256_movemask_epi8(match);
+
+        if (mask) {
+            p += __builtin_ctz(mask);
+            goto done;
+        }
+
+        p += 32;
+    }
+
+    p = ngx_http_parse_scan(p, last, set, n);
+
+done:
+
+    /* avoid the AVX to SSE transition penalty in the callers */
+
+    _mm256_zeroupper();
+
+    return p;
+}
+
+#endif
+
+
 /* gcc, icc, msvc and others compile these switches as an jump table */
 
 ngx_int_t
@@ -644,6 +798,15 @@ ngx_http_parse_request_line(ngx_http_request_t *r, ngx_buf_t *b)
         /* URI */
         case sw_uri:
 
+            if (ngx_http_parse_scan_handler && b->last - p >= 16) {
+                m = ngx_http_parse_scan_handler(p, b->last,
+                                                ngx_http_parse_args_stop, 5);
+                if (m != p) {
+                    p = m - 1;
+                    break;
+                }
+            }
+
             if (usual[ch >> 5] & (1U << (ch & 0x1f))) {
                 break;
             }
@@ -859,7 +1022,7 @@ ngx_int_t
 ngx_http_parse_header_line(ngx_http_request_t *r, ngx_buf_t *b,
     ngx_uint_t allow_underscores)
 {
-    u_char      c, ch, *p;
+    u_char      c, ch, *p, *m, *end;
     ngx_uint_t  hash, i;
     enum {
         sw_start = 0,
@@ -1034,6 +1197,28 @@ ngx_http_parse_header_line(ngx_http_request_t *r, ngx_buf_t *b,
 
         /* header value */
         case sw_value:
+
+            if (ngx_http_parse_scan_handler && b->last - p >= 16) {
+                end = ngx_http_parse_scan_handler(p, b->last,
+                                                  ngx_http_parse_value_stop, 3);
+                if (end != p) {
+
+                    /* the trailing spaces are not part of the value */
+
+                    for (m = end; m > p && m[-1] == ' '; m--) {
+                        /* void */
+                    }
+
+                    if (m != end) {
+                        r->header_end = m;
+                        state = sw_space_after_value;
+                    }
+
+                    p = end - 1;
+                    break;
+                }
+            }
+
             switch (ch) {
             case ' ':
                 r->header_end = p;
@@ -108,6 +108,9 @@ ngx_http_read_client_request_body(ngx_http_request_t *r,
         r->request_length += preread - (r->header_in->last - r->header_in->pos);
 
         if (!r->headers_in.chunked
+#if (NGX_HTTP_V3)
+            && r->http_version != NGX_HTTP_VERSION_30
+#endif
             && rb->rest > 0
             && rb->rest <= (off_t) (r->header_in->end - r->header_in->last))
         {
@@ -165,7 +168,12 @@ ngx_http_read_client_request_body(ngx_http_request_t *r,
 
     /* TODO: honor r->request_body_in_single_buf */
 
-    if (!r->headers_in.chunked && rb->rest < size) {
+    if (!r->headers_in.chunked
+#if (NGX_HTTP_V3)
+        && r->http_version != NGX_HTTP_VERSION_30
+#endif
+        && rb->rest < size)
+    {
         size = (ssize_t) rb->rest;
 
         if (r->request_body_in_single_buf) {
@@ -332,14 +340,25 @@ ngx_http_do_read_client_request_body(ngx_http_request_t *r)
                 break;
             }
 
-            if (n == 0) {
-                ngx_log_error(NGX_LOG_INFO, c->log, 0,
-                              "client prematurely closed connection");
-            }
+#if (NGX_HTTP_V3)
+            if (n == 0 && r->http_version == NGX_HTTP_VERSION_30) {
+
+                /* the request stream is finished */
+
+                rb->buf->last_buf = 1;
 
-            if (n == 0 || n == NGX_ERROR) {
-                c->error = 1;
-                return NGX_HTTP_BAD_REQUEST;
+            } else
+#endif
+            {
+                if (n == 0) {
+                    ngx_log_error(NGX_LOG_INFO, c->log, 0,
+                                  "client prematurely closed connection");
+                }
+
+                if (n == 0 || n == NGX_ERROR) {
+                    c->error = 1;
+                    return NGX_HTTP_BAD_REQUEST;
+                }
             }
 
             rb->buf->last += n;
@@ -584,6 +603,20 @@ ngx_http_discard_request_body(ngx_http_request_t *r)
     }
 #endif
 
+#if (NGX_HTTP_V3)
+    if (r->http_version == NGX_HTTP_VERSION_30) {
+        /* the client is asked to stop sending the request stream */
+
+        if (ngx_quic_shutdown_stream(r->connection, NGX_READ_SHUTDOWN)
+            != NGX_OK)
+        {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        return NGX_OK;
+    }
+#endif
+
     if (ngx_http_test_expect(r) != NGX_OK) {
         return NGX_HTTP_INTERNAL_SERVER_ERROR;
     }
@@ -879,6 +912,9 @@ ngx_http_test_expect(ngx_http_request_t *r)
         || r->http_version < NGX_HTTP_VERSION_11
 #if (NGX_HTTP_V2)
         || r->stream != NULL
+#endif
+#if (NGX_HTTP_V3)
+        || r->http_version == NGX_HTTP_VERSION_30
 #endif
        )
     {
@@ -919,6 +955,12 @@ ngx_http_test_expect(ngx_http_request_t *r)
 static ngx_int_t
 ngx_http_request_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
 {
+#if (NGX_HTTP_V3)
+    if (r->http_version == NGX_HTTP_VERSION_30) {
+        return ngx_http_v3_request_body_filter(r, in);
+    }
+#endif
+
     if (r->headers_in.chunked) {
         return ngx_http_request_body_chunked_filter(r, in);
 
@@ -37,6 +37,8 @@ static void ngx_http_upstream_check_broken_connection(ngx_http_request_t *r,
     ngx_event_t *ev);
 static void ngx_http_upstream_connect(ngx_http_request_t *r,
     ngx_http_upstream_t *u);
+static void ngx_http_upstream_connect_peer(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
 static ngx_int_t ngx_http_upstream_reinit(ngx_http_request_t *r,
     ngx_http_upstream_t *u);
 static void ngx_http_upstream_send_request(ngx_http_request_t *r,
@@ -185,8 +187,6 @@ static void ngx_http_upstream_ssl_handshake_handler(ngx_connection_t *c);
 static void ngx_http_upstream_ssl_handshake(ngx_http_request_t *,
     ngx_http_upstream_t *u, ngx_connection_t *c);
 static void ngx_http_upstream_ssl_save_session(ngx_connection_t *c);
-static ngx_int_t ngx_http_upstream_ssl_name(ngx_http_request_t *r,
-    ngx_http_upstream_t *u, ngx_connection_t *c);
 #endif
 
 
@@ -523,6 +523,13 @@ ngx_http_upstream_init(ngx_http_request_t *r)
     }
 #endif
 
+#if (NGX_HTTP_V3)
+    if (c->quic) {
+        ngx_http_upstream_init_request(r);
+        return;
+    }
+#endif
+
     if (c->read->timer_set) {
         ngx_del_timer(c->read);
     }
@@ -734,6 +741,14 @@ ngx_http_upstream_init_request(ngx_http_request_t *r)
                 return;
             }
 
+#if (NGX_HTTP_V2)
+            if (u->http2 && ngx_http_v2_upstream_init_peer(r, u) != NGX_OK) {
+                ngx_http_upstream_finalize_request(r, u,
+                                               NGX_HTTP_INTERNAL_SERVER_ERROR);
+                return;
+            }
+#endif
+
             ngx_http_upstream_connect(r, u);
 
             return;
@@ -803,6 +818,14 @@ found:
         return;
     }
 
+#if (NGX_HTTP_V2)
+    if (u->http2 && ngx_http_v2_upstream_init_peer(r, u) != NGX_OK) {
+        ngx_http_upstream_finalize_request(r, u,
+                                           NGX_HTTP_INTERNAL_SERVER_ERROR);
+        return;
+    }
+#endif
+
     u->peer.start_time = ngx_current_msec;
 
     if (u->conf->next_upstream_tries
@@ -1243,6 +1266,14 @@ ngx_http_upstream_resolve_handler(ngx_resolver_ctx_t *ctx)
         goto failed;
     }
 
+#if (NGX_HTTP_V2)
+    if (u->http2 && ngx_http_v2_upstream_init_peer(r, u) != NGX_OK) {
+        ngx_http_upstream_finalize_request(r, u,
+                                           NGX_HTTP_INTERNAL_SERVER_ERROR);
+        goto failed;
+    }
+#endif
+
     ngx_resolve_name_done(ctx);
     ur->ctx = NULL;
 
@@ -1356,6 +1387,23 @@ ngx_http_upstream_check_broken_connection(ngx_http_request_t *r,
     }
 #endif
 
+#if (NGX_HTTP_V3)
+
+    if (c->quic) {
+        if (ev->error) {
+            c->error = 1;
+
+            if (!u->cacheable) {
+                ngx_http_upstream_finalize_request(r, u,
+                                               NGX_HTTP_CLIENT_CLOSED_REQUEST);
+            }
+        }
+
+        return;
+    }
+
+#endif
+
 #if (NGX_HAVE_KQUEUE)
 
     if (ngx_event_flags & NGX_USE_KQUEUE_EVENT) {
@@ -1509,9 +1557,6 @@ ngx_http_upstream_check_broken_connection(ngx_http_request_t *r,
 static void
 ngx_http_upstream_connect(ngx_http_request_t *r, ngx_http_upstream_t *u)
 {
-    ngx_int_t          rc;
-    ngx_connection_t  *c;
-
     r->connection->log->action = "connecting to upstream";
 
     if (u->state && u->state->response_time == (ngx_msec_t) -1) {
@@ -1533,6 +1578,37 @@ ngx_http_upstream_connect(ngx_http_request_t *r, ngx_http_upstream_t *u)
     u->state->connect_time = (ngx_msec_t) -1;
     u->state->header_time = (ngx_msec_t) -1;
 
+    ngx_http_upstream_connect_peer(r, u);
+}
+
+
+void
+ngx_http_upstream_resume_connect(ngx_http_request_t *r, ngx_http_upstream_t *u)
+{
+    ngx_connection_t  *c;
+
+    c = r->connection;
+
+    ngx_http_set_log_request(c->log, r);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http upstream resume connect: \"%V?%V\"",
+                   &r->uri, &r->args);
+
+    c->log->action = "connecting to upstream";
+
+    ngx_http_upstream_connect_peer(r, u);
+
+    ngx_http_run_posted_requests(c);
+}
+
+
+static void
+ngx_http_upstream_connect_peer(ngx_http_request_t *r, ngx_http_upstream_t *u)
+{
+    ngx_int_t          rc;
+    ngx_connection_t  *c;
+
     rc = ngx_event_connect_peer(&u->peer);
 
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
@@ -1557,6 +1633,16 @@ ngx_http_upstream_connect(ngx_http_request_t *r, ngx_http_upstream_t *u)
         return;
     }
 
+    if (rc == NGX_AGAIN && u->peer.connection == NULL) {
+
+        /*
+         * the balancer waits for a connection to become available,
+         * it calls ngx_http_upstream_resume_connect() when done
+         */
+
+        return;
+    }
+
     /* rc == NGX_OK || rc == NGX_AGAIN || rc == NGX_DONE */
 
     c = u->peer.connection;
@@ -1647,7 +1733,12 @@ ngx_http_upstream_connect(ngx_http_request_t *r, ngx_http_upstream_t *u)
 
 #if (NGX_HTTP_SSL)
 
-    if (u->ssl && c->ssl == NULL) {
+    if (u->ssl && c->ssl == NULL
+#if (NGX_HTTP_V2)
+        && !u->http2
+#endif
+       )
+    {
         ngx_http_upstream_ssl_init_connection(r, u, c);
         return;
     }
@@ -1819,7 +1910,7 @@ ngx_http_upstream_ssl_save_session(ngx_connection_t *c)
 }
 
 
-static ngx_int_t
+ngx_int_t
 ngx_http_upstream_ssl_name(ngx_http_request_t *r, ngx_http_upstream_t *u,
     ngx_connection_t *c)
 {
@@ -1861,7 +1952,7 @@ ngx_http_upstream_ssl_name(ngx_http_request_t *r, ngx_http_upstream_t *u,
         name.len = p - name.data;
     }
 
-    if (!u->conf->ssl_server_name) {
+    if (c == NULL || !u->conf->ssl_server_name) {
         goto done;
     }
 
@@ -2248,7 +2339,12 @@ ngx_http_upstream_send_request_handler(ngx_http_request_t *r,
 
 #if (NGX_HTTP_SSL)
 
-    if (u->ssl && c->ssl == NULL) {
+    if (u->ssl && c->ssl == NULL
+#if (NGX_HTTP_V2)
+        && !u->http2
+#endif
+       )
+    {
         ngx_http_upstream_ssl_init_connection(r, u, c);
         return;
     }
@@ -5867,7 +5963,9 @@ ngx_http_upstream_server(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     ngx_str_t                   *value, s;
     ngx_url_t                    u;
     ngx_int_t                    weight, max_conns, max_fails;
-    ngx_uint_t                   i;
+    ngx_uint_t                   i, j, n, resolve;
+    ngx_addr_t                  *addrs;
+    ngx_sockaddr_t              *sa;
     ngx_http_upstream_server_t  *us;
 
     us = ngx_array_push(uscf->servers);
@@ -5883,6 +5981,7 @@ ngx_http_upstream_server(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     max_conns = 0;
     max_fails = 1;
     fail_timeout = 10;
+    resolve = 0;
 
     for (i = 2; i < cf->args->nelts; i++) {
 
@@ -5971,12 +6070,18 @@ ngx_http_upstream_server(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             continue;
         }
 
+        if (ngx_strcmp(value[i].data, "resolve") == 0) {
+            resolve = 1;
+            continue;
+        }
+
         goto invalid;
     }
 
     ngx_memzero(&u, sizeof(ngx_url_t));
 
     u.url = value[1];
+    u.no_resolve = resolve;
     u.default_port = 80;
 
     if (ngx_parse_url(cf->pool, &u) != NGX_OK) {
@@ -5988,6 +6093,44 @@ ngx_http_upstream_server(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         return NGX_CONF_ERROR;
     }
 
+    if (resolve && u.naddrs == 0) {
+
+        /*
+         * the name is re-resolved at run time into a fixed number
+         * of peer slots; addresses known at startup fill the first ones
+         */
+
+        us->resolve = 1;
+        us->host = u.host;
+        us->port = u.port;
+
+        (void) ngx_inet_resolve_host(cf->pool, &u);
+
+        n = ngx_max(u.naddrs, NGX_HTTP_UPSTREAM_RESOLVE_SLOTS);
+
+        addrs = ngx_pcalloc(cf->pool, n * sizeof(ngx_addr_t));
+        if (addrs == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        sa = ngx_pcalloc(cf->pool, sizeof(ngx_sockaddr_t));
+        if (sa == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        for (j = 0; j < n; j++) {
+            if (j < u.naddrs) {
+                addrs[j] = u.addrs[j];
+
+            } else {
+                addrs[j].sockaddr = &sa->sockaddr;
+            }
+        }
+
+        u.addrs = addrs;
+        u.naddrs = n;
+    }
+
     us->name = u.url;
     us->addrs = u.addrs;
     us->naddrs = u.naddrs;
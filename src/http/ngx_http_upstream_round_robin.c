@@ -14,6 +14,8 @@
                                     + ((p)->next ? (p)->next->tries : 0))
 
 
+static ngx_int_t ngx_http_upstream_init_resolve(ngx_conf_t *cf,
+    ngx_http_upstream_srv_conf_t *us);
 static ngx_http_upstream_rr_peer_t *ngx_http_upstream_get_peer(
     ngx_http_upstream_rr_peer_data_t *rrp);
 
@@ -42,6 +44,10 @@ ngx_http_upstream_init_round_robin(ngx_conf_t *cf,
     if (us->servers) {
         server = us->servers->elts;
 
+        if (ngx_http_upstream_init_resolve(cf, us) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
         n = 0;
         w = 0;
         t = 0;
@@ -102,6 +108,10 @@ ngx_http_upstream_init_round_robin(ngx_conf_t *cf,
                 peer[n].max_fails = server[i].max_fails;
                 peer[n].fail_timeout = server[i].fail_timeout;
                 peer[n].down = server[i].down;
+
+                if (server[i].addrs[j].name.len == 0) {
+                    peer[n].down |= NGX_HTTP_UPSTREAM_PEER_UNRESOLVED;
+                }
                 peer[n].server = server[i].name;
 
                 *peerp = &peer[n];
@@ -172,6 +182,10 @@ ngx_http_upstream_init_round_robin(ngx_conf_t *cf,
                 peer[n].max_fails = server[i].max_fails;
                 peer[n].fail_timeout = server[i].fail_timeout;
                 peer[n].down = server[i].down;
+
+                if (server[i].addrs[j].name.len == 0) {
+                    peer[n].down |= NGX_HTTP_UPSTREAM_PEER_UNRESOLVED;
+                }
                 peer[n].server = server[i].name;
 
                 *peerp = &peer[n];
@@ -253,6 +267,68 @@ ngx_http_upstream_init_round_robin(ngx_conf_t *cf,
 }
 
 
+static ngx_int_t
+ngx_http_upstream_init_resolve(ngx_conf_t *cf,
+    ngx_http_upstream_srv_conf_t *us)
+{
+    ngx_uint_t                   i;
+    ngx_http_upstream_server_t  *server;
+#if (NGX_HTTP_UPSTREAM_ZONE)
+    ngx_http_core_loc_conf_t    *clcf;
+#endif
+
+    server = us->servers->elts;
+
+    for (i = 0; i < us->servers->nelts; i++) {
+        if (server[i].resolve) {
+            break;
+        }
+    }
+
+    if (i == us->servers->nelts) {
+        return NGX_OK;
+    }
+
+#if (NGX_HTTP_UPSTREAM_ZONE)
+
+    if (us->shm_zone == NULL) {
+        ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                      "resolving names at run time requires "
+                      "upstream \"%V\" in %s:%ui to be in shared memory",
+                      &us->host, us->file_name, us->line);
+        return NGX_ERROR;
+    }
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+
+    if (clcf->resolver == NULL
+        || clcf->resolver->connections.nelts == 0)
+    {
+        ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                      "no resolver defined to resolve names "
+                      "in upstream \"%V\" in %s:%ui",
+                      &us->host, us->file_name, us->line);
+        return NGX_ERROR;
+    }
+
+    us->resolver = clcf->resolver;
+    us->resolver_timeout = (clcf->resolver_timeout == NGX_CONF_UNSET_MSEC)
+                           ? 30000 : clcf->resolver_timeout;
+
+    return NGX_OK;
+
+#else
+
+    ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                  "resolving names at run time requires "
+                  "upstream \"%V\" in %s:%ui to be in shared memory",
+                  &us->host, us->file_name, us->line);
+    return NGX_ERROR;
+
+#endif
+}
+
+
 ngx_int_t
 ngx_http_upstream_init_round_robin_peer(ngx_http_request_t *r,
     ngx_http_upstream_srv_conf_t *us)
@@ -38,6 +38,9 @@ struct ngx_http_upstream_rr_peer_s {
     ngx_msec_t                      slow_start;
     ngx_msec_t                      start_time;
 
+    ngx_uint_t                      ewma;
+    ngx_msec_t                      ewma_updated;
+
     ngx_uint_t                      down;
 
 #if (NGX_HTTP_SSL || NGX_COMPAT)
@@ -56,6 +59,12 @@ struct ngx_http_upstream_rr_peer_s {
 };
 
 
+#define NGX_HTTP_UPSTREAM_PEER_UNHEALTHY  0x02
+#define NGX_HTTP_UPSTREAM_PEER_UNRESOLVED 0x04
+
+#define NGX_HTTP_UPSTREAM_RESOLVE_SLOTS   16
+
+
 typedef struct ngx_http_upstream_rr_peers_s  ngx_http_upstream_rr_peers_t;
 
 struct ngx_http_upstream_rr_peers_s {
@@ -59,6 +59,8 @@ typedef struct {
 
 static void ngx_http_v2_read_handler(ngx_event_t *rev);
 static void ngx_http_v2_write_handler(ngx_event_t *wev);
+static ngx_http_v2_out_frame_t *ngx_http_v2_dequeue_frame(
+    ngx_http_v2_connection_t *h2c);
 static void ngx_http_v2_handle_connection(ngx_http_v2_connection_t *h2c);
 static void ngx_http_v2_lingering_close(ngx_connection_t *c);
 static void ngx_http_v2_lingering_close_handler(ngx_event_t *rev);
@@ -152,10 +154,6 @@ static ngx_http_v2_out_frame_t *ngx_http_v2_get_frame(
 static ngx_int_t ngx_http_v2_frame_handler(ngx_http_v2_connection_t *h2c,
     ngx_http_v2_out_frame_t *frame);
 
-static ngx_int_t ngx_http_v2_validate_header(ngx_http_request_t *r,
-    ngx_http_v2_header_t *header);
-static ngx_int_t ngx_http_v2_pseudo_header(ngx_http_request_t *r,
-    ngx_http_v2_header_t *header);
 static ngx_int_t ngx_http_v2_parse_path(ngx_http_request_t *r,
     ngx_str_t *value);
 static ngx_int_t ngx_http_v2_parse_method(ngx_http_request_t *r,
@@ -166,10 +164,9 @@ static ngx_int_t ngx_http_v2_parse_authority(ngx_http_request_t *r,
     ngx_str_t *value);
 static ngx_int_t ngx_http_v2_parse_header(ngx_http_request_t *r,
     ngx_http_v2_parse_header_t *header, ngx_str_t *value);
-static ngx_int_t ngx_http_v2_construct_request_line(ngx_http_request_t *r);
-static ngx_int_t ngx_http_v2_cookie(ngx_http_request_t *r,
-    ngx_http_v2_header_t *header);
-static ngx_int_t ngx_http_v2_construct_cookie_header(ngx_http_request_t *r);
+static void ngx_http_v2_priority(ngx_http_v2_stream_t *stream,
+    ngx_str_t *value);
+static void ngx_http_v2_request_failed(ngx_http_request_t *r);
 static void ngx_http_v2_run_request(ngx_http_request_t *r);
 static void ngx_http_v2_run_request_handler(ngx_event_t *ev);
 static ngx_int_t ngx_http_v2_process_request_body(ngx_http_request_t *r,
@@ -232,6 +229,7 @@ static ngx_http_v2_parse_header_t  ngx_http_v2_parse_headers[] = {
 void
 ngx_http_v2_init(ngx_event_t *rev)
 {
+    ngx_uint_t                 i;
     ngx_connection_t          *c;
     ngx_pool_cleanup_t        *cln;
     ngx_http_connection_t     *hc;
@@ -274,6 +272,10 @@ ngx_http_v2_init(ngx_event_t *rev)
 
     h2c->frame_size = NGX_HTTP_V2_DEFAULT_FRAME_SIZE;
 
+    h2c->hpack_enc.size = NGX_HTTP_V2_TABLE_SIZE;
+    h2c->hpack_enc.free = NGX_HTTP_V2_TABLE_SIZE;
+    h2c->hpack_enc.update = NGX_HTTP_V2_TABLE_SIZE;
+
     h2scf = ngx_http_get_module_srv_conf(hc->conf_ctx, ngx_http_v2_module);
 
     h2c->concurrent_pushes = h2scf->concurrent_pushes;
@@ -321,6 +323,10 @@ ngx_http_v2_init(ngx_event_t *rev)
     ngx_queue_init(&h2c->dependencies);
     ngx_queue_init(&h2c->closed);
 
+    for (i = 0; i < NGX_HTTP_V2_URGENCIES; i++) {
+        ngx_queue_init(&h2c->active[i]);
+    }
+
     c->data = h2c;
 
     rev->handler = ngx_http_v2_read_handler;
@@ -455,7 +461,9 @@ ngx_http_v2_read_handler(ngx_event_t *rev)
         return;
     }
 
-    if (h2c->last_out && ngx_http_v2_send_output_queue(h2c) == NGX_ERROR) {
+    if ((h2c->last_out || h2c->active_mask)
+        && ngx_http_v2_send_output_queue(h2c) == NGX_ERROR)
+    {
         ngx_http_v2_finalize_connection(h2c, 0);
         return;
     }
@@ -487,7 +495,7 @@ ngx_http_v2_write_handler(ngx_event_t *wev)
 
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0, "http2 write handler");
 
-    if (h2c->last_out == NULL && !c->buffered) {
+    if (h2c->last_out == NULL && h2c->active_mask == 0 && !c->buffered) {
 
         if (wev->timer_set) {
             ngx_del_timer(wev);
@@ -523,7 +531,8 @@ ngx_http_v2_send_output_queue(ngx_http_v2_connection_t *h2c)
     ngx_chain_t               *cl;
     ngx_event_t               *wev;
     ngx_connection_t          *c;
-    ngx_http_v2_out_frame_t   *out, *frame, *fn;
+    ngx_uint_t                 urgent;
+    ngx_http_v2_out_frame_t   *out, *frame, *fn, *partial, *requeue;
     ngx_http_core_loc_conf_t  *clcf;
 
     c = h2c->connection;
@@ -537,6 +546,19 @@ ngx_http_v2_send_output_queue(ngx_http_v2_connection_t *h2c)
         return NGX_AGAIN;
     }
 
+    /*
+     * only the most urgent streams are sent in a pass, less urgent ones
+     * wait until the posted write event, so that more urgent streams
+     * can queue their next frames first
+     */
+
+    urgent = h2c->active_mask & -h2c->active_mask;
+
+    while (h2c->active_mask & urgent) {
+        frame = ngx_http_v2_dequeue_frame(h2c);
+        ngx_http_v2_queue_ordered_frame(h2c, frame);
+    }
+
     cl = NULL;
     out = NULL;
 
@@ -598,14 +620,39 @@ ngx_http_v2_send_output_queue(ngx_http_v2_connection_t *h2c)
                        out->blocked, out->length);
     }
 
+    /*
+     * the frame sent partially stays in the connection queue, other
+     * unsent DATA frames taken from the streams return to them in order,
+     * so that they can neither get ahead of more urgent streams nor be
+     * missed when the stream is reset
+     */
+
     frame = NULL;
+    requeue = NULL;
+    partial = out;
 
     for ( /* void */ ; out; out = fn) {
         fn = out->next;
+
+        if (out->dequeued && out != partial) {
+            out->next = requeue;
+            requeue = out;
+            continue;
+        }
+
+        out->dequeued = 0;
+
         out->next = frame;
         frame = out;
     }
 
+    for ( /* void */ ; requeue; requeue = fn) {
+        fn = requeue->next;
+
+        requeue->stream->deficit += requeue->length;
+        ngx_http_v2_requeue_frame(h2c, requeue);
+    }
+
     h2c->last_out = frame;
 
     if (!wev->ready) {
@@ -617,6 +664,10 @@ ngx_http_v2_send_output_queue(ngx_http_v2_connection_t *h2c)
         ngx_del_timer(wev);
     }
 
+    if (h2c->active_mask) {
+        ngx_post_event(wev, &ngx_posted_events);
+    }
+
     return NGX_OK;
 
 error:
@@ -631,6 +682,95 @@ error:
 }
 
 
+void
+ngx_http_v2_schedule_stream(ngx_http_v2_connection_t *h2c,
+    ngx_http_v2_stream_t *stream)
+{
+    ngx_uint_t  urgency;
+
+    if (!stream->prioritized) {
+
+        /* without the "priority" header, urgency follows the tree depth */
+
+        urgency = stream->node->rank ? stream->node->rank - 1 : 0;
+
+        if (urgency >= NGX_HTTP_V2_URGENCIES) {
+            urgency = NGX_HTTP_V2_URGENCIES - 1;
+        }
+
+        stream->urgency = urgency;
+        stream->incremental = 1;
+    }
+
+    stream->deficit = 0;
+
+    ngx_queue_insert_tail(&h2c->active[stream->urgency], &stream->active);
+
+    h2c->active_mask |= 1 << stream->urgency;
+}
+
+
+void
+ngx_http_v2_unschedule_stream(ngx_http_v2_connection_t *h2c,
+    ngx_http_v2_stream_t *stream)
+{
+    ngx_queue_remove(&stream->active);
+
+    if (ngx_queue_empty(&h2c->active[stream->urgency])) {
+        h2c->active_mask &= ~(1 << stream->urgency);
+    }
+}
+
+
+static ngx_http_v2_out_frame_t *
+ngx_http_v2_dequeue_frame(ngx_http_v2_connection_t *h2c)
+{
+    ngx_uint_t                urgency;
+    ngx_queue_t              *active, *q;
+    ngx_http_v2_stream_t     *stream;
+    ngx_http_v2_out_frame_t  *frame;
+
+    for (urgency = 0; !(h2c->active_mask & (1 << urgency)); urgency++) {
+        /* void */
+    }
+
+    active = &h2c->active[urgency];
+
+    for ( ;; ) {
+        q = ngx_queue_head(active);
+        stream = ngx_queue_data(q, ngx_http_v2_stream_t, active);
+        frame = stream->out;
+
+        /* non-incremental streams are sent in order, one at a time */
+
+        if (!stream->incremental
+            || stream->deficit >= (ssize_t) frame->length)
+        {
+            break;
+        }
+
+        stream->deficit += h2c->frame_size * stream->node->weight
+                           / NGX_HTTP_V2_DEFAULT_WEIGHT;
+
+        if (q != ngx_queue_last(active)) {
+            ngx_queue_remove(q);
+            ngx_queue_insert_tail(active, q);
+        }
+    }
+
+    stream->deficit -= frame->length;
+    stream->out = frame->next;
+
+    frame->dequeued = 1;
+
+    if (stream->out == NULL) {
+        ngx_http_v2_unschedule_stream(h2c, stream);
+    }
+
+    return frame;
+}
+
+
 static void
 ngx_http_v2_handle_connection(ngx_http_v2_connection_t *h2c)
 {
@@ -638,7 +778,8 @@ ngx_http_v2_handle_connection(ngx_http_v2_connection_t *h2c)
     ngx_connection_t          *c;
     ngx_http_core_loc_conf_t  *clcf;
 
-    if (h2c->last_out || h2c->processing || h2c->pushing) {
+    if (h2c->last_out || h2c->active_mask || h2c->processing || h2c->pushing)
+    {
         return;
     }
 
@@ -1736,6 +1877,7 @@ ngx_http_v2_state_process_header(ngx_http_v2_connection_t *h2c, u_char *pos,
     ngx_http_core_main_conf_t  *cmcf;
 
     static ngx_str_t cookie = ngx_string("cookie");
+    static ngx_str_t priority = ngx_string("priority");
 
     header = &h2c->state.header;
 
@@ -1839,7 +1981,7 @@ ngx_http_v2_state_process_header(ngx_http_v2_connection_t *h2c, u_char *pos,
     if (header->name.len == cookie.len
         && ngx_memcmp(header->name.data, cookie.data, cookie.len) == 0)
     {
-        if (ngx_http_v2_cookie(r, header) != NGX_OK) {
+        if (ngx_http_v2_cookie(r, &r->stream->cookies, header) != NGX_OK) {
             return ngx_http_v2_connection_error(h2c,
                                                 NGX_HTTP_V2_INTERNAL_ERROR);
         }
@@ -1873,6 +2015,12 @@ ngx_http_v2_state_process_header(ngx_http_v2_connection_t *h2c, u_char *pos,
         if (hh && hh->handler(r, h, hh->offset) != NGX_OK) {
             goto error;
         }
+
+        if (h->key.len == priority.len
+            && ngx_memcmp(h->key.data, priority.data, priority.len) == 0)
+        {
+            ngx_http_v2_priority(r->stream, &h->value);
+        }
     }
 
     ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
@@ -2281,7 +2429,7 @@ ngx_http_v2_state_settings_params(ngx_http_v2_connection_t *h2c, u_char *pos,
 
         case NGX_HTTP_V2_HEADER_TABLE_SIZE_SETTING:
 
-            h2c->table_update = 1;
+            ngx_http_v2_encoder_table_size(h2c, value);
             break;
 
         default:
@@ -3435,7 +3583,7 @@ ngx_http_v2_get_closed_node(ngx_http_v2_connection_t *h2c)
 }
 
 
-static ngx_int_t
+ngx_int_t
 ngx_http_v2_validate_header(ngx_http_request_t *r, ngx_http_v2_header_t *header)
 {
     u_char                     ch;
@@ -3487,7 +3635,7 @@ ngx_http_v2_validate_header(ngx_http_request_t *r, ngx_http_v2_header_t *header)
 }
 
 
-static ngx_int_t
+ngx_int_t
 ngx_http_v2_pseudo_header(ngx_http_request_t *r, ngx_http_v2_header_t *header)
 {
     header->name.len--;
@@ -3765,13 +3913,11 @@ ngx_http_v2_parse_header(ngx_http_request_t *r,
 }
 
 
-static ngx_int_t
+ngx_int_t
 ngx_http_v2_construct_request_line(ngx_http_request_t *r)
 {
     u_char  *p;
 
-    static const u_char ending[] = " HTTP/2.0";
-
     if (r->method_name.len == 0
         || r->schema.len == 0
         || r->unparsed_uri.len == 0)
@@ -3793,13 +3939,15 @@ ngx_http_v2_construct_request_line(ngx_http_request_t *r)
         return NGX_ERROR;
     }
 
+    /* also used by HTTP/3, the protocol is taken from the request */
+
     r->request_line.len = r->method_name.len + 1
-                          + r->unparsed_uri.len
-                          + sizeof(ending) - 1;
+                          + r->unparsed_uri.len + 1
+                          + r->http_protocol.len;
 
     p = ngx_pnalloc(r->pool, r->request_line.len + 1);
     if (p == NULL) {
-        ngx_http_v2_close_stream(r->stream, NGX_HTTP_INTERNAL_SERVER_ERROR);
+        ngx_http_v2_request_failed(r);
         return NGX_ERROR;
     }
 
@@ -3811,33 +3959,121 @@ ngx_http_v2_construct_request_line(ngx_http_request_t *r)
 
     p = ngx_cpymem(p, r->unparsed_uri.data, r->unparsed_uri.len);
 
-    ngx_memcpy(p, ending, sizeof(ending));
+    *p++ = ' ';
+
+    p = ngx_cpymem(p, r->http_protocol.data, r->http_protocol.len);
+
+    *p = '\0';
 
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "http2 request line: \"%V\"", &r->request_line);
+                   "http request line: \"%V\"", &r->request_line);
 
     return NGX_OK;
 }
 
 
-static ngx_int_t
-ngx_http_v2_cookie(ngx_http_request_t *r, ngx_http_v2_header_t *header)
+/*
+ * the "priority" header field, RFC 9218: a dictionary with
+ * the "u" (urgency, 0-7) and "i" (incremental, boolean) members
+ */
+
+static void
+ngx_http_v2_priority(ngx_http_v2_stream_t *stream, ngx_str_t *value)
 {
-    ngx_str_t    *val;
-    ngx_array_t  *cookies;
+    u_char      *p, *end, *key, *val;
+    size_t       key_len, val_len;
+    ngx_uint_t   urgency, incremental;
 
-    cookies = r->stream->cookies;
+    urgency = NGX_HTTP_V2_DEFAULT_URGENCY;
+    incremental = 0;
 
-    if (cookies == NULL) {
-        cookies = ngx_array_create(r->pool, 2, sizeof(ngx_str_t));
-        if (cookies == NULL) {
-            return NGX_ERROR;
+    p = value->data;
+    end = p + value->len;
+
+    while (p < end) {
+
+        while (p < end && (*p == ' ' || *p == '\t')) {
+            p++;
+        }
+
+        key = p;
+
+        while (p < end && *p != '=' && *p != ',' && *p != ';') {
+            p++;
+        }
+
+        key_len = p - key;
+
+        val = NULL;
+        val_len = 0;
+
+        if (p < end && *p == '=') {
+            val = ++p;
+
+            while (p < end && *p != ',' && *p != ';'
+                   && *p != ' ' && *p != '\t')
+            {
+                p++;
+            }
+
+            val_len = p - val;
+        }
+
+        /* parameters are ignored */
+
+        while (p < end && *p != ',') {
+            p++;
+        }
+
+        p++;
+
+        if (key_len != 1) {
+            continue;
+        }
+
+        if (key[0] == 'u') {
+            if (val_len == 1 && val[0] >= '0' && val[0] <= '7') {
+                urgency = val[0] - '0';
+            }
+
+            continue;
+        }
+
+        if (key[0] == 'i') {
+            if (val == NULL || (val_len == 2 && val[0] == '?' && val[1] == '1'))
+            {
+                incremental = 1;
+
+            } else if (val_len == 2 && val[0] == '?' && val[1] == '0') {
+                incremental = 0;
+            }
         }
+    }
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, stream->request->connection->log, 0,
+                   "http2:%ui priority u=%ui i=%ui",
+                   stream->node->id, urgency, incremental);
 
-        r->stream->cookies = cookies;
+    stream->prioritized = 1;
+    stream->urgency = urgency;
+    stream->incremental = incremental;
+}
+
+
+ngx_int_t
+ngx_http_v2_cookie(ngx_http_request_t *r, ngx_array_t **cookies,
+    ngx_http_v2_header_t *header)
+{
+    ngx_str_t  *val;
+
+    if (*cookies == NULL) {
+        *cookies = ngx_array_create(r->pool, 2, sizeof(ngx_str_t));
+        if (*cookies == NULL) {
+            return NGX_ERROR;
+        }
     }
 
-    val = ngx_array_push(cookies);
+    val = ngx_array_push(*cookies);
     if (val == NULL) {
         return NGX_ERROR;
     }
@@ -3849,22 +4085,20 @@ ngx_http_v2_cookie(ngx_http_request_t *r, ngx_http_v2_header_t *header)
 }
 
 
-static ngx_int_t
-ngx_http_v2_construct_cookie_header(ngx_http_request_t *r)
+ngx_int_t
+ngx_http_v2_construct_cookie_header(ngx_http_request_t *r,
+    ngx_array_t *cookies)
 {
     u_char                     *buf, *p, *end;
     size_t                      len;
     ngx_str_t                  *vals;
     ngx_uint_t                  i;
-    ngx_array_t                *cookies;
     ngx_table_elt_t            *h;
     ngx_http_header_t          *hh;
     ngx_http_core_main_conf_t  *cmcf;
 
     static ngx_str_t cookie = ngx_string("cookie");
 
-    cookies = r->stream->cookies;
-
     if (cookies == NULL) {
         return NGX_OK;
     }
@@ -3882,7 +4116,7 @@ ngx_http_v2_construct_cookie_header(ngx_http_request_t *r)
 
     buf = ngx_pnalloc(r->pool, len + 1);
     if (buf == NULL) {
-        ngx_http_v2_close_stream(r->stream, NGX_HTTP_INTERNAL_SERVER_ERROR);
+        ngx_http_v2_request_failed(r);
         return NGX_ERROR;
     }
 
@@ -3903,7 +4137,7 @@ ngx_http_v2_construct_cookie_header(ngx_http_request_t *r)
 
     h = ngx_list_push(&r->headers_in.headers);
     if (h == NULL) {
-        ngx_http_v2_close_stream(r->stream, NGX_HTTP_INTERNAL_SERVER_ERROR);
+        ngx_http_v2_request_failed(r);
         return NGX_ERROR;
     }
 
@@ -3924,7 +4158,7 @@ ngx_http_v2_construct_cookie_header(ngx_http_request_t *r)
                        h->lowcase_key, h->key.len);
 
     if (hh == NULL) {
-        ngx_http_v2_close_stream(r->stream, NGX_HTTP_INTERNAL_SERVER_ERROR);
+        ngx_http_v2_request_failed(r);
         return NGX_ERROR;
     }
 
@@ -3940,6 +4174,20 @@ ngx_http_v2_construct_cookie_header(ngx_http_request_t *r)
 }
 
 
+static void
+ngx_http_v2_request_failed(ngx_http_request_t *r)
+{
+    if (r->stream) {
+        ngx_http_v2_close_stream(r->stream, NGX_HTTP_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+    /* an HTTP/3 request */
+
+    ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+}
+
+
 static void
 ngx_http_v2_run_request(ngx_http_request_t *r)
 {
@@ -3952,7 +4200,9 @@ ngx_http_v2_run_request(ngx_http_request_t *r)
         goto failed;
     }
 
-    if (ngx_http_v2_construct_cookie_header(r) != NGX_OK) {
+    if (ngx_http_v2_construct_cookie_header(r, r->stream->cookies)
+        != NGX_OK)
+    {
         goto failed;
     }
 
@@ -4656,7 +4906,9 @@ ngx_http_v2_handle_connection_handler(ngx_event_t *rev)
         return;
     }
 
-    if (h2c->last_out && ngx_http_v2_send_output_queue(h2c) == NGX_ERROR) {
+    if ((h2c->last_out || h2c->active_mask)
+        && ngx_http_v2_send_output_queue(h2c) == NGX_ERROR)
+    {
         ngx_http_v2_finalize_connection(h2c, 0);
         return;
     }
@@ -4765,6 +5017,12 @@ ngx_http_v2_finalize_connection(ngx_http_v2_connection_t *h2c,
 
     h2c->last_out = NULL;
 
+    for (i = 0; i < NGX_HTTP_V2_URGENCIES; i++) {
+        ngx_queue_init(&h2c->active[i]);
+    }
+
+    h2c->active_mask = 0;
+
     h2scf = ngx_http_get_module_srv_conf(h2c->http_connection->conf_ctx,
                                          ngx_http_v2_module);
 
@@ -4788,6 +5046,7 @@ ngx_http_v2_finalize_connection(ngx_http_v2_connection_t *h2c,
 
             if (stream->queued) {
                 stream->queued = 0;
+                stream->out = NULL;
 
                 ev = fc->write;
                 ev->active = 0;
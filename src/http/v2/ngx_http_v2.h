@@ -54,6 +54,9 @@
 
 #define NGX_HTTP_V2_DEFAULT_WEIGHT       16
 
+#define NGX_HTTP_V2_URGENCIES            8
+#define NGX_HTTP_V2_DEFAULT_URGENCY      3
+
 
 typedef struct ngx_http_v2_connection_s   ngx_http_v2_connection_t;
 typedef struct ngx_http_v2_node_s         ngx_http_v2_node_t;
@@ -115,6 +118,29 @@ typedef struct {
 } ngx_http_v2_hpack_t;
 
 
+typedef struct {
+    ngx_uint_t                       hash;
+    u_short                          offset;
+    u_short                          name_len;
+    u_short                          value_len;
+} ngx_http_v2_hpack_entry_t;
+
+
+typedef struct {
+    ngx_http_v2_hpack_entry_t       *entries;
+
+    ngx_uint_t                       added;
+    ngx_uint_t                       deleted;
+
+    size_t                           size;
+    size_t                           free;
+    size_t                           update;
+
+    u_char                          *storage;
+    size_t                           pos;
+} ngx_http_v2_hpack_enc_t;
+
+
 struct ngx_http_v2_connection_s {
     ngx_connection_t                *connection;
     ngx_http_connection_t           *http_connection;
@@ -141,6 +167,7 @@ struct ngx_http_v2_connection_s {
     ngx_http_v2_state_t              state;
 
     ngx_http_v2_hpack_t              hpack;
+    ngx_http_v2_hpack_enc_t          hpack_enc;
 
     ngx_pool_t                      *pool;
 
@@ -151,6 +178,9 @@ struct ngx_http_v2_connection_s {
 
     ngx_http_v2_out_frame_t         *last_out;
 
+    ngx_queue_t                      active[NGX_HTTP_V2_URGENCIES];
+    ngx_uint_t                       active_mask;
+
     ngx_queue_t                      dependencies;
     ngx_queue_t                      closed;
 
@@ -206,6 +236,11 @@ struct ngx_http_v2_stream_s {
 
     ngx_queue_t                      queue;
 
+    ngx_http_v2_out_frame_t         *out;
+    ngx_http_v2_out_frame_t        **out_last;
+    ngx_queue_t                      active;
+    ssize_t                          deficit;
+
     ngx_array_t                     *cookies;
 
     ngx_pool_t                      *pool;
@@ -218,6 +253,9 @@ struct ngx_http_v2_stream_s {
     unsigned                         rst_sent:1;
     unsigned                         no_flow_control:1;
     unsigned                         skip_data:1;
+    unsigned                         prioritized:1;
+    unsigned                         incremental:1;
+    unsigned                         urgency:3;
 };
 
 
@@ -233,32 +271,64 @@ struct ngx_http_v2_out_frame_s {
 
     unsigned                         blocked:1;
     unsigned                         fin:1;
+    unsigned                         dequeued:1;
 };
 
 
+void ngx_http_v2_schedule_stream(ngx_http_v2_connection_t *h2c,
+    ngx_http_v2_stream_t *stream);
+void ngx_http_v2_unschedule_stream(ngx_http_v2_connection_t *h2c,
+    ngx_http_v2_stream_t *stream);
+
+
+/*
+ * DATA frames and trailers are kept per stream and picked by
+ * ngx_http_v2_send_output_queue() in urgency order, with deficit
+ * round robin by weight among streams of the same urgency
+ */
+
 static ngx_inline void
 ngx_http_v2_queue_frame(ngx_http_v2_connection_t *h2c,
     ngx_http_v2_out_frame_t *frame)
 {
-    ngx_http_v2_out_frame_t  **out;
+    ngx_http_v2_stream_t  *stream;
 
-    for (out = &h2c->last_out; *out; out = &(*out)->next) {
+    stream = frame->stream;
+    frame->next = NULL;
 
-        if ((*out)->blocked || (*out)->stream == NULL) {
-            break;
-        }
+    if (stream->out) {
+        *stream->out_last = frame;
+        stream->out_last = &frame->next;
+        return;
+    }
 
-        if ((*out)->stream->node->rank < frame->stream->node->rank
-            || ((*out)->stream->node->rank == frame->stream->node->rank
-                && (*out)->stream->node->rel_weight
-                   >= frame->stream->node->rel_weight))
-        {
-            break;
-        }
+    stream->out = frame;
+    stream->out_last = &frame->next;
+
+    ngx_http_v2_schedule_stream(h2c, stream);
+}
+
+
+static ngx_inline void
+ngx_http_v2_requeue_frame(ngx_http_v2_connection_t *h2c,
+    ngx_http_v2_out_frame_t *frame)
+{
+    ngx_http_v2_stream_t  *stream;
+
+    stream = frame->stream;
+    frame->dequeued = 0;
+
+    if (stream->out) {
+        frame->next = stream->out;
+        stream->out = frame;
+        return;
     }
 
-    frame->next = *out;
-    *out = frame;
+    frame->next = NULL;
+    stream->out = frame;
+    stream->out_last = &frame->next;
+
+    ngx_http_v2_schedule_stream(h2c, stream);
 }
 
 
@@ -301,6 +371,21 @@ void ngx_http_v2_close_stream(ngx_http_v2_stream_t *stream, ngx_int_t rc);
 
 ngx_int_t ngx_http_v2_send_output_queue(ngx_http_v2_connection_t *h2c);
 
+ngx_int_t ngx_http_v2_validate_header(ngx_http_request_t *r,
+    ngx_http_v2_header_t *header);
+ngx_int_t ngx_http_v2_pseudo_header(ngx_http_request_t *r,
+    ngx_http_v2_header_t *header);
+ngx_int_t ngx_http_v2_construct_request_line(ngx_http_request_t *r);
+ngx_int_t ngx_http_v2_cookie(ngx_http_request_t *r, ngx_array_t **cookies,
+    ngx_http_v2_header_t *header);
+ngx_int_t ngx_http_v2_construct_cookie_header(ngx_http_request_t *r,
+    ngx_array_t *cookies);
+
+ngx_int_t ngx_http_v2_upstream_init_peer(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
+ngx_int_t ngx_http_v2_upstream_parse_header(ngx_http_request_t *r,
+    u_char **pos, u_char *end, ngx_str_t *name, ngx_str_t *value);
+
 
 ngx_str_t *ngx_http_v2_get_static_name(ngx_uint_t index);
 ngx_str_t *ngx_http_v2_get_static_value(ngx_uint_t index);
@@ -310,12 +395,22 @@ ngx_int_t ngx_http_v2_get_indexed_header(ngx_http_v2_connection_t *h2c,
 ngx_int_t ngx_http_v2_add_header(ngx_http_v2_connection_t *h2c,
     ngx_http_v2_header_t *header);
 ngx_int_t ngx_http_v2_table_size(ngx_http_v2_connection_t *h2c, size_t size);
+void ngx_http_v2_encoder_table_size(ngx_http_v2_connection_t *h2c,
+    size_t size);
+u_char *ngx_http_v2_write_table_update(ngx_http_v2_connection_t *h2c,
+    u_char *pos);
+u_char *ngx_http_v2_write_header(ngx_http_v2_connection_t *h2c, u_char *pos,
+    ngx_uint_t index, ngx_str_t *name, ngx_str_t *value, u_char *tmp,
+    ngx_uint_t indexing);
 
 
+void ngx_http_v2_huff_decode_init(void);
 ngx_int_t ngx_http_v2_huff_decode(u_char *state, u_char *src, size_t len,
     u_char **dst, ngx_uint_t last, ngx_log_t *log);
 size_t ngx_http_v2_huff_encode(u_char *src, size_t len, u_char *dst,
     ngx_uint_t lower);
+u_char *ngx_http_v2_write_int(u_char *pos, ngx_uint_t prefix,
+    ngx_uint_t value);
 
 
 #define ngx_http_v2_prefix(bits)  ((1 << (bits)) - 1)
@@ -383,6 +478,14 @@ size_t ngx_http_v2_huff_encode(u_char *src, size_t len, u_char *dst,
 #define NGX_HTTP_V2_ENCODE_RAW            0
 #define NGX_HTTP_V2_ENCODE_HUFF           0x80
 
+#define NGX_HTTP_V2_TABLE_SIZE            4096
+#define NGX_HTTP_V2_TABLE_UPDATE_SIZE     (2 * NGX_HTTP_V2_INT_OCTETS)
+
+/* indexing of encoded header fields */
+#define NGX_HTTP_V2_WITHOUT_INDEXING      0
+#define NGX_HTTP_V2_INDEXING              1
+#define NGX_HTTP_V2_NEVER_INDEXED         2
+
 #define NGX_HTTP_V2_AUTHORITY_INDEX       1
 
 #define NGX_HTTP_V2_METHOD_INDEX          2
@@ -406,12 +509,16 @@ size_t ngx_http_v2_huff_encode(u_char *src, size_t len, u_char *dst,
 
 #define NGX_HTTP_V2_ACCEPT_ENCODING_INDEX 16
 #define NGX_HTTP_V2_ACCEPT_LANGUAGE_INDEX 17
+#define NGX_HTTP_V2_AGE_INDEX             21
 #define NGX_HTTP_V2_CONTENT_LENGTH_INDEX  28
+#define NGX_HTTP_V2_CONTENT_RANGE_INDEX   30
 #define NGX_HTTP_V2_CONTENT_TYPE_INDEX    31
 #define NGX_HTTP_V2_DATE_INDEX            33
+#define NGX_HTTP_V2_ETAG_INDEX            34
 #define NGX_HTTP_V2_LAST_MODIFIED_INDEX   44
 #define NGX_HTTP_V2_LOCATION_INDEX        46
 #define NGX_HTTP_V2_SERVER_INDEX          54
+#define NGX_HTTP_V2_SET_COOKIE_INDEX      55
 #define NGX_HTTP_V2_USER_AGENT_INDEX      58
 #define NGX_HTTP_V2_VARY_INDEX            59
 
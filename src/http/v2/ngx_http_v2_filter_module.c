@@ -52,6 +52,8 @@ static ngx_http_v2_push_header_t  ngx_http_v2_push_headers[] = {
     (sizeof(ngx_http_v2_push_headers) / sizeof(ngx_http_v2_push_header_t))
 
 
+static ngx_uint_t ngx_http_v2_header_indexing(ngx_str_t *name,
+    ngx_uint_t *index);
 static ngx_int_t ngx_http_v2_push_resources(ngx_http_request_t *r);
 static ngx_int_t ngx_http_v2_push_resource(ngx_http_request_t *r,
     ngx_str_t *path, ngx_str_t *binary);
@@ -135,8 +137,8 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
 {
     u_char                     status, *pos, *start, *p, *tmp;
     size_t                     len, tmp_len;
-    ngx_str_t                  host, location;
-    ngx_uint_t                 i, port, fin;
+    ngx_str_t                  host, location, value;
+    ngx_uint_t                 i, port, fin, index, indexing;
     ngx_list_part_t           *part;
     ngx_table_elt_t           *header;
     ngx_connection_t          *fc;
@@ -147,20 +149,15 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
     ngx_http_core_loc_conf_t  *clcf;
     ngx_http_core_srv_conf_t  *cscf;
     u_char                     addr[NGX_SOCKADDR_STRLEN];
+    u_char                     buf[NGX_INT_T_LEN];
 
-    static const u_char nginx[5] = "\x84\xaa\x63\x55\xe7";
+    static ngx_str_t  nginx = ngx_string("nginx");
+    static ngx_str_t  nginx_ver = ngx_string(NGINX_VER);
+    static ngx_str_t  nginx_ver_build = ngx_string(NGINX_VER_BUILD);
 #if (NGX_HTTP_GZIP)
-    static const u_char accept_encoding[12] =
-        "\x8b\x84\x84\x2d\x69\x5b\x05\x44\x3c\x86\xaa\x6f";
+    static ngx_str_t  accept_encoding = ngx_string("Accept-Encoding");
 #endif
 
-    static size_t nginx_ver_len = ngx_http_v2_literal_size(NGINX_VER);
-    static u_char nginx_ver[ngx_http_v2_literal_size(NGINX_VER)];
-
-    static size_t nginx_ver_build_len =
-                                  ngx_http_v2_literal_size(NGINX_VER_BUILD);
-    static u_char nginx_ver_build[ngx_http_v2_literal_size(NGINX_VER_BUILD)];
-
     stream = r->stream;
 
     if (!stream) {
@@ -253,31 +250,36 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
         }
     }
 
-    len = h2c->table_update ? 1 : 0;
+    len = h2c->table_update ? NGX_HTTP_V2_TABLE_UPDATE_SIZE : 0;
 
-    len += status ? 1 : 1 + ngx_http_v2_literal_size("418");
+    len += status ? 1
+                  : NGX_HTTP_V2_INT_OCTETS + ngx_http_v2_literal_size("418");
 
     clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
 
     if (r->headers_out.server == NULL) {
 
         if (clcf->server_tokens == NGX_HTTP_SERVER_TOKENS_ON) {
-            len += 1 + nginx_ver_len;
+            len += NGX_HTTP_V2_INT_OCTETS
+                   + ngx_http_v2_literal_size(NGINX_VER);
 
         } else if (clcf->server_tokens == NGX_HTTP_SERVER_TOKENS_BUILD) {
-            len += 1 + nginx_ver_build_len;
+            len += NGX_HTTP_V2_INT_OCTETS
+                   + ngx_http_v2_literal_size(NGINX_VER_BUILD);
 
         } else {
-            len += 1 + sizeof(nginx);
+            len += NGX_HTTP_V2_INT_OCTETS + ngx_http_v2_literal_size("nginx");
         }
     }
 
     if (r->headers_out.date == NULL) {
-        len += 1 + ngx_http_v2_literal_size("Wed, 31 Dec 1986 18:00:00 GMT");
+        len += NGX_HTTP_V2_INT_OCTETS
+               + ngx_http_v2_literal_size("Wed, 31 Dec 1986 18:00:00 GMT");
     }
 
     if (r->headers_out.content_type.len) {
-        len += 1 + NGX_HTTP_V2_INT_OCTETS + r->headers_out.content_type.len;
+        len += NGX_HTTP_V2_INT_OCTETS + NGX_HTTP_V2_INT_OCTETS
+               + r->headers_out.content_type.len;
 
         if (r->headers_out.content_type_len == r->headers_out.content_type.len
             && r->headers_out.charset.len)
@@ -289,13 +291,15 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
     if (r->headers_out.content_length == NULL
         && r->headers_out.content_length_n >= 0)
     {
-        len += 1 + ngx_http_v2_integer_octets(NGX_OFF_T_LEN) + NGX_OFF_T_LEN;
+        len += NGX_HTTP_V2_INT_OCTETS
+               + ngx_http_v2_integer_octets(NGX_OFF_T_LEN) + NGX_OFF_T_LEN;
     }
 
     if (r->headers_out.last_modified == NULL
         && r->headers_out.last_modified_time != -1)
     {
-        len += 1 + ngx_http_v2_literal_size("Wed, 31 Dec 1986 18:00:00 GMT");
+        len += NGX_HTTP_V2_INT_OCTETS
+               + ngx_http_v2_literal_size("Wed, 31 Dec 1986 18:00:00 GMT");
     }
 
     if (r->headers_out.location && r->headers_out.location->value.len) {
@@ -373,7 +377,8 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
 
         r->headers_out.location->hash = 0;
 
-        len += 1 + NGX_HTTP_V2_INT_OCTETS + r->headers_out.location->value.len;
+        len += NGX_HTTP_V2_INT_OCTETS + NGX_HTTP_V2_INT_OCTETS
+               + r->headers_out.location->value.len;
     }
 
     tmp_len = len;
@@ -381,7 +386,8 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
 #if (NGX_HTTP_GZIP)
     if (r->gzip_vary) {
         if (clcf->gzip_vary) {
-            len += 1 + sizeof(accept_encoding);
+            len += NGX_HTTP_V2_INT_OCTETS
+                   + ngx_http_v2_literal_size("Accept-Encoding");
 
         } else {
             r->gzip_vary = 0;
@@ -444,10 +450,7 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
     start = pos;
 
     if (h2c->table_update) {
-        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, fc->log, 0,
-                       "http2 table size update: 0");
-        *pos++ = (1 << 5) | 0;
-        h2c->table_update = 0;
+        pos = ngx_http_v2_write_table_update(h2c, pos);
     }
 
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, fc->log, 0,
@@ -458,9 +461,12 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
         *pos++ = status;
 
     } else {
-        *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_STATUS_INDEX);
-        *pos++ = NGX_HTTP_V2_ENCODE_RAW | 3;
-        pos = ngx_sprintf(pos, "%03ui", r->headers_out.status);
+        value.data = buf;
+        value.len = ngx_sprintf(buf, "%03ui", r->headers_out.status) - buf;
+
+        pos = ngx_http_v2_write_header(h2c, pos, NGX_HTTP_V2_STATUS_INDEX,
+                                       NULL, &value, tmp,
+                                       NGX_HTTP_V2_INDEXING);
     }
 
     if (r->headers_out.server == NULL) {
@@ -480,30 +486,19 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
                            "http2 output header: \"server: nginx\"");
         }
 
-        *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_SERVER_INDEX);
-
         if (clcf->server_tokens == NGX_HTTP_SERVER_TOKENS_ON) {
-            if (nginx_ver[0] == '\0') {
-                p = ngx_http_v2_write_value(nginx_ver, (u_char *) NGINX_VER,
-                                            sizeof(NGINX_VER) - 1, tmp);
-                nginx_ver_len = p - nginx_ver;
-            }
-
-            pos = ngx_cpymem(pos, nginx_ver, nginx_ver_len);
+            value = nginx_ver;
 
         } else if (clcf->server_tokens == NGX_HTTP_SERVER_TOKENS_BUILD) {
-            if (nginx_ver_build[0] == '\0') {
-                p = ngx_http_v2_write_value(nginx_ver_build,
-                                            (u_char *) NGINX_VER_BUILD,
-                                            sizeof(NGINX_VER_BUILD) - 1, tmp);
-                nginx_ver_build_len = p - nginx_ver_build;
-            }
-
-            pos = ngx_cpymem(pos, nginx_ver_build, nginx_ver_build_len);
+            value = nginx_ver_build;
 
         } else {
-            pos = ngx_cpymem(pos, nginx, sizeof(nginx));
+            value = nginx;
         }
+
+        pos = ngx_http_v2_write_header(h2c, pos, NGX_HTTP_V2_SERVER_INDEX,
+                                       NULL, &value, tmp,
+                                       NGX_HTTP_V2_INDEXING);
     }
 
     if (r->headers_out.date == NULL) {
@@ -511,13 +506,15 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
                        "http2 output header: \"date: %V\"",
                        &ngx_cached_http_time);
 
-        *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_DATE_INDEX);
-        pos = ngx_http_v2_write_value(pos, ngx_cached_http_time.data,
-                                      ngx_cached_http_time.len, tmp);
+        /* the date is the same for all responses within a second */
+
+        value = ngx_cached_http_time;
+
+        pos = ngx_http_v2_write_header(h2c, pos, NGX_HTTP_V2_DATE_INDEX, NULL,
+                                       &value, tmp, NGX_HTTP_V2_INDEXING);
     }
 
     if (r->headers_out.content_type.len) {
-        *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_CONTENT_TYPE_INDEX);
 
         if (r->headers_out.content_type_len == r->headers_out.content_type.len
             && r->headers_out.charset.len)
@@ -548,10 +545,13 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
                        "http2 output header: \"content-type: %V\"",
                        &r->headers_out.content_type);
 
-        pos = ngx_http_v2_write_value(pos, r->headers_out.content_type.data,
-                                      r->headers_out.content_type.len, tmp);
+        pos = ngx_http_v2_write_header(h2c, pos, NGX_HTTP_V2_CONTENT_TYPE_INDEX,
+                                       NULL, &r->headers_out.content_type, tmp,
+                                       NGX_HTTP_V2_INDEXING);
     }
 
+    /* values unique to a response are not indexed */
+
     if (r->headers_out.content_length == NULL
         && r->headers_out.content_length_n >= 0)
     {
@@ -559,7 +559,9 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
                        "http2 output header: \"content-length: %O\"",
                        r->headers_out.content_length_n);
 
-        *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_CONTENT_LENGTH_INDEX);
+        *pos = 0;
+        pos = ngx_http_v2_write_int(pos, ngx_http_v2_prefix(4),
+                                    NGX_HTTP_V2_CONTENT_LENGTH_INDEX);
 
         p = pos;
         pos = ngx_sprintf(pos + 1, "%O", r->headers_out.content_length_n);
@@ -569,7 +571,9 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
     if (r->headers_out.last_modified == NULL
         && r->headers_out.last_modified_time != -1)
     {
-        *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_LAST_MODIFIED_INDEX);
+        *pos = 0;
+        pos = ngx_http_v2_write_int(pos, ngx_http_v2_prefix(4),
+                                    NGX_HTTP_V2_LAST_MODIFIED_INDEX);
 
         ngx_http_time(pos, r->headers_out.last_modified_time);
         len = sizeof("Wed, 31 Dec 1986 18:00:00 GMT") - 1;
@@ -590,9 +594,9 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
                        "http2 output header: \"location: %V\"",
                        &r->headers_out.location->value);
 
-        *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_LOCATION_INDEX);
-        pos = ngx_http_v2_write_value(pos, r->headers_out.location->value.data,
-                                      r->headers_out.location->value.len, tmp);
+        pos = ngx_http_v2_write_header(h2c, pos, NGX_HTTP_V2_LOCATION_INDEX,
+                                       NULL, &r->headers_out.location->value,
+                                       tmp, NGX_HTTP_V2_WITHOUT_INDEXING);
     }
 
 #if (NGX_HTTP_GZIP)
@@ -600,8 +604,9 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
         ngx_log_debug0(NGX_LOG_DEBUG_HTTP, fc->log, 0,
                        "http2 output header: \"vary: Accept-Encoding\"");
 
-        *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_VARY_INDEX);
-        pos = ngx_cpymem(pos, accept_encoding, sizeof(accept_encoding));
+        pos = ngx_http_v2_write_header(h2c, pos, NGX_HTTP_V2_VARY_INDEX, NULL,
+                                       &accept_encoding, tmp,
+                                       NGX_HTTP_V2_INDEXING);
     }
 #endif
 
@@ -634,13 +639,10 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
         }
 #endif
 
-        *pos++ = 0;
+        indexing = ngx_http_v2_header_indexing(&header[i].key, &index);
 
-        pos = ngx_http_v2_write_name(pos, header[i].key.data,
-                                     header[i].key.len, tmp);
-
-        pos = ngx_http_v2_write_value(pos, header[i].value.data,
-                                      header[i].value.len, tmp);
+        pos = ngx_http_v2_write_header(h2c, pos, index, &header[i].key,
+                                       &header[i].value, tmp, indexing);
     }
 
     fin = r->header_only
@@ -670,6 +672,77 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
 }
 
 
+static ngx_uint_t
+ngx_http_v2_header_indexing(ngx_str_t *name, ngx_uint_t *index)
+{
+    /*
+     * fields which are usually unique to a response are not indexed,
+     * cookies are never indexed as they may be guessed by compression
+     */
+
+    *index = 0;
+
+    switch (name->len) {
+
+    case 3:
+        if (ngx_strncasecmp(name->data, (u_char *) "age", 3) == 0) {
+            *index = NGX_HTTP_V2_AGE_INDEX;
+            return NGX_HTTP_V2_WITHOUT_INDEXING;
+        }
+
+        break;
+
+    case 4:
+        if (ngx_strncasecmp(name->data, (u_char *) "etag", 4) == 0) {
+            *index = NGX_HTTP_V2_ETAG_INDEX;
+            return NGX_HTTP_V2_WITHOUT_INDEXING;
+        }
+
+        break;
+
+    case 8:
+        if (ngx_strncasecmp(name->data, (u_char *) "location", 8) == 0) {
+            *index = NGX_HTTP_V2_LOCATION_INDEX;
+            return NGX_HTTP_V2_WITHOUT_INDEXING;
+        }
+
+        break;
+
+    case 10:
+        if (ngx_strncasecmp(name->data, (u_char *) "set-cookie", 10) == 0) {
+            *index = NGX_HTTP_V2_SET_COOKIE_INDEX;
+            return NGX_HTTP_V2_NEVER_INDEXED;
+        }
+
+        break;
+
+    case 13:
+        if (ngx_strncasecmp(name->data, (u_char *) "last-modified", 13) == 0) {
+            *index = NGX_HTTP_V2_LAST_MODIFIED_INDEX;
+            return NGX_HTTP_V2_WITHOUT_INDEXING;
+        }
+
+        if (ngx_strncasecmp(name->data, (u_char *) "content-range", 13) == 0) {
+            *index = NGX_HTTP_V2_CONTENT_RANGE_INDEX;
+            return NGX_HTTP_V2_WITHOUT_INDEXING;
+        }
+
+        break;
+
+    case 14:
+        if (ngx_strncasecmp(name->data, (u_char *) "content-length", 14) == 0)
+        {
+            *index = NGX_HTTP_V2_CONTENT_LENGTH_INDEX;
+            return NGX_HTTP_V2_WITHOUT_INDEXING;
+        }
+
+        break;
+    }
+
+    return NGX_HTTP_V2_INDEXING;
+}
+
+
 static ngx_int_t
 ngx_http_v2_push_resources(ngx_http_request_t *r)
 {
@@ -975,7 +1048,7 @@ ngx_http_v2_push_resource(ngx_http_request_t *r, ngx_str_t *path,
 
             value = &(*h)->value;
 
-            len = 1 + NGX_HTTP_V2_INT_OCTETS + value->len;
+            len = NGX_HTTP_V2_INT_OCTETS + NGX_HTTP_V2_INT_OCTETS + value->len;
 
             pos = ngx_pnalloc(r->pool, len);
             if (pos == NULL) {
@@ -984,17 +1057,21 @@ ngx_http_v2_push_resource(ngx_http_request_t *r, ngx_str_t *path,
 
             binary[i].data = pos;
 
-            *pos++ = ngx_http_v2_inc_indexed(ph[i].index);
+            /* reused for all pushes, hence not indexed */
+
+            *pos = 0;
+            pos = ngx_http_v2_write_int(pos, ngx_http_v2_prefix(4),
+                                        ph[i].index);
             pos = ngx_http_v2_write_value(pos, value->data, value->len, tmp);
 
             binary[i].len = pos - binary[i].data;
         }
     }
 
-    len = (h2c->table_update ? 1 : 0)
+    len = (h2c->table_update ? NGX_HTTP_V2_TABLE_UPDATE_SIZE : 0)
           + 1
-          + 1 + NGX_HTTP_V2_INT_OCTETS + path->len
-          + 1 + NGX_HTTP_V2_INT_OCTETS + r->schema.len;
+          + NGX_HTTP_V2_INT_OCTETS + NGX_HTTP_V2_INT_OCTETS + path->len
+          + NGX_HTTP_V2_INT_OCTETS + NGX_HTTP_V2_INT_OCTETS + r->schema.len;
 
     for (i = 0; i < NGX_HTTP_V2_PUSH_HEADERS; i++) {
         len += binary[i].len;
@@ -1008,10 +1085,7 @@ ngx_http_v2_push_resource(ngx_http_request_t *r, ngx_str_t *path,
     start = pos;
 
     if (h2c->table_update) {
-        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, fc->log, 0,
-                       "http2 table size update: 0");
-        *pos++ = (1 << 5) | 0;
-        h2c->table_update = 0;
+        pos = ngx_http_v2_write_table_update(h2c, pos);
     }
 
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, fc->log, 0,
@@ -1022,8 +1096,8 @@ ngx_http_v2_push_resource(ngx_http_request_t *r, ngx_str_t *path,
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, fc->log, 0,
                    "http2 push header: \":path: %V\"", path);
 
-    *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_PATH_INDEX);
-    pos = ngx_http_v2_write_value(pos, path->data, path->len, tmp);
+    pos = ngx_http_v2_write_header(h2c, pos, NGX_HTTP_V2_PATH_INDEX, NULL,
+                                   path, tmp, NGX_HTTP_V2_INDEXING);
 
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, fc->log, 0,
                    "http2 push header: \":scheme: %V\"", &r->schema);
@@ -1037,8 +1111,9 @@ ngx_http_v2_push_resource(ngx_http_request_t *r, ngx_str_t *path,
         *pos++ = ngx_http_v2_indexed(NGX_HTTP_V2_SCHEME_HTTP_INDEX);
 
     } else {
-        *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_SCHEME_HTTP_INDEX);
-        pos = ngx_http_v2_write_value(pos, r->schema.data, r->schema.len, tmp);
+        pos = ngx_http_v2_write_header(h2c, pos, NGX_HTTP_V2_SCHEME_HTTP_INDEX,
+                                       NULL, &r->schema, tmp,
+                                       NGX_HTTP_V2_INDEXING);
     }
 
     for (i = 0; i < NGX_HTTP_V2_PUSH_HEADERS; i++) {
@@ -1099,6 +1174,7 @@ ngx_http_v2_create_headers_frame(ngx_http_request_t *r, u_char *pos,
     frame->length = rest;
     frame->blocked = 1;
     frame->fin = fin;
+    frame->dequeued = 0;
 
     ll = &frame->first;
 
@@ -1205,6 +1281,7 @@ ngx_http_v2_create_push_frame(ngx_http_request_t *r, u_char *pos, u_char *end)
     frame->length = rest;
     frame->blocked = 1;
     frame->fin = 0;
+    frame->dequeued = 0;
 
     ll = &frame->first;
 
@@ -1748,6 +1825,7 @@ ngx_http_v2_filter_get_data_frame(ngx_http_v2_stream_t *stream,
     frame->length = len;
     frame->blocked = 0;
     frame->fin = last->buf->last_buf;
+    frame->dequeued = 0;
 
     return frame;
 }
@@ -2110,13 +2188,13 @@ ngx_http_v2_filter_cleanup(void *data)
         ngx_queue_remove(&stream->queue);
     }
 
-    if (stream->queued == 0) {
+    if (stream->queued == 0 || stream->out == NULL) {
         return;
     }
 
     window = 0;
     h2c = stream->connection;
-    fn = &h2c->last_out;
+    fn = &stream->out;
 
     for ( ;; ) {
         frame = *fn;
@@ -2125,14 +2203,11 @@ ngx_http_v2_filter_cleanup(void *data)
             break;
         }
 
-        if (frame->stream == stream && !frame->blocked) {
+        if (!frame->blocked) {
             *fn = frame->next;
 
             window += frame->length;
-
-            if (--stream->queued == 0) {
-                break;
-            }
+            stream->queued--;
 
             continue;
         }
@@ -2140,6 +2215,12 @@ ngx_http_v2_filter_cleanup(void *data)
         fn = &frame->next;
     }
 
+    stream->out_last = fn;
+
+    if (stream->out == NULL) {
+        ngx_http_v2_unschedule_stream(h2c, stream);
+    }
+
     if (h2c->send_window == 0 && window) {
 
         while (!ngx_queue_empty(&h2c->waiting)) {
@@ -18,6 +18,25 @@ typedef struct {
 } ngx_http_v2_huff_decode_code_t;
 
 
+/*
+ * a whole octet emits up to two symbols, as the shortest code is 5 bits;
+ * "flags" holds the number of symbols and the NGX_HTTP_V2_HUFF_* bits
+ */
+
+typedef struct {
+    u_char  next;
+    u_char  flags;
+    u_char  sym[2];
+} ngx_http_v2_huff_decode_byte_t;
+
+
+#define NGX_HTTP_V2_HUFF_EMIT    0x03
+#define NGX_HTTP_V2_HUFF_ENDING  0x04
+#define NGX_HTTP_V2_HUFF_ERROR   0x08
+
+
+static ngx_int_t ngx_http_v2_huff_decode_nibbles(u_char *state, u_char *src,
+    size_t len, u_char **dst, ngx_uint_t last, ngx_log_t *log);
 static ngx_inline ngx_int_t ngx_http_v2_huff_decode_bits(u_char *state,
     u_char *ending, ngx_uint_t bits, u_char **dst);
 
@@ -2639,9 +2658,140 @@ static ngx_http_v2_huff_decode_code_t  ngx_http_v2_huff_decode_codes[256][16] =
 };
 
 
+/*
+ * the octet table is built from the nibble table on startup,
+ * ngx_http_v2_huff_decode_codes[] remains the reference
+ */
+
+static ngx_http_v2_huff_decode_byte_t  ngx_http_v2_huff_decode_bytes[256][256];
+static ngx_uint_t                      ngx_http_v2_huff_decode_ready;
+
+
+void
+ngx_http_v2_huff_decode_init(void)
+{
+    ngx_uint_t                       state, next, octet, n;
+    ngx_http_v2_huff_decode_code_t   code;
+    ngx_http_v2_huff_decode_byte_t  *entry;
+
+    if (ngx_http_v2_huff_decode_ready) {
+        return;
+    }
+
+    for (state = 0; state < 256; state++) {
+        for (octet = 0; octet < 256; octet++) {
+
+            entry = &ngx_http_v2_huff_decode_bytes[state][octet];
+            n = 0;
+
+            code = ngx_http_v2_huff_decode_codes[state][octet >> 4];
+
+            if (code.next == state) {
+                entry->flags = NGX_HTTP_V2_HUFF_ERROR;
+                continue;
+            }
+
+            if (code.emit) {
+                entry->sym[n++] = code.sym;
+            }
+
+            next = code.next;
+            code = ngx_http_v2_huff_decode_codes[next][octet & 0xf];
+
+            if (code.next == next) {
+                entry->flags = NGX_HTTP_V2_HUFF_ERROR;
+                continue;
+            }
+
+            if (code.emit) {
+                entry->sym[n++] = code.sym;
+            }
+
+            entry->next = code.next;
+            entry->flags = n | (code.ending ? NGX_HTTP_V2_HUFF_ENDING : 0);
+        }
+    }
+
+    ngx_http_v2_huff_decode_ready = 1;
+}
+
+
 ngx_int_t
 ngx_http_v2_huff_decode(u_char *state, u_char *src, size_t len, u_char **dst,
     ngx_uint_t last, ngx_log_t *log)
+{
+    u_char                          *end, *p, st, ending;
+    ngx_http_v2_huff_decode_byte_t  *code;
+
+    if (!ngx_http_v2_huff_decode_ready) {
+        return ngx_http_v2_huff_decode_nibbles(state, src, len, dst, last, log);
+    }
+
+    /* state and output are kept in locals, as they may alias */
+
+    st = *state;
+    p = *dst;
+
+    ending = 1;
+    end = src + len;
+
+    while (src != end) {
+        code = &ngx_http_v2_huff_decode_bytes[st][*src];
+
+        if (code->flags & NGX_HTTP_V2_HUFF_ERROR) {
+            *state = st;
+            *dst = p;
+
+            ngx_log_debug2(NGX_LOG_DEBUG_HTTP, log, 0,
+                           "http2 huffman decoding error at state %d: "
+                           "bad code 0x%Xd", st, *src);
+
+            return NGX_ERROR;
+        }
+
+        switch (code->flags & NGX_HTTP_V2_HUFF_EMIT) {
+
+        case 2:
+            p[0] = code->sym[0];
+            p[1] = code->sym[1];
+            p += 2;
+            break;
+
+        case 1:
+            *p++ = code->sym[0];
+            break;
+        }
+
+        ending = code->flags & NGX_HTTP_V2_HUFF_ENDING;
+        st = code->next;
+        src++;
+    }
+
+    *dst = p;
+
+    if (last) {
+        if (!ending) {
+            *state = st;
+
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0,
+                           "http2 huffman decoding error: "
+                           "incomplete code 0x%Xd", src[-1]);
+
+            return NGX_ERROR;
+        }
+
+        st = 0;
+    }
+
+    *state = st;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_v2_huff_decode_nibbles(u_char *state, u_char *src, size_t len,
+    u_char **dst, ngx_uint_t last, ngx_log_t *log)
 {
     u_char  *end, ch, ending;
 
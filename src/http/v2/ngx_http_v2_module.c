@@ -273,6 +273,8 @@ ngx_http_v2_variable(ngx_http_request_t *r,
 static ngx_int_t
 ngx_http_v2_module_init(ngx_cycle_t *cycle)
 {
+    ngx_http_v2_huff_decode_init();
+
     return NGX_OK;
 }
 
@@ -10,11 +10,15 @@
 #include <ngx_http.h>
 
 
-#define NGX_HTTP_V2_TABLE_SIZE  4096
+#define NGX_HTTP_V2_TABLE_ENTRIES  (NGX_HTTP_V2_TABLE_SIZE / 32)
 
 
 static ngx_int_t ngx_http_v2_table_account(ngx_http_v2_connection_t *h2c,
     size_t size);
+static ngx_int_t ngx_http_v2_table_insert(ngx_http_v2_connection_t *h2c,
+    ngx_str_t *name, ngx_str_t *value, ngx_uint_t hash);
+static ngx_int_t ngx_http_v2_table_cmp(ngx_http_v2_hpack_enc_t *enc,
+    size_t offset, u_char *data, size_t len, ngx_uint_t lower);
 
 
 static ngx_http_v2_header_t  ngx_http_v2_static_table[] = {
@@ -361,3 +365,267 @@ ngx_http_v2_table_size(ngx_http_v2_connection_t *h2c, size_t size)
 
     return NGX_OK;
 }
+
+
+void
+ngx_http_v2_encoder_table_size(ngx_http_v2_connection_t *h2c, size_t size)
+{
+    ngx_http_v2_hpack_enc_t    *enc;
+    ngx_http_v2_hpack_entry_t  *entry;
+
+    enc = &h2c->hpack_enc;
+
+    /* the encoder never uses more than NGX_HTTP_V2_TABLE_SIZE */
+
+    size = ngx_min(size, NGX_HTTP_V2_TABLE_SIZE);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, h2c->connection->log, 0,
+                   "http2 encoder table size: %uz was:%uz", size, enc->size);
+
+    if (size == enc->size) {
+        return;
+    }
+
+    while (enc->size - enc->free > size) {
+        entry = &enc->entries[enc->deleted++ % NGX_HTTP_V2_TABLE_ENTRIES];
+        enc->free += 32 + entry->name_len + entry->value_len;
+    }
+
+    enc->free = size - (enc->size - enc->free);
+    enc->size = size;
+
+    if (size < enc->update) {
+        enc->update = size;
+    }
+
+    h2c->table_update = 1;
+}
+
+
+u_char *
+ngx_http_v2_write_table_update(ngx_http_v2_connection_t *h2c, u_char *pos)
+{
+    ngx_http_v2_hpack_enc_t  *enc;
+
+    enc = &h2c->hpack_enc;
+
+    /*
+     * if the table was shrunk below its final size,
+     * the decoder must see the smallest size first
+     */
+
+    if (enc->update < enc->size) {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, h2c->connection->log, 0,
+                       "http2 table size update: %uz", enc->update);
+
+        *pos = 0x20;
+        pos = ngx_http_v2_write_int(pos, ngx_http_v2_prefix(5), enc->update);
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, h2c->connection->log, 0,
+                   "http2 table size update: %uz", enc->size);
+
+    *pos = 0x20;
+    pos = ngx_http_v2_write_int(pos, ngx_http_v2_prefix(5), enc->size);
+
+    enc->update = enc->size;
+    h2c->table_update = 0;
+
+    return pos;
+}
+
+
+u_char *
+ngx_http_v2_write_header(ngx_http_v2_connection_t *h2c, u_char *pos,
+    ngx_uint_t index, ngx_str_t *name, ngx_str_t *value, u_char *tmp,
+    ngx_uint_t indexing)
+{
+    size_t                      i;
+    ngx_uint_t                  hash, n;
+    ngx_http_v2_hpack_enc_t    *enc;
+    ngx_http_v2_hpack_entry_t  *entry;
+
+    enc = &h2c->hpack_enc;
+
+    if (index) {
+        name = &ngx_http_v2_static_table[index - 1].name;
+    }
+
+    /*
+     * large fields are not indexed to avoid
+     * evicting the whole table in favour of them
+     */
+
+    if (indexing != NGX_HTTP_V2_INDEXING
+        || 32 + name->len + value->len > enc->size * 3 / 4)
+    {
+        goto literal;
+    }
+
+    hash = 0;
+
+    for (i = 0; i < name->len; i++) {
+        hash = ngx_hash(hash, ngx_tolower(name->data[i]));
+    }
+
+    for (i = 0; i < value->len; i++) {
+        hash = ngx_hash(hash, value->data[i]);
+    }
+
+    for (n = enc->added; n != enc->deleted; n--) {
+        entry = &enc->entries[(n - 1) % NGX_HTTP_V2_TABLE_ENTRIES];
+
+        if (entry->hash != hash
+            || entry->name_len != name->len
+            || entry->value_len != value->len)
+        {
+            continue;
+        }
+
+        if (ngx_http_v2_table_cmp(enc, entry->offset, name->data, name->len, 1)
+            != NGX_OK
+            || ngx_http_v2_table_cmp(enc, entry->offset + name->len,
+                                     value->data, value->len, 0)
+               != NGX_OK)
+        {
+            continue;
+        }
+
+        ngx_log_debug3(NGX_LOG_DEBUG_HTTP, h2c->connection->log, 0,
+                       "http2 table hit: \"%V: %V\" index:%ui",
+                       name, value,
+                       NGX_HTTP_V2_STATIC_TABLE_ENTRIES + enc->added - n + 1);
+
+        *pos = 0x80;
+
+        return ngx_http_v2_write_int(pos, ngx_http_v2_prefix(7),
+                                     NGX_HTTP_V2_STATIC_TABLE_ENTRIES
+                                     + enc->added - n + 1);
+    }
+
+    if (ngx_http_v2_table_insert(h2c, name, value, hash) != NGX_OK) {
+        goto literal;
+    }
+
+    *pos = 0x40;
+    pos = ngx_http_v2_write_int(pos, ngx_http_v2_prefix(6), index);
+
+    goto string;
+
+literal:
+
+    *pos = (indexing == NGX_HTTP_V2_NEVER_INDEXED) ? 0x10 : 0;
+    pos = ngx_http_v2_write_int(pos, ngx_http_v2_prefix(4), index);
+
+string:
+
+    if (index == 0) {
+        pos = ngx_http_v2_write_name(pos, name->data, name->len, tmp);
+    }
+
+    return ngx_http_v2_write_value(pos, value->data, value->len, tmp);
+}
+
+
+static ngx_int_t
+ngx_http_v2_table_insert(ngx_http_v2_connection_t *h2c, ngx_str_t *name,
+    ngx_str_t *value, ngx_uint_t hash)
+{
+    size_t                      i, size;
+    ngx_http_v2_hpack_enc_t    *enc;
+    ngx_http_v2_hpack_entry_t  *entry;
+
+    enc = &h2c->hpack_enc;
+
+    if (enc->entries == NULL) {
+        enc->entries = ngx_palloc(h2c->connection->pool,
+                                  sizeof(ngx_http_v2_hpack_entry_t)
+                                  * NGX_HTTP_V2_TABLE_ENTRIES);
+        if (enc->entries == NULL) {
+            return NGX_ERROR;
+        }
+
+        enc->storage = ngx_palloc(h2c->connection->pool,
+                                  NGX_HTTP_V2_TABLE_SIZE);
+        if (enc->storage == NULL) {
+            enc->entries = NULL;
+            return NGX_ERROR;
+        }
+    }
+
+    size = 32 + name->len + value->len;
+
+    while (size > enc->free) {
+        entry = &enc->entries[enc->deleted++ % NGX_HTTP_V2_TABLE_ENTRIES];
+        enc->free += 32 + entry->name_len + entry->value_len;
+    }
+
+    enc->free -= size;
+
+    /*
+     * each entry accounts for at least 32 octets more than it stores,
+     * so the storage ring never overruns the oldest entry
+     */
+
+    entry = &enc->entries[enc->added++ % NGX_HTTP_V2_TABLE_ENTRIES];
+
+    entry->hash = hash;
+    entry->offset = (u_short) enc->pos;
+    entry->name_len = (u_short) name->len;
+    entry->value_len = (u_short) value->len;
+
+    for (i = 0; i < name->len; i++) {
+        enc->storage[enc->pos] = ngx_tolower(name->data[i]);
+        enc->pos = (enc->pos + 1) % NGX_HTTP_V2_TABLE_SIZE;
+    }
+
+    for (i = 0; i < value->len; i++) {
+        enc->storage[enc->pos] = value->data[i];
+        enc->pos = (enc->pos + 1) % NGX_HTTP_V2_TABLE_SIZE;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, h2c->connection->log, 0,
+                   "http2 table insert: \"%V: %V\"", name, value);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_v2_table_cmp(ngx_http_v2_hpack_enc_t *enc, size_t offset,
+    u_char *data, size_t len, ngx_uint_t lower)
+{
+    size_t   n;
+    u_char  *p;
+
+    offset %= NGX_HTTP_V2_TABLE_SIZE;
+
+    while (len) {
+        p = enc->storage + offset;
+        n = ngx_min(len, NGX_HTTP_V2_TABLE_SIZE - offset);
+
+        if (lower) {
+            while (n) {
+                if (*p++ != ngx_tolower(*data)) {
+                    return NGX_DECLINED;
+                }
+
+                data++;
+                n--;
+                len--;
+            }
+
+        } else {
+            if (ngx_memcmp(p, data, n) != 0) {
+                return NGX_DECLINED;
+            }
+
+            data += n;
+            len -= n;
+        }
+
+        offset = 0;
+    }
+
+    return NGX_OK;
+}
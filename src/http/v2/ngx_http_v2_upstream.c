@@ -0,0 +1,3107 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+/*
+ * Multiplexed HTTP/2 connections to upstream servers ("proxy_http_version 2").
+ *
+ * Connections are kept per worker in a tree keyed by the peer address,
+ * the local address and, for TLS, the SSL context and the server name;
+ * they are shared by all requests to the same peer, up to the peer's
+ * SETTINGS_MAX_CONCURRENT_STREAMS.  Each request gets a stream with a
+ * fake connection which carries the frames of this stream only: HEADERS,
+ * CONTINUATION and DATA frames written to it by the proxy module are sent
+ * with a stream identifier assigned and split according to the peer's
+ * settings and flow control windows, and the frames received are passed
+ * to the proxy module with padding and priority removed and a header
+ * block coalesced into a single HEADERS frame.
+ */
+
+
+#define NGX_HTTP_V2_UPSTREAM_STREAMS        100
+#define NGX_HTTP_V2_UPSTREAM_WINDOW         (256 * 1024)
+#define NGX_HTTP_V2_UPSTREAM_IDLE_TIMEOUT   60000
+
+#define NGX_HTTP_V2_UPSTREAM_IN_SIZE                                          \
+    (4 * (NGX_HTTP_V2_DEFAULT_FRAME_SIZE + NGX_HTTP_V2_FRAME_HEADER_SIZE))
+#define NGX_HTTP_V2_UPSTREAM_OUT_SIZE       65536
+#define NGX_HTTP_V2_UPSTREAM_RESERVE        4096
+
+#define NGX_HTTP_V2_UPSTREAM_REQUEST_SIZE   32768
+#define NGX_HTTP_V2_UPSTREAM_RESPONSE_SIZE  65536
+#define NGX_HTTP_V2_UPSTREAM_BUFFER_SIZE    16384
+
+#define NGX_HTTP_V2_UPSTREAM_STATIC_SIZE    61
+
+#define NGX_HTTP_V2_MAX_SID                 0x7fffffff
+
+/* errors */
+#define NGX_HTTP_V2_NO_ERROR                0x0
+#define NGX_HTTP_V2_PROTOCOL_ERROR          0x1
+#define NGX_HTTP_V2_FLOW_CTRL_ERROR         0x3
+#define NGX_HTTP_V2_CANCEL                  0x8
+
+/* frame sizes */
+#define NGX_HTTP_V2_RST_STREAM_SIZE         4
+#define NGX_HTTP_V2_PRIORITY_SIZE           5
+#define NGX_HTTP_V2_PING_SIZE               8
+#define NGX_HTTP_V2_GOAWAY_SIZE             8
+#define NGX_HTTP_V2_WINDOW_UPDATE_SIZE      4
+#define NGX_HTTP_V2_SETTINGS_PARAM_SIZE     6
+
+/* settings fields */
+#define NGX_HTTP_V2_MAX_STREAMS_SETTING     0x3
+#define NGX_HTTP_V2_INIT_WINDOW_SIZE_SETTING  0x4
+#define NGX_HTTP_V2_MAX_FRAME_SIZE_SETTING  0x5
+
+
+typedef struct {
+    ngx_str_node_t                      sn;
+    ngx_queue_t                         connections;
+} ngx_http_v2_upstream_peer_t;
+
+
+typedef struct {
+    ngx_queue_t                         queue;
+    ngx_queue_t                         streams;
+
+    ngx_http_v2_upstream_peer_t        *peer;
+
+    ngx_connection_t                   *connection;
+    ngx_pool_t                         *pool;
+    ngx_log_t                          *log;
+
+    ngx_str_t                           name;
+
+    ngx_uint_t                          processing;
+    ngx_uint_t                          next_sid;
+    ngx_uint_t                          cont_sid;
+
+    ngx_uint_t                          max_streams;
+    size_t                              frame_size;
+    size_t                              init_window;
+    ssize_t                             send_window;
+    size_t                              recv_window;
+
+    ngx_buf_t                           in;
+    ngx_buf_t                           out;
+
+#if (NGX_HTTP_SSL)
+    ngx_str_t                           ssl_name;
+    ngx_msec_t                          connect_timeout;
+#endif
+
+    unsigned                            connected:1;
+    unsigned                            goaway:1;
+    unsigned                            end_stream:1;
+#if (NGX_HTTP_SSL)
+    unsigned                            ssl_verify:1;
+#endif
+} ngx_http_v2_upstream_connection_t;
+
+
+typedef struct {
+    ngx_connection_t                    connection;
+    ngx_event_t                         read;
+    ngx_event_t                         write;
+
+    ngx_queue_t                         queue;
+    ngx_http_v2_upstream_connection_t  *conn;
+    ngx_pool_t                         *pool;
+
+    ngx_uint_t                          sid;
+    ssize_t                             send_window;
+    size_t                              recv_window;
+
+    /* the frame being written by the proxy module */
+    u_char                              frame[NGX_HTTP_V2_FRAME_HEADER_SIZE];
+    size_t                              frame_len;
+    ngx_uint_t                          type;
+    ngx_uint_t                          flags;
+    size_t                              rest;
+
+    ngx_buf_t                          *request;
+
+    ngx_buf_t                          *header;
+    ngx_chain_t                        *out;
+    ngx_chain_t                        *tail;
+    ngx_chain_t                        *free;
+    size_t                              buffered;
+
+    unsigned                            headers_pending:1;
+    unsigned                            end_stream:1;
+    unsigned                            blocked:1;
+    unsigned                            local_closed:1;
+    unsigned                            remote_closed:1;
+    unsigned                            closed:1;
+    unsigned                            error:1;
+} ngx_http_v2_upstream_stream_t;
+
+
+typedef struct {
+    ngx_http_v2_upstream_stream_t      *stream;
+    ngx_http_request_t                 *request;
+
+    void                               *data;
+
+    ngx_event_get_peer_pt               original_get_peer;
+    ngx_event_free_peer_pt              original_free_peer;
+} ngx_http_v2_upstream_peer_data_t;
+
+
+static ngx_int_t ngx_http_v2_upstream_get_peer(ngx_peer_connection_t *pc,
+    void *data);
+static void ngx_http_v2_upstream_free_peer(ngx_peer_connection_t *pc,
+    void *data, ngx_uint_t state);
+static ngx_int_t ngx_http_v2_upstream_peer_key(ngx_peer_connection_t *pc,
+    ngx_http_v2_upstream_peer_data_t *pd, ngx_str_t *key);
+static ngx_http_v2_upstream_peer_t *ngx_http_v2_upstream_add_peer(
+    ngx_str_t *key, uint32_t hash);
+static void ngx_http_v2_upstream_release_peer(
+    ngx_http_v2_upstream_peer_t *peer);
+
+static ngx_int_t ngx_http_v2_upstream_connect(ngx_peer_connection_t *pc,
+    ngx_http_v2_upstream_peer_data_t *pd, ngx_http_v2_upstream_peer_t *peer,
+    ngx_http_v2_upstream_connection_t **h2cp);
+#if (NGX_HTTP_SSL)
+static ngx_int_t ngx_http_v2_upstream_ssl_init_connection(
+    ngx_http_v2_upstream_connection_t *h2c, ngx_http_request_t *r);
+static void ngx_http_v2_upstream_ssl_handshake(
+    ngx_http_v2_upstream_connection_t *h2c);
+static void ngx_http_v2_upstream_ssl_handshake_handler(ngx_connection_t *c);
+#endif
+static u_char *ngx_http_v2_upstream_log_error(ngx_log_t *log, u_char *buf,
+    size_t len);
+static void ngx_http_v2_upstream_read_handler(ngx_event_t *rev);
+static void ngx_http_v2_upstream_write_handler(ngx_event_t *wev);
+static ngx_int_t ngx_http_v2_upstream_test_connect(
+    ngx_http_v2_upstream_connection_t *h2c);
+static void ngx_http_v2_upstream_connected(
+    ngx_http_v2_upstream_connection_t *h2c);
+static ngx_int_t ngx_http_v2_upstream_flush(
+    ngx_http_v2_upstream_connection_t *h2c);
+static void ngx_http_v2_upstream_post_flush(
+    ngx_http_v2_upstream_connection_t *h2c);
+static void ngx_http_v2_upstream_wake(ngx_http_v2_upstream_connection_t *h2c);
+static void ngx_http_v2_upstream_set_idle(
+    ngx_http_v2_upstream_connection_t *h2c);
+static void ngx_http_v2_upstream_close_connection(
+    ngx_http_v2_upstream_connection_t *h2c);
+
+static ngx_int_t ngx_http_v2_upstream_process(
+    ngx_http_v2_upstream_connection_t *h2c);
+static ngx_int_t ngx_http_v2_upstream_state_data(
+    ngx_http_v2_upstream_connection_t *h2c, ngx_uint_t sid, ngx_uint_t flags,
+    u_char *p, size_t len);
+static ngx_int_t ngx_http_v2_upstream_state_headers(
+    ngx_http_v2_upstream_connection_t *h2c, ngx_uint_t sid, ngx_uint_t flags,
+    u_char *p, size_t len);
+static ngx_int_t ngx_http_v2_upstream_state_header_block(
+    ngx_http_v2_upstream_connection_t *h2c, ngx_uint_t sid, ngx_uint_t flags,
+    u_char *p, size_t len);
+static ngx_int_t ngx_http_v2_upstream_state_rst_stream(
+    ngx_http_v2_upstream_connection_t *h2c, ngx_uint_t sid, u_char *p,
+    size_t len);
+static ngx_int_t ngx_http_v2_upstream_state_settings(
+    ngx_http_v2_upstream_connection_t *h2c, ngx_uint_t sid, ngx_uint_t flags,
+    u_char *p, size_t len);
+static ngx_int_t ngx_http_v2_upstream_state_ping(
+    ngx_http_v2_upstream_connection_t *h2c, ngx_uint_t flags, u_char *p,
+    size_t len);
+static ngx_int_t ngx_http_v2_upstream_state_goaway(
+    ngx_http_v2_upstream_connection_t *h2c, u_char *p, size_t len);
+static ngx_int_t ngx_http_v2_upstream_state_window_update(
+    ngx_http_v2_upstream_connection_t *h2c, ngx_uint_t sid, u_char *p,
+    size_t len);
+static ngx_int_t ngx_http_v2_upstream_deliver(
+    ngx_http_v2_upstream_stream_t *stream, ngx_uint_t type, ngx_uint_t flags,
+    u_char *p, size_t len);
+
+static ngx_int_t ngx_http_v2_upstream_parse_int(u_char **pos, u_char *end,
+    ngx_uint_t prefix, ngx_uint_t *value);
+static ngx_int_t ngx_http_v2_upstream_parse_string(ngx_http_request_t *r,
+    u_char **pos, u_char *end, ngx_str_t *str);
+
+static ngx_http_v2_upstream_stream_t *ngx_http_v2_upstream_create_stream(
+    ngx_http_v2_upstream_connection_t *h2c, ngx_log_t *log);
+static ngx_http_v2_upstream_stream_t *ngx_http_v2_upstream_find_stream(
+    ngx_http_v2_upstream_connection_t *h2c, ngx_uint_t sid);
+static void ngx_http_v2_upstream_close_stream(
+    ngx_http_v2_upstream_stream_t *stream);
+static void ngx_http_v2_upstream_reset_stream(
+    ngx_http_v2_upstream_stream_t *stream, ngx_uint_t status);
+static void ngx_http_v2_upstream_stream_error(
+    ngx_http_v2_upstream_stream_t *stream);
+static void ngx_http_v2_upstream_check_closed(
+    ngx_http_v2_upstream_stream_t *stream);
+static void ngx_http_v2_upstream_post(ngx_event_t *ev);
+
+static ssize_t ngx_http_v2_upstream_recv(ngx_connection_t *fc, u_char *buf,
+    size_t size);
+static ssize_t ngx_http_v2_upstream_recv_chain(ngx_connection_t *fc,
+    ngx_chain_t *cl, off_t limit);
+static ssize_t ngx_http_v2_upstream_send(ngx_connection_t *fc, u_char *buf,
+    size_t size);
+static ngx_chain_t *ngx_http_v2_upstream_send_chain(ngx_connection_t *fc,
+    ngx_chain_t *in, off_t limit);
+static ngx_int_t ngx_http_v2_upstream_write_frame(
+    ngx_http_v2_upstream_stream_t *stream, ngx_buf_t *b);
+static ngx_int_t ngx_http_v2_upstream_read_header_block(
+    ngx_http_v2_upstream_stream_t *stream, ngx_buf_t *b);
+static ngx_int_t ngx_http_v2_upstream_send_headers(
+    ngx_http_v2_upstream_stream_t *stream);
+static ngx_int_t ngx_http_v2_upstream_send_data(
+    ngx_http_v2_upstream_stream_t *stream, ngx_buf_t *b);
+static void ngx_http_v2_upstream_update_window(
+    ngx_http_v2_upstream_stream_t *stream);
+static ngx_int_t ngx_http_v2_upstream_append(
+    ngx_http_v2_upstream_stream_t *stream, u_char *data, size_t len);
+
+static size_t ngx_http_v2_upstream_space(
+    ngx_http_v2_upstream_connection_t *h2c, size_t size, ngx_uint_t control);
+static u_char *ngx_http_v2_upstream_get_frame(
+    ngx_http_v2_upstream_connection_t *h2c, size_t len, ngx_uint_t type,
+    ngx_uint_t flags, ngx_uint_t sid, ngx_uint_t control);
+static ngx_int_t ngx_http_v2_upstream_send_window_update(
+    ngx_http_v2_upstream_connection_t *h2c, ngx_uint_t sid, size_t window);
+
+
+static u_char  ngx_http_v2_upstream_preface[] =
+    "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"         /* connection preface */
+
+    "\x00\x00\x12\x04\x00\x00\x00\x00\x00"     /* settings frame */
+    "\x00\x01\x00\x00\x00\x00"                 /* header table size */
+    "\x00\x02\x00\x00\x00\x00"                 /* disable push */
+    "\x00\x04\x00\x04\x00\x00"                 /* initial window */
+
+    "\x00\x00\x04\x08\x00\x00\x00\x00\x00"     /* window update frame */
+    "\x7f\xff\x00\x00";
+
+
+static ngx_rbtree_t          ngx_http_v2_upstream_peers;
+static ngx_rbtree_node_t     ngx_http_v2_upstream_sentinel;
+
+
+ngx_int_t
+ngx_http_v2_upstream_init_peer(ngx_http_request_t *r, ngx_http_upstream_t *u)
+{
+    ngx_http_v2_upstream_peer_data_t  *pd;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "init http2 upstream peer");
+
+    pd = ngx_pcalloc(r->pool, sizeof(ngx_http_v2_upstream_peer_data_t));
+    if (pd == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (ngx_http_v2_upstream_peers.root == NULL) {
+        ngx_rbtree_init(&ngx_http_v2_upstream_peers,
+                        &ngx_http_v2_upstream_sentinel,
+                        ngx_str_rbtree_insert_value);
+    }
+
+#if (NGX_HTTP_SSL)
+
+    /* the server name is a part of the key to look up connections */
+
+    if (u->ssl && ngx_http_upstream_ssl_name(r, u, NULL) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+#endif
+
+    pd->request = r;
+    pd->data = u->peer.data;
+    pd->original_get_peer = u->peer.get;
+    pd->original_free_peer = u->peer.free;
+
+    u->peer.data = pd;
+    u->peer.get = ngx_http_v2_upstream_get_peer;
+    u->peer.free = ngx_http_v2_upstream_free_peer;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_v2_upstream_get_peer(ngx_peer_connection_t *pc, void *data)
+{
+    ngx_http_v2_upstream_peer_data_t  *pd = data;
+
+    uint32_t                            hash;
+    ngx_int_t                           rc;
+    ngx_str_t                           key;
+    ngx_queue_t                        *q;
+    ngx_str_node_t                     *sn;
+    ngx_http_v2_upstream_peer_t        *peer;
+    ngx_http_v2_upstream_stream_t      *stream;
+    ngx_http_v2_upstream_connection_t  *h2c;
+
+    /* ask balancer, it accounts the request against the peer */
+
+    rc = pd->original_get_peer(pc, pd->data);
+
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    if (ngx_http_v2_upstream_peer_key(pc, pd, &key) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    hash = ngx_crc32_long(key.data, key.len);
+
+    sn = ngx_str_rbtree_lookup(&ngx_http_v2_upstream_peers, &key, hash);
+
+    if (sn) {
+        peer = (ngx_http_v2_upstream_peer_t *) sn;
+
+        for (q = ngx_queue_head(&peer->connections);
+             q != ngx_queue_sentinel(&peer->connections);
+             q = ngx_queue_next(q))
+        {
+            h2c = ngx_queue_data(q, ngx_http_v2_upstream_connection_t, queue);
+
+            if (h2c->goaway
+                || h2c->processing >= h2c->max_streams
+                || h2c->next_sid + 2 * h2c->processing > NGX_HTTP_V2_MAX_SID)
+            {
+                continue;
+            }
+
+            ngx_log_debug2(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                           "http2 upstream: using connection %p, streams:%ui",
+                           h2c->connection, h2c->processing);
+
+            pc->cached = 1;
+
+            goto found;
+        }
+
+    } else {
+        peer = ngx_http_v2_upstream_add_peer(&key, hash);
+        if (peer == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    h2c = NULL;
+
+    rc = ngx_http_v2_upstream_connect(pc, pd, peer, &h2c);
+
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    pc->cached = 0;
+
+found:
+
+    stream = ngx_http_v2_upstream_create_stream(h2c, pc->log);
+    if (stream == NULL) {
+        return NGX_ERROR;
+    }
+
+    pd->stream = stream;
+    pc->connection = &stream->connection;
+
+    return NGX_DONE;
+}
+
+
+static void
+ngx_http_v2_upstream_free_peer(ngx_peer_connection_t *pc, void *data,
+    ngx_uint_t state)
+{
+    ngx_http_v2_upstream_peer_data_t  *pd = data;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "free http2 upstream peer");
+
+    if (pd->stream) {
+        if (pc->connection == &pd->stream->connection) {
+            pc->connection = NULL;
+        }
+
+        ngx_http_v2_upstream_close_stream(pd->stream);
+        pd->stream = NULL;
+    }
+
+    pd->original_free_peer(pc, pd->data, state);
+}
+
+
+static ngx_int_t
+ngx_http_v2_upstream_peer_key(ngx_peer_connection_t *pc,
+    ngx_http_v2_upstream_peer_data_t *pd, ngx_str_t *key)
+{
+    u_char               *p;
+    size_t                len;
+#if (NGX_HTTP_SSL)
+    ngx_http_upstream_t  *u;
+
+    u = pd->request->upstream;
+#endif
+
+    len = 1 + pc->socklen + 1;
+
+    if (pc->local) {
+        len += pc->local->socklen;
+    }
+
+#if (NGX_HTTP_SSL)
+    if (u->ssl) {
+        len += sizeof(ngx_ssl_t *) + 1 + u->ssl_name.len;
+    }
+#endif
+
+    p = ngx_pnalloc(pd->request->pool, len);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    key->data = p;
+    key->len = len;
+
+    *p++ = (u_char) pc->socklen;
+    p = ngx_cpymem(p, pc->sockaddr, pc->socklen);
+
+    if (pc->local) {
+        *p++ = (u_char) pc->local->socklen;
+        p = ngx_cpymem(p, pc->local->sockaddr, pc->local->socklen);
+
+    } else {
+        *p++ = 0;
+    }
+
+#if (NGX_HTTP_SSL)
+    if (u->ssl) {
+        p = ngx_cpymem(p, &u->conf->ssl, sizeof(ngx_ssl_t *));
+        *p++ = (u_char) ((u->conf->ssl_verify ? 1 : 0)
+                         | (u->conf->ssl_server_name ? 2 : 0));
+        ngx_memcpy(p, u->ssl_name.data, u->ssl_name.len);
+    }
+#endif
+
+    return NGX_OK;
+}
+
+
+static ngx_http_v2_upstream_peer_t *
+ngx_http_v2_upstream_add_peer(ngx_str_t *key, uint32_t hash)
+{
+    ngx_http_v2_upstream_peer_t  *peer;
+
+    peer = ngx_alloc(sizeof(ngx_http_v2_upstream_peer_t) + key->len,
+                     ngx_cycle->log);
+    if (peer == NULL) {
+        return NULL;
+    }
+
+    peer->sn.node.key = hash;
+    peer->sn.str.len = key->len;
+    peer->sn.str.data = (u_char *) peer + sizeof(ngx_http_v2_upstream_peer_t);
+
+    ngx_memcpy(peer->sn.str.data, key->data, key->len);
+
+    ngx_queue_init(&peer->connections);
+
+    ngx_rbtree_insert(&ngx_http_v2_upstream_peers, &peer->sn.node);
+
+    return peer;
+}
+
+
+static void
+ngx_http_v2_upstream_release_peer(ngx_http_v2_upstream_peer_t *peer)
+{
+    if (!ngx_queue_empty(&peer->connections)) {
+        return;
+    }
+
+    ngx_rbtree_delete(&ngx_http_v2_upstream_peers, &peer->sn.node);
+    ngx_free(peer);
+}
+
+
+static ngx_int_t
+ngx_http_v2_upstream_connect(ngx_peer_connection_t *pc,
+    ngx_http_v2_upstream_peer_data_t *pd, ngx_http_v2_upstream_peer_t *peer,
+    ngx_http_v2_upstream_connection_t **h2cp)
+{
+    ngx_int_t                           rc;
+    ngx_log_t                          *log;
+    ngx_pool_t                         *pool;
+    ngx_connection_t                   *c;
+    ngx_peer_connection_t               conn;
+    ngx_http_upstream_t                *u;
+    ngx_http_v2_upstream_connection_t  *h2c;
+
+    u = pd->request->upstream;
+
+    pool = ngx_create_pool(1024, ngx_cycle->log);
+    if (pool == NULL) {
+        goto failed;
+    }
+
+    h2c = ngx_pcalloc(pool, sizeof(ngx_http_v2_upstream_connection_t));
+    if (h2c == NULL) {
+        goto failed;
+    }
+
+    log = ngx_palloc(pool, sizeof(ngx_log_t));
+    if (log == NULL) {
+        goto failed;
+    }
+
+    *log = *ngx_cycle->log;
+    log->handler = ngx_http_v2_upstream_log_error;
+    log->data = h2c;
+    log->action = NULL;
+
+    pool->log = log;
+
+    h2c->name.data = ngx_pstrdup(pool, pc->name);
+    if (h2c->name.data == NULL) {
+        goto failed;
+    }
+
+    h2c->name.len = pc->name->len;
+
+    h2c->in.start = ngx_palloc(pool, NGX_HTTP_V2_UPSTREAM_IN_SIZE);
+    if (h2c->in.start == NULL) {
+        goto failed;
+    }
+
+    h2c->in.pos = h2c->in.start;
+    h2c->in.last = h2c->in.start;
+    h2c->in.end = h2c->in.start + NGX_HTTP_V2_UPSTREAM_IN_SIZE;
+
+    h2c->out.start = ngx_palloc(pool, NGX_HTTP_V2_UPSTREAM_OUT_SIZE
+                                      + NGX_HTTP_V2_UPSTREAM_RESERVE);
+    if (h2c->out.start == NULL) {
+        goto failed;
+    }
+
+    h2c->out.pos = h2c->out.start;
+    h2c->out.last = ngx_cpymem(h2c->out.start, ngx_http_v2_upstream_preface,
+                               sizeof(ngx_http_v2_upstream_preface) - 1);
+    h2c->out.end = h2c->out.start + NGX_HTTP_V2_UPSTREAM_OUT_SIZE
+                   + NGX_HTTP_V2_UPSTREAM_RESERVE;
+
+    conn = *pc;
+    conn.get = ngx_event_get_peer;
+    conn.connection = NULL;
+
+    rc = ngx_event_connect_peer(&conn);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "http2 upstream connect: %i, %p", rc, conn.connection);
+
+    if (rc == NGX_ERROR || rc == NGX_BUSY || rc == NGX_DECLINED) {
+        ngx_destroy_pool(pool);
+        ngx_http_v2_upstream_release_peer(peer);
+        return rc;
+    }
+
+    c = conn.connection;
+
+    c->data = h2c;
+    c->pool = pool;
+    c->log = log;
+    c->read->log = log;
+    c->write->log = log;
+
+    c->read->handler = ngx_http_v2_upstream_read_handler;
+    c->write->handler = ngx_http_v2_upstream_write_handler;
+
+    h2c->connection = c;
+    h2c->pool = pool;
+    h2c->log = log;
+
+    ngx_queue_init(&h2c->streams);
+
+    h2c->next_sid = 1;
+    h2c->max_streams = NGX_HTTP_V2_UPSTREAM_STREAMS;
+    h2c->frame_size = NGX_HTTP_V2_DEFAULT_FRAME_SIZE;
+    h2c->init_window = NGX_HTTP_V2_DEFAULT_WINDOW;
+    h2c->send_window = NGX_HTTP_V2_DEFAULT_WINDOW;
+    h2c->recv_window = NGX_HTTP_V2_MAX_WINDOW;
+
+    h2c->peer = peer;
+    ngx_queue_insert_head(&peer->connections, &h2c->queue);
+
+#if (NGX_HTTP_SSL)
+
+    if (u->ssl
+        && ngx_http_v2_upstream_ssl_init_connection(h2c, pd->request)
+           != NGX_OK)
+    {
+        ngx_http_v2_upstream_close_connection(h2c);
+        return NGX_ERROR;
+    }
+
+#endif
+
+    if (rc == NGX_AGAIN) {
+        ngx_add_timer(c->write, u->conf->connect_timeout);
+
+    } else {
+
+        /* the connection is completed by the write handler */
+
+        ngx_post_event(c->write, &ngx_posted_events);
+    }
+
+    *h2cp = h2c;
+
+    return NGX_OK;
+
+failed:
+
+    if (pool) {
+        ngx_destroy_pool(pool);
+    }
+
+    ngx_http_v2_upstream_release_peer(peer);
+
+    return NGX_ERROR;
+}
+
+
+#if (NGX_HTTP_SSL)
+
+static ngx_int_t
+ngx_http_v2_upstream_ssl_init_connection(
+    ngx_http_v2_upstream_connection_t *h2c, ngx_http_request_t *r)
+{
+    ngx_connection_t     *c;
+    ngx_http_upstream_t  *u;
+
+    c = h2c->connection;
+    u = r->upstream;
+
+    if (ngx_ssl_create_connection(u->conf->ssl, c,
+                                  NGX_SSL_BUFFER|NGX_SSL_CLIENT)
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    c->sendfile = 0;
+
+    if (u->conf->ssl_server_name
+        && ngx_http_upstream_ssl_name(r, u, c) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+#ifdef TLSEXT_TYPE_application_layer_protocol_negotiation
+
+    if (SSL_set_alpn_protos(c->ssl->connection,
+                            (u_char *) NGX_HTTP_V2_ALPN_ADVERTISE,
+                            sizeof(NGX_HTTP_V2_ALPN_ADVERTISE) - 1)
+        != 0)
+    {
+        ngx_ssl_error(NGX_LOG_ERR, c->log, 0, "SSL_set_alpn_protos() failed");
+        return NGX_ERROR;
+    }
+
+#endif
+
+    /*
+     * the connection outlives the request, so the name to verify
+     * the certificate against is kept with the connection
+     */
+
+    if (u->conf->ssl_verify) {
+        h2c->ssl_name.data = ngx_pstrdup(h2c->pool, &u->ssl_name);
+        if (h2c->ssl_name.data == NULL) {
+            return NGX_ERROR;
+        }
+
+        h2c->ssl_name.len = u->ssl_name.len;
+        h2c->ssl_verify = 1;
+    }
+
+    h2c->connect_timeout = u->conf->connect_timeout;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_v2_upstream_ssl_handshake(ngx_http_v2_upstream_connection_t *h2c)
+{
+    ngx_int_t          rc;
+    ngx_connection_t  *c;
+
+    c = h2c->connection;
+
+    c->log->action = "SSL handshaking to upstream";
+
+    rc = ngx_ssl_handshake(c);
+
+    if (rc == NGX_AGAIN) {
+
+        if (!c->write->timer_set) {
+            ngx_add_timer(c->write, h2c->connect_timeout);
+        }
+
+        c->ssl->handler = ngx_http_v2_upstream_ssl_handshake_handler;
+        return;
+    }
+
+    ngx_http_v2_upstream_ssl_handshake_handler(c);
+}
+
+
+static void
+ngx_http_v2_upstream_ssl_handshake_handler(ngx_connection_t *c)
+{
+    long                                rc;
+#ifdef TLSEXT_TYPE_application_layer_protocol_negotiation
+    unsigned int                        len;
+    const unsigned char                *data;
+#endif
+    ngx_http_v2_upstream_connection_t  *h2c;
+
+    h2c = c->data;
+
+    if (c->write->timer_set) {
+        ngx_del_timer(c->write);
+    }
+
+    if (!c->ssl->handshaked) {
+
+        if (c->write->timedout || c->read->timedout) {
+            ngx_log_error(NGX_LOG_ERR, c->log, NGX_ETIMEDOUT,
+                          "upstream timed out");
+        }
+
+        goto failed;
+    }
+
+    if (h2c->ssl_verify) {
+        rc = SSL_get_verify_result(c->ssl->connection);
+
+        if (rc != X509_V_OK) {
+            ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                          "upstream SSL certificate verify error: (%l:%s)",
+                          rc, X509_verify_cert_error_string(rc));
+            goto failed;
+        }
+
+        if (ngx_ssl_check_host(c, &h2c->ssl_name) != NGX_OK) {
+            ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                          "upstream SSL certificate does not match \"%V\"",
+                          &h2c->ssl_name);
+            goto failed;
+        }
+    }
+
+#ifdef TLSEXT_TYPE_application_layer_protocol_negotiation
+
+    /* a server without ALPN support is assumed to know HTTP/2 */
+
+    SSL_get0_alpn_selected(c->ssl->connection, &data, &len);
+
+    if (len && (len != 2 || ngx_strncmp(data, "h2", 2) != 0)) {
+        ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                      "upstream selected unexpected protocol \"%*s\"",
+                      (size_t) len, data);
+        goto failed;
+    }
+
+#endif
+
+    c->log->action = NULL;
+
+    c->read->handler = ngx_http_v2_upstream_read_handler;
+    c->write->handler = ngx_http_v2_upstream_write_handler;
+
+    ngx_http_v2_upstream_connected(h2c);
+
+    return;
+
+failed:
+
+    ngx_http_v2_upstream_close_connection(h2c);
+}
+
+#endif
+
+
+static u_char *
+ngx_http_v2_upstream_log_error(ngx_log_t *log, u_char *buf, size_t len)
+{
+    ngx_http_v2_upstream_connection_t  *h2c;
+
+    h2c = log->data;
+
+    return ngx_snprintf(buf, len, ", http2 upstream: %V", &h2c->name);
+}
+
+
+static void
+ngx_http_v2_upstream_read_handler(ngx_event_t *rev)
+{
+    ssize_t                             n;
+    ngx_buf_t                          *b;
+    ngx_connection_t                   *c;
+    ngx_http_v2_upstream_connection_t  *h2c;
+
+    c = rev->data;
+    h2c = c->data;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http2 upstream read handler");
+
+    if (rev->timedout) {
+        ngx_http_v2_upstream_close_connection(h2c);
+        return;
+    }
+
+    if (c->close) {
+        h2c->goaway = 1;
+
+        if (ngx_queue_empty(&h2c->streams)) {
+            ngx_http_v2_upstream_close_connection(h2c);
+            return;
+        }
+    }
+
+    if (!h2c->connected) {
+        if (ngx_http_v2_upstream_test_connect(h2c) != NGX_OK) {
+            ngx_http_v2_upstream_close_connection(h2c);
+            return;
+        }
+
+        ngx_http_v2_upstream_connected(h2c);
+        return;
+    }
+
+    b = &h2c->in;
+
+    do {
+        n = c->recv(c, b->last, b->end - b->last);
+
+        if (n == NGX_AGAIN) {
+            break;
+        }
+
+        if (n == 0 || n == NGX_ERROR) {
+            if (h2c->processing) {
+                ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                              "upstream prematurely closed http2 connection");
+            }
+
+            ngx_http_v2_upstream_close_connection(h2c);
+            return;
+        }
+
+        b->last += n;
+
+        if (ngx_http_v2_upstream_process(h2c) != NGX_OK) {
+            ngx_http_v2_upstream_close_connection(h2c);
+            return;
+        }
+
+    } while (rev->ready);
+
+    if (ngx_handle_read_event(rev, 0) != NGX_OK) {
+        ngx_http_v2_upstream_close_connection(h2c);
+        return;
+    }
+
+    if (h2c->goaway && ngx_queue_empty(&h2c->streams)) {
+        ngx_http_v2_upstream_close_connection(h2c);
+        return;
+    }
+
+    if (ngx_http_v2_upstream_flush(h2c) != NGX_OK) {
+        ngx_http_v2_upstream_close_connection(h2c);
+    }
+}
+
+
+static void
+ngx_http_v2_upstream_write_handler(ngx_event_t *wev)
+{
+    ngx_connection_t                   *c;
+    ngx_http_v2_upstream_connection_t  *h2c;
+
+    c = wev->data;
+    h2c = c->data;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http2 upstream write handler");
+
+    if (wev->timedout) {
+        ngx_log_error(NGX_LOG_ERR, c->log, NGX_ETIMEDOUT,
+                      "upstream timed out while connecting");
+        ngx_http_v2_upstream_close_connection(h2c);
+        return;
+    }
+
+    if (!h2c->connected) {
+        if (ngx_http_v2_upstream_test_connect(h2c) != NGX_OK) {
+            ngx_http_v2_upstream_close_connection(h2c);
+            return;
+        }
+
+        ngx_http_v2_upstream_connected(h2c);
+        return;
+    }
+
+    if (ngx_http_v2_upstream_flush(h2c) != NGX_OK) {
+        ngx_http_v2_upstream_close_connection(h2c);
+    }
+}
+
+
+static ngx_int_t
+ngx_http_v2_upstream_test_connect(ngx_http_v2_upstream_connection_t *h2c)
+{
+    int                err;
+    socklen_t          len;
+    ngx_connection_t  *c;
+
+    c = h2c->connection;
+
+    if (c->write->timer_set) {
+        ngx_del_timer(c->write);
+    }
+
+#if (NGX_HAVE_KQUEUE)
+
+    if (ngx_event_flags & NGX_USE_KQUEUE_EVENT)  {
+        if (c->write->pending_eof || c->read->pending_eof) {
+            if (c->write->pending_eof) {
+                err = c->write->kq_errno;
+
+            } else {
+                err = c->read->kq_errno;
+            }
+
+            (void) ngx_connection_error(c, err,
+                                    "kevent() reported that connect() failed");
+            return NGX_ERROR;
+        }
+
+    } else
+#endif
+    {
+        err = 0;
+        len = sizeof(int);
+
+        if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, (void *) &err, &len)
+            == -1)
+        {
+            err = ngx_socket_errno;
+        }
+
+        if (err) {
+            (void) ngx_connection_error(c, err, "connect() failed");
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_v2_upstream_connected(ngx_http_v2_upstream_connection_t *h2c)
+{
+    ngx_connection_t  *c;
+
+    c = h2c->connection;
+
+#if (NGX_HTTP_SSL)
+
+    if (c->ssl && !c->ssl->handshaked) {
+        ngx_http_v2_upstream_ssl_handshake(h2c);
+        return;
+    }
+
+#endif
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http2 upstream connected");
+
+    h2c->connected = 1;
+
+    if (c->read->ready) {
+        ngx_post_event(c->read, &ngx_posted_events);
+    }
+
+    ngx_http_v2_upstream_post_flush(h2c);
+}
+
+
+static ngx_int_t
+ngx_http_v2_upstream_flush(ngx_http_v2_upstream_connection_t *h2c)
+{
+    ssize_t            n;
+    ngx_buf_t         *b;
+    ngx_uint_t         sent;
+    ngx_connection_t  *c;
+
+    if (!h2c->connected) {
+        return NGX_OK;
+    }
+
+    c = h2c->connection;
+    b = &h2c->out;
+
+    sent = 0;
+
+    while (b->pos < b->last && c->write->ready) {
+
+        n = c->send(c, b->pos, b->last - b->pos);
+
+        if (n == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+
+        if (n == NGX_AGAIN) {
+            break;
+        }
+
+        b->pos += n;
+        sent = 1;
+    }
+
+    if (b->pos == b->last) {
+        b->pos = b->start;
+        b->last = b->start;
+    }
+
+    if (ngx_handle_write_event(c->write, 0) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (sent) {
+        ngx_http_v2_upstream_wake(h2c);
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_v2_upstream_post_flush(ngx_http_v2_upstream_connection_t *h2c)
+{
+    ngx_event_t  *wev;
+
+    wev = h2c->connection->write;
+
+    if (h2c->connected && wev->ready && !wev->posted
+        && h2c->out.pos != h2c->out.last)
+    {
+        ngx_post_event(wev, &ngx_posted_events);
+    }
+}
+
+
+static void
+ngx_http_v2_upstream_wake(ngx_http_v2_upstream_connection_t *h2c)
+{
+    ngx_int_t                       rc;
+    ngx_queue_t                    *q;
+    ngx_http_v2_upstream_stream_t  *stream;
+
+    for (q = ngx_queue_head(&h2c->streams);
+         q != ngx_queue_sentinel(&h2c->streams);
+         q = ngx_queue_next(q))
+    {
+        stream = ngx_queue_data(q, ngx_http_v2_upstream_stream_t, queue);
+
+        if (stream->closed) {
+            continue;
+        }
+
+        if (stream->headers_pending) {
+            rc = ngx_http_v2_upstream_send_headers(stream);
+
+            if (rc == NGX_ERROR) {
+                ngx_http_v2_upstream_stream_error(stream);
+                continue;
+            }
+
+            if (rc == NGX_AGAIN) {
+                continue;
+            }
+        }
+
+        ngx_http_v2_upstream_update_window(stream);
+
+        if (stream->blocked
+            && (stream->type != NGX_HTTP_V2_DATA_FRAME
+                || (stream->send_window > 0 && h2c->send_window > 0)))
+        {
+            stream->blocked = 0;
+            ngx_http_v2_upstream_post(stream->connection.write);
+        }
+    }
+
+    ngx_http_v2_upstream_post_flush(h2c);
+}
+
+
+static void
+ngx_http_v2_upstream_set_idle(ngx_http_v2_upstream_connection_t *h2c)
+{
+    ngx_connection_t  *c;
+
+    c = h2c->connection;
+
+    if (h2c->goaway || ngx_terminate || ngx_exiting) {
+        ngx_http_v2_upstream_close_connection(h2c);
+        return;
+    }
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0, "http2 upstream idle");
+
+    c->idle = 1;
+    ngx_add_timer(c->read, NGX_HTTP_V2_UPSTREAM_IDLE_TIMEOUT);
+
+    ngx_http_v2_upstream_post_flush(h2c);
+}
+
+
+static void
+ngx_http_v2_upstream_close_connection(ngx_http_v2_upstream_connection_t *h2c)
+{
+    ngx_pool_t                     *pool;
+    ngx_queue_t                    *q;
+    ngx_http_v2_upstream_stream_t  *stream;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, h2c->log, 0,
+                   "close http2 upstream connection: %d",
+                   h2c->connection->fd);
+
+    for (q = ngx_queue_head(&h2c->streams);
+         q != ngx_queue_sentinel(&h2c->streams);
+         q = ngx_queue_next(q))
+    {
+        stream = ngx_queue_data(q, ngx_http_v2_upstream_stream_t, queue);
+
+        stream->conn = NULL;
+        stream->closed = 1;
+
+        if (!stream->remote_closed) {
+            ngx_http_v2_upstream_stream_error(stream);
+
+        } else if (stream->blocked) {
+            stream->blocked = 0;
+            ngx_http_v2_upstream_post(stream->connection.write);
+        }
+    }
+
+    ngx_queue_remove(&h2c->queue);
+    ngx_http_v2_upstream_release_peer(h2c->peer);
+
+#if (NGX_HTTP_SSL)
+
+    if (h2c->connection->ssl) {
+        h2c->connection->ssl->no_wait_shutdown = 1;
+        (void) ngx_ssl_shutdown(h2c->connection);
+    }
+
+#endif
+
+    pool = h2c->pool;
+
+    ngx_close_connection(h2c->connection);
+    ngx_destroy_pool(pool);
+}
+
+
+static ngx_int_t
+ngx_http_v2_upstream_process(ngx_http_v2_upstream_connection_t *h2c)
+{
+    u_char      *p;
+    size_t       len;
+    uint32_t     head;
+    ngx_buf_t   *b;
+    ngx_int_t    rc;
+    ngx_uint_t   type, flags, sid;
+
+    b = &h2c->in;
+    p = b->pos;
+
+    while (b->last - p >= NGX_HTTP_V2_FRAME_HEADER_SIZE) {
+
+        head = ngx_http_v2_parse_uint32(p);
+
+        len = ngx_http_v2_parse_length(head);
+        type = ngx_http_v2_parse_type(head);
+        flags = p[4];
+        sid = ngx_http_v2_parse_sid(&p[5]);
+
+        if (len > NGX_HTTP_V2_DEFAULT_FRAME_SIZE) {
+            ngx_log_error(NGX_LOG_ERR, h2c->log, 0,
+                          "upstream sent too large http2 frame: %uz", len);
+            return NGX_ERROR;
+        }
+
+        if ((size_t) (b->last - p) < NGX_HTTP_V2_FRAME_HEADER_SIZE + len) {
+            break;
+        }
+
+        p += NGX_HTTP_V2_FRAME_HEADER_SIZE;
+
+        ngx_log_debug4(NGX_LOG_DEBUG_HTTP, h2c->log, 0,
+                       "http2 upstream frame type:%ui f:%Xi l:%uz sid:%ui",
+                       type, flags, len, sid);
+
+        if (h2c->cont_sid && type != NGX_HTTP_V2_CONTINUATION_FRAME) {
+            ngx_log_error(NGX_LOG_ERR, h2c->log, 0,
+                          "upstream sent frame of type %ui "
+                          "instead of CONTINUATION", type);
+            return NGX_ERROR;
+        }
+
+        switch (type) {
+
+        case NGX_HTTP_V2_DATA_FRAME:
+            rc = ngx_http_v2_upstream_state_data(h2c, sid, flags, p, len);
+            break;
+
+        case NGX_HTTP_V2_HEADERS_FRAME:
+            rc = ngx_http_v2_upstream_state_headers(h2c, sid, flags, p, len);
+            break;
+
+        case NGX_HTTP_V2_CONTINUATION_FRAME:
+
+            if (h2c->cont_sid == 0 || h2c->cont_sid != sid) {
+                ngx_log_error(NGX_LOG_ERR, h2c->log, 0,
+                              "upstream sent unexpected CONTINUATION frame");
+                return NGX_ERROR;
+            }
+
+            rc = ngx_http_v2_upstream_state_header_block(h2c, sid, flags,
+                                                         p, len);
+            break;
+
+        case NGX_HTTP_V2_RST_STREAM_FRAME:
+            rc = ngx_http_v2_upstream_state_rst_stream(h2c, sid, p, len);
+            break;
+
+        case NGX_HTTP_V2_SETTINGS_FRAME:
+            rc = ngx_http_v2_upstream_state_settings(h2c, sid, flags, p, len);
+            break;
+
+        case NGX_HTTP_V2_PING_FRAME:
+            rc = ngx_http_v2_upstream_state_ping(h2c, flags, p, len);
+            break;
+
+        case NGX_HTTP_V2_GOAWAY_FRAME:
+            rc = ngx_http_v2_upstream_state_goaway(h2c, p, len);
+            break;
+
+        case NGX_HTTP_V2_WINDOW_UPDATE_FRAME:
+            rc = ngx_http_v2_upstream_state_window_update(h2c, sid, p, len);
+            break;
+
+        case NGX_HTTP_V2_PUSH_PROMISE_FRAME:
+            ngx_log_error(NGX_LOG_ERR, h2c->log, 0,
+                          "upstream sent PUSH_PROMISE frame "
+                          "while push is disabled");
+            return NGX_ERROR;
+
+        default:
+
+            /* PRIORITY and unknown frames are ignored */
+
+            rc = NGX_OK;
+        }
+
+        if (rc != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        p += len;
+    }
+
+    b->last = ngx_movemem(b->start, p, b->last - p);
+    b->pos = b->start;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_v2_upstream_state_data(ngx_http_v2_upstream_connection_t *h2c,
+    ngx_uint_t sid, ngx_uint_t flags, u_char *p, size_t len)
+{
+    size_t                          size, padding, window;
+    ngx_http_v2_upstream_stream_t  *stream;
+
+    if (sid == 0) {
+        ngx_log_error(NGX_LOG_ERR, h2c->log, 0,
+                      "upstream sent DATA frame with incorrect identifier");
+        return NGX_ERROR;
+    }
+
+    size = len;
+
+    if (size > h2c->recv_window) {
+        ngx_log_error(NGX_LOG_ERR, h2c->log, 0,
+                      "upstream violated connection flow control");
+        return NGX_ERROR;
+    }
+
+    h2c->recv_window -= size;
+
+    if (h2c->recv_window < NGX_HTTP_V2_MAX_WINDOW / 4) {
+        window = NGX_HTTP_V2_MAX_WINDOW - h2c->recv_window;
+
+        if (ngx_http_v2_upstream_send_window_update(h2c, 0, window) == NGX_OK) {
+            h2c->recv_window = NGX_HTTP_V2_MAX_WINDOW;
+        }
+    }
+
+    if (flags & NGX_HTTP_V2_PADDED_FLAG) {
+
+        if (len == 0) {
+            ngx_log_error(NGX_LOG_ERR, h2c->log, 0,
+                          "upstream sent padded DATA frame with "
+                          "incorrect length: 0");
+            return NGX_ERROR;
+        }
+
+        padding = *p++;
+        len--;
+
+        if (padding > len) {
+            ngx_log_error(NGX_LOG_ERR, h2c->log, 0,
+                          "upstream sent padded DATA frame with "
+                          "incorrect length: %uz, padding: %uz",
+                          len, padding);
+            return NGX_ERROR;
+        }
+
+        len -= padding;
+    }
+
+    stream = ngx_http_v2_upstream_find_stream(h2c, sid);
+
+    if (stream == NULL || stream->closed) {
+        return NGX_OK;
+    }
+
+    if (stream->remote_closed) {
+        ngx_log_error(NGX_LOG_ERR, stream->connection.log, 0,
+                      "upstream sent unexpected DATA frame");
+        ngx_http_v2_upstream_reset_stream(stream, NGX_HTTP_V2_PROTOCOL_ERROR);
+        ngx_http_v2_upstream_stream_error(stream);
+        return NGX_OK;
+    }
+
+    if (size > stream->recv_window) {
+        ngx_log_error(NGX_LOG_ERR, stream->connection.log, 0,
+                      "upstream violated stream flow control, "
+                      "received %uz data frame with window %uz",
+                      size, stream->recv_window);
+        ngx_http_v2_upstream_reset_stream(stream, NGX_HTTP_V2_FLOW_CTRL_ERROR);
+        ngx_http_v2_upstream_stream_error(stream);
+        return NGX_OK;
+    }
+
+    stream->recv_window -= size;
+
+    flags &= NGX_HTTP_V2_END_STREAM_FLAG;
+
+    if (len == 0 && flags == 0) {
+        return NGX_OK;
+    }
+
+    return ngx_http_v2_upstream_deliver(stream, NGX_HTTP_V2_DATA_FRAME, flags,
+                                        p, len);
+}
+
+
+static ngx_int_t
+ngx_http_v2_upstream_state_headers(ngx_http_v2_upstream_connection_t *h2c,
+    ngx_uint_t sid, ngx_uint_t flags, u_char *p, size_t len)
+{
+    size_t  padding;
+
+    if (sid == 0) {
+        ngx_log_error(NGX_LOG_ERR, h2c->log, 0,
+                      "upstream sent HEADERS frame with incorrect identifier");
+        return NGX_ERROR;
+    }
+
+    padding = 0;
+
+    if (flags & NGX_HTTP_V2_PADDED_FLAG) {
+
+        if (len == 0) {
+            goto invalid;
+        }
+
+        padding = *p++;
+        len--;
+    }
+
+    if (flags & NGX_HTTP_V2_PRIORITY_FLAG) {
+
+        if (len < NGX_HTTP_V2_PRIORITY_SIZE) {
+            goto invalid;
+        }
+
+        p += NGX_HTTP_V2_PRIORITY_SIZE;
+        len -= NGX_HTTP_V2_PRIORITY_SIZE;
+    }
+
+    if (padding > len) {
+        goto invalid;
+    }
+
+    len -= padding;
+
+    h2c->end_stream = (flags & NGX_HTTP_V2_END_STREAM_FLAG) ? 1 : 0;
+
+    return ngx_http_v2_upstream_state_header_block(h2c, sid, flags, p, len);
+
+invalid:
+
+    ngx_log_error(NGX_LOG_ERR, h2c->log, 0,
+                  "upstream sent HEADERS frame with incorrect length");
+
+    return NGX_ERROR;
+}
+
+
+static ngx_int_t
+ngx_http_v2_upstream_state_header_block(ngx_http_v2_upstream_connection_t *h2c,
+    ngx_uint_t sid, ngx_uint_t flags, u_char *p, size_t len)
+{
+    u_char                         *start;
+    size_t                          size;
+    ngx_buf_t                      *b;
+    ngx_http_v2_upstream_stream_t  *stream;
+
+    if (flags & NGX_HTTP_V2_END_HEADERS_FLAG) {
+        h2c->cont_sid = 0;
+
+    } else {
+        h2c->cont_sid = sid;
+    }
+
+    stream = ngx_http_v2_upstream_find_stream(h2c, sid);
+
+    if (stream == NULL || stream->closed) {
+        return NGX_OK;
+    }
+
+    b = stream->header;
+
+    if (b == NULL || (size_t) (b->end - b->last) < len) {
+
+        size = b ? 2 * (b->end - b->start) : 1024;
+        size = ngx_max(size, (size_t) (b ? b->last - b->start : 0) + len);
+
+        if (size > NGX_HTTP_V2_UPSTREAM_RESPONSE_SIZE) {
+            ngx_log_error(NGX_LOG_ERR, stream->connection.log, 0,
+                          "upstream sent too large http2 header block");
+            ngx_http_v2_upstream_reset_stream(stream,
+                                              NGX_HTTP_V2_PROTOCOL_ERROR);
+            ngx_http_v2_upstream_stream_error(stream);
+            return NGX_OK;
+        }
+
+        start = ngx_pnalloc(stream->pool, size);
+        if (start == NULL) {
+            return NGX_ERROR;
+        }
+
+        if (b == NULL) {
+            b = ngx_calloc_buf(stream->pool);
+            if (b == NULL) {
+                return NGX_ERROR;
+            }
+
+            b->pos = start;
+            b->last = start;
+
+            stream->header = b;
+
+        } else {
+            b->last = ngx_cpymem(start, b->pos, b->last - b->pos);
+            b->pos = start;
+        }
+
+        b->start = start;
+        b->end = start + size;
+    }
+
+    b->last = ngx_cpymem(b->last, p, len);
+
+    if (h2c->cont_sid) {
+        return NGX_OK;
+    }
+
+    /* the header block is complete */
+
+    if (stream->remote_closed) {
+        ngx_log_error(NGX_LOG_ERR, stream->connection.log, 0,
+                      "upstream sent unexpected HEADERS frame");
+        ngx_http_v2_upstream_reset_stream(stream, NGX_HTTP_V2_PROTOCOL_ERROR);
+        ngx_http_v2_upstream_stream_error(stream);
+        return NGX_OK;
+    }
+
+    flags = NGX_HTTP_V2_END_HEADERS_FLAG;
+
+    if (h2c->end_stream) {
+        flags |= NGX_HTTP_V2_END_STREAM_FLAG;
+    }
+
+    size = b->last - b->pos;
+
+    b->pos = b->start;
+    b->last = b->start;
+
+    return ngx_http_v2_upstream_deliver(stream, NGX_HTTP_V2_HEADERS_FRAME,
+                                        flags, b->start, size);
+}
+
+
+static ngx_int_t
+ngx_http_v2_upstream_state_rst_stream(ngx_http_v2_upstream_connection_t *h2c,
+    ngx_uint_t sid, u_char *p, size_t len)
+{
+    ngx_uint_t                      status;
+    ngx_http_v2_upstream_stream_t  *stream;
+
+    if (len != NGX_HTTP_V2_RST_STREAM_SIZE || sid == 0) {
+        ngx_log_error(NGX_LOG_ERR, h2c->log, 0,
+                      "upstream sent invalid RST_STREAM frame");
+        return NGX_ERROR;
+    }
+
+    stream = ngx_http_v2_upstream_find_stream(h2c, sid);
+
+    if (stream == NULL || stream->closed) {
+        return NGX_OK;
+    }
+
+    status = ngx_http_v2_parse_uint32(p);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, h2c->log, 0,
+                   "http2 upstream RST_STREAM sid:%ui status:%ui",
+                   sid, status);
+
+    stream->closed = 1;
+    h2c->processing--;
+
+    if (!stream->remote_closed) {
+        ngx_log_error(NGX_LOG_ERR, stream->connection.log, 0,
+                      "upstream reset http2 stream with status %ui", status);
+        ngx_http_v2_upstream_stream_error(stream);
+        return NGX_OK;
+    }
+
+    /* the response is complete, the rest of the request is discarded */
+
+    if (stream->blocked) {
+        stream->blocked = 0;
+        ngx_http_v2_upstream_post(stream->connection.write);
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_v2_upstream_state_settings(ngx_http_v2_upstream_connection_t *h2c,
+    ngx_uint_t sid, ngx_uint_t flags, u_char *p, size_t len)
+{
+    ssize_t                         window, delta;
+    ngx_uint_t                      id, value;
+    ngx_queue_t                    *q;
+    ngx_http_v2_upstream_stream_t  *stream;
+
+    if (sid != 0) {
+        ngx_log_error(NGX_LOG_ERR, h2c->log, 0,
+                      "upstream sent SETTINGS frame with incorrect identifier");
+        return NGX_ERROR;
+    }
+
+    if (flags & NGX_HTTP_V2_ACK_FLAG) {
+
+        if (len != 0) {
+            ngx_log_error(NGX_LOG_ERR, h2c->log, 0,
+                          "upstream sent SETTINGS frame with the ACK flag "
+                          "and nonzero length");
+            return NGX_ERROR;
+        }
+
+        return NGX_OK;
+    }
+
+    if (len % NGX_HTTP_V2_SETTINGS_PARAM_SIZE) {
+        ngx_log_error(NGX_LOG_ERR, h2c->log, 0,
+                      "upstream sent SETTINGS frame with incorrect length %uz",
+                      len);
+        return NGX_ERROR;
+    }
+
+    for ( /* void */ ; len; len -= NGX_HTTP_V2_SETTINGS_PARAM_SIZE) {
+
+        id = ngx_http_v2_parse_uint16(p);
+        value = ngx_http_v2_parse_uint32(&p[2]);
+
+        p += NGX_HTTP_V2_SETTINGS_PARAM_SIZE;
+
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, h2c->log, 0,
+                       "http2 upstream setting %ui:%ui", id, value);
+
+        switch (id) {
+
+        case NGX_HTTP_V2_MAX_STREAMS_SETTING:
+            h2c->max_streams = value;
+            break;
+
+        case NGX_HTTP_V2_INIT_WINDOW_SIZE_SETTING:
+
+            if (value > NGX_HTTP_V2_MAX_WINDOW) {
+                ngx_log_error(NGX_LOG_ERR, h2c->log, 0,
+                              "upstream sent SETTINGS frame with incorrect "
+                              "INITIAL_WINDOW_SIZE value %ui", value);
+                return NGX_ERROR;
+            }
+
+            delta = (ssize_t) value - (ssize_t) h2c->init_window;
+            h2c->init_window = value;
+
+            for (q = ngx_queue_head(&h2c->streams);
+                 q != ngx_queue_sentinel(&h2c->streams);
+                 q = ngx_queue_next(q))
+            {
+                stream = ngx_queue_data(q, ngx_http_v2_upstream_stream_t,
+                                        queue);
+
+                if (stream->sid == 0 || stream->closed) {
+                    continue;
+                }
+
+                window = stream->send_window + delta;
+
+                if (window > (ssize_t) NGX_HTTP_V2_MAX_WINDOW) {
+                    ngx_log_error(NGX_LOG_ERR, h2c->log, 0,
+                                  "upstream sent SETTINGS frame overflowing "
+                                  "stream window");
+                    return NGX_ERROR;
+                }
+
+                stream->send_window = window;
+            }
+
+            break;
+
+        case NGX_HTTP_V2_MAX_FRAME_SIZE_SETTING:
+
+            if (value < NGX_HTTP_V2_DEFAULT_FRAME_SIZE
+                || value > NGX_HTTP_V2_MAX_FRAME_SIZE)
+            {
+                ngx_log_error(NGX_LOG_ERR, h2c->log, 0,
+                              "upstream sent SETTINGS frame with incorrect "
+                              "MAX_FRAME_SIZE value %ui", value);
+                return NGX_ERROR;
+            }
+
+            h2c->frame_size = value;
+            break;
+
+        default:
+            break;
+        }
+    }
+
+    if (ngx_http_v2_upstream_get_frame(h2c, 0, NGX_HTTP_V2_SETTINGS_FRAME,
+                                       NGX_HTTP_V2_ACK_FLAG, 0, 1)
+        == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    ngx_http_v2_upstream_wake(h2c);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_v2_upstream_state_ping(ngx_http_v2_upstream_connection_t *h2c,
+    ngx_uint_t flags, u_char *p, size_t len)
+{
+    u_char  *pos;
+
+    if (len != NGX_HTTP_V2_PING_SIZE) {
+        ngx_log_error(NGX_LOG_ERR, h2c->log, 0,
+                      "upstream sent PING frame with incorrect length %uz",
+                      len);
+        return NGX_ERROR;
+    }
+
+    if (flags & NGX_HTTP_V2_ACK_FLAG) {
+        return NGX_OK;
+    }
+
+    pos = ngx_http_v2_upstream_get_frame(h2c, NGX_HTTP_V2_PING_SIZE,
+                                         NGX_HTTP_V2_PING_FRAME,
+                                         NGX_HTTP_V2_ACK_FLAG, 0, 1);
+    if (pos == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_memcpy(pos, p, NGX_HTTP_V2_PING_SIZE);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_v2_upstream_state_goaway(ngx_http_v2_upstream_connection_t *h2c,
+    u_char *p, size_t len)
+{
+    ngx_uint_t                      last_sid;
+    ngx_queue_t                    *q;
+    ngx_http_v2_upstream_stream_t  *stream;
+
+    if (len < NGX_HTTP_V2_GOAWAY_SIZE) {
+        ngx_log_error(NGX_LOG_ERR, h2c->log, 0,
+                      "upstream sent GOAWAY frame with incorrect length %uz",
+                      len);
+        return NGX_ERROR;
+    }
+
+    last_sid = ngx_http_v2_parse_sid(p);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, h2c->log, 0,
+                   "http2 upstream GOAWAY last_sid:%ui status:%ui",
+                   last_sid, ngx_http_v2_parse_uint32(&p[4]));
+
+    h2c->goaway = 1;
+
+    for (q = ngx_queue_head(&h2c->streams);
+         q != ngx_queue_sentinel(&h2c->streams);
+         q = ngx_queue_next(q))
+    {
+        stream = ngx_queue_data(q, ngx_http_v2_upstream_stream_t, queue);
+
+        if (stream->closed) {
+            continue;
+        }
+
+        if (stream->sid == 0 || stream->sid > last_sid) {
+
+            /* not processed by the upstream, safe to retry */
+
+            stream->closed = 1;
+            h2c->processing--;
+
+            ngx_http_v2_upstream_stream_error(stream);
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_v2_upstream_state_window_update(
+    ngx_http_v2_upstream_connection_t *h2c, ngx_uint_t sid, u_char *p,
+    size_t len)
+{
+    size_t                          window;
+    ngx_http_v2_upstream_stream_t  *stream;
+
+    if (len != NGX_HTTP_V2_WINDOW_UPDATE_SIZE) {
+        ngx_log_error(NGX_LOG_ERR, h2c->log, 0,
+                      "upstream sent WINDOW_UPDATE frame "
+                      "with incorrect length %uz", len);
+        return NGX_ERROR;
+    }
+
+    window = ngx_http_v2_parse_window(p);
+
+    if (sid) {
+        stream = ngx_http_v2_upstream_find_stream(h2c, sid);
+
+        if (stream == NULL || stream->closed) {
+            return NGX_OK;
+        }
+
+        if (window == 0
+            || window > (size_t) (NGX_HTTP_V2_MAX_WINDOW
+                                  - stream->send_window))
+        {
+            ngx_log_error(NGX_LOG_ERR, stream->connection.log, 0,
+                          "upstream sent invalid WINDOW_UPDATE frame");
+            ngx_http_v2_upstream_reset_stream(stream,
+                                              NGX_HTTP_V2_FLOW_CTRL_ERROR);
+            ngx_http_v2_upstream_stream_error(stream);
+            return NGX_OK;
+        }
+
+        stream->send_window += window;
+
+        if (stream->blocked && stream->send_window > 0
+            && h2c->send_window > 0)
+        {
+            stream->blocked = 0;
+            ngx_http_v2_upstream_post(stream->connection.write);
+        }
+
+        return NGX_OK;
+    }
+
+    if (window == 0
+        || window > (size_t) (NGX_HTTP_V2_MAX_WINDOW - h2c->send_window))
+    {
+        ngx_log_error(NGX_LOG_ERR, h2c->log, 0,
+                      "upstream sent invalid connection WINDOW_UPDATE frame");
+        return NGX_ERROR;
+    }
+
+    h2c->send_window += window;
+
+    ngx_http_v2_upstream_wake(h2c);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_v2_upstream_deliver(ngx_http_v2_upstream_stream_t *stream,
+    ngx_uint_t type, ngx_uint_t flags, u_char *p, size_t len)
+{
+    u_char  *pos, head[NGX_HTTP_V2_FRAME_HEADER_SIZE];
+
+    ngx_log_debug4(NGX_LOG_DEBUG_HTTP, stream->connection.log, 0,
+                   "http2 upstream deliver frame type:%ui f:%Xi l:%uz sid:%ui",
+                   type, flags, len, stream->sid);
+
+    pos = ngx_http_v2_write_uint32(head, len << 8 | type);
+    *pos++ = (u_char) flags;
+    (void) ngx_http_v2_write_sid(pos, stream->sid);
+
+    if (ngx_http_v2_upstream_append(stream, head,
+                                    NGX_HTTP_V2_FRAME_HEADER_SIZE)
+        != NGX_OK
+        || ngx_http_v2_upstream_append(stream, p, len) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    if (flags & NGX_HTTP_V2_END_STREAM_FLAG) {
+        stream->remote_closed = 1;
+        ngx_http_v2_upstream_check_closed(stream);
+    }
+
+    ngx_http_v2_upstream_post(stream->connection.read);
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_http_v2_upstream_parse_header(ngx_http_request_t *r, u_char **pos,
+    u_char *end, ngx_str_t *name, ngx_str_t *value)
+{
+    u_char      *p, ch;
+    ngx_int_t    rc;
+    ngx_uint_t   i, index;
+
+    p = *pos;
+
+    for ( ;; ) {
+
+        if (p == end) {
+            return NGX_DONE;
+        }
+
+        ch = *p;
+
+        if ((ch & 0xe0) != 0x20) {
+            break;
+        }
+
+        /* dynamic table size update, the table is disabled */
+
+        if (ngx_http_v2_upstream_parse_int(&p, end, ngx_http_v2_prefix(5),
+                                           &index)
+            != NGX_OK
+            || index != 0)
+        {
+            return NGX_DECLINED;
+        }
+    }
+
+    if (ch & 0x80) {
+        if (ngx_http_v2_upstream_parse_int(&p, end, ngx_http_v2_prefix(7),
+                                           &index)
+            != NGX_OK)
+        {
+            return NGX_DECLINED;
+        }
+
+        if (index == 0 || index > NGX_HTTP_V2_UPSTREAM_STATIC_SIZE) {
+            return NGX_DECLINED;
+        }
+
+        *name = *ngx_http_v2_get_static_name(index);
+        *value = *ngx_http_v2_get_static_value(index);
+
+        goto done;
+    }
+
+    if (ngx_http_v2_upstream_parse_int(&p, end,
+                                       (ch & 0x40) ? ngx_http_v2_prefix(6)
+                                                   : ngx_http_v2_prefix(4),
+                                       &index)
+        != NGX_OK)
+    {
+        return NGX_DECLINED;
+    }
+
+    if (index) {
+        if (index > NGX_HTTP_V2_UPSTREAM_STATIC_SIZE) {
+            return NGX_DECLINED;
+        }
+
+        *name = *ngx_http_v2_get_static_name(index);
+
+    } else {
+        rc = ngx_http_v2_upstream_parse_string(r, &p, end, name);
+
+        if (rc != NGX_OK) {
+            return rc;
+        }
+    }
+
+    rc = ngx_http_v2_upstream_parse_string(r, &p, end, value);
+
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+done:
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http2 upstream header: \"%V: %V\"", name, value);
+
+    if (name->len == 0) {
+        return NGX_DECLINED;
+    }
+
+    for (i = (name->data[0] == ':'); i < name->len; i++) {
+        ch = name->data[i];
+
+        if (ch <= 0x20 || ch == 0x7f || ch == ':'
+            || (ch >= 'A' && ch <= 'Z'))
+        {
+            return NGX_DECLINED;
+        }
+    }
+
+    for (i = 0; i < value->len; i++) {
+        ch = value->data[i];
+
+        if (ch == '\0' || ch == LF || ch == CR) {
+            return NGX_DECLINED;
+        }
+    }
+
+    *pos = p;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_v2_upstream_parse_int(u_char **pos, u_char *end, ngx_uint_t prefix,
+    ngx_uint_t *value)
+{
+    u_char      *p, octet;
+    ngx_uint_t   v, shift;
+
+    p = *pos;
+
+    if (p == end) {
+        return NGX_ERROR;
+    }
+
+    v = *p++ & prefix;
+
+    if (v == prefix) {
+
+        for (shift = 0; /* void */ ; shift += 7) {
+
+            if (p == end || shift == 7 * NGX_HTTP_V2_INT_OCTETS) {
+                return NGX_ERROR;
+            }
+
+            octet = *p++;
+
+            v += (ngx_uint_t) (octet & 0x7f) << shift;
+
+            if (!(octet & 0x80)) {
+                break;
+            }
+        }
+    }
+
+    *pos = p;
+    *value = v;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_v2_upstream_parse_string(ngx_http_request_t *r, u_char **pos,
+    u_char *end, ngx_str_t *str)
+{
+    u_char      *p, *dst, state;
+    ngx_uint_t   huff, len;
+
+    p = *pos;
+
+    if (p == end) {
+        return NGX_DECLINED;
+    }
+
+    huff = *p & 0x80;
+
+    if (ngx_http_v2_upstream_parse_int(&p, end, ngx_http_v2_prefix(7), &len)
+        != NGX_OK)
+    {
+        return NGX_DECLINED;
+    }
+
+    if ((size_t) (end - p) < len) {
+        return NGX_DECLINED;
+    }
+
+    if (huff) {
+        dst = ngx_pnalloc(r->pool, len * 8 / 5 + 1);
+        if (dst == NULL) {
+            return NGX_ERROR;
+        }
+
+        str->data = dst;
+        state = 0;
+
+        if (ngx_http_v2_huff_decode(&state, p, len, &dst, 1,
+                                    r->connection->log)
+            != NGX_OK)
+        {
+            return NGX_DECLINED;
+        }
+
+        str->len = dst - str->data;
+
+    } else {
+        str->data = p;
+        str->len = len;
+    }
+
+    *pos = p + len;
+
+    return NGX_OK;
+}
+
+
+static ngx_http_v2_upstream_stream_t *
+ngx_http_v2_upstream_create_stream(ngx_http_v2_upstream_connection_t *h2c,
+    ngx_log_t *log)
+{
+    ngx_pool_t                     *pool;
+    ngx_event_t                    *rev, *wev;
+    ngx_connection_t               *c, *fc;
+    ngx_http_v2_upstream_stream_t  *stream;
+
+    pool = ngx_create_pool(1024, log);
+    if (pool == NULL) {
+        return NULL;
+    }
+
+    stream = ngx_pcalloc(pool, sizeof(ngx_http_v2_upstream_stream_t));
+    if (stream == NULL) {
+        ngx_destroy_pool(pool);
+        return NULL;
+    }
+
+    c = h2c->connection;
+    fc = &stream->connection;
+    rev = &stream->read;
+    wev = &stream->write;
+
+    /*
+     * the fake connection shares the socket only to let
+     * ngx_http_upstream_test_connect() check it; its events
+     * are never added to the event method, and are kept with
+     * "active" being the opposite of "ready"
+     */
+
+    fc->fd = c->fd;
+    fc->read = rev;
+    fc->write = wev;
+    fc->pool = pool;
+    fc->log = log;
+
+    fc->recv = ngx_http_v2_upstream_recv;
+    fc->send = ngx_http_v2_upstream_send;
+    fc->recv_chain = ngx_http_v2_upstream_recv_chain;
+    fc->send_chain = ngx_http_v2_upstream_send_chain;
+
+    fc->tcp_nodelay = NGX_TCP_NODELAY_DISABLED;
+    fc->tcp_nopush = NGX_TCP_NOPUSH_DISABLED;
+
+    rev->data = fc;
+    rev->log = log;
+    rev->index = NGX_INVALID_INDEX;
+    rev->active = 1;
+
+    wev->data = fc;
+    wev->log = log;
+    wev->index = NGX_INVALID_INDEX;
+    wev->write = 1;
+    wev->ready = 1;
+
+    stream->pool = pool;
+    stream->conn = h2c;
+    stream->recv_window = NGX_HTTP_V2_UPSTREAM_WINDOW;
+
+    ngx_queue_insert_tail(&h2c->streams, &stream->queue);
+    h2c->processing++;
+
+    if (c->idle) {
+        c->idle = 0;
+
+        if (c->read->timer_set) {
+            ngx_del_timer(c->read);
+        }
+    }
+
+    return stream;
+}
+
+
+static ngx_http_v2_upstream_stream_t *
+ngx_http_v2_upstream_find_stream(ngx_http_v2_upstream_connection_t *h2c,
+    ngx_uint_t sid)
+{
+    ngx_queue_t                    *q;
+    ngx_http_v2_upstream_stream_t  *stream;
+
+    for (q = ngx_queue_head(&h2c->streams);
+         q != ngx_queue_sentinel(&h2c->streams);
+         q = ngx_queue_next(q))
+    {
+        stream = ngx_queue_data(q, ngx_http_v2_upstream_stream_t, queue);
+
+        if (stream->sid == sid) {
+            return stream;
+        }
+    }
+
+    return NULL;
+}
+
+
+static void
+ngx_http_v2_upstream_close_stream(ngx_http_v2_upstream_stream_t *stream)
+{
+    ngx_connection_t                   *fc;
+    ngx_http_v2_upstream_connection_t  *h2c;
+
+    fc = &stream->connection;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, fc->log, 0,
+                   "close http2 upstream stream sid:%ui", stream->sid);
+
+    if (fc->read->timer_set) {
+        ngx_del_timer(fc->read);
+    }
+
+    if (fc->write->timer_set) {
+        ngx_del_timer(fc->write);
+    }
+
+    if (fc->read->posted) {
+        ngx_delete_posted_event(fc->read);
+    }
+
+    if (fc->write->posted) {
+        ngx_delete_posted_event(fc->write);
+    }
+
+    h2c = stream->conn;
+
+    if (h2c) {
+        ngx_http_v2_upstream_reset_stream(stream,
+                                          stream->remote_closed
+                                          ? NGX_HTTP_V2_NO_ERROR
+                                          : NGX_HTTP_V2_CANCEL);
+
+        ngx_queue_remove(&stream->queue);
+
+        if (ngx_queue_empty(&h2c->streams)) {
+            ngx_http_v2_upstream_set_idle(h2c);
+
+        } else {
+            ngx_http_v2_upstream_post_flush(h2c);
+        }
+    }
+
+    ngx_destroy_pool(stream->pool);
+}
+
+
+static void
+ngx_http_v2_upstream_reset_stream(ngx_http_v2_upstream_stream_t *stream,
+    ngx_uint_t status)
+{
+    u_char                             *p;
+    ngx_http_v2_upstream_connection_t  *h2c;
+
+    if (stream->closed) {
+        return;
+    }
+
+    h2c = stream->conn;
+
+    stream->closed = 1;
+    h2c->processing--;
+
+    if (stream->sid == 0) {
+        return;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, h2c->log, 0,
+                   "http2 upstream send RST_STREAM sid:%ui status:%ui",
+                   stream->sid, status);
+
+    p = ngx_http_v2_upstream_get_frame(h2c, NGX_HTTP_V2_RST_STREAM_SIZE,
+                                       NGX_HTTP_V2_RST_STREAM_FRAME,
+                                       NGX_HTTP_V2_NO_FLAG, stream->sid, 1);
+    if (p == NULL) {
+
+        /* the peer still considers the stream open */
+
+        h2c->goaway = 1;
+        return;
+    }
+
+    (void) ngx_http_v2_write_uint32(p, status);
+
+    ngx_http_v2_upstream_post_flush(h2c);
+}
+
+
+static void
+ngx_http_v2_upstream_stream_error(ngx_http_v2_upstream_stream_t *stream)
+{
+    stream->error = 1;
+
+    if (stream->out) {
+        stream->tail->next = stream->free;
+        stream->free = stream->out;
+        stream->out = NULL;
+        stream->tail = NULL;
+        stream->buffered = 0;
+    }
+
+    stream->blocked = 0;
+
+    ngx_http_v2_upstream_post(stream->connection.read);
+    ngx_http_v2_upstream_post(stream->connection.write);
+}
+
+
+static void
+ngx_http_v2_upstream_check_closed(ngx_http_v2_upstream_stream_t *stream)
+{
+    if (stream->local_closed && stream->remote_closed && !stream->closed) {
+        stream->closed = 1;
+        stream->conn->processing--;
+    }
+}
+
+
+static void
+ngx_http_v2_upstream_post(ngx_event_t *ev)
+{
+    ev->ready = 1;
+    ev->active = 0;
+
+    if (!ev->posted) {
+        ngx_post_event(ev, &ngx_posted_events);
+    }
+}
+
+
+static ssize_t
+ngx_http_v2_upstream_recv(ngx_connection_t *fc, u_char *buf, size_t size)
+{
+    size_t                          n, len;
+    ngx_buf_t                      *b;
+    ngx_chain_t                    *cl;
+    ngx_http_v2_upstream_stream_t  *stream;
+
+    stream = (ngx_http_v2_upstream_stream_t *) fc;
+
+    n = 0;
+
+    while (size && stream->out) {
+        cl = stream->out;
+        b = cl->buf;
+
+        len = ngx_min((size_t) (b->last - b->pos), size);
+
+        buf = ngx_cpymem(buf, b->pos, len);
+        b->pos += len;
+
+        size -= len;
+        n += len;
+
+        if (b->pos == b->last) {
+            b->pos = b->start;
+            b->last = b->start;
+
+            stream->out = cl->next;
+
+            if (stream->out == NULL) {
+                stream->tail = NULL;
+            }
+
+            cl->next = stream->free;
+            stream->free = cl;
+        }
+    }
+
+    if (n) {
+        stream->buffered -= n;
+
+        ngx_http_v2_upstream_update_window(stream);
+
+        if (stream->out == NULL && !stream->remote_closed && !stream->error) {
+            fc->read->ready = 0;
+            fc->read->active = 1;
+        }
+
+        return n;
+    }
+
+    if (stream->error) {
+        fc->read->error = 1;
+        return NGX_ERROR;
+    }
+
+    if (stream->remote_closed) {
+        fc->read->eof = 1;
+        return 0;
+    }
+
+    fc->read->ready = 0;
+    fc->read->active = 1;
+
+    return NGX_AGAIN;
+}
+
+
+static ssize_t
+ngx_http_v2_upstream_recv_chain(ngx_connection_t *fc, ngx_chain_t *cl,
+    off_t limit)
+{
+    size_t      size;
+    ssize_t     n, total;
+    ngx_buf_t  *b;
+
+    total = 0;
+
+    for ( /* void */ ; cl; cl = cl->next) {
+        b = cl->buf;
+
+        size = b->end - b->last;
+
+        if (limit) {
+            if (total >= limit) {
+                break;
+            }
+
+            if ((off_t) size > limit - total) {
+                size = (size_t) (limit - total);
+            }
+        }
+
+        if (size == 0) {
+            continue;
+        }
+
+        n = ngx_http_v2_upstream_recv(fc, b->last, size);
+
+        if (n <= 0) {
+            return total ? total : n;
+        }
+
+        total += n;
+
+        if ((size_t) n < size) {
+            break;
+        }
+    }
+
+    return total;
+}
+
+
+static ssize_t
+ngx_http_v2_upstream_send(ngx_connection_t *fc, u_char *buf, size_t size)
+{
+    ngx_buf_t     b;
+    ngx_chain_t   cl, *rc;
+
+    ngx_memzero(&b, sizeof(ngx_buf_t));
+
+    b.temporary = 1;
+    b.pos = buf;
+    b.last = buf + size;
+
+    cl.buf = &b;
+    cl.next = NULL;
+
+    rc = ngx_http_v2_upstream_send_chain(fc, &cl, 0);
+
+    if (rc == NGX_CHAIN_ERROR) {
+        return NGX_ERROR;
+    }
+
+    return (b.pos == buf) ? NGX_AGAIN : b.pos - buf;
+}
+
+
+static ngx_chain_t *
+ngx_http_v2_upstream_send_chain(ngx_connection_t *fc, ngx_chain_t *in,
+    off_t limit)
+{
+    u_char                         *pos;
+    ngx_buf_t                      *b;
+    ngx_int_t                       rc;
+    ngx_http_v2_upstream_stream_t  *stream;
+
+    stream = (ngx_http_v2_upstream_stream_t *) fc;
+
+    if (stream->error) {
+        fc->write->error = 1;
+        return NGX_CHAIN_ERROR;
+    }
+
+    for ( /* void */ ; in; in = in->next) {
+        b = in->buf;
+
+        if (ngx_buf_special(b)) {
+            continue;
+        }
+
+        if (!ngx_buf_in_memory(b)) {
+            ngx_log_error(NGX_LOG_ALERT, fc->log, 0,
+                          "http2 upstream: file buffer in request");
+            return NGX_CHAIN_ERROR;
+        }
+
+        while (b->pos < b->last) {
+
+            pos = b->pos;
+
+            if (stream->closed || stream->conn == NULL) {
+
+                /* the response is complete, discard the request */
+
+                b->pos = b->last;
+                fc->sent += b->pos - pos;
+                continue;
+            }
+
+            rc = ngx_http_v2_upstream_write_frame(stream, b);
+
+            fc->sent += b->pos - pos;
+
+            if (rc == NGX_ERROR) {
+                return NGX_CHAIN_ERROR;
+            }
+
+            if (rc == NGX_AGAIN) {
+                goto blocked;
+            }
+        }
+    }
+
+    if (stream->headers_pending) {
+        rc = ngx_http_v2_upstream_send_headers(stream);
+
+        if (rc == NGX_ERROR) {
+            return NGX_CHAIN_ERROR;
+        }
+
+        if (rc == NGX_AGAIN) {
+
+            /* the headers are sent by ngx_http_v2_upstream_wake() */
+
+            stream->blocked = 1;
+        }
+    }
+
+    if (stream->conn) {
+        ngx_http_v2_upstream_post_flush(stream->conn);
+    }
+
+    return NULL;
+
+blocked:
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, fc->log, 0,
+                   "http2 upstream stream sid:%ui blocked", stream->sid);
+
+    stream->blocked = 1;
+
+    fc->write->ready = 0;
+    fc->write->active = 1;
+
+    ngx_http_v2_upstream_post_flush(stream->conn);
+
+    return in;
+}
+
+
+static ngx_int_t
+ngx_http_v2_upstream_write_frame(ngx_http_v2_upstream_stream_t *stream,
+    ngx_buf_t *b)
+{
+    size_t    n;
+    uint32_t  head;
+
+    if (stream->frame_len < NGX_HTTP_V2_FRAME_HEADER_SIZE) {
+
+        n = ngx_min((size_t) (b->last - b->pos),
+                    NGX_HTTP_V2_FRAME_HEADER_SIZE - stream->frame_len);
+
+        ngx_memcpy(stream->frame + stream->frame_len, b->pos, n);
+
+        b->pos += n;
+        stream->frame_len += n;
+
+        if (stream->frame_len < NGX_HTTP_V2_FRAME_HEADER_SIZE) {
+            return NGX_OK;
+        }
+
+        /* the stream identifier is assigned here and ignored */
+
+        head = ngx_http_v2_parse_uint32(stream->frame);
+
+        stream->rest = ngx_http_v2_parse_length(head);
+        stream->type = ngx_http_v2_parse_type(head);
+        stream->flags = stream->frame[4];
+
+        ngx_log_debug3(NGX_LOG_DEBUG_HTTP, stream->connection.log, 0,
+                       "http2 upstream write frame type:%ui f:%Xi l:%uz",
+                       stream->type, stream->flags, stream->rest);
+
+        if (stream->end_stream) {
+            goto invalid;
+        }
+
+        switch (stream->type) {
+
+        case NGX_HTTP_V2_HEADERS_FRAME:
+
+            /* trailers are not supported */
+
+            if (stream->sid || stream->request) {
+                goto invalid;
+            }
+
+            if (stream->flags & NGX_HTTP_V2_END_STREAM_FLAG) {
+                stream->end_stream = 1;
+            }
+
+            break;
+
+        case NGX_HTTP_V2_CONTINUATION_FRAME:
+
+            if (stream->request == NULL || stream->headers_pending) {
+                goto invalid;
+            }
+
+            break;
+
+        case NGX_HTTP_V2_DATA_FRAME:
+
+            if (stream->sid == 0 && !stream->headers_pending) {
+                goto invalid;
+            }
+
+            break;
+
+        default:
+            goto invalid;
+        }
+    }
+
+    if (stream->type == NGX_HTTP_V2_DATA_FRAME) {
+        return ngx_http_v2_upstream_send_data(stream, b);
+    }
+
+    return ngx_http_v2_upstream_read_header_block(stream, b);
+
+invalid:
+
+    ngx_log_error(NGX_LOG_ALERT, stream->connection.log, 0,
+                  "http2 upstream: unexpected frame type %ui in request",
+                  stream->type);
+
+    return NGX_ERROR;
+}
+
+
+static ngx_int_t
+ngx_http_v2_upstream_read_header_block(ngx_http_v2_upstream_stream_t *stream,
+    ngx_buf_t *b)
+{
+    u_char     *start;
+    size_t      n, size;
+    ngx_buf_t  *buf;
+
+    buf = stream->request;
+
+    n = ngx_min((size_t) (b->last - b->pos), stream->rest);
+
+    if (buf == NULL || (size_t) (buf->end - buf->last) < stream->rest) {
+
+        size = (buf ? buf->last - buf->pos : 0) + stream->rest;
+
+        if (size > NGX_HTTP_V2_UPSTREAM_REQUEST_SIZE) {
+            ngx_log_error(NGX_LOG_ERR, stream->connection.log, 0,
+                          "too large request header for http2 upstream");
+            return NGX_ERROR;
+        }
+
+        start = ngx_pnalloc(stream->pool, size);
+        if (start == NULL) {
+            return NGX_ERROR;
+        }
+
+        if (buf == NULL) {
+            buf = ngx_calloc_buf(stream->pool);
+            if (buf == NULL) {
+                return NGX_ERROR;
+            }
+
+            buf->last = start;
+
+            stream->request = buf;
+
+        } else {
+            buf->last = ngx_cpymem(start, buf->pos, buf->last - buf->pos);
+        }
+
+        buf->pos = start;
+        buf->start = start;
+        buf->end = start + size;
+    }
+
+    buf->last = ngx_cpymem(buf->last, b->pos, n);
+
+    b->pos += n;
+    stream->rest -= n;
+
+    if (stream->rest) {
+        return NGX_OK;
+    }
+
+    stream->frame_len = 0;
+
+    if (!(stream->flags & NGX_HTTP_V2_END_HEADERS_FLAG)) {
+        return NGX_OK;
+    }
+
+    stream->headers_pending = 1;
+
+    if (ngx_http_v2_upstream_send_headers(stream) == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    /* otherwise the headers are sent along with the body */
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_v2_upstream_send_headers(ngx_http_v2_upstream_stream_t *stream)
+{
+    u_char                             *p;
+    size_t                              len, size, frame_size, n;
+    ngx_buf_t                          *b;
+    ngx_uint_t                          type, flags;
+    ngx_http_v2_upstream_connection_t  *h2c;
+
+    h2c = stream->conn;
+
+    if (h2c == NULL || stream->closed) {
+        return NGX_ERROR;
+    }
+
+    b = stream->request;
+
+    len = b->last - b->pos;
+    frame_size = h2c->frame_size;
+
+    size = len + NGX_HTTP_V2_FRAME_HEADER_SIZE
+                 * ((len + frame_size - 1) / frame_size);
+
+    if (ngx_http_v2_upstream_space(h2c, size, 0) < size) {
+        return NGX_AGAIN;
+    }
+
+    if (h2c->goaway || h2c->next_sid > NGX_HTTP_V2_MAX_SID) {
+        return NGX_ERROR;
+    }
+
+    stream->sid = h2c->next_sid;
+    h2c->next_sid += 2;
+
+    stream->send_window = h2c->init_window;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, stream->connection.log, 0,
+                   "http2 upstream HEADERS sid:%ui len:%uz", stream->sid, len);
+
+    type = NGX_HTTP_V2_HEADERS_FRAME;
+    flags = stream->end_stream ? NGX_HTTP_V2_END_STREAM_FLAG
+                               : NGX_HTTP_V2_NO_FLAG;
+
+    do {
+        n = ngx_min(len, frame_size);
+
+        if (n == len) {
+            flags |= NGX_HTTP_V2_END_HEADERS_FLAG;
+        }
+
+        p = ngx_http_v2_upstream_get_frame(h2c, n, type, flags, stream->sid,
+                                           0);
+
+        ngx_memcpy(p, b->pos, n);
+
+        b->pos += n;
+        len -= n;
+
+        type = NGX_HTTP_V2_CONTINUATION_FRAME;
+        flags = NGX_HTTP_V2_NO_FLAG;
+
+    } while (len);
+
+    stream->headers_pending = 0;
+    stream->request = NULL;
+
+    if (stream->end_stream) {
+        stream->local_closed = 1;
+        ngx_http_v2_upstream_check_closed(stream);
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_v2_upstream_send_data(ngx_http_v2_upstream_stream_t *stream,
+    ngx_buf_t *b)
+{
+    u_char                             *p;
+    size_t                              size, space;
+    ngx_int_t                           rc;
+    ngx_uint_t                          flags, last;
+    ngx_http_v2_upstream_connection_t  *h2c;
+
+    h2c = stream->conn;
+
+    last = stream->flags & NGX_HTTP_V2_END_STREAM_FLAG;
+
+    if (stream->rest == 0) {
+
+        /* an empty frame */
+
+        stream->frame_len = 0;
+
+        if (!last) {
+            return NGX_OK;
+        }
+
+        stream->end_stream = 1;
+
+        if (stream->headers_pending) {
+
+            /* the flag is sent with the HEADERS frame */
+
+            return NGX_OK;
+        }
+
+        if (ngx_http_v2_upstream_get_frame(h2c, 0, NGX_HTTP_V2_DATA_FRAME,
+                                           NGX_HTTP_V2_END_STREAM_FLAG,
+                                           stream->sid, 1)
+            == NULL)
+        {
+            return NGX_ERROR;
+        }
+
+        stream->local_closed = 1;
+        ngx_http_v2_upstream_check_closed(stream);
+
+        return NGX_OK;
+    }
+
+    size = b->last - b->pos;
+
+    if (size == 0) {
+        return NGX_OK;
+    }
+
+    if (stream->headers_pending) {
+        rc = ngx_http_v2_upstream_send_headers(stream);
+
+        if (rc != NGX_OK) {
+            return rc;
+        }
+    }
+
+    if (stream->send_window <= 0 || h2c->send_window <= 0) {
+        return NGX_AGAIN;
+    }
+
+    size = ngx_min(size, stream->rest);
+    size = ngx_min(size, (size_t) stream->send_window);
+    size = ngx_min(size, (size_t) h2c->send_window);
+    size = ngx_min(size, h2c->frame_size);
+
+    space = ngx_http_v2_upstream_space(h2c,
+                                       size + NGX_HTTP_V2_FRAME_HEADER_SIZE, 0);
+
+    if (space <= NGX_HTTP_V2_FRAME_HEADER_SIZE) {
+        return NGX_AGAIN;
+    }
+
+    size = ngx_min(size, space - NGX_HTTP_V2_FRAME_HEADER_SIZE);
+
+    flags = (size == stream->rest && last) ? NGX_HTTP_V2_END_STREAM_FLAG
+                                           : NGX_HTTP_V2_NO_FLAG;
+
+    p = ngx_http_v2_upstream_get_frame(h2c, size, NGX_HTTP_V2_DATA_FRAME,
+                                       flags, stream->sid, 0);
+
+    ngx_memcpy(p, b->pos, size);
+
+    b->pos += size;
+
+    stream->rest -= size;
+    stream->send_window -= size;
+    h2c->send_window -= size;
+
+    if (stream->rest) {
+        return NGX_OK;
+    }
+
+    stream->frame_len = 0;
+
+    if (last) {
+        stream->end_stream = 1;
+        stream->local_closed = 1;
+        ngx_http_v2_upstream_check_closed(stream);
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_v2_upstream_update_window(ngx_http_v2_upstream_stream_t *stream)
+{
+    size_t                              used, window;
+    ngx_http_v2_upstream_connection_t  *h2c;
+
+    h2c = stream->conn;
+
+    if (h2c == NULL || stream->sid == 0 || stream->remote_closed
+        || stream->closed)
+    {
+        return;
+    }
+
+    used = stream->recv_window + stream->buffered;
+
+    if (used >= NGX_HTTP_V2_UPSTREAM_WINDOW) {
+        return;
+    }
+
+    window = NGX_HTTP_V2_UPSTREAM_WINDOW - used;
+
+    if (window < NGX_HTTP_V2_UPSTREAM_WINDOW / 2) {
+        return;
+    }
+
+    if (ngx_http_v2_upstream_send_window_update(h2c, stream->sid, window)
+        != NGX_OK)
+    {
+        /* retried by ngx_http_v2_upstream_wake() */
+        return;
+    }
+
+    stream->recv_window += window;
+
+    ngx_http_v2_upstream_post_flush(h2c);
+}
+
+
+static ngx_int_t
+ngx_http_v2_upstream_append(ngx_http_v2_upstream_stream_t *stream,
+    u_char *data, size_t len)
+{
+    size_t        n;
+    ngx_buf_t    *b;
+    ngx_chain_t  *cl;
+
+    stream->buffered += len;
+
+    while (len) {
+        cl = stream->tail;
+
+        if (cl == NULL || cl->buf->last == cl->buf->end) {
+
+            cl = stream->free;
+
+            if (cl) {
+                stream->free = cl->next;
+
+            } else {
+                cl = ngx_alloc_chain_link(stream->pool);
+                if (cl == NULL) {
+                    return NGX_ERROR;
+                }
+
+                cl->buf = ngx_create_temp_buf(stream->pool,
+                                              NGX_HTTP_V2_UPSTREAM_BUFFER_SIZE);
+                if (cl->buf == NULL) {
+                    return NGX_ERROR;
+                }
+            }
+
+            cl->next = NULL;
+
+            if (stream->tail) {
+                stream->tail->next = cl;
+
+            } else {
+                stream->out = cl;
+            }
+
+            stream->tail = cl;
+        }
+
+        b = cl->buf;
+
+        n = ngx_min(len, (size_t) (b->end - b->last));
+
+        b->last = ngx_cpymem(b->last, data, n);
+
+        data += n;
+        len -= n;
+    }
+
+    return NGX_OK;
+}
+
+
+static size_t
+ngx_http_v2_upstream_space(ngx_http_v2_upstream_connection_t *h2c,
+    size_t size, ngx_uint_t control)
+{
+    u_char     *end;
+    ngx_buf_t  *b;
+
+    b = &h2c->out;
+
+    end = control ? b->end : b->end - NGX_HTTP_V2_UPSTREAM_RESERVE;
+
+    if (end - b->last < (ssize_t) size && b->pos != b->start) {
+        b->last = ngx_movemem(b->start, b->pos, b->last - b->pos);
+        b->pos = b->start;
+    }
+
+    return (end > b->last) ? (size_t) (end - b->last) : 0;
+}
+
+
+static u_char *
+ngx_http_v2_upstream_get_frame(ngx_http_v2_upstream_connection_t *h2c,
+    size_t len, ngx_uint_t type, ngx_uint_t flags, ngx_uint_t sid,
+    ngx_uint_t control)
+{
+    u_char  *p;
+    size_t   size;
+
+    size = NGX_HTTP_V2_FRAME_HEADER_SIZE + len;
+
+    if (ngx_http_v2_upstream_space(h2c, size, control) < size) {
+        ngx_log_error(NGX_LOG_ERR, h2c->log, 0,
+                      "http2 upstream output buffer is full");
+        return NULL;
+    }
+
+    p = h2c->out.last;
+
+    p = ngx_http_v2_write_uint32(p, len << 8 | type);
+    *p++ = (u_char) flags;
+    p = ngx_http_v2_write_sid(p, sid);
+
+    h2c->out.last = p + len;
+
+    return p;
+}
+
+
+static ngx_int_t
+ngx_http_v2_upstream_send_window_update(ngx_http_v2_upstream_connection_t *h2c,
+    ngx_uint_t sid, size_t window)
+{
+    u_char  *p;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, h2c->log, 0,
+                   "http2 upstream send WINDOW_UPDATE sid:%ui window:%uz",
+                   sid, window);
+
+    p = ngx_http_v2_upstream_get_frame(h2c, NGX_HTTP_V2_WINDOW_UPDATE_SIZE,
+                                       NGX_HTTP_V2_WINDOW_UPDATE_FRAME,
+                                       NGX_HTTP_V2_NO_FLAG, sid, 1);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    (void) ngx_http_v2_write_uint32(p, window);
+
+    return NGX_OK;
+}
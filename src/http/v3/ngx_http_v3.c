@@ -0,0 +1,723 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+typedef struct {
+    ngx_http_v3_parse_t            parse;
+    uint64_t                       type;
+    ngx_uint_t                     param;
+    unsigned                       typed:1;
+    unsigned                       critical:1;
+    unsigned                       frame:1;
+    unsigned                       settings:1;
+} ngx_http_v3_uni_stream_t;
+
+
+static void ngx_http_v3_init(ngx_connection_t *c);
+static void ngx_http_v3_cleanup_session(void *data);
+static void ngx_http_v3_keepalive_handler(ngx_event_t *ev);
+static void ngx_http_v3_control_handler(ngx_event_t *ev);
+static ngx_int_t ngx_http_v3_send_control(ngx_connection_t *c, u_char *buf,
+    size_t len);
+
+static void ngx_http_v3_init_uni_stream(ngx_connection_t *c);
+static void ngx_http_v3_uni_read_handler(ngx_event_t *rev);
+static ngx_int_t ngx_http_v3_uni_stream_type(ngx_connection_t *c,
+    ngx_http_v3_uni_stream_t *us);
+static ngx_int_t ngx_http_v3_parse_control(ngx_connection_t *c,
+    ngx_http_v3_uni_stream_t *us, u_char *pos, u_char *end);
+static ngx_int_t ngx_http_v3_parse_encoder(ngx_connection_t *c, u_char *pos,
+    u_char *end);
+static void ngx_http_v3_close_uni_stream(ngx_connection_t *c);
+
+
+void
+ngx_http_v3_init_stream(ngx_connection_t *c)
+{
+    ngx_http_connection_t     *hc, *phc;
+    ngx_http_core_loc_conf_t  *clcf;
+
+    hc = c->data;
+
+    hc->ssl = 1;
+
+    if (c->quic == NULL) {
+        ngx_http_v3_init(c);
+        return;
+    }
+
+    /* the virtual server is chosen by SNI of the QUIC connection */
+
+    phc = c->quic->parent->data;
+
+    if (phc->ssl_servername) {
+        hc->ssl_servername = phc->ssl_servername;
+#if (NGX_PCRE)
+        hc->ssl_servername_regex = phc->ssl_servername_regex;
+#endif
+        hc->conf_ctx = phc->conf_ctx;
+
+        clcf = ngx_http_get_module_loc_conf(hc->conf_ctx,
+                                            ngx_http_core_module);
+
+        ngx_set_connection_log(c, clcf->error_log);
+    }
+
+    if (c->quic->id & NGX_QUIC_STREAM_UNIDIRECTIONAL) {
+        ngx_http_v3_init_uni_stream(c);
+        return;
+    }
+
+    ngx_http_v3_init_request_stream(c);
+}
+
+
+static void
+ngx_http_v3_init(ngx_connection_t *c)
+{
+    ngx_pool_cleanup_t        *cln;
+    ngx_http_connection_t     *hc;
+    ngx_http_v3_session_t     *h3c;
+    ngx_http_v3_srv_conf_t    *h3scf;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0, "http3 init");
+
+    hc = c->data;
+
+    h3c = ngx_pcalloc(c->pool, sizeof(ngx_http_v3_session_t));
+    if (h3c == NULL) {
+        ngx_http_close_connection(c);
+        return;
+    }
+
+    h3c->connection = c;
+
+    h3c->keepalive.log = c->log;
+    h3c->keepalive.data = c;
+    h3c->keepalive.handler = ngx_http_v3_keepalive_handler;
+
+    cln = ngx_pool_cleanup_add(c->pool, 0);
+    if (cln == NULL) {
+        ngx_http_close_connection(c);
+        return;
+    }
+
+    cln->handler = ngx_http_v3_cleanup_session;
+    cln->data = h3c;
+
+    hc->v3_session = h3c;
+
+    h3scf = ngx_http_get_module_srv_conf(hc->conf_ctx, ngx_http_v3_module);
+
+    c->log->action = "QUIC handshaking";
+
+    ngx_quic_run(c, &h3scf->quic);
+}
+
+
+static void
+ngx_http_v3_cleanup_session(void *data)
+{
+    ngx_http_v3_session_t  *h3c = data;
+
+    if (h3c->keepalive.timer_set) {
+        ngx_del_timer(&h3c->keepalive);
+    }
+
+    if (h3c->keepalive.posted) {
+        ngx_delete_posted_event(&h3c->keepalive);
+    }
+}
+
+
+static void
+ngx_http_v3_keepalive_handler(ngx_event_t *ev)
+{
+    ngx_connection_t  *c;
+
+    c = ev->data;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0, "http3 keepalive handler");
+
+    ngx_http_v3_finalize_connection(c, NGX_HTTP_V3_ERR_NO_ERROR,
+                                    "keepalive timeout");
+}
+
+
+void
+ngx_http_v3_init_session(ngx_connection_t *c)
+{
+    u_char                    *p, buf[NGX_HTTP_V3_VARLEN_INT_LEN * 6];
+    ngx_connection_t          *sc;
+    ngx_http_connection_t     *hc;
+    ngx_http_v3_session_t     *h3c;
+    ngx_http_core_srv_conf_t  *cscf;
+
+    hc = c->data;
+    h3c = hc->v3_session;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0, "http3 init session");
+
+    c->log->action = "waiting for request";
+
+    /* RFC 9114, 6.2.1.  Control Streams */
+
+    sc = ngx_quic_open_stream(c, 0);
+    if (sc == NULL) {
+        goto failed;
+    }
+
+    sc->data = h3c;
+    sc->read->handler = ngx_http_v3_control_handler;
+    sc->write->handler = ngx_http_v3_control_handler;
+
+    h3c->control = sc;
+
+    cscf = ngx_http_get_module_srv_conf(hc->conf_ctx, ngx_http_core_module);
+
+    /* the dynamic table is not used, its capacity is 0 by default */
+
+    p = buf;
+
+    *p++ = NGX_HTTP_V3_STREAM_CONTROL;
+    *p++ = NGX_HTTP_V3_FRAME_SETTINGS;
+
+    *p++ = (u_char) (1 + (uintptr_t) ngx_http_v3_encode_varlen_int(NULL,
+                                    cscf->large_client_header_buffers.size));
+
+    *p++ = NGX_HTTP_V3_PARAM_MAX_FIELD_SECTION_SIZE;
+    p = ngx_http_v3_encode_varlen_int(p,
+                                      cscf->large_client_header_buffers.size);
+
+    if (ngx_http_v3_send_control(sc, buf, p - buf) != NGX_OK) {
+        goto failed;
+    }
+
+    return;
+
+failed:
+
+    ngx_http_v3_finalize_connection(c, NGX_HTTP_V3_ERR_INTERNAL_ERROR,
+                                    "failed to create control stream");
+}
+
+
+static void
+ngx_http_v3_control_handler(ngx_event_t *ev)
+{
+    ngx_connection_t       *c;
+    ngx_http_v3_session_t  *h3c;
+
+    c = ev->data;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0, "http3 control handler");
+
+    /* the stream lives as long as the connection */
+
+    if (ev->error) {
+        h3c = c->data;
+        h3c->control = NULL;
+
+        ngx_http_v3_close_uni_stream(c);
+    }
+}
+
+
+static ngx_int_t
+ngx_http_v3_send_control(ngx_connection_t *c, u_char *buf, size_t len)
+{
+    ssize_t  n;
+
+    /* control frames are small and are never blocked by flow control */
+
+    n = c->send(c, buf, len);
+
+    if (n != (ssize_t) len) {
+        ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                      "failed to send http3 control frame");
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+void
+ngx_http_v3_shutdown(ngx_connection_t *c)
+{
+    u_char                 *p, buf[NGX_HTTP_V3_VARLEN_INT_LEN + 2];
+    ngx_http_connection_t  *hc;
+    ngx_http_v3_session_t  *h3c;
+
+    hc = c->data;
+    h3c = hc->v3_session;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http3 shutdown, requests:%ui", h3c->nrequests);
+
+    if (h3c->goaway) {
+        return;
+    }
+
+    h3c->goaway = 1;
+
+    /* RFC 9114, 5.2.  Connection Shutdown */
+
+    if (h3c->control) {
+        p = buf;
+
+        *p++ = NGX_HTTP_V3_FRAME_GOAWAY;
+        *p++ = (u_char) (uintptr_t) ngx_http_v3_encode_varlen_int(NULL,
+                                                        h3c->next_request_id);
+        p = ngx_http_v3_encode_varlen_int(p, h3c->next_request_id);
+
+        (void) ngx_http_v3_send_control(h3c->control, buf, p - buf);
+    }
+
+    if (h3c->nrequests == 0) {
+        ngx_http_v3_finalize_connection(c, NGX_HTTP_V3_ERR_NO_ERROR,
+                                        "graceful shutdown");
+    }
+}
+
+
+static void
+ngx_http_v3_init_uni_stream(ngx_connection_t *c)
+{
+    ngx_http_v3_uni_stream_t  *us;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http3 init uni stream id:0x%xL", c->quic->id);
+
+    us = ngx_pcalloc(c->pool, sizeof(ngx_http_v3_uni_stream_t));
+    if (us == NULL) {
+        ngx_http_v3_finalize_connection(c, NGX_HTTP_V3_ERR_INTERNAL_ERROR,
+                                        "memory allocation error");
+        ngx_http_v3_close_uni_stream(c);
+        return;
+    }
+
+    c->data = us;
+
+    c->log->action = "reading client uni stream";
+
+    c->read->handler = ngx_http_v3_uni_read_handler;
+    c->write->handler = ngx_http_empty_handler;
+
+    ngx_http_v3_uni_read_handler(c->read);
+}
+
+
+static void
+ngx_http_v3_uni_read_handler(ngx_event_t *rev)
+{
+    u_char                     *p, *end, buf[512];
+    ssize_t                     n;
+    ngx_int_t                   rc;
+    ngx_connection_t           *c;
+    ngx_http_v3_uni_stream_t   *us;
+
+    c = rev->data;
+    us = c->data;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0, "http3 uni read handler");
+
+    for ( ;; ) {
+
+        n = c->recv(c, buf, sizeof(buf));
+
+        if (n == NGX_AGAIN) {
+            return;
+        }
+
+        if (n == 0 || n == NGX_ERROR) {
+            break;
+        }
+
+        p = buf;
+        end = buf + n;
+
+        if (!us->typed) {
+            rc = ngx_http_v3_parse_varlen_int(&us->parse, &p, end);
+
+            if (rc == NGX_AGAIN) {
+                continue;
+            }
+
+            us->type = us->parse.value;
+            us->typed = 1;
+
+            rc = ngx_http_v3_uni_stream_type(c, us);
+
+            if (rc == NGX_DECLINED) {
+                ngx_http_v3_close_uni_stream(c);
+                return;
+            }
+
+            if (rc != NGX_OK) {
+                goto failed;
+            }
+        }
+
+        switch (us->type) {
+
+        case NGX_HTTP_V3_STREAM_CONTROL:
+            rc = ngx_http_v3_parse_control(c, us, p, end);
+            break;
+
+        case NGX_HTTP_V3_STREAM_ENCODER:
+            rc = ngx_http_v3_parse_encoder(c, p, end);
+            break;
+
+        default: /* NGX_HTTP_V3_STREAM_DECODER */
+
+            /* no dynamic table entries are ever referenced */
+            rc = NGX_OK;
+        }
+
+        if (rc != NGX_OK) {
+            goto failed;
+        }
+    }
+
+    /* RFC 9114, 6.2.1, RFC 9204, 4.2: closure of a critical stream */
+
+    if (us->critical) {
+        ngx_http_v3_finalize_connection(c,
+                                        NGX_HTTP_V3_ERR_CLOSED_CRITICAL_STREAM,
+                                        "closed critical stream");
+    }
+
+failed:
+
+    ngx_http_v3_close_uni_stream(c);
+}
+
+
+static ngx_int_t
+ngx_http_v3_uni_stream_type(ngx_connection_t *c, ngx_http_v3_uni_stream_t *us)
+{
+    ngx_http_v3_session_t  *h3c;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http3 uni stream type:0x%xL", us->type);
+
+    h3c = ngx_http_v3_get_session(c);
+
+    switch (us->type) {
+
+    case NGX_HTTP_V3_STREAM_CONTROL:
+    case NGX_HTTP_V3_STREAM_ENCODER:
+    case NGX_HTTP_V3_STREAM_DECODER:
+
+        if (h3c->known_streams[us->type]) {
+            ngx_http_v3_finalize_connection(c,
+                                        NGX_HTTP_V3_ERR_STREAM_CREATION_ERROR,
+                                        "duplicate uni stream");
+            return NGX_ERROR;
+        }
+
+        h3c->known_streams[us->type] = c;
+        us->critical = 1;
+
+        return NGX_OK;
+
+    case NGX_HTTP_V3_STREAM_PUSH:
+
+        /* a client cannot push */
+
+        ngx_http_v3_finalize_connection(c,
+                                        NGX_HTTP_V3_ERR_STREAM_CREATION_ERROR,
+                                        "client push stream");
+        return NGX_ERROR;
+
+    default:
+
+        /* RFC 9114, 6.2.3.  Reserved Stream Types */
+
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                       "http3 unknown uni stream");
+
+        (void) ngx_quic_shutdown_stream(c, NGX_READ_SHUTDOWN);
+
+        return NGX_DECLINED;
+    }
+}
+
+
+static ngx_int_t
+ngx_http_v3_parse_control(ngx_connection_t *c, ngx_http_v3_uni_stream_t *us,
+    u_char *pos, u_char *end)
+{
+    u_char               *p;
+    size_t                size;
+    ngx_int_t             rc;
+    ngx_http_v3_parse_t  *st;
+
+    st = &us->parse;
+
+    for ( ;; ) {
+
+        if (us->frame && st->length == 0) {
+
+            /* the end of a frame, a setting needs both id and value */
+
+            if (st->left || us->param % 2) {
+                ngx_http_v3_finalize_connection(c,
+                                                NGX_HTTP_V3_ERR_FRAME_ERROR,
+                                                "malformed settings frame");
+                return NGX_ERROR;
+            }
+
+            us->frame = 0;
+        }
+
+        if (pos == end) {
+            return NGX_OK;
+        }
+
+        if (!us->frame) {
+
+            rc = ngx_http_v3_parse_frame(st, &pos, end);
+
+            if (rc == NGX_AGAIN) {
+                return NGX_OK;
+            }
+
+            ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                           "http3 control frame type:0x%xL len:%uL",
+                           st->type, st->length);
+
+            if (!us->settings) {
+                if (st->type != NGX_HTTP_V3_FRAME_SETTINGS) {
+                    ngx_http_v3_finalize_connection(c,
+                                            NGX_HTTP_V3_ERR_MISSING_SETTINGS,
+                                            "missing settings");
+                    return NGX_ERROR;
+                }
+
+                us->settings = 1;
+
+            } else if (st->type == NGX_HTTP_V3_FRAME_SETTINGS) {
+                goto unexpected;
+            }
+
+            switch (st->type) {
+
+            case NGX_HTTP_V3_FRAME_DATA:
+            case NGX_HTTP_V3_FRAME_HEADERS:
+            case NGX_HTTP_V3_FRAME_PUSH_PROMISE:
+
+            /* RFC 9114, 7.2.8.  HTTP/2 frame types are reserved */
+            case 0x02:
+            case 0x06:
+            case 0x08:
+            case 0x09:
+                goto unexpected;
+            }
+
+            us->frame = 1;
+            us->param = 0;
+
+            continue;
+        }
+
+        size = ngx_min((uint64_t) (end - pos), st->length);
+
+        if (st->type != NGX_HTTP_V3_FRAME_SETTINGS) {
+
+            /* GOAWAY, MAX_PUSH_ID, CANCEL_PUSH and unknown frames */
+
+            pos += size;
+            st->length -= size;
+
+            continue;
+        }
+
+        p = pos;
+
+        rc = ngx_http_v3_parse_varlen_int(st, &pos, pos + size);
+
+        st->length -= pos - p;
+
+        if (rc == NGX_AGAIN) {
+            continue;
+        }
+
+        if (us->param++ % 2) {
+            continue;
+        }
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                       "http3 setting id:0x%xL", st->value);
+
+        if (st->value >= 0x02 && st->value <= 0x05) {
+            ngx_http_v3_finalize_connection(c, NGX_HTTP_V3_ERR_SETTINGS_ERROR,
+                                            "reserved setting");
+            return NGX_ERROR;
+        }
+    }
+
+unexpected:
+
+    ngx_http_v3_finalize_connection(c, NGX_HTTP_V3_ERR_FRAME_UNEXPECTED,
+                                    "unexpected frame on control stream");
+    return NGX_ERROR;
+}
+
+
+static ngx_int_t
+ngx_http_v3_parse_encoder(ngx_connection_t *c, u_char *pos, u_char *end)
+{
+    /*
+     * RFC 9204, 4.3.  Encoder Instructions: with the maximum table
+     * capacity of 0 the only valid instruction is setting it to 0
+     */
+
+    while (pos < end) {
+        if (*pos++ != 0x20) {
+            ngx_http_v3_finalize_connection(c,
+                                        NGX_HTTP_V3_ERR_ENCODER_STREAM_ERROR,
+                                        "dynamic table is not supported");
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_v3_close_uni_stream(ngx_connection_t *c)
+{
+    ngx_pool_t  *pool;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0, "http3 close uni stream");
+
+#if (NGX_STAT_STUB)
+    (void) ngx_atomic_fetch_add(ngx_stat_active, -1);
+#endif
+
+    c->destroyed = 1;
+
+    pool = c->pool;
+
+    ngx_close_connection(c);
+
+    ngx_destroy_pool(pool);
+}
+
+
+ngx_int_t
+ngx_http_v3_parse_varlen_int(ngx_http_v3_parse_t *st, u_char **pos,
+    u_char *end)
+{
+    u_char  *p;
+
+    /* RFC 9000, 16.  Variable-Length Integer Encoding */
+
+    for (p = *pos; p < end; p++) {
+
+        if (st->left == 0) {
+            st->left = 1 << (*p >> 6);
+            st->value = *p & 0x3f;
+
+        } else {
+            st->value = (st->value << 8) | *p;
+        }
+
+        if (--st->left == 0) {
+            *pos = p + 1;
+            return NGX_DONE;
+        }
+    }
+
+    *pos = p;
+
+    return NGX_AGAIN;
+}
+
+
+ngx_int_t
+ngx_http_v3_parse_frame(ngx_http_v3_parse_t *st, u_char **pos, u_char *end)
+{
+    ngx_int_t  rc;
+
+    /* RFC 9114, 7.1.  Frame Layout: type and length */
+
+    for ( ;; ) {
+        rc = ngx_http_v3_parse_varlen_int(st, pos, end);
+
+        if (rc == NGX_AGAIN) {
+            return NGX_AGAIN;
+        }
+
+        if (st->state == 0) {
+            st->type = st->value;
+            st->state = 1;
+            continue;
+        }
+
+        st->length = st->value;
+        st->state = 0;
+
+        return NGX_DONE;
+    }
+}
+
+
+u_char *
+ngx_http_v3_encode_varlen_int(u_char *p, uint64_t value)
+{
+    if (value <= 63) {
+        if (p == NULL) {
+            return (u_char *) 1;
+        }
+
+        *p++ = (u_char) value;
+        return p;
+    }
+
+    if (value <= 16383) {
+        if (p == NULL) {
+            return (u_char *) 2;
+        }
+
+        *p++ = 0x40 | (u_char) (value >> 8);
+        *p++ = (u_char) value;
+        return p;
+    }
+
+    if (value <= 1073741823) {
+        if (p == NULL) {
+            return (u_char *) 4;
+        }
+
+        *p++ = 0x80 | (u_char) (value >> 24);
+        *p++ = (u_char) (value >> 16);
+        *p++ = (u_char) (value >> 8);
+        *p++ = (u_char) value;
+        return p;
+    }
+
+    if (p == NULL) {
+        return (u_char *) 8;
+    }
+
+    *p++ = 0xc0 | (u_char) (value >> 56);
+    *p++ = (u_char) (value >> 48);
+    *p++ = (u_char) (value >> 40);
+    *p++ = (u_char) (value >> 32);
+    *p++ = (u_char) (value >> 24);
+    *p++ = (u_char) (value >> 16);
+    *p++ = (u_char) (value >> 8);
+    *p++ = (u_char) value;
+    return p;
+}
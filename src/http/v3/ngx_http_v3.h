@@ -0,0 +1,127 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#ifndef _NGX_HTTP_V3_H_INCLUDED_
+#define _NGX_HTTP_V3_H_INCLUDED_
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+#define NGX_HTTP_V3_ALPN_ADVERTISE                 "\x02h3"
+
+#define NGX_HTTP_V3_VARLEN_INT_LEN                 8
+
+/* RFC 9114, 6.2.  Unidirectional Streams */
+#define NGX_HTTP_V3_STREAM_CONTROL                 0x00
+#define NGX_HTTP_V3_STREAM_PUSH                    0x01
+#define NGX_HTTP_V3_STREAM_ENCODER                 0x02
+#define NGX_HTTP_V3_STREAM_DECODER                 0x03
+
+/* 7.2.  Frame Definitions */
+#define NGX_HTTP_V3_FRAME_DATA                     0x00
+#define NGX_HTTP_V3_FRAME_HEADERS                  0x01
+#define NGX_HTTP_V3_FRAME_CANCEL_PUSH              0x03
+#define NGX_HTTP_V3_FRAME_SETTINGS                 0x04
+#define NGX_HTTP_V3_FRAME_PUSH_PROMISE             0x05
+#define NGX_HTTP_V3_FRAME_GOAWAY                   0x07
+#define NGX_HTTP_V3_FRAME_MAX_PUSH_ID              0x0d
+
+/* 7.2.4.1.  Defined SETTINGS Parameters, RFC 9204, 5.  Configuration */
+#define NGX_HTTP_V3_PARAM_MAX_TABLE_CAPACITY       0x01
+#define NGX_HTTP_V3_PARAM_MAX_FIELD_SECTION_SIZE   0x06
+#define NGX_HTTP_V3_PARAM_BLOCKED_STREAMS          0x07
+
+/* RFC 9114, 8.1.  HTTP/3 Error Codes */
+#define NGX_HTTP_V3_ERR_NO_ERROR                   0x100
+#define NGX_HTTP_V3_ERR_GENERAL_PROTOCOL_ERROR     0x101
+#define NGX_HTTP_V3_ERR_INTERNAL_ERROR             0x102
+#define NGX_HTTP_V3_ERR_STREAM_CREATION_ERROR      0x103
+#define NGX_HTTP_V3_ERR_CLOSED_CRITICAL_STREAM     0x104
+#define NGX_HTTP_V3_ERR_FRAME_UNEXPECTED           0x105
+#define NGX_HTTP_V3_ERR_FRAME_ERROR                0x106
+#define NGX_HTTP_V3_ERR_EXCESSIVE_LOAD             0x107
+#define NGX_HTTP_V3_ERR_ID_ERROR                   0x108
+#define NGX_HTTP_V3_ERR_SETTINGS_ERROR             0x109
+#define NGX_HTTP_V3_ERR_MISSING_SETTINGS           0x10a
+#define NGX_HTTP_V3_ERR_REQUEST_REJECTED           0x10b
+#define NGX_HTTP_V3_ERR_REQUEST_CANCELLED          0x10c
+#define NGX_HTTP_V3_ERR_REQUEST_INCOMPLETE         0x10d
+#define NGX_HTTP_V3_ERR_MESSAGE_ERROR              0x10e
+
+/* RFC 9204, 6.  Error Handling */
+#define NGX_HTTP_V3_ERR_DECOMPRESSION_FAILED       0x200
+#define NGX_HTTP_V3_ERR_ENCODER_STREAM_ERROR       0x201
+#define NGX_HTTP_V3_ERR_DECODER_STREAM_ERROR       0x202
+
+
+typedef struct {
+    ngx_quic_conf_t                quic;
+} ngx_http_v3_srv_conf_t;
+
+
+/* a frame header or a variable-length integer being parsed */
+
+struct ngx_http_v3_parse_s {
+    ngx_uint_t                     state;
+    ngx_uint_t                     left;
+    uint64_t                       value;
+    uint64_t                       type;
+    uint64_t                       length;
+    off_t                          received;
+};
+
+
+struct ngx_http_v3_session_s {
+    ngx_connection_t              *connection;
+    ngx_connection_t              *control;
+
+    ngx_connection_t              *known_streams[4];
+
+    ngx_event_t                    keepalive;
+    ngx_uint_t                     nrequests;
+
+    uint64_t                       next_request_id;
+
+    unsigned                       goaway:1;
+};
+
+
+#define ngx_http_v3_get_session(c)                                            \
+    ((ngx_http_connection_t *) ((c)->quic ? (c)->quic->parent->data           \
+                                          : (c)->data))->v3_session
+
+#define ngx_http_v3_finalize_connection(c, code, reason)                      \
+    ngx_quic_finalize_connection((c)->quic ? (c)->quic->parent : (c),        \
+                                 code, reason)
+
+
+void ngx_http_v3_init_stream(ngx_connection_t *c);
+void ngx_http_v3_init_session(ngx_connection_t *c);
+void ngx_http_v3_shutdown(ngx_connection_t *c);
+
+void ngx_http_v3_init_request_stream(ngx_connection_t *c);
+ngx_int_t ngx_http_v3_request_body_filter(ngx_http_request_t *r,
+    ngx_chain_t *in);
+
+ngx_int_t ngx_http_v3_parse_varlen_int(ngx_http_v3_parse_t *st, u_char **pos,
+    u_char *end);
+ngx_int_t ngx_http_v3_parse_frame(ngx_http_v3_parse_t *st, u_char **pos,
+    u_char *end);
+u_char *ngx_http_v3_encode_varlen_int(u_char *p, uint64_t value);
+
+ngx_int_t ngx_http_v3_parse_field_section(ngx_http_request_t *r, u_char *pos,
+    u_char *end, ngx_array_t *fields);
+ngx_int_t ngx_http_v3_lookup_static(ngx_str_t *name, ngx_str_t *value,
+    ngx_uint_t *exact);
+
+
+extern ngx_module_t  ngx_http_v3_module;
+
+
+#endif /* _NGX_HTTP_V3_H_INCLUDED_ */
@@ -0,0 +1,718 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include <nginx.h>
+
+
+/* RFC 9204, Appendix A.  Static Table */
+
+#define NGX_HTTP_V3_CONTENT_LENGTH_INDEX   4
+#define NGX_HTTP_V3_DATE_INDEX             6
+#define NGX_HTTP_V3_LAST_MODIFIED_INDEX    10
+#define NGX_HTTP_V3_LOCATION_INDEX         12
+#define NGX_HTTP_V3_STATUS_INDEX           24
+#define NGX_HTTP_V3_CONTENT_TYPE_INDEX     44
+#define NGX_HTTP_V3_VARY_INDEX             59
+#define NGX_HTTP_V3_SERVER_INDEX           92
+
+#define NGX_HTTP_V3_FRAME_HEADER_SIZE      (1 + NGX_HTTP_V3_VARLEN_INT_LEN)
+
+
+typedef struct {
+    ngx_chain_t         *free;
+    ngx_chain_t         *busy;
+} ngx_http_v3_filter_ctx_t;
+
+
+static ngx_uint_t ngx_http_v3_status_index(ngx_uint_t status);
+static u_char *ngx_http_v3_write_header(u_char *pos, ngx_int_t index,
+    ngx_str_t *name, ngx_str_t *value, u_char *tmp);
+static ngx_int_t ngx_http_v3_filter_init(ngx_conf_t *cf);
+
+
+static ngx_http_module_t  ngx_http_v3_filter_module_ctx = {
+    NULL,                                  /* preconfiguration */
+    ngx_http_v3_filter_init,               /* postconfiguration */
+
+    NULL,                                  /* create main configuration */
+    NULL,                                  /* init main configuration */
+
+    NULL,                                  /* create server configuration */
+    NULL,                                  /* merge server configuration */
+
+    NULL,                                  /* create location configuration */
+    NULL                                   /* merge location configuration */
+};
+
+
+ngx_module_t  ngx_http_v3_filter_module = {
+    NGX_MODULE_V1,
+    &ngx_http_v3_filter_module_ctx,        /* module context */
+    NULL,                                  /* module directives */
+    NGX_HTTP_MODULE,                       /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    NULL,                                  /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static ngx_http_output_header_filter_pt  ngx_http_next_header_filter;
+static ngx_http_output_body_filter_pt    ngx_http_next_body_filter;
+
+
+static ngx_int_t
+ngx_http_v3_header_filter(ngx_http_request_t *r)
+{
+    u_char                    *pos, *start, *p, *tmp;
+    size_t                     len, tmp_len;
+    ngx_str_t                  host, location, value;
+    ngx_buf_t                 *b;
+    ngx_uint_t                 i, port, index;
+    ngx_chain_t                out;
+    ngx_list_part_t           *part;
+    ngx_table_elt_t           *header;
+    ngx_connection_t          *c;
+    ngx_http_v3_filter_ctx_t  *ctx;
+    ngx_http_core_loc_conf_t  *clcf;
+    ngx_http_core_srv_conf_t  *cscf;
+    u_char                     addr[NGX_SOCKADDR_STRLEN];
+    u_char                     buf[NGX_INT_T_LEN];
+
+    static ngx_str_t  nginx = ngx_string("nginx");
+    static ngx_str_t  nginx_ver = ngx_string(NGINX_VER);
+    static ngx_str_t  nginx_ver_build = ngx_string(NGINX_VER_BUILD);
+
+    if (r->http_version != NGX_HTTP_VERSION_30) {
+        return ngx_http_next_header_filter(r);
+    }
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http3 header filter");
+
+    if (r->header_sent) {
+        return NGX_OK;
+    }
+
+    r->header_sent = 1;
+
+    if (r != r->main) {
+        return NGX_OK;
+    }
+
+    c = r->connection;
+
+    if (c->error) {
+        return NGX_ERROR;
+    }
+
+    if (r->method == NGX_HTTP_HEAD) {
+        r->header_only = 1;
+    }
+
+    switch (r->headers_out.status) {
+
+    case NGX_HTTP_OK:
+    case NGX_HTTP_PARTIAL_CONTENT:
+        break;
+
+    case NGX_HTTP_NO_CONTENT:
+        r->header_only = 1;
+
+        ngx_str_null(&r->headers_out.content_type);
+
+        r->headers_out.content_length = NULL;
+        r->headers_out.content_length_n = -1;
+
+        r->headers_out.last_modified_time = -1;
+        r->headers_out.last_modified = NULL;
+        break;
+
+    case NGX_HTTP_NOT_MODIFIED:
+        r->header_only = 1;
+        break;
+
+    default:
+        r->headers_out.last_modified_time = -1;
+        r->headers_out.last_modified = NULL;
+    }
+
+    /* the encoded field section prefix and :status */
+
+    len = 2 + 1 + NGX_HTTP_V2_INT_OCTETS + sizeof("418") - 1;
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+    if (r->headers_out.server == NULL) {
+
+        if (clcf->server_tokens == NGX_HTTP_SERVER_TOKENS_ON) {
+            len += 1 + NGX_HTTP_V2_INT_OCTETS + sizeof(NGINX_VER) - 1;
+
+        } else if (clcf->server_tokens == NGX_HTTP_SERVER_TOKENS_BUILD) {
+            len += 1 + NGX_HTTP_V2_INT_OCTETS + sizeof(NGINX_VER_BUILD) - 1;
+
+        } else {
+            len += 1 + NGX_HTTP_V2_INT_OCTETS + sizeof("nginx") - 1;
+        }
+    }
+
+    if (r->headers_out.date == NULL) {
+        len += 1 + NGX_HTTP_V2_INT_OCTETS + ngx_cached_http_time.len;
+    }
+
+    if (r->headers_out.content_type.len) {
+        len += 1 + NGX_HTTP_V2_INT_OCTETS + r->headers_out.content_type.len;
+
+        if (r->headers_out.content_type_len == r->headers_out.content_type.len
+            && r->headers_out.charset.len)
+        {
+            len += sizeof("; charset=") - 1 + r->headers_out.charset.len;
+        }
+    }
+
+    if (r->headers_out.content_length == NULL
+        && r->headers_out.content_length_n >= 0)
+    {
+        len += 1 + NGX_HTTP_V2_INT_OCTETS + NGX_OFF_T_LEN;
+    }
+
+    if (r->headers_out.last_modified == NULL
+        && r->headers_out.last_modified_time != -1)
+    {
+        len += 1 + NGX_HTTP_V2_INT_OCTETS
+               + sizeof("Wed, 31 Dec 1986 18:00:00 GMT") - 1;
+    }
+
+    if (r->headers_out.location && r->headers_out.location->value.len) {
+
+        if (r->headers_out.location->value.data[0] == '/'
+            && clcf->absolute_redirect)
+        {
+            if (clcf->server_name_in_redirect) {
+                cscf = ngx_http_get_module_srv_conf(r, ngx_http_core_module);
+                host = cscf->server_name;
+
+            } else if (r->headers_in.server.len) {
+                host = r->headers_in.server;
+
+            } else {
+                host.len = NGX_SOCKADDR_STRLEN;
+                host.data = addr;
+
+                if (ngx_connection_local_sockaddr(c, &host, 0) != NGX_OK) {
+                    return NGX_ERROR;
+                }
+            }
+
+            port = ngx_inet_get_port(c->local_sockaddr);
+
+            location.len = sizeof("https://") - 1 + host.len
+                           + r->headers_out.location->value.len;
+
+            if (clcf->port_in_redirect) {
+                port = (port == 443) ? 0 : port;
+
+            } else {
+                port = 0;
+            }
+
+            if (port) {
+                location.len += sizeof(":65535") - 1;
+            }
+
+            location.data = ngx_pnalloc(r->pool, location.len);
+            if (location.data == NULL) {
+                return NGX_ERROR;
+            }
+
+            p = ngx_cpymem(location.data, "https://", sizeof("https://") - 1);
+            p = ngx_cpymem(p, host.data, host.len);
+
+            if (port) {
+                p = ngx_sprintf(p, ":%ui", port);
+            }
+
+            p = ngx_cpymem(p, r->headers_out.location->value.data,
+                              r->headers_out.location->value.len);
+
+            /* update r->headers_out.location->value for possible logging */
+
+            r->headers_out.location->value.len = p - location.data;
+            r->headers_out.location->value.data = location.data;
+            ngx_str_set(&r->headers_out.location->key, "Location");
+        }
+
+        r->headers_out.location->hash = 0;
+
+        len += 1 + NGX_HTTP_V2_INT_OCTETS + r->headers_out.location->value.len;
+    }
+
+    tmp_len = len;
+
+#if (NGX_HTTP_GZIP)
+    if (r->gzip_vary) {
+        if (clcf->gzip_vary) {
+            len += 1;
+
+        } else {
+            r->gzip_vary = 0;
+        }
+    }
+#endif
+
+    part = &r->headers_out.headers.part;
+    header = part->elts;
+
+    for (i = 0; /* void */; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+
+            part = part->next;
+            header = part->elts;
+            i = 0;
+        }
+
+        if (header[i].hash == 0) {
+            continue;
+        }
+
+        if (header[i].key.len > NGX_HTTP_V2_MAX_FIELD) {
+            ngx_log_error(NGX_LOG_CRIT, c->log, 0,
+                          "too long response header name: \"%V\"",
+                          &header[i].key);
+            return NGX_ERROR;
+        }
+
+        if (header[i].value.len > NGX_HTTP_V2_MAX_FIELD) {
+            ngx_log_error(NGX_LOG_CRIT, c->log, 0,
+                          "too long response header value: \"%V: %V\"",
+                          &header[i].key, &header[i].value);
+            return NGX_ERROR;
+        }
+
+        len += 1 + NGX_HTTP_V2_INT_OCTETS + header[i].key.len
+                 + NGX_HTTP_V2_INT_OCTETS + header[i].value.len;
+
+        if (header[i].value.len > tmp_len) {
+            tmp_len = header[i].value.len;
+        }
+    }
+
+    tmp = ngx_palloc(r->pool, tmp_len);
+    b = ngx_create_temp_buf(r->pool, NGX_HTTP_V3_FRAME_HEADER_SIZE + len);
+
+    if (b == NULL || tmp == NULL) {
+        return NGX_ERROR;
+    }
+
+    /* the frame header is prepended when the payload size is known */
+
+    start = b->pos + NGX_HTTP_V3_FRAME_HEADER_SIZE;
+    pos = start;
+
+    /* RFC 9204, 4.5.1.  Encoded Field Section Prefix */
+
+    *pos++ = 0;
+    *pos++ = 0;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http3 output header: \":status: %03ui\"",
+                   r->headers_out.status);
+
+    index = ngx_http_v3_status_index(r->headers_out.status);
+
+    if (index) {
+        pos = ngx_http_v3_write_header(pos, index, NULL, NULL, tmp);
+
+    } else {
+        value.data = buf;
+        value.len = ngx_sprintf(buf, "%03ui", r->headers_out.status) - buf;
+
+        pos = ngx_http_v3_write_header(pos, NGX_HTTP_V3_STATUS_INDEX, NULL,
+                                       &value, tmp);
+    }
+
+    if (r->headers_out.server == NULL) {
+
+        if (clcf->server_tokens == NGX_HTTP_SERVER_TOKENS_ON) {
+            value = nginx_ver;
+
+        } else if (clcf->server_tokens == NGX_HTTP_SERVER_TOKENS_BUILD) {
+            value = nginx_ver_build;
+
+        } else {
+            value = nginx;
+        }
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                       "http3 output header: \"server: %V\"", &value);
+
+        pos = ngx_http_v3_write_header(pos, NGX_HTTP_V3_SERVER_INDEX, NULL,
+                                       &value, tmp);
+    }
+
+    if (r->headers_out.date == NULL) {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                       "http3 output header: \"date: %V\"",
+                       &ngx_cached_http_time);
+
+        value = ngx_cached_http_time;
+
+        pos = ngx_http_v3_write_header(pos, NGX_HTTP_V3_DATE_INDEX, NULL,
+                                       &value, tmp);
+    }
+
+    if (r->headers_out.content_type.len) {
+
+        if (r->headers_out.content_type_len == r->headers_out.content_type.len
+            && r->headers_out.charset.len)
+        {
+            len = r->headers_out.content_type.len + sizeof("; charset=") - 1
+                  + r->headers_out.charset.len;
+
+            p = ngx_pnalloc(r->pool, len);
+            if (p == NULL) {
+                return NGX_ERROR;
+            }
+
+            p = ngx_cpymem(p, r->headers_out.content_type.data,
+                           r->headers_out.content_type.len);
+
+            p = ngx_cpymem(p, "; charset=", sizeof("; charset=") - 1);
+
+            p = ngx_cpymem(p, r->headers_out.charset.data,
+                           r->headers_out.charset.len);
+
+            /* updated r->headers_out.content_type is also needed for logging */
+
+            r->headers_out.content_type.len = len;
+            r->headers_out.content_type.data = p - len;
+        }
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                       "http3 output header: \"content-type: %V\"",
+                       &r->headers_out.content_type);
+
+        pos = ngx_http_v3_write_header(pos, NGX_HTTP_V3_CONTENT_TYPE_INDEX,
+                                       NULL, &r->headers_out.content_type,
+                                       tmp);
+    }
+
+    if (r->headers_out.content_length == NULL
+        && r->headers_out.content_length_n >= 0)
+    {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                       "http3 output header: \"content-length: %O\"",
+                       r->headers_out.content_length_n);
+
+        value.data = buf;
+        value.len = ngx_sprintf(buf, "%O", r->headers_out.content_length_n)
+                    - buf;
+
+        pos = ngx_http_v3_write_header(pos, NGX_HTTP_V3_CONTENT_LENGTH_INDEX,
+                                       NULL, &value, tmp);
+    }
+
+    if (r->headers_out.last_modified == NULL
+        && r->headers_out.last_modified_time != -1)
+    {
+        p = ngx_pnalloc(r->pool, sizeof("Wed, 31 Dec 1986 18:00:00 GMT") - 1);
+        if (p == NULL) {
+            return NGX_ERROR;
+        }
+
+        value.data = p;
+        value.len = ngx_http_time(p, r->headers_out.last_modified_time) - p;
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                       "http3 output header: \"last-modified: %V\"", &value);
+
+        pos = ngx_http_v3_write_header(pos, NGX_HTTP_V3_LAST_MODIFIED_INDEX,
+                                       NULL, &value, tmp);
+    }
+
+    if (r->headers_out.location && r->headers_out.location->value.len) {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                       "http3 output header: \"location: %V\"",
+                       &r->headers_out.location->value);
+
+        pos = ngx_http_v3_write_header(pos, NGX_HTTP_V3_LOCATION_INDEX, NULL,
+                                       &r->headers_out.location->value, tmp);
+    }
+
+#if (NGX_HTTP_GZIP)
+    if (r->gzip_vary) {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                       "http3 output header: \"vary: accept-encoding\"");
+
+        /* "vary: accept-encoding" is in the static table as is */
+
+        pos = ngx_http_v3_write_header(pos, NGX_HTTP_V3_VARY_INDEX, NULL,
+                                       NULL, tmp);
+    }
+#endif
+
+    part = &r->headers_out.headers.part;
+    header = part->elts;
+
+    for (i = 0; /* void */; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+
+            part = part->next;
+            header = part->elts;
+            i = 0;
+        }
+
+        if (header[i].hash == 0) {
+            continue;
+        }
+
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                       "http3 output header: \"%V: %V\"",
+                       &header[i].key, &header[i].value);
+
+        pos = ngx_http_v3_write_header(pos, -1, &header[i].key,
+                                       &header[i].value, tmp);
+    }
+
+    /* RFC 9114, 7.2.2.  HEADERS */
+
+    len = pos - start;
+
+    b->pos = start - 1
+             - (uintptr_t) ngx_http_v3_encode_varlen_int(NULL, len);
+
+    p = b->pos;
+
+    *p++ = NGX_HTTP_V3_FRAME_HEADERS;
+    (void) ngx_http_v3_encode_varlen_int(p, len);
+
+    b->last = pos;
+
+    if (r->header_only) {
+        b->last_buf = 1;
+    }
+
+    ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_v3_filter_ctx_t));
+    if (ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_http_set_ctx(r, ctx, ngx_http_v3_filter_module);
+
+    out.buf = b;
+    out.next = NULL;
+
+    return ngx_http_write_filter(r, &out);
+}
+
+
+static ngx_uint_t
+ngx_http_v3_status_index(ngx_uint_t status)
+{
+    switch (status) {
+
+    case 103:
+        return 24;
+    case NGX_HTTP_OK:
+        return 25;
+    case NGX_HTTP_NOT_MODIFIED:
+        return 26;
+    case NGX_HTTP_NOT_FOUND:
+        return 27;
+    case NGX_HTTP_SERVICE_UNAVAILABLE:
+        return 28;
+    case 100:
+        return 63;
+    case NGX_HTTP_NO_CONTENT:
+        return 64;
+    case NGX_HTTP_PARTIAL_CONTENT:
+        return 65;
+    case NGX_HTTP_MOVED_TEMPORARILY:
+        return 66;
+    case NGX_HTTP_BAD_REQUEST:
+        return 67;
+    case NGX_HTTP_FORBIDDEN:
+        return 68;
+    case NGX_HTTP_MISDIRECTED_REQUEST:
+        return 69;
+    case 425:
+        return 70;
+    case NGX_HTTP_INTERNAL_SERVER_ERROR:
+        return 71;
+    }
+
+    return 0;
+}
+
+
+static u_char *
+ngx_http_v3_write_header(u_char *pos, ngx_int_t index, ngx_str_t *name,
+    ngx_str_t *value, u_char *tmp)
+{
+    ngx_uint_t  exact;
+
+    if (index == -1) {
+        index = ngx_http_v3_lookup_static(name, value, &exact);
+
+    } else {
+        exact = (value == NULL);
+    }
+
+    if (exact) {
+
+        /* RFC 9204, 4.5.2.  Indexed Field Line */
+
+        *pos = 0xc0;
+        return ngx_http_v2_write_int(pos, ngx_http_v2_prefix(6), index);
+    }
+
+    if (index != NGX_DECLINED) {
+
+        /* 4.5.4.  Literal Field Line with Name Reference */
+
+        *pos = 0x50;
+        pos = ngx_http_v2_write_int(pos, ngx_http_v2_prefix(4), index);
+
+    } else {
+
+        /* 4.5.6.  Literal Field Line with Literal Name */
+
+        *pos = 0x20;
+        pos = ngx_http_v2_write_int(pos, ngx_http_v2_prefix(3), name->len);
+
+        ngx_strlow(pos, name->data, name->len);
+        pos += name->len;
+    }
+
+    return ngx_http_v2_write_value(pos, value->data, value->len, tmp);
+}
+
+
+static ngx_int_t
+ngx_http_v3_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
+{
+    u_char                    *frame;
+    off_t                      size;
+    ngx_int_t                  rc;
+    ngx_buf_t                 *b;
+    ngx_chain_t               *out, *cl, *tl, **ll;
+    ngx_http_v3_filter_ctx_t  *ctx;
+
+    if (in == NULL || r->http_version != NGX_HTTP_VERSION_30) {
+        return ngx_http_next_body_filter(r, in);
+    }
+
+    if (r->header_only) {
+
+        /* the stream has been finished with the HEADERS frame */
+
+        return NGX_OK;
+    }
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_v3_filter_module);
+
+    if (ctx == NULL) {
+        return ngx_http_next_body_filter(r, in);
+    }
+
+    out = NULL;
+    ll = &out;
+
+    size = 0;
+
+    for (cl = in; cl; cl = cl->next) {
+
+        size += ngx_buf_size(cl->buf);
+
+        if (cl->buf->flush
+            || cl->buf->sync
+            || cl->buf->last_buf
+            || ngx_buf_in_memory(cl->buf)
+            || cl->buf->in_file)
+        {
+            tl = ngx_alloc_chain_link(r->pool);
+            if (tl == NULL) {
+                return NGX_ERROR;
+            }
+
+            tl->buf = cl->buf;
+            *ll = tl;
+            ll = &tl->next;
+        }
+    }
+
+    *ll = NULL;
+
+    if (size) {
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http3 output DATA frame: %O", size);
+
+        tl = ngx_chain_get_free_buf(r->pool, &ctx->free);
+        if (tl == NULL) {
+            return NGX_ERROR;
+        }
+
+        b = tl->buf;
+        frame = b->start;
+
+        if (frame == NULL) {
+            frame = ngx_palloc(r->pool, NGX_HTTP_V3_FRAME_HEADER_SIZE);
+            if (frame == NULL) {
+                return NGX_ERROR;
+            }
+
+            b->start = frame;
+            b->end = frame + NGX_HTTP_V3_FRAME_HEADER_SIZE;
+        }
+
+        b->tag = (ngx_buf_tag_t) &ngx_http_v3_filter_module;
+        b->memory = 0;
+        b->temporary = 1;
+        b->pos = frame;
+
+        *frame++ = NGX_HTTP_V3_FRAME_DATA;
+        b->last = ngx_http_v3_encode_varlen_int(frame, size);
+
+        tl->next = out;
+        out = tl;
+    }
+
+    rc = ngx_http_next_body_filter(r, out);
+
+    ngx_chain_update_chains(r->pool, &ctx->free, &ctx->busy, &out,
+                            (ngx_buf_tag_t) &ngx_http_v3_filter_module);
+
+    return rc;
+}
+
+
+static ngx_int_t
+ngx_http_v3_filter_init(ngx_conf_t *cf)
+{
+    ngx_http_next_header_filter = ngx_http_top_header_filter;
+    ngx_http_top_header_filter = ngx_http_v3_header_filter;
+
+    ngx_http_next_body_filter = ngx_http_top_body_filter;
+    ngx_http_top_body_filter = ngx_http_v3_body_filter;
+
+    return NGX_OK;
+}
@@ -0,0 +1,735 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+static void ngx_http_v3_cleanup_request(void *data);
+static void ngx_http_v3_wait_request_handler(ngx_event_t *rev);
+static ngx_int_t ngx_http_v3_request_frame(ngx_http_request_t *r);
+static void ngx_http_v3_process_request_header(ngx_http_request_t *r,
+    u_char *pos, u_char *end);
+static ngx_int_t ngx_http_v3_process_header(ngx_http_request_t *r,
+    ngx_http_v2_header_t *header, ngx_array_t **cookies);
+
+
+void
+ngx_http_v3_init_request_stream(ngx_connection_t *c)
+{
+    ngx_buf_t                 *b;
+    ngx_pool_cleanup_t        *cln;
+    ngx_http_request_t        *r;
+    ngx_http_connection_t     *hc;
+    ngx_http_v3_session_t     *h3c;
+    ngx_http_core_srv_conf_t  *cscf;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http3 init request stream id:0x%xL", c->quic->id);
+
+    hc = c->data;
+    h3c = ngx_http_v3_get_session(c);
+
+    if (h3c->goaway) {
+        c->close = 1;
+        (void) ngx_quic_reset_stream(c, NGX_HTTP_V3_ERR_REQUEST_REJECTED);
+        ngx_http_close_connection(c);
+        return;
+    }
+
+    if (c->quic->id >= h3c->next_request_id) {
+        h3c->next_request_id = c->quic->id + 4;
+    }
+
+    h3c->nrequests++;
+
+    if (h3c->keepalive.timer_set) {
+        ngx_del_timer(&h3c->keepalive);
+    }
+
+    cln = ngx_pool_cleanup_add(c->pool, 0);
+    if (cln == NULL) {
+        h3c->nrequests--;
+        ngx_http_close_connection(c);
+        return;
+    }
+
+    cln->handler = ngx_http_v3_cleanup_request;
+    cln->data = c;
+
+    cscf = ngx_http_get_module_srv_conf(hc->conf_ctx, ngx_http_core_module);
+
+    b = ngx_create_temp_buf(c->pool, cscf->client_header_buffer_size);
+    if (b == NULL) {
+        ngx_http_close_connection(c);
+        return;
+    }
+
+    c->buffer = b;
+
+    r = ngx_http_create_request(c);
+    if (r == NULL) {
+        ngx_http_close_connection(c);
+        return;
+    }
+
+    c->data = r;
+
+    ngx_str_set(&r->http_protocol, "HTTP/3.0");
+
+    r->http_version = NGX_HTTP_VERSION_30;
+    r->valid_location = 1;
+
+    if (ngx_list_init(&r->headers_in.headers, r->pool, 20,
+                      sizeof(ngx_table_elt_t))
+        != NGX_OK)
+    {
+        ngx_http_finalize_request(r, NGX_HTTP_CLOSE);
+        return;
+    }
+
+    r->headers_in.connection_type = NGX_HTTP_CONNECTION_CLOSE;
+
+    r->v3_parse = ngx_pcalloc(r->pool, sizeof(ngx_http_v3_parse_t));
+    if (r->v3_parse == NULL) {
+        ngx_http_finalize_request(r, NGX_HTTP_CLOSE);
+        return;
+    }
+
+    c->log->action = "reading client request headers";
+
+    c->read->handler = ngx_http_v3_wait_request_handler;
+    c->write->handler = ngx_http_empty_handler;
+
+    ngx_add_timer(c->read, cscf->client_header_timeout);
+
+    ngx_http_v3_wait_request_handler(c->read);
+}
+
+
+static void
+ngx_http_v3_cleanup_request(void *data)
+{
+    ngx_connection_t  *c = data;
+
+    ngx_http_connection_t     *phc;
+    ngx_http_v3_session_t     *h3c;
+    ngx_http_core_loc_conf_t  *clcf;
+
+    h3c = ngx_http_v3_get_session(c);
+
+    if (--h3c->nrequests) {
+        return;
+    }
+
+    if (h3c->goaway) {
+        ngx_post_event(&h3c->keepalive, &ngx_posted_events);
+        return;
+    }
+
+    phc = h3c->connection->data;
+
+    clcf = ngx_http_get_module_loc_conf(phc->conf_ctx, ngx_http_core_module);
+
+    ngx_add_timer(&h3c->keepalive, clcf->keepalive_timeout);
+}
+
+
+static void
+ngx_http_v3_wait_request_handler(ngx_event_t *rev)
+{
+    size_t                     size;
+    ssize_t                    n;
+    ngx_int_t                  rc;
+    ngx_buf_t                 *b;
+    ngx_connection_t          *c;
+    ngx_http_request_t        *r;
+    ngx_http_v3_parse_t       *st;
+    ngx_http_core_srv_conf_t  *cscf;
+
+    c = rev->data;
+    r = c->data;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0, "http3 wait request handler");
+
+    if (rev->timedout) {
+        ngx_log_error(NGX_LOG_INFO, c->log, NGX_ETIMEDOUT, "client timed out");
+        c->timedout = 1;
+        ngx_http_finalize_request(r, NGX_HTTP_REQUEST_TIME_OUT);
+        return;
+    }
+
+    st = r->v3_parse;
+    b = r->header_in;
+
+    for ( ;; ) {
+
+        if (st->length == 0) {
+
+            /* RFC 9114, 4.1.  the request starts with a HEADERS frame */
+
+            rc = ngx_http_v3_parse_frame(st, &b->pos, b->last);
+
+            if (rc == NGX_DONE) {
+                rc = ngx_http_v3_request_frame(r);
+
+                if (rc == NGX_ERROR) {
+                    return;
+                }
+
+                continue;
+            }
+
+            /* a partial frame header is kept in the parser state */
+
+            b->pos = b->start;
+            b->last = b->start;
+
+        } else if (st->type == NGX_HTTP_V3_FRAME_HEADERS) {
+
+            if ((uint64_t) (b->last - b->pos) >= st->length) {
+                ngx_http_v3_process_request_header(r, b->pos,
+                                                   b->pos + st->length);
+                return;
+            }
+
+            if ((uint64_t) (b->end - b->pos) < st->length) {
+
+                /* the size is limited by ngx_http_v3_request_frame() */
+
+                b = ngx_create_temp_buf(r->pool, (size_t) st->length);
+                if (b == NULL) {
+                    ngx_http_finalize_request(r, NGX_HTTP_CLOSE);
+                    return;
+                }
+
+                b->last = ngx_cpymem(b->last, r->header_in->pos,
+                                     r->header_in->last - r->header_in->pos);
+
+                r->header_in = b;
+            }
+
+        } else {
+
+            /* RFC 9114, 9.  unknown frames are skipped */
+
+            size = ngx_min((uint64_t) (b->last - b->pos), st->length);
+
+            b->pos += size;
+            st->length -= size;
+
+            if (st->length == 0) {
+                continue;
+            }
+
+            b->pos = b->start;
+            b->last = b->start;
+        }
+
+        n = c->recv(c, b->last, b->end - b->last);
+
+        if (n == NGX_AGAIN) {
+
+            if (!rev->timer_set) {
+                cscf = ngx_http_get_module_srv_conf(r, ngx_http_core_module);
+                ngx_add_timer(rev, cscf->client_header_timeout);
+            }
+
+            if (ngx_handle_read_event(rev, 0) != NGX_OK) {
+                ngx_http_finalize_request(r, NGX_HTTP_CLOSE);
+            }
+
+            return;
+        }
+
+        if (n == 0) {
+            ngx_log_error(NGX_LOG_INFO, c->log, 0,
+                          "client prematurely closed stream");
+        }
+
+        if (n == 0 || n == NGX_ERROR) {
+            c->error = 1;
+            c->log->action = "reading client request headers";
+
+            ngx_http_finalize_request(r, NGX_HTTP_BAD_REQUEST);
+            return;
+        }
+
+        b->last += n;
+        r->request_length += n;
+    }
+}
+
+
+static ngx_int_t
+ngx_http_v3_request_frame(ngx_http_request_t *r)
+{
+    ngx_http_v3_parse_t       *st;
+    ngx_http_core_srv_conf_t  *cscf;
+
+    st = r->v3_parse;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http3 request frame type:0x%xL len:%uL",
+                   st->type, st->length);
+
+    switch (st->type) {
+
+    case NGX_HTTP_V3_FRAME_HEADERS:
+
+        if (st->length == 0) {
+            ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+                          "client sent empty HEADERS frame");
+
+            ngx_http_v3_finalize_connection(r->connection,
+                                            NGX_HTTP_V3_ERR_FRAME_ERROR,
+                                            "empty HEADERS frame");
+            ngx_http_finalize_request(r, NGX_HTTP_CLOSE);
+            return NGX_ERROR;
+        }
+
+        cscf = ngx_http_get_module_srv_conf(r, ngx_http_core_module);
+
+        if (st->length > cscf->large_client_header_buffers.size) {
+            ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+                          "client sent too large header");
+
+            ngx_http_finalize_request(r, NGX_HTTP_REQUEST_HEADER_TOO_LARGE);
+            return NGX_ERROR;
+        }
+
+        return NGX_OK;
+
+    case NGX_HTTP_V3_FRAME_DATA:
+    case NGX_HTTP_V3_FRAME_CANCEL_PUSH:
+    case NGX_HTTP_V3_FRAME_SETTINGS:
+    case NGX_HTTP_V3_FRAME_PUSH_PROMISE:
+    case NGX_HTTP_V3_FRAME_GOAWAY:
+    case NGX_HTTP_V3_FRAME_MAX_PUSH_ID:
+
+    /* RFC 9114, 7.2.8.  HTTP/2 frame types are reserved */
+    case 0x02:
+    case 0x06:
+    case 0x08:
+    case 0x09:
+
+        ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+                      "client sent unexpected frame 0x%xL", st->type);
+
+        ngx_http_v3_finalize_connection(r->connection,
+                                        NGX_HTTP_V3_ERR_FRAME_UNEXPECTED,
+                                        "unexpected frame");
+        ngx_http_finalize_request(r, NGX_HTTP_CLOSE);
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_v3_process_request_header(ngx_http_request_t *r, u_char *pos,
+    u_char *end)
+{
+    ngx_int_t              rc;
+    ngx_uint_t             i;
+    ngx_array_t            fields, *cookies;
+    ngx_connection_t      *c;
+    ngx_http_v3_parse_t   *st;
+    ngx_http_v2_header_t  *header;
+
+    c = r->connection;
+    st = r->v3_parse;
+
+    r->header_in->pos = end;
+    st->length = 0;
+
+    if (ngx_array_init(&fields, r->pool, 16, sizeof(ngx_http_v2_header_t))
+        != NGX_OK)
+    {
+        ngx_http_finalize_request(r, NGX_HTTP_CLOSE);
+        return;
+    }
+
+    rc = ngx_http_v3_parse_field_section(r, pos, end, &fields);
+
+    if (rc == NGX_ERROR) {
+        ngx_http_finalize_request(r, NGX_HTTP_CLOSE);
+        return;
+    }
+
+    if (rc == NGX_DECLINED) {
+        ngx_http_v3_finalize_connection(c,
+                                        NGX_HTTP_V3_ERR_DECOMPRESSION_FAILED,
+                                        "failed to decode field section");
+        ngx_http_finalize_request(r, NGX_HTTP_CLOSE);
+        return;
+    }
+
+    cookies = NULL;
+    header = fields.elts;
+
+    for (i = 0; i < fields.nelts; i++) {
+
+        rc = ngx_http_v3_process_header(r, &header[i], &cookies);
+
+        if (rc == NGX_ABORT) {
+            goto failed;
+        }
+
+        if (rc != NGX_OK) {
+            ngx_http_finalize_request(r, rc);
+            goto failed;
+        }
+    }
+
+    if (ngx_http_v2_construct_request_line(r) != NGX_OK) {
+        goto failed;
+    }
+
+    if (ngx_http_v2_construct_cookie_header(r, cookies) != NGX_OK) {
+        goto failed;
+    }
+
+    r->http_state = NGX_HTTP_PROCESS_REQUEST_STATE;
+
+    if (ngx_http_process_request_header(r) != NGX_OK) {
+        goto failed;
+    }
+
+    if (r->headers_in.content_length_n == -1
+        && !(c->quic->recv_state == NGX_QUIC_STREAM_RECV_DATA_READ
+             && r->header_in->pos == r->header_in->last))
+    {
+        /* the body size is known as the stream is finished */
+        r->headers_in.chunked = 1;
+    }
+
+    ngx_http_process_request(r);
+
+failed:
+
+    ngx_http_run_posted_requests(c);
+}
+
+
+static ngx_int_t
+ngx_http_v3_process_header(ngx_http_request_t *r,
+    ngx_http_v2_header_t *header, ngx_array_t **cookies)
+{
+    ngx_int_t                   rc;
+    ngx_table_elt_t            *h;
+    ngx_http_header_t          *hh;
+    ngx_http_core_srv_conf_t   *cscf;
+    ngx_http_core_main_conf_t  *cmcf;
+
+    static ngx_str_t cookie = ngx_string("cookie");
+
+    if (header->name.len == 0) {
+        ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+                      "client sent zero header name length");
+        return NGX_HTTP_BAD_REQUEST;
+    }
+
+    if (ngx_http_v2_validate_header(r, header) != NGX_OK) {
+        return NGX_HTTP_BAD_REQUEST;
+    }
+
+    if (header->name.data[0] == ':') {
+        rc = ngx_http_v2_pseudo_header(r, header);
+
+        if (rc == NGX_OK) {
+            ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                           "http3 header: \":%V: %V\"",
+                           &header->name, &header->value);
+            return NGX_OK;
+        }
+
+        if (rc == NGX_DECLINED) {
+            return NGX_HTTP_BAD_REQUEST;
+        }
+
+        /* NGX_ABORT: the request has been finalized already */
+
+        return NGX_ABORT;
+    }
+
+    if (r->invalid_header) {
+        cscf = ngx_http_get_module_srv_conf(r, ngx_http_core_module);
+
+        if (cscf->ignore_invalid_headers) {
+            ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+                          "client sent invalid header: \"%V\"", &header->name);
+            return NGX_OK;
+        }
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http3 header: \"%V: %V\"",
+                   &header->name, &header->value);
+
+    if (header->name.len == cookie.len
+        && ngx_memcmp(header->name.data, cookie.data, cookie.len) == 0)
+    {
+        if (ngx_http_v2_cookie(r, cookies, header) != NGX_OK) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        return NGX_OK;
+    }
+
+    h = ngx_list_push(&r->headers_in.headers);
+    if (h == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    h->key = header->name;
+    h->value = header->value;
+    h->lowcase_key = h->key.data;
+    h->hash = ngx_hash_key(h->key.data, h->key.len);
+
+    cmcf = ngx_http_get_module_main_conf(r, ngx_http_core_module);
+
+    hh = ngx_hash_find(&cmcf->headers_in_hash, h->hash,
+                       h->lowcase_key, h->key.len);
+
+    if (hh && hh->handler(r, h, hh->offset) != NGX_OK) {
+        return NGX_ABORT;
+    }
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_http_v3_request_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
+{
+    off_t                      max;
+    size_t                     size;
+    u_char                    *p;
+    ngx_int_t                  rc;
+    ngx_buf_t                 *b;
+    ngx_uint_t                 last;
+    ngx_chain_t               *cl, *out, *tl, **ll;
+    ngx_http_v3_parse_t       *st;
+    ngx_http_request_body_t   *rb;
+    ngx_http_core_loc_conf_t  *clcf;
+    ngx_http_core_srv_conf_t  *cscf;
+
+    rb = r->request_body;
+    st = r->v3_parse;
+
+    cscf = ngx_http_get_module_srv_conf(r, ngx_http_core_module);
+
+    if (rb->rest == -1) {
+
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http3 request body filter");
+
+        st->received = 0;
+
+        if (r->headers_in.chunked) {
+            r->headers_in.content_length_n = 0;
+        }
+
+        rb->rest = cscf->large_client_header_buffers.size;
+    }
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+    /* without "Content-Length" the body size is accumulated */
+
+    max = r->headers_in.chunked ? -1 : r->headers_in.content_length_n;
+
+    out = NULL;
+    ll = &out;
+    last = 0;
+
+    for (cl = in; cl; cl = cl->next) {
+
+        b = NULL;
+
+        if (cl->buf->last_buf) {
+            last = 1;
+        }
+
+        while (cl->buf->pos < cl->buf->last) {
+
+            if (st->length == 0) {
+
+                rc = ngx_http_v3_parse_frame(st, &cl->buf->pos, cl->buf->last);
+
+                if (rc == NGX_AGAIN) {
+                    break;
+                }
+
+                ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                               "http3 body frame type:0x%xL len:%uL",
+                               st->type, st->length);
+
+                switch (st->type) {
+
+                case NGX_HTTP_V3_FRAME_DATA:
+                case NGX_HTTP_V3_FRAME_HEADERS:
+                    break;
+
+                case NGX_HTTP_V3_FRAME_CANCEL_PUSH:
+                case NGX_HTTP_V3_FRAME_SETTINGS:
+                case NGX_HTTP_V3_FRAME_PUSH_PROMISE:
+                case NGX_HTTP_V3_FRAME_GOAWAY:
+                case NGX_HTTP_V3_FRAME_MAX_PUSH_ID:
+                case 0x02:
+                case 0x06:
+                case 0x08:
+                case 0x09:
+                    ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+                                  "client sent unexpected frame 0x%xL",
+                                  st->type);
+
+                    ngx_http_v3_finalize_connection(r->connection,
+                                            NGX_HTTP_V3_ERR_FRAME_UNEXPECTED,
+                                            "unexpected frame");
+                    r->connection->error = 1;
+                    return NGX_HTTP_BAD_REQUEST;
+                }
+
+                if (st->type != NGX_HTTP_V3_FRAME_DATA) {
+                    continue;
+                }
+
+                if (clcf->client_max_body_size
+                    && clcf->client_max_body_size - st->received
+                       < (off_t) st->length)
+                {
+                    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                                  "client intended to send too large body: "
+                                  "%O+%uL bytes", st->received, st->length);
+
+                    r->lingering_close = 1;
+
+                    return NGX_HTTP_REQUEST_ENTITY_TOO_LARGE;
+                }
+
+                if (max != -1 && max - st->received < (off_t) st->length) {
+                    ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+                                  "client intended to send body data "
+                                  "larger than declared");
+
+                    return NGX_HTTP_BAD_REQUEST;
+                }
+
+                continue;
+            }
+
+            size = ngx_min((uint64_t) (cl->buf->last - cl->buf->pos),
+                           st->length);
+
+            if (st->type != NGX_HTTP_V3_FRAME_DATA) {
+
+                /* trailers and unknown frames are skipped */
+
+                cl->buf->pos += size;
+                st->length -= size;
+
+                continue;
+            }
+
+            p = cl->buf->pos;
+
+            cl->buf->pos += size;
+            st->length -= size;
+            st->received += size;
+
+            if (max == -1) {
+                r->headers_in.content_length_n += size;
+            }
+
+            if (b && b->last == p) {
+                b->last = cl->buf->pos;
+                continue;
+            }
+
+            tl = ngx_chain_get_free_buf(r->pool, &rb->free);
+            if (tl == NULL) {
+                return NGX_HTTP_INTERNAL_SERVER_ERROR;
+            }
+
+            b = tl->buf;
+
+            ngx_memzero(b, sizeof(ngx_buf_t));
+
+            b->temporary = 1;
+            b->tag = (ngx_buf_tag_t) &ngx_http_read_client_request_body;
+            b->start = p;
+            b->pos = p;
+            b->last = cl->buf->pos;
+            b->end = cl->buf->end;
+            b->flush = r->request_body_no_buffering;
+
+            *ll = tl;
+            ll = &tl->next;
+        }
+    }
+
+    if (last) {
+
+        if (st->length || st->state || st->left) {
+            ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+                          "client prematurely closed stream");
+
+            r->connection->error = 1;
+            return NGX_HTTP_BAD_REQUEST;
+        }
+
+        if (max != -1 && st->received != max) {
+            ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+                          "client prematurely closed stream: "
+                          "only %O out of %O bytes of request body received",
+                          st->received, max);
+
+            r->connection->error = 1;
+            return NGX_HTTP_BAD_REQUEST;
+        }
+
+    } else if (max != -1 && st->received == max
+               && st->length == 0 && st->state == 0 && st->left == 0)
+    {
+        /* the whole body is received, the end of stream is not awaited */
+        last = 1;
+    }
+
+    if (last) {
+        rb->rest = 0;
+
+        tl = ngx_chain_get_free_buf(r->pool, &rb->free);
+        if (tl == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        b = tl->buf;
+
+        ngx_memzero(b, sizeof(ngx_buf_t));
+
+        b->last_buf = 1;
+
+        *ll = tl;
+
+    } else {
+
+        /* set rb->rest, amount of data we want to see next time */
+
+        rb->rest = ngx_max((off_t) st->length,
+                           (off_t) cscf->large_client_header_buffers.size);
+    }
+
+    rc = ngx_http_top_request_body_filter(r, out);
+
+    ngx_chain_update_chains(r->pool, &rb->free, &rb->busy, &out,
+                            (ngx_buf_tag_t) &ngx_http_read_client_request_body);
+
+    return rc;
+}
@@ -0,0 +1,390 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+static ngx_int_t ngx_http_v3_parse_int(u_char **pos, u_char *end,
+    ngx_uint_t prefix, ngx_uint_t *value);
+static ngx_int_t ngx_http_v3_parse_literal(ngx_http_request_t *r,
+    u_char **pos, u_char *end, ngx_uint_t prefix, ngx_str_t *str);
+
+
+/* RFC 9204, Appendix A.  Static Table */
+
+static ngx_http_v2_header_t  ngx_http_v3_static_table[] = {
+
+    { ngx_string(":authority"), ngx_string("") },
+    { ngx_string(":path"), ngx_string("/") },
+    { ngx_string("age"), ngx_string("0") },
+    { ngx_string("content-disposition"), ngx_string("") },
+    { ngx_string("content-length"), ngx_string("0") },
+    { ngx_string("cookie"), ngx_string("") },
+    { ngx_string("date"), ngx_string("") },
+    { ngx_string("etag"), ngx_string("") },
+    { ngx_string("if-modified-since"), ngx_string("") },
+    { ngx_string("if-none-match"), ngx_string("") },
+    { ngx_string("last-modified"), ngx_string("") },
+    { ngx_string("link"), ngx_string("") },
+    { ngx_string("location"), ngx_string("") },
+    { ngx_string("referer"), ngx_string("") },
+    { ngx_string("set-cookie"), ngx_string("") },
+    { ngx_string(":method"), ngx_string("CONNECT") },
+    { ngx_string(":method"), ngx_string("DELETE") },
+    { ngx_string(":method"), ngx_string("GET") },
+    { ngx_string(":method"), ngx_string("HEAD") },
+    { ngx_string(":method"), ngx_string("OPTIONS") },
+    { ngx_string(":method"), ngx_string("POST") },
+    { ngx_string(":method"), ngx_string("PUT") },
+    { ngx_string(":scheme"), ngx_string("http") },
+    { ngx_string(":scheme"), ngx_string("https") },
+    { ngx_string(":status"), ngx_string("103") },
+    { ngx_string(":status"), ngx_string("200") },
+    { ngx_string(":status"), ngx_string("304") },
+    { ngx_string(":status"), ngx_string("404") },
+    { ngx_string(":status"), ngx_string("503") },
+    { ngx_string("accept"), ngx_string("*/*") },
+    { ngx_string("accept"), ngx_string("application/dns-message") },
+    { ngx_string("accept-encoding"), ngx_string("gzip, deflate, br") },
+    { ngx_string("accept-ranges"), ngx_string("bytes") },
+    { ngx_string("access-control-allow-headers"),
+      ngx_string("cache-control") },
+    { ngx_string("access-control-allow-headers"),
+      ngx_string("content-type") },
+    { ngx_string("access-control-allow-origin"), ngx_string("*") },
+    { ngx_string("cache-control"), ngx_string("max-age=0") },
+    { ngx_string("cache-control"), ngx_string("max-age=2592000") },
+    { ngx_string("cache-control"), ngx_string("max-age=604800") },
+    { ngx_string("cache-control"), ngx_string("no-cache") },
+    { ngx_string("cache-control"), ngx_string("no-store") },
+    { ngx_string("cache-control"),
+      ngx_string("public, max-age=31536000") },
+    { ngx_string("content-encoding"), ngx_string("br") },
+    { ngx_string("content-encoding"), ngx_string("gzip") },
+    { ngx_string("content-type"), ngx_string("application/dns-message") },
+    { ngx_string("content-type"), ngx_string("application/javascript") },
+    { ngx_string("content-type"), ngx_string("application/json") },
+    { ngx_string("content-type"),
+      ngx_string("application/x-www-form-urlencoded") },
+    { ngx_string("content-type"), ngx_string("image/gif") },
+    { ngx_string("content-type"), ngx_string("image/jpeg") },
+    { ngx_string("content-type"), ngx_string("image/png") },
+    { ngx_string("content-type"), ngx_string("text/css") },
+    { ngx_string("content-type"),
+      ngx_string("text/html; charset=utf-8") },
+    { ngx_string("content-type"), ngx_string("text/plain") },
+    { ngx_string("content-type"),
+      ngx_string("text/plain;charset=utf-8") },
+    { ngx_string("range"), ngx_string("bytes=0-") },
+    { ngx_string("strict-transport-security"),
+      ngx_string("max-age=31536000") },
+    { ngx_string("strict-transport-security"),
+      ngx_string("max-age=31536000; includesubdomains") },
+    { ngx_string("strict-transport-security"),
+      ngx_string("max-age=31536000; includesubdomains; preload") },
+    { ngx_string("vary"), ngx_string("accept-encoding") },
+    { ngx_string("vary"), ngx_string("origin") },
+    { ngx_string("x-content-type-options"), ngx_string("nosniff") },
+    { ngx_string("x-xss-protection"), ngx_string("1; mode=block") },
+    { ngx_string(":status"), ngx_string("100") },
+    { ngx_string(":status"), ngx_string("204") },
+    { ngx_string(":status"), ngx_string("206") },
+    { ngx_string(":status"), ngx_string("302") },
+    { ngx_string(":status"), ngx_string("400") },
+    { ngx_string(":status"), ngx_string("403") },
+    { ngx_string(":status"), ngx_string("421") },
+    { ngx_string(":status"), ngx_string("425") },
+    { ngx_string(":status"), ngx_string("500") },
+    { ngx_string("accept-language"), ngx_string("") },
+    { ngx_string("access-control-allow-credentials"), ngx_string("FALSE") },
+    { ngx_string("access-control-allow-credentials"), ngx_string("TRUE") },
+    { ngx_string("access-control-allow-headers"), ngx_string("*") },
+    { ngx_string("access-control-allow-methods"), ngx_string("get") },
+    { ngx_string("access-control-allow-methods"),
+      ngx_string("get, post, options") },
+    { ngx_string("access-control-allow-methods"), ngx_string("options") },
+    { ngx_string("access-control-expose-headers"),
+      ngx_string("content-length") },
+    { ngx_string("access-control-request-headers"),
+      ngx_string("content-type") },
+    { ngx_string("access-control-request-method"), ngx_string("get") },
+    { ngx_string("access-control-request-method"), ngx_string("post") },
+    { ngx_string("alt-svc"), ngx_string("clear") },
+    { ngx_string("authorization"), ngx_string("") },
+    { ngx_string("content-security-policy"),
+      ngx_string("script-src 'none'; object-src 'none'; base-uri 'none'") },
+    { ngx_string("early-data"), ngx_string("1") },
+    { ngx_string("expect-ct"), ngx_string("") },
+    { ngx_string("forwarded"), ngx_string("") },
+    { ngx_string("if-range"), ngx_string("") },
+    { ngx_string("origin"), ngx_string("") },
+    { ngx_string("purpose"), ngx_string("prefetch") },
+    { ngx_string("server"), ngx_string("") },
+    { ngx_string("timing-allow-origin"), ngx_string("*") },
+    { ngx_string("upgrade-insecure-requests"), ngx_string("1") },
+    { ngx_string("user-agent"), ngx_string("") },
+    { ngx_string("x-forwarded-for"), ngx_string("") },
+    { ngx_string("x-frame-options"), ngx_string("deny") },
+    { ngx_string("x-frame-options"), ngx_string("sameorigin") }
+};
+
+#define NGX_HTTP_V3_STATIC_TABLE_SIZE                                         \
+    (sizeof(ngx_http_v3_static_table) / sizeof(ngx_http_v2_header_t))
+
+
+ngx_int_t
+ngx_http_v3_parse_field_section(ngx_http_request_t *r, u_char *pos,
+    u_char *end, ngx_array_t *fields)
+{
+    u_char                 ch;
+    ngx_int_t              rc;
+    ngx_uint_t             index;
+    ngx_http_v2_header_t  *header;
+
+    /*
+     * RFC 9204, 4.5.1.  Encoded Field Section Prefix: as the dynamic table
+     * is never enabled, the Required Insert Count is always 0 and the base
+     * is not used
+     */
+
+    if (ngx_http_v3_parse_int(&pos, end, 8, &index) != NGX_OK
+        || index != 0
+        || ngx_http_v3_parse_int(&pos, end, 7, &index) != NGX_OK)
+    {
+        ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+                      "client sent invalid field section prefix");
+        return NGX_DECLINED;
+    }
+
+    while (pos < end) {
+
+        header = ngx_array_push(fields);
+        if (header == NULL) {
+            return NGX_ERROR;
+        }
+
+        ch = *pos;
+
+        if (ch & 0x80) {
+
+            /* 4.5.2.  Indexed Field Line, T bit is set for the static table */
+
+            if (!(ch & 0x40)) {
+                goto dynamic;
+            }
+
+            if (ngx_http_v3_parse_int(&pos, end, 6, &index) != NGX_OK
+                || index >= NGX_HTTP_V3_STATIC_TABLE_SIZE)
+            {
+                goto invalid;
+            }
+
+            *header = ngx_http_v3_static_table[index];
+
+            continue;
+        }
+
+        if (ch & 0x40) {
+
+            /* 4.5.4.  Literal Field Line with Name Reference */
+
+            if (!(ch & 0x10)) {
+                goto dynamic;
+            }
+
+            if (ngx_http_v3_parse_int(&pos, end, 4, &index) != NGX_OK
+                || index >= NGX_HTTP_V3_STATIC_TABLE_SIZE)
+            {
+                goto invalid;
+            }
+
+            header->name = ngx_http_v3_static_table[index].name;
+
+            rc = ngx_http_v3_parse_literal(r, &pos, end, 7, &header->value);
+
+            if (rc != NGX_OK) {
+                return rc;
+            }
+
+            continue;
+        }
+
+        if (ch & 0x20) {
+
+            /* 4.5.6.  Literal Field Line with Literal Name */
+
+            rc = ngx_http_v3_parse_literal(r, &pos, end, 3, &header->name);
+
+            if (rc != NGX_OK) {
+                return rc;
+            }
+
+            rc = ngx_http_v3_parse_literal(r, &pos, end, 7, &header->value);
+
+            if (rc != NGX_OK) {
+                return rc;
+            }
+
+            continue;
+        }
+
+        /* 4.5.3, 4.5.5.  post-base references need the dynamic table */
+
+        goto dynamic;
+    }
+
+    return NGX_OK;
+
+dynamic:
+
+    ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+                  "client sent dynamic table reference");
+
+    return NGX_DECLINED;
+
+invalid:
+
+    ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+                  "client sent invalid field line");
+
+    return NGX_DECLINED;
+}
+
+
+static ngx_int_t
+ngx_http_v3_parse_int(u_char **pos, u_char *end, ngx_uint_t prefix,
+    ngx_uint_t *value)
+{
+    u_char      *p, ch;
+    ngx_uint_t   mask, shift;
+
+    /* RFC 7541, 5.1.  Integer Representation */
+
+    p = *pos;
+
+    if (p == end) {
+        return NGX_ERROR;
+    }
+
+    mask = (1 << prefix) - 1;
+
+    *value = *p++ & mask;
+
+    if (*value != mask) {
+        *pos = p;
+        return NGX_OK;
+    }
+
+    for (shift = 0; p < end && shift < 28; shift += 7) {
+        ch = *p++;
+
+        *value += (ngx_uint_t) (ch & 0x7f) << shift;
+
+        if (!(ch & 0x80)) {
+            *pos = p;
+            return NGX_OK;
+        }
+    }
+
+    return NGX_ERROR;
+}
+
+
+static ngx_int_t
+ngx_http_v3_parse_literal(ngx_http_request_t *r, u_char **pos, u_char *end,
+    ngx_uint_t prefix, ngx_str_t *str)
+{
+    u_char      *p, state, huff;
+    ngx_uint_t   len;
+
+    /* the Huffman flag precedes the length prefix */
+
+    huff = **pos & (1 << prefix);
+
+    if (ngx_http_v3_parse_int(pos, end, prefix, &len) != NGX_OK
+        || len > (ngx_uint_t) (end - *pos))
+    {
+        ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+                      "client sent invalid field line");
+        return NGX_DECLINED;
+    }
+
+    if (huff) {
+        p = ngx_pnalloc(r->pool, len * 8 / 5 + 1);
+        if (p == NULL) {
+            return NGX_ERROR;
+        }
+
+        str->data = p;
+        state = 0;
+
+        if (ngx_http_v2_huff_decode(&state, *pos, len, &p, 1,
+                                    r->connection->log)
+            != NGX_OK)
+        {
+            return NGX_DECLINED;
+        }
+
+        str->len = p - str->data;
+
+    } else {
+        p = ngx_pnalloc(r->pool, len + 1);
+        if (p == NULL) {
+            return NGX_ERROR;
+        }
+
+        str->data = p;
+        str->len = len;
+
+        p = ngx_cpymem(p, *pos, len);
+    }
+
+    *p = '\0';
+
+    *pos += len;
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_http_v3_lookup_static(ngx_str_t *name, ngx_str_t *value,
+    ngx_uint_t *exact)
+{
+    ngx_int_t              index;
+    ngx_uint_t             i;
+    ngx_http_v2_header_t  *h;
+
+    index = NGX_DECLINED;
+
+    for (i = 0; i < NGX_HTTP_V3_STATIC_TABLE_SIZE; i++) {
+        h = &ngx_http_v3_static_table[i];
+
+        if (h->name.len != name->len
+            || ngx_strncasecmp(h->name.data, name->data, name->len) != 0)
+        {
+            continue;
+        }
+
+        if (value
+            && h->value.len == value->len
+            && ngx_strncmp(h->value.data, value->data, value->len) == 0)
+        {
+            *exact = 1;
+            return i;
+        }
+
+        if (index == NGX_DECLINED) {
+            index = i;
+        }
+    }
+
+    *exact = 0;
+
+    return index;
+}
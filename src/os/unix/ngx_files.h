@@ -162,6 +162,10 @@ ngx_write_fd(ngx_fd_t fd, void *buf, size_t n)
 #define ngx_rename_file_n        "rename()"
 
 
+#define ngx_fsync(fd)            fsync(fd)
+#define ngx_fsync_n              "fsync()"
+
+
 #define ngx_change_file_access(n, a) chmod((const char *) n, a)
 #define ngx_change_file_access_n "chmod()"
 
@@ -194,6 +198,7 @@ ngx_int_t ngx_set_file_time(u_char *name, ngx_fd_t fd, time_t s);
 
 
 ngx_int_t ngx_create_file_mapping(ngx_file_mapping_t *fm);
+ngx_int_t ngx_open_file_mapping(ngx_file_mapping_t *fm);
 void ngx_close_file_mapping(ngx_file_mapping_t *fm);
 
 
@@ -606,6 +606,12 @@ ngx_unlock_mutexes(ngx_pid_t pid)
                           "shared memory zone \"%V\" was locked by %P",
                           &shm_zone[i].shm.name, pid);
         }
+
+        /* release anything else the process owned in the zone */
+
+        if (shm_zone[i].reap) {
+            shm_zone[i].reap(&shm_zone[i], pid);
+        }
     }
 }
 
@@ -54,6 +54,8 @@ sig_atomic_t  ngx_noaccept;
 ngx_uint_t    ngx_noaccepting;
 ngx_uint_t    ngx_restart;
 
+ngx_pass_connection_pt  ngx_pass_connection_handler;
+
 
 static u_char  master_process[] = "master process";
 
@@ -293,13 +295,18 @@ ngx_master_process_cycle(ngx_cycle_t *cycle)
 void
 ngx_single_process_cycle(ngx_cycle_t *cycle)
 {
-    ngx_uint_t  i;
+    ngx_uint_t        i;
+    ngx_core_conf_t  *ccf;
 
     if (ngx_set_environment(cycle, NULL) == NULL) {
         /* fatal */
         exit(2);
     }
 
+    ccf = (ngx_core_conf_t *) ngx_get_conf(cycle->conf_ctx, ngx_core_module);
+
+    ngx_pool_cache_init(ccf->pool_cache_size);
+
     for (i = 0; cycle->modules[i]; i++) {
         if (cycle->modules[i]->init_process) {
             if (cycle->modules[i]->init_process(cycle) == NGX_ERROR) {
@@ -810,6 +817,8 @@ ngx_worker_process_init(ngx_cycle_t *cycle, ngx_int_t worker)
         }
     }
 
+    ngx_pool_cache_init(ccf->pool_cache_size);
+
     if (geteuid() == 0) {
         if (setgid(ccf->group) == -1) {
             ngx_log_error(NGX_LOG_EMERG, cycle->log, ngx_errno,
@@ -865,7 +874,7 @@ ngx_worker_process_init(ngx_cycle_t *cycle, ngx_int_t worker)
     }
 
     if (worker >= 0) {
-        cpu_affinity = ngx_get_cpu_affinity(worker);
+        cpu_affinity = ngx_get_cpu_affinity(cycle, worker);
 
         if (cpu_affinity) {
             ngx_setaffinity(cpu_affinity, cycle->log);
@@ -1087,6 +1096,13 @@ ngx_channel_handler(ngx_event_t *ev)
 
             ngx_processes[ch.slot].pid = ch.pid;
             ngx_processes[ch.slot].channel[0] = ch.fd;
+
+            /* the process was spawned after this one */
+
+            if (ch.slot >= ngx_last_process) {
+                ngx_last_process = ch.slot + 1;
+            }
+
             break;
 
         case NGX_CMD_CLOSE_CHANNEL:
@@ -1103,6 +1119,38 @@ ngx_channel_handler(ngx_event_t *ev)
 
             ngx_processes[ch.slot].channel[0] = -1;
             break;
+
+        case NGX_CMD_PASS_CONNECTION:
+
+            /* ch.slot is an identifier set by the sender, not a slot */
+
+            ngx_log_debug3(NGX_LOG_DEBUG_CORE, ev->log, 0,
+                           "get connection id:%i pid:%P fd:%d",
+                           ch.slot, ch.pid, ch.fd);
+
+            if (ngx_pass_connection_handler) {
+                ngx_pass_connection_handler(ch.fd, ch.pid, ch.slot, ev->log);
+                break;
+            }
+
+            if (close(ch.fd) == -1) {
+                ngx_log_error(NGX_LOG_ALERT, ev->log, ngx_errno,
+                              "close() passed connection failed");
+            }
+
+            break;
+
+        case NGX_CMD_WANT_CONNECTION:
+
+            ngx_log_debug2(NGX_LOG_DEBUG_CORE, ev->log, 0,
+                           "want connection id:%i pid:%P", ch.slot, ch.pid);
+
+            if (ngx_pass_connection_handler) {
+                ngx_pass_connection_handler((ngx_socket_t) -1, ch.pid,
+                                            ch.slot, ev->log);
+            }
+
+            break;
         }
     }
 }
@@ -18,6 +18,8 @@
 #define NGX_CMD_QUIT           3
 #define NGX_CMD_TERMINATE      4
 #define NGX_CMD_REOPEN         5
+#define NGX_CMD_PASS_CONNECTION  6
+#define NGX_CMD_WANT_CONNECTION  7
 
 
 #define NGX_PROCESS_SINGLE     0
@@ -27,6 +29,12 @@
 #define NGX_PROCESS_HELPER     4
 
 
+/* s is -1 if the process pid asks for a connection */
+
+typedef void (*ngx_pass_connection_pt)(ngx_socket_t s, ngx_pid_t pid,
+    ngx_uint_t id, ngx_log_t *log);
+
+
 typedef struct {
     ngx_event_handler_pt       handler;
     char                      *name;
@@ -57,5 +65,7 @@ extern sig_atomic_t    ngx_reconfigure;
 extern sig_atomic_t    ngx_reopen;
 extern sig_atomic_t    ngx_change_binary;
 
+extern ngx_pass_connection_pt  ngx_pass_connection_handler;
+
 
 #endif /* _NGX_PROCESS_CYCLE_H_INCLUDED_ */
@@ -13,6 +13,7 @@
 
 
 #define NGX_WRITE_SHUTDOWN SHUT_WR
+#define NGX_READ_SHUTDOWN  SHUT_RD
 
 typedef int  ngx_socket_t;
 
@@ -10,16 +10,42 @@
 #include <ngx_event.h>
 
 
+/*
+ * datagrams of the same size, possibly except the last one, are sent
+ * with a single sendmsg() call using UDP segmentation offload
+ */
+
+#if (NGX_HAVE_UDP_SEGMENT)
+
+#define NGX_UDP_MAX_SEGMENTS      64
+#define NGX_UDP_MAX_SEGMENTS_SIZE 65000
+#define NGX_UDP_SEGMENT_CMSG_SPACE  CMSG_SPACE(sizeof(uint16_t))
+
+static ngx_chain_t *ngx_udp_output_chain_to_segments(ngx_iovec_t *vec,
+    ngx_chain_t *in, size_t *segment);
+
+static ngx_uint_t  ngx_udp_segment_disabled;
+
+#else
+
+#define NGX_UDP_SEGMENT_CMSG_SPACE  0
+
+#endif
+
+
 static ngx_chain_t *ngx_udp_output_chain_to_iovec(ngx_iovec_t *vec,
     ngx_chain_t *in, ngx_log_t *log);
-static ssize_t ngx_sendmsg(ngx_connection_t *c, ngx_iovec_t *vec);
+static ssize_t ngx_sendmsg(ngx_connection_t *c, ngx_iovec_t *vec,
+    size_t segment);
 
 
 ngx_chain_t *
 ngx_udp_unix_sendmsg_chain(ngx_connection_t *c, ngx_chain_t *in, off_t limit)
 {
+    size_t         segment;
     ssize_t        n;
     off_t          send;
+    ngx_uint_t     segments;
     ngx_chain_t   *cl;
     ngx_event_t   *wev;
     ngx_iovec_t    vec;
@@ -49,6 +75,8 @@ ngx_udp_unix_sendmsg_chain(ngx_connection_t *c, ngx_chain_t *in, off_t limit)
     }
 
     send = 0;
+    segment = 0;
+    segments = 1;
 
     vec.iovs = iovs;
     vec.nalloc = NGX_IOVS_PREALLOCATE;
@@ -86,14 +114,32 @@ ngx_udp_unix_sendmsg_chain(ngx_connection_t *c, ngx_chain_t *in, off_t limit)
             return in;
         }
 
-        send += vec.size;
+#if (NGX_HAVE_UDP_SEGMENT)
+
+        if (segments && !ngx_udp_segment_disabled && cl && vec.size) {
+            cl = ngx_udp_output_chain_to_segments(&vec, cl, &segment);
+        }
+
+#endif
 
-        n = ngx_sendmsg(c, &vec);
+        n = ngx_sendmsg(c, &vec, segment);
 
         if (n == NGX_ERROR) {
             return NGX_CHAIN_ERROR;
         }
 
+        if (n == NGX_DECLINED) {
+
+            /* send the datagrams one by one */
+
+            segment = 0;
+            segments = 0;
+            continue;
+        }
+
+        send += vec.size;
+        segment = 0;
+
         if (n == NGX_AGAIN) {
             wev->ready = 0;
             return in;
@@ -203,8 +249,74 @@ ngx_udp_output_chain_to_iovec(ngx_iovec_t *vec, ngx_chain_t *in, ngx_log_t *log)
 }
 
 
+#if (NGX_HAVE_UDP_SEGMENT)
+
+static ngx_chain_t *
+ngx_udp_output_chain_to_segments(ngx_iovec_t *vec, ngx_chain_t *in,
+    size_t *segment)
+{
+    size_t         size, total;
+    ngx_buf_t     *b;
+    ngx_uint_t     n, count;
+    struct iovec  *iov;
+
+    n = vec->count;
+    total = vec->size;
+    count = 1;
+
+    /* each of the next datagrams is expected in a single memory buffer */
+
+    for ( /* void */ ; in; in = in->next) {
+
+        if (count == NGX_UDP_MAX_SEGMENTS || n == vec->nalloc) {
+            break;
+        }
+
+        b = in->buf;
+
+        if (!(b->flush || b->last_buf) || b->in_file || !ngx_buf_in_memory(b))
+        {
+            break;
+        }
+
+        size = b->last - b->pos;
+
+        if (size == 0
+            || size > vec->size
+            || total + size > NGX_UDP_MAX_SEGMENTS_SIZE)
+        {
+            break;
+        }
+
+        iov = &vec->iovs[n++];
+
+        iov->iov_base = (void *) b->pos;
+        iov->iov_len = size;
+
+        total += size;
+        count++;
+
+        if (size < vec->size) {
+            in = in->next;
+            break;
+        }
+    }
+
+    if (count > 1) {
+        *segment = vec->size;
+
+        vec->count = n;
+        vec->size = total;
+    }
+
+    return in;
+}
+
+#endif
+
+
 static ssize_t
-ngx_sendmsg(ngx_connection_t *c, ngx_iovec_t *vec)
+ngx_sendmsg(ngx_connection_t *c, ngx_iovec_t *vec, size_t segment)
 {
     ssize_t        n;
     ngx_err_t      err;
@@ -213,13 +325,16 @@ ngx_sendmsg(ngx_connection_t *c, ngx_iovec_t *vec)
 #if (NGX_HAVE_MSGHDR_MSG_CONTROL)
 
 #if (NGX_HAVE_IP_SENDSRCADDR)
-    u_char         msg_control[CMSG_SPACE(sizeof(struct in_addr))];
+    u_char         msg_control[CMSG_SPACE(sizeof(struct in_addr))
+                               + NGX_UDP_SEGMENT_CMSG_SPACE];
 #elif (NGX_HAVE_IP_PKTINFO)
-    u_char         msg_control[CMSG_SPACE(sizeof(struct in_pktinfo))];
+    u_char         msg_control[CMSG_SPACE(sizeof(struct in_pktinfo))
+                               + NGX_UDP_SEGMENT_CMSG_SPACE];
 #endif
 
 #if (NGX_HAVE_INET6 && NGX_HAVE_IPV6_RECVPKTINFO)
-    u_char         msg_control6[CMSG_SPACE(sizeof(struct in6_pktinfo))];
+    u_char         msg_control6[CMSG_SPACE(sizeof(struct in6_pktinfo))
+                                + NGX_UDP_SEGMENT_CMSG_SPACE];
 #endif
 
 #endif
@@ -246,7 +361,7 @@ ngx_sendmsg(ngx_connection_t *c, ngx_iovec_t *vec)
             struct sockaddr_in  *sin;
 
             msg.msg_control = &msg_control;
-            msg.msg_controllen = sizeof(msg_control);
+            msg.msg_controllen = CMSG_SPACE(sizeof(struct in_addr));
 
             cmsg = CMSG_FIRSTHDR(&msg);
             cmsg->cmsg_level = IPPROTO_IP;
@@ -267,7 +382,7 @@ ngx_sendmsg(ngx_connection_t *c, ngx_iovec_t *vec)
             struct sockaddr_in  *sin;
 
             msg.msg_control = &msg_control;
-            msg.msg_controllen = sizeof(msg_control);
+            msg.msg_controllen = CMSG_SPACE(sizeof(struct in_pktinfo));
 
             cmsg = CMSG_FIRSTHDR(&msg);
             cmsg->cmsg_level = IPPROTO_IP;
@@ -291,7 +406,7 @@ ngx_sendmsg(ngx_connection_t *c, ngx_iovec_t *vec)
             struct sockaddr_in6  *sin6;
 
             msg.msg_control = &msg_control6;
-            msg.msg_controllen = sizeof(msg_control6);
+            msg.msg_controllen = CMSG_SPACE(sizeof(struct in6_pktinfo));
 
             cmsg = CMSG_FIRSTHDR(&msg);
             cmsg->cmsg_level = IPPROTO_IPV6;
@@ -310,16 +425,63 @@ ngx_sendmsg(ngx_connection_t *c, ngx_iovec_t *vec)
 
 #endif
 
+#if (NGX_HAVE_UDP_SEGMENT)
+
+    if (segment) {
+        struct cmsghdr  *cmsg;
+        uint16_t         size;
+
+        if (msg.msg_control == NULL) {
+            msg.msg_control = &msg_control;
+        }
+
+        cmsg = (struct cmsghdr *) ((u_char *) msg.msg_control
+                                   + msg.msg_controllen);
+
+        cmsg->cmsg_level = SOL_UDP;
+        cmsg->cmsg_type = UDP_SEGMENT;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+
+        size = (uint16_t) segment;
+        ngx_memcpy(CMSG_DATA(cmsg), &size, sizeof(uint16_t));
+
+        msg.msg_controllen += CMSG_SPACE(sizeof(uint16_t));
+    }
+
+#endif
+
 eintr:
 
     n = sendmsg(c->fd, &msg, 0);
 
-    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, c->log, 0,
-                   "sendmsg: %z of %uz", n, vec->size);
+    ngx_log_debug3(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "sendmsg: %z of %uz, segment: %uz", n, vec->size, segment);
 
     if (n == -1) {
         err = ngx_errno;
 
+#if (NGX_HAVE_UDP_SEGMENT)
+
+        /*
+         * EIO: the device does not support checksum offload,
+         * EINVAL: the segment does not fit into the path MTU
+         */
+
+        if (segment && (err == NGX_EIO || err == NGX_EINVAL)) {
+
+            if (err == NGX_EIO) {
+                ngx_log_error(NGX_LOG_NOTICE, c->log, err,
+                              "sendmsg() with UDP_SEGMENT failed, "
+                              "segmentation offload disabled");
+
+                ngx_udp_segment_disabled = 1;
+            }
+
+            return NGX_DECLINED;
+        }
+
+#endif
+
         switch (err) {
         case NGX_EAGAIN:
             ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, err,
@@ -407,7 +407,9 @@ ngx_stream_upstream_server(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     ngx_str_t                     *value, s;
     ngx_url_t                      u;
     ngx_int_t                      weight, max_conns, max_fails;
-    ngx_uint_t                     i;
+    ngx_uint_t                     i, j, n, resolve;
+    ngx_addr_t                    *addrs;
+    ngx_sockaddr_t                *sa;
     ngx_stream_upstream_server_t  *us;
 
     us = ngx_array_push(uscf->servers);
@@ -423,6 +425,7 @@ ngx_stream_upstream_server(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     max_conns = 0;
     max_fails = 1;
     fail_timeout = 10;
+    resolve = 0;
 
     for (i = 2; i < cf->args->nelts; i++) {
 
@@ -511,12 +514,18 @@ ngx_stream_upstream_server(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             continue;
         }
 
+        if (ngx_strcmp(value[i].data, "resolve") == 0) {
+            resolve = 1;
+            continue;
+        }
+
         goto invalid;
     }
 
     ngx_memzero(&u, sizeof(ngx_url_t));
 
     u.url = value[1];
+    u.no_resolve = resolve;
 
     if (ngx_parse_url(cf->pool, &u) != NGX_OK) {
         if (u.err) {
@@ -533,6 +542,44 @@ ngx_stream_upstream_server(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         return NGX_CONF_ERROR;
     }
 
+    if (resolve && u.naddrs == 0) {
+
+        /*
+         * the name is re-resolved at run time into a fixed number
+         * of peer slots; addresses known at startup fill the first ones
+         */
+
+        us->resolve = 1;
+        us->host = u.host;
+        us->port = u.port;
+
+        (void) ngx_inet_resolve_host(cf->pool, &u);
+
+        n = ngx_max(u.naddrs, NGX_STREAM_UPSTREAM_RESOLVE_SLOTS);
+
+        addrs = ngx_pcalloc(cf->pool, n * sizeof(ngx_addr_t));
+        if (addrs == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        sa = ngx_pcalloc(cf->pool, sizeof(ngx_sockaddr_t));
+        if (sa == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        for (j = 0; j < n; j++) {
+            if (j < u.naddrs) {
+                addrs[j] = u.addrs[j];
+
+            } else {
+                addrs[j].sockaddr = &sa->sockaddr;
+            }
+        }
+
+        u.addrs = addrs;
+        u.naddrs = n;
+    }
+
     us->name = u.url;
     us->addrs = u.addrs;
     us->naddrs = u.naddrs;
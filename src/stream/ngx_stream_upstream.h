@@ -60,7 +60,11 @@ typedef struct {
     ngx_msec_t                         slow_start;
     ngx_uint_t                         down;
 
+    ngx_str_t                          host;
+    in_port_t                          port;
+
     unsigned                           backup:1;
+    unsigned                           resolve:1;
 
     NGX_COMPAT_BEGIN(4)
     NGX_COMPAT_END
@@ -83,6 +87,8 @@ struct ngx_stream_upstream_srv_conf_s {
 
 #if (NGX_STREAM_UPSTREAM_ZONE)
     ngx_shm_zone_t                    *shm_zone;
+    ngx_resolver_t                    *resolver;
+    ngx_msec_t                         resolver_timeout;
 #endif
 };
 
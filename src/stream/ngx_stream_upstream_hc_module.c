@@ -0,0 +1,954 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event_connect.h>
+#include <ngx_stream.h>
+
+
+typedef struct {
+    ngx_str_t                            name;
+    ngx_str_t                            send;
+    ngx_str_t                            expect;
+#if (NGX_PCRE)
+    ngx_regex_t                         *regex;
+#endif
+} ngx_stream_upstream_hc_match_t;
+
+
+typedef struct {
+    ngx_array_t                          matches;
+} ngx_stream_upstream_hc_main_conf_t;
+
+
+typedef struct {
+    ngx_msec_t                           interval;
+    ngx_msec_t                           timeout;
+    ngx_uint_t                           fails;
+    ngx_uint_t                           passes;
+    in_port_t                            port;
+    ngx_uint_t                           udp;   /* unsigned udp:1; */
+
+    ngx_str_t                            match_name;
+    ngx_stream_upstream_hc_match_t      *match;
+} ngx_stream_upstream_hc_srv_conf_t;
+
+
+typedef struct {
+    ngx_stream_upstream_hc_srv_conf_t   *conf;
+    ngx_stream_upstream_rr_peers_t      *peers;
+    ngx_stream_upstream_rr_peer_t       *peer;
+
+    ngx_event_t                          event;
+    ngx_peer_connection_t                pc;
+
+    ngx_sockaddr_t                       sockaddr;
+    socklen_t                            socklen;
+
+    ngx_pool_t                          *pool;
+    ngx_buf_t                           *buffer;
+    u_char                              *sent;
+    ngx_uint_t                           connected;  /* unsigned connected:1; */
+
+    ngx_uint_t                           fails;
+    ngx_uint_t                           passes;
+} ngx_stream_upstream_hc_peer_t;
+
+
+static void ngx_stream_upstream_hc_handler(ngx_event_t *ev);
+static void ngx_stream_upstream_hc_send_handler(ngx_event_t *wev);
+static void ngx_stream_upstream_hc_read_handler(ngx_event_t *rev);
+static void ngx_stream_upstream_hc_dummy_handler(ngx_event_t *ev);
+static ngx_int_t ngx_stream_upstream_hc_test_connect(ngx_connection_t *c);
+static ngx_int_t ngx_stream_upstream_hc_expect(
+    ngx_stream_upstream_hc_peer_t *hp);
+static void ngx_stream_upstream_hc_finalize(ngx_stream_upstream_hc_peer_t *hp,
+    ngx_uint_t healthy);
+
+static ngx_int_t ngx_stream_upstream_hc_init_process(ngx_cycle_t *cycle);
+static ngx_int_t ngx_stream_upstream_hc_add_peers(ngx_cycle_t *cycle,
+    ngx_stream_upstream_hc_srv_conf_t *hcf,
+    ngx_stream_upstream_rr_peers_t *peers);
+
+static void *ngx_stream_upstream_hc_create_main_conf(ngx_conf_t *cf);
+static char *ngx_stream_upstream_hc_init_main_conf(ngx_conf_t *cf,
+    void *conf);
+static void *ngx_stream_upstream_hc_create_conf(ngx_conf_t *cf);
+static char *ngx_stream_upstream_hc(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static char *ngx_stream_upstream_hc_match_block(ngx_conf_t *cf,
+    ngx_command_t *cmd, void *conf);
+static char *ngx_stream_upstream_hc_match_condition(ngx_conf_t *cf,
+    ngx_command_t *dummy, void *conf);
+
+
+static ngx_command_t  ngx_stream_upstream_hc_commands[] = {
+
+    { ngx_string("health_check"),
+      NGX_STREAM_UPS_CONF|NGX_CONF_ANY,
+      ngx_stream_upstream_hc,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("match"),
+      NGX_STREAM_MAIN_CONF|NGX_CONF_BLOCK|NGX_CONF_TAKE1,
+      ngx_stream_upstream_hc_match_block,
+      NGX_STREAM_MAIN_CONF_OFFSET,
+      0,
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_stream_module_t  ngx_stream_upstream_hc_module_ctx = {
+    NULL,                                  /* preconfiguration */
+    NULL,                                  /* postconfiguration */
+
+    ngx_stream_upstream_hc_create_main_conf, /* create main configuration */
+    ngx_stream_upstream_hc_init_main_conf, /* init main configuration */
+
+    ngx_stream_upstream_hc_create_conf,    /* create server configuration */
+    NULL                                   /* merge server configuration */
+};
+
+
+ngx_module_t  ngx_stream_upstream_hc_module = {
+    NGX_MODULE_V1,
+    &ngx_stream_upstream_hc_module_ctx,    /* module context */
+    ngx_stream_upstream_hc_commands,       /* module directives */
+    NGX_STREAM_MODULE,                     /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    ngx_stream_upstream_hc_init_process,   /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static void
+ngx_stream_upstream_hc_handler(ngx_event_t *ev)
+{
+    ngx_int_t                       rc;
+    ngx_connection_t               *c;
+    ngx_stream_upstream_hc_peer_t  *hp;
+
+    hp = ev->data;
+
+    if (ngx_terminate || ngx_exiting || ngx_quit) {
+        return;
+    }
+
+    /* the address may be changed at run time, see "server ... resolve" */
+
+    ngx_stream_upstream_rr_peers_rlock(hp->peers);
+
+    if (hp->peer->down & NGX_STREAM_UPSTREAM_PEER_UNRESOLVED) {
+        ngx_stream_upstream_rr_peers_unlock(hp->peers);
+        ngx_add_timer(ev, hp->conf->interval);
+        return;
+    }
+
+    ngx_memcpy(&hp->sockaddr, hp->peer->sockaddr, hp->peer->socklen);
+    hp->socklen = hp->peer->socklen;
+
+    ngx_stream_upstream_rr_peers_unlock(hp->peers);
+
+    if (hp->conf->port) {
+        ngx_inet_set_port(&hp->sockaddr.sockaddr, hp->conf->port);
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_STREAM, ev->log, 0,
+                   "health check peer %V", &hp->peer->name);
+
+    hp->pool = ngx_create_pool(1024, ev->log);
+    if (hp->pool == NULL) {
+        goto failed;
+    }
+
+    hp->buffer = ngx_create_temp_buf(hp->pool, ngx_pagesize);
+    if (hp->buffer == NULL) {
+        goto failed;
+    }
+
+    hp->sent = NULL;
+    hp->connected = 0;
+
+    if (hp->conf->match) {
+        hp->sent = hp->conf->match->send.data;
+    }
+
+    ngx_memzero(&hp->pc, sizeof(ngx_peer_connection_t));
+
+    hp->pc.sockaddr = &hp->sockaddr.sockaddr;
+    hp->pc.socklen = hp->socklen;
+    hp->pc.name = &hp->peer->name;
+    hp->pc.get = ngx_event_get_peer;
+    hp->pc.log = ev->log;
+    hp->pc.log_error = NGX_ERROR_INFO;
+    hp->pc.type = hp->conf->udp ? SOCK_DGRAM : SOCK_STREAM;
+
+    rc = ngx_event_connect_peer(&hp->pc);
+
+    if (rc == NGX_ERROR || rc == NGX_BUSY || rc == NGX_DECLINED) {
+        goto failed;
+    }
+
+    c = hp->pc.connection;
+    c->data = hp;
+    c->pool = hp->pool;
+
+    c->write->handler = ngx_stream_upstream_hc_send_handler;
+    c->read->handler = ngx_stream_upstream_hc_read_handler;
+
+    ngx_add_timer(c->read, hp->conf->timeout);
+
+    if (rc == NGX_AGAIN) {
+        return;
+    }
+
+    hp->connected = 1;
+
+    ngx_stream_upstream_hc_send_handler(c->write);
+
+    return;
+
+failed:
+
+    ngx_stream_upstream_hc_finalize(hp, 0);
+}
+
+
+static void
+ngx_stream_upstream_hc_send_handler(ngx_event_t *wev)
+{
+    ssize_t                          n, size;
+    ngx_connection_t                *c;
+    ngx_stream_upstream_hc_match_t  *m;
+    ngx_stream_upstream_hc_peer_t   *hp;
+
+    c = wev->data;
+    hp = c->data;
+    m = hp->conf->match;
+
+    if (!hp->connected) {
+        if (ngx_stream_upstream_hc_test_connect(c) != NGX_OK) {
+            ngx_stream_upstream_hc_finalize(hp, 0);
+            return;
+        }
+
+        hp->connected = 1;
+    }
+
+    size = m ? m->send.data + m->send.len - hp->sent : 0;
+
+    while (size > 0) {
+        n = c->send(c, hp->sent, size);
+
+        if (n == NGX_ERROR) {
+            ngx_stream_upstream_hc_finalize(hp, 0);
+            return;
+        }
+
+        if (n == NGX_AGAIN) {
+            if (ngx_handle_write_event(wev, 0) != NGX_OK) {
+                ngx_stream_upstream_hc_finalize(hp, 0);
+            }
+
+            return;
+        }
+
+        hp->sent += n;
+        size -= n;
+    }
+
+    if (m == NULL || m->expect.len == 0) {
+        ngx_stream_upstream_hc_finalize(hp, 1);
+        return;
+    }
+
+    wev->handler = ngx_stream_upstream_hc_dummy_handler;
+
+    if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+        ngx_stream_upstream_hc_finalize(hp, 0);
+        return;
+    }
+
+    if (c->read->ready) {
+        ngx_stream_upstream_hc_read_handler(c->read);
+    }
+}
+
+
+static void
+ngx_stream_upstream_hc_read_handler(ngx_event_t *rev)
+{
+    ssize_t                         n;
+    ngx_int_t                       rc;
+    ngx_buf_t                      *b;
+    ngx_connection_t               *c;
+    ngx_stream_upstream_hc_peer_t  *hp;
+
+    c = rev->data;
+    hp = c->data;
+
+    if (rev->timedout) {
+        ngx_log_error(NGX_LOG_INFO, c->log, NGX_ETIMEDOUT,
+                      "health check of peer %V in upstream \"%V\" timed out",
+                      &hp->peer->name, hp->peers->name);
+        ngx_stream_upstream_hc_finalize(hp, 0);
+        return;
+    }
+
+    b = hp->buffer;
+
+    for ( ;; ) {
+
+        if (b->last == b->end) {
+            rc = NGX_DECLINED;
+            break;
+        }
+
+        n = c->recv(c, b->last, b->end - b->last);
+
+        if (n == NGX_AGAIN) {
+            if (ngx_handle_read_event(rev, 0) != NGX_OK) {
+                ngx_stream_upstream_hc_finalize(hp, 0);
+            }
+
+            return;
+        }
+
+        if (n == NGX_ERROR || n == 0) {
+            rc = NGX_ERROR;
+            break;
+        }
+
+        b->last += n;
+
+        rc = ngx_stream_upstream_hc_expect(hp);
+
+        if (rc == NGX_AGAIN && c->type == SOCK_STREAM) {
+            continue;
+        }
+
+        break;
+    }
+
+    ngx_stream_upstream_hc_finalize(hp, rc == NGX_OK);
+}
+
+
+static void
+ngx_stream_upstream_hc_dummy_handler(ngx_event_t *ev)
+{
+    ngx_log_debug0(NGX_LOG_DEBUG_STREAM, ev->log, 0,
+                   "health check dummy handler");
+}
+
+
+static ngx_int_t
+ngx_stream_upstream_hc_test_connect(ngx_connection_t *c)
+{
+    int        err;
+    socklen_t  len;
+
+#if (NGX_HAVE_KQUEUE)
+
+    if (ngx_event_flags & NGX_USE_KQUEUE_EVENT)  {
+        err = c->write->kq_errno ? c->write->kq_errno : c->read->kq_errno;
+
+        if (err) {
+            (void) ngx_connection_error(c, err,
+                                    "kevent() reported that connect() failed");
+            return NGX_ERROR;
+        }
+
+    } else
+#endif
+    {
+        err = 0;
+        len = sizeof(int);
+
+        if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, (void *) &err, &len)
+            == -1)
+        {
+            err = ngx_socket_errno;
+        }
+
+        if (err) {
+            (void) ngx_connection_error(c, err, "connect() failed");
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_stream_upstream_hc_expect(ngx_stream_upstream_hc_peer_t *hp)
+{
+    u_char                          *p, *last;
+    ngx_buf_t                       *b;
+    ngx_stream_upstream_hc_match_t  *m;
+#if (NGX_PCRE)
+    ngx_int_t                        rc;
+    ngx_str_t                        s;
+#endif
+
+    b = hp->buffer;
+    m = hp->conf->match;
+
+#if (NGX_PCRE)
+
+    if (m->regex) {
+        s.data = b->pos;
+        s.len = b->last - b->pos;
+
+        rc = ngx_regex_exec(m->regex, &s, NULL, 0);
+
+        if (rc >= 0) {
+            return NGX_OK;
+        }
+
+        if (rc != NGX_REGEX_NO_MATCHED) {
+            ngx_log_error(NGX_LOG_ALERT, hp->pc.log, 0,
+                          ngx_regex_exec_n " failed: %i on response", rc);
+            return NGX_ERROR;
+        }
+
+        return NGX_AGAIN;
+    }
+
+#endif
+
+    if ((size_t) (b->last - b->pos) < m->expect.len) {
+        return NGX_AGAIN;
+    }
+
+    last = b->last - m->expect.len;
+
+    for (p = b->pos; p <= last; p++) {
+        if (ngx_memcmp(p, m->expect.data, m->expect.len) == 0) {
+            return NGX_OK;
+        }
+    }
+
+    return NGX_AGAIN;
+}
+
+
+static void
+ngx_stream_upstream_hc_finalize(ngx_stream_upstream_hc_peer_t *hp,
+    ngx_uint_t healthy)
+{
+    ngx_stream_upstream_rr_peer_t      *peer;
+    ngx_stream_upstream_rr_peers_t     *peers;
+    ngx_stream_upstream_hc_srv_conf_t  *hcf;
+
+    hcf = hp->conf;
+    peers = hp->peers;
+    peer = hp->peer;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_STREAM, hp->event.log, 0,
+                   "health check peer %V result: %ui",
+                   &peer->name, healthy);
+
+    if (hp->pc.connection) {
+        ngx_close_connection(hp->pc.connection);
+        hp->pc.connection = NULL;
+    }
+
+    if (hp->pool) {
+        ngx_destroy_pool(hp->pool);
+        hp->pool = NULL;
+    }
+
+    if (healthy) {
+        hp->fails = 0;
+
+        if (++hp->passes >= hcf->passes) {
+            ngx_stream_upstream_rr_peers_wlock(peers);
+
+            if (peer->down & NGX_STREAM_UPSTREAM_PEER_UNHEALTHY) {
+                peer->down &= ~NGX_STREAM_UPSTREAM_PEER_UNHEALTHY;
+                peer->fails = 0;
+
+                ngx_log_error(NGX_LOG_NOTICE, hp->event.log, 0,
+                              "peer %V in upstream \"%V\" is healthy",
+                              &peer->name, peers->name);
+            }
+
+            ngx_stream_upstream_rr_peers_unlock(peers);
+        }
+
+    } else {
+        hp->passes = 0;
+
+        if (++hp->fails >= hcf->fails) {
+            ngx_stream_upstream_rr_peers_wlock(peers);
+
+            if (!(peer->down & NGX_STREAM_UPSTREAM_PEER_UNHEALTHY)) {
+                peer->down |= NGX_STREAM_UPSTREAM_PEER_UNHEALTHY;
+
+                ngx_log_error(NGX_LOG_WARN, hp->event.log, 0,
+                              "peer %V in upstream \"%V\" is unhealthy",
+                              &peer->name, peers->name);
+            }
+
+            ngx_stream_upstream_rr_peers_unlock(peers);
+        }
+    }
+
+    if (ngx_terminate || ngx_exiting || ngx_quit) {
+        return;
+    }
+
+    ngx_add_timer(&hp->event, hcf->interval);
+}
+
+
+static ngx_int_t
+ngx_stream_upstream_hc_init_process(ngx_cycle_t *cycle)
+{
+    ngx_uint_t                           i;
+    ngx_stream_upstream_rr_peers_t      *peers;
+    ngx_stream_upstream_hc_srv_conf_t   *hcf;
+    ngx_stream_upstream_srv_conf_t     **uscfp;
+    ngx_stream_upstream_main_conf_t     *umcf;
+
+    /* probes are sent by the first worker only */
+
+    if ((ngx_process != NGX_PROCESS_WORKER
+         && ngx_process != NGX_PROCESS_SINGLE)
+        || ngx_worker != 0)
+    {
+        return NGX_OK;
+    }
+
+    umcf = ngx_stream_cycle_get_module_main_conf(cycle,
+                                                 ngx_stream_upstream_module);
+
+    if (umcf == NULL) {
+        return NGX_OK;
+    }
+
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+
+        if (uscfp[i]->srv_conf == NULL || uscfp[i]->shm_zone == NULL) {
+            continue;
+        }
+
+        hcf = ngx_stream_conf_upstream_srv_conf(uscfp[i],
+                                                ngx_stream_upstream_hc_module);
+
+        if (hcf->interval == 0) {
+            continue;
+        }
+
+        for (peers = uscfp[i]->peer.data; peers; peers = peers->next) {
+            if (ngx_stream_upstream_hc_add_peers(cycle, hcf, peers) != NGX_OK)
+            {
+                return NGX_ERROR;
+            }
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_stream_upstream_hc_add_peers(ngx_cycle_t *cycle,
+    ngx_stream_upstream_hc_srv_conf_t *hcf,
+    ngx_stream_upstream_rr_peers_t *peers)
+{
+    ngx_stream_upstream_rr_peer_t  *peer;
+    ngx_stream_upstream_hc_peer_t  *hp;
+
+    for (peer = peers->peer; peer; peer = peer->next) {
+
+        hp = ngx_pcalloc(cycle->pool, sizeof(ngx_stream_upstream_hc_peer_t));
+        if (hp == NULL) {
+            return NGX_ERROR;
+        }
+
+        hp->conf = hcf;
+        hp->peers = peers;
+        hp->peer = peer;
+
+        hp->event.handler = ngx_stream_upstream_hc_handler;
+        hp->event.data = hp;
+        hp->event.log = cycle->log;
+        hp->event.cancelable = 1;
+
+        ngx_add_timer(&hp->event, 0);
+    }
+
+    return NGX_OK;
+}
+
+
+static void *
+ngx_stream_upstream_hc_create_main_conf(ngx_conf_t *cf)
+{
+    ngx_stream_upstream_hc_main_conf_t  *hmcf;
+
+    hmcf = ngx_pcalloc(cf->pool, sizeof(ngx_stream_upstream_hc_main_conf_t));
+    if (hmcf == NULL) {
+        return NULL;
+    }
+
+    if (ngx_array_init(&hmcf->matches, cf->pool, 4,
+                       sizeof(ngx_stream_upstream_hc_match_t))
+        != NGX_OK)
+    {
+        return NULL;
+    }
+
+    return hmcf;
+}
+
+
+static char *
+ngx_stream_upstream_hc_init_main_conf(ngx_conf_t *cf, void *conf)
+{
+    ngx_stream_upstream_hc_main_conf_t  *hmcf = conf;
+
+    ngx_uint_t                            i, j;
+    ngx_stream_upstream_hc_match_t       *m;
+    ngx_stream_upstream_srv_conf_t      **uscfp;
+    ngx_stream_upstream_hc_srv_conf_t    *hcf;
+    ngx_stream_upstream_main_conf_t      *umcf;
+
+    umcf = ngx_stream_conf_get_module_main_conf(cf,
+                                                ngx_stream_upstream_module);
+
+    uscfp = umcf->upstreams.elts;
+    m = hmcf->matches.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+
+        if (uscfp[i]->srv_conf == NULL) {
+            continue;
+        }
+
+        hcf = ngx_stream_conf_upstream_srv_conf(uscfp[i],
+                                                ngx_stream_upstream_hc_module);
+
+        if (hcf->interval == 0) {
+            continue;
+        }
+
+        if (uscfp[i]->shm_zone == NULL) {
+            ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                          "health check requires \"zone\" in upstream \"%V\" "
+                          "in %s:%ui",
+                          &uscfp[i]->host, uscfp[i]->file_name,
+                          uscfp[i]->line);
+            return NGX_CONF_ERROR;
+        }
+
+        if (hcf->match_name.len) {
+
+            for (j = 0; j < hmcf->matches.nelts; j++) {
+                if (m[j].name.len == hcf->match_name.len
+                    && ngx_strncmp(m[j].name.data, hcf->match_name.data,
+                                   hcf->match_name.len)
+                       == 0)
+                {
+                    hcf->match = &m[j];
+                    break;
+                }
+            }
+
+            if (hcf->match == NULL) {
+                ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                              "match \"%V\" not found for upstream \"%V\" "
+                              "in %s:%ui",
+                              &hcf->match_name, &uscfp[i]->host,
+                              uscfp[i]->file_name, uscfp[i]->line);
+                return NGX_CONF_ERROR;
+            }
+        }
+
+        if (hcf->udp && (hcf->match == NULL || hcf->match->send.len == 0
+                         || hcf->match->expect.len == 0))
+        {
+            ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                          "udp health check requires match with \"send\" "
+                          "and \"expect\" in upstream \"%V\" in %s:%ui",
+                          &uscfp[i]->host, uscfp[i]->file_name,
+                          uscfp[i]->line);
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static void *
+ngx_stream_upstream_hc_create_conf(ngx_conf_t *cf)
+{
+    ngx_stream_upstream_hc_srv_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_stream_upstream_hc_srv_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     conf->interval = 0;
+     *     conf->port = 0;
+     *     conf->udp = 0;
+     *     conf->match_name = { 0, NULL };
+     *     conf->match = NULL;
+     */
+
+    return conf;
+}
+
+
+static char *
+ngx_stream_upstream_hc(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_stream_upstream_hc_srv_conf_t  *hcf = conf;
+
+    ngx_int_t    n;
+    ngx_str_t   *value, s;
+    ngx_uint_t   i;
+
+    if (hcf->interval) {
+        return "is duplicate";
+    }
+
+    hcf->interval = 5000;
+    hcf->timeout = 1000;
+    hcf->fails = 1;
+    hcf->passes = 1;
+
+    value = cf->args->elts;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "interval=", 9) == 0) {
+            s.len = value[i].len - 9;
+            s.data = &value[i].data[9];
+
+            hcf->interval = ngx_parse_time(&s, 0);
+            if (hcf->interval == (ngx_msec_t) NGX_ERROR
+                || hcf->interval == 0)
+            {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "timeout=", 8) == 0) {
+            s.len = value[i].len - 8;
+            s.data = &value[i].data[8];
+
+            hcf->timeout = ngx_parse_time(&s, 0);
+            if (hcf->timeout == (ngx_msec_t) NGX_ERROR || hcf->timeout == 0) {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "fails=", 6) == 0) {
+            n = ngx_atoi(&value[i].data[6], value[i].len - 6);
+            if (n == NGX_ERROR || n == 0) {
+                goto invalid;
+            }
+
+            hcf->fails = n;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "passes=", 7) == 0) {
+            n = ngx_atoi(&value[i].data[7], value[i].len - 7);
+            if (n == NGX_ERROR || n == 0) {
+                goto invalid;
+            }
+
+            hcf->passes = n;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "port=", 5) == 0) {
+            n = ngx_atoi(&value[i].data[5], value[i].len - 5);
+            if (n < 1 || n > 65535) {
+                goto invalid;
+            }
+
+            hcf->port = (in_port_t) n;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "match=", 6) == 0) {
+            hcf->match_name.len = value[i].len - 6;
+            hcf->match_name.data = &value[i].data[6];
+
+            if (hcf->match_name.len == 0) {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "udp") == 0) {
+            hcf->udp = 1;
+            continue;
+        }
+
+        goto invalid;
+    }
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+
+    return NGX_CONF_ERROR;
+}
+
+
+static char *
+ngx_stream_upstream_hc_match_block(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+    ngx_stream_upstream_hc_main_conf_t  *hmcf = conf;
+
+    char                            *rv;
+    ngx_str_t                       *value;
+    ngx_uint_t                       i;
+    ngx_conf_t                       save;
+    ngx_stream_upstream_hc_match_t  *m;
+
+    value = cf->args->elts;
+    m = hmcf->matches.elts;
+
+    for (i = 0; i < hmcf->matches.nelts; i++) {
+        if (m[i].name.len == value[1].len
+            && ngx_strncmp(m[i].name.data, value[1].data, value[1].len) == 0)
+        {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "duplicate match \"%V\"", &value[1]);
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    m = ngx_array_push(&hmcf->matches);
+    if (m == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_memzero(m, sizeof(ngx_stream_upstream_hc_match_t));
+
+    m->name = value[1];
+
+    save = *cf;
+    cf->handler = ngx_stream_upstream_hc_match_condition;
+    cf->handler_conf = (char *) m;
+
+    rv = ngx_conf_parse(cf, NULL);
+
+    *cf = save;
+
+    return rv;
+}
+
+
+static char *
+ngx_stream_upstream_hc_match_condition(ngx_conf_t *cf, ngx_command_t *dummy,
+    void *conf)
+{
+    ngx_stream_upstream_hc_match_t  *m = conf;
+
+    ngx_str_t  *value;
+#if (NGX_PCRE)
+    u_char               errstr[NGX_MAX_CONF_ERRSTR];
+    ngx_regex_compile_t  rc;
+#endif
+
+    value = cf->args->elts;
+
+    if (cf->args->nelts == 2 && ngx_strcmp(value[0].data, "send") == 0) {
+
+        if (m->send.data) {
+            return "is duplicate";
+        }
+
+        m->send = value[1];
+        return NGX_CONF_OK;
+    }
+
+    if (ngx_strcmp(value[0].data, "expect") != 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid match condition \"%V\"", &value[0]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (m->expect.data) {
+        return "is duplicate";
+    }
+
+    if (cf->args->nelts == 2 && value[1].len) {
+        m->expect = value[1];
+        return NGX_CONF_OK;
+    }
+
+    if (cf->args->nelts != 3
+        || value[1].len != 1 || value[1].data[0] != '~'
+        || value[2].len == 0)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid \"expect\" condition");
+        return NGX_CONF_ERROR;
+    }
+
+#if (NGX_PCRE)
+
+    ngx_memzero(&rc, sizeof(ngx_regex_compile_t));
+
+    rc.pattern = value[2];
+    rc.pool = cf->pool;
+    rc.err.len = NGX_MAX_CONF_ERRSTR;
+    rc.err.data = errstr;
+
+    if (ngx_regex_compile(&rc) != NGX_OK) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "%V", &rc.err);
+        return NGX_CONF_ERROR;
+    }
+
+    m->expect = value[2];
+    m->regex = rc.regex;
+
+    return NGX_CONF_OK;
+
+#else
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "using regex \"%V\" requires PCRE library", &value[2]);
+    return NGX_CONF_ERROR;
+
+#endif
+}
@@ -54,6 +54,12 @@ struct ngx_stream_upstream_rr_peer_s {
 };
 
 
+#define NGX_STREAM_UPSTREAM_PEER_UNHEALTHY  0x02
+#define NGX_STREAM_UPSTREAM_PEER_UNRESOLVED 0x04
+
+#define NGX_STREAM_UPSTREAM_RESOLVE_SLOTS   16
+
+
 typedef struct ngx_stream_upstream_rr_peers_s  ngx_stream_upstream_rr_peers_t;
 
 struct ngx_stream_upstream_rr_peers_s {